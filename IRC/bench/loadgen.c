@@ -0,0 +1,1021 @@
+/*
+ *
+ *  chirc-loadgen: a load generator for chirc
+ *
+ *  Opens many client connections, registers them, joins them to a set of
+ *  channels and then drives an open-loop mix of channel PRIVMSGs, private
+ *  PRIVMSGs and JOIN/PART churn at a fixed rate. Every PRIVMSG carries the
+ *  CLOCK_MONOTONIC time it was queued, so receivers can measure end-to-end
+ *  delivery latency. The load generator must therefore run on the same
+ *  host as the server.
+ *
+ *  Each worker thread owns a slice of the connections and multiplexes
+ *  them with epoll. Results are printed as a human-readable report or,
+ *  with -J, as a single JSON object for regression scripts.
+ *
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <time.h>
+#include <pthread.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/un.h>
+
+#include "../lib/sds/sds.h"
+
+#define LG_SUB_BITS 4
+#define LG_SUB_BUCKETS (1 << LG_SUB_BITS)     /* Histogram precision ~6% */
+#define LG_BUCKETS (LG_SUB_BUCKETS * 61)
+#define LG_MAX_EVENTS 256
+#define LG_READ_CHUNK 16384
+#define LG_MARKER " :LG "                      /* Precedes the timestamp in payloads */
+
+/* Command line configuration, read-only once the workers start */
+typedef struct lg_config
+{
+    char *host;
+    char *port;
+    char *nick;             /* Nick prefix, followed by the connection number */
+    int connections;
+    int threads;
+    int channels;
+    int joins;              /* Channels joined by each connection */
+    bool zipf;              /* Zipf instead of uniform channel popularity */
+    double rate;            /* Operations per second per connection */
+    int pct_channel;        /* Share of channel PRIVMSGs in the mix */
+    int pct_private;        /* Share of private PRIVMSGs, the rest is JOIN/PART */
+    int payload;            /* Extra payload bytes per PRIVMSG */
+    double duration;        /* Seconds of measured load */
+    double warmup;          /* Seconds of load before measuring */
+    double drain;           /* Seconds to wait for deliveries after the load stops */
+    double setup_timeout;   /* Seconds allowed for registration and joins */
+    char *stats_socket;     /* Server's stats socket, to count its system calls */
+    bool json;
+} lg_config;
+
+/* Log-linear latency histogram, in nanoseconds */
+typedef struct lg_hist
+{
+    uint64_t buckets[LG_BUCKETS];
+    uint64_t count;
+    uint64_t max;
+    double sum;
+} lg_hist;
+
+typedef struct lg_conn
+{
+    int fd;
+    unsigned int id;
+    sds inbuf;
+    sds outbuf;
+    bool want_write;        /* EPOLLOUT is armed */
+    bool registered;        /* RPL_WELCOME received */
+    bool closed;            /* The server closed the connection */
+    int *chans;             /* Indices of the channels joined */
+    bool *joined;           /* Whether the JOIN of each entry of chans completed */
+    int pending_joins;      /* JOINs not yet answered by RPL_ENDOFNAMES */
+} lg_conn;
+
+typedef struct lg_worker
+{
+    pthread_t tid;
+    int index;
+    lg_conn *conns;
+    int nconns;
+    int epfd;
+    uint64_t rng;
+    bool failed;
+    bool quitting;          /* QUIT was sent, connections are expected to close */
+    int closed;
+    /* Results */
+    uint64_t sent_channel;
+    uint64_t sent_private;
+    uint64_t sent_churn;
+    uint64_t delivered;
+    uint64_t errors;
+    lg_hist hist;
+} lg_worker;
+
+static lg_config cfg;
+static double *chan_cdf;            /* Cumulative channel popularity */
+static struct addrinfo *server_addr;
+static pthread_barrier_t setup_done, start_gate;
+static uint64_t run_start, measure_start, run_end;
+static long long syscalls_start = -1, syscalls_end = -1;  /* Server's counter around the measurement */
+
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+
+static uint64_t rng_next(uint64_t *state)
+{
+    /* xorshift64* */
+    uint64_t x = *state;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    *state = x;
+    return x * 0x2545F4914F6CDD1DULL;
+}
+
+
+static double rng_unit(uint64_t *state)
+{
+    return (rng_next(state) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+
+static int hist_index(uint64_t v)
+{
+    if (v < LG_SUB_BUCKETS)
+    {
+        return (int)v;
+    }
+    int msb = 63 - __builtin_clzll(v);
+    int shift = msb - LG_SUB_BITS;
+    return (shift + 1) * LG_SUB_BUCKETS + (int)((v >> shift) & (LG_SUB_BUCKETS - 1));
+}
+
+
+static uint64_t hist_value(int index)
+{
+    /* Lower bound of the bucket */
+    if (index < LG_SUB_BUCKETS)
+    {
+        return index;
+    }
+    int shift = index / LG_SUB_BUCKETS - 1;
+    return (uint64_t)(LG_SUB_BUCKETS + index % LG_SUB_BUCKETS) << shift;
+}
+
+
+static void hist_record(lg_hist *h, uint64_t v)
+{
+    h->buckets[hist_index(v)]++;
+    h->count++;
+    h->sum += v;
+    if (v > h->max)
+    {
+        h->max = v;
+    }
+}
+
+
+static void hist_merge(lg_hist *into, lg_hist *from)
+{
+    for (int i = 0; i < LG_BUCKETS; i++)
+    {
+        into->buckets[i] += from->buckets[i];
+    }
+    into->count += from->count;
+    into->sum += from->sum;
+    if (from->max > into->max)
+    {
+        into->max = from->max;
+    }
+}
+
+
+static double hist_percentile_us(lg_hist *h, double pct)
+{
+    if (h->count == 0)
+    {
+        return 0;
+    }
+    uint64_t rank = (uint64_t)ceil(h->count * pct / 100.0);
+    uint64_t seen = 0;
+    for (int i = 0; i < LG_BUCKETS; i++)
+    {
+        seen += h->buckets[i];
+        if (seen >= rank && h->buckets[i] > 0)
+        {
+            uint64_t v = hist_value(i);
+            return (v > h->max ? h->max : v) / 1000.0;
+        }
+    }
+    return h->max / 1000.0;
+}
+
+
+static int pick_channel(uint64_t *rng)
+{
+    /* Binary search of the popularity CDF */
+    double u = rng_unit(rng);
+    int lo = 0, hi = cfg.channels - 1;
+
+    while (lo < hi)
+    {
+        int mid = (lo + hi) / 2;
+        if (chan_cdf[mid] < u)
+        {
+            lo = mid + 1;
+        }
+        else
+        {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+
+static bool in_channel(lg_conn *c, int chan, int count)
+{
+    for (int i = 0; i < count; i++)
+    {
+        if (c->chans[i] == chan)
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+
+static int pick_new_channel(lg_conn *c, int count, uint64_t *rng)
+{
+    /* A channel the connection is not in. Popular channels may take a few
+     * tries with the Zipf distribution, so fall back to a linear scan. */
+    for (int tries = 0; tries < 32; tries++)
+    {
+        int chan = pick_channel(rng);
+        if (!in_channel(c, chan, count))
+        {
+            return chan;
+        }
+    }
+    for (int chan = 0; chan < cfg.channels; chan++)
+    {
+        if (!in_channel(c, chan, count))
+        {
+            return chan;
+        }
+    }
+    return -1;
+}
+
+
+static void conn_flush(lg_worker *w, lg_conn *c)
+{
+    /*
+     * conn_flush - Write as much of the output buffer as the socket takes,
+     * and wait for EPOLLOUT if some is left
+     */
+    size_t off = 0, len = sdslen(c->outbuf);
+
+    while (off < len)
+    {
+        ssize_t n = send(c->fd, c->outbuf + off, len - off, MSG_NOSIGNAL);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+            {
+                w->errors++;
+                off = len;
+            }
+            break;
+        }
+        off += n;
+    }
+    sdsrange(c->outbuf, off, -1);
+
+    bool want_write = sdslen(c->outbuf) > 0;
+    if (want_write != c->want_write)
+    {
+        struct epoll_event ev = {.events = EPOLLIN | (want_write ? EPOLLOUT : 0),
+                                 .data.ptr = c};
+        epoll_ctl(w->epfd, EPOLL_CTL_MOD, c->fd, &ev);
+        c->want_write = want_write;
+    }
+}
+
+
+static void conn_queue_privmsg(lg_conn *c, const char *target, int index)
+{
+    c->outbuf = sdscatprintf(c->outbuf, "PRIVMSG %s%d" LG_MARKER "%llu %u",
+                             target, index, (unsigned long long)now_ns(), c->id);
+    if (cfg.payload > 0)
+    {
+        c->outbuf = sdscat(c->outbuf, " ");
+        size_t len = sdslen(c->outbuf);
+        c->outbuf = sdsgrowzero(c->outbuf, len + cfg.payload);
+        memset(c->outbuf + len, 'x', cfg.payload);
+    }
+    c->outbuf = sdscatlen(c->outbuf, "\r\n", 2);
+}
+
+
+static void handle_line(lg_worker *w, lg_conn *c, char *line, uint64_t now)
+{
+    /*
+     * handle_line - Process one line received from the server
+     *
+     * Lines carrying a timestamp are deliveries, numerics track registration
+     * and JOIN completion, and error numerics are counted.
+     */
+    char *marker = strstr(line, LG_MARKER);
+
+    if (marker != NULL && strstr(line, " PRIVMSG ") != NULL)
+    {
+        uint64_t sent = strtoull(marker + strlen(LG_MARKER), NULL, 10);
+        if (sent >= measure_start && sent < run_end)
+        {
+            w->delivered++;
+            hist_record(&w->hist, now > sent ? now - sent : 0);
+        }
+        return;
+    }
+
+    char *cmd = strchr(line, ' ');
+    if (line[0] != ':' || cmd == NULL)
+    {
+        if (!strncmp(line, "ERROR", 5))
+        {
+            w->errors++;
+        }
+        return;
+    }
+    cmd++;
+
+    if (!strncmp(cmd, "001 ", 4))
+    {
+        c->registered = true;
+    }
+    else if (!strncmp(cmd, "366 ", 4))
+    {
+        char *chan = strstr(cmd, " #lg");
+        for (int i = 0; chan != NULL && i < cfg.joins; i++)
+        {
+            if (c->chans[i] == atoi(chan + 4) && !c->joined[i])
+            {
+                c->joined[i] = true;
+                c->pending_joins--;
+                break;
+            }
+        }
+    }
+    else if ((cmd[0] == '4' || cmd[0] == '5') && cmd[3] == ' ' && strncmp(cmd, "422 ", 4))
+    {
+        w->errors++;
+    }
+}
+
+
+static int conn_read(lg_worker *w, lg_conn *c)
+{
+    /*
+     * conn_read - Read everything available and process complete lines
+     *
+     * Return: 0, or -1 if the server closed the connection
+     */
+    char buf[LG_READ_CHUNK];
+
+    for (;;)
+    {
+        ssize_t n = recv(c->fd, buf, sizeof buf, 0);
+        if (n == 0)
+        {
+            return -1;
+        }
+        if (n < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+            {
+                break;
+            }
+            return -1;
+        }
+        c->inbuf = sdscatlen(c->inbuf, buf, n);
+    }
+
+    uint64_t now = now_ns();
+    size_t start = 0, len = sdslen(c->inbuf);
+    char *eol;
+
+    while ((eol = memchr(c->inbuf + start, '\n', len - start)) != NULL)
+    {
+        *eol = '\0';
+        if (eol > c->inbuf + start && eol[-1] == '\r')
+        {
+            eol[-1] = '\0';
+        }
+        handle_line(w, c, c->inbuf + start, now);
+        start = eol - c->inbuf + 1;
+    }
+    sdsrange(c->inbuf, start, -1);
+
+    return 0;
+}
+
+
+static int poll_once(lg_worker *w, int timeout_ms)
+{
+    /*
+     * poll_once - Wait for socket events and service them
+     *
+     * Return: 0, or -1 if a connection was lost
+     */
+    struct epoll_event events[LG_MAX_EVENTS];
+    int rc = 0;
+    int n = epoll_wait(w->epfd, events, LG_MAX_EVENTS, timeout_ms);
+
+    for (int i = 0; i < n; i++)
+    {
+        lg_conn *c = events[i].data.ptr;
+
+        if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+        {
+            if (conn_read(w, c) == -1)
+            {
+                epoll_ctl(w->epfd, EPOLL_CTL_DEL, c->fd, NULL);
+                c->closed = true;
+                w->closed++;
+                if (!w->quitting)
+                {
+                    w->errors++;
+                    rc = -1;
+                }
+                continue;
+            }
+        }
+        if (events[i].events & EPOLLOUT)
+        {
+            conn_flush(w, c);
+        }
+    }
+
+    return rc;
+}
+
+
+static bool wait_setup(lg_worker *w, bool (*done)(lg_conn *), const char *what)
+{
+    /*
+     * wait_setup - Service the connections until done() holds for all of
+     * them, or the setup timeout expires
+     */
+    uint64_t deadline = now_ns() + (uint64_t)(cfg.setup_timeout * 1e9);
+    int next = 0;
+
+    while (next < w->nconns)
+    {
+        if (done(&w->conns[next]))
+        {
+            next++;
+            continue;
+        }
+        if (now_ns() > deadline || poll_once(w, 10) == -1)
+        {
+            fprintf(stderr, "ERROR: %s did not complete (thread %d, %d/%d connections done)\n",
+                    what, w->index, next, w->nconns);
+            return false;
+        }
+    }
+    return true;
+}
+
+
+static bool is_registered(lg_conn *c)
+{
+    return c->registered;
+}
+
+
+static bool is_joined(lg_conn *c)
+{
+    return c->pending_joins <= 0;
+}
+
+
+static int connect_all(lg_worker *w)
+{
+    for (int i = 0; i < w->nconns; i++)
+    {
+        lg_conn *c = &w->conns[i];
+        int one = 1;
+
+        c->fd = socket(server_addr->ai_family, server_addr->ai_socktype, server_addr->ai_protocol);
+        if (c->fd == -1 || connect(c->fd, server_addr->ai_addr, server_addr->ai_addrlen) == -1)
+        {
+            perror("Could not connect to server");
+            return -1;
+        }
+        setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof one);
+        fcntl(c->fd, F_SETFL, fcntl(c->fd, F_GETFL) | O_NONBLOCK);
+
+        struct epoll_event ev = {.events = EPOLLIN, .data.ptr = c};
+        epoll_ctl(w->epfd, EPOLL_CTL_ADD, c->fd, &ev);
+
+        c->outbuf = sdscatprintf(c->outbuf, "NICK %s%u\r\nUSER %s%u * * :chirc load generator\r\n",
+                                 cfg.nick, c->id, cfg.nick, c->id);
+        conn_flush(w, c);
+    }
+    return 0;
+}
+
+
+static void join_all(lg_worker *w)
+{
+    for (int i = 0; i < w->nconns; i++)
+    {
+        lg_conn *c = &w->conns[i];
+
+        for (int j = 0; j < cfg.joins; j++)
+        {
+            c->chans[j] = pick_new_channel(c, j, &w->rng);
+            c->joined[j] = false;
+            c->outbuf = sdscatprintf(c->outbuf, "JOIN #lg%d\r\n", c->chans[j]);
+            c->pending_joins++;
+        }
+        conn_flush(w, c);
+    }
+}
+
+
+static void run_operation(lg_worker *w, lg_conn *c)
+{
+    /*
+     * run_operation - Queue one operation of the configured mix
+     */
+    int dice = (int)(rng_unit(&w->rng) * 100);
+    int slot = (int)(rng_unit(&w->rng) * (cfg.joins ? cfg.joins : 1));
+
+    if (c->closed)
+    {
+        return;
+    }
+
+    /* Only send to channels whose JOIN completed, so the message is delivered */
+    if (cfg.joins > 0 && !c->joined[slot])
+    {
+        slot = (slot + 1) % cfg.joins;
+    }
+
+    if (dice >= cfg.pct_channel + cfg.pct_private && cfg.joins > 0
+        && cfg.joins < cfg.channels && c->pending_joins <= 0)
+    {
+        /* Churn: leave one channel and join another */
+        int chan = pick_new_channel(c, cfg.joins, &w->rng);
+        c->outbuf = sdscatprintf(c->outbuf, "PART #lg%d\r\nJOIN #lg%d\r\n", c->chans[slot], chan);
+        c->chans[slot] = chan;
+        c->joined[slot] = false;
+        c->pending_joins++;
+        w->sent_churn++;
+    }
+    else if (dice < cfg.pct_channel && cfg.joins > 0 && c->joined[slot])
+    {
+        conn_queue_privmsg(c, "#lg", c->chans[slot]);
+        w->sent_channel++;
+    }
+    else
+    {
+        unsigned int to = (unsigned int)(rng_unit(&w->rng) * cfg.connections);
+        if (to == c->id && cfg.connections > 1)
+        {
+            to = (to + 1) % cfg.connections;
+        }
+        conn_queue_privmsg(c, cfg.nick, to);
+        w->sent_private++;
+    }
+    conn_flush(w, c);
+}
+
+
+static void *worker_main(void *arg)
+{
+    lg_worker *w = arg;
+    bool ok;
+
+    w->epfd = epoll_create1(0);
+    ok = connect_all(w) == 0 && wait_setup(w, is_registered, "Registration");
+    if (ok)
+    {
+        join_all(w);
+        ok = wait_setup(w, is_joined, "JOIN");
+    }
+    w->failed = !ok;
+
+    /* The main thread sets the clock between the two barriers */
+    pthread_barrier_wait(&setup_done);
+    pthread_barrier_wait(&start_gate);
+
+    if (run_start == 0)
+    {
+        return NULL;
+    }
+
+    /* Open loop: the schedule does not slow down if the server does */
+    double rate = cfg.rate * w->nconns;
+    uint64_t issued = 0;
+    int next = 0;
+
+    for (;;)
+    {
+        uint64_t now = now_ns();
+        if (now >= run_end)
+        {
+            break;
+        }
+        uint64_t due = (uint64_t)((now - run_start) / 1e9 * rate);
+        for (; issued < due; issued++)
+        {
+            run_operation(w, &w->conns[next]);
+            next = (next + 1) % w->nconns;
+        }
+        poll_once(w, 1);
+    }
+
+    uint64_t drain_end = run_end + (uint64_t)(cfg.drain * 1e9);
+    while (now_ns() < drain_end)
+    {
+        poll_once(w, 10);
+    }
+
+    /* Wait for the server to close the connections so that the nicks are
+     * released before the next run */
+    w->quitting = true;
+    for (int i = 0; i < w->nconns; i++)
+    {
+        if (!w->conns[i].closed)
+        {
+            w->conns[i].outbuf = sdscat(w->conns[i].outbuf, "QUIT :done\r\n");
+            conn_flush(w, &w->conns[i]);
+        }
+    }
+    uint64_t quit_end = now_ns() + (uint64_t)(cfg.setup_timeout * 1e9);
+    while (w->closed < w->nconns && now_ns() < quit_end)
+    {
+        poll_once(w, 10);
+    }
+
+    return NULL;
+}
+
+
+/*
+ * server_syscalls - Read the server's system call counter from its stats
+ * socket
+ *
+ * Return: the counter, or -1
+ */
+static long long server_syscalls(void)
+{
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    char buf[65536];
+    size_t len = 0;
+    ssize_t n;
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+
+    strncpy(addr.sun_path, cfg.stats_socket, sizeof(addr.sun_path) - 1);
+    if (fd == -1 || connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1)
+    {
+        if (fd != -1)
+        {
+            close(fd);
+        }
+        return -1;
+    }
+    while (len < sizeof(buf) - 1 && (n = read(fd, buf + len, sizeof(buf) - 1 - len)) > 0)
+    {
+        len += n;
+    }
+    close(fd);
+    buf[len] = '\0';
+
+    char *field = strstr(buf, "\"syscalls\":");
+    return field != NULL ? strtoll(field + strlen("\"syscalls\":"), NULL, 10) : -1;
+}
+
+
+static void sleep_until(uint64_t deadline)
+{
+    uint64_t now = now_ns();
+
+    if (now < deadline)
+    {
+        struct timespec ts = {.tv_sec = (deadline - now) / 1000000000ULL,
+                              .tv_nsec = (deadline - now) % 1000000000ULL};
+        nanosleep(&ts, NULL);
+    }
+}
+
+
+static void print_report(lg_worker *workers, int nworkers)
+{
+    lg_hist *hist = calloc(1, sizeof(lg_hist));
+    uint64_t sent_channel = 0, sent_private = 0, sent_churn = 0, delivered = 0, errors = 0;
+
+    for (int i = 0; i < nworkers; i++)
+    {
+        sent_channel += workers[i].sent_channel;
+        sent_private += workers[i].sent_private;
+        sent_churn += workers[i].sent_churn;
+        delivered += workers[i].delivered;
+        errors += workers[i].errors;
+        hist_merge(hist, &workers[i].hist);
+    }
+
+    uint64_t sent = sent_channel + sent_private + sent_churn;
+    double elapsed = (run_end - run_start) / 1e9;
+    double measured = (run_end - measure_start) / 1e9;
+    double mean = hist->count ? hist->sum / hist->count / 1000.0 : 0;
+    long long syscalls = syscalls_start >= 0 && syscalls_end >= 0 ? syscalls_end - syscalls_start : -1;
+    double per_message = syscalls >= 0 && delivered ? (double)syscalls / delivered : 0;
+
+    if (cfg.json)
+    {
+        printf("{\"connections\": %d, \"threads\": %d, \"channels\": %d, \"joins\": %d, "
+               "\"distribution\": \"%s\", \"rate\": %g, \"duration\": %g, \"warmup\": %g, "
+               "\"sent\": {\"channel\": %llu, \"private\": %llu, \"churn\": %llu, \"per_sec\": %.1f}, "
+               "\"delivered\": {\"count\": %llu, \"per_sec\": %.1f}, \"errors\": %llu, "
+               "\"latency_us\": {\"mean\": %.1f, \"p50\": %.1f, \"p90\": %.1f, \"p99\": %.1f, "
+               "\"p999\": %.1f, \"max\": %.1f}, "
+               "\"server_syscalls\": {\"count\": %lld, \"per_delivered\": %.2f}}\n",
+               cfg.connections, cfg.threads, cfg.channels, cfg.joins,
+               cfg.zipf ? "zipf" : "uniform", cfg.rate, cfg.duration, cfg.warmup,
+               (unsigned long long)sent_channel, (unsigned long long)sent_private,
+               (unsigned long long)sent_churn, sent / elapsed,
+               (unsigned long long)delivered, delivered / measured, (unsigned long long)errors,
+               mean, hist_percentile_us(hist, 50), hist_percentile_us(hist, 90),
+               hist_percentile_us(hist, 99), hist_percentile_us(hist, 99.9), hist->max / 1000.0,
+               syscalls, per_message);
+    }
+    else
+    {
+        printf("Connections: %d on %d threads, %d channels (%s), %d joins each\n",
+               cfg.connections, cfg.threads, cfg.channels, cfg.zipf ? "zipf" : "uniform", cfg.joins);
+        printf("Sent:        %llu operations in %.1fs (%.1f/s): %llu channel, %llu private, %llu churn\n",
+               (unsigned long long)sent, elapsed, sent / elapsed, (unsigned long long)sent_channel,
+               (unsigned long long)sent_private, (unsigned long long)sent_churn);
+        printf("Delivered:   %llu messages in %.1fs (%.1f/s)\n",
+               (unsigned long long)delivered, measured, delivered / measured);
+        printf("Errors:      %llu\n", (unsigned long long)errors);
+        printf("Latency:     mean %.1fus p50 %.1fus p90 %.1fus p99 %.1fus p99.9 %.1fus max %.1fus\n",
+               mean, hist_percentile_us(hist, 50), hist_percentile_us(hist, 90),
+               hist_percentile_us(hist, 99), hist_percentile_us(hist, 99.9), hist->max / 1000.0);
+        if (syscalls >= 0)
+        {
+            printf("Server:      %lld system calls, %.2f per delivered message\n", syscalls, per_message);
+        }
+    }
+    free(hist);
+}
+
+
+static void usage(void)
+{
+    printf("Usage: chirc-loadgen [-H HOST] [-p PORT] [-n NICK] [-c CONNECTIONS] [-t THREADS]\n"
+           "                     [-C CHANNELS] [-j JOINS] [-z] [-r RATE] [-m CHANNEL%%,PRIVATE%%]\n"
+           "                     [-s PAYLOAD] [-d DURATION] [-w WARMUP] [-D DRAIN] [-T TIMEOUT]\n"
+           "                     [-S STATS_SOCKET] [-J]\n"
+           "\n"
+           "  -n  nick prefix (default lg)\n"
+           "  -c  connections (default 100)         -t  worker threads (default 4)\n"
+           "  -C  channels (default 10)             -j  channels joined per connection (default 1)\n"
+           "  -z  Zipf channel popularity           -r  operations/s per connection (default 10)\n"
+           "  -m  mix of channel and private PRIVMSGs in percent, the rest is\n"
+           "      JOIN/PART churn (default 90,10)\n"
+           "  -s  extra payload bytes per PRIVMSG   -d  measured seconds (default 10)\n"
+           "  -w  warmup seconds (default 2)        -D  drain seconds (default 1)\n"
+           "  -T  setup timeout in seconds (30)     -J  print results as JSON\n"
+           "  -S  stats socket of the server (chirc -S), to report its system calls\n"
+           "      per delivered message during the measurement\n");
+}
+
+
+int main(int argc, char *argv[])
+{
+    int opt;
+
+    cfg = (lg_config){.host = "127.0.0.1", .port = "6667", .nick = "lg", .connections = 100, .threads = 4,
+                      .channels = 10, .joins = 1, .rate = 10, .pct_channel = 90,
+                      .pct_private = 10, .duration = 10, .warmup = 2, .drain = 1,
+                      .setup_timeout = 30};
+
+    while ((opt = getopt(argc, argv, "H:p:n:c:t:C:j:zr:m:s:d:w:D:T:S:Jh")) != -1)
+        switch (opt)
+        {
+        case 'H':
+            cfg.host = optarg;
+            break;
+        case 'p':
+            cfg.port = optarg;
+            break;
+        case 'n':
+            cfg.nick = optarg;
+            break;
+        case 'c':
+            cfg.connections = atoi(optarg);
+            break;
+        case 't':
+            cfg.threads = atoi(optarg);
+            break;
+        case 'C':
+            cfg.channels = atoi(optarg);
+            break;
+        case 'j':
+            cfg.joins = atoi(optarg);
+            break;
+        case 'z':
+            cfg.zipf = true;
+            break;
+        case 'r':
+            cfg.rate = atof(optarg);
+            break;
+        case 'm':
+            if (sscanf(optarg, "%d,%d", &cfg.pct_channel, &cfg.pct_private) != 2)
+            {
+                fprintf(stderr, "ERROR: -m expects CHANNEL%%,PRIVATE%%\n");
+                exit(-1);
+            }
+            break;
+        case 's':
+            cfg.payload = atoi(optarg);
+            break;
+        case 'd':
+            cfg.duration = atof(optarg);
+            break;
+        case 'w':
+            cfg.warmup = atof(optarg);
+            break;
+        case 'D':
+            cfg.drain = atof(optarg);
+            break;
+        case 'T':
+            cfg.setup_timeout = atof(optarg);
+            break;
+        case 'S':
+            cfg.stats_socket = optarg;
+            break;
+        case 'J':
+            cfg.json = true;
+            break;
+        case 'h':
+            usage();
+            exit(0);
+            break;
+        default:
+            usage();
+            exit(-1);
+        }
+
+    if (cfg.connections < 1 || cfg.threads < 1 || cfg.channels < 1 || cfg.joins < 0
+        || cfg.joins > cfg.channels || cfg.rate <= 0 || cfg.duration <= 0
+        || cfg.pct_channel < 0 || cfg.pct_private < 0 || cfg.pct_channel + cfg.pct_private > 100)
+    {
+        fprintf(stderr, "ERROR: Invalid parameters\n");
+        exit(-1);
+    }
+    if (cfg.threads > cfg.connections)
+    {
+        cfg.threads = cfg.connections;
+    }
+
+    /* Every connection needs a descriptor */
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < (rlim_t)cfg.connections + 64)
+    {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+
+    struct addrinfo hints = {.ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM};
+    int rc = getaddrinfo(cfg.host, cfg.port, &hints, &server_addr);
+    if (rc != 0)
+    {
+        fprintf(stderr, "ERROR: getaddrinfo: %s\n", gai_strerror(rc));
+        exit(-1);
+    }
+
+    /* Channel popularity: uniform, or Zipf with exponent 1 */
+    chan_cdf = calloc(cfg.channels, sizeof(double));
+    double total = 0;
+    for (int i = 0; i < cfg.channels; i++)
+    {
+        total += cfg.zipf ? 1.0 / (i + 1) : 1.0;
+        chan_cdf[i] = total;
+    }
+    for (int i = 0; i < cfg.channels; i++)
+    {
+        chan_cdf[i] /= total;
+    }
+
+    lg_worker *workers = calloc(cfg.threads, sizeof(lg_worker));
+    lg_conn *conns = calloc(cfg.connections, sizeof(lg_conn));
+    int *chans = calloc((size_t)cfg.connections * (cfg.joins ? cfg.joins : 1), sizeof(int));
+    bool *joined = calloc((size_t)cfg.connections * (cfg.joins ? cfg.joins : 1), sizeof(bool));
+
+    for (int i = 0; i < cfg.connections; i++)
+    {
+        conns[i].fd = -1;
+        conns[i].id = i;
+        conns[i].inbuf = sdsempty();
+        conns[i].outbuf = sdsempty();
+        conns[i].chans = chans + (size_t)i * cfg.joins;
+        conns[i].joined = joined + (size_t)i * cfg.joins;
+    }
+
+    pthread_barrier_init(&setup_done, NULL, cfg.threads + 1);
+    pthread_barrier_init(&start_gate, NULL, cfg.threads + 1);
+
+    int assigned = 0;
+    for (int i = 0; i < cfg.threads; i++)
+    {
+        lg_worker *w = &workers[i];
+        w->index = i;
+        w->conns = conns + assigned;
+        w->nconns = cfg.connections / cfg.threads + (i < cfg.connections % cfg.threads);
+        w->rng = 0x9E3779B97F4A7C15ULL * (i + 1);
+        assigned += w->nconns;
+        pthread_create(&w->tid, NULL, worker_main, w);
+    }
+
+    uint64_t setup_start = now_ns();
+    pthread_barrier_wait(&setup_done);
+
+    bool failed = false;
+    for (int i = 0; i < cfg.threads; i++)
+    {
+        failed |= workers[i].failed;
+    }
+    if (!failed)
+    {
+        if (!cfg.json)
+        {
+            printf("Setup:       %d connections registered and joined in %.2fs\n",
+                   cfg.connections, (now_ns() - setup_start) / 1e9);
+        }
+        run_start = now_ns();
+        measure_start = run_start + (uint64_t)(cfg.warmup * 1e9);
+        run_end = measure_start + (uint64_t)(cfg.duration * 1e9);
+    }
+    pthread_barrier_wait(&start_gate);
+
+    if (!failed && cfg.stats_socket != NULL)
+    {
+        sleep_until(measure_start);
+        syscalls_start = server_syscalls();
+        sleep_until(run_end);
+        syscalls_end = server_syscalls();
+    }
+
+    for (int i = 0; i < cfg.threads; i++)
+    {
+        pthread_join(workers[i].tid, NULL);
+    }
+
+    if (!failed)
+    {
+        print_report(workers, cfg.threads);
+    }
+
+    for (int i = 0; i < cfg.connections; i++)
+    {
+        if (conns[i].fd != -1)
+        {
+            close(conns[i].fd);
+        }
+        sdsfree(conns[i].inbuf);
+        sdsfree(conns[i].outbuf);
+    }
+    for (int i = 0; i < cfg.threads; i++)
+    {
+        close(workers[i].epfd);
+    }
+    free(chans);
+    free(joined);
+    free(conns);
+    free(workers);
+    free(chan_cdf);
+    freeaddrinfo(server_addr);
+
+    return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,1084 @@
+/*
+ *
+ *  chirc-microbench: microbenchmarks of chirc's per-message primitives
+ *
+ *  Every case runs one primitive in a tight loop against chirc_core, the
+ *  same code the server runs. The iteration count of a sample is calibrated
+ *  so that a sample takes about -t milliseconds, the case is warmed up for
+ *  -w milliseconds, and then -r samples are timed. Results are reported in
+ *  nanoseconds per operation as a table or, with -J, as one JSON object per
+ *  line for regression tracking.
+ *
+ *  Build with -DCMAKE_BUILD_TYPE=Release for numbers that mean anything.
+ *
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <ctype.h>
+#include <unistd.h>
+#include <math.h>
+#include <malloc.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/socket.h>
+
+#include "server.h"
+#include "server_cmd.h"
+#include "client.h"
+#include "channels.h"
+#include "msg.h"
+#include "banlist.h"
+#include "reply.h"
+#include "log.h"
+#include "../lib/sds/sds.h"
+
+#define MB_MAX_SAMPLES 1000
+#define MB_OVERLAP_USERS 2000      /* Users in the NICK/QUIT relay graph */
+#define MB_OVERLAP_CHANNELS 500    /* Channels in the NICK/QUIT relay graph */
+#define MB_OVERLAP_MAX_JOINS 20    /* Most channels a user of the graph joins */
+#define MB_BANS 1000               /* Masks in the ban list of the JOIN checks */
+#define MB_BAN_JOINERS 4096        /* Distinct nick!user@host of the joining users */
+#define MB_FOOTPRINT_USERS 20000   /* Users in the memory footprint report */
+#define MB_FOOTPRINT_CHANNELS 2000 /* Channels in the memory footprint report */
+#define MB_FOOTPRINT_JOINS 20      /* Channels each user of the footprint report joins */
+
+/* One benchmark case. run() executes the primitive iters times. */
+typedef struct mb_case
+{
+    const char *name;
+    void (*setup)(void);
+    void (*run)(uint64_t iters);
+    void (*teardown)(void);
+} mb_case;
+
+typedef struct mb_result
+{
+    uint64_t iters;     /* Iterations per sample */
+    int samples;
+    double min;         /* Nanoseconds per operation */
+    double median;
+    double mean;
+    double stddev;
+    double max;
+} mb_result;
+
+static int num_samples = 15;
+static double sample_ms = 20;
+static double warmup_ms = 200;
+static int num_nicks = 10000;
+static int num_channels = 1000;
+
+/* Results are folded into this so the compiler cannot drop the loops */
+static volatile uintptr_t sink;
+
+/* A received buffer: eight typical commands followed by a partial one */
+static const char recv_buffer[] =
+    "PRIVMSG #chirc :hello everyone, how is the load test going?\r\n"
+    "PRIVMSG alice :did you see the numbers from last night\r\n"
+    "JOIN #benchmarks\r\n"
+    "PING :irc.example.com\r\n"
+    "PRIVMSG #benchmarks :p99 is up by 12% since the last release\r\n"
+    "PART #chirc :bye\r\n"
+    "NOTICE bob :ping me when you are back\r\n"
+    "PRIVMSG #chirc :the quick brown fox jumps over the lazy dog\r\n"
+    "PRIVMSG #chirc :and this one is still on its w";
+
+static const char privmsg_line[] = "PRIVMSG #benchmarks :p99 is up by 12% since the last release";
+
+static server_ctx *ctx;
+static conn_info_t *conn;
+static int drain_socket;
+static pthread_t drain_thread;
+static sds *nick_keys, *channel_keys, *missing_keys;
+static client_t **users;
+
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+
+/*
+ * Line framing and tokenization
+ */
+
+static void bench_frame_commands(uint64_t iters)
+{
+    sds cmdstack = sdsempty();
+
+    for (uint64_t i = 0; i < iters; i++)
+    {
+        int count;
+        cmdstack = sdscpylen(cmdstack, recv_buffer, sizeof recv_buffer - 1);
+        sds *cmdseg = frame_commands(cmdstack, &count);
+        sink += count;
+        sdsfreesplitres(cmdseg, count);
+    }
+    sdsfree(cmdstack);
+}
+
+
+static void bench_frame_and_tokenize(uint64_t iters)
+{
+    sds cmdstack = sdsempty();
+
+    for (uint64_t i = 0; i < iters; i++)
+    {
+        int count, argc;
+        cmdstack = sdscpylen(cmdstack, recv_buffer, sizeof recv_buffer - 1);
+        sds *cmdseg = frame_commands(cmdstack, &count);
+        for (int j = 0; j < count; j++)
+        {
+            sds *cmdtokens = tokenize_command(cmdseg[j], &argc);
+            sink += argc;
+            sdsfreesplitres(cmdtokens, argc);
+        }
+        sdsfreesplitres(cmdseg, count);
+    }
+    sdsfree(cmdstack);
+}
+
+
+static void bench_sdssplitlen(uint64_t iters)
+{
+    sds line = sdsnew(privmsg_line);
+
+    for (uint64_t i = 0; i < iters; i++)
+    {
+        int argc;
+        sds *tokens = sdssplitlen(line, sdslen(line), " ", 1, &argc);
+        sink += argc;
+        sdsfreesplitres(tokens, argc);
+    }
+    sdsfree(line);
+}
+
+
+/*
+ * Vectorized scanning: the same splits and trims with the widest vector
+ * instructions sds may use capped at none, SSE2 and AVX2
+ */
+
+#define MB_SCAN_LINES 256   /* Lines of the buffer split on "\r\n" */
+
+static sds long_line;       /* A 512-byte line of short words */
+static sds scan_buffer;     /* MB_SCAN_LINES lines, as a busy connection's input */
+static sds padded_line;     /* privmsg_line with spaces on both ends */
+
+
+static void setup_scan(void)
+{
+    long_line = sdsempty();
+    while (sdslen(long_line) < 512)
+    {
+        long_line = sdscat(long_line, "alice bob carol dave ");
+    }
+    sdsrange(long_line, 0, 511);
+
+    scan_buffer = sdsempty();
+    for (int i = 0; i < MB_SCAN_LINES; i++)
+    {
+        scan_buffer = sdscatfmt(scan_buffer, "%s %i\r\n", privmsg_line, i);
+    }
+
+    padded_line = sdscatfmt(sdsempty(), "%s%s%s", "        ", privmsg_line, "            ");
+}
+
+static void setup_scan_scalar(void)
+{
+    setup_scan();
+    sdssimd(0);
+}
+
+static void setup_scan_sse2(void)
+{
+    setup_scan();
+    sdssimd(1);
+}
+
+static void setup_scan_avx2(void)
+{
+    setup_scan();
+    sdssimd(2);
+}
+
+
+static void teardown_scan(void)
+{
+    /* Back to the best the CPU has */
+    sdssimd(2);
+    sdsfree(long_line);
+    sdsfree(scan_buffer);
+    sdsfree(padded_line);
+}
+
+
+static void bench_split_long_line(uint64_t iters)
+{
+    for (uint64_t i = 0; i < iters; i++)
+    {
+        int argc;
+        sds *tokens = sdssplitlen(long_line, sdslen(long_line), " ", 1, &argc);
+        sink += argc;
+        sdsfreesplitres(tokens, argc);
+    }
+}
+
+
+static void bench_split_buffer(uint64_t iters)
+{
+    for (uint64_t i = 0; i < iters; i++)
+    {
+        int count;
+        sds *lines = sdssplitlen(scan_buffer, sdslen(scan_buffer), "\r\n", 2, &count);
+        sink += count;
+        sdsfreesplitres(lines, count);
+    }
+}
+
+
+static void bench_trim(uint64_t iters)
+{
+    sds line = sdsempty();
+
+    for (uint64_t i = 0; i < iters; i++)
+    {
+        line = sdscpylen(line, padded_line, sdslen(padded_line));
+        line = sdstrim(line, " ");
+        sink += sdslen(line);
+    }
+    sdsfree(line);
+}
+
+
+/*
+ * Message formatting
+ */
+
+static void bench_message_to_string(uint64_t iters)
+{
+    chirc_message_t *msg = malloc(sizeof(chirc_message_t));
+    chirc_message_construct(msg, ":alice!alice@client.example.com", "PRIVMSG");
+    chirc_message_add_parameter(msg, "#benchmarks", false);
+    chirc_message_add_parameter(msg, "p99 is up by 12% since the last release\r\n", true);
+
+    for (uint64_t i = 0; i < iters; i++)
+    {
+        sds s;
+        chirc_message_to_string(msg, &s);
+        sink += sdslen(s);
+        sdsfree(s);
+    }
+    chirc_message_destroy(msg);
+}
+
+
+static void bench_message_build(uint64_t iters)
+{
+    /* What every reply path does: construct, add parameters, format, destroy */
+    for (uint64_t i = 0; i < iters; i++)
+    {
+        sds s;
+        chirc_message_t *msg = malloc(sizeof(chirc_message_t));
+        chirc_message_construct(msg, ":alice!alice@client.example.com", "PRIVMSG");
+        chirc_message_add_parameter(msg, "#benchmarks", false);
+        chirc_message_add_parameter(msg, "p99 is up by 12% since the last release\r\n", true);
+        chirc_message_to_string(msg, &s);
+        sink += sdslen(s);
+        sdsfree(s);
+        chirc_message_destroy(msg);
+    }
+}
+
+
+/*
+ * reply_error, on a registered client whose replies go to a socketpair
+ * drained by another thread
+ */
+
+static void *drain_main(void *arg)
+{
+    char buf[65536];
+
+    while (read(drain_socket, buf, sizeof buf) > 0)
+    {
+    }
+    return NULL;
+}
+
+
+static void setup_reply(void)
+{
+    int sv[2];
+
+    socketpair(AF_UNIX, SOCK_STREAM, 0, sv);
+    drain_socket = sv[1];
+    pthread_create(&drain_thread, NULL, drain_main, NULL);
+
+    conn = calloc(1, sizeof(conn_info_t));
+    conn->client_socket = sv[0];
+    conn->server_hostname = sdsnew("irc.example.com");
+    conn->client_hostname = sdsnew("client.example.com");
+
+    client_t *client = new_USER(sv[0], conn->client_hostname, 1);
+    user_set_nick(&client->info, "alice");
+    user_set_username(&client->info, "alice");
+    client->info.realname = sdscpy(client->info.realname, "Alice");
+    client->info.state = REGISTERED;
+    add_USER(client, sv[0], &ctx->client_hashtable);
+}
+
+
+static void teardown_reply(void)
+{
+    remove_USER(conn->client_socket, &ctx->client_hashtable);
+    close(conn->client_socket);
+    pthread_join(drain_thread, NULL);
+    close(drain_socket);
+    sdsfree(conn->server_hostname);
+    sdsfree(conn->client_hostname);
+    free(conn);
+}
+
+
+static void bench_reply_error_unknown(uint64_t iters)
+{
+    sds cmd[1] = {sdsnew("FOOBAR")};
+
+    for (uint64_t i = 0; i < iters; i++)
+    {
+        sink += reply_error(cmd, ERR_UNKNOWNCOMMAND, conn, ctx);
+    }
+    sdsfree(cmd[0]);
+}
+
+
+static void bench_reply_error_nosuchnick(uint64_t iters)
+{
+    sds cmd[2] = {sdsnew("PRIVMSG"), sdsnew("bob")};
+
+    for (uint64_t i = 0; i < iters; i++)
+    {
+        sink += reply_error(cmd, ERR_NOSUCHNICK, conn, ctx);
+    }
+    sdsfree(cmd[0]);
+    sdsfree(cmd[1]);
+}
+
+
+/*
+ * Hash table lookups at realistic sizes
+ */
+
+static void setup_tables(void)
+{
+    nick_keys = calloc(num_nicks, sizeof(sds));
+    channel_keys = calloc(num_channels, sizeof(sds));
+    missing_keys = calloc(num_nicks, sizeof(sds));
+
+    for (int i = 0; i < num_nicks; i++)
+    {
+        nick_keys[i] = sdscatprintf(sdsempty(), "user%d", i);
+        missing_keys[i] = sdscatprintf(sdsempty(), "ghost%d", i);
+        add_NICK(nick_keys[i], i, &ctx->nicks_hashtable);
+    }
+    for (int i = 0; i < num_channels; i++)
+    {
+        channel_keys[i] = sdscatprintf(sdsempty(), "#channel%d", i);
+        add_CHANNEL(channel_keys[i], &ctx->channels_hashtable);
+    }
+}
+
+
+static void teardown_tables(void)
+{
+    for (int i = 0; i < num_nicks; i++)
+    {
+        remove_NICK(nick_keys[i], &ctx->nicks_hashtable);
+        sdsfree(nick_keys[i]);
+        sdsfree(missing_keys[i]);
+    }
+    for (int i = 0; i < num_channels; i++)
+    {
+        remove_CHANNEL(channel_keys[i], &ctx->channels_hashtable);
+        sdsfree(channel_keys[i]);
+    }
+    free(nick_keys);
+    free(channel_keys);
+    free(missing_keys);
+}
+
+
+static void bench_find_nick_hit(uint64_t iters)
+{
+    /* Stride through the keys so consecutive lookups touch different buckets */
+    for (uint64_t i = 0, k = 0; i < iters; i++, k = (k + 7919) % num_nicks)
+    {
+        sink += (uintptr_t)find_NICK(nick_keys[k], &ctx->nicks_hashtable);
+    }
+}
+
+
+static void bench_find_nick_miss(uint64_t iters)
+{
+    for (uint64_t i = 0, k = 0; i < iters; i++, k = (k + 7919) % num_nicks)
+    {
+        sink += (uintptr_t)find_NICK(missing_keys[k], &ctx->nicks_hashtable);
+    }
+}
+
+
+static void bench_find_channel_hit(uint64_t iters)
+{
+    for (uint64_t i = 0, k = 0; i < iters; i++, k = (k + 7919) % num_channels)
+    {
+        sink += (uintptr_t)find_CHANNEL(channel_keys[k], &ctx->channels_hashtable);
+    }
+}
+
+
+static void bench_find_channel_miss(uint64_t iters)
+{
+    for (uint64_t i = 0, k = 0; i < iters; i++, k = (k + 7919) % num_nicks)
+    {
+        sink += (uintptr_t)find_CHANNEL(missing_keys[k], &ctx->channels_hashtable);
+    }
+}
+
+
+/*
+ * NICK/QUIT relay fan-out on an overlap graph: users join between 2 and
+ * MB_OVERLAP_MAX_JOINS channels picked with a strong bias towards a few
+ * popular ones, so neighbors share many channels as on real networks
+ */
+
+static uint64_t overlap_rng;
+
+static uint64_t overlap_next(void)
+{
+    overlap_rng ^= overlap_rng << 13;
+    overlap_rng ^= overlap_rng >> 7;
+    overlap_rng ^= overlap_rng << 17;
+    return overlap_rng;
+}
+
+
+/* A registered user with socket 1000 + i, in the client and nick tables */
+static client_t *add_bench_user(int i, sds nick, sds hostname)
+{
+    client_t *user = new_USER(1000 + i, hostname, i);
+    sds realname = sdscatprintf(sdsempty(), "User Number %d", i);
+
+    user_set_nick(&user->info, nick);
+    user_set_username(&user->info, nick);
+    user->info.realname = sdscpy(user->info.realname, realname);
+    user->info.state = REGISTERED;
+    add_USER(user, user->socket, &ctx->client_hashtable);
+    add_NICK(user->info.nick, user->socket, &ctx->nicks_hashtable);
+    sdsfree(realname);
+
+    return user;
+}
+
+
+static void remove_bench_user(client_t *user)
+{
+    remove_NICK(user->info.nick, &ctx->nicks_hashtable);
+    remove_USER(user->socket, &ctx->client_hashtable);
+}
+
+
+static void setup_overlap(void)
+{
+    sds hostname = sdsnew("client.example.com");
+
+    nick_keys = calloc(MB_OVERLAP_USERS, sizeof(sds));
+    channel_keys = calloc(MB_OVERLAP_CHANNELS, sizeof(sds));
+    users = calloc(MB_OVERLAP_USERS, sizeof(client_t *));
+    overlap_rng = 88172645463325252ULL;
+
+    for (int i = 0; i < MB_OVERLAP_CHANNELS; i++)
+    {
+        channel_keys[i] = sdscatprintf(sdsempty(), "#channel%d", i);
+        add_CHANNEL(channel_keys[i], &ctx->channels_hashtable);
+    }
+    for (int i = 0; i < MB_OVERLAP_USERS; i++)
+    {
+        nick_keys[i] = sdscatprintf(sdsempty(), "user%d", i);
+        users[i] = add_bench_user(i, nick_keys[i], hostname);
+
+        int joins = 2 + overlap_next() % (MB_OVERLAP_MAX_JOINS - 1);
+        for (int j = 0; j < joins; j++)
+        {
+            double u = (overlap_next() >> 11) * (1.0 / 9007199254740992.0);
+            channel_t *c = find_CHANNEL(channel_keys[(int)(MB_OVERLAP_CHANNELS * u * u * u)],
+                                        &ctx->channels_hashtable);
+            add_CHANNEL_CLIENT(users[i], c);
+        }
+    }
+    sdsfree(hostname);
+
+    /* What one QUIT from every user costs on the wire, before and after deduplication */
+    uint64_t naive = 0, dedup = 0, bytes_naive = 0, bytes_dedup = 0;
+    for (int i = 0; i < MB_OVERLAP_USERS; i++)
+    {
+        size_t len = strlen(nick_keys[i]) * 2 + sizeof(":!@client.example.com QUIT :Client Quit\r\n") - 1;
+        uint64_t n = 0;
+        int *sockets;
+
+        for (channel_t *c = ctx->channels_hashtable; c != NULL; c = c->hh.next)
+        {
+            if (find_CHANNEL_CLIENT(users[i], &c->channel_clients) != NULL)
+            {
+                n += HASH_COUNT(c->channel_clients) - 1;
+            }
+        }
+        int d = server_find_NEIGHBORS(ctx, users[i], &sockets);
+        free(sockets);
+
+        naive += n;
+        dedup += d;
+        bytes_naive += n * len;
+        bytes_dedup += d * len;
+    }
+    fprintf(stderr, "# relay graph: %d users, %d channels; per QUIT %.1f relays (%.0f bytes) "
+            "one per shared channel, %.1f relays (%.0f bytes) one per neighbor: %.1f%% fewer bytes\n",
+            MB_OVERLAP_USERS, MB_OVERLAP_CHANNELS,
+            (double)naive / MB_OVERLAP_USERS, (double)bytes_naive / MB_OVERLAP_USERS,
+            (double)dedup / MB_OVERLAP_USERS, (double)bytes_dedup / MB_OVERLAP_USERS,
+            bytes_naive ? 100.0 * (bytes_naive - bytes_dedup) / bytes_naive : 0.0);
+}
+
+
+static void teardown_overlap(void)
+{
+    for (int i = 0; i < MB_OVERLAP_CHANNELS; i++)
+    {
+        channel_t *c = find_CHANNEL(channel_keys[i], &ctx->channels_hashtable);
+        channel_client *cc, *tmp;
+
+        HASH_ITER(hh, c->channel_clients, cc, tmp)
+        {
+            remove_CHANNEL_CLIENT(cc->user, c);
+        }
+        remove_CHANNEL(channel_keys[i], &ctx->channels_hashtable);
+        sdsfree(channel_keys[i]);
+    }
+    for (int i = 0; i < MB_OVERLAP_USERS; i++)
+    {
+        remove_bench_user(users[i]);
+        sdsfree(nick_keys[i]);
+    }
+    free(nick_keys);
+    free(channel_keys);
+    free(users);
+}
+
+
+static void bench_relay_per_channel(uint64_t iters)
+{
+    /* The relay loop NICK and QUIT used to run: every member of every shared channel */
+    for (uint64_t i = 0, k = 0; i < iters; i++, k = (k + 7919) % MB_OVERLAP_USERS)
+    {
+        for (channel_t *c = ctx->channels_hashtable; c != NULL; c = c->hh.next)
+        {
+            if (find_CHANNEL_CLIENT(users[k], &c->channel_clients) == NULL)
+                continue;
+            for (channel_client *cc = c->channel_clients; cc != NULL; cc = cc->hh.next)
+            {
+                sink += cc->user->socket;
+            }
+        }
+    }
+}
+
+
+static void bench_relay_neighbors(uint64_t iters)
+{
+    int *sockets;
+
+    for (uint64_t i = 0, k = 0; i < iters; i++, k = (k + 7919) % MB_OVERLAP_USERS)
+    {
+        sink += server_find_NEIGHBORS(ctx, users[k], &sockets);
+        free(sockets);
+    }
+}
+
+
+/*
+ * Memory footprint of users and channel memberships, measured with
+ * mallinfo2() while MB_FOOTPRINT_USERS users join MB_FOOTPRINT_JOINS of
+ * MB_FOOTPRINT_CHANNELS channels each, and membership churn on that table
+ */
+
+static void setup_footprint(void)
+{
+    sds hostname = sdsnew("client.example.com");
+
+    nick_keys = calloc(MB_FOOTPRINT_USERS, sizeof(sds));
+    channel_keys = calloc(MB_FOOTPRINT_CHANNELS, sizeof(sds));
+    users = calloc(MB_FOOTPRINT_USERS, sizeof(client_t *));
+    for (int i = 0; i < MB_FOOTPRINT_CHANNELS; i++)
+    {
+        channel_keys[i] = sdscatprintf(sdsempty(), "#channel%d", i);
+        add_CHANNEL(channel_keys[i], &ctx->channels_hashtable);
+    }
+    for (int i = 0; i < MB_FOOTPRINT_USERS; i++)
+    {
+        nick_keys[i] = sdscatprintf(sdsempty(), "user%d", i);
+    }
+
+    size_t start = mallinfo2().uordblks;
+    for (int i = 0; i < MB_FOOTPRINT_USERS; i++)
+    {
+        users[i] = add_bench_user(i, nick_keys[i], hostname);
+    }
+    size_t registered = mallinfo2().uordblks;
+    for (int i = 0; i < MB_FOOTPRINT_USERS; i++)
+    {
+        for (int j = 0; j < MB_FOOTPRINT_JOINS; j++)
+        {
+            channel_t *c = find_CHANNEL(channel_keys[(i * 7 + j * 101) % MB_FOOTPRINT_CHANNELS],
+                                        &ctx->channels_hashtable);
+            channel_client *cc = add_CHANNEL_CLIENT(users[i], c);
+
+            if (HASH_COUNT(c->channel_clients) == 1)
+            {
+                cc->modes |= MEMBER_OP;
+            }
+        }
+    }
+    size_t joined = mallinfo2().uordblks;
+    sdsfree(hostname);
+
+    fprintf(stderr, "# footprint: %d users, %d memberships: %.1f bytes per user "
+            "(client_t %zu), %.1f bytes per membership (channel_client %zu)\n",
+            MB_FOOTPRINT_USERS, MB_FOOTPRINT_USERS * MB_FOOTPRINT_JOINS,
+            (double)(registered - start) / MB_FOOTPRINT_USERS, sizeof(client_t),
+            (double)(joined - registered) / (MB_FOOTPRINT_USERS * MB_FOOTPRINT_JOINS),
+            sizeof(channel_client));
+}
+
+
+static void teardown_footprint(void)
+{
+    for (int i = 0; i < MB_FOOTPRINT_CHANNELS; i++)
+    {
+        channel_t *c = find_CHANNEL(channel_keys[i], &ctx->channels_hashtable);
+        channel_client *cc, *tmp;
+
+        HASH_ITER(hh, c->channel_clients, cc, tmp)
+        {
+            remove_CHANNEL_CLIENT(cc->user, c);
+        }
+        remove_CHANNEL(channel_keys[i], &ctx->channels_hashtable);
+        sdsfree(channel_keys[i]);
+    }
+    for (int i = 0; i < MB_FOOTPRINT_USERS; i++)
+    {
+        remove_bench_user(users[i]);
+        sdsfree(nick_keys[i]);
+    }
+    free(nick_keys);
+    free(channel_keys);
+    free(users);
+}
+
+
+static void bench_membership_churn(uint64_t iters)
+{
+    /* A user leaves one of its channels and joins it again */
+    for (uint64_t i = 0, k = 0; i < iters; i++, k = (k + 7919) % MB_FOOTPRINT_USERS)
+    {
+        channel_t *c = find_CHANNEL(channel_keys[(k * 7 + (i % MB_FOOTPRINT_JOINS) * 101)
+                                                 % MB_FOOTPRINT_CHANNELS],
+                                    &ctx->channels_hashtable);
+
+        remove_CHANNEL_CLIENT(users[k], c);
+        sink += (uintptr_t)add_CHANNEL_CLIENT(users[k], c);
+    }
+}
+
+
+static void bench_connection_counters(uint64_t iters)
+{
+    /* The LUSERS counts of a connection that registers and quits */
+    for (uint64_t i = 0; i < iters; i++)
+    {
+        add_total_connected_number(ctx);
+        add_connected_user_number(ctx);
+        dec_connected_user_number(ctx);
+        dec_total_connected_number(ctx);
+    }
+}
+
+
+/*
+ * JOIN ban check against a channel with MB_BANS bans: nick bans with a
+ * literal prefix, IP and host bans with a literal suffix, and a few
+ * masks with wildcards at both ends. The joining users are mostly not
+ * banned, as in a join flood against a busy channel.
+ */
+
+static channel_t *ban_channel;
+static sds ban_masks[MB_BANS];
+static sds ban_joiners[MB_BAN_JOINERS];
+
+static void setup_bans(void)
+{
+    sds name = sdsnew("#banned");
+
+    overlap_rng = 88172645463325252ULL;
+    ban_channel = add_CHANNEL(name, &ctx->channels_hashtable);
+    for (int i = 0; i < MB_BANS; i++)
+    {
+        int kind = overlap_next() % 20;
+        sds mask;
+
+        if (kind < 8)
+            mask = sdscatprintf(sdsempty(), "spam%d*!*@*", i);
+        else if (kind < 16)
+            mask = sdscatprintf(sdsempty(), "*!*@10.%d.%d.%d", (int)(overlap_next() % 256),
+                                (int)(overlap_next() % 256), (int)(overlap_next() % 256));
+        else if (kind < 19)
+            mask = sdscatprintf(sdsempty(), "*!*@host%d.example.com", i);
+        else
+            mask = sdscatprintf(sdsempty(), "*!*bot%d*@*", i);
+
+        ban_masks[i] = mask;
+        banlist_add(&ban_channel->bans, mask, "op!op@example.com");
+    }
+    for (int i = 0; i < MB_BAN_JOINERS; i++)
+    {
+        if (i % 2)
+            ban_joiners[i] = sdscatprintf(sdsempty(), "user%d!~ident%d@10.%d.%d.%d", i, i,
+                                          (int)(overlap_next() % 256), (int)(overlap_next() % 256),
+                                          (int)(overlap_next() % 256));
+        else
+            ban_joiners[i] = sdscatprintf(sdsempty(), "user%d!ident%d@client%d.example.com", i, i, i);
+    }
+    sdsfree(name);
+}
+
+
+static void teardown_bans(void)
+{
+    remove_CHANNEL(ban_channel->channel_name, &ctx->channels_hashtable);
+    for (int i = 0; i < MB_BANS; i++)
+    {
+        sdsfree(ban_masks[i]);
+    }
+    for (int i = 0; i < MB_BAN_JOINERS; i++)
+    {
+        sdsfree(ban_joiners[i]);
+    }
+}
+
+
+/* Case-insensitive glob with backtracking to the last '*', the matcher
+ * the ban check used before masks were compiled */
+static bool naive_mask_match(const char *mask, const char *str)
+{
+    const char *star = NULL, *resume = NULL;
+
+    while (*str)
+    {
+        if (*mask == '*')
+        {
+            star = mask++;
+            resume = str;
+        }
+        else if (*mask == '?' || tolower((unsigned char)*mask) == tolower((unsigned char)*str))
+        {
+            mask++;
+            str++;
+        }
+        else if (star != NULL)
+        {
+            mask = star + 1;
+            str = ++resume;
+        }
+        else
+        {
+            return false;
+        }
+    }
+    while (*mask == '*')
+    {
+        mask++;
+    }
+
+    return *mask == '\0';
+}
+
+
+static void bench_join_bans_naive(uint64_t iters)
+{
+    /* Every mask globbed against every joining user */
+    for (uint64_t i = 0; i < iters; i++)
+    {
+        const char *joiner = ban_joiners[i % MB_BAN_JOINERS];
+
+        for (int j = 0; j < MB_BANS; j++)
+        {
+            if (naive_mask_match(ban_masks[j], joiner))
+            {
+                sink++;
+                break;
+            }
+        }
+    }
+}
+
+
+static void bench_join_bans_compiled(uint64_t iters)
+{
+    /* The check JOIN runs, channels_lock included */
+    for (uint64_t i = 0; i < iters; i++)
+    {
+        sink += server_find_BANNED(ctx, ban_channel, ban_joiners[i % MB_BAN_JOINERS]);
+    }
+}
+
+
+static mb_case cases[] = {
+    {"frame_commands", NULL, bench_frame_commands, NULL},
+    {"frame_and_tokenize", NULL, bench_frame_and_tokenize, NULL},
+    {"sdssplitlen_privmsg", NULL, bench_sdssplitlen, NULL},
+    {"split_long_line_scalar", setup_scan_scalar, bench_split_long_line, teardown_scan},
+    {"split_long_line_sse2", setup_scan_sse2, bench_split_long_line, teardown_scan},
+    {"split_long_line_avx2", setup_scan_avx2, bench_split_long_line, teardown_scan},
+    {"split_buffer_scalar", setup_scan_scalar, bench_split_buffer, teardown_scan},
+    {"split_buffer_sse2", setup_scan_sse2, bench_split_buffer, teardown_scan},
+    {"split_buffer_avx2", setup_scan_avx2, bench_split_buffer, teardown_scan},
+    {"trim_scalar", setup_scan_scalar, bench_trim, teardown_scan},
+    {"trim_sse2", setup_scan_sse2, bench_trim, teardown_scan},
+    {"trim_avx2", setup_scan_avx2, bench_trim, teardown_scan},
+    {"message_to_string", NULL, bench_message_to_string, NULL},
+    {"message_build", NULL, bench_message_build, NULL},
+    {"reply_error_unknowncommand", setup_reply, bench_reply_error_unknown, teardown_reply},
+    {"reply_error_nosuchnick", setup_reply, bench_reply_error_nosuchnick, teardown_reply},
+    {"find_NICK_hit", setup_tables, bench_find_nick_hit, teardown_tables},
+    {"find_NICK_miss", setup_tables, bench_find_nick_miss, teardown_tables},
+    {"find_CHANNEL_hit", setup_tables, bench_find_channel_hit, teardown_tables},
+    {"find_CHANNEL_miss", setup_tables, bench_find_channel_miss, teardown_tables},
+    {"relay_targets_per_channel", setup_overlap, bench_relay_per_channel, teardown_overlap},
+    {"relay_targets_neighbors", setup_overlap, bench_relay_neighbors, teardown_overlap},
+    {"membership_churn", setup_footprint, bench_membership_churn, teardown_footprint},
+    {"connection_counters", NULL, bench_connection_counters, NULL},
+    {"join_bans_naive", setup_bans, bench_join_bans_naive, teardown_bans},
+    {"join_bans_compiled", setup_bans, bench_join_bans_compiled, teardown_bans},
+};
+
+
+static int compare_double(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+
+static void run_case(mb_case *c, mb_result *r)
+{
+    /*
+     * run_case - Calibrate, warm up and time one case
+     */
+    double samples[MB_MAX_SAMPLES];
+    uint64_t target = (uint64_t)(sample_ms * 1e6);
+    uint64_t iters = 1, elapsed = 0;
+
+    if (c->setup)
+    {
+        c->setup();
+    }
+
+    /* Grow the iteration count until a sample takes long enough */
+    while (iters < (1ULL << 40))
+    {
+        uint64_t start = now_ns();
+        c->run(iters);
+        elapsed = now_ns() - start;
+        if (elapsed >= target / 4)
+        {
+            break;
+        }
+        iters *= 2;
+    }
+    if (elapsed > 0 && elapsed < target)
+    {
+        iters = iters * target / elapsed;
+    }
+    if (iters == 0)
+    {
+        iters = 1;
+    }
+
+    uint64_t warmup_end = now_ns() + (uint64_t)(warmup_ms * 1e6);
+    while (now_ns() < warmup_end)
+    {
+        c->run(iters);
+    }
+
+    double sum = 0, sumsq = 0;
+    for (int i = 0; i < num_samples; i++)
+    {
+        uint64_t start = now_ns();
+        c->run(iters);
+        samples[i] = (double)(now_ns() - start) / iters;
+        sum += samples[i];
+        sumsq += samples[i] * samples[i];
+    }
+
+    if (c->teardown)
+    {
+        c->teardown();
+    }
+
+    qsort(samples, num_samples, sizeof(double), compare_double);
+    r->iters = iters;
+    r->samples = num_samples;
+    r->min = samples[0];
+    r->max = samples[num_samples - 1];
+    r->median = num_samples % 2 ? samples[num_samples / 2]
+                                : (samples[num_samples / 2 - 1] + samples[num_samples / 2]) / 2;
+    r->mean = sum / num_samples;
+    r->stddev = sqrt(fmax(0, sumsq / num_samples - r->mean * r->mean));
+}
+
+
+static void usage(void)
+{
+    printf("Usage: chirc-microbench [-f FILTER] [-r SAMPLES] [-t SAMPLE_MS] [-w WARMUP_MS]\n"
+           "                        [-n NICKS] [-c CHANNELS] [-l] [-J]\n"
+           "\n"
+           "  -f  only run cases whose name contains FILTER\n"
+           "  -r  timed samples per case (default 15)\n"
+           "  -t  target duration of a sample in milliseconds (default 20)\n"
+           "  -w  warmup per case in milliseconds (default 200)\n"
+           "  -n  nicks in the table for find_NICK (default 10000)\n"
+           "  -c  channels in the table for find_CHANNEL (default 1000)\n"
+           "  -l  list the cases and exit\n"
+           "  -J  print one JSON object per case\n");
+}
+
+
+int main(int argc, char *argv[])
+{
+    int opt;
+    char *filter = NULL;
+    bool json = false;
+    int ncases = sizeof cases / sizeof cases[0];
+
+    while ((opt = getopt(argc, argv, "f:r:t:w:n:c:lJh")) != -1)
+        switch (opt)
+        {
+        case 'f':
+            filter = optarg;
+            break;
+        case 'r':
+            num_samples = atoi(optarg);
+            break;
+        case 't':
+            sample_ms = atof(optarg);
+            break;
+        case 'w':
+            warmup_ms = atof(optarg);
+            break;
+        case 'n':
+            num_nicks = atoi(optarg);
+            break;
+        case 'c':
+            num_channels = atoi(optarg);
+            break;
+        case 'l':
+            for (int i = 0; i < ncases; i++)
+            {
+                printf("%s\n", cases[i].name);
+            }
+            exit(0);
+            break;
+        case 'J':
+            json = true;
+            break;
+        case 'h':
+            usage();
+            exit(0);
+            break;
+        default:
+            usage();
+            exit(-1);
+        }
+
+    if (num_samples < 1 || num_samples > MB_MAX_SAMPLES || sample_ms <= 0 || warmup_ms < 0
+        || num_nicks < 1 || num_channels < 1)
+    {
+        fprintf(stderr, "ERROR: Invalid parameters\n");
+        exit(-1);
+    }
+
+    chirc_setloglevel(QUIET);
+
+    ctx = calloc(1, sizeof(server_ctx));
+    pthread_mutex_init(&ctx->lock, NULL);
+    pthread_mutex_init(&ctx->channels_lock, NULL);
+    pthread_mutex_init(&ctx->clients_lock, NULL);
+    pthread_mutex_init(&ctx->nicks_lock, NULL);
+    pthread_mutex_init(&ctx->operators_lock, NULL);
+    for (int i = 0; i < SOCKET_LOCKS; i++)
+    {
+        pthread_mutex_init(&ctx->socket_locks[i], NULL);
+    }
+
+    if (!json)
+    {
+        printf("%-28s %12s %10s %10s %10s %10s %10s\n",
+               "case", "iters", "min", "median", "mean", "stddev", "max");
+    }
+
+    for (int i = 0; i < ncases; i++)
+    {
+        mb_result r;
+
+        if (filter != NULL && strstr(cases[i].name, filter) == NULL)
+        {
+            continue;
+        }
+        run_case(&cases[i], &r);
+
+        if (json)
+        {
+            printf("{\"name\": \"%s\", \"iterations\": %llu, \"samples\": %d, \"unit\": \"ns/op\", "
+                   "\"min\": %.2f, \"median\": %.2f, \"mean\": %.2f, \"stddev\": %.2f, \"max\": %.2f}\n",
+                   cases[i].name, (unsigned long long)r.iters, r.samples,
+                   r.min, r.median, r.mean, r.stddev, r.max);
+        }
+        else
+        {
+            printf("%-28s %12llu %10.1f %10.1f %10.1f %10.1f %10.1f\n",
+                   cases[i].name, (unsigned long long)r.iters,
+                   r.min, r.median, r.mean, r.stddev, r.max);
+        }
+        fflush(stdout);
+    }
+
+    pthread_mutex_destroy(&ctx->lock);
+    pthread_mutex_destroy(&ctx->channels_lock);
+    pthread_mutex_destroy(&ctx->clients_lock);
+    pthread_mutex_destroy(&ctx->nicks_lock);
+    pthread_mutex_destroy(&ctx->operators_lock);
+    for (int i = 0; i < SOCKET_LOCKS; i++)
+    {
+        pthread_mutex_destroy(&ctx->socket_locks[i]);
+    }
+    free(ctx);
+
+    return EXIT_SUCCESS;
+}
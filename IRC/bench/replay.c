@@ -0,0 +1,787 @@
+/*
+ *
+ *  chirc-replay: replays a traffic capture against a chirc server
+ *
+ *  Reads a capture written by chirc -R and plays it back: a connection is
+ *  opened for every connection of the capture, sends the lines it sent and
+ *  is closed when it was, on the captured schedule scaled by -x, or as fast
+ *  as the server takes them with -x 0. The time between the segments of
+ *  two processes (a restart, or a live upgrade) is skipped. Connections
+ *  handed over by a live upgrade are not replayed: their registration is
+ *  in the previous segment, under another number.
+ *
+ *  Every -L lines, a registered connection also sends a probe, an unknown
+ *  command carrying the CLOCK_MONOTONIC time it was sent, which comes back
+ *  in the server's ERR_UNKNOWNCOMMAND: the time it took is the time the
+ *  server took to get through the lines sent before it on the connection.
+ *  After the last line, every connection left open sends a last probe: the
+ *  server is done with the capture when they are all answered and it has
+ *  closed the connections closed in the capture. The tool reports the rate
+ *  the lines were sent and processed at, how late they were sent compared
+ *  to the schedule and the probe latency percentiles, or a single JSON
+ *  object with -J.
+ *
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <time.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+
+#include "../src/capture.h"
+#include "../lib/sds/sds.h"
+
+#define RP_SUB_BITS 4
+#define RP_SUB_BUCKETS (1 << RP_SUB_BITS)     /* Histogram precision ~6% */
+#define RP_BUCKETS (RP_SUB_BUCKETS * 61)
+#define RP_MAX_EVENTS 256
+#define RP_READ_CHUNK 16384
+#define RP_PROBE "RPLAT"                      /* Probe command, followed by the time it was sent */
+#define RP_MAX_QUEUED (64 * 1024)             /* Bytes queued on a connection past which -x 0 waits */
+
+/* Command line configuration */
+typedef struct rp_config
+{
+    char *host;
+    char *port;
+    char *file;
+    double speed;           /* Schedule speed-up, 0 for as fast as possible */
+    int probe_every;        /* Lines between two probes of a connection, 0 for none */
+    double drain;           /* Most seconds to wait for the server after the last line */
+    bool json;
+} rp_config;
+
+/* Log-linear latency histogram, in nanoseconds */
+typedef struct rp_hist
+{
+    uint64_t buckets[RP_BUCKETS];
+    uint64_t count;
+    uint64_t max;
+    double sum;
+} rp_hist;
+
+/* A record of the capture, with its time from the start of the capture */
+typedef struct rp_event
+{
+    uint64_t t_ns;
+    char type;              /* CAPTURE_OPEN, CAPTURE_LINE or CAPTURE_CLOSE */
+    uint32_t conn;          /* Index in the connections of the whole capture */
+    uint32_t len;
+    const char *line;       /* In the mapped capture */
+} rp_event;
+
+typedef struct rp_conn
+{
+    int fd;                 /* -1 when not open */
+    sds inbuf;
+    sds outbuf;
+    bool want_write;        /* EPOLLOUT is armed */
+    bool registered;        /* RPL_WELCOME received */
+    bool closing;           /* Closed in the capture, shut down for writing once outbuf is sent */
+    bool skipped;           /* Handed over by a live upgrade, not replayed */
+    bool quit;              /* QUIT was sent, a probe would not be answered */
+    bool user_sent;         /* USER was sent, registration is expected */
+    bool last_probe;        /* The probe after the last line was sent */
+    int since_probe;        /* Lines sent since the last probe */
+} rp_conn;
+
+static rp_config cfg;
+static struct addrinfo *server_addr;
+static int epfd;
+static rp_hist lag_hist, probe_hist;
+static uint64_t sent_lines, sent_bytes, probes_sent, skipped_lines, errors;
+static int open_conns, closing_conns;
+
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+
+static int hist_index(uint64_t v)
+{
+    if (v < RP_SUB_BUCKETS)
+    {
+        return (int)v;
+    }
+    int msb = 63 - __builtin_clzll(v);
+    int shift = msb - RP_SUB_BITS;
+    return (shift + 1) * RP_SUB_BUCKETS + (int)((v >> shift) & (RP_SUB_BUCKETS - 1));
+}
+
+
+static uint64_t hist_value(int index)
+{
+    /* Lower bound of the bucket */
+    if (index < RP_SUB_BUCKETS)
+    {
+        return index;
+    }
+    int shift = index / RP_SUB_BUCKETS - 1;
+    return (uint64_t)(RP_SUB_BUCKETS + index % RP_SUB_BUCKETS) << shift;
+}
+
+
+static void hist_record(rp_hist *h, uint64_t v)
+{
+    h->buckets[hist_index(v)]++;
+    h->count++;
+    h->sum += v;
+    if (v > h->max)
+    {
+        h->max = v;
+    }
+}
+
+
+static double hist_percentile_us(rp_hist *h, double pct)
+{
+    if (h->count == 0)
+    {
+        return 0;
+    }
+    uint64_t rank = (uint64_t)ceil(h->count * pct / 100.0);
+    uint64_t seen = 0;
+    for (int i = 0; i < RP_BUCKETS; i++)
+    {
+        seen += h->buckets[i];
+        if (seen >= rank && h->buckets[i] > 0)
+        {
+            uint64_t v = hist_value(i);
+            return (v > h->max ? h->max : v) / 1000.0;
+        }
+    }
+    return h->max / 1000.0;
+}
+
+
+static double hist_mean_us(rp_hist *h)
+{
+    return h->count ? h->sum / h->count / 1000.0 : 0;
+}
+
+
+static rp_event *load_capture(const char *path, int *nevents, uint32_t *nconns, uint8_t **flags)
+{
+    /*
+     * load_capture - Map a capture and decode its records
+     *
+     * Return: the events in capture order, or NULL if the file is not a
+     * capture. A record cut short at the end, as the server was writing it,
+     * ends the capture.
+     */
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+
+    if (fd == -1 || fstat(fd, &st) == -1)
+    {
+        perror(path);
+        return NULL;
+    }
+    size_t magic_len = sizeof(CAPTURE_MAGIC) - 1;
+    if ((size_t)st.st_size < magic_len + sizeof(uint32_t))
+    {
+        fprintf(stderr, "ERROR: %s is not a capture file\n", path);
+        close(fd);
+        return NULL;
+    }
+    const unsigned char *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED)
+    {
+        perror("mmap");
+        return NULL;
+    }
+
+    uint32_t version;
+    memcpy(&version, data + magic_len, sizeof version);
+    if (memcmp(data, CAPTURE_MAGIC, magic_len) != 0 || version != CAPTURE_VERSION)
+    {
+        fprintf(stderr, "ERROR: %s is not a capture file of version %d\n", path, CAPTURE_VERSION);
+        return NULL;
+    }
+
+    const unsigned char *p = data + magic_len + sizeof version, *end = data + st.st_size;
+    int cap = 1024, n = 0;
+    rp_event *events = malloc(cap * sizeof(rp_event));
+    uint32_t flags_cap = 1024;
+    *flags = calloc(flags_cap, 1);
+    *nconns = 0;
+    uint32_t base = 0;          /* Index of the connections numbered 0 in this segment */
+    uint64_t t = 0;
+    bool started = false;
+
+    while (p < end)
+    {
+        const unsigned char *record = p;
+        char type = *p++;
+        uint64_t dt, id, v = 0;
+
+        if (type == CAPTURE_START)
+        {
+            if (!capture_get_varint(&p, end, &v))
+            {
+                p = record;
+                break;
+            }
+            /* Numbers start again from 1 in the segment of a new process */
+            base = *nconns;
+            started = true;
+            continue;
+        }
+        if (!started || (type != CAPTURE_OPEN && type != CAPTURE_LINE && type != CAPTURE_CLOSE))
+        {
+            fprintf(stderr, "ERROR: bad record at offset %td\n", record - data);
+            free(events);
+            return NULL;
+        }
+        if (!capture_get_varint(&p, end, &dt) || !capture_get_varint(&p, end, &id) ||
+            (type != CAPTURE_CLOSE && !capture_get_varint(&p, end, &v)) ||
+            (type == CAPTURE_LINE && v > (uint64_t)(end - p)))
+        {
+            p = record;
+            break;
+        }
+
+        if (n == cap)
+        {
+            cap *= 2;
+            events = realloc(events, cap * sizeof(rp_event));
+        }
+        t += dt * 1000;
+        events[n] = (rp_event){.t_ns = t, .type = type, .conn = base + (uint32_t)id};
+        if (base + id >= *nconns)
+        {
+            *nconns = base + id + 1;
+        }
+        if (*nconns > flags_cap)
+        {
+            uint32_t old = flags_cap;
+            while (flags_cap < *nconns)
+            {
+                flags_cap *= 2;
+            }
+            *flags = realloc(*flags, flags_cap);
+            memset(*flags + old, 0, flags_cap - old);
+        }
+        if (type == CAPTURE_OPEN)
+        {
+            (*flags)[base + id] = (uint8_t)v;
+        }
+        else if (type == CAPTURE_LINE)
+        {
+            events[n].len = (uint32_t)v;
+            events[n].line = (const char *)p;
+            p += v;
+        }
+        n++;
+    }
+    if (p < end)
+    {
+        fprintf(stderr, "Warning: the last record is cut short, %td bytes ignored\n", end - p);
+    }
+
+    *nevents = n;
+    return events;
+}
+
+
+static void conn_close(rp_conn *c)
+{
+    if (c->fd != -1)
+    {
+        epoll_ctl(epfd, EPOLL_CTL_DEL, c->fd, NULL);
+        close(c->fd);
+        c->fd = -1;
+        open_conns--;
+        closing_conns -= c->closing;
+    }
+}
+
+
+static void conn_flush(rp_conn *c)
+{
+    /*
+     * conn_flush - Write as much of the output buffer as the socket takes,
+     * and wait for EPOLLOUT if some is left
+     */
+    size_t off = 0, len = sdslen(c->outbuf);
+
+    while (off < len)
+    {
+        ssize_t n = send(c->fd, c->outbuf + off, len - off, MSG_NOSIGNAL);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+            {
+                errors++;
+                off = len;
+            }
+            break;
+        }
+        off += n;
+    }
+    sdsrange(c->outbuf, off, -1);
+
+    if (sdslen(c->outbuf) == 0 && c->closing)
+    {
+        /* Like the client going away; the replies are read until the
+         * server closes, since closing with unread input would reset the
+         * connection and lose the last lines sent */
+        shutdown(c->fd, SHUT_WR);
+    }
+
+    bool want_write = sdslen(c->outbuf) > 0;
+    if (want_write != c->want_write)
+    {
+        struct epoll_event ev = {.events = EPOLLIN | (want_write ? EPOLLOUT : 0), .data.ptr = c};
+        epoll_ctl(epfd, EPOLL_CTL_MOD, c->fd, &ev);
+        c->want_write = want_write;
+    }
+}
+
+
+static void handle_line(rp_conn *c, char *line, uint64_t now)
+{
+    char *cmd = strchr(line, ' ');
+
+    if (cmd == NULL)
+    {
+        return;
+    }
+    cmd++;
+    if (!strncmp(cmd, "001 ", 4))
+    {
+        c->registered = true;
+    }
+    else if (!strncmp(cmd, "421 ", 4))
+    {
+        char *probe = strstr(cmd, " " RP_PROBE);
+        if (probe != NULL)
+        {
+            uint64_t sent = strtoull(probe + 1 + strlen(RP_PROBE), NULL, 10);
+            hist_record(&probe_hist, now - sent);
+        }
+    }
+}
+
+
+static void conn_read(rp_conn *c)
+{
+    /*
+     * conn_read - Read everything available and process complete lines,
+     * closing the connection when the server did
+     */
+    char buf[RP_READ_CHUNK];
+    bool closed = false;
+
+    for (;;)
+    {
+        ssize_t n = recv(c->fd, buf, sizeof buf, 0);
+        if (n < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (n <= 0)
+        {
+            closed = n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK);
+            break;
+        }
+        c->inbuf = sdscatlen(c->inbuf, buf, n);
+
+        uint64_t now = now_ns();
+        size_t start = 0, len = sdslen(c->inbuf);
+        char *eol;
+
+        while ((eol = memchr(c->inbuf + start, '\n', len - start)) != NULL)
+        {
+            *eol = '\0';
+            if (eol > c->inbuf + start && eol[-1] == '\r')
+            {
+                eol[-1] = '\0';
+            }
+            handle_line(c, c->inbuf + start, now);
+            start = eol - c->inbuf + 1;
+        }
+        sdsrange(c->inbuf, start, -1);
+    }
+
+    /* After the lines that came with the end of the connection */
+    if (closed)
+    {
+        conn_close(c);
+    }
+}
+
+
+static void poll_once(int timeout_ms)
+{
+    struct epoll_event events[RP_MAX_EVENTS];
+    int n = epoll_wait(epfd, events, RP_MAX_EVENTS, timeout_ms);
+
+    for (int i = 0; i < n; i++)
+    {
+        rp_conn *c = events[i].data.ptr;
+
+        if (c->fd != -1 && (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)))
+        {
+            conn_read(c);
+        }
+        if (c->fd != -1 && (events[i].events & EPOLLOUT))
+        {
+            conn_flush(c);
+        }
+    }
+}
+
+
+static void conn_open(rp_conn *c)
+{
+    int one = 1;
+
+    /* Without waiting for the handshake, so a server slow to accept does
+     * not hold the other connections back: lines queue until it is done */
+    c->fd = socket(server_addr->ai_family, server_addr->ai_socktype | SOCK_NONBLOCK, server_addr->ai_protocol);
+    if (c->fd == -1 ||
+        (connect(c->fd, server_addr->ai_addr, server_addr->ai_addrlen) == -1 && errno != EINPROGRESS))
+    {
+        perror("Could not connect to server");
+        if (c->fd != -1)
+        {
+            close(c->fd);
+            c->fd = -1;
+        }
+        errors++;
+        return;
+    }
+    setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof one);
+
+    struct epoll_event ev = {.events = EPOLLIN, .data.ptr = c};
+    epoll_ctl(epfd, EPOLL_CTL_ADD, c->fd, &ev);
+    open_conns++;
+}
+
+
+static void run_event(rp_event *e, rp_conn *c, uint64_t due)
+{
+    switch (e->type)
+    {
+    case CAPTURE_OPEN:
+        if (!c->skipped)
+        {
+            conn_open(c);
+        }
+        break;
+    case CAPTURE_LINE:
+        if (c->skipped || c->fd == -1)
+        {
+            skipped_lines++;
+            break;
+        }
+        c->outbuf = sdscatlen(c->outbuf, e->line, e->len);
+        c->quit |= e->len >= 4 && !strncasecmp(e->line, "QUIT", 4) && (e->len == 4 || e->line[4] == ' ');
+        c->user_sent |= e->len > 5 && !strncasecmp(e->line, "USER ", 5);
+        c->outbuf = sdscatlen(c->outbuf, "\r\n", 2);
+        sent_lines++;
+        sent_bytes += e->len + 2;
+        if (cfg.speed > 0)
+        {
+            uint64_t now = now_ns();
+            hist_record(&lag_hist, now > due ? now - due : 0);
+        }
+        if (cfg.probe_every > 0 && c->registered && !c->quit && ++c->since_probe >= cfg.probe_every)
+        {
+            c->outbuf = sdscatprintf(c->outbuf, RP_PROBE "%llu\r\n", (unsigned long long)now_ns());
+            c->since_probe = 0;
+            probes_sent++;
+        }
+        conn_flush(c);
+        break;
+    case CAPTURE_CLOSE:
+        if (c->fd != -1 && !c->closing)
+        {
+            c->closing = true;
+            closing_conns++;
+            conn_flush(c);
+        }
+        break;
+    }
+}
+
+
+static void print_report(int nevents, uint32_t opened, uint32_t replayed, uint64_t captured_ns, uint64_t elapsed_ns,
+                         uint64_t done_ns)
+{
+    /*
+     * print_report - elapsed_ns is the time the lines took to be sent,
+     * done_ns the time until the server answered the last probes and
+     * closed the connections closed in the capture, 0 if it did not
+     * within the drain time
+     */
+    double elapsed = elapsed_ns / 1e9, done = done_ns / 1e9;
+    double rate = elapsed > 0 ? sent_lines / elapsed : 0;
+    double done_rate = done > 0 ? sent_lines / done : 0;
+
+    if (cfg.json)
+    {
+        printf("{\"file\": \"%s\", \"records\": %d, \"connections\": %u, \"replayed\": %u, \"speed\": %g, "
+               "\"captured_s\": %.3f, \"elapsed_s\": %.3f, "
+               "\"sent\": {\"lines\": %llu, \"bytes\": %llu, \"per_sec\": %.1f, \"skipped\": %llu}, "
+               "\"processed\": {\"complete\": %s, \"seconds\": %.3f, \"per_sec\": %.1f}, "
+               "\"errors\": %llu, "
+               "\"lag_us\": {\"mean\": %.1f, \"p50\": %.1f, \"p90\": %.1f, \"p99\": %.1f, \"max\": %.1f}, "
+               "\"probes\": {\"sent\": %llu, \"answered\": %llu}, "
+               "\"latency_us\": {\"mean\": %.1f, \"p50\": %.1f, \"p90\": %.1f, \"p99\": %.1f, "
+               "\"p999\": %.1f, \"max\": %.1f}}\n",
+               cfg.file, nevents, opened, replayed, cfg.speed, captured_ns / 1e9, elapsed,
+               (unsigned long long)sent_lines, (unsigned long long)sent_bytes, rate,
+               (unsigned long long)skipped_lines, done_ns > 0 ? "true" : "false", done, done_rate,
+               (unsigned long long)errors,
+               hist_mean_us(&lag_hist), hist_percentile_us(&lag_hist, 50), hist_percentile_us(&lag_hist, 90),
+               hist_percentile_us(&lag_hist, 99), lag_hist.max / 1000.0,
+               (unsigned long long)probes_sent, (unsigned long long)probe_hist.count,
+               hist_mean_us(&probe_hist), hist_percentile_us(&probe_hist, 50),
+               hist_percentile_us(&probe_hist, 90), hist_percentile_us(&probe_hist, 99),
+               hist_percentile_us(&probe_hist, 99.9), probe_hist.max / 1000.0);
+    }
+    else
+    {
+        printf("Capture:     %d records, %u connections (%u replayed), %.1fs captured\n",
+               nevents, opened, replayed, captured_ns / 1e9);
+        char speed[32];
+        snprintf(speed, sizeof speed, cfg.speed > 0 ? "%gx" : "full", cfg.speed);
+        printf("Sent:        %llu lines, %llu bytes in %.2fs (%.1f lines/s) at %s speed\n",
+               (unsigned long long)sent_lines, (unsigned long long)sent_bytes, elapsed, rate, speed);
+        if (done_ns > 0)
+        {
+            printf("Processed:   all lines in %.2fs (%.1f lines/s)\n", done, done_rate);
+        }
+        else
+        {
+            printf("Processed:   not all lines within the drain time (-D)\n");
+        }
+        printf("Skipped:     %llu lines   Errors: %llu\n",
+               (unsigned long long)skipped_lines, (unsigned long long)errors);
+        if (cfg.speed > 0)
+        {
+            printf("Lag:         mean %.1fus p50 %.1fus p90 %.1fus p99 %.1fus max %.1fus\n",
+                   hist_mean_us(&lag_hist), hist_percentile_us(&lag_hist, 50),
+                   hist_percentile_us(&lag_hist, 90), hist_percentile_us(&lag_hist, 99),
+                   lag_hist.max / 1000.0);
+        }
+        printf("Probes:      %llu sent, %llu answered\n",
+               (unsigned long long)probes_sent, (unsigned long long)probe_hist.count);
+        printf("Latency:     mean %.1fus p50 %.1fus p90 %.1fus p99 %.1fus p99.9 %.1fus max %.1fus\n",
+               hist_mean_us(&probe_hist), hist_percentile_us(&probe_hist, 50),
+               hist_percentile_us(&probe_hist, 90), hist_percentile_us(&probe_hist, 99),
+               hist_percentile_us(&probe_hist, 99.9), probe_hist.max / 1000.0);
+    }
+}
+
+
+static void usage(void)
+{
+    printf("Usage: chirc-replay [-H HOST] [-p PORT] [-x SPEED] [-L LINES] [-D DRAIN] [-J] CAPTURE_FILE\n"
+           "\n"
+           "  -H  server host (default 127.0.0.1)   -p  server port (default 6667)\n"
+           "  -x  speed-up of the captured schedule, 0 for as fast as possible (default 1)\n"
+           "  -L  lines between two latency probes of a connection, 0 for none (default 10)\n"
+           "  -D  most seconds to wait, after the last line, for the server to be done\n"
+           "      with everything (default 10)\n"
+           "  -J  print results as JSON\n");
+}
+
+
+int main(int argc, char *argv[])
+{
+    int opt;
+
+    cfg = (rp_config){.host = "127.0.0.1", .port = "6667", .speed = 1, .probe_every = 10, .drain = 10};
+
+    while ((opt = getopt(argc, argv, "H:p:x:L:D:Jh")) != -1)
+        switch (opt)
+        {
+        case 'H':
+            cfg.host = optarg;
+            break;
+        case 'p':
+            cfg.port = optarg;
+            break;
+        case 'x':
+            cfg.speed = atof(optarg);
+            break;
+        case 'L':
+            cfg.probe_every = atoi(optarg);
+            break;
+        case 'D':
+            cfg.drain = atof(optarg);
+            break;
+        case 'J':
+            cfg.json = true;
+            break;
+        case 'h':
+            usage();
+            exit(0);
+            break;
+        default:
+            usage();
+            exit(-1);
+        }
+
+    if (optind != argc - 1 || cfg.speed < 0 || cfg.probe_every < 0 || cfg.drain < 0)
+    {
+        usage();
+        exit(-1);
+    }
+    cfg.file = argv[optind];
+
+    int nevents;
+    uint32_t nconns;
+    uint8_t *flags;
+    rp_event *events = load_capture(cfg.file, &nevents, &nconns, &flags);
+    if (events == NULL)
+    {
+        exit(-1);
+    }
+
+    /* Every connection open at once needs a descriptor */
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < (rlim_t)nconns + 64)
+    {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+
+    struct addrinfo hints = {.ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM};
+    int rc = getaddrinfo(cfg.host, cfg.port, &hints, &server_addr);
+    if (rc != 0)
+    {
+        fprintf(stderr, "ERROR: getaddrinfo: %s\n", gai_strerror(rc));
+        exit(-1);
+    }
+
+    rp_conn *conns = calloc(nconns ? nconns : 1, sizeof(rp_conn));
+    uint32_t opened = 0, replayed = 0;
+    for (uint32_t i = 0; i < nconns; i++)
+    {
+        conns[i].fd = -1;
+        conns[i].inbuf = sdsempty();
+        conns[i].outbuf = sdsempty();
+        conns[i].skipped = flags[i] & CAPTURE_HANDED_OVER;
+    }
+    for (int i = 0; i < nevents; i++)
+    {
+        opened += events[i].type == CAPTURE_OPEN;
+        replayed += events[i].type == CAPTURE_OPEN && !conns[events[i].conn].skipped;
+    }
+
+    epfd = epoll_create1(0);
+    uint64_t start = now_ns();
+    uint64_t first = nevents > 0 ? events[0].t_ns : 0;
+
+    for (int i = 0; i < nevents; i++)
+    {
+        uint64_t due = start;
+        if (cfg.speed > 0)
+        {
+            due += (uint64_t)((events[i].t_ns - first) / cfg.speed);
+            /* Serve the connections until the record is due */
+            for (uint64_t now = now_ns(); now < due; now = now_ns())
+            {
+                uint64_t wait_ms = (due - now) / 1000000;
+                poll_once(wait_ms > 0 ? (int)wait_ms : 0);
+                if (wait_ms == 0)
+                {
+                    break;
+                }
+            }
+        }
+        else
+        {
+            /* As fast as the server takes the lines: wait while it is behind on this connection */
+            while (conns[events[i].conn].fd != -1 && sdslen(conns[events[i].conn].outbuf) > RP_MAX_QUEUED)
+            {
+                poll_once(10);
+            }
+            if (i % 64 == 0)
+            {
+                poll_once(0);
+            }
+        }
+        run_event(&events[i], &conns[events[i].conn], due);
+    }
+    uint64_t end = now_ns();
+
+    /* A last probe on the connections left open, once registered, tells
+     * when the server is done with everything; the others are done when
+     * the server closes them */
+    uint64_t drain_end = end + (uint64_t)(cfg.drain * 1e9), done;
+    bool complete = false;
+    for (done = now_ns(); !complete && done < drain_end; done = now_ns())
+    {
+        int unregistered = 0;
+        for (uint32_t i = 0; i < nconns && cfg.probe_every > 0; i++)
+        {
+            rp_conn *c = &conns[i];
+            if (c->fd == -1 || c->closing || c->quit || c->last_probe)
+            {
+                continue;
+            }
+            if (c->registered)
+            {
+                c->outbuf = sdscatprintf(c->outbuf, RP_PROBE "%llu\r\n", (unsigned long long)now_ns());
+                c->last_probe = true;
+                probes_sent++;
+                conn_flush(c);
+            }
+            else
+            {
+                unregistered += c->user_sent;
+            }
+        }
+        complete = unregistered == 0 && probe_hist.count >= probes_sent && closing_conns == 0;
+        if (!complete)
+        {
+            poll_once((int)((drain_end - done) / 1000000) + 1);
+        }
+    }
+
+    print_report(nevents, opened, replayed, nevents > 0 ? events[nevents - 1].t_ns - first : 0,
+                 end - start, complete ? done - start : 0);
+
+    for (uint32_t i = 0; i < nconns; i++)
+    {
+        conn_close(&conns[i]);
+        sdsfree(conns[i].inbuf);
+        sdsfree(conns[i].outbuf);
+    }
+    freeaddrinfo(server_addr);
+    free(conns);
+    free(flags);
+    free(events);
+    return errors == 0 ? 0 : 1;
+}
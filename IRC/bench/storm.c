@@ -0,0 +1,397 @@
+/*
+ *
+ *  chirc-storm: reconnect storm against a chirc server
+ *
+ *  Opens -n connections, as clients reconnecting all at once after a
+ *  network blip would: each one connects, registers, waits for the welcome
+ *  and quits, and -c of them are in flight at any time (all of them by
+ *  default). The tool reports the rate connections were welcomed at, the
+ *  percentiles of the time from connect() to the welcome, the connections
+ *  that took over a second (a SYN dropped by a full listen queue is sent
+ *  again after one) and those that failed. The kernel's count of listen
+ *  queue overflows is read before and after, so the server must run on
+ *  the same host.
+ *
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+
+#define ST_MAX_EVENTS 256
+#define ST_SLOW_NS 1000000000ULL    /* A SYN dropped is sent again after a second */
+
+/* Command line configuration */
+typedef struct st_config
+{
+    char *host;
+    char *port;
+    int connections;        /* Connections of the storm */
+    int concurrency;        /* Connections in flight at once */
+    int timeout_s;          /* A connection not welcomed by then has failed */
+    bool json;
+} st_config;
+
+/* A connection in flight */
+typedef struct st_conn
+{
+    int fd;                 /* -1 when the slot is free */
+    int index;              /* Number of the connection in the storm */
+    bool connected;
+    uint64_t start_ns;      /* When connect() was called */
+    char buf[1024];         /* Tail of what was received */
+    size_t have;
+} st_conn;
+
+static st_config cfg;
+static struct addrinfo *server_addr;
+static int epfd;
+static uint64_t *latencies;     /* connect() to welcome of each connection, in ns */
+static int welcomed, failed, slow, started;
+
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+
+/* The kernel's count of connections dropped by a full listen queue, -1 if
+ * it cannot be read */
+static long long listen_overflows(void)
+{
+    FILE *f = fopen("/proc/net/netstat", "r");
+    char names[4096], values[4096];
+    long long result = -1;
+
+    if (f == NULL)
+    {
+        return -1;
+    }
+    /* Pairs of lines: the field names, then their values */
+    while (fgets(names, sizeof names, f) != NULL && fgets(values, sizeof values, f) != NULL)
+    {
+        if (strncmp(names, "TcpExt:", 7) != 0)
+        {
+            continue;
+        }
+        char *n_save, *v_save;
+        char *n = strtok_r(names, " \n", &n_save), *v = strtok_r(values, " \n", &v_save);
+        while (n != NULL && v != NULL)
+        {
+            if (strcmp(n, "ListenOverflows") == 0)
+            {
+                result = atoll(v);
+            }
+            n = strtok_r(NULL, " \n", &n_save);
+            v = strtok_r(NULL, " \n", &v_save);
+        }
+    }
+    fclose(f);
+
+    return result;
+}
+
+
+static void conn_close(st_conn *c)
+{
+    epoll_ctl(epfd, EPOLL_CTL_DEL, c->fd, NULL);
+    close(c->fd);
+    c->fd = -1;
+}
+
+
+static void conn_fail(st_conn *c)
+{
+    failed++;
+    conn_close(c);
+}
+
+
+/* Start the next connection of the storm in a free slot */
+static void conn_open(st_conn *c)
+{
+    int yes = 1;
+
+    c->index = started++;
+    c->connected = false;
+    c->have = 0;
+    c->start_ns = now_ns();
+    c->fd = socket(server_addr->ai_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (c->fd == -1)
+    {
+        perror("socket");
+        failed++;
+        return;
+    }
+    setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof yes);
+    if (connect(c->fd, server_addr->ai_addr, server_addr->ai_addrlen) == -1 && errno != EINPROGRESS)
+    {
+        conn_fail(c);
+        return;
+    }
+
+    struct epoll_event ev = {.events = EPOLLOUT | EPOLLIN, .data.ptr = c};
+    epoll_ctl(epfd, EPOLL_CTL_ADD, c->fd, &ev);
+}
+
+
+/* The connection is established: register */
+static void conn_connected(st_conn *c)
+{
+    char reg[128];
+    int err = 0;
+    socklen_t len = sizeof err;
+
+    if (getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &err, &len) == -1 || err != 0)
+    {
+        conn_fail(c);
+        return;
+    }
+    c->connected = true;
+
+    /* Nicks of their own, so several storms can run at once */
+    int n = snprintf(reg, sizeof reg, "NICK st%x_%d\r\nUSER st%d * * :chirc reconnect storm\r\n",
+                     (unsigned)getpid() & 0xfff, c->index, c->index);
+    if (send(c->fd, reg, n, MSG_NOSIGNAL) != n)
+    {
+        conn_fail(c);
+        return;
+    }
+
+    struct epoll_event ev = {.events = EPOLLIN, .data.ptr = c};
+    epoll_ctl(epfd, EPOLL_CTL_MOD, c->fd, &ev);
+}
+
+
+/* Read the replies, and quit once welcomed */
+static void conn_read(st_conn *c)
+{
+    ssize_t n = recv(c->fd, c->buf + c->have, sizeof c->buf - 1 - c->have, 0);
+
+    if (n == -1 && (errno == EAGAIN || errno == EINTR))
+    {
+        return;
+    }
+    if (n <= 0)
+    {
+        conn_fail(c);
+        return;
+    }
+    c->have += n;
+    c->buf[c->have] = '\0';
+
+    if (strstr(c->buf, " 001 ") != NULL)
+    {
+        uint64_t took = now_ns() - c->start_ns;
+
+        latencies[welcomed++] = took;
+        slow += took >= ST_SLOW_NS;
+        send(c->fd, "QUIT\r\n", 6, MSG_NOSIGNAL);
+        conn_close(c);
+        return;
+    }
+    if (c->have > sizeof c->buf / 2)
+    {
+        /* Keep the tail, where a reply may be cut */
+        memmove(c->buf, c->buf + c->have - 64, 64);
+        c->have = 64;
+    }
+}
+
+
+static int compare_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+
+static double percentile_ms(double pct)
+{
+    if (welcomed == 0)
+    {
+        return 0;
+    }
+    int rank = (int)(welcomed * pct / 100.0);
+    return latencies[rank < welcomed ? rank : welcomed - 1] / 1e6;
+}
+
+
+static void usage(void)
+{
+    printf("Usage: chirc-storm [-H HOST] [-p PORT] [-n CONNECTIONS] [-c CONCURRENCY] [-T TIMEOUT] [-J]\n"
+           "\n"
+           "  -H  server host (default 127.0.0.1)   -p  server port (default 6667)\n"
+           "  -n  connections of the storm (default 5000)\n"
+           "  -c  connections in flight at once (default: all of them)\n"
+           "  -T  seconds a connection has to be welcomed (default 30)\n"
+           "  -J  print the results as JSON\n");
+}
+
+
+int main(int argc, char *argv[])
+{
+    int opt;
+
+    cfg = (st_config){.host = "127.0.0.1", .port = "6667", .connections = 5000, .concurrency = 0,
+                      .timeout_s = 30, .json = false};
+
+    while ((opt = getopt(argc, argv, "H:p:n:c:T:Jh")) != -1)
+        switch (opt)
+        {
+        case 'H':
+            cfg.host = optarg;
+            break;
+        case 'p':
+            cfg.port = optarg;
+            break;
+        case 'n':
+            cfg.connections = atoi(optarg);
+            break;
+        case 'c':
+            cfg.concurrency = atoi(optarg);
+            break;
+        case 'T':
+            cfg.timeout_s = atoi(optarg);
+            break;
+        case 'J':
+            cfg.json = true;
+            break;
+        case 'h':
+            usage();
+            exit(0);
+        default:
+            usage();
+            exit(-1);
+        }
+
+    if (cfg.connections < 1 || cfg.concurrency < 0 || cfg.timeout_s < 1)
+    {
+        fprintf(stderr, "ERROR: CONNECTIONS and TIMEOUT must be at least 1\n");
+        exit(-1);
+    }
+    if (cfg.concurrency == 0 || cfg.concurrency > cfg.connections)
+    {
+        cfg.concurrency = cfg.connections;
+    }
+
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < (rlim_t)cfg.concurrency + 16)
+    {
+        rl.rlim_cur = rl.rlim_max < (rlim_t)cfg.concurrency + 16 ? rl.rlim_max : (rlim_t)cfg.concurrency + 16;
+        setrlimit(RLIMIT_NOFILE, &rl);
+        if (rl.rlim_cur < (rlim_t)cfg.concurrency + 16)
+        {
+            fprintf(stderr, "ERROR: only %llu file descriptors, raise ulimit -n\n", (unsigned long long)rl.rlim_cur);
+            exit(-1);
+        }
+    }
+
+    struct addrinfo hints = {.ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM};
+    if (getaddrinfo(cfg.host, cfg.port, &hints, &server_addr) != 0)
+    {
+        fprintf(stderr, "ERROR: cannot resolve %s:%s\n", cfg.host, cfg.port);
+        exit(-1);
+    }
+
+    epfd = epoll_create1(EPOLL_CLOEXEC);
+    latencies = malloc(cfg.connections * sizeof(uint64_t));
+    st_conn *conns = calloc(cfg.concurrency, sizeof(st_conn));
+    struct epoll_event events[ST_MAX_EVENTS];
+    uint64_t timeout_ns = (uint64_t)cfg.timeout_s * 1000000000ULL;
+    long long overflows = listen_overflows();
+    uint64_t start = now_ns(), last_check = start;
+
+    for (int i = 0; i < cfg.concurrency; i++)
+    {
+        conn_open(&conns[i]);
+    }
+
+    while (welcomed + failed < cfg.connections)
+    {
+        int n = epoll_wait(epfd, events, ST_MAX_EVENTS, 100);
+
+        for (int i = 0; i < n; i++)
+        {
+            st_conn *c = events[i].data.ptr;
+
+            if (c->fd == -1)
+            {
+                continue;
+            }
+            if (!c->connected)
+            {
+                conn_connected(c);
+            }
+            else if (events[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP))
+            {
+                conn_read(c);
+            }
+        }
+
+        uint64_t now = now_ns();
+        if (now - last_check >= 100000000ULL)
+        {
+            for (int i = 0; i < cfg.concurrency; i++)
+            {
+                if (conns[i].fd != -1 && now - conns[i].start_ns > timeout_ns)
+                {
+                    conn_fail(&conns[i]);
+                }
+            }
+            last_check = now;
+        }
+
+        /* The slots freed go to the next connections */
+        for (int i = 0; i < cfg.concurrency && started < cfg.connections; i++)
+        {
+            while (conns[i].fd == -1 && started < cfg.connections)
+            {
+                conn_open(&conns[i]);
+            }
+        }
+    }
+
+    double elapsed = (now_ns() - start) / 1e9;
+    long long after = listen_overflows();
+    long long dropped = overflows >= 0 && after >= 0 ? after - overflows : -1;
+
+    qsort(latencies, welcomed, sizeof(uint64_t), compare_u64);
+    if (cfg.json)
+    {
+        printf("{\"connections\":%d,\"concurrency\":%d,\"welcomed\":%d,\"failed\":%d,\"seconds\":%.3f,"
+               "\"per_second\":%.1f,\"latency_ms\":{\"p50\":%.2f,\"p90\":%.2f,\"p99\":%.2f,\"max\":%.2f},"
+               "\"over_1s\":%d,\"listen_overflows\":%lld}\n",
+               cfg.connections, cfg.concurrency, welcomed, failed, elapsed, welcomed / elapsed,
+               percentile_ms(50), percentile_ms(90), percentile_ms(99), percentile_ms(100), slow, dropped);
+    }
+    else
+    {
+        printf("Storm:       %d connections, %d in flight, %s:%s\n", cfg.connections, cfg.concurrency,
+               cfg.host, cfg.port);
+        printf("Welcomed:    %d in %.2fs (%.1f/s), %d failed\n", welcomed, elapsed, welcomed / elapsed, failed);
+        printf("Latency:     p50 %.2fms p90 %.2fms p99 %.2fms max %.2fms, %d over 1s\n",
+               percentile_ms(50), percentile_ms(90), percentile_ms(99), percentile_ms(100), slow);
+        printf("Overflows:   %lld SYNs or connections dropped by a full listen queue\n", dropped);
+    }
+
+    freeaddrinfo(server_addr);
+    free(conns);
+    free(latencies);
+    return failed == 0 ? 0 : 1;
+}
@@ -0,0 +1,270 @@
+/*
+ *
+ *  chirc-tlsbench: TLS handshake rate of chirc's TLS port
+ *
+ *  Opens connections one after the other, as a client reconnecting in a
+ *  loop would: each one does the TLS handshake, registers, waits for the
+ *  welcome and quits. The run is done twice, first with a full handshake
+ *  every time, then resuming the session of the previous connection, and
+ *  the handshake rate of both is reported. The time of a handshake is from
+ *  connect() to the end of SSL_connect(); the registration that follows is
+ *  what lets a TLS 1.3 client receive its session ticket.
+ *
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+
+/* Command line configuration */
+typedef struct tb_config
+{
+    char *host;
+    char *port;
+    int connections;        /* Connections of each run */
+    int version;            /* TLS1_2_VERSION or TLS1_3_VERSION */
+} tb_config;
+
+/* Result of a run */
+typedef struct tb_result
+{
+    int done;               /* Connections registered */
+    int reused;             /* Of which resumed a session */
+    double handshake_s;     /* Time in connect() and SSL_connect() */
+    double total_s;         /* Time of the whole run */
+} tb_result;
+
+static tb_config cfg;
+
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+/* Connect to the server, -1 on failure */
+static int tb_connect(void)
+{
+    struct addrinfo hints = {.ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM}, *res, *p;
+    int s = -1, yes = 1;
+
+    if (getaddrinfo(cfg.host, cfg.port, &hints, &res) != 0)
+    {
+        return -1;
+    }
+    for (p = res; p != NULL; p = p->ai_next)
+    {
+        s = socket(p->ai_family, p->ai_socktype, p->ai_protocol);
+        if (s == -1)
+        {
+            continue;
+        }
+        if (connect(s, p->ai_addr, p->ai_addrlen) == 0)
+        {
+            break;
+        }
+        close(s);
+        s = -1;
+    }
+    freeaddrinfo(res);
+    if (s != -1)
+    {
+        setsockopt(s, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof yes);
+    }
+    return s;
+}
+
+
+/* Read until the welcome reply, false if the connection ends or the nick
+ * is taken first */
+static bool tb_welcome(SSL *ssl)
+{
+    char buf[4096];
+    size_t have = 0;
+    int n;
+
+    while ((n = SSL_read(ssl, buf + have, sizeof buf - 1 - have)) > 0)
+    {
+        have += n;
+        buf[have] = '\0';
+        if (strstr(buf, " 001 ") != NULL)
+        {
+            return true;
+        }
+        if (strstr(buf, " 433 ") != NULL)
+        {
+            return false;
+        }
+        if (have > sizeof buf / 2)
+        {
+            /* Keep the tail, where a reply may be cut */
+            memmove(buf, buf + have - 64, 64);
+            have = 64;
+        }
+    }
+    return false;
+}
+
+
+/* Run cfg.connections connections in a row, resuming sessions if asked */
+static tb_result tb_run(SSL_CTX *ssl_ctx, bool resume)
+{
+    tb_result r = {0};
+    SSL_SESSION *session = NULL;
+    double start = now();
+    char reg[128];
+
+    for (int i = 0; i < cfg.connections; i++)
+    {
+        double t0 = now();
+        int s = tb_connect();
+        if (s == -1)
+        {
+            perror("connect");
+            break;
+        }
+
+        SSL *ssl = SSL_new(ssl_ctx);
+        SSL_set_fd(ssl, s);
+        if (session != NULL)
+        {
+            SSL_set_session(ssl, session);
+        }
+        if (SSL_connect(ssl) != 1)
+        {
+            ERR_print_errors_fp(stderr);
+            SSL_free(ssl);
+            close(s);
+            break;
+        }
+        r.handshake_s += now() - t0;
+        r.reused += SSL_session_reused(ssl);
+
+        /* Nicks of their own, so several benchmarks can run at once */
+        int len = snprintf(reg, sizeof reg, "NICK tb%d%c%d\r\nUSER tb%d * * :tlsbench\r\n",
+                           getpid(), resume ? 'r' : 'f', i, i);
+        if (SSL_write(ssl, reg, len) != len || !tb_welcome(ssl))
+        {
+            fprintf(stderr, "Connection %d was not welcomed\n", i);
+            SSL_free(ssl);
+            close(s);
+            break;
+        }
+        r.done++;
+
+        if (resume)
+        {
+            /* The ticket of TLS 1.3 came after the handshake, with the welcome */
+            SSL_SESSION_free(session);
+            session = SSL_get1_session(ssl);
+        }
+        SSL_write(ssl, "QUIT\r\n", 6);
+        SSL_shutdown(ssl);
+        SSL_free(ssl);
+        close(s);
+    }
+    SSL_SESSION_free(session);
+    r.total_s = now() - start;
+
+    return r;
+}
+
+
+static void report(char *name, tb_result *r)
+{
+    printf("%-8s %6d connections  %6d resumed  %9.0f handshakes/s  %7.1f us/handshake  %7.0f connections/s\n",
+           name, r->done, r->reused,
+           r->handshake_s > 0 ? r->done / r->handshake_s : 0,
+           r->done > 0 ? r->handshake_s * 1e6 / r->done : 0,
+           r->total_s > 0 ? r->done / r->total_s : 0);
+}
+
+
+static void usage(void)
+{
+    printf("Usage: chirc-tlsbench [-H HOST] [-p PORT] [-n CONNECTIONS] [-V 1.2|1.3]\n"
+           "\n"
+           "  -H  server host (default 127.0.0.1)   -p  TLS port of the server (default 6697)\n"
+           "  -n  connections per run (default 1000)\n"
+           "  -V  TLS version (default 1.3)\n");
+}
+
+
+int main(int argc, char *argv[])
+{
+    int opt;
+
+    cfg = (tb_config){.host = "127.0.0.1", .port = "6697", .connections = 1000, .version = TLS1_3_VERSION};
+
+    while ((opt = getopt(argc, argv, "H:p:n:V:h")) != -1)
+        switch (opt)
+        {
+        case 'H':
+            cfg.host = optarg;
+            break;
+        case 'p':
+            cfg.port = optarg;
+            break;
+        case 'n':
+            cfg.connections = atoi(optarg);
+            break;
+        case 'V':
+            if (!strcmp(optarg, "1.2"))
+            {
+                cfg.version = TLS1_2_VERSION;
+            }
+            else if (!strcmp(optarg, "1.3"))
+            {
+                cfg.version = TLS1_3_VERSION;
+            }
+            else
+            {
+                usage();
+                exit(-1);
+            }
+            break;
+        case 'h':
+            usage();
+            exit(0);
+        default:
+            usage();
+            exit(-1);
+        }
+
+    if (cfg.connections < 1)
+    {
+        fprintf(stderr, "ERROR: CONNECTIONS must be at least 1\n");
+        exit(-1);
+    }
+
+    /* The server's certificate is not checked: this measures its handshakes */
+    SSL_CTX *ssl_ctx = SSL_CTX_new(TLS_client_method());
+    SSL_CTX_set_min_proto_version(ssl_ctx, cfg.version);
+    SSL_CTX_set_max_proto_version(ssl_ctx, cfg.version);
+    SSL_CTX_set_verify(ssl_ctx, SSL_VERIFY_NONE, NULL);
+    SSL_CTX_set_session_cache_mode(ssl_ctx, SSL_SESS_CACHE_CLIENT);
+
+    tb_result full = tb_run(ssl_ctx, false);
+    tb_result resumed = tb_run(ssl_ctx, true);
+
+    printf("TLS %s, %s:%s\n", cfg.version == TLS1_3_VERSION ? "1.3" : "1.2", cfg.host, cfg.port);
+    report("full", &full);
+    report("resumed", &resumed);
+
+    SSL_CTX_free(ssl_ctx);
+    return full.done == cfg.connections && resumed.done == cfg.connections ? 0 : 1;
+}
@@ -691,6 +691,216 @@ sds sdscatfmt(sds s, char const *fmt, ...) {
     return s;
 }
 
+/* Byte scanning used by sdstrim() and sdssplitlen().
+ *
+ * On x86 the input is compared 16 bytes at a time with SSE2, which every
+ * x86-64 CPU has, or 32 at a time with AVX2 when the CPU has it (checked
+ * once, at the first call). Elsewhere, or when sdssimd(0) was called, the
+ * plain loops are used. All of them give the same results. */
+#if defined(__x86_64__) || (defined(__i386__) && defined(__SSE2__))
+#define SDS_SIMD_X86 1
+#include <immintrin.h>
+#endif
+
+#define SDS_TRIM_SIMD_MAX 4 /* Longest 'cset' sdstrim() compares with vectors. */
+
+static int sds_simd_level = -1; /* -1 until the CPU was checked. */
+
+/* Return the widest vector instructions the scanning functions may use,
+ * 0 for none, 1 for SSE2, 2 for AVX2, after limiting them to 'level' if
+ * 'level' is not negative. By default the best the CPU has is used:
+ * benchmarks lower it to compare the implementations. */
+int sdssimd(int level) {
+    int best = 0;
+
+#ifdef SDS_SIMD_X86
+    best = __builtin_cpu_supports("avx2") ? 2 : 1;
+#endif
+    if (level >= 0 && level < best) best = level;
+    if (level >= 0 || sds_simd_level == -1) sds_simd_level = best;
+    return sds_simd_level;
+}
+
+static inline int sdsSimdLevel(void) {
+    return sds_simd_level >= 0 ? sds_simd_level : sdssimd(-1);
+}
+
+/* State of a scan for the separators of sdssplitlen(). Separators do not
+ * overlap: one found at 'p' hides those starting before p+seplen. */
+typedef struct sdsSplitScan {
+    const char *s, *sep;
+    long len, last;                     /* last: where a separator can start */
+    long next;                          /* Where the next separator can start */
+    int seplen;
+    int found;                          /* Separators found */
+    sds *tokens;                        /* Where to put the tokens, or NULL */
+} sdsSplitScan;
+
+/* A separator starts at 'p': make the token before it, if asked.
+ * Return -1 on out of memory. */
+static inline int sdsSplitAt(sdsSplitScan *sc, long p) {
+    if (sc->tokens) {
+        long start = sc->next;
+        sc->tokens[sc->found] = sdsnewlen(sc->s+start,p-start);
+        if (sc->tokens[sc->found] == NULL) return -1;
+    }
+    sc->found++;
+    sc->next = p+sc->seplen;
+    return 0;
+}
+
+/* Find the separators from 'from' on, one byte at a time. */
+static int sdsSplitScalar(sdsSplitScan *sc, long from) {
+    long j;
+
+    for (j = from; j <= sc->last; j++) {
+        if (j >= sc->next && sc->s[j] == sc->sep[0] &&
+            (sc->seplen == 1 || memcmp(sc->s+j+1,sc->sep+1,sc->seplen-1) == 0))
+        {
+            if (sdsSplitAt(sc,j) == -1) return -1;
+            j = sc->next-1;
+        }
+    }
+    return 0;
+}
+
+#ifdef SDS_SIMD_X86
+/* Check the candidates in 'mask', bit i standing for position j+i, where
+ * the first one or two bytes of the separator matched. Return 1 when past
+ * the last position a separator can start at, -1 on out of memory. */
+static inline int sdsSplitMask(sdsSplitScan *sc, long j, unsigned int mask) {
+    while (mask) {
+        long p = j+__builtin_ctz(mask);
+        mask &= mask-1;
+        if (p > sc->last) return 1;
+        if (p < sc->next) continue;
+        if (sc->seplen > 2 && memcmp(sc->s+p+2,sc->sep+2,sc->seplen-2) != 0) continue;
+        if (sdsSplitAt(sc,p) == -1) return -1;
+    }
+    return 0;
+}
+
+/* 16 positions at a time: a position is a candidate where the first byte
+ * of the separator is, and the second one follows. Only the bytes of the
+ * string are loaded, the rest is left to sdsSplitScalar(). */
+static int sdsSplitSSE2(sdsSplitScan *sc, long from) {
+    const __m128i c0 = _mm_set1_epi8(sc->sep[0]);
+    const __m128i c1 = _mm_set1_epi8(sc->seplen > 1 ? sc->sep[1] : 0);
+    int two = sc->seplen > 1, r;
+    long j;
+
+    for (j = from; j+16+two <= sc->len; j += 16) {
+        __m128i b = _mm_loadu_si128((const __m128i*)(sc->s+j));
+        unsigned int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(b,c0));
+        if (mask && two) {
+            __m128i b1 = _mm_loadu_si128((const __m128i*)(sc->s+j+1));
+            mask &= _mm_movemask_epi8(_mm_cmpeq_epi8(b1,c1));
+        }
+        if (mask && (r = sdsSplitMask(sc,j,mask)) != 0) return r < 0 ? -1 : 0;
+    }
+    return sdsSplitScalar(sc,j);
+}
+
+/* Same as sdsSplitSSE2(), 32 positions at a time. */
+__attribute__((target("avx2")))
+static int sdsSplitAVX2(sdsSplitScan *sc, long from) {
+    const __m256i c0 = _mm256_set1_epi8(sc->sep[0]);
+    const __m256i c1 = _mm256_set1_epi8(sc->seplen > 1 ? sc->sep[1] : 0);
+    int two = sc->seplen > 1, r;
+    long j;
+
+    for (j = from; j+32+two <= sc->len; j += 32) {
+        __m256i b = _mm256_loadu_si256((const __m256i*)(sc->s+j));
+        unsigned int mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(b,c0));
+        if (mask && two) {
+            __m256i b1 = _mm256_loadu_si256((const __m256i*)(sc->s+j+1));
+            mask &= _mm256_movemask_epi8(_mm256_cmpeq_epi8(b1,c1));
+        }
+        if (mask && (r = sdsSplitMask(sc,j,mask)) != 0) return r < 0 ? -1 : 0;
+    }
+    return sdsSplitSSE2(sc,j);
+}
+#endif
+
+/* Find all the separators, making the tokens before them if sc->tokens is
+ * set. Return -1 on out of memory. */
+static int sdsSplitRun(sdsSplitScan *sc) {
+#ifdef SDS_SIMD_X86
+    switch(sdsSimdLevel()) {
+        case 2: return sdsSplitAVX2(sc,0);
+        case 1: return sdsSplitSSE2(sc,0);
+    }
+#endif
+    return sdsSplitScalar(sc,0);
+}
+
+/* The set of bytes sdstrim() removes: those of 'cset' and, as strchr()
+ * finds the terminator, the null byte. */
+typedef struct sdsByteSet {
+    unsigned char bits[32];
+    int len;                            /* strlen(cset) */
+    const char *cset;
+} sdsByteSet;
+
+static inline void sdsByteSetInit(sdsByteSet *set, const char *cset) {
+    const unsigned char *c = (const unsigned char*)cset;
+
+    memset(set->bits,0,sizeof(set->bits));
+    set->bits[0] = 1;
+    for (; *c; c++) set->bits[*c>>3] |= 1<<(*c&7);
+    set->len = (const char*)c-cset;
+    set->cset = cset;
+}
+
+static inline int sdsByteSetHas(const sdsByteSet *set, unsigned char c) {
+    return set->bits[c>>3] & (1<<(c&7));
+}
+
+#ifdef SDS_SIMD_X86
+/* Mask of the bytes of 'b' that are in the set, which has at most
+ * SDS_TRIM_SIMD_MAX bytes besides the null one. */
+static inline unsigned int sdsByteSetMask(const sdsByteSet *set, __m128i b) {
+    __m128i in = _mm_cmpeq_epi8(b,_mm_setzero_si128());
+    int i;
+
+    for (i = 0; i < set->len; i++)
+        in = _mm_or_si128(in,_mm_cmpeq_epi8(b,_mm_set1_epi8(set->cset[i])));
+    return _mm_movemask_epi8(in);
+}
+#endif
+
+/* Return how many of the first 'len' bytes of 's' are in the set. */
+static size_t sdsSpanLeft(const char *s, size_t len, const sdsByteSet *set) {
+    size_t j = 0;
+
+#ifdef SDS_SIMD_X86
+    if (set->len <= SDS_TRIM_SIMD_MAX && sdsSimdLevel() > 0) {
+        for (; j+16 <= len; j += 16) {
+            unsigned int out = ~sdsByteSetMask(set,_mm_loadu_si128((const __m128i*)(s+j))) & 0xffff;
+            if (out) return j+__builtin_ctz(out);
+        }
+    }
+#endif
+    while (j < len && sdsByteSetHas(set,s[j])) j++;
+    return j;
+}
+
+/* Return how many of the last 'len' bytes of 's' are in the set. */
+static size_t sdsSpanRight(const char *s, size_t len, const sdsByteSet *set) {
+    size_t j = len;
+
+#ifdef SDS_SIMD_X86
+    if (set->len <= SDS_TRIM_SIMD_MAX && sdsSimdLevel() > 0) {
+        for (; j >= 16; j -= 16) {
+            unsigned int out = ~sdsByteSetMask(set,_mm_loadu_si128((const __m128i*)(s+j-16))) & 0xffff;
+            if (out) return len-(j-16+(31-__builtin_clz(out)))-1;
+        }
+    }
+#endif
+    while (j > 0 && sdsByteSetHas(set,s[j-1])) j--;
+    return len-j;
+}
+
 /* Remove the part of the string from left and from right composed just of
  * contiguous characters found in 'cset', that is a null terminted C string.
  *
@@ -706,15 +916,14 @@ sds sdscatfmt(sds s, char const *fmt, ...) {
  * Output will be just "HelloWorld".
  */
 sds sdstrim(sds s, const char *cset) {
-    char *start, *end, *sp, *ep;
-    size_t len;
-
-    sp = start = s;
-    ep = end = s+sdslen(s)-1;
-    while(sp <= end && strchr(cset, *sp)) sp++;
-    while(ep > sp && strchr(cset, *ep)) ep--;
-    len = (sp > ep) ? 0 : ((ep-sp)+1);
-    if (s != sp) memmove(s, sp, len);
+    size_t len = sdslen(s), left, right;
+    sdsByteSet set;
+
+    sdsByteSetInit(&set,cset);
+    left = sdsSpanLeft(s,len,&set);
+    right = (left == len) ? 0 : sdsSpanRight(s+left,len-left,&set);
+    len -= left+right;
+    if (left) memmove(s, s+left, len);
     s[len] = '\0';
     sdssetlen(s,len);
     return s;
@@ -818,49 +1027,35 @@ int sdscmp(const sds s1, const sds s2) {
  * same function but for zero-terminated strings.
  */
 sds *sdssplitlen(const char *s, ssize_t len, const char *sep, int seplen, int *count) {
-    int elements = 0, slots = 5;
-    long start = 0, j;
+    sdsSplitScan sc = {s, sep, len, len-seplen, 0, seplen, 0, NULL};
     sds *tokens;
 
     if (seplen < 1 || len < 0) return NULL;
 
-    tokens = s_malloc(sizeof(sds)*slots);
+    /* A first pass counts the separators, so the array is allocated once,
+     * with exactly the room the tokens need. */
+    if (len > 0) sdsSplitRun(&sc);
+    tokens = s_malloc(sizeof(sds)*(sc.found+1));
     if (tokens == NULL) return NULL;
 
     if (len == 0) {
         *count = 0;
         return tokens;
     }
-    for (j = 0; j < (len-(seplen-1)); j++) {
-        /* make sure there is room for the next element and the final one */
-        if (slots < elements+2) {
-            sds *newtokens;
-
-            slots *= 2;
-            newtokens = s_realloc(tokens,sizeof(sds)*slots);
-            if (newtokens == NULL) goto cleanup;
-            tokens = newtokens;
-        }
-        /* search the separator */
-        if ((seplen == 1 && *(s+j) == sep[0]) || (memcmp(s+j,sep,seplen) == 0)) {
-            tokens[elements] = sdsnewlen(s+start,j-start);
-            if (tokens[elements] == NULL) goto cleanup;
-            elements++;
-            start = j+seplen;
-            j = j+seplen-1; /* skip the separator */
-        }
-    }
-    /* Add the final element. We are sure there is room in the tokens array. */
-    tokens[elements] = sdsnewlen(s+start,len-start);
-    if (tokens[elements] == NULL) goto cleanup;
-    elements++;
-    *count = elements;
+    sc.next = 0;
+    sc.found = 0;
+    sc.tokens = tokens;
+    if (sdsSplitRun(&sc) == -1) goto cleanup;
+    /* Add the final element. */
+    tokens[sc.found] = sdsnewlen(s+sc.next,len-sc.next);
+    if (tokens[sc.found] == NULL) goto cleanup;
+    *count = sc.found+1;
     return tokens;
 
 cleanup:
     {
         int i;
-        for (i = 0; i < elements; i++) sdsfree(tokens[i]);
+        for (i = 0; i < sc.found; i++) sdsfree(tokens[i]);
         s_free(tokens);
         *count = 0;
         return NULL;
@@ -1105,8 +1300,14 @@ sds sdsjoin(char **argv, int argc, char *sep) {
 /* Like sdsjoin, but joins an array of SDS strings. */
 sds sdsjoinsds(sds *argv, int argc, const char *sep, size_t seplen) {
     sds join = sdsempty();
+    size_t totlen = 0;
     int j;
 
+    /* Make room for the whole result at once. */
+    for (j = 0; j < argc; j++) totlen += sdslen(argv[j]);
+    if (argc > 1) totlen += seplen*(argc-1);
+    join = sdsMakeRoomFor(join,totlen);
+
     for (j = 0; j < argc; j++) {
         join = sdscatsds(join, argv[j]);
         if (j != argc-1) join = sdscatlen(join,sep,seplen);
@@ -0,0 +1,326 @@
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include "banlist.h"
+#include "../lib/uthash.h"
+#include "../lib/sds/sds.h"
+
+
+/* Append mask index i to an index array */
+static void index_append(int **masks, int *count, int *size, int i)
+{
+    if (*count == *size)
+    {
+        *size = *size ? *size * 2 : 4;
+        *masks = realloc(*masks, *size * sizeof(int));
+    }
+    (*masks)[(*count)++] = i;
+}
+
+
+/* Free the compiled masks and the index */
+static void index_free(banlist_t *list)
+{
+    banlist_bucket_t *b, *tmp;
+
+    HASH_ITER(hh, list->buckets, b, tmp)
+    {
+        HASH_DELETE(hh, list->buckets, b);
+        free(b->masks);
+        free(b);
+    }
+    for (int i = 0; i < list->count && list->compiled != NULL; i++)
+    {
+        mask_free(&list->compiled[i]);
+    }
+    free(list->compiled);
+    free(list->unindexed);
+    list->compiled = NULL;
+    list->unindexed = NULL;
+    list->nunindexed = 0;
+}
+
+
+/*
+ * index_build - Compile every mask of the list and file it under its
+ * literal prefix, its literal suffix, or in the unindexed masks
+ */
+static void index_build(banlist_t *list)
+{
+    int unindexed_size = 0;
+
+    list->compiled = malloc(list->count * sizeof(mask_t));
+    for (int i = 0; i < list->count; i++)
+    {
+        mask_t *m = &list->compiled[i];
+        char key[BANLIST_KEY_LEN + 2];
+        size_t n;
+
+        mask_compile(m, list->entries[i].mask);
+        if (m->prefix_len > 0)
+        {
+            n = m->prefix_len < BANLIST_KEY_LEN ? m->prefix_len : BANLIST_KEY_LEN;
+            key[0] = 'p';
+            memcpy(key + 1, m->pattern, n);
+        }
+        else if (m->suffix_len > 0)
+        {
+            n = m->suffix_len < BANLIST_KEY_LEN ? m->suffix_len : BANLIST_KEY_LEN;
+            key[0] = 's';
+            memcpy(key + 1, m->pattern + sdslen(m->pattern) - n, n);
+        }
+        else
+        {
+            index_append(&list->unindexed, &list->nunindexed, &unindexed_size, i);
+            continue;
+        }
+        key[n + 1] = '\0';
+
+        banlist_bucket_t *b;
+        HASH_FIND_STR(list->buckets, key, b);
+        if (b == NULL)
+        {
+            b = calloc(1, sizeof(banlist_bucket_t));
+            strcpy(b->key, key);
+            HASH_ADD_STR(list->buckets, key, b);
+        }
+        index_append(&b->masks, &b->count, &b->size, i);
+    }
+}
+
+
+void banlist_init(banlist_t *list)
+{
+    /*
+     * banlist_init - Initialize an empty list
+     *
+     * list: the list
+     *
+     * Return: nothing
+     */
+    memset(list, 0, sizeof(banlist_t));
+}
+
+
+sds banlist_normalize(const char *mask)
+{
+    /*
+     * banlist_normalize - Complete a mask to the nick!user@host form
+     *
+     * mask: the mask as given to MODE
+     *
+     * Return: the complete mask, to be freed by the caller
+     */
+    bool bang = strchr(mask, '!') != NULL;
+    bool at = strchr(mask, '@') != NULL;
+
+    if (bang && at)
+    {
+        return sdsnew(mask);
+    }
+    if (bang)
+    {
+        return sdscatprintf(sdsempty(), "%s@*", mask);
+    }
+    if (at)
+    {
+        return sdscatprintf(sdsempty(), "*!%s", mask);
+    }
+    return sdscatprintf(sdsempty(), "%s!*@*", mask);
+}
+
+
+bool banlist_add(banlist_t *list, const char *mask, const char *setter)
+{
+    /*
+     * banlist_add - Add a mask and recompile the list
+     *
+     * list: the list
+     *
+     * mask: the mask, in the nick!user@host form
+     *
+     * setter: nick!user@host of the user setting it
+     *
+     * Return: false if the mask was already in the list
+     */
+    for (int i = 0; i < list->count; i++)
+    {
+        if (!strcasecmp(list->entries[i].mask, mask))
+        {
+            return false;
+        }
+    }
+
+    index_free(list);
+    if (list->count == list->size)
+    {
+        list->size = list->size ? list->size * 2 : 8;
+        list->entries = realloc(list->entries, list->size * sizeof(banlist_entry_t));
+    }
+    banlist_entry_t *e = &list->entries[list->count++];
+    e->mask = sdsnew(mask);
+    e->setter = sdsnew(setter);
+    e->set_at = time(NULL);
+    index_build(list);
+
+    return true;
+}
+
+
+void banlist_add_entries(banlist_t *list, banlist_entry_t *entries, int count)
+{
+    /*
+     * banlist_add_entries - Add masks read back from saved state and
+     * compile the list once
+     *
+     * list: the list
+     *
+     * entries: the masks, whose strings the list takes over or frees
+     *
+     * count: the number of masks
+     *
+     * Return: nothing
+     */
+    index_free(list);
+    if (list->count + count > list->size)
+    {
+        list->size = list->count + count;
+        list->entries = realloc(list->entries, list->size * sizeof(banlist_entry_t));
+    }
+    for (int j = 0; j < count; j++)
+    {
+        bool dup = false;
+
+        for (int i = 0; i < list->count && !dup; i++)
+        {
+            dup = !strcasecmp(list->entries[i].mask, entries[j].mask);
+        }
+        if (dup)
+        {
+            sdsfree(entries[j].mask);
+            sdsfree(entries[j].setter);
+            continue;
+        }
+        list->entries[list->count++] = entries[j];
+    }
+    index_build(list);
+}
+
+
+bool banlist_remove(banlist_t *list, const char *mask)
+{
+    /*
+     * banlist_remove - Remove a mask and recompile the list
+     *
+     * list: the list
+     *
+     * mask: the mask, in the nick!user@host form
+     *
+     * Return: false if the mask was not in the list
+     */
+    for (int i = 0; i < list->count; i++)
+    {
+        if (strcasecmp(list->entries[i].mask, mask))
+        {
+            continue;
+        }
+
+        index_free(list);
+        sdsfree(list->entries[i].mask);
+        sdsfree(list->entries[i].setter);
+        memmove(&list->entries[i], &list->entries[i + 1],
+                (list->count - i - 1) * sizeof(banlist_entry_t));
+        list->count--;
+        index_build(list);
+
+        return true;
+    }
+    return false;
+}
+
+
+bool banlist_match(const banlist_t *list, const char *hostmask)
+{
+    /*
+     * banlist_match - Check a user against the compiled list
+     *
+     * list: the list
+     *
+     * hostmask: nick!user@host of the user
+     *
+     * Return: true if a mask of the list matches
+     *
+     * Every mask is filed under exactly one key, and the keys probed here
+     * are all different, so no mask is tried twice.
+     */
+    if (list->count == 0)
+    {
+        return false;
+    }
+
+    size_t len = strlen(hostmask);
+    size_t n = len < BANLIST_KEY_LEN ? len : BANLIST_KEY_LEN;
+    char prefix[BANLIST_KEY_LEN + 2] = {'p'};
+    char suffix[BANLIST_KEY_LEN + 2] = {'s'};
+
+    for (size_t k = 1; k <= n; k++)
+    {
+        banlist_bucket_t *b;
+
+        /* Prefix keys grow to the right, suffix keys to the left */
+        prefix[k] = tolower((unsigned char)hostmask[k - 1]);
+        prefix[k + 1] = '\0';
+        for (size_t j = 0; j < k; j++)
+        {
+            suffix[j + 1] = tolower((unsigned char)hostmask[len - k + j]);
+        }
+        suffix[k + 1] = '\0';
+
+        HASH_FIND_STR(list->buckets, prefix, b);
+        for (int i = 0; b != NULL && i < b->count; i++)
+        {
+            if (mask_match(&list->compiled[b->masks[i]], hostmask))
+            {
+                return true;
+            }
+        }
+        HASH_FIND_STR(list->buckets, suffix, b);
+        for (int i = 0; b != NULL && i < b->count; i++)
+        {
+            if (mask_match(&list->compiled[b->masks[i]], hostmask))
+            {
+                return true;
+            }
+        }
+    }
+    for (int i = 0; i < list->nunindexed; i++)
+    {
+        if (mask_match(&list->compiled[list->unindexed[i]], hostmask))
+        {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+
+void banlist_free(banlist_t *list)
+{
+    /*
+     * banlist_free - Free the masks and the compiled index
+     *
+     * list: the list
+     *
+     * Return: nothing
+     */
+    index_free(list);
+    for (int i = 0; i < list->count; i++)
+    {
+        sdsfree(list->entries[i].mask);
+        sdsfree(list->entries[i].setter);
+    }
+    free(list->entries);
+    banlist_init(list);
+}
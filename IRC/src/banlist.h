@@ -0,0 +1,128 @@
+#ifndef BANLIST_H_
+#define BANLIST_H_
+
+#include <stdbool.h>
+#include <time.h>
+#include "mask.h"
+#include "../lib/uthash.h"
+#include "../lib/sds/sds.h"
+
+#define BANLIST_KEY_LEN 4 /* Longest literal prefix or suffix used as an index key */
+
+/* One mask of a list, as set with MODE */
+typedef struct banlist_entry
+{
+    sds mask;       /* nick!user@host mask */
+    sds setter;     /* nick!user@host of the user who set it */
+    time_t set_at;
+} banlist_entry_t;
+
+/* Masks of the compiled index that share a key: 'p' or 's' followed by
+ * the first or last BANLIST_KEY_LEN (or fewer) literal characters */
+typedef struct banlist_bucket
+{
+    char key[BANLIST_KEY_LEN + 2];
+    int *masks;     /* Indices into banlist_t.compiled */
+    int count;
+    int size;
+    UT_hash_handle hh;
+} banlist_bucket_t;
+
+/*
+ * A channel's +b, +e or +I list. The masks are kept in the order they
+ * were set, for the list replies, and compiled again each time the list
+ * changes. A mask with a literal prefix is filed under it, else one with
+ * a literal suffix under that, else in a short list of masks that must
+ * always be tried. A hostmask is then only matched against the masks of
+ * the few buckets its own first and last characters lead to.
+ */
+typedef struct banlist
+{
+    banlist_entry_t *entries;
+    int count;
+    int size;
+    mask_t *compiled;           /* compiled[i] is entries[i].mask */
+    banlist_bucket_t *buckets;  /* Hashtable by key */
+    int *unindexed;             /* Masks starting and ending with a wildcard */
+    int nunindexed;
+} banlist_t;
+
+/*
+ * banlist_init - Initialize an empty list
+ *
+ * list: the list
+ *
+ * Return: nothing
+ */
+void banlist_init(banlist_t *list);
+
+/*
+ * banlist_normalize - Complete a mask to the nick!user@host form:
+ * "nick" becomes "nick!*@*", "user@host" becomes "*!user@host" and
+ * "nick!user" becomes "nick!user@*"
+ *
+ * mask: the mask as given to MODE
+ *
+ * Return: the complete mask, to be freed by the caller
+ */
+sds banlist_normalize(const char *mask);
+
+/*
+ * banlist_add - Add a mask and recompile the list
+ *
+ * list: the list
+ *
+ * mask: the mask, in the nick!user@host form
+ *
+ * setter: nick!user@host of the user setting it
+ *
+ * Return: false if the mask was already in the list
+ */
+bool banlist_add(banlist_t *list, const char *mask, const char *setter);
+
+/*
+ * banlist_add_entries - Add masks read back from saved state, keeping who
+ * set them and when, and compile the list once
+ *
+ * list: the list
+ *
+ * entries: the masks, whose strings the list takes over or frees
+ *
+ * count: the number of masks
+ *
+ * Return: nothing
+ */
+void banlist_add_entries(banlist_t *list, banlist_entry_t *entries, int count);
+
+/*
+ * banlist_remove - Remove a mask and recompile the list
+ *
+ * list: the list
+ *
+ * mask: the mask, in the nick!user@host form
+ *
+ * Return: false if the mask was not in the list
+ */
+bool banlist_remove(banlist_t *list, const char *mask);
+
+/*
+ * banlist_match - Check a user against the compiled list
+ *
+ * list: the list
+ *
+ * hostmask: nick!user@host of the user
+ *
+ * Return: true if a mask of the list matches
+ */
+bool banlist_match(const banlist_t *list, const char *hostmask);
+
+/*
+ * banlist_free - Free the masks and the compiled index
+ *
+ * list: the list
+ *
+ * Return: nothing
+ */
+void banlist_free(banlist_t *list);
+
+#endif
@@ -0,0 +1,302 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include "capture.h"
+#include "stats.h"
+#include "reply.h"
+#include "log.h"
+#include "../lib/sds/sds.h"
+
+static bool capturing;
+static int capture_fd = -1;
+static pthread_mutex_t capture_lock = PTHREAD_MUTEX_INITIALIZER;
+static sds pending;                 /* Records not written yet, protected by capture_lock */
+static uint64_t last_ns;            /* Time of the last record, protected by capture_lock */
+static uint64_t dropped;            /* Lines dropped since the last write, protected by capture_lock */
+static bool suspended;               /* Records are dropped, protected by capture_lock */
+static _Atomic uint32_t next_id = 1;
+static pthread_mutex_t write_lock = PTHREAD_MUTEX_INITIALIZER; /* Keeps the writes in order */
+
+
+/* Append a record header: the type, the time since the previous record
+ * and the connection (called with capture_lock held, room made) */
+static unsigned char *put_header(unsigned char *p, char type, uint32_t id)
+{
+    uint64_t now = stats_now();
+
+    *p++ = type;
+    p += capture_put_varint(p, (now - last_ns) / 1000);
+    p += capture_put_varint(p, id);
+    /* Keep the remainder, so the deltas add up to the real time */
+    last_ns = now - (now - last_ns) % 1000;
+    return p;
+}
+
+
+/* Write out what was buffered */
+static void flush(void)
+{
+    pthread_mutex_lock(&write_lock);
+    pthread_mutex_lock(&capture_lock);
+    sds out = pending;
+    uint64_t lost = dropped;
+    pending = sdsempty();
+    dropped = 0;
+    pthread_mutex_unlock(&capture_lock);
+
+    size_t done = 0;
+    while (done < sdslen(out))
+    {
+        ssize_t n = write(capture_fd, out + done, sdslen(out) - done);
+        if (n <= 0)
+        {
+            chilog(ERROR, "Capture: could not write the file, %zu bytes lost", sdslen(out) - done);
+            break;
+        }
+        done += n;
+    }
+    sdsfree(out);
+    pthread_mutex_unlock(&write_lock);
+
+    if (lost > 0)
+    {
+        chilog(WARNING, "Capture: the disk is behind, %llu lines were dropped", (unsigned long long)lost);
+    }
+}
+
+
+static void *capture_thread(void *args)
+{
+    struct timespec interval = {.tv_sec = 0, .tv_nsec = CAPTURE_FLUSH_MS * 1000000L};
+
+    (void)args;
+    for (;;)
+    {
+        nanosleep(&interval, NULL);
+        flush();
+    }
+
+    return NULL;
+}
+
+
+int capture_init(char *path)
+{
+    /*
+     * capture_init - Open the capture file, appending to it
+     *
+     * path: the capture file
+     *
+     * Return: CHIRC_OK/CHIRC_ERROR
+     */
+    struct stat st;
+    char magic[sizeof(CAPTURE_MAGIC) - 1];
+
+    capture_fd = open(path, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (capture_fd == -1 || fstat(capture_fd, &st) == -1)
+    {
+        chilog(CRITICAL, "Could not open the capture file %s", path);
+        return CHIRC_ERROR;
+    }
+
+    if (st.st_size == 0)
+    {
+        /* Right away, before a process taking over from this one opens it */
+        char header[sizeof magic + sizeof(uint32_t)];
+        uint32_t version = CAPTURE_VERSION;
+        memcpy(header, CAPTURE_MAGIC, sizeof magic);
+        memcpy(header + sizeof magic, &version, sizeof version);
+        if (write(capture_fd, header, sizeof header) != sizeof header)
+        {
+            chilog(CRITICAL, "Could not write the capture file %s", path);
+            close(capture_fd);
+            return CHIRC_ERROR;
+        }
+    }
+    else if (pread(capture_fd, magic, sizeof magic, 0) != sizeof magic ||
+             memcmp(magic, CAPTURE_MAGIC, sizeof magic) != 0)
+    {
+        chilog(CRITICAL, "%s is not a capture file", path);
+        close(capture_fd);
+        return CHIRC_ERROR;
+    }
+
+    /* A new process, after an upgrade or a restart, starts its own segment */
+    struct timespec wall;
+    unsigned char start[16];
+    clock_gettime(CLOCK_REALTIME, &wall);
+    start[0] = CAPTURE_START;
+    int n = 1 + capture_put_varint(start + 1, (uint64_t)wall.tv_sec * 1000000000ULL + wall.tv_nsec);
+    pending = sdsnewlen(start, n);
+    last_ns = stats_now();
+    capturing = true;
+
+    return CHIRC_OK;
+}
+
+
+int capture_start(void)
+{
+    /*
+     * capture_start - Start the thread writing the records out, once a live
+     * upgrade, if any, has handed the connections over: the previous process
+     * has then written its last records
+     *
+     * Return: CHIRC_OK/CHIRC_ERROR
+     */
+    pthread_t tid;
+
+    if (!capturing)
+    {
+        return CHIRC_OK;
+    }
+    if (pthread_create(&tid, NULL, capture_thread, NULL) != 0)
+    {
+        chilog(CRITICAL, "Could not create the capture thread");
+        return CHIRC_ERROR;
+    }
+    pthread_detach(tid);
+
+    return CHIRC_OK;
+}
+
+
+uint32_t capture_open(uint32_t flags)
+{
+    /*
+     * capture_open - Record that a connection was opened (Thread-safe)
+     *
+     * flags: CAPTURE_TLS and CAPTURE_HANDED_OVER
+     *
+     * Return: the connection's number in the capture, 0 when not capturing
+     */
+    if (!capturing)
+    {
+        return 0;
+    }
+
+    uint32_t id = atomic_fetch_add_explicit(&next_id, 1, memory_order_relaxed);
+
+    pthread_mutex_lock(&capture_lock);
+    if (!suspended)
+    {
+        pending = sdsMakeRoomFor(pending, 32);
+        unsigned char *start = (unsigned char *)pending + sdslen(pending);
+        unsigned char *p = put_header(start, CAPTURE_OPEN, id);
+        p += capture_put_varint(p, flags);
+        sdsIncrLen(pending, p - start);
+    }
+    pthread_mutex_unlock(&capture_lock);
+
+    return id;
+}
+
+
+void capture_lines(uint32_t id, sds *lines, int count)
+{
+    /*
+     * capture_lines - Record lines received on a connection (Thread-safe)
+     *
+     * id: the connection's number in the capture, 0 to record nothing
+     *
+     * lines: the whole lines, without "\r\n"
+     *
+     * count: number of lines
+     *
+     * Return: nothing
+     */
+    size_t room = 0;
+
+    if (id == 0 || count == 0)
+    {
+        return;
+    }
+    for (int i = 0; i < count; i++)
+    {
+        room += 32 + sdslen(lines[i]);
+    }
+
+    pthread_mutex_lock(&capture_lock);
+    if (suspended)
+    {
+        pthread_mutex_unlock(&capture_lock);
+        return;
+    }
+    if (sdslen(pending) + room > CAPTURE_MAX_BUFFER)
+    {
+        dropped += count;
+        pthread_mutex_unlock(&capture_lock);
+        return;
+    }
+    pending = sdsMakeRoomFor(pending, room);
+    unsigned char *start = (unsigned char *)pending + sdslen(pending);
+    unsigned char *p = start;
+    for (int i = 0; i < count; i++)
+    {
+        p = put_header(p, CAPTURE_LINE, id);
+        p += capture_put_varint(p, sdslen(lines[i]));
+        memcpy(p, lines[i], sdslen(lines[i]));
+        p += sdslen(lines[i]);
+    }
+    sdsIncrLen(pending, p - start);
+    pthread_mutex_unlock(&capture_lock);
+}
+
+
+void capture_close(uint32_t id)
+{
+    /*
+     * capture_close - Record that a connection was closed (Thread-safe)
+     *
+     * id: the connection's number in the capture, 0 to record nothing
+     *
+     * Return: nothing
+     */
+    if (id == 0)
+    {
+        return;
+    }
+
+    pthread_mutex_lock(&capture_lock);
+    if (!suspended)
+    {
+        pending = sdsMakeRoomFor(pending, 32);
+        unsigned char *start = (unsigned char *)pending + sdslen(pending);
+        unsigned char *p = put_header(start, CAPTURE_CLOSE, id);
+        sdsIncrLen(pending, p - start);
+    }
+    pthread_mutex_unlock(&capture_lock);
+}
+
+
+void capture_suspend(bool suspend)
+{
+    /*
+     * capture_suspend - Stop recording, writing out the records buffered so
+     * far, while a live upgrade hands the connections over: the new process
+     * appends to the file from then on (Thread-safe)
+     *
+     * suspend: true to stop recording, false to carry on if the upgrade failed
+     *
+     * Return: nothing
+     */
+    if (!capturing)
+    {
+        return;
+    }
+
+    pthread_mutex_lock(&capture_lock);
+    suspended = suspend;
+    pthread_mutex_unlock(&capture_lock);
+    if (suspend)
+    {
+        flush();
+    }
+}
@@ -0,0 +1,161 @@
+#ifndef CAPTURE_H_
+#define CAPTURE_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "../lib/sds/sds.h"
+
+#define CAPTURE_MAGIC "CHIRCCAP"           /* First bytes of a capture file */
+#define CAPTURE_VERSION 1                  /* Bumped when the record layout changes */
+#define CAPTURE_FLUSH_MS 100               /* Milliseconds between two writes of the buffer */
+#define CAPTURE_MAX_BUFFER (64 * 1024 * 1024) /* Buffered bytes past which lines are dropped */
+
+/*
+ * Traffic capture (-R): the lines clients send are appended to a binary
+ * log, to be replayed against another build by chirc-replay.
+ *
+ * The file starts with CAPTURE_MAGIC and CAPTURE_VERSION (32 bits), and
+ * goes on with records, each a type byte followed by unsigned LEB128
+ * varints:
+ *
+ *   CAPTURE_START  wall clock in ns          A process started capturing
+ *   CAPTURE_OPEN   dt, connection, flags     A connection was opened
+ *   CAPTURE_LINE   dt, connection, length    A line, without "\r\n",
+ *                  and the line's bytes      was received
+ *   CAPTURE_CLOSE  dt, connection            A connection was closed
+ *
+ * dt is the time since the previous record in microseconds. Connections
+ * are numbered from 1 by each process: a live upgrade appends a
+ * CAPTURE_START to the same file, and the connections handed over to the
+ * new process are opened again under new numbers, with CAPTURE_HANDED_OVER.
+ *
+ * Threads append records to a buffer under a lock, and a background
+ * thread writes it out every CAPTURE_FLUSH_MS; the lines received while
+ * the disk is too far behind are dropped, and a warning logged.
+ *
+ * The lines a connection sent before it was handed over and that were not
+ * processed yet are recorded again by the new process.
+ */
+
+enum capture_record
+{
+    CAPTURE_START = 'S',
+    CAPTURE_OPEN = 'O',
+    CAPTURE_LINE = 'L',
+    CAPTURE_CLOSE = 'C'
+};
+
+#define CAPTURE_TLS 0x01          /* The connection came in on the TLS port */
+#define CAPTURE_HANDED_OVER 0x02  /* The connection was handed over by a live upgrade */
+
+/*
+ * capture_init - Open the capture file, appending to it
+ *
+ * path: the capture file
+ *
+ * Return: CHIRC_OK/CHIRC_ERROR
+ */
+int capture_init(char *path);
+
+/*
+ * capture_start - Start the thread writing the records out, once a live
+ * upgrade, if any, has handed the connections over: the previous process
+ * has then written its last records
+ *
+ * Return: CHIRC_OK/CHIRC_ERROR
+ */
+int capture_start(void);
+
+/*
+ * capture_open - Record that a connection was opened (Thread-safe)
+ *
+ * flags: CAPTURE_TLS and CAPTURE_HANDED_OVER
+ *
+ * Return: the connection's number in the capture, 0 when not capturing
+ */
+uint32_t capture_open(uint32_t flags);
+
+/*
+ * capture_lines - Record lines received on a connection (Thread-safe)
+ *
+ * id: the connection's number in the capture, 0 to record nothing
+ *
+ * lines: the whole lines, without "\r\n"
+ *
+ * count: number of lines
+ *
+ * Return: nothing
+ */
+void capture_lines(uint32_t id, sds *lines, int count);
+
+/*
+ * capture_close - Record that a connection was closed (Thread-safe)
+ *
+ * id: the connection's number in the capture, 0 to record nothing
+ *
+ * Return: nothing
+ */
+void capture_close(uint32_t id);
+
+/*
+ * capture_suspend - Stop recording, writing out the records buffered so
+ * far, while a live upgrade hands the connections over: the new process
+ * appends to the file from then on (Thread-safe)
+ *
+ * suspend: true to stop recording, false to carry on if the upgrade failed
+ *
+ * Return: nothing
+ */
+void capture_suspend(bool suspend);
+
+/*
+ * capture_put_varint - Append an unsigned LEB128 varint
+ *
+ * p: where to write it, with room for 10 bytes
+ *
+ * v: the value
+ *
+ * Return: the number of bytes written
+ */
+static inline int capture_put_varint(unsigned char *p, uint64_t v)
+{
+    int n = 0;
+
+    while (v >= 0x80)
+    {
+        p[n++] = (unsigned char)(v | 0x80);
+        v >>= 7;
+    }
+    p[n++] = (unsigned char)v;
+    return n;
+}
+
+/*
+ * capture_get_varint - Read an unsigned LEB128 varint
+ *
+ * p: cursor, moved past the varint
+ *
+ * end: end of the data
+ *
+ * v: set to the value
+ *
+ * Return: false if the data ends in the middle of the varint
+ */
+static inline bool capture_get_varint(const unsigned char **p, const unsigned char *end, uint64_t *v)
+{
+    uint64_t r = 0;
+
+    for (int shift = 0; *p < end && shift < 64; shift += 7)
+    {
+        unsigned char b = *(*p)++;
+        r |= (uint64_t)(b & 0x7f) << shift;
+        if (!(b & 0x80))
+        {
+            *v = r;
+            return true;
+        }
+    }
+    return false;
+}
+
+#endif
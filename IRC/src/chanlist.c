@@ -0,0 +1,404 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <limits.h>
+#include <time.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include "chanlist.h"
+#include "log.h"
+#include "trace.h"
+#include "../lib/uthash.h"
+#include "../lib/sds/sds.h"
+
+
+static uint64_t now_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+
+static int compare_entries(const void *a, const void *b)
+{
+    return strcmp(((const chanlist_entry_t *)a)->name, ((const chanlist_entry_t *)b)->name);
+}
+
+
+static void snapshot_free(chanlist_snapshot_t *snap)
+{
+    for (int i = 0; i < snap->count; i++)
+    {
+        sdsfree(snap->entries[i].name);
+    }
+    free(snap->entries);
+    free(snap);
+}
+
+
+/* The cached snapshot if it is still recent enough, with a new reference */
+static chanlist_snapshot_t *cached(server_ctx *ctx)
+{
+    uint64_t generation = atomic_load(&ctx->channels_generation);
+    chanlist_snapshot_t *snap;
+
+    trace_mutex_lock(&ctx->chanlist_lock, "chanlist_lock");
+    snap = ctx->chanlist;
+    if (snap != NULL && (snap->generation == generation
+                         || now_ms() - snap->built_ms < CHANLIST_MAX_AGE_MS))
+    {
+        snap->refcount++;
+    }
+    else
+    {
+        snap = NULL;
+    }
+    pthread_mutex_unlock(&ctx->chanlist_lock);
+
+    return snap;
+}
+
+
+chanlist_snapshot_t *chanlist_acquire(server_ctx *ctx)
+{
+    /*
+     * chanlist_acquire - Get a reference to a recent channel snapshot
+     *
+     * ctx: server context
+     *
+     * Return: the snapshot, to be released with chanlist_release, or NULL
+     * with channel shards if a new one is to be gathered
+     */
+    chanlist_snapshot_t *snap = cached(ctx);
+
+    if (snap != NULL || ctx->shards != NULL)
+    {
+        return snap;
+    }
+
+    snap = chanlist_new(ctx);
+    trace_mutex_lock(&ctx->channels_lock, "channels_lock");
+    for (channel_t *c = ctx->channels_hashtable; c != NULL; c = c->hh.next)
+    {
+        chanlist_add(snap, c);
+    }
+    pthread_mutex_unlock(&ctx->channels_lock);
+
+    return chanlist_publish(ctx, snap);
+}
+
+
+chanlist_snapshot_t *chanlist_new(server_ctx *ctx)
+{
+    /*
+     * chanlist_new - Start a new snapshot
+     *
+     * ctx: server context
+     *
+     * Return: an empty snapshot, to be filled with chanlist_add
+     */
+    chanlist_snapshot_t *snap = calloc(1, sizeof(chanlist_snapshot_t));
+
+    /* Read first, so a change made while it is filled makes it stale */
+    snap->generation = atomic_load(&ctx->channels_generation);
+
+    return snap;
+}
+
+
+void chanlist_add(chanlist_snapshot_t *snap, channel_t *c)
+{
+    /*
+     * chanlist_add - Copy the name and user count of a channel into a new
+     * snapshot (Not thread-safe, called with the channel's table taken)
+     *
+     * snap: the snapshot, from chanlist_new
+     *
+     * c: the channel
+     *
+     * Return: nothing
+     */
+    if (snap->count == snap->size)
+    {
+        snap->size = snap->size ? snap->size * 2 : 16;
+        snap->entries = realloc(snap->entries, snap->size * sizeof(chanlist_entry_t));
+    }
+    snap->entries[snap->count].name = sdsdup(c->channel_name);
+    snap->entries[snap->count].users = HASH_COUNT(c->channel_clients);
+    snap->count++;
+}
+
+
+chanlist_snapshot_t *chanlist_publish(server_ctx *ctx, chanlist_snapshot_t *snap)
+{
+    /*
+     * chanlist_publish - Sort a new snapshot and cache it
+     *
+     * ctx: server context
+     *
+     * snap: the snapshot, filled with chanlist_add
+     *
+     * Return: the snapshot, with a reference for the caller
+     */
+    chanlist_snapshot_t *stale = NULL;
+
+    /* Sorting outside the lock gives a stable order and lets name lookups bsearch */
+    qsort(snap->entries, snap->count, sizeof(chanlist_entry_t), compare_entries);
+    snap->built_ms = now_ms();
+    snap->refcount = 2; /* The cache and the caller */
+
+    /* Concurrent LISTs may both copy; the later copy replaces the earlier */
+    trace_mutex_lock(&ctx->chanlist_lock, "chanlist_lock");
+    if (ctx->chanlist != NULL && --ctx->chanlist->refcount == 0)
+    {
+        stale = ctx->chanlist;
+    }
+    ctx->chanlist = snap;
+    pthread_mutex_unlock(&ctx->chanlist_lock);
+
+    if (stale != NULL)
+    {
+        snapshot_free(stale);
+    }
+
+    return snap;
+}
+
+
+void chanlist_release(server_ctx *ctx, chanlist_snapshot_t *snap)
+{
+    /*
+     * chanlist_release - Release a reference taken by chanlist_acquire
+     *
+     * ctx: server context
+     *
+     * snap: the snapshot
+     *
+     * Return: nothing
+     */
+    trace_mutex_lock(&ctx->chanlist_lock, "chanlist_lock");
+    bool last = --snap->refcount == 0;
+    pthread_mutex_unlock(&ctx->chanlist_lock);
+
+    if (last)
+    {
+        snapshot_free(snap);
+    }
+}
+
+
+void chanlist_free(server_ctx *ctx)
+{
+    /*
+     * chanlist_free - Free the cached snapshot when the server shuts down
+     *
+     * ctx: server context
+     *
+     * Return: nothing
+     */
+    if (ctx->chanlist != NULL)
+    {
+        chanlist_release(ctx, ctx->chanlist);
+        ctx->chanlist = NULL;
+    }
+}
+
+
+static sds *append_sds(sds *array, int *count, const char *s)
+{
+    array = realloc(array, (*count + 1) * sizeof(sds));
+    array[(*count)++] = sdsnew(s);
+    return array;
+}
+
+
+static mask_t *append_mask(mask_t *array, int *count, const char *pattern)
+{
+    array = realloc(array, (*count + 1) * sizeof(mask_t));
+    mask_compile(&array[(*count)++], pattern);
+    return array;
+}
+
+
+void chanlist_filter_parse(sds param, chanlist_filter_t *filter)
+{
+    /*
+     * chanlist_filter_parse - Parse the parameter of LIST
+     *
+     * param: the parameter, or NULL to list everything
+     *
+     * filter: output, to be freed with chanlist_filter_free
+     *
+     * Return: nothing
+     */
+    int count;
+
+    memset(filter, 0, sizeof(chanlist_filter_t));
+    filter->min_users = 0;
+    filter->max_users = INT_MAX;
+
+    if (param == NULL)
+    {
+        return;
+    }
+
+    sds *items = sdssplitlen(param, sdslen(param), ",", 1, &count);
+    for (int i = 0; i < count; i++)
+    {
+        char *item = items[i];
+
+        if (item[0] == '\0')
+        {
+            continue;
+        }
+        if ((item[0] == '>' || item[0] == '<') && isdigit((unsigned char)item[1]))
+        {
+            int n = atoi(item + 1);
+            if (item[0] == '>')
+            {
+                filter->min_users = n + 1;
+            }
+            else
+            {
+                filter->max_users = n - 1;
+            }
+        }
+        else if (item[0] == '!')
+        {
+            filter->excludes = append_mask(filter->excludes, &filter->nexcludes, item + 1);
+        }
+        else if (strpbrk(item, "*?") != NULL)
+        {
+            filter->masks = append_mask(filter->masks, &filter->nmasks, item);
+        }
+        else
+        {
+            filter->names = append_sds(filter->names, &filter->nnames, item);
+        }
+    }
+    sdsfreesplitres(items, count);
+}
+
+
+void chanlist_filter_free(chanlist_filter_t *filter)
+{
+    /*
+     * chanlist_filter_free - Free the strings and masks of a parsed filter
+     *
+     * filter: the filter
+     *
+     * Return: nothing
+     */
+    sdsfreesplitres(filter->names, filter->nnames);
+    for (int i = 0; i < filter->nmasks; i++)
+    {
+        mask_free(&filter->masks[i]);
+    }
+    free(filter->masks);
+    for (int i = 0; i < filter->nexcludes; i++)
+    {
+        mask_free(&filter->excludes[i]);
+    }
+    free(filter->excludes);
+    memset(filter, 0, sizeof(chanlist_filter_t));
+}
+
+
+/*
+ * filter_match - Check the user count and mask conditions of a filter
+ *
+ * filter: the filter
+ *
+ * entry: the channel
+ *
+ * Return: true if the channel passes
+ */
+static bool filter_match(chanlist_filter_t *filter, chanlist_entry_t *entry)
+{
+    if (entry->users < filter->min_users || entry->users > filter->max_users)
+    {
+        return false;
+    }
+    for (int i = 0; i < filter->nexcludes; i++)
+    {
+        if (mask_match(&filter->excludes[i], entry->name))
+        {
+            return false;
+        }
+    }
+    if (filter->nmasks == 0)
+    {
+        return true;
+    }
+    for (int i = 0; i < filter->nmasks; i++)
+    {
+        if (mask_match(&filter->masks[i], entry->name))
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+
+void chanlist_cursor_init(chanlist_cursor_t *cursor, chanlist_snapshot_t *snap,
+                          chanlist_filter_t *filter)
+{
+    /*
+     * chanlist_cursor_init - Start iterating over the channels of a snapshot
+     * that pass a filter
+     *
+     * cursor: output
+     *
+     * snap: the snapshot
+     *
+     * filter: the filter
+     *
+     * Return: nothing
+     */
+    cursor->snap = snap;
+    cursor->filter = filter;
+    cursor->next = 0;
+}
+
+
+chanlist_entry_t *chanlist_cursor_next(chanlist_cursor_t *cursor)
+{
+    /*
+     * chanlist_cursor_next - Advance to the next channel that passes the filter
+     *
+     * cursor: the cursor
+     *
+     * Return: the channel, or NULL at the end of the list
+     */
+    chanlist_snapshot_t *snap = cursor->snap;
+    chanlist_filter_t *filter = cursor->filter;
+
+    /* With channel names, look each one up instead of scanning */
+    if (filter->nnames > 0)
+    {
+        while (cursor->next < filter->nnames)
+        {
+            chanlist_entry_t key = {.name = filter->names[cursor->next++]};
+            chanlist_entry_t *entry = bsearch(&key, snap->entries, snap->count,
+                                              sizeof(chanlist_entry_t), compare_entries);
+            if (entry != NULL && filter_match(filter, entry))
+            {
+                return entry;
+            }
+        }
+        return NULL;
+    }
+
+    while (cursor->next < snap->count)
+    {
+        chanlist_entry_t *entry = &snap->entries[cursor->next++];
+        if (filter_match(filter, entry))
+        {
+            return entry;
+        }
+    }
+    return NULL;
+}
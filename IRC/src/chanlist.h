@@ -0,0 +1,167 @@
+#ifndef CHANLIST_H_
+#define CHANLIST_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "server.h"
+#include "channels.h"
+#include "mask.h"
+#include "../lib/sds/sds.h"
+
+#define CHANLIST_MAX_AGE_MS 500     /* A changed channel set is re-copied at most this often */
+#define CHANLIST_BATCH_BYTES 4096   /* LIST replies are sent in batches of about this size */
+
+/* One channel in a snapshot */
+typedef struct chanlist_entry
+{
+    sds name;
+    int users;
+} chanlist_entry_t;
+
+/* Read-only copy of the channel names and user counts, sorted by name.
+ * Shared by concurrent LISTs and freed when the last reference is released. */
+typedef struct chanlist_snapshot
+{
+    int refcount;               /* Protected by ctx->chanlist_lock */
+    uint64_t generation;        /* ctx->channels_generation when copied */
+    uint64_t built_ms;          /* CLOCK_MONOTONIC time when copied */
+    int count;
+    int size;                   /* Entries allocated */
+    chanlist_entry_t *entries;
+} chanlist_snapshot_t;
+
+/* ELIST-style filters of a LIST request. All given conditions must hold. */
+typedef struct chanlist_filter
+{
+    int min_users;              /* ">n" sets n + 1, 0 if not given */
+    int max_users;              /* "<n" sets n - 1, INT_MAX if not given */
+    sds *names;                 /* Exact channel names, only these are listed */
+    int nnames;
+    mask_t *masks;              /* Name masks, the channel must match one */
+    int nmasks;
+    mask_t *excludes;           /* "!mask": the channel must match none */
+    int nexcludes;
+} chanlist_filter_t;
+
+/* Resumable position in a snapshot */
+typedef struct chanlist_cursor
+{
+    chanlist_snapshot_t *snap;
+    chanlist_filter_t *filter;
+    int next;                   /* Next entry, or next name with a names filter */
+} chanlist_cursor_t;
+
+/*
+ * chanlist_acquire - Get a reference to a recent channel snapshot. The
+ * cached one is reused if the channels did not change or if it is younger
+ * than CHANLIST_MAX_AGE_MS; otherwise a new copy is made, which is the only
+ * time channels_lock is taken. With channel shards, the copy is gathered
+ * from the shards by the caller instead.
+ *
+ * ctx: server context
+ *
+ * Return: the snapshot, to be released with chanlist_release, or NULL
+ * with channel shards if a new one is to be made with chanlist_new,
+ * chanlist_add on each shard and chanlist_publish
+ */
+chanlist_snapshot_t *chanlist_acquire(server_ctx *ctx);
+
+/*
+ * chanlist_new - Start a new snapshot
+ *
+ * ctx: server context
+ *
+ * Return: an empty snapshot, to be filled with chanlist_add
+ */
+chanlist_snapshot_t *chanlist_new(server_ctx *ctx);
+
+/*
+ * chanlist_add - Copy the name and user count of a channel into a new
+ * snapshot (Not thread-safe, called with the channel's table taken)
+ *
+ * snap: the snapshot, from chanlist_new
+ *
+ * c: the channel
+ *
+ * Return: nothing
+ */
+void chanlist_add(chanlist_snapshot_t *snap, channel_t *c);
+
+/*
+ * chanlist_publish - Sort a new snapshot and make it the cached one
+ *
+ * ctx: server context
+ *
+ * snap: the snapshot, filled with chanlist_add
+ *
+ * Return: the snapshot, with a reference to be released with
+ * chanlist_release
+ */
+chanlist_snapshot_t *chanlist_publish(server_ctx *ctx, chanlist_snapshot_t *snap);
+
+/*
+ * chanlist_release - Release a reference taken by chanlist_acquire
+ *
+ * ctx: server context
+ *
+ * snap: the snapshot
+ *
+ * Return: nothing
+ */
+void chanlist_release(server_ctx *ctx, chanlist_snapshot_t *snap);
+
+/*
+ * chanlist_filter_parse - Parse the parameter of LIST: a comma separated
+ * list of channel names, ">n", "<n", masks and "!mask" negated masks
+ *
+ * param: the parameter, or NULL to list everything
+ *
+ * filter: output, to be freed with chanlist_filter_free
+ *
+ * Return: nothing
+ */
+void chanlist_filter_parse(sds param, chanlist_filter_t *filter);
+
+/*
+ * chanlist_filter_free - Free the strings and masks of a parsed filter
+ *
+ * filter: the filter
+ *
+ * Return: nothing
+ */
+void chanlist_filter_free(chanlist_filter_t *filter);
+
+/*
+ * chanlist_cursor_init - Start iterating over the channels of a snapshot
+ * that pass a filter
+ *
+ * cursor: output
+ *
+ * snap: the snapshot, must stay acquired while the cursor is used
+ *
+ * filter: the filter, must outlive the cursor
+ *
+ * Return: nothing
+ */
+void chanlist_cursor_init(chanlist_cursor_t *cursor, chanlist_snapshot_t *snap,
+                          chanlist_filter_t *filter);
+
+/*
+ * chanlist_cursor_next - Advance to the next channel that passes the filter
+ *
+ * cursor: the cursor
+ *
+ * Return: the channel, or NULL at the end of the list
+ */
+chanlist_entry_t *chanlist_cursor_next(chanlist_cursor_t *cursor);
+
+/*
+ * chanlist_free - Free the cached snapshot when the server shuts down
+ *
+ * ctx: server context
+ *
+ * Return: nothing
+ */
+void chanlist_free(server_ctx *ctx);
+
+#endif
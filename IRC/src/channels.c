@@ -54,6 +54,13 @@ channel_t *add_CHANNEL(sds channelname, channel_t **channels)
 
     channel_t *channel_add = malloc(sizeof(channel_t));
     channel_add->channel_clients = NULL;
+    channel_add->cid = 0;
+    channel_add->names = NULL;
+    channel_add->nnames = 0;
+    channel_add->names_stale = false;
+    banlist_init(&channel_add->bans);
+    banlist_init(&channel_add->excepts);
+    banlist_init(&channel_add->invites);
     channel_add->channel_name = sdsempty();
     channel_add->channel_name = sdscpy(channel_add->channel_name, channelname);
 
@@ -62,46 +69,56 @@ channel_t *add_CHANNEL(sds channelname, channel_t **channels)
 }
 
 
-channel_client *find_CHANNEL_CLIENT(sds nickname, channel_client **channel_clients)
+channel_client *find_CHANNEL_CLIENT(client_t *user, channel_client **channel_clients)
 {
     /*
-     * find_CHANNEL_CLIENT -  Find the client in channel with the given nick name (Not thread-safe)
+     * find_CHANNEL_CLIENT -  Find the membership of a user in a channel (Not thread-safe)
      *
-     * nickname: The nickname of the client you want to search as key
+     * user: The user you want to search as key
      *
      * channel_clients: Channel_client hashtable which will include the client
      *
-     * Returns: The channel_client with given nickname.
+     * Returns: The channel_client of the user, or NULL if it is not a member.
      */
     channel_client *clientvalue = NULL;
-    HASH_FIND_STR(*channel_clients, nickname, clientvalue);
+    HASH_FIND_PTR(*channel_clients, &user, clientvalue);
 
     return clientvalue;
 }
 
 
-channel_client *add_CHANNEL_CLIENT(sds nickname, channel_client **channel_clients)
+channel_client *add_CHANNEL_CLIENT(client_t *user, channel_t *channel)
 {
     /*
-     * add_CHANNEL_CLIENT -  Add client with the given channel name to the channel(Not thread-safe)
+     * add_CHANNEL_CLIENT -  Add a user to the channel, with no mode, and the
+     * channel to the user's channels (Not thread-safe)
      *
-     * nickname: The nickname you want to insert the client into the channel as key
+     * user: The user you want to insert into the channel as key
      *
-     * channel_clients: Channel_client hashtable which will include the client
+     * channel: The channel
      *
-     * Returns: The channel_client with given nickname after adding it to the hashtable.
+     * Returns: The channel_client of the user after adding it to the hashtable.
      */
     channel_client *clientvalue = NULL;
-    HASH_FIND_STR(*channel_clients, nickname, clientvalue);
+    HASH_FIND_PTR(channel->channel_clients, &user, clientvalue);
 
     if (clientvalue != NULL)
     {
         return clientvalue;
     }
     channel_client *client_add = malloc(sizeof(channel_client));
-    client_add->nick = sdsempty();
-    client_add->nick = sdscpy(client_add->nick, nickname);
-    HASH_ADD_STR(*channel_clients, nick, client_add);
+    client_add->user = user;
+    client_add->modes = 0;
+    client_add->channel = channel;
+    HASH_ADD_PTR(channel->channel_clients, user, client_add);
+
+    client_add->prev_joined = NULL;
+    client_add->next_joined = user->channels;
+    if (user->channels != NULL)
+    {
+        user->channels->prev_joined = client_add;
+    }
+    user->channels = client_add;
 
     return client_add;
 }
@@ -123,28 +140,140 @@ void remove_CHANNEL(sds channelname, channel_t **channels)
     if (channel_to_remove != NULL)
     {
         HASH_DELETE(hh, *channels, channel_to_remove);
+        sdsfreesplitres(channel_to_remove->names, channel_to_remove->nnames);
+        banlist_free(&channel_to_remove->bans);
+        banlist_free(&channel_to_remove->excepts);
+        banlist_free(&channel_to_remove->invites);
         free(channel_to_remove);
     }
 }
 
 
-void remove_CHANNEL_CLIENT(sds nickname, channel_client **channel_clients)
+void remove_CHANNEL_CLIENT(client_t *user, channel_t *channel)
 {
     /*
-     * remove_CHANNEL_CLIENT -  Remove channel_client with the given nickname from channels(Not thread-safe)
+     * remove_CHANNEL_CLIENT -  Remove the membership of a user from a channel
+     * and from the user's channels (Not thread-safe)
      *
-     * nickname: The nickname you want to remove as key
+     * user: The user you want to remove as key
      *
-     * channel_clients: Channel_client hashtable which include the channel_client
+     * channel: The channel
      *
      * Return: nothing
      */
     channel_client *client_to_remove;
-    HASH_FIND_STR(*channel_clients, nickname, client_to_remove);
+    HASH_FIND_PTR(channel->channel_clients, &user, client_to_remove);
     
     if (client_to_remove != NULL)
     {
-        HASH_DELETE(hh, *channel_clients, client_to_remove);
+        HASH_DELETE(hh, channel->channel_clients, client_to_remove);
+        if (client_to_remove->prev_joined != NULL)
+        {
+            client_to_remove->prev_joined->next_joined = client_to_remove->next_joined;
+        }
+        else
+        {
+            user->channels = client_to_remove->next_joined;
+        }
+        if (client_to_remove->next_joined != NULL)
+        {
+            client_to_remove->next_joined->prev_joined = client_to_remove->prev_joined;
+        }
         free(client_to_remove);
     }
-}
\ No newline at end of file
+}
+
+
+/*
+ * names_append - Append one "[@]nick" entry to the member list pieces
+ *
+ * c: The channel
+ *
+ * cc: The member
+ *
+ * Returns: nothing
+ */
+static void names_append(channel_t *c, channel_client *cc)
+{
+    bool op = cc->modes & MEMBER_OP;
+    size_t len = sdslen(cc->user->info.nick) + (op ? 1 : 0);
+    sds last = c->nnames > 0 ? c->names[c->nnames - 1] : NULL;
+
+    if (last == NULL || sdslen(last) + 1 + len > NAMES_CHUNK_BYTES)
+    {
+        c->names = realloc(c->names, (c->nnames + 1) * sizeof(sds));
+        last = c->names[c->nnames++] = sdsMakeRoomFor(sdsempty(), NAMES_CHUNK_BYTES);
+    }
+    else
+    {
+        last = sdscatlen(last, " ", 1);
+    }
+
+    if (op)
+    {
+        last = sdscatlen(last, "@", 1);
+    }
+    c->names[c->nnames - 1] = sdscatsds(last, cc->user->info.nick);
+}
+
+
+void channel_names_add(channel_t *c, channel_client *cc)
+{
+    /*
+     * channel_names_add - Append a member to the cached member list of a
+     * channel (Not thread-safe)
+     *
+     * c: The channel
+     *
+     * cc: The member that was added to the channel
+     *
+     * Returns: nothing
+     */
+    if (!c->names_stale)
+    {
+        names_append(c, cc);
+    }
+}
+
+
+void channel_names_invalidate(channel_t *c)
+{
+    /*
+     * channel_names_invalidate - Mark the cached member list of a channel as
+     * stale (Not thread-safe)
+     *
+     * c: The channel
+     *
+     * Returns: nothing
+     */
+    c->names_stale = true;
+}
+
+
+sds *channel_names_get(channel_t *c, int *count)
+{
+    /*
+     * channel_names_get - Return the cached member list of a channel,
+     * rebuilding it first if it is stale (Not thread-safe)
+     *
+     * c: The channel
+     *
+     * count: The number of pieces returned
+     *
+     * Returns: The pieces, owned by the channel
+     */
+    if (c->names_stale)
+    {
+        sdsfreesplitres(c->names, c->nnames);
+        c->names = NULL;
+        c->nnames = 0;
+        for (channel_client *cc = c->channel_clients; cc != NULL; cc = cc->hh.next)
+        {
+            names_append(c, cc);
+        }
+        c->names_stale = false;
+    }
+
+    *count = c->nnames;
+    return c->names;
+}
@@ -3,21 +3,34 @@
 
 #include <pthread.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include "../lib/uthash.h"
 #include "../lib/sds/sds.h"
+#include "banlist.h"
+#include "client.h"
 
+#define NAMES_CHUNK_BYTES 256 /* Size of the pieces of the cached member list */
 
-/* A hash table for clients' information in a channel */
+#define MEMBER_OP 0x01 /* channel_client modes: channel operator (+o) */
+
+
+/*
+ * A hash table for clients' information in a channel. A member refers to
+ * the user's client_t rather than copying its nick, so a NICK leaves the
+ * memberships alone; the client_t outlives its memberships. Each
+ * membership is also in the list of the user's channels, so the channels
+ * of a user are found without going through all of them.
+ */
 typedef struct channel_client
 {
     /* Key for hashtable */
-    sds nick;
-    /* 
-     * The mode for the client,
-     * "o" if first added, could be
-     * "+o" or "-o" in different modes 
-     */
-    sds mode;
+    client_t *user;
+    /* The member's channel modes, MEMBER_* bits */
+    uint8_t modes;
+    /* The channel, and the other memberships of the user (user->channels) */
+    struct channel_t *channel;
+    struct channel_client *next_joined;
+    struct channel_client *prev_joined;
     UT_hash_handle hh;
 } channel_client;
 
@@ -26,8 +39,25 @@ typedef struct channel_t
 {
     /* key for hashtable */
     sds channel_name;
+    /* network-wide channel ID, assigned by the server that created it */
+    uint64_t cid;
     /* channel_clients hashtable for the channel*/
     channel_client *channel_clients;
+    /*
+     * Cached member list for RPL_NAMREPLY: "[@]nick" entries separated
+     * by spaces, in pieces of at most NAMES_CHUNK_BYTES. Joins append to
+     * it; parts and mode changes mark it stale and it is rebuilt on the
+     * next use.
+     */
+    sds *names;
+    int nnames;
+    bool names_stale;
+    /* MODE +b, +e and +I lists, compiled for the JOIN checks */
+    banlist_t bans;
+    banlist_t excepts;
+    banlist_t invites;
+    /* Key for ctx->channels_hashtable, or for the table of the shard
+     * owning it with channel shards */
     UT_hash_handle hh;
 } channel_t;
 
@@ -57,27 +87,28 @@ channel_t *add_CHANNEL(sds channelname, channel_t **channels);
 
 
 /*
- * find_CHANNEL_CLIENT -  Find the client in channel with the given nick name (Not thread-safe)
+ * find_CHANNEL_CLIENT -  Find the membership of a user in a channel (Not thread-safe)
  *
- * nickname: The nickname of the client you want to search as key
+ * user: The user you want to search as key
  *
  * channel_clients: Channel_client hashtable which will include the client
  *
- * Returns: The channel_client with given nickname.
+ * Returns: The channel_client of the user, or NULL if it is not a member.
  */
-channel_client *find_CHANNEL_CLIENT(sds nickname, channel_client **channel_clients);
+channel_client *find_CHANNEL_CLIENT(client_t *user, channel_client **channel_clients);
 
 
 /*
- * add_CHANNEL_CLIENT -  Add client with the given channel name to the channel(Not thread-safe)
+ * add_CHANNEL_CLIENT -  Add a user to the channel, with no mode, and the
+ * channel to the user's channels (Not thread-safe)
  *
- * nickname: The nickname you want to insert the client into the channel as key
+ * user: The user you want to insert into the channel as key
  *
- * channel_clients: Channel_client hashtable which will include the client
+ * channel: The channel
  *
- * Returns: The channel_client with given nickname after adding it to the hashtable.
+ * Returns: The channel_client of the user after adding it to the hashtable.
  */
-channel_client *add_CHANNEL_CLIENT(sds nickname, channel_client **channel_clients);
+channel_client *add_CHANNEL_CLIENT(client_t *user, channel_t *channel);
 
 
 /*
@@ -93,14 +124,52 @@ void remove_CHANNEL(sds channelname, channel_t **channels);
 
 
 /*
- * remove_CHANNEL_CLIENT -  Remove channel_client with the given nickname from channels(Not thread-safe)
+ * remove_CHANNEL_CLIENT -  Remove the membership of a user from a channel
+ * and from the user's channels (Not thread-safe)
+ *
+ * user: The user you want to remove as key
+ *
+ * channel: The channel
+ *
+ * Returns: nothing
+ */
+void remove_CHANNEL_CLIENT(client_t *user, channel_t *channel);
+
+
+/*
+ * channel_names_add - Append a member to the cached member list of a
+ * channel (Not thread-safe)
  *
- * nickname: The nickname you want to remove as key
+ * c: The channel
  *
- * channel_clients: Channel_client hashtable which include the channel_client
+ * cc: The member that was added to the channel
  *
  * Returns: nothing
  */
-void remove_CHANNEL_CLIENT(sds nickname, channel_client **channel_clients);
+void channel_names_add(channel_t *c, channel_client *cc);
+
+
+/*
+ * channel_names_invalidate - Mark the cached member list of a channel as
+ * stale after a member left, changed mode or changed nick (Not thread-safe)
+ *
+ * c: The channel
+ *
+ * Returns: nothing
+ */
+void channel_names_invalidate(channel_t *c);
+
+
+/*
+ * channel_names_get - Return the cached member list of a channel,
+ * rebuilding it first if it is stale (Not thread-safe)
+ *
+ * c: The channel
+ *
+ * count: The number of pieces returned
+ *
+ * Returns: The pieces, owned by the channel
+ */
+sds *channel_names_get(channel_t *c, int *count);
 
 #endif
\ No newline at end of file
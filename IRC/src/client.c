@@ -64,6 +64,121 @@ nick_t *add_NICK(sds nickname, int client_socket, nick_t **nicks)
 }
 
 
+/* Set a nick or username: in the client_t when it fits, on the heap otherwise */
+static void user_str_set(user_str_t *inline_str, sds *s, const char *value)
+{
+    size_t len = strlen(value);
+
+    if (len <= USER_INLINE_LEN)
+    {
+        if (*s != NULL && *s != inline_str->buf)
+        {
+            sdsfree(*s);
+        }
+        memmove(inline_str->buf, value, len);
+        inline_str->buf[len] = '\0';
+        inline_str->len = len;
+        inline_str->alloc = USER_INLINE_LEN;
+        inline_str->flags = SDS_TYPE_8;
+        *s = inline_str->buf;
+    }
+    else if (*s == NULL || *s == inline_str->buf)
+    {
+        *s = sdsnewlen(value, len);
+    }
+    else
+    {
+        *s = sdscpylen(*s, value, len);
+    }
+}
+
+
+client_t *new_USER(int client_socket, sds client_hostname, uint64_t uid)
+{
+    /*
+     * new_USER - Allocate the client_t of a new connection
+     *
+     * client_socket: The client socket for the client
+     *
+     * client_hostname: The client's hostname, copied
+     *
+     * uid: network-wide ID of the user
+     *
+     * Return: The new client_t, to be added with add_USER.
+     */
+    client_t *client = malloc(sizeof(client_t));
+
+    client->socket = client_socket;
+    client->uid = uid;
+    client->relay_epoch = 0;
+    client->channels = NULL;
+    client->server = NULL;
+    client->client_hostname = sdsdup(client_hostname);
+    client->info.nick = NULL;
+    client->info.username = NULL;
+    user_str_set(&client->info.nick_buf, &client->info.nick, "");
+    user_str_set(&client->info.username_buf, &client->info.username, "");
+    client->info.realname = sdsempty();
+    client->info.state = NOT_REGISTERED;
+    client->info.is_irc_operator = false;
+
+    return client;
+}
+
+
+void user_set_nick(user_t *info, const char *nick)
+{
+    /*
+     * user_set_nick - Set the nickname of a user, inline if it fits
+     *
+     * info: The user
+     *
+     * nick: The new nickname
+     *
+     * Return: nothing
+     */
+    user_str_set(&info->nick_buf, &info->nick, nick);
+}
+
+
+void user_set_username(user_t *info, const char *username)
+{
+    /*
+     * user_set_username - Set the username of a user, inline if it fits
+     *
+     * info: The user
+     *
+     * username: The new username
+     *
+     * Return: nothing
+     */
+    user_str_set(&info->username_buf, &info->username, username);
+}
+
+
+void free_USER(client_t *client)
+{
+    /*
+     * free_USER - Free a client_t that is in no hashtable
+     *
+     * client: The client
+     *
+     * Return: nothing
+     */
+    if (client->info.nick != client->info.nick_buf.buf)
+    {
+        sdsfree(client->info.nick);
+    }
+    if (client->info.username != client->info.username_buf.buf)
+    {
+        sdsfree(client->info.username);
+    }
+    sdsfree(client->info.realname);
+    sdsfree(client->client_hostname);
+    free(client);
+}
+
+
 client_t *find_USER(int client_socket, client_t **client_hashtable)
 {
     /*
@@ -149,6 +264,6 @@ void remove_USER(int client_socket, client_t **clients)
     if (client != NULL)
     {
         HASH_DELETE(hh, *clients, client);
-        free(client);
+        free_USER(client);
     }
 }
\ No newline at end of file
@@ -3,6 +3,7 @@
 
 #include <pthread.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include "../lib/uthash.h"
 #include "../lib/sds/sds.h"
 
@@ -14,23 +15,46 @@ typedef enum
     REGISTERED = 3
 } conn_status;
 
+#define USER_INLINE_LEN 15 /* Nicks and usernames up to this long are kept inside the client_t */
+
+/*
+ * Inline storage of a short string, laid out like an sds with an 8-bit
+ * header: the sds pointing at buf works with every sds function that
+ * does not need to grow it. Set it with user_set_nick/user_set_username,
+ * which move the string to the heap when it does not fit.
+ */
+typedef struct __attribute__((__packed__)) user_str
+{
+    uint8_t len;
+    uint8_t alloc;
+    unsigned char flags;
+    char buf[USER_INLINE_LEN + 1];
+} user_str_t;
+
 /* user_info is used to record user information upon registration */
 typedef struct user_info
 {
-    sds nick;             // User's nickname
-    sds username;         // User's username
+    sds nick;             // User's nickname, in nick_buf if it fits
+    sds username;         // User's username, in username_buf if it fits
     sds realname;         // User's realname
-    conn_status state;    // User's connected status, defined in conn_status struct
+    uint8_t state;        // User's connected status, a conn_status
     bool is_irc_operator; // If the user is irc_operator or channel operator
+    user_str_t nick_buf;
+    user_str_t username_buf;
 } user_t;
 
 /* This struct is a hashtable whose key is the client's hostname
  * and value is the user_info_t struct belonging to that client
- * so that we can uniquely identify each client and their registered info
+ * so that we can uniquely identify each client and their registered info.
+ * Channel members refer to it rather than copy the nick.
  */
 typedef struct client_t
 {
     int socket;          /* key for hastable */
+    uint64_t uid;        /* network-wide user ID assigned by this server */
+    uint64_t relay_epoch; /* Last neighbor search (NICK/QUIT relay, WHO) that reached this user, protected by channels_lock */
+    struct channel_client *channels; /* Memberships of the user, linked by next_joined, protected by channels_lock */
+    struct irc_server *server; /* Server the user is connected to, NULL for a user of this server */
     sds client_hostname; /* client hostname */
     user_t info;         /* value for hashtable */
     UT_hash_handle hh;
@@ -70,6 +94,51 @@ nick_t *find_NICK(sds nickname, nick_t **nicks);
  */
 nick_t *add_NICK(sds nickname, int client_socket, nick_t **nicks);
 
+/*
+ * new_USER - Allocate the client_t of a new connection, not registered
+ * yet and with empty nick, username and realname
+ *
+ * client_socket: The client socket for the client
+ *
+ * client_hostname: The client's hostname, copied
+ *
+ * uid: network-wide ID of the user
+ *
+ * Return: The new client_t, to be added with add_USER.
+ */
+client_t *new_USER(int client_socket, sds client_hostname, uint64_t uid);
+
+/*
+ * user_set_nick - Set the nickname of a user, inline if it fits
+ *
+ * info: The user
+ *
+ * nick: The new nickname
+ *
+ * Return: nothing
+ */
+void user_set_nick(user_t *info, const char *nick);
+
+/*
+ * user_set_username - Set the username of a user, inline if it fits
+ *
+ * info: The user
+ *
+ * username: The new username
+ *
+ * Return: nothing
+ */
+void user_set_username(user_t *info, const char *username);
+
+/*
+ * free_USER - Free a client_t that is in no hashtable
+ *
+ * client: The client
+ *
+ * Return: nothing
+ */
+void free_USER(client_t *client);
+
 /*
  * find_USER -  Find connected client from client_hashtable
  * table if exists(Not thread-safe)
@@ -119,4 +188,4 @@ void remove_NICK(sds nick, nick_t **nicks);
  * Returns: nothing
  */
 void remove_USER(int client_socket, client_t **clients);
-#endif
\ No newline at end of file
+#endif
@@ -0,0 +1,231 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include "compress.h"
+#include "reply.h"
+#include "log.h"
+#include "../lib/sds/sds.h"
+
+
+/*
+ * out_window - Make room at the end of out and point a zlib stream's
+ * output window at it
+ *
+ * strm: the zlib stream
+ *
+ * out: sds string the stream writes into
+ *
+ * Return: the size of the window
+ */
+static size_t out_window(z_stream *strm, sds *out)
+{
+    *out = sdsMakeRoomFor(*out, LINK_COMPRESS_CHUNK);
+    size_t avail = sdsavail(*out);
+
+    if (avail > UINT_MAX)
+    {
+        avail = UINT_MAX;
+    }
+    strm->next_out = (Bytef *)(*out + sdslen(*out));
+    strm->avail_out = (uInt)avail;
+
+    return avail;
+}
+
+
+/*
+ * run_deflate - Feed the pending input of the deflater through zlib
+ *
+ * z: the link streams
+ *
+ * flush: zlib flush mode
+ *
+ * out: compressed bytes are appended here
+ *
+ * Return: CHIRC_OK/CHIRC_ERROR
+ */
+static int run_deflate(link_zstream_t *z, int flush, sds *out)
+{
+    do
+    {
+        size_t avail = out_window(&z->deflater, out);
+
+        if (deflate(&z->deflater, flush) == Z_STREAM_ERROR)
+        {
+            chilog(ERROR, "deflate() failed on server link");
+            return CHIRC_ERROR;
+        }
+
+        size_t produced = avail - z->deflater.avail_out;
+        sdsIncrLen(*out, produced);
+        z->compressed_out += produced;
+    } while (z->deflater.avail_out == 0);
+
+    return CHIRC_OK;
+}
+
+
+bool link_compress_requested(const char *options)
+{
+    /*
+     * link_compress_requested - Check if the options of a PASS command ask
+     * for a compressed link
+     *
+     * options: the flags parameter of PASS, e.g. "chirc|Z"
+     *
+     * Return: true if the LINK_COMPRESS_FLAG flag is present
+     */
+    const char *flags = options ? strchr(options, '|') : NULL;
+
+    return flags != NULL && strchr(flags + 1, LINK_COMPRESS_FLAG) != NULL;
+}
+
+
+int link_zstream_init(link_zstream_t *z, int level, link_flush_t flush)
+{
+    /*
+     * link_zstream_init - Initialize the streams of a compressed link
+     *
+     * z: the link streams
+     *
+     * level: zlib compression level (0-9, or Z_DEFAULT_COMPRESSION)
+     *
+     * flush: flush policy for outgoing data
+     *
+     * Return: CHIRC_OK/CHIRC_ERROR
+     */
+    memset(z, 0, sizeof(link_zstream_t));
+    z->flush = flush;
+    z->flush_bytes = LINK_COMPRESS_FLUSH_BYTES;
+
+    if (deflateInit(&z->deflater, level) != Z_OK)
+    {
+        chilog(ERROR, "deflateInit() failed with level %d", level);
+        return CHIRC_ERROR;
+    }
+
+    if (inflateInit(&z->inflater) != Z_OK)
+    {
+        chilog(ERROR, "inflateInit() failed");
+        deflateEnd(&z->deflater);
+        return CHIRC_ERROR;
+    }
+
+    return CHIRC_OK;
+}
+
+
+int link_zstream_compress(link_zstream_t *z, const char *buf, size_t len, sds *out)
+{
+    /*
+     * link_zstream_compress - Compress outgoing data
+     *
+     * z: the link streams
+     *
+     * buf: data to compress, usually one or more complete IRC lines
+     *
+     * len: length of buf
+     *
+     * out: compressed bytes ready to be sent are appended here
+     *
+     * Return: CHIRC_OK/CHIRC_ERROR
+     */
+    int flush = Z_NO_FLUSH;
+
+    z->deflater.next_in = (Bytef *)buf;
+    z->deflater.avail_in = (uInt)len;
+    z->raw_out += len;
+    z->pending += len;
+
+    if (z->flush == LINK_FLUSH_SYNC || z->pending >= z->flush_bytes)
+    {
+        flush = Z_SYNC_FLUSH;
+        z->pending = 0;
+    }
+
+    return run_deflate(z, flush, out);
+}
+
+
+int link_zstream_flush(link_zstream_t *z, sds *out)
+{
+    /*
+     * link_zstream_flush - Flush all pending outgoing data
+     *
+     * z: the link streams
+     *
+     * out: compressed bytes ready to be sent are appended here
+     *
+     * Return: CHIRC_OK/CHIRC_ERROR
+     */
+    if (z->pending == 0)
+    {
+        return CHIRC_OK;
+    }
+
+    z->deflater.next_in = NULL;
+    z->deflater.avail_in = 0;
+    z->pending = 0;
+
+    return run_deflate(z, Z_SYNC_FLUSH, out);
+}
+
+
+int link_zstream_decompress(link_zstream_t *z, const char *buf, size_t len, sds *out)
+{
+    /*
+     * link_zstream_decompress - Decompress incoming data
+     *
+     * z: the link streams
+     *
+     * buf: bytes received on the link
+     *
+     * len: length of buf
+     *
+     * out: decompressed bytes are appended here
+     *
+     * Return: CHIRC_OK/CHIRC_ERROR (corrupt stream)
+     */
+    z->inflater.next_in = (Bytef *)buf;
+    z->inflater.avail_in = (uInt)len;
+    z->compressed_in += len;
+
+    do
+    {
+        size_t avail = out_window(&z->inflater, out);
+        int rc = inflate(&z->inflater, Z_SYNC_FLUSH);
+
+        if (rc != Z_OK && rc != Z_BUF_ERROR && rc != Z_STREAM_END)
+        {
+            chilog(ERROR, "inflate() failed on server link: %s",
+                   z->inflater.msg ? z->inflater.msg : "corrupt stream");
+            return CHIRC_ERROR;
+        }
+
+        size_t produced = avail - z->inflater.avail_out;
+        sdsIncrLen(*out, produced);
+        z->raw_in += produced;
+
+        if (rc == Z_STREAM_END || (rc == Z_BUF_ERROR && produced == 0))
+        {
+            break;
+        }
+    } while (z->inflater.avail_in > 0 || z->inflater.avail_out == 0);
+
+    return CHIRC_OK;
+}
+
+
+void link_zstream_free(link_zstream_t *z)
+{
+    /*
+     * link_zstream_free - Release the zlib state of a link
+     *
+     * z: the link streams
+     *
+     * Return: nothing
+     */
+    deflateEnd(&z->deflater);
+    inflateEnd(&z->inflater);
+}
@@ -0,0 +1,115 @@
+#ifndef COMPRESS_H_
+#define COMPRESS_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <zlib.h>
+#include "../lib/sds/sds.h"
+
+#define LINK_COMPRESS_FLAG 'Z'          /* PASS option flag requesting a compressed link (RFC 2813) */
+#define LINK_COMPRESS_DEFAULT_LEVEL 6
+#define LINK_COMPRESS_FLUSH_BYTES 16384 /* Batch flush threshold */
+#define LINK_COMPRESS_CHUNK 4096
+
+/* When compressed bytes are handed back to the caller for sending */
+typedef enum
+{
+    /* Flush after every message. Lowest latency, each message can be
+     * decompressed as soon as it arrives, but every flush costs a few
+     * bytes of framing and resets the matcher's lookahead. */
+    LINK_FLUSH_SYNC = 0,
+    /* Only flush once LINK_COMPRESS_FLUSH_BYTES of input are pending, or
+     * when link_zstream_flush() is called (e.g. when the send loop runs
+     * out of queued messages). Best ratio for bursts. */
+    LINK_FLUSH_BATCH = 1
+} link_flush_t;
+
+/* One direction pair of a compressed server link */
+typedef struct link_zstream
+{
+    z_stream deflater;          /* Outgoing stream */
+    z_stream inflater;          /* Incoming stream */
+    link_flush_t flush;         /* Flush policy for the outgoing stream */
+    size_t flush_bytes;         /* Pending input that triggers a batch flush */
+    size_t pending;             /* Input bytes not yet flushed */
+    uint64_t raw_out;           /* Bytes given to link_zstream_compress */
+    uint64_t compressed_out;    /* Bytes produced by the deflater */
+    uint64_t compressed_in;     /* Bytes given to link_zstream_decompress */
+    uint64_t raw_in;            /* Bytes produced by the inflater */
+} link_zstream_t;
+
+/*
+ * link_compress_requested - Check if the options of a PASS command ask
+ * for a compressed link
+ *
+ * options: the flags parameter of PASS, e.g. "chirc|Z"
+ *
+ * Return: true if the LINK_COMPRESS_FLAG flag is present
+ */
+bool link_compress_requested(const char *options);
+
+/*
+ * link_zstream_init - Initialize the streams of a compressed link
+ *
+ * z: the link streams
+ *
+ * level: zlib compression level (0-9, or Z_DEFAULT_COMPRESSION)
+ *
+ * flush: flush policy for outgoing data
+ *
+ * Return: CHIRC_OK/CHIRC_ERROR
+ */
+int link_zstream_init(link_zstream_t *z, int level, link_flush_t flush);
+
+/*
+ * link_zstream_compress - Compress outgoing data
+ *
+ * z: the link streams
+ *
+ * buf: data to compress, usually one or more complete IRC lines
+ *
+ * len: length of buf
+ *
+ * out: compressed bytes ready to be sent are appended here. With
+ * LINK_FLUSH_BATCH nothing may be appended until enough data is pending.
+ *
+ * Return: CHIRC_OK/CHIRC_ERROR
+ */
+int link_zstream_compress(link_zstream_t *z, const char *buf, size_t len, sds *out);
+
+/*
+ * link_zstream_flush - Flush all pending outgoing data
+ *
+ * z: the link streams
+ *
+ * out: compressed bytes ready to be sent are appended here
+ *
+ * Return: CHIRC_OK/CHIRC_ERROR
+ */
+int link_zstream_flush(link_zstream_t *z, sds *out);
+
+/*
+ * link_zstream_decompress - Decompress incoming data
+ *
+ * z: the link streams
+ *
+ * buf: bytes received on the link
+ *
+ * len: length of buf
+ *
+ * out: decompressed bytes are appended here, to be fed to the line framer
+ *
+ * Return: CHIRC_OK/CHIRC_ERROR (corrupt stream)
+ */
+int link_zstream_decompress(link_zstream_t *z, const char *buf, size_t len, sds *out);
+
+/*
+ * link_zstream_free - Release the zlib state of a link
+ *
+ * z: the link streams
+ *
+ * Return: nothing
+ */
+void link_zstream_free(link_zstream_t *z);
+
+#endif
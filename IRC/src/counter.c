@@ -0,0 +1,79 @@
+#include <stdatomic.h>
+#include "counter.h"
+
+static _Atomic unsigned int next_shard;
+static __thread int thread_shard = -1;
+
+
+/*
+ * my_shard - Return the shard index of the calling thread
+ */
+static int my_shard(void)
+{
+    if (thread_shard < 0)
+    {
+        thread_shard = atomic_fetch_add_explicit(&next_shard, 1, memory_order_relaxed) % COUNTER_SHARDS;
+    }
+    return thread_shard;
+}
+
+
+void counter_add(counters_t *c, counter_id_t id, int64_t delta)
+{
+    /*
+     * counter_add - Add to a counter (lock-free)
+     *
+     * c: the counters
+     *
+     * id: which counter
+     *
+     * delta: what to add, negative to subtract
+     *
+     * Return: nothing
+     */
+    atomic_fetch_add_explicit(&c->shards[my_shard()].values[id], delta, memory_order_relaxed);
+}
+
+
+int64_t counter_read(counters_t *c, counter_id_t id)
+{
+    /*
+     * counter_read - Sum the shards of a counter (lock-free)
+     *
+     * c: the counters
+     *
+     * id: which counter
+     *
+     * Return: the count, never negative
+     */
+    int64_t sum = 0;
+
+    for (int i = 0; i < COUNTER_SHARDS; i++)
+    {
+        sum += atomic_load_explicit(&c->shards[i].values[id], memory_order_relaxed);
+    }
+
+    /* A decrement may be summed before the increment it follows */
+    return sum > 0 ? sum : 0;
+}
+
+
+void counter_set(counters_t *c, counter_id_t id, int64_t value)
+{
+    /*
+     * counter_set - Set a counter, e.g. to the count restored by a live
+     * upgrade (Not thread-safe)
+     *
+     * c: the counters
+     *
+     * id: which counter
+     *
+     * value: the new count
+     *
+     * Return: nothing
+     */
+    for (int i = 0; i < COUNTER_SHARDS; i++)
+    {
+        atomic_store_explicit(&c->shards[i].values[id], i == 0 ? value : 0, memory_order_relaxed);
+    }
+}
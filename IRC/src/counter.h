@@ -0,0 +1,77 @@
+#ifndef COUNTER_H_
+#define COUNTER_H_
+
+#include <stdint.h>
+#include <stdatomic.h>
+
+#define COUNTER_SHARDS 16   /* Threads are spread over this many copies of the counters */
+#define COUNTER_LINE 64     /* Bytes of a cache line, so shards do not share one */
+
+/* The counts LUSERS reports */
+typedef enum
+{
+    COUNTER_USERS = 0,      /* Registered users */
+    COUNTER_CONNECTIONS,    /* Open connections, registered or not */
+    COUNTER_CLIENTS,        /* Entries of ctx->client_hashtable, NICK or USER seen */
+    COUNTER_CHANNELS,       /* Entries of ctx->channels_hashtable */
+    COUNTER_OPERATORS,      /* Entries of ctx->irc_operators_hashtable */
+    COUNTERS
+} counter_id_t;
+
+/*
+ * Counters updated by every registration, disconnect, JOIN and PART.
+ * Like the stats module, each thread is pinned to one of COUNTER_SHARDS
+ * shards on first use and updates it with relaxed atomics, and readers
+ * sum the shards. A sum is not a snapshot: counts changed while it is
+ * taken may be seen in one counter and not yet in another.
+ */
+typedef union counter_shard
+{
+    _Atomic int64_t values[COUNTERS];
+    char line[COUNTER_LINE];
+} counter_shard_t;
+
+typedef struct counters
+{
+    counter_shard_t shards[COUNTER_SHARDS];
+} counters_t;
+
+/*
+ * counter_add - Add to a counter (lock-free)
+ *
+ * c: the counters
+ *
+ * id: which counter
+ *
+ * delta: what to add, negative to subtract
+ *
+ * Return: nothing
+ */
+void counter_add(counters_t *c, counter_id_t id, int64_t delta);
+
+/*
+ * counter_read - Sum the shards of a counter (lock-free)
+ *
+ * c: the counters
+ *
+ * id: which counter
+ *
+ * Return: the count, never negative
+ */
+int64_t counter_read(counters_t *c, counter_id_t id);
+
+/*
+ * counter_set - Set a counter, e.g. to the count restored by a live
+ * upgrade (Not thread-safe)
+ *
+ * c: the counters
+ *
+ * id: which counter
+ *
+ * value: the new count
+ *
+ * Return: nothing
+ */
+void counter_set(counters_t *c, counter_id_t id, int64_t value);
+
+#endif
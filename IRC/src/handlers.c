@@ -7,6 +7,13 @@
 #include "channels.h"
 #include "server_cmd.h"
 #include "send_msg.h"
+#include "stats.h"
+#include "chanlist.h"
+#include "history.h"
+#include "persist.h"
+#include "shard.h"
+#include "trace.h"
+#include "link.h"
 
 /* Dispatch table */
 struct handler_entry handlers[] = {
@@ -21,11 +28,46 @@ struct handler_entry handlers[] = {
     {"LUSERS", handle_LUSERS},
     {"WHOIS", handle_WHOIS},
     {"LIST", handle_LIST},
+    {"NAMES", handle_NAMES},
+    {"WHO", handle_WHO},
+    {"HISTORY", handle_HISTORY},
     {"MODE", handle_MODE},
     {"OPER", handle_OPER},
     {"PART", handle_PART},
+    {"STATS", handle_STATS},
+    {"PASS", handle_PASS},
+    {"SERVER", handle_SERVER},
+    {"CONNECT", handle_CONNECT},
 };
 
+#define NUM_HANDLERS (int)(sizeof(handlers) / sizeof(struct handler_entry))
+
+
+/*
+ * dispatch_request - Run the handler at index j of the dispatch table
+ * (j == NUM_HANDLERS for unknown commands) and send the registration
+ * replies that follow it
+ */
+static int dispatch_request(server_ctx *ctx, sds *cmdtokens, int argc, conn_info_t *conn, int j);
+
+
+void register_handler_stats(void)
+{
+    /*
+     * register_handler_stats - Name the stats slots of every command in
+     * the dispatch table, plus one for unknown commands and one for the
+     * commands received on server links
+     *
+     * Return: nothing
+     */
+    for (int j = 0; j < NUM_HANDLERS; j++)
+    {
+        stats_register_command(j, handlers[j].name);
+    }
+    stats_register_command(NUM_HANDLERS, "UNKNOWN");
+    stats_register_command(NUM_HANDLERS + 1, "LINK");
+}
+
 
 int handle_request(server_ctx *ctx, sds *cmdtokens, int argc, conn_info_t *conn)
 {
@@ -42,19 +84,62 @@ int handle_request(server_ctx *ctx, sds *cmdtokens, int argc, conn_info_t *conn)
      *
      * Return: CHIRC_OK/CHIRC_ERROR
      */
-    int j, rc = 0;
-    int client_socket = conn->client_socket;
-    sds server_hostname = conn->server_hostname;
-    sds client_hostname = conn->client_hostname;
-    int num_handlers = sizeof(handlers) / sizeof(struct handler_entry);
+    int j;
+    uint64_t dispatch_ns = stats_now();
+
+    if (argc == 0)
+    {
+        /* An empty line: the tokens are not set */
+        return CHIRC_OK;
+    }
+
+    trace_msg = conn->trace_id;
+    int rc;
 
-    for (j = 0; j < num_handlers; j++)
+    if (conn->link != NULL && !link_user_hello(conn, cmdtokens[0]))
     {
-        if (!strncmp(handlers[j].name, cmdtokens[0], MAX_STR_LEN))
+        /* A server link, with commands of its own */
+        j = NUM_HANDLERS + 1;
+        rc = link_request(ctx, cmdtokens, argc, conn);
+    }
+    else
+    {
+        for (j = 0; j < NUM_HANDLERS; j++)
         {
-            rc = handlers[j].func(ctx, cmdtokens, argc, conn);
-            break;
+            if (!strncmp(handlers[j].name, cmdtokens[0], MAX_STR_LEN))
+            {
+                break;
+            }
         }
+        rc = dispatch_request(ctx, cmdtokens, argc, conn, j);
+    }
+    uint64_t done_ns = stats_now();
+
+    stats_record_command(j, conn->recv_ns, dispatch_ns, done_ns);
+    if (trace_msg != 0)
+    {
+        trace_span(trace_msg, "dispatch", stats_command_name(j), dispatch_ns, done_ns);
+        trace_msg = 0;
+    }
+
+    return rc;
+}
+
+
+static int dispatch_request(server_ctx *ctx, sds *cmdtokens, int argc, conn_info_t *conn, int j)
+{
+    /*
+     * dispatch_request - Run the handler at index j of the dispatch table
+     * (j == NUM_HANDLERS for unknown commands) and send the registration
+     * replies that follow it
+     */
+    int rc = 0;
+    int client_socket = conn->client_socket;
+    int num_handlers = NUM_HANDLERS;
+
+    if (j < num_handlers)
+    {
+        rc = handlers[j].func(ctx, cmdtokens, argc, conn);
     }
 
     /* Thread-safe call with a lock wrapped around the find_USER function */
@@ -80,7 +165,15 @@ int handle_request(server_ctx *ctx, sds *cmdtokens, int argc, conn_info_t *conn)
         strncmp(cmdtokens[0], "WHOIS", MAX_STR_LEN) &&
         strncmp(cmdtokens[0], "JOIN", MAX_STR_LEN) &&
         strncmp(cmdtokens[0], "OPER", MAX_STR_LEN) &&
-        strncmp(cmdtokens[0], "MODE", MAX_STR_LEN))
+        strncmp(cmdtokens[0], "MODE", MAX_STR_LEN) &&
+        strncmp(cmdtokens[0], "STATS", MAX_STR_LEN) &&
+        strncmp(cmdtokens[0], "LIST", MAX_STR_LEN) &&
+        strncmp(cmdtokens[0], "NAMES", MAX_STR_LEN) &&
+        strncmp(cmdtokens[0], "WHO", MAX_STR_LEN) &&
+        strncmp(cmdtokens[0], "HISTORY", MAX_STR_LEN) &&
+        strncmp(cmdtokens[0], "PASS", MAX_STR_LEN) &&
+        strncmp(cmdtokens[0], "SERVER", MAX_STR_LEN) &&
+        strncmp(cmdtokens[0], "CONNECT", MAX_STR_LEN))
     {
         if (j == num_handlers) // Unknown command
         {
@@ -117,6 +210,136 @@ int handle_request(server_ctx *ctx, sds *cmdtokens, int argc, conn_info_t *conn)
 }
 
 
+/* A NICK or QUIT to relay once the channel shards found the neighbors */
+typedef struct relay
+{
+    client_t *user;
+    sds prefix;     /* ":nick!user@host" before the command */
+    sds *tokens;    /* Copy of the command */
+    int argc;
+} relay_t;
+
+
+static relay_t *relay_new(client_t *user, sds prefix, sds *cmdtokens, int argc)
+{
+    relay_t *r = malloc(sizeof(relay_t));
+
+    r->user = user;
+    r->prefix = sdsdup(prefix);
+    r->tokens = malloc(argc * sizeof(sds));
+    for (int i = 0; i < argc; i++)
+    {
+        r->tokens[i] = sdsdup(cmdtokens[i]);
+    }
+    r->argc = argc;
+
+    return r;
+}
+
+
+static void relay_free(relay_t *r)
+{
+    sdsfreesplitres(r->tokens, r->argc);
+    sdsfree(r->prefix);
+    free(r);
+}
+
+
+/* shard_neighbors_fn of NICK */
+static void nick_relay(server_ctx *ctx, conn_info_t *conn, int *sockets, int count, void *arg)
+{
+    relay_t *r = (relay_t *)arg;
+
+    server_reply_nick_relay(ctx, r->prefix, r->tokens, r->argc, sockets, count);
+    relay_free(r);
+}
+
+
+/* shard_neighbors_fn of QUIT, run once the user left every channel */
+static void quit_relay(server_ctx *ctx, conn_info_t *conn, int *sockets, int count, void *arg)
+{
+    relay_t *r = (relay_t *)arg;
+
+    server_reply_quit_relay(ctx, r->prefix, r->tokens, r->argc, sockets, count);
+    free_USER(r->user);
+    relay_free(r);
+}
+
+
+void rename_user(server_ctx *ctx, client_t *s, sds prefix, sds *cmdtokens, int argc)
+{
+    /*
+     * rename_user - Relay a nick change to the users sharing a channel with
+     * the user, then change it (without channel shards)
+     *
+     * ctx: The server context
+     *
+     * s: the user
+     *
+     * prefix: ":nick!user@host" of the user before the change
+     *
+     * cmdtokens: "NICK" and the new nick
+     *
+     * argc: the count of tokens
+     *
+     * Return: nothing
+     */
+
+    /* Reply nick update to channels, once to each user sharing any of them */
+    int *sockets;
+    int count = server_find_NEIGHBORS(ctx, s, &sockets);
+    server_reply_nick_relay(ctx, prefix, cmdtokens, argc, sockets, count);
+    free(sockets);
+
+    trace_mutex_lock(&ctx->channels_lock, "channels_lock");
+    for (channel_client *joined = s->channels; joined != NULL; joined = joined->next_joined)
+    {
+        channel_names_invalidate(joined->channel);
+    }
+    trace_mutex_lock(&ctx->clients_lock, "clients_lock");
+    user_set_nick(&s->info, cmdtokens[1]);
+    pthread_mutex_unlock(&ctx->clients_lock);
+    pthread_mutex_unlock(&ctx->channels_lock);
+}
+
+
+void quit_user(server_ctx *ctx, client_t *s, sds prefix, sds *cmdtokens, int argc)
+{
+    /*
+     * quit_user - Relay a QUIT to the users sharing a channel with the
+     * user, take it out of its channels and free it (without channel
+     * shards, once it is out of the clients and nicks hashtables)
+     *
+     * ctx: The server context
+     *
+     * s: the user
+     *
+     * prefix: ":nick!user@host" of the user
+     *
+     * cmdtokens: "QUIT" and its message, if any
+     *
+     * argc: the count of tokens
+     *
+     * Return: nothing
+     */
+
+    /* Relay the QUIT once to each user sharing a channel with the user */
+    int *sockets;
+    int count = server_find_NEIGHBORS(ctx, s, &sockets);
+    server_reply_quit_relay(ctx, prefix, cmdtokens, argc, sockets, count);
+    free(sockets);
+
+    /* Leaving frees the membership, and the channel once it is empty */
+    channel_t **channels = server_lock_CHANNELS(ctx);
+    while (s->channels != NULL)
+    {
+        server_leave_CHANNEL(ctx, channels, s->channels->channel, s);
+    }
+    server_unlock_CHANNELS(ctx);
+    free_USER(s);
+}
+
+
 int handle_NICK(server_ctx *ctx, sds *cmdtokens, int argc, conn_info_t *conn)
 {
     /*
@@ -164,12 +387,7 @@ int handle_NICK(server_ctx *ctx, sds *cmdtokens, int argc, conn_info_t *conn)
     if (s == NULL)
     {
         /* First time user */
-        s = malloc(sizeof(client_t));
-        s->info.nick = sdsempty();
-        s->info.realname = sdsempty();
-        s->info.username = sdsempty();
-        s->info.state = NOT_REGISTERED;
-        s->socket = client_socket;
+        s = new_USER(client_socket, client_hostname, server_new_UID(ctx));
     }
 
     if (argc - 1 < NICK_PARAMETER_NUM)
@@ -183,13 +401,14 @@ int handle_NICK(server_ctx *ctx, sds *cmdtokens, int argc, conn_info_t *conn)
     if (s->info.state == NICK_MISSING)
     {
         s->info.state = REGISTERED;
-        s->info.nick = sdscpy(s->info.nick, cmdtokens[1]);
+        user_set_nick(&s->info, cmdtokens[1]);
 
         /* Tread-safe function to add connected user number */
         add_connected_user_number(ctx);
 
         /* Thread-safe call to add NICK to nick_hashtable */
         server_add_NICK(ctx, s->socket, s->info.nick);
+        link_user_new(ctx, s);
 
         /* reply_registration(ctx, cmdtokens, argc, client_socket, client_hashtable, server_hostname); */
         return REGISTERED;
@@ -207,43 +426,32 @@ int handle_NICK(server_ctx *ctx, sds *cmdtokens, int argc, conn_info_t *conn)
         {
             return CHIRC_ERROR;
         }
+        link_user_nick(ctx, -1, s, cmdtokens[1]);
 
-        /* Reply nick update to channels */
-        channel_t *c;
+        /* Update nick hashtable */
+        /* Tread-safe call to remove_NICK */
+        server_remove_NICK(ctx, s->info.nick);
 
-        pthread_mutex_lock(&ctx->channels_lock);
-        for (c = ctx->channels_hashtable; c != NULL; c = c->hh.next)
+        /* The memberships refer to the client, so only the member lists
+         * of its channels change; the nick is changed under clients_lock,
+         * which the readers of the members' nicks hold */
+        if (ctx->shards != NULL)
         {
-            channel_client *cc = NULL;
-            cc = find_CHANNEL_CLIENT(s->info.nick, &c->channel_clients);
-            if (cc == NULL) // Not in the channel
-                continue;
-            for (cc = c->channel_clients; cc != NULL; cc = cc->hh.next)
-            {
-                /* Reply to the clients in the channel */
-
-                /* Do not send msg to self more than once*/
-                if (!strncmp(cc->nick, s->info.nick, MAX_STR_LEN))
-                {
-                    continue;
-                }
-                /* Tread-safe call to find_NICK */
-                nick_t *msgtarget = server_find_NICK(ctx, cc->nick);
-
-                if (server_reply_nick(ctx, prefix, cmdtokens, argc, msgtarget->client_socket) == MSG_ERROR)
-                {
-                    return CHIRC_ERROR;
-                }
-            }
+            trace_mutex_lock(&ctx->clients_lock, "clients_lock");
+            user_set_nick(&s->info, cmdtokens[1]);
+            pthread_mutex_unlock(&ctx->clients_lock);
+
+            /* The shards of its channels drop their member lists, then
+             * the nick update is relayed once to each user sharing any */
+            shard_neighbors(ctx, conn, s, SHARD_RENAME, nick_relay,
+                            relay_new(s, prefix, cmdtokens, argc));
+        }
+        else
+        {
+            rename_user(ctx, s, prefix, cmdtokens, argc);
         }
-        pthread_mutex_unlock(&ctx->channels_lock);
-
         sdsfree(prefix);
 
-        s->info.nick = sdscpy(s->info.nick, cmdtokens[1]);
-        /* Update nick hashtable */
-        /* Tread-safe call to remove_NICK */
-        server_remove_NICK(ctx, s->info.nick);
         /* Tread-safe call to add_NICK */
         server_add_NICK(ctx, client_socket, s->info.nick);
 
@@ -252,14 +460,14 @@ int handle_NICK(server_ctx *ctx, sds *cmdtokens, int argc, conn_info_t *conn)
     else if (s->info.state == NOT_REGISTERED)
     {
         s->info.state = USER_MISSING;
-        s->info.nick = sdscpy(s->info.nick, cmdtokens[1]);
+        user_set_nick(&s->info, cmdtokens[1]);
         /* Tread-safe call to add_USER */
         server_add_USER(ctx, s, client_socket);
 
         return NOT_REGISTERED;
     }
 
-    s->info.nick = sdscpy(s->info.nick, cmdtokens[1]);
+    user_set_nick(&s->info, cmdtokens[1]);
 
     return NOT_REGISTERED;
 }
@@ -303,16 +511,11 @@ int handle_USER(server_ctx *ctx, sds *cmdtokens, int argc, conn_info_t *conn)
 
     if (s == NULL)
     {
-        s = malloc(sizeof(client_t));
         /* USER_NOT_FOUND, create new user. */
-        s->info.username = sdsempty();
-        s->info.realname = sdsempty();
-        s->info.nick = sdsempty();
-        s->socket = client_socket;
-        s->info.state = NOT_REGISTERED;
+        s = new_USER(client_socket, client_hostname, server_new_UID(ctx));
     }
 
-    s->info.username = sdscpy(s->info.username, cmdtokens[1]);
+    user_set_username(&s->info, cmdtokens[1]);
 
     sds realname = sdsjoinsds(cmdtokens + 4, argc - 4, " ", 1);
 
@@ -338,7 +541,8 @@ int handle_USER(server_ctx *ctx, sds *cmdtokens, int argc, conn_info_t *conn)
         
         /* Tread-safe function to add connected user number */
         add_connected_user_number(ctx);
-        
+        link_user_new(ctx, s);
+
         return REGISTERED;
     }
     else if (s->info.state == NOT_REGISTERED)
@@ -407,93 +611,163 @@ int handle_QUIT(server_ctx *ctx, sds *cmdtokens, int argc, conn_info_t *conn)
                               s->info.username,
                               client_hostname);
 
-    pthread_mutex_lock(&ctx->channels_lock);
-    for (channel_t *c = ctx->channels_hashtable; c != NULL; c = c->hh.next)
+    /* Release the nick, and the socket number for the next connection to use it */
+    server_remove_NICK(ctx, s->info.nick);
+    server_take_USER(ctx, client_socket);
+    link_user_quit(ctx, -1, s, cmdtokens, argc);
+
+    if (ctx->shards != NULL)
+    {
+        /* The shards of its channels take the user out of them in turn,
+         * then the QUIT is relayed and the client its memberships
+         * referred to is freed */
+        shard_neighbors(ctx, conn, s, SHARD_LEAVE, quit_relay,
+                        relay_new(s, prefix, cmdtokens, argc));
+    }
+    else
+    {
+        quit_user(ctx, s, prefix, cmdtokens, argc);
+    }
+    sdsfree(prefix);
+
+    /* Closed by the thread serving the connection once the command is done */
+    conn->quit = true;
+    return CHIRC_OK;
+}
+
+
+/*
+ * split_targets - Split the comma-separated target list of a command,
+ * dropping empty and repeated entries and keeping at most MAXTARGETS
+ *
+ * ctx: The server context
+ *
+ * cmdtokens: command stacks, the list is cmdtokens[1]
+ *
+ * conn: the conn_info_t object, ERR_TOOMANYTARGETS is sent to it for
+ * each target past the limit unless quiet is set
+ *
+ * quiet: true for NOTICE, which never gets automatic replies
+ *
+ * count: the number of targets returned
+ *
+ * Return: the targets, to be freed with sdsfreesplitres
+ */
+static sds *split_targets(server_ctx *ctx, sds *cmdtokens, conn_info_t *conn, bool quiet, int *count)
+{
+    int n = 0, kept = 0;
+    sds *targets = sdssplitlen(cmdtokens[1], sdslen(cmdtokens[1]), ",", 1, &n);
+
+    for (int i = 0; i < n; i++)
     {
-        channel_client *cc = NULL;
-        cc = find_CHANNEL_CLIENT(s->info.nick, &c->channel_clients);
-        if (cc == NULL) // Not in the channel
-            continue;
-        for (cc = c->channel_clients; cc != NULL; cc = cc->hh.next)
+        bool drop = sdslen(targets[i]) == 0;
+        for (int k = 0; k < kept && !drop; k++)
         {
-            /* Reply to the clients in the channel */
-            /* Do not send msg to self more than once*/
-            if (!strncmp(cc->nick, s->info.nick, MAX_STR_LEN))
-            {
-                continue;
-            }
-            /* Thread-safe call to find_NICK */
-            nick_t *msgtarget = server_find_NICK(ctx, cc->nick);
-            if (server_reply_quit_relay(ctx, prefix, cmdtokens, argc, msgtarget->client_socket) == MSG_ERROR)
+            drop = strcmp(targets[k], targets[i]) == 0;
+        }
+        if (!drop && kept == ctx->max_targets)
+        {
+            if (!quiet)
             {
-                return CHIRC_ERROR;
+                sds err[2] = {cmdtokens[0], targets[i]};
+                reply_error(err, ERR_TOOMANYTARGETS, conn, ctx);
             }
+            drop = true;
+        }
+
+        if (drop)
+        {
+            sdsfree(targets[i]);
         }
-        remove_CHANNEL_CLIENT(s->info.nick, &c->channel_clients);
-        if (HASH_COUNT(c->channel_clients) <= 0)
+        else
         {
-            remove_CHANNEL(c->channel_name, &ctx->channels_hashtable);
+            targets[kept++] = targets[i];
         }
     }
-    pthread_mutex_unlock(&ctx->channels_lock);
 
-    sdsfree(prefix);
-    close_socket(ctx, client_socket);
-    pthread_exit(NULL);
-    return CHIRC_OK;
+    *count = kept;
+    return targets;
 }
 
 
-int handle_JOIN(server_ctx *ctx, sds *cmdtokens, int argc, conn_info_t *conn)
+sds *handle_split_targets(server_ctx *ctx, sds *cmdtokens, int argc, conn_info_t *conn, int *count)
 {
     /*
-     * handle_JOIN -  handler the JOIN commands
+     * handle_split_targets - Split the target list of a JOIN, PART,
+     * NAMES, PRIVMSG or NOTICE the way the command does, for it to be run
+     * once per target by the channel shards
      *
      * ctx: The server context
      *
-     * cmdtokens: command stacks created from recved messages
+     * cmdtokens: command stacks, the list is cmdtokens[1]
      *
      * argc: the count of arguments from the command stacks
      *
      * conn: the conn_info_t object
      *
-     * Return: CHIRC_OK/CHIRC_ERROR
+     * count: the number of targets returned
      *
+     * Return: the targets, or NULL if the sender is not registered
      */
-    int client_socket = conn->client_socket;
-    sds server_hostname = conn->server_hostname;
-    sds client_hostname = conn->client_hostname;
-    sds channel_name = cmdtokens[1];
+    client_t *s = server_find_USER(ctx, conn->client_socket);
 
-    /* Thread-safe call to find_USER */
-    client_t *s = server_find_USER(ctx, client_socket);
-    if (s == NULL) // Not registered
+    if (s == NULL || s->info.state != REGISTERED)
     {
-        /* ERR_NOTREGISTERED */
-        reply_error(cmdtokens, ERR_NOTREGISTERED, conn, ctx);
-
-        return CHIRC_ERROR;
+        /* The command replies ERR_NOTREGISTERED once */
+        return NULL;
     }
-    if (s->info.state != REGISTERED) // Not registered
+    if (!strncmp(cmdtokens[0], "NAMES", MAX_STR_LEN))
     {
-        /* ERR_NOTREGISTERED */
-        reply_error(cmdtokens, ERR_NOTREGISTERED, conn, ctx);
-
-        return CHIRC_ERROR;
+        /* Replied for each channel listed, however often */
+        return sdssplitlen(cmdtokens[1], sdslen(cmdtokens[1]), ",", 1, count);
     }
-    /* ERR_NONICKNAMEGIVEN */
-    if (argc - 1 < JOIN_PARAMETER_NUM)
-    {
-        reply_error(cmdtokens, ERR_NEEDMOREPARAMS, conn, ctx);
+    return split_targets(ctx, cmdtokens, conn, !strncmp(cmdtokens[0], "NOTICE", MAX_STR_LEN), count);
+}
 
-        return CHIRC_ERROR;
-    }
+
+/*
+ * join_channel - Add the user to one channel of a JOIN and send the
+ * relays and replies
+ *
+ * ctx: The server context
+ *
+ * cmdtokens: command stacks created from recved messages
+ *
+ * conn: the conn_info_t object
+ *
+ * s: the user joining
+ *
+ * channel_name: the channel
+ *
+ * Return: CHIRC_OK/CHIRC_ERROR
+ */
+static int join_channel(server_ctx *ctx, sds *cmdtokens, conn_info_t *conn, client_t *s, sds channel_name)
+{
+    int client_socket = conn->client_socket;
+    sds server_hostname = conn->server_hostname;
+    sds client_hostname = conn->client_hostname;
+    int rc = CHIRC_OK;
 
     /* Thread-safe call to find_CHANNEL */
     channel_t *c = server_find_CHANNEL(ctx, channel_name);
     bool flag = 1; // If flag == 1, channel exists, else channel is newly created.
     if (c == NULL)
     {
+        /* The lists of a channel restored from the snapshot apply to its creator too */
+        sds hostmask = sdscatprintf(sdsempty(), "%s!%s@%s", s->info.nick,
+                                    s->info.username, client_hostname);
+        bool banned = persist_find_BANNED(ctx, channel_name, hostmask);
+        sdsfree(hostmask);
+
+        if (banned)
+        {
+            /* ERR_BANNEDFROMCHAN */
+            sds err[2] = {cmdtokens[0], channel_name};
+            reply_error(err, ERR_BANNEDFROMCHAN, conn, ctx);
+
+            return CHIRC_ERROR;
+        }
+
         /* Channel not exist */
         /* Thread-safe call to add_CHANNEL */
         c = server_add_CHANNEL(ctx, channel_name);
@@ -501,15 +775,32 @@ int handle_JOIN(server_ctx *ctx, sds *cmdtokens, int argc, conn_info_t *conn)
     }
 
     /* Thread-safe call to find_CHANNEL_CLIENT */
-    channel_client *cc = server_find_CHANNEL_CLIENT(ctx, c, s->info.nick);
+    channel_client *cc = server_find_CHANNEL_CLIENT(ctx, c, s);
     if (cc != NULL)
     {
         /* Client already in the channel */
         return CHIRC_ERROR;
     }
 
+    if (flag)
+    {
+        sds hostmask = sdscatprintf(sdsempty(), "%s!%s@%s", s->info.nick,
+                                    s->info.username, client_hostname);
+        bool banned = server_find_BANNED(ctx, c, hostmask);
+        sdsfree(hostmask);
+
+        if (banned)
+        {
+            /* ERR_BANNEDFROMCHAN */
+            sds err[2] = {cmdtokens[0], channel_name};
+            reply_error(err, ERR_BANNEDFROMCHAN, conn, ctx);
+
+            return CHIRC_ERROR;
+        }
+    }
+
     // /* Thread-safe call to add client to channel */
-    cc = server_add_CHANNEL_CLIENT(ctx, s->info.nick, channel_name, flag);
+    cc = server_add_CHANNEL_CLIENT(ctx, s, channel_name, flag);
 
     /* Send JOIN msg to each client in the channel */
     sds join_prefix = sdscatprintf(sdsempty(), ":%s!%s@%s",
@@ -517,48 +808,57 @@ int handle_JOIN(server_ctx *ctx, sds *cmdtokens, int argc, conn_info_t *conn)
                                    s->info.username,
                                    client_hostname);
 
-    pthread_mutex_lock(&ctx->channels_lock);
+    server_lock_CHANNELS(ctx);
     for (cc = c->channel_clients; cc != NULL; cc = cc->hh.next)
     {
         /* Send JOIN msg to each client in the channel */
-        /*Thread-safe call to find_NICK*/
-        nick_t *msgtarget = server_find_NICK(ctx, cc->nick);
-
         if (server_reply_join_relay(ctx, join_prefix, cmdtokens, channel_name,
-                                    msgtarget->client_socket) == MSG_ERROR)
+                                    cc->user->socket) == MSG_ERROR)
         {
-            return CHIRC_ERROR;
+            rc = CHIRC_ERROR;
         }
     }
-    pthread_mutex_unlock(&ctx->channels_lock);
+    server_unlock_CHANNELS(ctx);
 
     sdsfree(join_prefix);
+    link_user_channel(ctx, -1, s, cmdtokens, 2, channel_name);
 
     /* RPL_NAMREPLY */
     char *prefix = sdscatsds(sdsnew(":"), server_hostname);
-    if (server_reply_join(ctx, prefix, RPL_NAMREPLY, s->info.nick,
-                          channel_name, client_socket, c) == MSG_ERROR)
+    if (server_reply_names(ctx, prefix, s->info.nick, c, client_socket) == MSG_ERROR ||
+        /* RPL_ENDOFNAMES */
+        server_reply_join(ctx, prefix, RPL_ENDOFNAMES, s->info.nick,
+                          channel_name, client_socket) == MSG_ERROR)
     {
-        return CHIRC_ERROR;
+        rc = CHIRC_ERROR;
     }
 
-    /* RPL_ENDOFNAMES */
-    if (server_reply_join(ctx, prefix, RPL_ENDOFNAMES, s->info.nick,
-                          channel_name, client_socket, c) == MSG_ERROR)
+    /* Scrollback of the channel, if history is kept */
+    if (flag && ctx->history_lines > 0)
     {
-        return CHIRC_ERROR;
+        int count;
+        sds *lines = history_copy(ctx, channel_name, -1, &count);
+
+        if (lines != NULL)
+        {
+            if (server_reply_history(ctx, lines, count, client_socket) == MSG_ERROR)
+            {
+                rc = CHIRC_ERROR;
+            }
+            sdsfreesplitres(lines, count);
+        }
     }
 
     sdsfree(prefix);
 
-    return CHIRC_OK;
+    return rc;
 }
 
 
-int handle_PRIVMSG(server_ctx *ctx, sds *cmdtokens, int argc, conn_info_t *conn)
+int handle_JOIN(server_ctx *ctx, sds *cmdtokens, int argc, conn_info_t *conn)
 {
     /*
-     * handle_PRIVMSG -  handler the PRIVMSG commands
+     * handle_JOIN -  handler the JOIN commands
      *
      * ctx: The server context
      *
@@ -572,120 +872,122 @@ int handle_PRIVMSG(server_ctx *ctx, sds *cmdtokens, int argc, conn_info_t *conn)
      *
      */
     int client_socket = conn->client_socket;
-    sds server_hostname = conn->server_hostname;
-    sds client_hostname = conn->client_hostname;
+    int count = 0;
+    int rc = CHIRC_OK;
 
-    /*Thread-safe call to find_USER*/
+    /* Thread-safe call to find_USER */
     client_t *s = server_find_USER(ctx, client_socket);
-
-    if (s == NULL) // not registered
+    if (s == NULL) // Not registered
     {
         /* ERR_NOTREGISTERED */
         reply_error(cmdtokens, ERR_NOTREGISTERED, conn, ctx);
 
         return CHIRC_ERROR;
     }
-    if (s->info.state != REGISTERED) // not registered
+    if (s->info.state != REGISTERED) // Not registered
     {
         /* ERR_NOTREGISTERED */
         reply_error(cmdtokens, ERR_NOTREGISTERED, conn, ctx);
 
         return CHIRC_ERROR;
     }
-
-    if (argc - 1 < PRIVMSG_PARAMETER_NUM)
+    /* ERR_NONICKNAMEGIVEN */
+    if (argc - 1 < JOIN_PARAMETER_NUM)
     {
-        if (argc == 1)
-        {
-            /* ERR_NORECIPIENT */
-            reply_error(cmdtokens, ERR_NORECIPIENT, conn, ctx);
-
-            return CHIRC_ERROR;
-        }
-        else if (argc == 2)
-        {
-            reply_error(cmdtokens, ERR_NOTEXTTOSEND, conn, ctx);
+        reply_error(cmdtokens, ERR_NEEDMOREPARAMS, conn, ctx);
 
-            return CHIRC_ERROR;
-        }
+        return CHIRC_ERROR;
     }
 
-    /* PRIVMSG to channels */
-    if (cmdtokens[1][0] == '#')
+    /* JOIN #a,#b joins each channel in turn */
+    sds *channel_names = split_targets(ctx, cmdtokens, conn, false, &count);
+    for (int i = 0; i < count; i++)
     {
-        /* Thread-safe call to find_CHANNEL */
-        channel_t *c = server_find_CHANNEL(ctx, cmdtokens[1]);
-        if (c == NULL) // Channel not exist
+        if (join_channel(ctx, cmdtokens, conn, s, channel_names[i]) == CHIRC_ERROR)
         {
-            reply_error(cmdtokens, ERR_NOSUCHNICK, conn, ctx);
-
-            return CHIRC_ERROR;
+            rc = CHIRC_ERROR;
         }
-        /* Thread-safe call to find_CHANNEL_CLIENT */
-        channel_client *cc = server_find_CHANNEL_CLIENT(ctx, c, s->info.nick);
+    }
+    sdsfreesplitres(channel_names, count);
 
-        if (cc == NULL) // Client not in the channel
-        {
-            reply_error(cmdtokens, ERR_CANNOTSENDTOCHAN, conn, ctx);
-            return CHIRC_ERROR;
-        }
+    return rc;
+}
 
-        sds prefix = sdscatprintf(sdsempty(), ":%s!%s@%s",
-                                  s->info.nick,
-                                  s->info.username,
-                                  client_hostname);
 
-        pthread_mutex_lock(&ctx->channels_lock);
-        /* Send msg to each client in the channel */
-        for (cc = c->channel_clients; cc != NULL; cc = cc->hh.next)
+/*
+ * relay_message - Deliver a PRIVMSG or NOTICE to each of its
+ * comma-separated targets
+ *
+ * ctx: The server context
+ *
+ * cmdtokens: command stacks created from recved messages
+ *
+ * argc: the count of arguments from the command stacks
+ *
+ * conn: the conn_info_t object
+ *
+ * s: the sender
+ *
+ * notice: true for NOTICE, which never gets error replies
+ *
+ * Return: CHIRC_OK/CHIRC_ERROR
+ *
+ * All targets are resolved under one hold of the locks, then the message
+ * is serialized once per target and sent to its recipients.
+ */
+static int relay_message(server_ctx *ctx, sds *cmdtokens, int argc, conn_info_t *conn,
+                         client_t *s, bool notice)
+{
+    int count = 0;
+    int rc = CHIRC_OK;
+    sds *names = split_targets(ctx, cmdtokens, conn, notice, &count);
+    msg_target_t *targets = calloc(count, sizeof(msg_target_t));
+
+    for (int i = 0; i < count; i++)
+    {
+        targets[i].name = names[i];
+    }
+    server_resolve_TARGETS(ctx, s, targets, count);
+
+    sds prefix = sdscatprintf(sdsempty(), ":%s!%s@%s",
+                              s->info.nick,
+                              s->info.username,
+                              conn->client_hostname); // reply msg prefix
+
+    for (int i = 0; i < count; i++)
+    {
+        if (targets[i].error != NULL)
         {
-            /* Do not send msg to self */
-            if (!strncmp(cc->nick, s->info.nick, MAX_STR_LEN))
+            if (!notice)
             {
-                continue;
+                sds err[2] = {cmdtokens[0], targets[i].name};
+                reply_error(err, targets[i].error, conn, ctx);
             }
-            /* Thread-safe call to find_NICK */
-            nick_t *msgtarget = server_find_NICK(ctx, cc->nick);
-
-            if (server_reply_privmsg(ctx, prefix, cmdtokens, argc, msgtarget->client_socket) == MSG_ERROR)
+            rc = CHIRC_ERROR;
+        }
+        else
+        {
+            if (server_reply_privmsg(ctx, prefix, cmdtokens, argc, &targets[i]) == MSG_ERROR)
             {
-                return CHIRC_ERROR;
+                rc = CHIRC_ERROR;
             }
+            link_user_message(ctx, -1, s, cmdtokens, argc, &targets[i]);
         }
-        pthread_mutex_unlock(&ctx->channels_lock);
+        free(targets[i].sockets);
+    }
 
-        sdsfree(prefix);
+    sdsfree(prefix);
+    free(targets);
+    sdsfreesplitres(names, count);
 
-        return CHIRC_OK;
-    }
-    /* Thread-safe call to find_NICK */
-    nick_t *msgtarget = server_find_NICK(ctx, cmdtokens[1]);
-
-    if (msgtarget == NULL) // Nickname not exist
-    {
-        reply_error(cmdtokens, ERR_NOSUCHNICK, conn, ctx);
-
-        return CHIRC_ERROR;
-    }
-
-    sds msg_prefix = sdscatprintf(sdsempty(), ":%s!%s@%s",
-                                  s->info.nick,
-                                  s->info.username,
-                                  client_hostname); // reply msg prefix
-
-    if (server_reply_privmsg(ctx, msg_prefix, cmdtokens, argc, msgtarget->client_socket) == MSG_ERROR)
-    {
-        return CHIRC_ERROR;
-    }
-
-    return CHIRC_OK;
-}
+    return rc;
+}
 
 
-int handle_NOTICE(server_ctx *ctx, sds *cmdtokens, int argc, conn_info_t *conn)
+int handle_PRIVMSG(server_ctx *ctx, sds *cmdtokens, int argc, conn_info_t *conn)
 {
     /*
-     * handle_NOTICE -  handler the NOTICE commands
+     * handle_PRIVMSG -  handler the PRIVMSG commands
      *
      * ctx: The server context
      *
@@ -699,98 +1001,86 @@ int handle_NOTICE(server_ctx *ctx, sds *cmdtokens, int argc, conn_info_t *conn)
      *
      */
     int client_socket = conn->client_socket;
-    sds server_hostname = conn->server_hostname;
-    sds client_hostname = conn->client_hostname;
 
-    /* Thread-safe call to find_USER */
+    /*Thread-safe call to find_USER*/
     client_t *s = server_find_USER(ctx, client_socket);
 
-    if (s == NULL) // Not registered
+    if (s == NULL) // not registered
     {
         /* ERR_NOTREGISTERED */
-        return CHIRC_ERROR;
-    }
+        reply_error(cmdtokens, ERR_NOTREGISTERED, conn, ctx);
 
-    if (s->info.state != REGISTERED) // Not registered
-    {
         return CHIRC_ERROR;
     }
-
-    if (argc - 1 < PRIVMSG_PARAMETER_NUM)
+    if (s->info.state != REGISTERED) // not registered
     {
+        /* ERR_NOTREGISTERED */
+        reply_error(cmdtokens, ERR_NOTREGISTERED, conn, ctx);
+
         return CHIRC_ERROR;
     }
 
-    /* NOTICE to channels */
-    if (cmdtokens[1][0] == '#')
+    if (argc - 1 < PRIVMSG_PARAMETER_NUM)
     {
-        /* Thread-safe call to find_CHANNEL */
-        channel_t *c = server_find_CHANNEL(ctx, cmdtokens[1]);
-        if (c == NULL) // Channel not exist
+        if (argc == 1)
         {
-            /* ERR_NOSUCHCHANNEL */
+            /* ERR_NORECIPIENT */
+            reply_error(cmdtokens, ERR_NORECIPIENT, conn, ctx);
+
             return CHIRC_ERROR;
         }
-        /* Thread-safe call to find_CHANNEL_CLIENT */
-        channel_client *cc = server_find_CHANNEL_CLIENT(ctx, c, s->info.nick);
-
-        if (cc == NULL) // Client not in the channel
+        else if (argc == 2)
         {
-            /* ERR_CANNOTSENDTOCHAN */
+            reply_error(cmdtokens, ERR_NOTEXTTOSEND, conn, ctx);
+
             return CHIRC_ERROR;
         }
+    }
 
-        /* Send msg to each client in the channel */
-        pthread_mutex_lock(&ctx->channels_lock);
-        for (cc = c->channel_clients; cc != NULL; cc = cc->hh.next)
-        {
-
-            /* Do not send msg to self */
-            if (!strncmp(cc->nick, s->info.nick, MAX_STR_LEN))
-            {
-                continue;
-            }
-            /* Thread-safe call to find_NICK */
-            nick_t *msgtarget = server_find_NICK(ctx, cc->nick);
-            chirc_message_t *msg = (chirc_message_t *)malloc(sizeof(chirc_message_t));
-            sds prefix = sdscatprintf(sdsempty(), ":%s!%s@%s",
-                                      s->info.nick,
-                                      s->info.username,
-                                      client_hostname);
-
-            if (server_reply_privmsg(ctx, prefix, cmdtokens, argc,
-                                     msgtarget->client_socket) == MSG_ERROR)
-            {
-                return CHIRC_ERROR;
-            }
+    /* PRIVMSG to each channel or nick of a comma-separated list */
+    return relay_message(ctx, cmdtokens, argc, conn, s, false);
+}
 
-            sdsfree(prefix);
-        }
-        pthread_mutex_unlock(&ctx->channels_lock);
 
-        return CHIRC_OK;
-    }
+int handle_NOTICE(server_ctx *ctx, sds *cmdtokens, int argc, conn_info_t *conn)
+{
+    /*
+     * handle_NOTICE -  handler the NOTICE commands
+     *
+     * ctx: The server context
+     *
+     * cmdtokens: command stacks created from recved messages
+     *
+     * argc: the count of arguments from the command stacks
+     *
+     * conn: the conn_info_t object
+     *
+     * Return: CHIRC_OK/CHIRC_ERROR
+     *
+     */
+    int client_socket = conn->client_socket;
 
-    nick_t *msgtarget = server_find_NICK(ctx, cmdtokens[1]);
+    /* Thread-safe call to find_USER */
+    client_t *s = server_find_USER(ctx, client_socket);
 
-    if (msgtarget == NULL) // Nickname not exist
+    if (s == NULL) // Not registered
     {
-        chilog(ERROR, "ERR_NOSUCHNICK\n");
+        /* ERR_NOTREGISTERED */
         return CHIRC_ERROR;
     }
 
-    sds msg_prefix = sdscatprintf(sdsempty(), ":%s!%s@%s",
-                                  s->info.nick,
-                                  s->info.username,
-                                  client_hostname); // reply msg prefix
+    if (s->info.state != REGISTERED) // Not registered
+    {
+        return CHIRC_ERROR;
+    }
 
-    if (server_reply_privmsg(ctx, msg_prefix, cmdtokens, argc,
-                             msgtarget->client_socket) == MSG_ERROR)
+    if (argc - 1 < PRIVMSG_PARAMETER_NUM)
     {
         return CHIRC_ERROR;
     }
 
-    return CHIRC_OK;
+    /* NOTICE to each channel or nick of a comma-separated list */
+    return relay_message(ctx, cmdtokens, argc, conn, s, true);
 }
 
 
@@ -979,6 +1269,107 @@ int handle_WHOIS(server_ctx *ctx, sds *cmdtokens, int argc, conn_info_t *conn)
 }
 
 
+/*
+ * list_send - Send the LIST replies of a snapshot and release it
+ *
+ * ctx: The server context
+ *
+ * conn: the conn_info_t object
+ *
+ * s: the user asking
+ *
+ * param: the parameter of LIST, or NULL
+ *
+ * snap: the snapshot
+ *
+ * Return: CHIRC_OK/CHIRC_ERROR
+ */
+static int list_send(server_ctx *ctx, conn_info_t *conn, client_t *s, sds param,
+                     chanlist_snapshot_t *snap)
+{
+    int client_socket = conn->client_socket;
+    sds server_hostname = conn->server_hostname;
+
+    /* Replies come from a shared snapshot, so channels_lock is at most
+     * held while the snapshot is refreshed, never while sending */
+    sds msg_prefix = sdscatsds(sdsnew(":"), server_hostname);
+    sds batch = sdsempty();
+    chanlist_filter_t filter;
+    chanlist_cursor_t cursor;
+    chanlist_entry_t *entry;
+    int rc = CHIRC_OK;
+
+    chanlist_filter_parse(param, &filter);
+    chanlist_cursor_init(&cursor, snap, &filter);
+    while ((entry = chanlist_cursor_next(&cursor)) != NULL)
+    {
+        sds num_clients = sdsfromlonglong(entry->users);
+        sds reply = server_reply_list(ctx, msg_prefix, RPL_LIST, s->info.nick,
+                                      entry->name, num_clients);
+        batch = sdscatsds(batch, reply);
+        sdsfree(reply);
+        sdsfree(num_clients);
+
+        /* Stream in batches: memory stays bounded and the blocking send
+         * paces the cursor to the rate the client reads at */
+        if (sdslen(batch) >= CHANLIST_BATCH_BYTES)
+        {
+            if (send_msg(client_socket, ctx, batch) == MSG_ERROR)
+            {
+                rc = CHIRC_ERROR;
+                break;
+            }
+            sdsclear(batch);
+        }
+    }
+
+    chanlist_release(ctx, snap);
+    chanlist_filter_free(&filter);
+
+    if (rc == CHIRC_OK && sdslen(batch) > 0 && send_msg(client_socket, ctx, batch) == MSG_ERROR)
+    {
+        rc = CHIRC_ERROR;
+    }
+    sdsfree(batch);
+
+    if (rc == CHIRC_OK &&
+        server_reply_listend(ctx, msg_prefix, RPL_LISTEND, s->info.nick, client_socket) == MSG_ERROR)
+    {
+        rc = CHIRC_ERROR;
+    }
+    sdsfree(msg_prefix);
+
+    return rc;
+}
+
+
+/* A LIST waiting for the channel shards to fill a new snapshot */
+typedef struct list_walk
+{
+    client_t *user;
+    sds param;                  /* The parameter of LIST, or NULL */
+    chanlist_snapshot_t *snap;
+} list_walk_t;
+
+
+/* shard_channel_fn of LIST */
+static void list_add(server_ctx *ctx, channel_t *c, void *arg)
+{
+    chanlist_add(((list_walk_t *)arg)->snap, c);
+}
+
+
+/* Step of LIST run once every shard added its channels */
+static void list_gathered(server_ctx *ctx, conn_info_t *conn, void *arg)
+{
+    list_walk_t *w = (list_walk_t *)arg;
+
+    list_send(ctx, conn, w->user, w->param, chanlist_publish(ctx, w->snap));
+    sdsfree(w->param);
+    free(w);
+}
+
+
 int handle_LIST(server_ctx *ctx, sds *cmdtokens, int argc, conn_info_t *conn)
 {
     /*
@@ -997,11 +1388,6 @@ int handle_LIST(server_ctx *ctx, sds *cmdtokens, int argc, conn_info_t *conn)
      */
 
     int client_socket = conn->client_socket;
-    sds server_hostname = conn->server_hostname;
-    sds client_hostname = conn->client_hostname;
-    channel_t *channel = NULL;
-    sds channel_name = sdsempty();
-    int num_clients = 0;
 
     client_t *s = server_find_USER(ctx, client_socket);
 
@@ -1022,56 +1408,130 @@ int handle_LIST(server_ctx *ctx, sds *cmdtokens, int argc, conn_info_t *conn)
         return CHIRC_ERROR;
     }
 
-    sds msg_all = sdsempty();
-    sds msg_prefix = sdscatsds(sdsnew(":"), server_hostname);
-    if (argc == 1)
+    sds param = argc >= 2 ? cmdtokens[1] : NULL;
+    chanlist_snapshot_t *snap = chanlist_acquire(ctx);
+
+    if (snap == NULL)
     {
-        pthread_mutex_lock(&ctx->channels_lock);
-        for (channel = ctx->channels_hashtable; channel != NULL; channel = channel->hh.next)
-        {
-            channel_name = channel->channel_name;
-            num_clients = HASH_COUNT(channel->channel_clients);
-
-            msg_all = sdscatsds(msg_all, server_reply_list(ctx, msg_prefix,
-                                                           RPL_LIST,
-                                                           s->info.nick,
-                                                           channel_name,
-                                                           sdsfromlonglong(num_clients)));
-        }
-        pthread_mutex_unlock(&ctx->channels_lock);
+        /* With channel shards, each adds its own channels to a new
+         * snapshot in turn, and the worker sends it */
+        list_walk_t *w = malloc(sizeof(list_walk_t));
+
+        w->user = s;
+        w->param = param != NULL ? sdsdup(param) : NULL;
+        w->snap = chanlist_new(ctx);
+        shard_channels(ctx, conn, list_add, list_gathered, w);
+
+        return CHIRC_OK;
     }
-    else if (argc == 2)
-    {
-        channel_t *channel = server_find_CHANNEL(ctx, cmdtokens[1]);
 
-        pthread_mutex_lock(&ctx->channels_lock);
-        num_clients = HASH_COUNT(channel->channel_clients);
-        pthread_mutex_unlock(&ctx->channels_lock);
+    return list_send(ctx, conn, s, param, snap);
+}
+
+
+/* The RPL_NAMREPLY lines of a channel, serialized by its shard */
+typedef struct names_entry
+{
+    sds name;
+    sds lines;
+} names_entry_t;
+
+
+/* A NAMES of every channel, gathered from the channel shards */
+typedef struct names_walk
+{
+    client_t *user;
+    sds prefix;
+    names_entry_t *channels;
+    int count;
+    int size;
+    int *members;               /* Sockets of the users in some channel */
+    int nmembers;
+    int msize;
+} names_walk_t;
+
+
+static int compare_names(const void *a, const void *b)
+{
+    return strcmp(((const names_entry_t *)a)->name, ((const names_entry_t *)b)->name);
+}
+
+
+static int compare_sockets(const void *a, const void *b)
+{
+    int x = *(const int *)a, y = *(const int *)b;
+
+    return (x > y) - (x < y);
+}
+
 
-        msg_all = sdscatsds(msg_all, server_reply_list(ctx, msg_prefix,
-                                                       RPL_LIST,
-                                                       s->info.nick,
-                                                       cmdtokens[1],
-                                                       sdsfromlonglong(num_clients)));
+/* shard_channel_fn of NAMES */
+static void names_add(server_ctx *ctx, channel_t *c, void *arg)
+{
+    names_walk_t *w = (names_walk_t *)arg;
+
+    if (w->count == w->size)
+    {
+        w->size = w->size ? w->size * 2 : 16;
+        w->channels = realloc(w->channels, w->size * sizeof(names_entry_t));
+    }
+    w->channels[w->count].name = sdsdup(c->channel_name);
+    w->channels[w->count].lines = server_reply_names_lines(ctx, w->prefix, w->user->info.nick, c);
+    w->count++;
+
+    for (channel_client *cc = c->channel_clients; cc != NULL; cc = cc->hh.next)
+    {
+        if (w->nmembers == w->msize)
+        {
+            w->msize = w->msize ? w->msize * 2 : 16;
+            w->members = realloc(w->members, w->msize * sizeof(int));
+        }
+        w->members[w->nmembers++] = cc->user->socket;
     }
+}
 
-    send_msg(client_socket, ctx, msg_all);
 
-    sdsfree(msg_all);
+/* Step of NAMES run once every shard added its channels */
+static void names_gathered(server_ctx *ctx, conn_info_t *conn, void *arg)
+{
+    names_walk_t *w = (names_walk_t *)arg;
+    int rc = CHIRC_OK;
 
-    if (server_reply_listend(ctx, msg_prefix, RPL_LISTEND, s->info.nick, client_socket) == MSG_ERROR)
+    /* In the order of the channel names, as without shards */
+    qsort(w->channels, w->count, sizeof(names_entry_t), compare_names);
+    qsort(w->members, w->nmembers, sizeof(int), compare_sockets);
+    for (int i = 0; i < w->count; i++)
     {
-        return CHIRC_ERROR;
+        if (rc == CHIRC_OK && sdslen(w->channels[i].lines) > 0 &&
+            send_msg(conn->client_socket, ctx, w->channels[i].lines) == MSG_ERROR)
+        {
+            rc = CHIRC_ERROR;
+        }
+        sdsfree(w->channels[i].name);
+        sdsfree(w->channels[i].lines);
     }
 
-    return CHIRC_OK;
+    sds all = sdsnew("*");
+    if (rc == CHIRC_OK &&
+        server_reply_names_nochannel(ctx, w->prefix, w->user->info.nick, w->members,
+                                     w->nmembers, conn->client_socket) == MSG_OK)
+    {
+        server_reply_join(ctx, w->prefix, RPL_ENDOFNAMES, w->user->info.nick, all,
+                          conn->client_socket);
+    }
+    sdsfree(all);
+
+    free(w->channels);
+    free(w->members);
+    sdsfree(w->prefix);
+    free(w);
 }
 
 
-int handle_MODE(server_ctx *ctx, sds *cmdtokens, int argc, conn_info_t *conn)
+int handle_NAMES(server_ctx *ctx, sds *cmdtokens, int argc, conn_info_t *conn)
 {
     /*
-     * handle_MODE -  handler the MODE commands
+     * handle_NAMES -  handler the NAMES commands
      *
      * ctx: The server context
      *
@@ -1086,100 +1546,185 @@ int handle_MODE(server_ctx *ctx, sds *cmdtokens, int argc, conn_info_t *conn)
      */
     int client_socket = conn->client_socket;
     sds server_hostname = conn->server_hostname;
-    sds client_hostname = conn->client_hostname;
+    int count = 0;
 
-    if (argc - 1 < MODE_PARAMETER_NUM)
+    client_t *s = server_find_USER(ctx, client_socket);
+
+    if (s == NULL || s->info.state != REGISTERED) // Not registered
     {
+        /* ERR_NOTREGISTERED */
+        reply_error(cmdtokens, ERR_NOTREGISTERED, conn, ctx);
+
         return CHIRC_ERROR;
     }
 
-    char *channel_name = cmdtokens[1];
-    char *mode = cmdtokens[2];
-    char *nick = cmdtokens[3];
-
-    client_t *client = server_find_USER(ctx, client_socket);
-    channel_t *channel = server_find_CHANNEL(ctx, channel_name);
+    sds prefix = sdscatsds(sdsnew(":"), server_hostname);
+    int rc = CHIRC_OK;
 
-    if (channel == NULL)
+    if (argc >= 2)
     {
-        /* ERR_NOSUCHCHANNEL */
-        chilog(ERROR, "ERR_NOSUCHCHANNEL");
-        reply_error(cmdtokens, ERR_NOSUCHCHANNEL, conn, ctx);
+        /* NAMES #a,#b: the members of each channel, each followed by RPL_ENDOFNAMES */
+        sds *names = sdssplitlen(cmdtokens[1], sdslen(cmdtokens[1]), ",", 1, &count);
+        for (int i = 0; i < count && rc == CHIRC_OK; i++)
+        {
+            channel_t *c = server_find_CHANNEL(ctx, names[i]);
+            if ((c != NULL && server_reply_names(ctx, prefix, s->info.nick, c, client_socket) == MSG_ERROR) ||
+                server_reply_join(ctx, prefix, RPL_ENDOFNAMES, s->info.nick,
+                                  names[i], client_socket) == MSG_ERROR)
+            {
+                rc = CHIRC_ERROR;
+            }
+        }
+        sdsfreesplitres(names, count);
+        sdsfree(prefix);
 
-        return CHIRC_ERROR;
+        return rc;
     }
 
-    if (strncmp(mode, "+o", MAX_STR_LEN) && strncmp(mode, "-o", MAX_STR_LEN))
+    /* NAMES: every channel, then the users in no channel, then one RPL_ENDOFNAMES */
+    if (ctx->shards != NULL)
     {
-        /* UNKNOWNMODE */
-        chilog(ERROR, "UNKNOWNMODE");
-        reply_error(cmdtokens, ERR_UNKNOWNMODE, conn, ctx);
+        /* Each shard serializes its own channels in turn, and the worker
+         * sends them */
+        names_walk_t *w = calloc(1, sizeof(names_walk_t));
 
-        return CHIRC_ERROR;
+        w->user = s;
+        w->prefix = prefix;
+        shard_channels(ctx, conn, names_add, names_gathered, w);
+
+        return CHIRC_OK;
     }
 
-    channel_client *chan = server_find_CHANNEL_CLIENT(ctx, channel, nick);
+    chanlist_filter_t filter;
+    chanlist_cursor_t cursor;
+    chanlist_entry_t *entry;
 
-    if (chan == NULL)
+    chanlist_filter_parse(NULL, &filter);
+    chanlist_snapshot_t *snap = chanlist_acquire(ctx);
+    chanlist_cursor_init(&cursor, snap, &filter);
+    while (rc == CHIRC_OK && (entry = chanlist_cursor_next(&cursor)) != NULL)
     {
-        /* ERR_USERNOTINCHANNEL */
-        chilog(ERROR, "ERR_USERNOTINCHANNEL");
-        reply_error(cmdtokens, ERR_USERNOTINCHANNEL, conn, ctx);
+        channel_t *c = server_find_CHANNEL(ctx, entry->name);
+        if (c != NULL && server_reply_names(ctx, prefix, s->info.nick, c, client_socket) == MSG_ERROR)
+        {
+            rc = CHIRC_ERROR;
+        }
+    }
+    chanlist_release(ctx, snap);
+    chanlist_filter_free(&filter);
 
-        return CHIRC_ERROR;
+    sds all = sdsnew("*");
+    if (rc == CHIRC_OK &&
+        (server_reply_names_nochannel(ctx, prefix, s->info.nick, NULL, 0, client_socket) == MSG_ERROR ||
+         server_reply_join(ctx, prefix, RPL_ENDOFNAMES, s->info.nick, all, client_socket) == MSG_ERROR))
+    {
+        rc = CHIRC_ERROR;
     }
+    sdsfree(all);
+    sdsfree(prefix);
+
+    return rc;
+}
 
-    channel_client *owner = server_find_CHANNEL_CLIENT(ctx, channel, client->info.nick);
 
-    if (owner == NULL || owner->mode == NULL ||
-        (strncmp(owner->mode, "o", MAX_STR_LEN) != 0 &&
-         (client->info.is_irc_operator == false)))
+/*
+ * who_send - Send the WHO replies of copied rows, then RPL_ENDOFWHO
+ *
+ * ctx: The server context
+ *
+ * conn: the conn_info_t object
+ *
+ * s: the user asking
+ *
+ * name: the channel or mask asked for
+ *
+ * channel: whether name is a channel
+ *
+ * rows: the rows, freed here
+ *
+ * count: the number of rows
+ *
+ * Return: CHIRC_OK/CHIRC_ERROR
+ */
+static int who_send(server_ctx *ctx, conn_info_t *conn, client_t *s, sds name,
+                    bool channel, who_row_t *rows, int count)
+{
+    int client_socket = conn->client_socket;
+    sds server_hostname = conn->server_hostname;
+
+    /* The rows are copies, so no lock is held while they are sent, and
+     * a large channel is streamed in batches paced by the client */
+    sds msg_prefix = sdscatsds(sdsnew(":"), server_hostname);
+    sds row_channel = sdsnew(channel ? name : "*");
+    sds batch = sdsempty();
+    int rc = CHIRC_OK;
+
+    for (int i = 0; i < count; i++)
     {
-        /* ERR_CHANOPRIVSNEEDED */
-        chilog(ERROR, "ERR_CHANOPRIVSNEEDED");
-        reply_error(cmdtokens, ERR_CHANOPRIVSNEEDED, conn, ctx);
+        sds reply = server_reply_who(ctx, msg_prefix, s->info.nick, row_channel,
+                                     server_hostname, &rows[i]);
+        batch = sdscatsds(batch, reply);
+        sdsfree(reply);
 
-        return CHIRC_ERROR;
+        if (sdslen(batch) >= WHO_BATCH_BYTES)
+        {
+            if (send_msg(client_socket, ctx, batch) == MSG_ERROR)
+            {
+                rc = CHIRC_ERROR;
+                break;
+            }
+            sdsclear(batch);
+        }
+    }
+    if (count > 0)
+    {
+        who_rows_free(rows, count);
     }
 
-    if (strncmp(mode, "+o", MAX_STR_LEN) == 0)
+    if (rc == CHIRC_OK && sdslen(batch) > 0 && send_msg(client_socket, ctx, batch) == MSG_ERROR)
     {
-        chan->mode = sdsnew("o");
+        rc = CHIRC_ERROR;
     }
-    else
+    if (rc == CHIRC_OK &&
+        server_reply_endofwho(ctx, msg_prefix, s->info.nick, name, client_socket) == MSG_ERROR)
     {
-        chan->mode = sdsnew("-o");
+        rc = CHIRC_ERROR;
     }
 
-    sds msg_prefix = sdscatprintf(sdsempty(), ":%s!%s@%s",
-                                  client->info.nick,
-                                  client->info.username,
-                                  client_hostname);
+    sdsfree(batch);
+    sdsfree(row_channel);
+    sdsfree(msg_prefix);
 
-    pthread_mutex_lock(&ctx->channels_lock);
-    /* Send msg to each client in the channel */
-    for (chan = channel->channel_clients; chan != NULL; chan = chan->hh.next)
-    {
-        nick_t *msgtarget = server_find_NICK(ctx, chan->nick);
-        // chilog(TRACE, "%s relay to: %s", client->info.nick, chan->nick);
+    return rc;
+}
 
-        if (server_reply_mode(ctx, msg_prefix, cmdtokens, msgtarget->client_socket) == MSG_ERROR)
-        {
-            return CHIRC_ERROR;
-        }
-    }
-    pthread_mutex_unlock(&ctx->channels_lock);
 
-    sdsfree(msg_prefix);
+/* A WHO of the users sharing no channel, waiting for the channel shards */
+typedef struct who_walk
+{
+    client_t *user;
+    sds name;
+    bool opers_only;
+} who_walk_t;
 
-    return CHIRC_OK;
+
+/* shard_neighbors_fn of WHO */
+static void who_shared(server_ctx *ctx, conn_info_t *conn, int *sockets, int count, void *arg)
+{
+    who_walk_t *w = (who_walk_t *)arg;
+    who_row_t *rows;
+    int nrows = server_find_WHO_MASK(ctx, w->user, NULL, w->opers_only, sockets, count, &rows);
+
+    who_send(ctx, conn, w->user, w->name, false, rows, nrows);
+    sdsfree(w->name);
+    free(w);
 }
 
 
-int handle_OPER(server_ctx *ctx, sds *cmdtokens, int argc, conn_info_t *conn)
+int handle_WHO(server_ctx *ctx, sds *cmdtokens, int argc, conn_info_t *conn)
 {
     /*
-     * handle_OPER -  handler the OPER commands
+     * handle_WHO -  handler the WHO commands
      *
      * ctx: The server context
      *
@@ -1193,12 +1738,412 @@ int handle_OPER(server_ctx *ctx, sds *cmdtokens, int argc, conn_info_t *conn)
      *
      */
     int client_socket = conn->client_socket;
-    sds server_hostname = conn->server_hostname;
-    sds client_hostname = conn->client_hostname;
 
-    client_t *client = server_find_USER(ctx, client_socket);
+    client_t *s = server_find_USER(ctx, client_socket);
 
-    if (argc - 1 < OPER_PARAMETER_NUM)
+    if (s == NULL || s->info.state != REGISTERED) // Not registered
+    {
+        /* ERR_NOTREGISTERED */
+        chilog(ERROR, "ERR_NOTREGISTERED\n");
+        reply_error(cmdtokens, ERR_NOTREGISTERED, conn, ctx);
+
+        return CHIRC_ERROR;
+    }
+
+    /* "WHO", "WHO *" and "WHO 0" list the users sharing no channel */
+    sds name = sdsnew(argc >= 2 ? cmdtokens[1] : "*");
+    bool all = !strcmp(name, "*") || !strcmp(name, "0");
+    bool opers_only = argc >= 3 && !strcmp(cmdtokens[2], "o");
+    bool channel = name[0] == '#';
+    who_row_t *rows;
+    int count;
+
+    if (all && ctx->shards != NULL)
+    {
+        /* The shards of the user's channels find who shares them */
+        who_walk_t *w = malloc(sizeof(who_walk_t));
+
+        w->user = s;
+        w->name = name;
+        w->opers_only = opers_only;
+        shard_neighbors(ctx, conn, s, SHARD_FIND, who_shared, w);
+
+        return CHIRC_OK;
+    }
+
+    if (channel)
+    {
+        count = server_find_WHO_CHANNEL(ctx, name, opers_only, &rows);
+    }
+    else
+    {
+        mask_t mask;
+
+        mask_compile(&mask, name);
+        count = server_find_WHO_MASK(ctx, s, all ? NULL : &mask, opers_only, NULL, 0, &rows);
+        mask_free(&mask);
+    }
+
+    int rc = who_send(ctx, conn, s, name, channel, rows, count);
+    sdsfree(name);
+
+    return rc;
+}
+
+
+int handle_HISTORY(server_ctx *ctx, sds *cmdtokens, int argc, conn_info_t *conn)
+{
+    /*
+     * handle_HISTORY -  handler the HISTORY commands: replay the recent
+     * messages of a channel the user is in, optionally only the last few
+     *
+     * ctx: The server context
+     *
+     * cmdtokens: command stacks created from recved messages
+     *
+     * argc: the count of arguments from the command stacks
+     *
+     * conn: the conn_info_t object
+     *
+     * Return: CHIRC_OK/CHIRC_ERROR
+     *
+     */
+    int client_socket = conn->client_socket;
+    sds server_hostname = conn->server_hostname;
+
+    client_t *s = server_find_USER(ctx, client_socket);
+
+    if (s == NULL || s->info.state != REGISTERED) // Not registered
+    {
+        /* ERR_NOTREGISTERED */
+        chilog(ERROR, "ERR_NOTREGISTERED\n");
+        reply_error(cmdtokens, ERR_NOTREGISTERED, conn, ctx);
+
+        return CHIRC_ERROR;
+    }
+    if (argc < 2)
+    {
+        reply_error(cmdtokens, ERR_NEEDMOREPARAMS, conn, ctx);
+
+        return CHIRC_ERROR;
+    }
+
+    channel_t *c = server_find_CHANNEL(ctx, cmdtokens[1]);
+    if (c == NULL)
+    {
+        /* ERR_NOSUCHCHANNEL */
+        reply_error(cmdtokens, ERR_NOSUCHCHANNEL, conn, ctx);
+
+        return CHIRC_ERROR;
+    }
+    if (server_find_CHANNEL_CLIENT(ctx, c, s) == NULL)
+    {
+        /* ERR_NOTONCHANNEL */
+        reply_error(cmdtokens, ERR_NOTONCHANNEL, conn, ctx);
+
+        return CHIRC_ERROR;
+    }
+
+    int max = argc >= 3 ? atoi(cmdtokens[2]) : -1;
+    int count;
+    int rc = CHIRC_OK;
+    sds *lines = history_copy(ctx, cmdtokens[1], max, &count);
+
+    if (lines != NULL)
+    {
+        if (server_reply_history(ctx, lines, count, client_socket) == MSG_ERROR)
+        {
+            rc = CHIRC_ERROR;
+        }
+        sdsfreesplitres(lines, count);
+    }
+
+    sds end = sdscatprintf(sdsempty(), ":%s NOTICE %s :End of %s history\r\n",
+                           server_hostname, s->info.nick, cmdtokens[1]);
+    if (rc == CHIRC_OK && send_msg(client_socket, ctx, end) == MSG_ERROR)
+    {
+        rc = CHIRC_ERROR;
+    }
+    sdsfree(end);
+
+    return rc;
+}
+
+
+/*
+ * relay_mode - Send a channel MODE change to every member of the channel
+ * (Takes the channel table)
+ */
+static int relay_mode(server_ctx *ctx, sds *cmdtokens, client_t *client,
+                      sds client_hostname, channel_t *channel)
+{
+    int rc = CHIRC_OK;
+    sds msg_prefix = sdscatprintf(sdsempty(), ":%s!%s@%s",
+                                  client->info.nick,
+                                  client->info.username,
+                                  client_hostname);
+
+    server_lock_CHANNELS(ctx);
+    /* Send msg to each client in the channel */
+    for (channel_client *chan = channel->channel_clients; chan != NULL; chan = chan->hh.next)
+    {
+        if (server_reply_mode(ctx, msg_prefix, cmdtokens, chan->user->socket) == MSG_ERROR)
+        {
+            rc = CHIRC_ERROR;
+        }
+    }
+    server_unlock_CHANNELS(ctx);
+
+    sdsfree(msg_prefix);
+
+    return rc;
+}
+
+
+/*
+ * list_mode - Handle MODE b, e and I: list the masks of a channel, or add
+ * or remove one. A changed list is compiled again before the lock is
+ * released, so JOINs always check against a complete matcher.
+ */
+static int list_mode(server_ctx *ctx, sds *cmdtokens, int argc,
+                     conn_info_t *conn, client_t *client, channel_t *channel)
+{
+    char *mode = cmdtokens[2];
+    char letter = (mode[0] == '+' || mode[0] == '-') ? mode[1] : mode[0];
+    char *entry_code, *end_code;
+    banlist_t *list;
+
+    switch (letter)
+    {
+    case 'b':
+        list = &channel->bans;
+        entry_code = RPL_BANLIST;
+        end_code = RPL_ENDOFBANLIST;
+        break;
+    case 'e':
+        list = &channel->excepts;
+        entry_code = RPL_EXCEPTLIST;
+        end_code = RPL_ENDOFEXCEPTLIST;
+        break;
+    default:
+        list = &channel->invites;
+        entry_code = RPL_INVITELIST;
+        end_code = RPL_ENDOFINVITELIST;
+        break;
+    }
+
+    if (argc - 1 < MODE_PARAMETER_NUM) // No mask: list the masks
+    {
+        sds prefix = sdscatsds(sdsnew(":"), conn->server_hostname);
+        sds out = sdsempty();
+        int rc = CHIRC_OK;
+
+        server_lock_CHANNELS(ctx);
+        for (int i = 0; i < list->count; i++)
+        {
+            sds reply = server_reply_banlist(ctx, prefix, entry_code, client->info.nick,
+                                             channel->channel_name, &list->entries[i]);
+            out = sdscatsds(out, reply);
+            sdsfree(reply);
+        }
+        server_unlock_CHANNELS(ctx);
+
+        if ((sdslen(out) > 0 && send_msg(conn->client_socket, ctx, out) == MSG_ERROR) ||
+            server_reply_endofbanlist(ctx, prefix, end_code, client->info.nick,
+                                      cmdtokens[1], conn->client_socket) == MSG_ERROR)
+        {
+            rc = CHIRC_ERROR;
+        }
+        sdsfree(out);
+        sdsfree(prefix);
+
+        return rc;
+    }
+
+    channel_client *owner = server_find_CHANNEL_CLIENT(ctx, channel, client);
+
+    if ((owner == NULL || (owner->modes & MEMBER_OP) == 0) &&
+        client->info.is_irc_operator == false)
+    {
+        /* ERR_CHANOPRIVSNEEDED */
+        chilog(ERROR, "ERR_CHANOPRIVSNEEDED");
+        reply_error(cmdtokens, ERR_CHANOPRIVSNEEDED, conn, ctx);
+
+        return CHIRC_ERROR;
+    }
+
+    sds mask = banlist_normalize(cmdtokens[3]);
+    sds setter = sdscatprintf(sdsempty(), "%s!%s@%s", client->info.nick,
+                              client->info.username, conn->client_hostname);
+    bool changed;
+
+    server_lock_CHANNELS(ctx);
+    if (mode[0] == '-')
+    {
+        changed = banlist_remove(list, mask);
+    }
+    else
+    {
+        changed = banlist_add(list, mask, setter);
+    }
+    if (changed)
+    {
+        persist_mark(ctx, channel, false);
+    }
+    server_unlock_CHANNELS(ctx);
+
+    int rc = CHIRC_OK;
+    if (changed)
+    {
+        /* Relay the mask in its complete form */
+        sds tokens[4] = {cmdtokens[0], cmdtokens[1], cmdtokens[2], mask};
+        rc = relay_mode(ctx, tokens, client, conn->client_hostname, channel);
+    }
+    sdsfree(setter);
+    sdsfree(mask);
+
+    return rc;
+}
+
+
+int handle_MODE(server_ctx *ctx, sds *cmdtokens, int argc, conn_info_t *conn)
+{
+    /*
+     * handle_MODE -  handler the MODE commands
+     *
+     * ctx: The server context
+     *
+     * cmdtokens: command stacks created from recved messages
+     *
+     * argc: the count of arguments from the command stacks
+     *
+     * conn: the conn_info_t object
+     *
+     * Return: CHIRC_OK/CHIRC_ERROR
+     *
+     */
+    int client_socket = conn->client_socket;
+    sds server_hostname = conn->server_hostname;
+    sds client_hostname = conn->client_hostname;
+
+    /* List modes take their mask as an optional parameter */
+    if (argc - 1 < MODE_PARAMETER_NUM - 1)
+    {
+        return CHIRC_ERROR;
+    }
+
+    char *channel_name = cmdtokens[1];
+    char *mode = cmdtokens[2];
+    int sign = (mode[0] == '+' || mode[0] == '-');
+    bool is_list_mode = mode[sign] != '\0' && mode[sign + 1] == '\0' &&
+                        strchr("beI", mode[sign]) != NULL;
+
+    if (argc - 1 < MODE_PARAMETER_NUM && !is_list_mode)
+    {
+        return CHIRC_ERROR;
+    }
+
+    client_t *client = server_find_USER(ctx, client_socket);
+
+    if (client == NULL || client->info.state != REGISTERED) // Not registered
+    {
+        /* ERR_NOTREGISTERED */
+        chilog(ERROR, "ERR_NOTREGISTERED\n");
+        reply_error(cmdtokens, ERR_NOTREGISTERED, conn, ctx);
+
+        return CHIRC_ERROR;
+    }
+
+    channel_t *channel = server_find_CHANNEL(ctx, channel_name);
+
+    if (channel == NULL)
+    {
+        /* ERR_NOSUCHCHANNEL */
+        chilog(ERROR, "ERR_NOSUCHCHANNEL");
+        reply_error(cmdtokens, ERR_NOSUCHCHANNEL, conn, ctx);
+
+        return CHIRC_ERROR;
+    }
+
+    if (is_list_mode)
+    {
+        return list_mode(ctx, cmdtokens, argc, conn, client, channel);
+    }
+
+    if (strncmp(mode, "+o", MAX_STR_LEN) && strncmp(mode, "-o", MAX_STR_LEN))
+    {
+        /* UNKNOWNMODE */
+        chilog(ERROR, "UNKNOWNMODE");
+        reply_error(cmdtokens, ERR_UNKNOWNMODE, conn, ctx);
+
+        return CHIRC_ERROR;
+    }
+
+    nick_t *nick = server_find_NICK(ctx, cmdtokens[3]);
+    client_t *target = nick != NULL ? server_find_USER(ctx, nick->client_socket) : NULL;
+    channel_client *chan = target != NULL ? server_find_CHANNEL_CLIENT(ctx, channel, target) : NULL;
+
+    if (chan == NULL)
+    {
+        /* ERR_USERNOTINCHANNEL */
+        chilog(ERROR, "ERR_USERNOTINCHANNEL");
+        reply_error(cmdtokens, ERR_USERNOTINCHANNEL, conn, ctx);
+
+        return CHIRC_ERROR;
+    }
+
+    channel_client *owner = server_find_CHANNEL_CLIENT(ctx, channel, client);
+
+    if (owner == NULL ||
+        ((owner->modes & MEMBER_OP) == 0 &&
+         (client->info.is_irc_operator == false)))
+    {
+        /* ERR_CHANOPRIVSNEEDED */
+        chilog(ERROR, "ERR_CHANOPRIVSNEEDED");
+        reply_error(cmdtokens, ERR_CHANOPRIVSNEEDED, conn, ctx);
+
+        return CHIRC_ERROR;
+    }
+
+    server_lock_CHANNELS(ctx);
+    if (strncmp(mode, "+o", MAX_STR_LEN) == 0)
+    {
+        chan->modes |= MEMBER_OP;
+    }
+    else
+    {
+        chan->modes &= ~MEMBER_OP;
+    }
+    channel_names_invalidate(channel);
+    server_unlock_CHANNELS(ctx);
+
+    return relay_mode(ctx, cmdtokens, client, client_hostname, channel);
+}
+
+
+int handle_OPER(server_ctx *ctx, sds *cmdtokens, int argc, conn_info_t *conn)
+{
+    /*
+     * handle_OPER -  handler the OPER commands
+     *
+     * ctx: The server context
+     *
+     * cmdtokens: command stacks created from recved messages
+     *
+     * argc: the count of arguments from the command stacks
+     *
+     * conn: the conn_info_t object
+     *
+     * Return: CHIRC_OK/CHIRC_ERROR
+     *
+     */
+    int client_socket = conn->client_socket;
+    sds server_hostname = conn->server_hostname;
+    sds client_hostname = conn->client_hostname;
+
+    client_t *client = server_find_USER(ctx, client_socket);
+
+    if (argc - 1 < OPER_PARAMETER_NUM)
     {
         /* ERR_NEEDMOREPARAMS */
         reply_error(cmdtokens, ERR_NEEDMOREPARAMS, conn, ctx);
@@ -1242,6 +2187,77 @@ int handle_OPER(server_ctx *ctx, sds *cmdtokens, int argc, conn_info_t *conn)
 }
 
 
+/*
+ * part_channel - Remove the user from one channel of a PART and send the
+ * relays
+ *
+ * ctx: The server context
+ *
+ * cmdtokens: command stacks created from recved messages
+ *
+ * argc: the count of arguments from the command stacks
+ *
+ * conn: the conn_info_t object
+ *
+ * s: the user leaving
+ *
+ * channel_name: the channel
+ *
+ * Return: CHIRC_OK/CHIRC_ERROR
+ */
+static int part_channel(server_ctx *ctx, sds *cmdtokens, int argc, conn_info_t *conn,
+                        client_t *s, sds channel_name)
+{
+    sds client_hostname = conn->client_hostname;
+    int rc = CHIRC_OK;
+
+    channel_t *c = server_find_CHANNEL(ctx, channel_name);
+
+    if (c == NULL) // Channel not exist
+    {
+        sds err[2] = {cmdtokens[0], channel_name};
+        chilog(ERROR, "ERR_NOSUCHCHANNEL\n");
+        reply_error(err, ERR_NOSUCHCHANNEL, conn, ctx);
+
+        return CHIRC_ERROR;
+    }
+
+    channel_client *cc = server_find_CHANNEL_CLIENT(ctx, c, s);
+
+    if (cc == NULL) // Client not in the channel
+    {
+        sds err[2] = {cmdtokens[0], channel_name};
+        chilog(ERROR, "ERR_NOTONCHANNEL\n");
+        reply_error(err, ERR_NOTONCHANNEL, conn, ctx);
+
+        return CHIRC_ERROR;
+    }
+
+    /* Leave the channel */
+    sds prefix = sdscatprintf(sdsempty(), ":%s!%s@%s",
+                              s->info.nick,
+                              s->info.username,
+                              client_hostname);
+
+    /* Send msg to each client in the channel */
+    channel_t **channels = server_lock_CHANNELS(ctx);
+    for (cc = c->channel_clients; cc != NULL; cc = cc->hh.next)
+    {
+        if (server_reply_part(ctx, prefix, cmdtokens, c->channel_name,
+                              argc, cc->user->socket) == MSG_ERROR)
+        {
+            rc = CHIRC_ERROR;
+        }
+    }
+    sdsfree(prefix);
+    server_leave_CHANNEL(ctx, channels, c, s);
+    server_unlock_CHANNELS(ctx);
+    link_user_channel(ctx, -1, s, cmdtokens, argc, channel_name);
+
+    return rc;
+}
+
+
 int handle_PART(server_ctx *ctx, sds *cmdtokens, int argc, conn_info_t *conn)
 {
     /*
@@ -1259,8 +2275,8 @@ int handle_PART(server_ctx *ctx, sds *cmdtokens, int argc, conn_info_t *conn)
      *
      */
     int client_socket = conn->client_socket;
-    sds server_hostname = conn->server_hostname;
-    sds client_hostname = conn->client_hostname;
+    int count = 0;
+    int rc = CHIRC_OK;
 
     client_t *s = server_find_USER(ctx, client_socket);
 
@@ -1289,51 +2305,183 @@ int handle_PART(server_ctx *ctx, sds *cmdtokens, int argc, conn_info_t *conn)
         return CHIRC_ERROR;
     }
 
-    channel_t *c = server_find_CHANNEL(ctx, cmdtokens[1]);
+    /* PART #a,#b leaves each channel in turn */
+    sds *channel_names = split_targets(ctx, cmdtokens, conn, false, &count);
+    for (int i = 0; i < count; i++)
+    {
+        if (part_channel(ctx, cmdtokens, argc, conn, s, channel_names[i]) == CHIRC_ERROR)
+        {
+            rc = CHIRC_ERROR;
+        }
+    }
+    sdsfreesplitres(channel_names, count);
 
-    if (c == NULL) // Channel not exist
+    return rc;
+}
+
+
+int handle_STATS(server_ctx *ctx, sds *cmdtokens, int argc, conn_info_t *conn)
+{
+    /*
+     * handle_STATS -  handler the STATS commands (IRC operators only)
+     *
+     * ctx: The server context
+     *
+     * cmdtokens: command stacks created from recved messages
+     *
+     * argc: the count of arguments from the command stacks
+     *
+     * conn: the conn_info_t object
+     *
+     * Return: CHIRC_OK/CHIRC_ERROR
+     *
+     */
+    client_t *s = server_find_USER(ctx, conn->client_socket);
+
+    if (s == NULL || s->info.state != REGISTERED) // Not registered
     {
-        chilog(ERROR, "ERR_NOSUCHCHANNEL\n");
-        reply_error(cmdtokens, ERR_NOSUCHCHANNEL, conn, ctx);
+        /* ERR_NOTREGISTERED */
+        reply_error(cmdtokens, ERR_NOTREGISTERED, conn, ctx);
 
         return CHIRC_ERROR;
     }
 
-    channel_client *cc = server_find_CHANNEL_CLIENT(ctx, c, s->info.nick);
+    if (argc - 1 < STATS_PARAMETER_NUM)
+    {
+        /* ERR_NEEDMOREPARAMS */
+        reply_error(cmdtokens, ERR_NEEDMOREPARAMS, conn, ctx);
 
-    if (cc == NULL) // Client not in the channel
+        return CHIRC_ERROR;
+    }
+
+    if (!s->info.is_irc_operator)
     {
-        chilog(ERROR, "ERR_NOTONCHANNEL\n");
-        reply_error(cmdtokens, ERR_NOTONCHANNEL, conn, ctx);
+        /* ERR_NOPRIVILEGES */
+        reply_error(cmdtokens, ERR_NOPRIVILEGES, conn, ctx);
 
         return CHIRC_ERROR;
     }
 
-    /* Leave the channel */
-    sds prefix = sdscatprintf(sdsempty(), ":%s!%s@%s",
-                              s->info.nick,
-                              s->info.username,
-                              client_hostname);
+    if (server_reply_stats(ctx, s->info.nick, cmdtokens[1], conn) == MSG_ERROR)
+    {
+        return CHIRC_ERROR;
+    }
 
-    /* Send msg to each client in the channel */
-    pthread_mutex_lock(&ctx->channels_lock);
-    for (cc = c->channel_clients; cc != NULL; cc = cc->hh.next)
+    return CHIRC_OK;
+}
+
+
+int handle_PASS(server_ctx *ctx, sds *cmdtokens, int argc, conn_info_t *conn)
+{
+    /*
+     * handle_PASS -  handler the PASS commands, which start a server link
+     *
+     * ctx: The server context
+     *
+     * cmdtokens: command stacks created from recved messages
+     *
+     * argc: the count of arguments from the command stacks
+     *
+     * conn: the conn_info_t object
+     *
+     * Return: CHIRC_OK/CHIRC_ERROR
+     *
+     */
+    client_t *s = server_find_USER(ctx, conn->client_socket);
+
+    if (s != NULL && s->info.state == REGISTERED)
     {
-        nick_t *msgtarget = server_find_NICK(ctx, cc->nick);
+        /* ERR_ALREADYREGISTRED */
+        reply_error(cmdtokens, ERR_ALREADYREGISTRED, conn, ctx);
 
-        if (server_reply_part(ctx, prefix, cmdtokens, c->channel_name,
-                              argc, msgtarget->client_socket) == MSG_ERROR)
-        {
-            return CHIRC_ERROR;
-        }
+        return CHIRC_ERROR;
     }
-    sdsfree(prefix);
-    remove_CHANNEL_CLIENT(s->info.nick, &c->channel_clients);
-    if (HASH_COUNT(c->channel_clients) <= 0)
+    if (s != NULL)
     {
-        remove_CHANNEL(c->channel_name, &ctx->channels_hashtable);
+        /* A user half way through its registration */
+        return CHIRC_OK;
     }
-    pthread_mutex_unlock(&ctx->channels_lock);
 
-    return CHIRC_OK;
-}
\ No newline at end of file
+    return link_request(ctx, cmdtokens, argc, conn);
+}
+
+
+int handle_SERVER(server_ctx *ctx, sds *cmdtokens, int argc, conn_info_t *conn)
+{
+    /*
+     * handle_SERVER -  handler the SERVER commands, which start a server link
+     *
+     * ctx: The server context
+     *
+     * cmdtokens: command stacks created from recved messages
+     *
+     * argc: the count of arguments from the command stacks
+     *
+     * conn: the conn_info_t object
+     *
+     * Return: CHIRC_OK/CHIRC_ERROR
+     *
+     */
+    client_t *s = server_find_USER(ctx, conn->client_socket);
+
+    if (s != NULL && s->info.state == REGISTERED)
+    {
+        /* ERR_ALREADYREGISTRED */
+        reply_error(cmdtokens, ERR_ALREADYREGISTRED, conn, ctx);
+
+        return CHIRC_ERROR;
+    }
+    if (s != NULL)
+    {
+        /* A user half way through its registration */
+        return CHIRC_OK;
+    }
+
+    return link_request(ctx, cmdtokens, argc, conn);
+}
+
+
+int handle_CONNECT(server_ctx *ctx, sds *cmdtokens, int argc, conn_info_t *conn)
+{
+    /*
+     * handle_CONNECT -  handler the CONNECT commands (IRC operators only)
+     *
+     * ctx: The server context
+     *
+     * cmdtokens: command stacks created from recved messages
+     *
+     * argc: the count of arguments from the command stacks
+     *
+     * conn: the conn_info_t object
+     *
+     * Return: CHIRC_OK/CHIRC_ERROR
+     *
+     */
+    client_t *s = server_find_USER(ctx, conn->client_socket);
+
+    if (s == NULL || s->info.state != REGISTERED) // Not registered
+    {
+        /* ERR_NOTREGISTERED */
+        reply_error(cmdtokens, ERR_NOTREGISTERED, conn, ctx);
+
+        return CHIRC_ERROR;
+    }
+
+    if (argc - 1 < CONNECT_PARAMETER_NUM)
+    {
+        /* ERR_NEEDMOREPARAMS */
+        reply_error(cmdtokens, ERR_NEEDMOREPARAMS, conn, ctx);
+
+        return CHIRC_ERROR;
+    }
+
+    if (!s->info.is_irc_operator)
+    {
+        /* ERR_NOPRIVILEGES */
+        reply_error(cmdtokens, ERR_NOPRIVILEGES, conn, ctx);
+
+        return CHIRC_ERROR;
+    }
+
+    return link_connect(ctx, conn, s, cmdtokens, argc);
+}
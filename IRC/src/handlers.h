@@ -210,6 +210,54 @@ int handle_WHOIS(server_ctx *ctx, sds *cmdtokens, int argc, conn_info_t *conn);
  */
 int handle_LIST(server_ctx *ctx, sds *cmdtokens, int argc, conn_info_t *conn);
 
+/*
+ * handle_NAMES -  handler the NAMES commands
+ *
+ * ctx: The server context
+ *
+ * cmdtokens: command stacks created from recved messages
+ *
+ * argc: the count of arguments from the command stacks
+ *
+ * conn: the conn_info_t object
+ *
+ * Return: CHIRC_OK/CHIRC_ERROR
+ *
+ */
+int handle_NAMES(server_ctx *ctx, sds *cmdtokens, int argc, conn_info_t *conn);
+
+/*
+ * handle_WHO -  handler the WHO commands
+ *
+ * ctx: The server context
+ *
+ * cmdtokens: command stacks created from recved messages
+ *
+ * argc: the count of arguments from the command stacks
+ *
+ * conn: the conn_info_t object
+ *
+ * Return: CHIRC_OK/CHIRC_ERROR
+ *
+ */
+int handle_WHO(server_ctx *ctx, sds *cmdtokens, int argc, conn_info_t *conn);
+
+/*
+ * handle_HISTORY -  handler the HISTORY commands
+ *
+ * ctx: The server context
+ *
+ * cmdtokens: command stacks created from recved messages
+ *
+ * argc: the count of arguments from the command stacks
+ *
+ * conn: the conn_info_t object
+ *
+ * Return: CHIRC_OK/CHIRC_ERROR
+ *
+ */
+int handle_HISTORY(server_ctx *ctx, sds *cmdtokens, int argc, conn_info_t *conn);
+
 /*
  * handle_PART -  handler the PART commands
  *
@@ -258,6 +306,137 @@ int handle_MODE(server_ctx *ctx, sds *cmdtokens, int argc, conn_info_t *conn);
  */
 int handle_OPER(server_ctx *ctx, sds *cmdtokens, int argc, conn_info_t *conn);
 
+/*
+ * handle_STATS -  handler the STATS commands (IRC operators only)
+ *
+ * ctx: The server context
+ *
+ * cmdtokens: command stacks created from recved messages
+ *
+ * argc: the count of arguments from the command stacks
+ *
+ * conn: the conn_info_t object
+ *
+ * Return: CHIRC_OK/CHIRC_ERROR
+ *
+ */
+int handle_STATS(server_ctx *ctx, sds *cmdtokens, int argc, conn_info_t *conn);
+
+/*
+ * handle_split_targets - Split the target list of a JOIN, PART, NAMES,
+ * PRIVMSG or NOTICE the way the command does, for it to be run once per
+ * target by the channel shards. ERR_TOOMANYTARGETS is sent for each target
+ * past the limit, unless it is a NOTICE or a NAMES.
+ *
+ * ctx: The server context
+ *
+ * cmdtokens: command stacks, the list is cmdtokens[1]
+ *
+ * argc: the count of arguments from the command stacks
+ *
+ * conn: the conn_info_t object
+ *
+ * count: the number of targets returned
+ *
+ * Return: the targets, to be freed with sdsfreesplitres, or NULL if the
+ * sender is not registered and the command is to be run as it is
+ */
+sds *handle_split_targets(server_ctx *ctx, sds *cmdtokens, int argc, conn_info_t *conn, int *count);
+
+/*
+ * handle_PASS -  handler the PASS commands, which start a server link
+ *
+ * ctx: The server context
+ *
+ * cmdtokens: command stacks created from recved messages
+ *
+ * argc: the count of arguments from the command stacks
+ *
+ * conn: the conn_info_t object
+ *
+ * Return: CHIRC_OK/CHIRC_ERROR
+ *
+ */
+int handle_PASS(server_ctx *ctx, sds *cmdtokens, int argc, conn_info_t *conn);
+
+/*
+ * handle_SERVER -  handler the SERVER commands, which start a server link
+ *
+ * ctx: The server context
+ *
+ * cmdtokens: command stacks created from recved messages
+ *
+ * argc: the count of arguments from the command stacks
+ *
+ * conn: the conn_info_t object
+ *
+ * Return: CHIRC_OK/CHIRC_ERROR
+ *
+ */
+int handle_SERVER(server_ctx *ctx, sds *cmdtokens, int argc, conn_info_t *conn);
+
+/*
+ * handle_CONNECT -  handler the CONNECT commands (IRC operators only)
+ *
+ * ctx: The server context
+ *
+ * cmdtokens: command stacks created from recved messages
+ *
+ * argc: the count of arguments from the command stacks
+ *
+ * conn: the conn_info_t object
+ *
+ * Return: CHIRC_OK/CHIRC_ERROR
+ *
+ */
+int handle_CONNECT(server_ctx *ctx, sds *cmdtokens, int argc, conn_info_t *conn);
+
+/*
+ * rename_user - Relay a nick change to the users sharing a channel with
+ * the user, then change it (without channel shards)
+ *
+ * ctx: The server context
+ *
+ * s: the user
+ *
+ * prefix: ":nick!user@host" of the user before the change
+ *
+ * cmdtokens: "NICK" and the new nick
+ *
+ * argc: the count of tokens
+ *
+ * Return: nothing
+ */
+void rename_user(server_ctx *ctx, client_t *s, sds prefix, sds *cmdtokens, int argc);
+
+/*
+ * quit_user - Relay a QUIT to the users sharing a channel with the user,
+ * take it out of its channels and free it (without channel shards, once
+ * it is out of the clients and nicks hashtables)
+ *
+ * ctx: The server context
+ *
+ * s: the user
+ *
+ * prefix: ":nick!user@host" of the user
+ *
+ * cmdtokens: "QUIT" and its message, if any
+ *
+ * argc: the count of tokens
+ *
+ * Return: nothing
+ */
+void quit_user(server_ctx *ctx, client_t *s, sds prefix, sds *cmdtokens, int argc);
+
+/*
+ * register_handler_stats - Name the stats slots of every command in
+ * the dispatch table, plus one for unknown commands and one for the
+ * commands received on server links
+ *
+ * Return: nothing
+ */
+void register_handler_stats(void);
+
 typedef int (*handler_function)(server_ctx *ctx, sds *cmdtokens, int argc, conn_info_t *conn);
 
 struct handler_entry
@@ -275,5 +454,7 @@ struct handler_entry
 #define PART_PARAMETER_NUM 1
 #define OPER_PARAMETER_NUM 2
 #define MODE_PARAMETER_NUM 3
+#define STATS_PARAMETER_NUM 1
+#define CONNECT_PARAMETER_NUM 1
 
 #endif
\ No newline at end of file
@@ -0,0 +1,217 @@
+#include <stdlib.h>
+#include <pthread.h>
+#include "history.h"
+#include "trace.h"
+#include "../lib/uthash.h"
+#include "../lib/sds/sds.h"
+
+
+/* Unlink a history from the use order (history_lock held) */
+static void lru_unlink(server_ctx *ctx, history_t *h)
+{
+    if (h->newer != NULL)
+    {
+        h->newer->older = h->older;
+    }
+    else
+    {
+        ctx->history_newest = h->older;
+    }
+    if (h->older != NULL)
+    {
+        h->older->newer = h->newer;
+    }
+    else
+    {
+        ctx->history_oldest = h->newer;
+    }
+    h->newer = h->older = NULL;
+}
+
+
+/* Make a history the most recently used one (history_lock held) */
+static void lru_touch(server_ctx *ctx, history_t *h)
+{
+    if (ctx->history_newest == h)
+    {
+        return;
+    }
+    if (h->newer != NULL || h->older != NULL || ctx->history_oldest == h) // Already listed
+    {
+        lru_unlink(ctx, h);
+    }
+
+    h->older = ctx->history_newest;
+    if (ctx->history_newest != NULL)
+    {
+        ctx->history_newest->newer = h;
+    }
+    ctx->history_newest = h;
+    if (ctx->history_oldest == NULL)
+    {
+        ctx->history_oldest = h;
+    }
+}
+
+
+/* Drop the oldest line of a history (history_lock held) */
+static void drop_oldest(server_ctx *ctx, history_t *h)
+{
+    sds line = h->lines[h->start];
+
+    h->bytes -= sdslen(line);
+    ctx->history_bytes -= sdslen(line);
+    sdsfree(line);
+    h->lines[h->start] = NULL;
+    h->start = (h->start + 1) % ctx->history_lines;
+    h->count--;
+}
+
+
+/* Unlink and free a whole history (history_lock held) */
+static void history_remove(server_ctx *ctx, history_t *h)
+{
+    while (h->count > 0)
+    {
+        drop_oldest(ctx, h);
+    }
+    lru_unlink(ctx, h);
+    HASH_DELETE(hh, ctx->histories, h);
+    sdsfree(h->channel_name);
+    free(h->lines);
+    free(h);
+}
+
+
+void history_record(server_ctx *ctx, sds channel_name, sds line)
+{
+    /*
+     * history_record - (Thread-safe)Keep a message relayed to a channel
+     *
+     * ctx: server context
+     *
+     * channel_name: the channel
+     *
+     * line: the serialized message, taken over by the history
+     *
+     * Return: nothing
+     */
+    if (ctx->history_lines <= 0)
+    {
+        sdsfree(line);
+        return;
+    }
+
+    history_t *h;
+
+    trace_mutex_lock(&ctx->history_lock, "history_lock");
+    HASH_FIND_STR(ctx->histories, channel_name, h);
+    if (h == NULL)
+    {
+        h = calloc(1, sizeof(history_t));
+        h->channel_name = sdsdup(channel_name);
+        h->lines = calloc(ctx->history_lines, sizeof(sds));
+        HASH_ADD_KEYPTR(hh, ctx->histories, h->channel_name, sdslen(h->channel_name), h);
+    }
+
+    if (h->count == ctx->history_lines)
+    {
+        drop_oldest(ctx, h);
+    }
+    h->lines[(h->start + h->count) % ctx->history_lines] = line;
+    h->count++;
+    h->bytes += sdslen(line);
+    ctx->history_bytes += sdslen(line);
+    lru_touch(ctx, h);
+
+    /* Evict idle channels first, then trim this one if it is over the cap alone */
+    while (ctx->history_bytes > ctx->history_max_bytes && ctx->history_oldest != h)
+    {
+        history_remove(ctx, ctx->history_oldest);
+    }
+    while (ctx->history_bytes > ctx->history_max_bytes && h->count > 1)
+    {
+        drop_oldest(ctx, h);
+    }
+    pthread_mutex_unlock(&ctx->history_lock);
+}
+
+
+sds *history_copy(server_ctx *ctx, sds channel_name, int max, int *count)
+{
+    /*
+     * history_copy - (Thread-safe)Copy the most recent messages of a channel
+     *
+     * ctx: server context
+     *
+     * channel_name: the channel
+     *
+     * max: most messages to copy, or -1 for all of them
+     *
+     * count: set to the number of messages copied
+     *
+     * Return: the messages, oldest first, or NULL if there are none
+     */
+    history_t *h;
+    sds *lines = NULL;
+
+    *count = 0;
+    trace_mutex_lock(&ctx->history_lock, "history_lock");
+    HASH_FIND_STR(ctx->histories, channel_name, h);
+    if (h != NULL && h->count > 0)
+    {
+        int n = (max < 0 || max > h->count) ? h->count : max;
+
+        lines = malloc(n * sizeof(sds));
+        for (int i = 0; i < n; i++)
+        {
+            lines[i] = sdsdup(h->lines[(h->start + h->count - n + i) % ctx->history_lines]);
+        }
+        *count = n;
+        lru_touch(ctx, h);
+    }
+    pthread_mutex_unlock(&ctx->history_lock);
+
+    return lines;
+}
+
+
+void history_drop(server_ctx *ctx, sds channel_name)
+{
+    /*
+     * history_drop - (Thread-safe)Forget the messages of a channel
+     *
+     * ctx: server context
+     *
+     * channel_name: the channel
+     *
+     * Return: nothing
+     */
+    history_t *h;
+
+    trace_mutex_lock(&ctx->history_lock, "history_lock");
+    HASH_FIND_STR(ctx->histories, channel_name, h);
+    if (h != NULL)
+    {
+        history_remove(ctx, h);
+    }
+    pthread_mutex_unlock(&ctx->history_lock);
+}
+
+
+void history_free(server_ctx *ctx)
+{
+    /*
+     * history_free - Free every history when the server shuts down
+     *
+     * ctx: server context
+     *
+     * Return: nothing
+     */
+    trace_mutex_lock(&ctx->history_lock, "history_lock");
+    while (ctx->histories != NULL)
+    {
+        history_remove(ctx, ctx->histories);
+    }
+    pthread_mutex_unlock(&ctx->history_lock);
+}
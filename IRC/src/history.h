@@ -0,0 +1,80 @@
+#ifndef HISTORY_H_
+#define HISTORY_H_
+
+#include <stddef.h>
+#include "server.h"
+#include "../lib/uthash.h"
+#include "../lib/sds/sds.h"
+
+#define HISTORY_BATCH_BYTES 4096 /* Replayed history is sent in batches of about this size */
+
+/* Recent messages of one channel: a ring of the serialized lines that
+ * were relayed, oldest first. Histories are kept on a list ordered by
+ * last use, so the idle ones are evicted first when the memory cap is
+ * reached. */
+typedef struct history
+{
+    sds channel_name;       /* Key for hashtable */
+    sds *lines;             /* ctx->history_lines slots, lines[(start + i) % history_lines] */
+    int start;
+    int count;
+    size_t bytes;           /* Bytes of the lines held */
+    struct history *newer;  /* Neighbors in the use order, NULL at the ends */
+    struct history *older;
+    UT_hash_handle hh;
+} history_t;
+
+/*
+ * history_record - (Thread-safe)Keep a message relayed to a channel,
+ * dropping the oldest one when the ring is full and evicting the least
+ * recently used histories while the total is over ctx->history_max_bytes
+ *
+ * ctx: server context
+ *
+ * channel_name: the channel
+ *
+ * line: the serialized message, as sent to the members. The history takes
+ * it over and frees it; nothing is kept if history is disabled.
+ *
+ * Return: nothing
+ */
+void history_record(server_ctx *ctx, sds channel_name, sds line);
+
+/*
+ * history_copy - (Thread-safe)Copy the most recent messages of a channel
+ *
+ * ctx: server context
+ *
+ * channel_name: the channel
+ *
+ * max: most messages to copy, or -1 for all of them
+ *
+ * count: set to the number of messages copied
+ *
+ * Return: the messages, oldest first, to be freed with sdsfreesplitres,
+ * or NULL if there are none
+ */
+sds *history_copy(server_ctx *ctx, sds channel_name, int max, int *count);
+
+/*
+ * history_drop - (Thread-safe)Forget the messages of a channel, when it
+ * is removed
+ *
+ * ctx: server context
+ *
+ * channel_name: the channel
+ *
+ * Return: nothing
+ */
+void history_drop(server_ctx *ctx, sds channel_name);
+
+/*
+ * history_free - Free every history when the server shuts down
+ *
+ * ctx: server context
+ *
+ * Return: nothing
+ */
+void history_free(server_ctx *ctx);
+
+#endif
@@ -0,0 +1,1584 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include "link.h"
+#include "handlers.h"
+#include "send_msg.h"
+#include "reply.h"
+#include "log.h"
+#include "trace.h"
+#include "stats.h"
+#include "../lib/uthash.h"
+#include "../lib/sds/sds.h"
+
+/* A user of the network by UID, for the links that name users by UID */
+typedef struct uid_entry
+{
+    uint64_t uid;       /* Key for ctx->uids */
+    client_t *user;
+    UT_hash_handle hh;
+} uid_entry_t;
+
+/* A command received on a registered link, with the prefix of its sender, if any */
+typedef int (*link_function)(server_ctx *ctx, conn_info_t *conn, char *prefix, sds *cmdtokens, int argc);
+
+struct link_entry
+{
+    char *name;
+    link_function func;
+};
+
+
+/*
+ * link_option - Check if the options of a PASS have a flag
+ *
+ * options: the options, e.g. "chirc|U"
+ *
+ * flag: the flag, e.g. LINK_UID_FLAG
+ *
+ * Return: true if flag follows the '|'
+ */
+static bool link_option(const char *options, char flag)
+{
+    const char *flags = options ? strchr(options, '|') : NULL;
+
+    return flags != NULL && strchr(flags + 1, flag) != NULL;
+}
+
+
+/* The options this server sends in PASS */
+static sds link_options(server_ctx *ctx)
+{
+    sds options = sdscatprintf(sdsempty(), "chirc|%c", LINK_UID_FLAG);
+
+    if (ctx->link_compress >= 0)
+    {
+        options = sdscatprintf(options, "%c", LINK_COMPRESS_FLAG);
+    }
+    return options;
+}
+
+
+/*
+ * link_write - Send a message on a link, compressed if the link is
+ *
+ * ctx: server context
+ *
+ * link: the link
+ *
+ * msg: the message, with "\r\n"
+ *
+ * Return: MSG_OK/MSG_ERROR
+ */
+static int link_write(server_ctx *ctx, link_t *link, sds msg)
+{
+    if (link->z == NULL)
+    {
+        return send_msg(link->socket, ctx, msg);
+    }
+
+    /* The deflater is kept in the order of the sends by the socket's lock */
+    pthread_mutex_t *lock = &ctx->socket_locks[link->socket % SOCKET_LOCKS];
+    sds out = sdsempty();
+    int r = MSG_OK;
+    int len = 0;
+
+    stats_send_enter();
+    trace_mutex_lock(lock, "socket_lock");
+    if (link_zstream_compress(link->z, msg, sdslen(msg), &out) == CHIRC_ERROR)
+    {
+        r = MSG_ERROR;
+    }
+    else if ((len = sdslen(out)) > 0 && sendall(link->socket, out, &len) == -1)
+    {
+        chilog(ERROR, "We only sent %d bytes because of the error!\n", len);
+        r = MSG_ERROR;
+    }
+    pthread_mutex_unlock(lock);
+    stats_send_leave();
+    stats_bytes_out(len);
+    sdsfree(out);
+
+    return r;
+}
+
+
+/*
+ * link_trailing - Join the parameters of a command from the first given
+ * on, without the ':' of a trailing parameter
+ */
+static sds link_trailing(sds *cmdtokens, int argc, int first)
+{
+    if (argc <= first)
+    {
+        return sdsempty();
+    }
+
+    sds text = sdsjoinsds(cmdtokens + first, argc - first, " ", 1);
+    if (text[0] == ':')
+    {
+        sdsrange(text, 1, sdslen(text));
+    }
+    return text;
+}
+
+
+/*
+ * link_hops - Count the links between this server and another
+ *
+ * net: the network
+ *
+ * id: the other server
+ *
+ * Return: the number of links on the spanning tree path
+ */
+static int link_hops(network_t *net, unsigned int id)
+{
+    unsigned int self = net->self->id;
+    int hops = 0;
+
+    /* In the heap layout, the ancestors of a server have smaller IDs */
+    while (self != id)
+    {
+        if (self > id)
+        {
+            self = net->servers[self]->parent;
+        }
+        else
+        {
+            id = net->servers[id]->parent;
+        }
+        hops++;
+    }
+
+    return hops;
+}
+
+
+/* Whether a user is connected to a server reached through the link to server id */
+static bool link_behind(network_t *net, client_t *user, unsigned int id)
+{
+    return user->server != NULL && network_next_hop(net, user->server->id) == (int)id;
+}
+
+
+/* Add a user to ctx->uids (called with clients_lock held) */
+static void uid_add(server_ctx *ctx, client_t *user)
+{
+    uid_entry_t *entry;
+
+    HASH_FIND(hh, ctx->uids, &user->uid, sizeof(uint64_t), entry);
+    if (entry == NULL)
+    {
+        entry = malloc(sizeof(uid_entry_t));
+        entry->uid = user->uid;
+        entry->user = user;
+        HASH_ADD(hh, ctx->uids, uid, sizeof(uint64_t), entry);
+    }
+}
+
+
+/* Remove a user from ctx->uids (called with clients_lock held) */
+static void uid_remove(server_ctx *ctx, client_t *user)
+{
+    uid_entry_t *entry;
+
+    HASH_FIND(hh, ctx->uids, &user->uid, sizeof(uint64_t), entry);
+    if (entry != NULL && entry->user == user)
+    {
+        HASH_DEL(ctx->uids, entry);
+        free(entry);
+    }
+}
+
+
+/*
+ * uid_user - (Thread-safe) Find a user by the compact form of its UID
+ *
+ * Return: the user, or NULL if s is no UID or no user has it
+ */
+static client_t *uid_user(server_ctx *ctx, const char *s)
+{
+    uid_entry_t *entry = NULL;
+    uint64_t uid;
+
+    if (uid_decode(s, &uid) == CHIRC_ERROR)
+    {
+        return NULL;
+    }
+    trace_mutex_lock(&ctx->clients_lock, "clients_lock");
+    HASH_FIND(hh, ctx->uids, &uid, sizeof(uint64_t), entry);
+    pthread_mutex_unlock(&ctx->clients_lock);
+
+    return entry != NULL ? entry->user : NULL;
+}
+
+
+/*
+ * link_line - Format a message of a user for a link
+ *
+ * user: the user, named by nick or by UID in the prefix
+ *
+ * uids: the link names users by UID
+ *
+ * rest: the command and its parameters
+ *
+ * Return: the line, with "\r\n"
+ */
+static sds link_line(client_t *user, bool uids, const char *rest)
+{
+    if (uids)
+    {
+        char uid[UID_STR_LEN + 1];
+
+        uid_encode(user->uid, uid);
+        return sdscatprintf(sdsempty(), ":%s %s\r\n", uid, rest);
+    }
+    return sdscatprintf(sdsempty(), ":%s %s\r\n", user->info.nick, rest);
+}
+
+
+/*
+ * link_send - Send a message on the links towards some servers, once on
+ * each link
+ *
+ * ctx: server context
+ *
+ * dest_ids: the servers, or NULL for every server of the network
+ *
+ * ndest: the number of servers in dest_ids
+ *
+ * from_id: the server the message came from, whose link is skipped, or -1
+ *
+ * line: the message for the links naming users by nick
+ *
+ * compact: the message for the links naming users by UID
+ *
+ * Return: nothing
+ */
+static void link_send(server_ctx *ctx, unsigned int *dest_ids, int ndest, int from_id,
+                      sds line, sds compact)
+{
+    network_t *net = ctx->network;
+    unsigned int *hops = malloc(net->num_servers * sizeof(unsigned int));
+    unsigned int *all = NULL;
+
+    if (dest_ids == NULL)
+    {
+        all = malloc(net->num_servers * sizeof(unsigned int));
+        for (unsigned int i = 0; i < net->num_servers; i++)
+        {
+            all[i] = i;
+        }
+        dest_ids = all;
+        ndest = net->num_servers;
+    }
+    int nhops = network_downstream(net, dest_ids, ndest, from_id, hops);
+
+    /* Held while sending, so a link being registered gets its burst first */
+    trace_mutex_lock(&ctx->links_lock, "links_lock");
+    for (int i = 0; i < nhops; i++)
+    {
+        link_t *link = ctx->links[hops[i]];
+
+        if (link != NULL && !link->waiting)
+        {
+            link_write(ctx, link, link->uids ? compact : line);
+        }
+    }
+    pthread_mutex_unlock(&ctx->links_lock);
+
+    free(all);
+    free(hops);
+}
+
+
+/*
+ * link_intro - Format the NICK introducing a user to another server: the
+ * hopcount counts the links to the user's server plus one, and the token
+ * is the user's UID
+ *
+ * Return: the line, with "\r\n"
+ */
+static sds link_intro(network_t *net, client_t *user)
+{
+    irc_server_t *server = user->server != NULL ? user->server : net->self;
+    char uid[UID_STR_LEN + 1];
+
+    uid_encode(user->uid, uid);
+    return sdscatprintf(sdsempty(), ":%s NICK %s %d %s %s %s + :%s\r\n",
+                        server->servername, user->info.nick, link_hops(net, server->id) + 1,
+                        user->info.username, user->client_hostname, uid, user->info.realname);
+}
+
+
+/* Send the NICK introducing a user on every link but the one it came from */
+static void link_introduce(server_ctx *ctx, int from_id, client_t *user)
+{
+    sds line = link_intro(ctx->network, user);
+
+    link_send(ctx, NULL, 0, from_id, line, line);
+    sdsfree(line);
+}
+
+
+/*
+ * link_burst - Format what a link just registered is told about: a NICK
+ * for each user that is not behind it, then a JOIN for each of their
+ * memberships (called with links_lock held)
+ *
+ * Return: the lines
+ */
+static sds link_burst(server_ctx *ctx, link_t *link)
+{
+    network_t *net = ctx->network;
+    unsigned int id = link->server->id;
+    sds burst = sdsempty();
+    client_t *client, *client_tmp;
+    channel_t *c, *channel_tmp;
+
+    channel_t **channels = server_lock_CHANNELS(ctx);
+    trace_mutex_lock(&ctx->clients_lock, "clients_lock");
+    HASH_ITER(hh, ctx->client_hashtable, client, client_tmp)
+    {
+        if (client->info.state == REGISTERED && !link_behind(net, client, id))
+        {
+            sds line = link_intro(net, client);
+            burst = sdscatsds(burst, line);
+            sdsfree(line);
+        }
+    }
+    HASH_ITER(hh, *channels, c, channel_tmp)
+    {
+        sds rest = sdscatprintf(sdsempty(), "JOIN %s", c->channel_name);
+
+        for (channel_client *cc = c->channel_clients; cc != NULL; cc = cc->hh.next)
+        {
+            if (!link_behind(net, cc->user, id))
+            {
+                sds line = link_line(cc->user, link->uids, rest);
+                burst = sdscatsds(burst, line);
+                sdsfree(line);
+            }
+        }
+        sdsfree(rest);
+    }
+    pthread_mutex_unlock(&ctx->clients_lock);
+    server_unlock_CHANNELS(ctx);
+
+    return burst;
+}
+
+
+/*
+ * link_refuse - Send ERROR on a link that cannot be registered and close
+ * it once the command is done
+ *
+ * Return: CHIRC_ERROR
+ */
+static int link_refuse(server_ctx *ctx, conn_info_t *conn, sds reason)
+{
+    sds msg = sdscatprintf(sdsempty(), "ERROR :%s\r\n", reason);
+
+    chilog(WARNING, "Refused server link: %s", reason);
+    send_msg(conn->client_socket, ctx, msg);
+    conn->quit = true;
+
+    sdsfree(msg);
+    sdsfree(reason);
+    return CHIRC_ERROR;
+}
+
+
+/*
+ * link_established - Start relaying on a link: send it the burst, then
+ * the messages relayed after it (called with links_lock held, so the
+ * relays wait for the burst)
+ */
+static void link_established(server_ctx *ctx, link_t *link)
+{
+    sds burst = link_burst(ctx, link);
+
+    link->waiting = false;
+    if (link->z != NULL && link->outgoing)
+    {
+        /* The other end waits for a compressed command before it sends */
+        burst = sdscatprintf(burst, "PING :%s\r\n", ctx->network->self->servername);
+    }
+    if (sdslen(burst) > 0)
+    {
+        link_write(ctx, link, burst);
+    }
+    sdsfree(burst);
+}
+
+
+/*
+ * link_register - Register a link once its PASS and SERVER are in: the
+ * server must be a neighbor on the spanning tree that is not linked yet
+ * and know this server's password. A link opened by CONNECT must also
+ * come from the server connected to.
+ *
+ * Return: CHIRC_OK/CHIRC_ERROR
+ */
+static int link_register(server_ctx *ctx, conn_info_t *conn)
+{
+    link_t *link = conn->link;
+    network_t *net = ctx->network;
+    irc_server_t *self = net->self;
+    irc_server_t *server = find_SERVER(link->servername, &net->servers_hashtable);
+
+    if (server == NULL || server == self || (link->outgoing && server != link->server))
+    {
+        return link_refuse(ctx, conn, sdsnew("Server not configured here"));
+    }
+    if (strcmp(link->passwd, self->passwd) != 0)
+    {
+        return link_refuse(ctx, conn, sdsnew("Bad password"));
+    }
+    if (server->parent != (int)self->id && self->parent != (int)server->id)
+    {
+        return link_refuse(ctx, conn, sdscatprintf(sdsempty(), "%s is not a neighbor of %s in the spanning tree",
+                                                   server->servername, self->servername));
+    }
+
+    trace_mutex_lock(&ctx->links_lock, "links_lock");
+    if (ctx->links[server->id] != NULL)
+    {
+        pthread_mutex_unlock(&ctx->links_lock);
+        return link_refuse(ctx, conn, sdscatprintf(sdsempty(), "ID \"%s\" already registered",
+                                                   server->servername));
+    }
+    link->server = server;
+    link->uids = link_option(link->options, LINK_UID_FLAG);
+
+    /* Both ends compute the same: each compresses when it sent the flag
+     * and got it */
+    if (ctx->link_compress >= 0 && link_compress_requested(link->options))
+    {
+        link->z = malloc(sizeof(link_zstream_t));
+        if (link_zstream_init(link->z, ctx->link_compress, ctx->link_flush) == CHIRC_ERROR)
+        {
+            pthread_mutex_unlock(&ctx->links_lock);
+            free(link->z);
+            link->z = NULL;
+            return link_refuse(ctx, conn, sdsnew("Compression unavailable"));
+        }
+    }
+
+    /* The other end of a link opened by CONNECT already sent its own */
+    if (!link->outgoing)
+    {
+        sds options = link_options(ctx);
+        sds reply = sdscatprintf(sdsempty(), ":%s PASS %s %s %s\r\n:%s SERVER %s 1 :%s\r\n",
+                                 self->servername, server->passwd, LINK_VERSION, options,
+                                 self->servername, self->servername, LINK_INFO);
+        /* In plain text even on a compressed link */
+        send_msg(link->socket, ctx, reply);
+        sdsfree(reply);
+        sdsfree(options);
+    }
+
+    link->registered = true;
+    ctx->links[server->id] = link;
+    if (link->z != NULL && !link->outgoing)
+    {
+        /* The burst waits for the first compressed command of the other
+         * end: it has read our SERVER by then */
+        link->waiting = true;
+    }
+    else
+    {
+        link_established(ctx, link);
+    }
+    pthread_mutex_unlock(&ctx->links_lock);
+
+    chilog(INFO, "Linked to %s%s%s", server->servername, link->uids ? " (UIDs)" : "",
+           link->z != NULL ? " (compressed)" : "");
+    return CHIRC_OK;
+}
+
+
+/* PASS or SERVER, registering a link */
+static int link_hello(server_ctx *ctx, conn_info_t *conn, sds *cmdtokens, int argc)
+{
+    link_t *link = conn->link;
+
+    if (link->registered || link->lost)
+    {
+        sds reply = sdscatprintf(sdsempty(), ":%s %s %s :Connection already registered\r\n",
+                                 conn->server_hostname, ERR_ALREADYREGISTRED, link->server->servername);
+        link_write(ctx, link, reply);
+        sdsfree(reply);
+
+        return CHIRC_ERROR;
+    }
+    if (argc < 2)
+    {
+        return CHIRC_ERROR;
+    }
+
+    if (!strcmp(cmdtokens[0], "PASS"))
+    {
+        link->passwd = sdscpy(link->passwd != NULL ? link->passwd : sdsempty(), cmdtokens[1]);
+        link->options = sdscpy(link->options != NULL ? link->options : sdsempty(),
+                               argc > 3 ? cmdtokens[3] : "");
+    }
+    else
+    {
+        link->servername = sdscpy(link->servername != NULL ? link->servername : sdsempty(),
+                                  cmdtokens[1]);
+    }
+
+    /* Either may come first */
+    if (link->passwd == NULL || link->servername == NULL)
+    {
+        return CHIRC_OK;
+    }
+    return link_register(ctx, conn);
+}
+
+
+/*
+ * link_sender - Find the user a command received on a link is from,
+ * which must be behind the link
+ *
+ * Return: the user, or NULL if there is none
+ */
+static client_t *link_sender(server_ctx *ctx, link_t *link, const char *prefix)
+{
+    client_t *user = NULL;
+
+    if (prefix == NULL)
+    {
+        return NULL;
+    }
+    if (link->uids)
+    {
+        user = uid_user(ctx, prefix);
+    }
+    else
+    {
+        /* Either the nick or nick!user@host */
+        sds nick = sdsnew(prefix);
+        char *bang = strchr(nick, '!');
+        if (bang != NULL)
+        {
+            sdsrange(nick, 0, bang - nick - 1);
+        }
+
+        nick_t *n = server_find_NICK(ctx, nick);
+        user = n != NULL ? server_find_USER(ctx, n->client_socket) : NULL;
+        sdsfree(nick);
+    }
+
+    if (user == NULL || !link_behind(ctx->network, user, link->server->id))
+    {
+        chilog(DEBUG, "%s sent a command from %s, who is not behind it", link->server->servername, prefix);
+        return NULL;
+    }
+    return user;
+}
+
+
+/* The prefix a user's commands are relayed to the users of this server with */
+static sds link_user_prefix(client_t *user)
+{
+    return sdscatprintf(sdsempty(), ":%s!%s@%s", user->info.nick, user->info.username,
+                        user->client_hostname);
+}
+
+
+/*
+ * link_take_user - Take a user behind a link out of the nicks and the
+ * clients, relay its QUIT to the users sharing a channel with it, and
+ * free it
+ */
+static void link_take_user(server_ctx *ctx, client_t *user, sds *cmdtokens, int argc)
+{
+    sds prefix = link_user_prefix(user);
+
+    server_remove_NICK(ctx, user->info.nick);
+    trace_mutex_lock(&ctx->clients_lock, "clients_lock");
+    HASH_DELETE(hh, ctx->client_hashtable, user);
+    pthread_mutex_unlock(&ctx->clients_lock);
+
+    quit_user(ctx, user, prefix, cmdtokens, argc);
+    sdsfree(prefix);
+}
+
+
+/*
+ * link_quit_users - Quit the users of the servers lost with a link, or
+ * of one server behind it
+ *
+ * ctx: server context
+ *
+ * link: the link
+ *
+ * gone: the server, or NULL for every server behind the link
+ *
+ * Return: nothing
+ */
+static void link_quit_users(server_ctx *ctx, link_t *link, irc_server_t *gone)
+{
+    network_t *net = ctx->network;
+    unsigned int id = link->server->id;
+    client_t **lost = NULL;
+    client_t *client, *tmp;
+    int count = 0, size = 0;
+
+    /* Only the thread serving the link takes out the users behind it,
+     * so they stay valid once the lock is released */
+    trace_mutex_lock(&ctx->clients_lock, "clients_lock");
+    HASH_ITER(hh, ctx->client_hashtable, client, tmp)
+    {
+        if (gone != NULL ? client->server == gone : link_behind(net, client, id))
+        {
+            if (count == size)
+            {
+                size = size ? size * 2 : 16;
+                lost = realloc(lost, size * sizeof(client_t *));
+            }
+            lost[count++] = client;
+        }
+    }
+    pthread_mutex_unlock(&ctx->clients_lock);
+
+    /* The message of a netsplit names the two servers */
+    sds tokens[2];
+    tokens[0] = sdsnew("QUIT");
+    tokens[1] = sdscatprintf(sdsempty(), ":%s %s", gone != NULL ? link->server->servername : net->self->servername,
+                             gone != NULL ? gone->servername : link->server->servername);
+    for (int i = 0; i < count; i++)
+    {
+        link_user_quit(ctx, id, lost[i], tokens, 2);
+        link_take_user(ctx, lost[i], tokens, 2);
+    }
+    sdsfree(tokens[0]);
+    sdsfree(tokens[1]);
+    free(lost);
+}
+
+
+/* NICK introducing a user of another server */
+static int link_introduced(server_ctx *ctx, conn_info_t *conn, char *prefix, sds *cmdtokens, int argc)
+{
+    link_t *link = conn->link;
+    network_t *net = ctx->network;
+    irc_server_t *server = NULL;
+    uint64_t uid;
+
+    if (link->uids && uid_decode(cmdtokens[5], &uid) == CHIRC_OK && uid_server(uid) < net->num_servers)
+    {
+        server = net->servers[uid_server(uid)];
+    }
+    else
+    {
+        /* The token of another kind of server means nothing here. A UID
+         * of this server routes the user's messages here first, and this
+         * server knows the way on. */
+        server = prefix != NULL ? find_SERVER(prefix, &net->servers_hashtable) : NULL;
+        server = server != NULL ? server : link->server;
+        uid = server_new_UID(ctx);
+    }
+
+    if (network_next_hop(net, server->id) != (int)link->server->id)
+    {
+        chilog(WARNING, "%s introduced %s of %s, which is not behind it",
+               link->server->servername, cmdtokens[1], server->servername);
+        return CHIRC_ERROR;
+    }
+    if (server_find_NICK(ctx, cmdtokens[1]) != NULL)
+    {
+        /* Also a user introduced by a burst and by its registration */
+        chilog(DEBUG, "%s introduced %s, whose nick is taken", link->server->servername, cmdtokens[1]);
+        return CHIRC_ERROR;
+    }
+
+    trace_mutex_lock(&ctx->lock, "ctx_lock");
+    int key = --ctx->remote_key;
+    pthread_mutex_unlock(&ctx->lock);
+
+    client_t *user = new_USER(key, cmdtokens[4], uid);
+    sds realname = link_trailing(cmdtokens, argc, 7);
+    user_set_nick(&user->info, cmdtokens[1]);
+    user_set_username(&user->info, cmdtokens[3]);
+    user->info.realname = sdscpy(user->info.realname, realname);
+    user->info.state = REGISTERED;
+    user->server = server;
+    sdsfree(realname);
+
+    trace_mutex_lock(&ctx->clients_lock, "clients_lock");
+    add_USER(user, key, &ctx->client_hashtable);
+    uid_add(ctx, user);
+    pthread_mutex_unlock(&ctx->clients_lock);
+    server_add_NICK(ctx, key, user->info.nick);
+
+    link_introduce(ctx, link->server->id, user);
+    return CHIRC_OK;
+}
+
+
+/* NICK: a user introduced, or a nick change */
+static int link_NICK(server_ctx *ctx, conn_info_t *conn, char *prefix, sds *cmdtokens, int argc)
+{
+    if (argc >= 8)
+    {
+        return link_introduced(ctx, conn, prefix, cmdtokens, argc);
+    }
+
+    client_t *user = link_sender(ctx, conn->link, prefix);
+    if (user == NULL || argc < 2)
+    {
+        return CHIRC_ERROR;
+    }
+
+    sds tokens[2] = {cmdtokens[0], link_trailing(cmdtokens, argc, 1)};
+    if (server_find_NICK(ctx, tokens[1]) != NULL)
+    {
+        chilog(WARNING, "%s renamed %s to %s, whose nick is taken",
+               conn->link->server->servername, user->info.nick, tokens[1]);
+        sdsfree(tokens[1]);
+        return CHIRC_ERROR;
+    }
+
+    link_user_nick(ctx, conn->link->server->id, user, tokens[1]);
+
+    sds user_prefix = link_user_prefix(user);
+    server_remove_NICK(ctx, user->info.nick);
+    rename_user(ctx, user, user_prefix, tokens, 2);
+    server_add_NICK(ctx, user->socket, user->info.nick);
+
+    sdsfree(user_prefix);
+    sdsfree(tokens[1]);
+    return CHIRC_OK;
+}
+
+
+static int link_QUIT(server_ctx *ctx, conn_info_t *conn, char *prefix, sds *cmdtokens, int argc)
+{
+    client_t *user = link_sender(ctx, conn->link, prefix);
+
+    if (user == NULL)
+    {
+        return CHIRC_ERROR;
+    }
+    link_user_quit(ctx, conn->link->server->id, user, cmdtokens, argc);
+    link_take_user(ctx, user, cmdtokens, argc);
+
+    return CHIRC_OK;
+}
+
+
+/* JOIN of one channel by a user behind a link */
+static void link_join(server_ctx *ctx, conn_info_t *conn, client_t *user, sds *cmdtokens, int argc,
+                      sds channel_name)
+{
+    channel_t *c = server_find_CHANNEL(ctx, channel_name);
+    bool existed = c != NULL;
+
+    if (c == NULL)
+    {
+        c = server_add_CHANNEL(ctx, channel_name);
+    }
+    else if (server_find_CHANNEL_CLIENT(ctx, c, user) != NULL)
+    {
+        /* Also a membership sent by a burst and by its JOIN */
+        return;
+    }
+    server_add_CHANNEL_CLIENT(ctx, user, channel_name, existed);
+
+    sds prefix = link_user_prefix(user);
+    server_lock_CHANNELS(ctx);
+    for (channel_client *cc = c->channel_clients; cc != NULL; cc = cc->hh.next)
+    {
+        server_reply_join_relay(ctx, prefix, cmdtokens, channel_name, cc->user->socket);
+    }
+    server_unlock_CHANNELS(ctx);
+    sdsfree(prefix);
+
+    link_user_channel(ctx, conn->link->server->id, user, cmdtokens, argc, channel_name);
+}
+
+
+/* PART of one channel by a user behind a link */
+static void link_part(server_ctx *ctx, conn_info_t *conn, client_t *user, sds *cmdtokens, int argc,
+                      sds channel_name)
+{
+    channel_t *c = server_find_CHANNEL(ctx, channel_name);
+
+    if (c == NULL || server_find_CHANNEL_CLIENT(ctx, c, user) == NULL)
+    {
+        return;
+    }
+
+    sds prefix = link_user_prefix(user);
+    channel_t **channels = server_lock_CHANNELS(ctx);
+    for (channel_client *cc = c->channel_clients; cc != NULL; cc = cc->hh.next)
+    {
+        server_reply_part(ctx, prefix, cmdtokens, c->channel_name, argc, cc->user->socket);
+    }
+    server_leave_CHANNEL(ctx, channels, c, user);
+    server_unlock_CHANNELS(ctx);
+    sdsfree(prefix);
+
+    link_user_channel(ctx, conn->link->server->id, user, cmdtokens, argc, channel_name);
+}
+
+
+/* JOIN or PART */
+static int link_channels(server_ctx *ctx, conn_info_t *conn, char *prefix, sds *cmdtokens, int argc)
+{
+    client_t *user = link_sender(ctx, conn->link, prefix);
+    bool join = !strcmp(cmdtokens[0], "JOIN");
+    int count = 0;
+
+    if (user == NULL || argc < 2)
+    {
+        return CHIRC_ERROR;
+    }
+
+    sds *names = sdssplitlen(cmdtokens[1], sdslen(cmdtokens[1]), ",", 1, &count);
+    for (int i = 0; i < count; i++)
+    {
+        if (names[i][0] != '#')
+        {
+            continue;
+        }
+        if (join)
+        {
+            link_join(ctx, conn, user, cmdtokens, argc, names[i]);
+        }
+        else
+        {
+            link_part(ctx, conn, user, cmdtokens, argc, names[i]);
+        }
+    }
+    sdsfreesplitres(names, count);
+
+    return CHIRC_OK;
+}
+
+
+/* PRIVMSG or NOTICE */
+static int link_PRIVMSG(server_ctx *ctx, conn_info_t *conn, char *prefix, sds *cmdtokens, int argc)
+{
+    link_t *link = conn->link;
+    client_t *user = link_sender(ctx, link, prefix);
+    int count = 0;
+
+    if (user == NULL || argc < 3)
+    {
+        return CHIRC_ERROR;
+    }
+
+    sds user_prefix = link_user_prefix(user);
+    sds *names = sdssplitlen(cmdtokens[1], sdslen(cmdtokens[1]), ",", 1, &count);
+    for (int i = 0; i < count; i++)
+    {
+        msg_target_t target = {.name = names[i]};
+
+        if (names[i][0] != '#' && link->uids)
+        {
+            /* The recipient is named by UID, and its nick is what it gets */
+            client_t *to = uid_user(ctx, names[i]);
+            if (to == NULL)
+            {
+                continue;
+            }
+            trace_mutex_lock(&ctx->clients_lock, "clients_lock");
+            names[i] = sdscpy(names[i], to->info.nick);
+            pthread_mutex_unlock(&ctx->clients_lock);
+            target.name = names[i];
+        }
+
+        server_resolve_TARGETS(ctx, user, &target, 1);
+        if (target.error == NULL)
+        {
+            server_reply_privmsg(ctx, user_prefix, cmdtokens, argc, &target);
+            link_user_message(ctx, link->server->id, user, cmdtokens, argc, &target);
+        }
+        free(target.sockets);
+    }
+    sdsfreesplitres(names, count);
+    sdsfree(user_prefix);
+
+    return CHIRC_OK;
+}
+
+
+/*
+ * link_lose - Take down a link: it leaves ctx->links, and the users
+ * behind it quit
+ */
+static void link_lose(server_ctx *ctx, conn_info_t *conn)
+{
+    link_t *link = conn->link;
+
+    trace_mutex_lock(&ctx->links_lock, "links_lock");
+    if (ctx->links[link->server->id] == link)
+    {
+        ctx->links[link->server->id] = NULL;
+    }
+    link->registered = false;
+    link->lost = true;
+    pthread_mutex_unlock(&ctx->links_lock);
+
+    chilog(INFO, "Lost the link to %s", link->server->servername);
+    link_quit_users(ctx, link, NULL);
+}
+
+
+/* SQUIT of the server at the other end, also run when its input ends, or of one behind it */
+static int link_SQUIT(server_ctx *ctx, conn_info_t *conn, char *prefix, sds *cmdtokens, int argc)
+{
+    network_t *net = ctx->network;
+    link_t *link = conn->link;
+    irc_server_t *gone = argc > 1 ? find_SERVER(cmdtokens[1], &net->servers_hashtable) : NULL;
+
+    (void)prefix;
+    if (gone == NULL)
+    {
+        return CHIRC_ERROR;
+    }
+    if (gone == link->server)
+    {
+        link_lose(ctx, conn);
+        /* Its input then ends, and the socket is closed after it */
+        shutdown(conn->client_socket, SHUT_RDWR);
+    }
+    else if (network_next_hop(net, gone->id) == (int)link->server->id)
+    {
+        link_quit_users(ctx, link, gone);
+    }
+
+    return CHIRC_OK;
+}
+
+
+static int link_PING(server_ctx *ctx, conn_info_t *conn, char *prefix, sds *cmdtokens, int argc)
+{
+    sds param = argc > 1 ? link_trailing(cmdtokens, argc, 1) : sdsnew(conn->server_hostname);
+    sds reply = sdscatprintf(sdsempty(), ":%s PONG %s :%s\r\n", conn->server_hostname,
+                             conn->server_hostname, param);
+    int rc = link_write(ctx, conn->link, reply) == MSG_ERROR ? CHIRC_ERROR : CHIRC_OK;
+
+    (void)prefix;
+    sdsfree(reply);
+    sdsfree(param);
+    return rc;
+}
+
+
+static int link_PONG(server_ctx *ctx, conn_info_t *conn, char *prefix, sds *cmdtokens, int argc)
+{
+    (void)ctx;
+    (void)conn;
+    (void)prefix;
+    (void)cmdtokens;
+    (void)argc;
+    return CHIRC_OK;
+}
+
+
+static int link_ERROR(server_ctx *ctx, conn_info_t *conn, char *prefix, sds *cmdtokens, int argc)
+{
+    sds text = link_trailing(cmdtokens, argc, 1);
+
+    (void)ctx;
+    (void)prefix;
+    chilog(WARNING, "%s closed the link: %s", conn->link->server->servername, text);
+    sdsfree(text);
+    /* Its input then ends, and the link is taken down */
+    shutdown(conn->client_socket, SHUT_RDWR);
+
+    return CHIRC_OK;
+}
+
+
+/* Dispatch table of registered links */
+static struct link_entry link_handlers[] = {
+    {"NICK", link_NICK},
+    {"QUIT", link_QUIT},
+    {"JOIN", link_channels},
+    {"PART", link_channels},
+    {"PRIVMSG", link_PRIVMSG},
+    {"NOTICE", link_PRIVMSG},
+    {"SQUIT", link_SQUIT},
+    {"PING", link_PING},
+    {"PONG", link_PONG},
+    {"ERROR", link_ERROR},
+};
+
+#define NUM_LINK_HANDLERS (int)(sizeof(link_handlers) / sizeof(struct link_entry))
+
+
+int link_request(server_ctx *ctx, sds *cmdtokens, int argc, conn_info_t *conn)
+{
+    /*
+     * link_request - Run a command received on a server link, or the PASS
+     * or SERVER starting one (then conn->link is set)
+     *
+     * ctx: server context
+     *
+     * cmdtokens: the command, with the prefix of the sender, if any
+     *
+     * argc: the count of tokens
+     *
+     * conn: the connection
+     *
+     * Return: CHIRC_OK/CHIRC_ERROR
+     */
+    link_t *link = conn->link;
+    char *prefix = NULL;
+
+    if (cmdtokens[0][0] == ':')
+    {
+        prefix = cmdtokens[0] + 1;
+        cmdtokens++;
+        argc--;
+    }
+
+    /* A standalone server ignores them, like the other commands it does
+     * not know from unregistered connections */
+    if (argc == 0 || ctx->network == NULL)
+    {
+        return CHIRC_OK;
+    }
+    if (link == NULL)
+    {
+        link = conn->link = calloc(1, sizeof(link_t));
+        link->socket = conn->client_socket;
+    }
+
+    if (!strncmp(cmdtokens[0], "PASS", MAX_STR_LEN) || !strncmp(cmdtokens[0], "SERVER", MAX_STR_LEN))
+    {
+        return link_hello(ctx, conn, cmdtokens, argc);
+    }
+    if (!link->registered)
+    {
+        /* Nothing but PASS and SERVER before registration, and nothing
+         * once the link is taken down */
+        return CHIRC_OK;
+    }
+    if (link->waiting)
+    {
+        /* The other end decompresses what we send from now on */
+        trace_mutex_lock(&ctx->links_lock, "links_lock");
+        link_established(ctx, link);
+        pthread_mutex_unlock(&ctx->links_lock);
+    }
+
+    for (int j = 0; j < NUM_LINK_HANDLERS; j++)
+    {
+        if (!strncmp(link_handlers[j].name, cmdtokens[0], MAX_STR_LEN))
+        {
+            return link_handlers[j].func(ctx, conn, prefix, cmdtokens, argc);
+        }
+    }
+    chilog(DEBUG, "Ignored %s from %s", cmdtokens[0], link->server->servername);
+
+    return CHIRC_OK;
+}
+
+
+bool link_user_hello(conn_info_t *conn, sds cmd)
+{
+    /*
+     * link_user_hello - Give up the link state of a connection that sent
+     * PASS and then registers as a user with NICK or USER
+     *
+     * conn: the connection, with conn->link set
+     *
+     * cmd: the command received
+     *
+     * Return: true if the connection is a user after all and the command
+     * is to be run as a user's
+     */
+    link_t *link = conn->link;
+
+    if (link->servername != NULL || link->outgoing ||
+        (strncmp(cmd, "NICK", MAX_STR_LEN) && strncmp(cmd, "USER", MAX_STR_LEN)))
+    {
+        return false;
+    }
+    link_free(link);
+    conn->link = NULL;
+
+    return true;
+}
+
+
+int link_connect(server_ctx *ctx, conn_info_t *conn, client_t *user, sds *cmdtokens, int argc)
+{
+    /*
+     * link_connect - Open a server link to a neighbor on the spanning
+     * tree, for CONNECT. PASS and SERVER are sent and the link is
+     * registered once the other end sends its own.
+     *
+     * ctx: server context
+     *
+     * conn: the connection of the IRC operator
+     *
+     * user: the IRC operator
+     *
+     * cmdtokens: "CONNECT", the servername and an optional port
+     *
+     * argc: the count of tokens
+     *
+     * Return: CHIRC_OK/CHIRC_ERROR
+     */
+    network_t *net = ctx->network;
+    irc_server_t *server = net != NULL ? find_SERVER(cmdtokens[1], &net->servers_hashtable) : NULL;
+    struct addrinfo hints, *res, *p;
+    int fd = -1;
+
+    if (server == NULL || server == net->self)
+    {
+        /* ERR_NOSUCHSERVER */
+        sds reply = sdscatprintf(sdsempty(), ":%s %s %s %s :No such server\r\n", conn->server_hostname,
+                                 ERR_NOSUCHSERVER, user->info.nick, cmdtokens[1]);
+        send_msg(conn->client_socket, ctx, reply);
+        sdsfree(reply);
+
+        return CHIRC_ERROR;
+    }
+    if (server->parent != (int)net->self->id && net->self->parent != (int)server->id)
+    {
+        chilog(WARNING, "Not connecting to %s: not a neighbor in the spanning tree", server->servername);
+        return CHIRC_ERROR;
+    }
+
+    trace_mutex_lock(&ctx->links_lock, "links_lock");
+    bool linked = ctx->links[server->id] != NULL;
+    pthread_mutex_unlock(&ctx->links_lock);
+    if (linked)
+    {
+        chilog(INFO, "Already linked to %s", server->servername);
+        return CHIRC_OK;
+    }
+
+    memset(&hints, 0, sizeof hints);
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(server->hostname, argc > 2 ? cmdtokens[2] : server->port, &hints, &res) != 0)
+    {
+        chilog(ERROR, "Could not resolve %s", server->hostname);
+        return CHIRC_ERROR;
+    }
+    for (p = res; p != NULL; p = p->ai_next)
+    {
+        /* Close-on-exec, like the sockets accepted */
+        if ((fd = socket(p->ai_family, p->ai_socktype | SOCK_CLOEXEC, p->ai_protocol)) == -1)
+        {
+            continue;
+        }
+        if (connect(fd, p->ai_addr, p->ai_addrlen) == 0)
+        {
+            break;
+        }
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(res);
+    if (fd == -1)
+    {
+        chilog(ERROR, "Could not connect to %s", server->servername);
+        return CHIRC_ERROR;
+    }
+
+    link_t *link = calloc(1, sizeof(link_t));
+    link->socket = fd;
+    link->server = server;
+    link->outgoing = true;
+
+    /* Sent before the connection is served, so before any reply is read */
+    sds options = link_options(ctx);
+    sds hello = sdscatprintf(sdsempty(), "PASS %s %s %s\r\nSERVER %s 1 :%s\r\n",
+                             server->passwd, LINK_VERSION, options, net->self->servername, LINK_INFO);
+    int rc = send_msg(fd, ctx, hello);
+    sdsfree(hello);
+    sdsfree(options);
+
+    if (rc == MSG_ERROR)
+    {
+        link_free(link);
+        close(fd);
+        return CHIRC_ERROR;
+    }
+    stats_connection_opened();
+    if (start_worker(ctx, fd, sdsnew(server->hostname), NULL, false, link) == CHIRC_ERROR)
+    {
+        /* The connection freed the link */
+        close_socket(ctx, fd);
+        return CHIRC_ERROR;
+    }
+
+    return CHIRC_OK;
+}
+
+
+sds link_eof(conn_info_t *conn)
+{
+    /*
+     * link_eof - The command taking down a registered server link whose
+     * input ended, to be run after the commands it sent before
+     *
+     * conn: the connection
+     *
+     * Return: the SQUIT of the server at the other end, or NULL if the
+     * connection is not a registered link or it was taken down already
+     */
+    link_t *link = conn->link;
+
+    if (link == NULL || !link->registered)
+    {
+        return NULL;
+    }
+    return sdscatprintf(sdsempty(), "SQUIT %s :Connection closed", link->server->servername);
+}
+
+
+int link_input(conn_info_t *conn, const char *data, int len)
+{
+    /*
+     * link_input - Take in bytes received on a connection that may be a
+     * server link: decompress them if the link is compressed, and append
+     * them to the cmd stack (called by the thread reading the connection)
+     *
+     * conn: the connection
+     *
+     * data: the bytes received
+     *
+     * len: number of bytes
+     *
+     * Return: CHIRC_OK, or CHIRC_ERROR if the compressed stream is
+     * corrupt: the connection is to be closed
+     */
+    link_t *link = conn->link;
+
+    /* The inflater is set up before the other end is told to compress,
+     * so the first compressed bytes find it */
+    if (link == NULL || link->z == NULL)
+    {
+        conn->cmdstack = sdscatlen(conn->cmdstack, data, len);
+        return CHIRC_OK;
+    }
+    return link_zstream_decompress(link->z, data, len, &conn->cmdstack);
+}
+
+
+void link_flush(server_ctx *ctx)
+{
+    /*
+     * link_flush - Send what the compressed links hold back in batch mode
+     * (-Z batch), once a run of commands is done
+     *
+     * ctx: server context
+     *
+     * Return: nothing
+     */
+    network_t *net = ctx->network;
+
+    if (net == NULL || ctx->link_compress < 0 || ctx->link_flush != LINK_FLUSH_BATCH)
+    {
+        return;
+    }
+
+    /* The links of a server are to its parent and its two children */
+    unsigned int self = net->self->id;
+    int neighbors[3] = {net->self->parent, 2 * self + 1, 2 * self + 2};
+
+    trace_mutex_lock(&ctx->links_lock, "links_lock");
+    for (int i = 0; i < 3; i++)
+    {
+        link_t *link = neighbors[i] >= 0 && neighbors[i] < (int)net->num_servers ? ctx->links[neighbors[i]] : NULL;
+
+        if (link == NULL || link->z == NULL || link->waiting)
+        {
+            continue;
+        }
+
+        pthread_mutex_t *lock = &ctx->socket_locks[link->socket % SOCKET_LOCKS];
+        sds out = sdsempty();
+        int len = 0;
+
+        trace_mutex_lock(lock, "socket_lock");
+        if (link_zstream_flush(link->z, &out) == CHIRC_OK && (len = sdslen(out)) > 0 &&
+            sendall(link->socket, out, &len) == -1)
+        {
+            chilog(ERROR, "We only sent %d bytes because of the error!\n", len);
+        }
+        pthread_mutex_unlock(lock);
+        stats_bytes_out(len);
+        sdsfree(out);
+    }
+    pthread_mutex_unlock(&ctx->links_lock);
+}
+
+
+void link_free(link_t *link)
+{
+    /*
+     * link_free - Free the link state of a connection once it is closed
+     *
+     * link: the link, may be NULL
+     *
+     * Return: nothing
+     */
+    if (link == NULL)
+    {
+        return;
+    }
+    sdsfree(link->servername);
+    sdsfree(link->passwd);
+    sdsfree(link->options);
+    if (link->z != NULL)
+    {
+        link_zstream_free(link->z);
+        free(link->z);
+    }
+    free(link);
+}
+
+
+void link_cleanup(server_ctx *ctx)
+{
+    /*
+     * link_cleanup - Free the links table and the UIDs of the users when
+     * the server exits
+     *
+     * ctx: server context
+     *
+     * Return: nothing
+     */
+    uid_entry_t *entry, *tmp;
+
+    HASH_ITER(hh, ctx->uids, entry, tmp)
+    {
+        HASH_DEL(ctx->uids, entry);
+        free(entry);
+    }
+    free(ctx->links);
+    ctx->links = NULL;
+}
+
+
+void link_user_new(server_ctx *ctx, client_t *user)
+{
+    /*
+     * link_user_new - Tell the network about a user of this server that
+     * just registered
+     *
+     * ctx: server context
+     *
+     * user: the user
+     *
+     * Return: nothing
+     */
+    if (ctx->network == NULL)
+    {
+        return;
+    }
+
+    trace_mutex_lock(&ctx->clients_lock, "clients_lock");
+    uid_add(ctx, user);
+    pthread_mutex_unlock(&ctx->clients_lock);
+
+    link_introduce(ctx, -1, user);
+}
+
+
+void link_user_nick(server_ctx *ctx, int from_id, client_t *user, sds nick)
+{
+    /*
+     * link_user_nick - Tell the network about the nick change of a user,
+     * before it is changed
+     *
+     * ctx: server context
+     *
+     * from_id: ID of the server the change came from, or -1 for a user of
+     * this server
+     *
+     * user: the user
+     *
+     * nick: the new nick
+     *
+     * Return: nothing
+     */
+    if (ctx->network == NULL)
+    {
+        return;
+    }
+
+    sds rest = sdscatprintf(sdsempty(), "NICK %s", nick);
+    sds line = link_line(user, false, rest);
+    sds compact = link_line(user, true, rest);
+
+    link_send(ctx, NULL, 0, from_id, line, compact);
+    sdsfree(compact);
+    sdsfree(line);
+    sdsfree(rest);
+}
+
+
+void link_user_quit(server_ctx *ctx, int from_id, client_t *user, sds *cmdtokens, int argc)
+{
+    /*
+     * link_user_quit - Tell the network a user quit, before it is freed
+     *
+     * ctx: server context
+     *
+     * from_id: ID of the server the QUIT came from, or -1 for a user of
+     * this server
+     *
+     * user: the user
+     *
+     * cmdtokens: "QUIT" and its message, if any
+     *
+     * argc: the count of tokens
+     *
+     * Return: nothing
+     */
+    if (ctx->network == NULL)
+    {
+        return;
+    }
+
+    trace_mutex_lock(&ctx->clients_lock, "clients_lock");
+    uid_remove(ctx, user);
+    pthread_mutex_unlock(&ctx->clients_lock);
+
+    sds text = argc > 1 ? link_trailing(cmdtokens, argc, 1) : sdsnew("Client Quit");
+    sds rest = sdscatprintf(sdsempty(), "QUIT :%s", text);
+    sds line = link_line(user, false, rest);
+    sds compact = link_line(user, true, rest);
+
+    link_send(ctx, NULL, 0, from_id, line, compact);
+    sdsfree(compact);
+    sdsfree(line);
+    sdsfree(rest);
+    sdsfree(text);
+}
+
+
+void link_user_channel(server_ctx *ctx, int from_id, client_t *user, sds *cmdtokens, int argc,
+                       sds channel_name)
+{
+    /*
+     * link_user_channel - Tell the network a user joined or left a channel
+     *
+     * ctx: server context
+     *
+     * from_id: ID of the server the JOIN or PART came from, or -1 for a
+     * user of this server
+     *
+     * user: the user
+     *
+     * cmdtokens: "JOIN" or "PART", the channels and, for PART, its message
+     *
+     * argc: the count of tokens
+     *
+     * channel_name: the channel joined or left
+     *
+     * Return: nothing
+     */
+    if (ctx->network == NULL)
+    {
+        return;
+    }
+
+    /* Every server keeps the members of every channel */
+    sds rest = sdscatprintf(sdsempty(), "%s %s", cmdtokens[0], channel_name);
+    if (!strncmp(cmdtokens[0], "PART", MAX_STR_LEN) && argc > 2)
+    {
+        sds text = link_trailing(cmdtokens, argc, 2);
+        rest = sdscatprintf(rest, " :%s", text);
+        sdsfree(text);
+    }
+    sds line = link_line(user, false, rest);
+    sds compact = link_line(user, true, rest);
+
+    link_send(ctx, NULL, 0, from_id, line, compact);
+    sdsfree(compact);
+    sdsfree(line);
+    sdsfree(rest);
+}
+
+
+void link_user_message(server_ctx *ctx, int from_id, client_t *user, sds *cmdtokens, int argc,
+                       msg_target_t *target)
+{
+    /*
+     * link_user_message - Forward a PRIVMSG or NOTICE to the servers of
+     * its recipients: every server for a channel, the server of the user
+     * for a nick
+     *
+     * ctx: server context
+     *
+     * from_id: ID of the server the message came from, or -1 for a user
+     * of this server
+     *
+     * user: the sender
+     *
+     * cmdtokens: "PRIVMSG" or "NOTICE", the targets and the text
+     *
+     * argc: the count of tokens
+     *
+     * target: one target, resolved by server_resolve_TARGETS
+     *
+     * Return: nothing
+     */
+    if (ctx->network == NULL)
+    {
+        return;
+    }
+
+    sds text = link_trailing(cmdtokens, argc, 2);
+
+    if (target->name[0] == '#')
+    {
+        sds rest = sdscatprintf(sdsempty(), "%s %s :%s", cmdtokens[0], target->name, text);
+        sds line = link_line(user, false, rest);
+        sds compact = link_line(user, true, rest);
+
+        link_send(ctx, NULL, 0, from_id, line, compact);
+        sdsfree(compact);
+        sdsfree(line);
+        sdsfree(rest);
+    }
+    else if (target->nsockets == 1 && target->sockets[0] < 0)
+    {
+        char uid[UID_STR_LEN + 1];
+        unsigned int dest = 0;
+
+        /* A user of another server */
+        trace_mutex_lock(&ctx->clients_lock, "clients_lock");
+        client_t *to = find_USER(target->sockets[0], &ctx->client_hashtable);
+        if (to != NULL)
+        {
+            dest = to->server->id;
+            uid_encode(to->uid, uid);
+        }
+        pthread_mutex_unlock(&ctx->clients_lock);
+
+        if (to != NULL)
+        {
+            sds rest = sdscatprintf(sdsempty(), "%s %s :%s", cmdtokens[0], target->name, text);
+            sds compact_rest = sdscatprintf(sdsempty(), "%s %s :%s", cmdtokens[0], uid, text);
+            sds line = link_line(user, false, rest);
+            sds compact = link_line(user, true, compact_rest);
+
+            link_send(ctx, &dest, 1, from_id, line, compact);
+            sdsfree(compact);
+            sdsfree(line);
+            sdsfree(compact_rest);
+            sdsfree(rest);
+        }
+    }
+    sdsfree(text);
+}
@@ -0,0 +1,253 @@
+#ifndef LINK_H_
+#define LINK_H_
+
+#include <stdbool.h>
+#include "server.h"
+#include "server_cmd.h"
+#include "network.h"
+#include "compress.h"
+#include "../lib/sds/sds.h"
+
+#define LINK_VERSION "0210"     /* Protocol version sent in PASS (RFC 2813) */
+#define LINK_UID_FLAG 'U'       /* PASS option flag asking for the compact form of messages */
+#define LINK_INFO "chirc server" /* Info sent in SERVER */
+
+/*
+ * Server links. Servers of a network only link along the spanning tree
+ * of the network file (network.h): a server registers a link with its
+ * parent and its children, and refuses any other. Every message about a
+ * user or a channel is sent on the links given by network_downstream and
+ * forwarded by each server on its other links, so it reaches each server
+ * of the network once.
+ *
+ * Users of other servers are kept in the clients hashtable like the
+ * users of this server, under a negative key that no socket has, with
+ * the server they are connected to. Sending to them sends nothing:
+ * what they must get is forwarded on the link towards their server.
+ *
+ * Both ends of a link send LINK_UID_FLAG in the options of PASS. When
+ * both did, users are named by their UID (network.h) rather than their
+ * nick in the prefix and the target of the messages: it is looked up
+ * in a table of fixed-size keys, and a nick change does not race with
+ * the messages already on their way. Channels are still named, as two
+ * servers can create the same channel at once.
+ *
+ * With -z, a server also sends LINK_COMPRESS_FLAG, and a link is
+ * compressed with zlib when both ends did. Everything after the SERVER
+ * of each end is compressed. The end that registered the link sends
+ * nothing more until the first compressed command of the other end
+ * comes in, so no read takes in plain and compressed bytes at once.
+ */
+
+/* A connection that sent PASS or SERVER, or was opened by CONNECT */
+typedef struct link
+{
+    int socket;             /* The connection */
+    irc_server_t *server;   /* Server at the other end: from SERVER once registered, or the one connected to */
+    sds servername;         /* Name it gave in SERVER, NULL until then */
+    sds passwd;             /* Password it gave in PASS, NULL until then */
+    sds options;            /* Options it gave in PASS, e.g. "chirc|U" */
+    bool outgoing;          /* Opened by CONNECT: PASS and SERVER were sent first */
+    bool registered;        /* In ctx->links, relaying */
+    bool uids;              /* Users are named by their UID on it */
+    bool lost;              /* Its end of input was seen and its SQUIT run */
+    bool waiting;           /* Registered and compressed, nothing sent until the other end sends */
+    link_zstream_t *z;      /* Streams of a compressed link, NULL for plain text */
+} link_t;
+
+/*
+ * link_request - Run a command received on a server link, or the PASS or
+ * SERVER starting one (then conn->link is set)
+ *
+ * ctx: server context
+ *
+ * cmdtokens: the command, with the prefix of the sender, if any
+ *
+ * argc: the count of tokens
+ *
+ * conn: the connection
+ *
+ * Return: CHIRC_OK/CHIRC_ERROR
+ */
+int link_request(server_ctx *ctx, sds *cmdtokens, int argc, conn_info_t *conn);
+
+/*
+ * link_user_hello - Give up the link state of a connection that sent
+ * PASS and then registers as a user with NICK or USER
+ *
+ * conn: the connection, with conn->link set
+ *
+ * cmd: the command received
+ *
+ * Return: true if the connection is a user after all and the command is
+ * to be run as a user's
+ */
+bool link_user_hello(conn_info_t *conn, sds cmd);
+
+/*
+ * link_connect - Open a server link to a neighbor on the spanning tree,
+ * for CONNECT. PASS and SERVER are sent and the link is registered once
+ * the other end sends its own.
+ *
+ * ctx: server context
+ *
+ * conn: the connection of the IRC operator
+ *
+ * user: the IRC operator
+ *
+ * cmdtokens: "CONNECT", the servername and an optional port
+ *
+ * argc: the count of tokens
+ *
+ * Return: CHIRC_OK/CHIRC_ERROR
+ */
+int link_connect(server_ctx *ctx, conn_info_t *conn, client_t *user, sds *cmdtokens, int argc);
+
+/*
+ * link_eof - The command taking down a registered server link whose input
+ * ended, to be run after the commands it sent before
+ *
+ * conn: the connection
+ *
+ * Return: the SQUIT of the server at the other end, or NULL if the
+ * connection is not a registered link or it was taken down already
+ */
+sds link_eof(conn_info_t *conn);
+
+/*
+ * link_input - Take in bytes received on a connection that may be a
+ * server link: decompress them if the link is compressed, and append
+ * them to the cmd stack (called by the thread reading the connection)
+ *
+ * conn: the connection
+ *
+ * data: the bytes received
+ *
+ * len: number of bytes
+ *
+ * Return: CHIRC_OK, or CHIRC_ERROR if the compressed stream is corrupt:
+ * the connection is to be closed
+ */
+int link_input(conn_info_t *conn, const char *data, int len);
+
+/*
+ * link_flush - Send what the compressed links hold back in batch mode
+ * (-Z batch), once a run of commands is done
+ *
+ * ctx: server context
+ *
+ * Return: nothing
+ */
+void link_flush(server_ctx *ctx);
+
+/*
+ * link_free - Free the link state of a connection once it is closed
+ *
+ * link: the link, may be NULL
+ *
+ * Return: nothing
+ */
+void link_free(link_t *link);
+
+/*
+ * link_cleanup - Free the links table and the UIDs of the users when the
+ * server exits
+ *
+ * ctx: server context
+ *
+ * Return: nothing
+ */
+void link_cleanup(server_ctx *ctx);
+
+/*
+ * link_user_new - Tell the network about a user of this server that just
+ * registered
+ *
+ * ctx: server context
+ *
+ * user: the user
+ *
+ * Return: nothing
+ */
+void link_user_new(server_ctx *ctx, client_t *user);
+
+/*
+ * link_user_nick - Tell the network about the nick change of a user,
+ * before it is changed
+ *
+ * ctx: server context
+ *
+ * from_id: ID of the server the change came from, or -1 for a user of
+ * this server
+ *
+ * user: the user
+ *
+ * nick: the new nick
+ *
+ * Return: nothing
+ */
+void link_user_nick(server_ctx *ctx, int from_id, client_t *user, sds nick);
+
+/*
+ * link_user_quit - Tell the network a user quit, before it is freed
+ *
+ * ctx: server context
+ *
+ * from_id: ID of the server the QUIT came from, or -1 for a user of this
+ * server
+ *
+ * user: the user
+ *
+ * cmdtokens: "QUIT" and its message, if any
+ *
+ * argc: the count of tokens
+ *
+ * Return: nothing
+ */
+void link_user_quit(server_ctx *ctx, int from_id, client_t *user, sds *cmdtokens, int argc);
+
+/*
+ * link_user_channel - Tell the network a user joined or left a channel
+ *
+ * ctx: server context
+ *
+ * from_id: ID of the server the JOIN or PART came from, or -1 for a user
+ * of this server
+ *
+ * user: the user
+ *
+ * cmdtokens: "JOIN" or "PART", the channels and, for PART, its message
+ *
+ * argc: the count of tokens
+ *
+ * channel_name: the channel joined or left
+ *
+ * Return: nothing
+ */
+void link_user_channel(server_ctx *ctx, int from_id, client_t *user, sds *cmdtokens, int argc,
+                       sds channel_name);
+
+/*
+ * link_user_message - Forward a PRIVMSG or NOTICE to the servers of its
+ * recipients: every server for a channel, the server of the user for a
+ * nick
+ *
+ * ctx: server context
+ *
+ * from_id: ID of the server the message came from, or -1 for a user of
+ * this server
+ *
+ * user: the sender
+ *
+ * cmdtokens: "PRIVMSG" or "NOTICE", the targets and the text
+ *
+ * argc: the count of tokens
+ *
+ * target: one target, resolved by server_resolve_TARGETS
+ *
+ * Return: nothing
+ */
+void link_user_message(server_ctx *ctx, int from_id, client_t *user, sds *cmdtokens, int argc,
+                       msg_target_t *target);
+
+#endif
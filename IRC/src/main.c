@@ -55,27 +55,46 @@
 #include "log.h"
 #include "reply.h"
 #include "server.h"
+#include "upgrade.h"
+#include "pool.h"
+#include "shard.h"
+#include "trace.h"
 
 #include "channels.h"
 #include "../lib/sds/sds.h"
 
+#define DEFAULT_PORT "6667"
+
 int main(int argc, char *argv[])
 {
     int opt;
-    char *port = "6667", *passwd = NULL, *servername = NULL, *network_file = NULL;
+    long long history_max_bytes = DEFAULT_HISTORY_BYTES;
+    server_config config = {
+        .port = NULL, .passwd = NULL, .servername = NULL, .network_file = NULL,
+        .stats_socket = NULL, .upgrade_socket = NULL, .persist_file = NULL,
+        .workers = 0, .io_threads = 1, .uring = false, .shards = 0,
+        .max_targets = DEFAULT_MAXTARGETS, .history_lines = 0,
+        .tls_port = NULL, .tls_cert = NULL, .tls_key = NULL, .ktls = false,
+        .capture_file = NULL, .trace_socket = NULL, .trace_rate = TRACE_DEFAULT_RATE,
+        .backlog = DEFAULT_BACKLOG, .link_compress = -1, .link_flush = LINK_FLUSH_SYNC,
+    };
+    bool link_flush_set = false;
     int verbosity = 0;
 
-    while ((opt = getopt(argc, argv, "p:o:s:n:vqh")) != -1)
+    /* Kept for SIGUSR2, which starts the same command line again */
+    upgrade_save_argv(argc, argv);
+
+    while ((opt = getopt(argc, argv, "p:o:s:n:S:u:P:w:i:B:c:t:H:M:T:C:K:kR:X:x:b:z:Z:vqh")) != -1)
         switch (opt)
         {
         case 'p':
-            port = strdup(optarg);
+            config.port = strdup(optarg);
             break;
         case 'o':
-            passwd = strdup(optarg);
+            config.passwd = strdup(optarg);
             break;
         case 's':
-            servername = strdup(optarg);
+            config.servername = strdup(optarg);
             break;
         case 'n':
             if (access(optarg, R_OK) == -1)
@@ -83,7 +102,139 @@ int main(int argc, char *argv[])
                 printf("ERROR: No such file: %s\n", optarg);
                 exit(-1);
             }
-            network_file = strdup(optarg);
+            config.network_file = strdup(optarg);
+            break;
+        case 'S':
+            config.stats_socket = strdup(optarg);
+            break;
+        case 'u':
+            config.upgrade_socket = strdup(optarg);
+            break;
+        case 'P':
+            config.persist_file = strdup(optarg);
+            break;
+        case 'w':
+            config.workers = atoi(optarg);
+            if (config.workers < 1 || config.workers > POOL_MAX_THREADS)
+            {
+                fprintf(stderr, "ERROR: WORKERS must be between 1 and %d\n", POOL_MAX_THREADS);
+                exit(-1);
+            }
+            break;
+        case 'i':
+            config.io_threads = atoi(optarg);
+            if (config.io_threads < 1 || config.io_threads > POOL_MAX_THREADS)
+            {
+                fprintf(stderr, "ERROR: IO_THREADS must be between 1 and %d\n", POOL_MAX_THREADS);
+                exit(-1);
+            }
+            break;
+        case 'B':
+            if (!strcmp(optarg, "uring"))
+            {
+                config.uring = true;
+            }
+            else if (strcmp(optarg, "epoll"))
+            {
+                fprintf(stderr, "ERROR: BACKEND must be epoll or uring\n");
+                exit(-1);
+            }
+            break;
+        case 'c':
+            config.shards = atoi(optarg);
+            if (config.shards < 1 || config.shards > SHARD_MAX)
+            {
+                fprintf(stderr, "ERROR: SHARDS must be between 1 and %d\n", SHARD_MAX);
+                exit(-1);
+            }
+            break;
+        case 't':
+            config.max_targets = atoi(optarg);
+            if (config.max_targets < 1)
+            {
+                fprintf(stderr, "ERROR: MAXTARGETS must be at least 1\n");
+                exit(-1);
+            }
+            break;
+        case 'H':
+            config.history_lines = atoi(optarg);
+            if (config.history_lines < 0)
+            {
+                fprintf(stderr, "ERROR: HISTORY_LINES cannot be negative\n");
+                exit(-1);
+            }
+            break;
+        case 'M':
+            history_max_bytes = atoll(optarg);
+            if (history_max_bytes < 1)
+            {
+                fprintf(stderr, "ERROR: HISTORY_BYTES must be at least 1\n");
+                exit(-1);
+            }
+            break;
+        case 'T':
+            config.tls_port = strdup(optarg);
+            break;
+        case 'C':
+        case 'K':
+            if (access(optarg, R_OK) == -1)
+            {
+                printf("ERROR: No such file: %s\n", optarg);
+                exit(-1);
+            }
+            if (opt == 'C')
+            {
+                config.tls_cert = strdup(optarg);
+            }
+            else
+            {
+                config.tls_key = strdup(optarg);
+            }
+            break;
+        case 'k':
+            config.ktls = true;
+            break;
+        case 'R':
+            config.capture_file = strdup(optarg);
+            break;
+        case 'X':
+            config.trace_socket = strdup(optarg);
+            break;
+        case 'x':
+            config.trace_rate = atoi(optarg);
+            if (config.trace_rate < 1)
+            {
+                fprintf(stderr, "ERROR: TRACE_RATE must be at least 1\n");
+                exit(-1);
+            }
+            break;
+        case 'b':
+            config.backlog = atoi(optarg);
+            if (config.backlog < 1)
+            {
+                fprintf(stderr, "ERROR: BACKLOG must be at least 1\n");
+                exit(-1);
+            }
+            break;
+        case 'z':
+            config.link_compress = atoi(optarg);
+            if (config.link_compress < 0 || config.link_compress > 9)
+            {
+                fprintf(stderr, "ERROR: LINK_LEVEL must be between 0 and 9\n");
+                exit(-1);
+            }
+            break;
+        case 'Z':
+            if (!strcmp(optarg, "batch"))
+            {
+                config.link_flush = LINK_FLUSH_BATCH;
+            }
+            else if (strcmp(optarg, "sync"))
+            {
+                fprintf(stderr, "ERROR: LINK_FLUSH must be sync or batch\n");
+                exit(-1);
+            }
+            link_flush_set = true;
             break;
         case 'v':
             verbosity++;
@@ -92,7 +243,7 @@ int main(int argc, char *argv[])
             verbosity = -1;
             break;
         case 'h':
-            printf("Usage: chirc -o OPER_PASSWD [-p PORT] [-s SERVERNAME] [-n NETWORK_FILE] [(-q|-v|-vv)]\n");
+            printf("Usage: chirc -o OPER_PASSWD [-p PORT] [-s SERVERNAME] [-n NETWORK_FILE] [-S STATS_SOCKET] [-u UPGRADE_SOCKET] [-P SNAPSHOT_FILE] [-w WORKERS [-i IO_THREADS] [-B epoll|uring] [-c SHARDS]] [-t MAXTARGETS] [-H HISTORY_LINES] [-M HISTORY_BYTES] [-T TLS_PORT -C CERT_FILE -K KEY_FILE [-k]] [-R CAPTURE_FILE] [-X TRACE_SOCKET [-x TRACE_RATE]] [-b BACKLOG] [-z LINK_LEVEL [-Z sync|batch]] [(-q|-v|-vv)]\n");
             exit(0);
             break;
         default:
@@ -100,18 +251,54 @@ int main(int argc, char *argv[])
             exit(-1);
         }
 
-    if (!passwd)
+    if (!config.passwd)
     {
         fprintf(stderr, "ERROR: You must specify an operator password\n");
         exit(-1);
     }
 
-    if (network_file && !servername)
+    if (config.shards > 0 && config.workers == 0)
+    {
+        fprintf(stderr, "ERROR: Channel shards (-c) need split mode (-w)\n");
+        exit(-1);
+    }
+
+    if (config.tls_port && (!config.tls_cert || !config.tls_key))
+    {
+        fprintf(stderr, "ERROR: A TLS port (-T) needs a certificate (-C) and a key (-K)\n");
+        exit(-1);
+    }
+
+    if (config.network_file && !config.servername)
     {
         fprintf(stderr, "ERROR: If specifying a network file, you must also specify a server name.\n");
         exit(-1);
     }
 
+    if (config.link_compress >= 0 && !config.network_file)
+    {
+        fprintf(stderr, "ERROR: Link compression (-z) needs a network file (-n)\n");
+        exit(-1);
+    }
+
+    if (link_flush_set && config.link_compress < 0)
+    {
+        fprintf(stderr, "ERROR: A link flush mode (-Z) needs a compression level (-z)\n");
+        exit(-1);
+    }
+
+    if (config.network_file && config.upgrade_socket)
+    {
+        fprintf(stderr, "ERROR: A live upgrade (-u) cannot hand over server links (-n)\n");
+        exit(-1);
+    }
+
+    if (config.network_file && config.shards > 0)
+    {
+        fprintf(stderr, "ERROR: Channel shards (-c) cannot take commands from server links (-n)\n");
+        exit(-1);
+    }
+
     /* Set logging level based on verbosity */
     switch (verbosity)
     {
@@ -132,23 +319,61 @@ int main(int argc, char *argv[])
         break;
     }
     
-    server(port, passwd, servername, network_file);
+    if (config.port == NULL)
+    {
+        config.port = strdup(DEFAULT_PORT);
+    }
+    config.history_max_bytes = (size_t)history_max_bytes;
+
+    int rc = server(&config);
 
-    if (port != NULL)
+    if (config.port != NULL)
+    {
+        free(config.port);
+    }
+    if (config.passwd != NULL)
+    {
+        free(config.passwd);
+    }
+    if (config.servername != NULL)
+    {
+        free(config.servername);
+    }
+    if (config.network_file != NULL)
+    {
+        free(config.network_file);
+    }
+    if (config.stats_socket != NULL)
+    {
+        free(config.stats_socket);
+    }
+    if (config.upgrade_socket != NULL)
+    {
+        free(config.upgrade_socket);
+    }
+    if (config.persist_file != NULL)
+    {
+        free(config.persist_file);
+    }
+    if (config.tls_port != NULL)
+    {
+        free(config.tls_port);
+    }
+    if (config.tls_cert != NULL)
     {
-        free(port);
+        free(config.tls_cert);
     }
-    if (passwd != NULL)
+    if (config.tls_key != NULL)
     {
-        free(passwd);
+        free(config.tls_key);
     }
-    if (servername != NULL)
+    if (config.capture_file != NULL)
     {
-        free(servername);
+        free(config.capture_file);
     }
-    if (network_file != NULL)
+    if (config.trace_socket != NULL)
     {
-        free(network_file);
+        free(config.trace_socket);
     }
-    return 0;
+    return rc;
 }
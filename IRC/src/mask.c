@@ -0,0 +1,195 @@
+#include <string.h>
+#include <ctype.h>
+#include "mask.h"
+#include "../lib/sds/sds.h"
+
+
+/*
+ * glob_range - Case-insensitive glob match of str[0..str_end) against
+ * pattern[0..pattern_end), iterative with backtracking to the last '*'.
+ * The pattern is already lower-cased.
+ */
+static bool glob_range(const char *pattern, const char *pattern_end,
+                       const char *str, const char *str_end)
+{
+    const char *star = NULL, *resume = NULL;
+
+    while (str < str_end)
+    {
+        if (pattern < pattern_end && *pattern == '*')
+        {
+            star = pattern++;
+            resume = str;
+        }
+        else if (pattern < pattern_end &&
+                 (*pattern == '?' || *pattern == tolower((unsigned char)*str)))
+        {
+            pattern++;
+            str++;
+        }
+        else if (star != NULL)
+        {
+            pattern = star + 1;
+            str = ++resume;
+        }
+        else
+        {
+            return false;
+        }
+    }
+    while (pattern < pattern_end && *pattern == '*')
+    {
+        pattern++;
+    }
+
+    return pattern == pattern_end;
+}
+
+
+/* Case-insensitive comparison of len characters against lower-cased literal text */
+static bool literal_equal(const char *lower, const char *str, size_t len)
+{
+    for (size_t i = 0; i < len; i++)
+    {
+        if (lower[i] != tolower((unsigned char)str[i]))
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+
+/* Whether lower-cased literal text of len characters occurs in str[0..str_end) */
+static bool literal_find(const char *lower, size_t len, const char *str, const char *str_end)
+{
+    for (; str + len <= str_end; str++)
+    {
+        if (*lower == tolower((unsigned char)*str) && literal_equal(lower, str, len))
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+
+void mask_compile(mask_t *mask, const char *pattern)
+{
+    /*
+     * mask_compile - Compile a mask
+     *
+     * mask: output, to be freed with mask_free
+     *
+     * pattern: the mask, matched case-insensitively
+     *
+     * Return: nothing
+     */
+    size_t len = strlen(pattern);
+    const char *first = strpbrk(pattern, "*?");
+
+    mask->pattern = sdsnewlen(pattern, len);
+    sdstolower(mask->pattern);
+    mask->min_len = 0;
+    for (size_t i = 0; i < len; i++)
+    {
+        if (pattern[i] != '*')
+        {
+            mask->min_len++;
+        }
+    }
+
+    mask->infix_off = 0;
+    mask->infix_len = 0;
+    mask->literal = (first == NULL);
+    mask->any = (len > 0 && mask->min_len == 0);
+    if (mask->literal)
+    {
+        mask->prefix_len = len;
+        mask->suffix_len = 0;
+        return;
+    }
+
+    mask->prefix_len = first - pattern;
+    mask->suffix_len = 0;
+    while (pattern[len - 1 - mask->suffix_len] != '*' &&
+           pattern[len - 1 - mask->suffix_len] != '?')
+    {
+        mask->suffix_len++;
+    }
+
+    for (size_t i = mask->prefix_len, run = 0; i < len - mask->suffix_len; i++)
+    {
+        run = (pattern[i] == '*' || pattern[i] == '?') ? 0 : run + 1;
+        if (run > mask->infix_len)
+        {
+            mask->infix_off = i + 1 - run;
+            mask->infix_len = run;
+        }
+    }
+}
+
+
+bool mask_match(const mask_t *mask, const char *str)
+{
+    /*
+     * mask_match - Match a string against a compiled mask. The length and
+     * the literal prefix and suffix reject most strings before the glob runs.
+     *
+     * mask: the mask
+     *
+     * str: the string
+     *
+     * Return: true if the string matches
+     */
+    if (mask->any)
+    {
+        return true;
+    }
+
+    size_t len = strlen(str);
+    if (len < mask->min_len)
+    {
+        return false;
+    }
+    if (mask->literal)
+    {
+        return len == mask->min_len && literal_equal(mask->pattern, str, len);
+    }
+    if (!literal_equal(mask->pattern, str, mask->prefix_len))
+    {
+        return false;
+    }
+
+    size_t pattern_len = sdslen(mask->pattern);
+    if (!literal_equal(mask->pattern + pattern_len - mask->suffix_len,
+                       str + len - mask->suffix_len, mask->suffix_len))
+    {
+        return false;
+    }
+
+    /* min_len counts the prefix and the suffix, so they do not overlap */
+    const char *start = str + mask->prefix_len, *end = str + len - mask->suffix_len;
+    if (mask->infix_len > 0 &&
+        !literal_find(mask->pattern + mask->infix_off, mask->infix_len, start, end))
+    {
+        return false;
+    }
+
+    return glob_range(mask->pattern + mask->prefix_len,
+                      mask->pattern + pattern_len - mask->suffix_len, start, end);
+}
+
+
+void mask_free(mask_t *mask)
+{
+    /*
+     * mask_free - Free the strings of a compiled mask
+     *
+     * mask: the mask
+     *
+     * Return: nothing
+     */
+    sdsfree(mask->pattern);
+    mask->pattern = NULL;
+}
@@ -0,0 +1,56 @@
+#ifndef MASK_H_
+#define MASK_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include "../lib/sds/sds.h"
+
+/* A '*' and '?' wildcard mask, compiled once and matched against many
+ * strings. Most masks start or end with literal text ("nick*", "*.edu"),
+ * so a string is first checked against its length and the literal prefix
+ * and suffix, then searched for the longest literal run in between, and
+ * the glob only runs on strings that pass all three. */
+typedef struct mask
+{
+    sds pattern;        /* The mask, lower-cased */
+    size_t prefix_len;  /* Literal characters before the first wildcard */
+    size_t suffix_len;  /* Literal characters after the last wildcard */
+    size_t infix_off;   /* Longest literal run between the wildcards */
+    size_t infix_len;
+    size_t min_len;     /* Shortest string that can match */
+    bool literal;       /* No wildcard at all */
+    bool any;           /* Only '*': everything matches */
+} mask_t;
+
+/*
+ * mask_compile - Compile a mask
+ *
+ * mask: output, to be freed with mask_free
+ *
+ * pattern: the mask, matched case-insensitively
+ *
+ * Return: nothing
+ */
+void mask_compile(mask_t *mask, const char *pattern);
+
+/*
+ * mask_match - Match a string against a compiled mask
+ *
+ * mask: the mask
+ *
+ * str: the string
+ *
+ * Return: true if the string matches
+ */
+bool mask_match(const mask_t *mask, const char *str);
+
+/*
+ * mask_free - Free the strings of a compiled mask
+ *
+ * mask: the mask
+ *
+ * Return: nothing
+ */
+void mask_free(mask_t *mask);
+
+#endif
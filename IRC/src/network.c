@@ -0,0 +1,350 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include "network.h"
+#include "reply.h"
+#include "log.h"
+#include "../lib/uthash.h"
+#include "../lib/sds/sds.h"
+
+static const char uid_digits[] = "0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZ";
+
+
+/*
+ * add_server - Append a server to the network (Not thread-safe)
+ *
+ * net: the network
+ *
+ * fields: servername, hostname, port, passwd
+ *
+ * Return: CHIRC_OK/CHIRC_ERROR
+ */
+static int add_server(network_t *net, sds *fields)
+{
+    irc_server_t *server;
+
+    if (net->num_servers >= NETWORK_MAX_SERVERS)
+    {
+        chilog(ERROR, "Network file lists more than %d servers", NETWORK_MAX_SERVERS);
+        return CHIRC_ERROR;
+    }
+
+    if (find_SERVER(fields[0], &net->servers_hashtable) != NULL)
+    {
+        chilog(ERROR, "Server %s listed twice in network file", fields[0]);
+        return CHIRC_ERROR;
+    }
+
+    server = calloc(1, sizeof(irc_server_t));
+    server->servername = sdsdup(fields[0]);
+    server->hostname = sdsdup(fields[1]);
+    server->port = sdsdup(fields[2]);
+    server->passwd = sdsdup(fields[3]);
+    server->id = net->num_servers;
+
+    /* The spanning tree is laid out like a binary heap over the order
+     * of the network file, so every server computes the same tree and
+     * any server is at most log2(n) hops from the root. */
+    server->parent = server->id == 0 ? -1 : (int)(server->id - 1) / 2;
+
+    net->servers = realloc(net->servers, (net->num_servers + 1) * sizeof(irc_server_t *));
+    net->servers[net->num_servers++] = server;
+    HASH_ADD_KEYPTR(hh, net->servers_hashtable, server->servername,
+                    sdslen(server->servername), server);
+
+    return CHIRC_OK;
+}
+
+
+network_t *network_load(char *network_file, char *servername)
+{
+    /*
+     * network_load - Parse the network file and compute the spanning tree
+     *
+     * network_file: path of the network file, one "servername,hostname,port,passwd"
+     * entry per line
+     *
+     * servername: the name of this server, must appear in the network file
+     *
+     * Return: the parsed network, or NULL if the file is malformed or does
+     * not list servername.
+     */
+    FILE *f = fopen(network_file, "r");
+    char *line = NULL;
+    size_t linecap = 0;
+    int lineno = 0;
+
+    if (f == NULL)
+    {
+        chilog(ERROR, "Could not open network file %s", network_file);
+        return NULL;
+    }
+
+    network_t *net = calloc(1, sizeof(network_t));
+
+    while (getline(&line, &linecap, f) != -1)
+    {
+        int count;
+        sds entry = sdstrim(sdsnew(line), " \t\r\n");
+        lineno++;
+
+        if (sdslen(entry) == 0)
+        {
+            sdsfree(entry);
+            continue;
+        }
+
+        sds *fields = sdssplitlen(entry, sdslen(entry), ",", 1, &count);
+        sdsfree(entry);
+
+        if (count != NETWORK_FIELDS || add_server(net, fields) == CHIRC_ERROR)
+        {
+            chilog(ERROR, "Malformed entry on line %d of network file", lineno);
+            sdsfreesplitres(fields, count);
+            free(line);
+            fclose(f);
+            network_free(net);
+            return NULL;
+        }
+        sdsfreesplitres(fields, count);
+    }
+    free(line);
+    fclose(f);
+
+    net->self = find_SERVER(servername, &net->servers_hashtable);
+    if (net->self == NULL)
+    {
+        chilog(ERROR, "Server %s is not listed in network file", servername);
+        network_free(net);
+        return NULL;
+    }
+
+    chilog(DEBUG, "Loaded %u servers, this server has ID %u and parent %d",
+           net->num_servers, net->self->id, net->self->parent);
+
+    return net;
+}
+
+
+void network_free(network_t *net)
+{
+    /*
+     * network_free - Free a network returned by network_load
+     *
+     * net: the network to be freed
+     *
+     * Return: nothing
+     */
+    irc_server_t *server, *tmp;
+
+    if (net == NULL)
+    {
+        return;
+    }
+
+    HASH_ITER(hh, net->servers_hashtable, server, tmp)
+    {
+        HASH_DEL(net->servers_hashtable, server);
+        sdsfree(server->servername);
+        sdsfree(server->hostname);
+        sdsfree(server->port);
+        sdsfree(server->passwd);
+        free(server);
+    }
+    free(net->servers);
+    free(net);
+}
+
+
+irc_server_t *find_SERVER(char *servername, irc_server_t **servers)
+{
+    /*
+     * find_SERVER - Find a server in the network by name (Not thread-safe,
+     * but the network is read-only after network_load)
+     *
+     * servername: the name of the server you want to search as key
+     *
+     * servers: servers hashtable of the network
+     *
+     * Return: The searched irc_server_t pointer or NULL if not exists.
+     */
+    irc_server_t *server = NULL;
+    HASH_FIND_STR(*servers, servername, server);
+    return server;
+}
+
+
+int network_next_hop(network_t *net, unsigned int dest_id)
+{
+    /*
+     * network_next_hop - Find the neighbour of this server on the spanning
+     * tree path towards another server
+     *
+     * net: the network
+     *
+     * dest_id: numeric ID of the destination server
+     *
+     * Return: the ID of the neighbour to forward to, or -1 if dest_id is
+     * this server or not a valid server ID.
+     */
+    int self_id = net->self->id;
+    int node = dest_id;
+
+    if (dest_id >= net->num_servers || node == self_id)
+    {
+        return -1;
+    }
+
+    /* Walk up from the destination: if we pass through this server,
+     * the destination is in our subtree and the node we came from is
+     * the child to forward to. Otherwise it is reached via our parent. */
+    while (net->servers[node]->parent != -1)
+    {
+        if (net->servers[node]->parent == self_id)
+        {
+            return node;
+        }
+        node = net->servers[node]->parent;
+    }
+
+    return net->self->parent;
+}
+
+
+int network_downstream(network_t *net, unsigned int *dest_ids, int ndest,
+                       int from_id, unsigned int *hops)
+{
+    /*
+     * network_downstream - Compute the set of links a message must be sent
+     * on to reach a set of servers.
+     *
+     * net: the network
+     *
+     * dest_ids: numeric IDs of the destination servers (may repeat)
+     *
+     * ndest: number of entries in dest_ids
+     *
+     * from_id: ID of the neighbour the message arrived from, or -1
+     *
+     * hops: output array, must have room for net->num_servers entries
+     *
+     * Return: the number of links written to hops.
+     */
+    int nhops = 0;
+    bool *seen = calloc(net->num_servers, sizeof(bool));
+
+    for (int i = 0; i < ndest; i++)
+    {
+        int hop = network_next_hop(net, dest_ids[i]);
+
+        if (hop == -1 || hop == from_id || seen[hop])
+        {
+            continue;
+        }
+        seen[hop] = true;
+        hops[nhops++] = hop;
+    }
+    free(seen);
+
+    return nhops;
+}
+
+
+uint64_t uid_make(unsigned int server_id, uint32_t counter)
+{
+    /*
+     * uid_make - Build a network-wide ID for a user or channel
+     *
+     * server_id: numeric ID of the origin server
+     *
+     * counter: value of the origin server's local counter
+     *
+     * Return: the 64-bit ID
+     */
+    return ((uint64_t)server_id << UID_SERVER_SHIFT) | counter;
+}
+
+
+unsigned int uid_server(uint64_t uid)
+{
+    /*
+     * uid_server - Return the numeric ID of the server that assigned an ID
+     *
+     * uid: the ID
+     *
+     * Return: origin server ID
+     */
+    return (unsigned int)(uid >> UID_SERVER_SHIFT);
+}
+
+
+void uid_encode(uint64_t uid, char *buf)
+{
+    /*
+     * uid_encode - Write the compact wire form of an ID: the origin server
+     * in two base-36 digits followed by the counter in seven.
+     *
+     * uid: the ID
+     *
+     * buf: output buffer of at least UID_STR_LEN + 1 bytes
+     *
+     * Return: nothing
+     */
+    uint64_t server_id = uid_server(uid);
+    uint64_t counter = uid & 0xFFFFFFFFULL;
+
+    for (int i = 8; i >= 2; i--)
+    {
+        buf[i] = uid_digits[counter % 36];
+        counter /= 36;
+    }
+    buf[1] = uid_digits[server_id % 36];
+    buf[0] = uid_digits[(server_id / 36) % 36];
+    buf[UID_STR_LEN] = '\0';
+}
+
+
+int uid_decode(const char *s, uint64_t *uid)
+{
+    /*
+     * uid_decode - Parse the compact wire form of an ID
+     *
+     * s: string of exactly UID_STR_LEN base-36 digits
+     *
+     * uid: output ID
+     *
+     * Return: CHIRC_OK/CHIRC_ERROR
+     */
+    uint64_t server_id = 0, counter = 0;
+
+    if (strlen(s) != UID_STR_LEN)
+    {
+        return CHIRC_ERROR;
+    }
+
+    for (int i = 0; i < UID_STR_LEN; i++)
+    {
+        const char *digit = strchr(uid_digits, s[i]);
+        if (s[i] == '\0' || digit == NULL)
+        {
+            return CHIRC_ERROR;
+        }
+        if (i < 2)
+        {
+            server_id = server_id * 36 + (digit - uid_digits);
+        }
+        else
+        {
+            counter = counter * 36 + (digit - uid_digits);
+        }
+    }
+
+    if (counter > 0xFFFFFFFFULL)
+    {
+        return CHIRC_ERROR;
+    }
+
+    *uid = uid_make(server_id, counter);
+    return CHIRC_OK;
+}
@@ -0,0 +1,150 @@
+#ifndef NETWORK_H_
+#define NETWORK_H_
+
+#include <stdint.h>
+#include "../lib/uthash.h"
+#include "../lib/sds/sds.h"
+
+#define NETWORK_MAX_SERVERS 1296 /* 36^2: server part of a UID is two base-36 digits */
+#define NETWORK_FIELDS 4         /* servername,hostname,port,passwd */
+#define UID_STR_LEN 9            /* 2 digits of server ID + 7 digits of local counter */
+#define UID_SERVER_SHIFT 32
+
+/*
+ * A server listed in the network file. Every server in the network
+ * parses the same file, so the numeric ID (the line number of the
+ * server in the file) and the spanning tree computed from it are
+ * identical on every server without having to negotiate them.
+ */
+typedef struct irc_server
+{
+    sds servername;    /* Key for servers hashtable */
+    sds hostname;      /* Hostname the server listens on */
+    sds port;          /* Port the server listens on */
+    sds passwd;        /* Password for PASS on a link to this server */
+    unsigned int id;   /* Numeric server ID, assigned by network file order */
+    int parent;        /* ID of the parent in the spanning tree, -1 for the root */
+    UT_hash_handle hh;
+} irc_server_t;
+
+typedef struct network
+{
+    irc_server_t *servers_hashtable; /* Servers keyed by servername */
+    irc_server_t **servers;          /* Servers indexed by numeric ID */
+    unsigned int num_servers;        /* Number of servers in the network file */
+    irc_server_t *self;              /* Entry of this server */
+} network_t;
+
+/*
+ * network_load - Parse the network file and compute the spanning tree
+ *
+ * network_file: path of the network file, one "servername,hostname,port,passwd"
+ * entry per line
+ *
+ * servername: the name of this server, must appear in the network file
+ *
+ * Return: the parsed network, or NULL if the file is malformed or does
+ * not list servername.
+ */
+network_t *network_load(char *network_file, char *servername);
+
+/*
+ * network_free - Free a network returned by network_load
+ *
+ * net: the network to be freed
+ *
+ * Return: nothing
+ */
+void network_free(network_t *net);
+
+/*
+ * find_SERVER - Find a server in the network by name (Not thread-safe,
+ * but the network is read-only after network_load)
+ *
+ * servername: the name of the server you want to search as key
+ *
+ * servers: servers hashtable of the network
+ *
+ * Return: The searched irc_server_t pointer or NULL if not exists.
+ */
+irc_server_t *find_SERVER(char *servername, irc_server_t **servers);
+
+/*
+ * network_next_hop - Find the neighbour of this server on the spanning
+ * tree path towards another server
+ *
+ * net: the network
+ *
+ * dest_id: numeric ID of the destination server
+ *
+ * Return: the ID of the neighbour to forward to, or -1 if dest_id is
+ * this server or not a valid server ID.
+ */
+int network_next_hop(network_t *net, unsigned int dest_id);
+
+/*
+ * network_downstream - Compute the set of links a message must be sent
+ * on to reach a set of servers, e.g. the servers with members in a channel.
+ *
+ * Each link appears at most once in the result no matter how many of the
+ * destinations are behind it, so a message is sent once per link.
+ *
+ * net: the network
+ *
+ * dest_ids: numeric IDs of the destination servers (may repeat)
+ *
+ * ndest: number of entries in dest_ids
+ *
+ * from_id: ID of the neighbour the message arrived from, which is never
+ * included in the result, or -1 for messages originated here
+ *
+ * hops: output array, must have room for net->num_servers entries
+ *
+ * Return: the number of links written to hops.
+ */
+int network_downstream(network_t *net, unsigned int *dest_ids, int ndest,
+                       int from_id, unsigned int *hops);
+
+/*
+ * uid_make - Build a network-wide ID for a user or channel
+ *
+ * server_id: numeric ID of the origin server
+ *
+ * counter: value of the origin server's local counter
+ *
+ * Return: the 64-bit ID
+ */
+uint64_t uid_make(unsigned int server_id, uint32_t counter);
+
+/*
+ * uid_server - Return the numeric ID of the server that assigned an ID
+ *
+ * uid: the ID
+ *
+ * Return: origin server ID
+ */
+unsigned int uid_server(uint64_t uid);
+
+/*
+ * uid_encode - Write the compact wire form of an ID
+ *
+ * uid: the ID
+ *
+ * buf: output buffer of at least UID_STR_LEN + 1 bytes
+ *
+ * Return: nothing
+ */
+void uid_encode(uint64_t uid, char *buf);
+
+/*
+ * uid_decode - Parse the compact wire form of an ID
+ *
+ * s: string of exactly UID_STR_LEN base-36 digits
+ *
+ * uid: output ID
+ *
+ * Return: CHIRC_OK/CHIRC_ERROR
+ */
+int uid_decode(const char *s, uint64_t *uid);
+
+#endif
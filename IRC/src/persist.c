@@ -0,0 +1,595 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "persist.h"
+#include "server.h"
+#include "channels.h"
+#include "banlist.h"
+#include "serial.h"
+#include "reply.h"
+#include "log.h"
+#include "../lib/uthash.h"
+#include "../lib/sds/sds.h"
+
+/* Record types */
+#define PERSIST_CHANNEL 1   /* Mask lists of a channel */
+#define PERSIST_REMOVED 2   /* A channel without lists any more */
+#define PERSIST_OPERS 3     /* Every IRC operator */
+
+/* Only the writer thread uses these once it runs */
+static int log_fd = -1;         /* The snapshot file, appended to */
+static size_t log_bytes;        /* Its size */
+static size_t compacted_bytes;  /* Its size after the last rewrite */
+static bool rewrite = true;     /* Rewrite the whole file on the next write */
+
+
+/* FNV-1a, to tell a record from one torn by a crash */
+static uint32_t checksum(const char *p, size_t len)
+{
+    uint32_t h = 2166136261u;
+
+    for (size_t i = 0; i < len; i++)
+    {
+        h ^= (unsigned char)p[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+
+/* Append a record: its length, its checksum and the body */
+static sds put_record(sds b, sds body)
+{
+    b = serial_put_u32(b, sdslen(body));
+    b = serial_put_u32(b, checksum(body, sdslen(body)));
+    b = sdscatsds(b, body);
+    sdsfree(body);
+    return b;
+}
+
+
+static sds put_channel(sds b, sds channel_name, banlist_t *bans, banlist_t *excepts, banlist_t *invites)
+{
+    sds body = serial_put_u32(sdsempty(), PERSIST_CHANNEL);
+
+    body = serial_put_str(body, channel_name);
+    body = serial_put_banlist(body, bans);
+    body = serial_put_banlist(body, excepts);
+    body = serial_put_banlist(body, invites);
+    return put_record(b, body);
+}
+
+
+static bool has_lists(channel_t *c)
+{
+    return c->bans.count > 0 || c->excepts.count > 0 || c->invites.count > 0;
+}
+
+
+/*
+ * save - Keep the record of a channel's lists for the next writes, or drop
+ * it if the channel has none left (called with persist_lock held)
+ */
+static void save(server_ctx *ctx, channel_t *c, bool removed)
+{
+    persist_record_t *saved;
+
+    HASH_FIND_STR(ctx->persist_saved, c->channel_name, saved);
+    if (saved != NULL)
+    {
+        HASH_DELETE(hh, ctx->persist_saved, saved);
+        sdsfree(saved->record);
+        sdsfree(saved->channel_name);
+        free(saved);
+    }
+    if (removed || !has_lists(c))
+    {
+        return;
+    }
+
+    saved = malloc(sizeof(persist_record_t));
+    saved->channel_name = sdsdup(c->channel_name);
+    saved->record = put_channel(sdsempty(), c->channel_name, &c->bans, &c->excepts, &c->invites);
+    HASH_ADD_KEYPTR(hh, ctx->persist_saved, saved->channel_name, sdslen(saved->channel_name), saved);
+}
+
+
+static void pending_free(persist_channel_t *p)
+{
+    banlist_free(&p->bans);
+    banlist_free(&p->excepts);
+    banlist_free(&p->invites);
+    sdsfree(p->channel_name);
+    free(p);
+}
+
+
+/*
+ * collect - Serialize what the next write needs: the whole state, or the
+ * channels marked since the last write and the operators if they changed
+ *
+ * ctx: server context
+ *
+ * all: whether to serialize the whole state
+ *
+ * Return: the records, empty if there is nothing to write
+ */
+static sds collect(server_ctx *ctx, bool all)
+{
+    sds b = sdsempty();
+    persist_dirty_t *d, *d_tmp;
+
+    pthread_mutex_lock(&ctx->persist_lock);
+    if (all)
+    {
+        persist_record_t *saved, *saved_tmp;
+        persist_channel_t *p, *p_tmp;
+
+        HASH_ITER(hh, ctx->persist_saved, saved, saved_tmp)
+        {
+            b = sdscatsds(b, saved->record);
+        }
+        HASH_ITER(hh, ctx->persist_pending, p, p_tmp)
+        {
+            b = put_channel(b, p->channel_name, &p->bans, &p->excepts, &p->invites);
+        }
+    }
+    HASH_ITER(hh, ctx->persist_dirty, d, d_tmp)
+    {
+        if (!all)
+        {
+            persist_record_t *saved;
+
+            HASH_FIND_STR(ctx->persist_saved, d->channel_name, saved);
+            if (saved != NULL)
+            {
+                b = sdscatsds(b, saved->record);
+            }
+            else
+            {
+                sds body = serial_put_u32(sdsempty(), PERSIST_REMOVED);
+                b = put_record(b, serial_put_str(body, d->channel_name));
+            }
+        }
+        HASH_DELETE(hh, ctx->persist_dirty, d);
+        sdsfree(d->channel_name);
+        free(d);
+    }
+    pthread_mutex_unlock(&ctx->persist_lock);
+
+    pthread_mutex_lock(&ctx->operators_lock);
+    if (all || ctx->persist_opers_dirty)
+    {
+        irc_oper_t *oper, *oper_tmp;
+        sds body = serial_put_u32(sdsempty(), PERSIST_OPERS);
+
+        body = serial_put_u32(body, HASH_COUNT(ctx->irc_operators_hashtable));
+        HASH_ITER(hh, ctx->irc_operators_hashtable, oper, oper_tmp)
+        {
+            body = serial_put_str(body, oper->nick);
+        }
+        b = put_record(b, body);
+        ctx->persist_opers_dirty = false;
+    }
+    pthread_mutex_unlock(&ctx->operators_lock);
+
+    return b;
+}
+
+
+static int write_all(int fd, const char *buf, size_t len)
+{
+    while (len > 0)
+    {
+        ssize_t n = write(fd, buf, len);
+        if (n == -1)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            return CHIRC_ERROR;
+        }
+        buf += n;
+        len -= n;
+    }
+    return CHIRC_OK;
+}
+
+
+/* Write the whole state to a new file and put it in place of the log */
+static int rewrite_file(server_ctx *ctx, sds records)
+{
+    sds tmp_path = sdscatprintf(sdsempty(), "%s.tmp", ctx->persist_file);
+    sds header = serial_put_u32(sdsempty(), PERSIST_MAGIC);
+    header = serial_put_u32(header, PERSIST_VERSION);
+
+    int fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    int rc = CHIRC_ERROR;
+
+    if (fd != -1 &&
+        write_all(fd, header, sdslen(header)) == CHIRC_OK &&
+        write_all(fd, records, sdslen(records)) == CHIRC_OK &&
+        fdatasync(fd) == 0 &&
+        rename(tmp_path, ctx->persist_file) == 0)
+    {
+        if (log_fd != -1)
+        {
+            close(log_fd);
+        }
+        log_fd = fd;
+        log_bytes = compacted_bytes = sdslen(header) + sdslen(records);
+        rc = CHIRC_OK;
+    }
+    else
+    {
+        chilog(ERROR, "Could not write snapshot %s: %s", ctx->persist_file, strerror(errno));
+        if (fd != -1)
+        {
+            close(fd);
+            unlink(tmp_path);
+        }
+    }
+    sdsfree(header);
+    sdsfree(tmp_path);
+    return rc;
+}
+
+
+/* Append the changes to the log */
+static int append_log(server_ctx *ctx, sds records)
+{
+    if (write_all(log_fd, records, sdslen(records)) == CHIRC_ERROR ||
+        fdatasync(log_fd) != 0)
+    {
+        chilog(ERROR, "Could not write snapshot %s: %s", ctx->persist_file, strerror(errno));
+        return CHIRC_ERROR;
+    }
+    log_bytes += sdslen(records);
+    return CHIRC_OK;
+}
+
+
+static void persist_write(server_ctx *ctx)
+{
+    bool all = rewrite || log_bytes > 2 * compacted_bytes + PERSIST_COMPACT_BYTES;
+    sds records = collect(ctx, all);
+
+    if (all)
+    {
+        rewrite = rewrite_file(ctx, records) == CHIRC_ERROR;
+    }
+    else if (sdslen(records) > 0)
+    {
+        /* A failed append may leave a torn record, which the rewrite replaces */
+        rewrite = append_log(ctx, records) == CHIRC_ERROR;
+    }
+    sdsfree(records);
+}
+
+
+static void *persist_thread(void *args)
+{
+    server_ctx *ctx = (server_ctx *)args;
+
+    for (;;)
+    {
+        /* Not while a live upgrade hands the state over, which the new
+         * process then writes itself */
+        pthread_rwlock_rdlock(&ctx->upgrade_lock);
+        persist_write(ctx);
+        pthread_rwlock_unlock(&ctx->upgrade_lock);
+        sleep(PERSIST_INTERVAL);
+    }
+
+    return NULL;
+}
+
+
+/* Apply a record of the file to the restored state */
+static void load_record(server_ctx *ctx, serial_reader_t *r)
+{
+    uint32_t type = serial_get_u32(r);
+
+    if (type == PERSIST_CHANNEL || type == PERSIST_REMOVED)
+    {
+        sds channel_name = serial_get_str(r);
+        persist_channel_t *p = NULL;
+
+        if (channel_name == NULL)
+        {
+            return;
+        }
+        HASH_FIND_STR(ctx->persist_pending, channel_name, p);
+        if (p != NULL)
+        {
+            HASH_DELETE(hh, ctx->persist_pending, p);
+            pending_free(p);
+        }
+        if (type == PERSIST_REMOVED)
+        {
+            sdsfree(channel_name);
+            return;
+        }
+
+        p = calloc(1, sizeof(persist_channel_t));
+        p->channel_name = channel_name;
+        banlist_init(&p->bans);
+        banlist_init(&p->excepts);
+        banlist_init(&p->invites);
+        serial_get_banlist(r, &p->bans);
+        serial_get_banlist(r, &p->excepts);
+        serial_get_banlist(r, &p->invites);
+        HASH_ADD_KEYPTR(hh, ctx->persist_pending, p->channel_name, sdslen(p->channel_name), p);
+    }
+    else if (type == PERSIST_OPERS)
+    {
+        irc_oper_t *oper, *oper_tmp;
+
+        HASH_ITER(hh, ctx->irc_operators_hashtable, oper, oper_tmp)
+        {
+            HASH_DEL(ctx->irc_operators_hashtable, oper);
+            sdsfree(oper->nick);
+            sdsfree(oper->mode);
+            free(oper);
+        }
+
+        uint32_t count = serial_get_u32(r);
+        for (uint32_t i = 0; i < count && !r->bad; i++)
+        {
+            sds nick = serial_get_str(r);
+            if (nick == NULL)
+            {
+                continue;
+            }
+            oper = malloc(sizeof(irc_oper_t));
+            oper->nick = nick;
+            oper->mode = sdsnew("o");
+            HASH_ADD_STR(ctx->irc_operators_hashtable, nick, oper);
+        }
+    }
+}
+
+
+int persist_load(server_ctx *ctx)
+{
+    /*
+     * persist_load - Restore the mask lists and operators of a snapshot file
+     *
+     * ctx: server context, before any client is served
+     *
+     * Return: CHIRC_OK, also if there is no file yet, or CHIRC_ERROR if the
+     * file is not a snapshot
+     */
+    struct timespec t0, t1;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+
+    int fd = open(ctx->persist_file, O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
+    {
+        if (errno == ENOENT)
+        {
+            return CHIRC_OK;
+        }
+        chilog(CRITICAL, "Could not open snapshot %s: %s", ctx->persist_file, strerror(errno));
+        return CHIRC_ERROR;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) == -1 || st.st_size == 0)
+    {
+        close(fd);
+        return CHIRC_OK;
+    }
+
+    char *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+    {
+        chilog(CRITICAL, "Could not map snapshot %s: %s", ctx->persist_file, strerror(errno));
+        return CHIRC_ERROR;
+    }
+    madvise(map, st.st_size, MADV_SEQUENTIAL);
+
+    serial_reader_t r = {.p = map, .left = st.st_size, .bad = false};
+    if (serial_get_u32(&r) != PERSIST_MAGIC || serial_get_u32(&r) != PERSIST_VERSION)
+    {
+        chilog(CRITICAL, "%s is not a snapshot of this version of chirc", ctx->persist_file);
+        munmap(map, st.st_size);
+        return CHIRC_ERROR;
+    }
+
+    while (r.left > 0)
+    {
+        uint32_t len = serial_get_u32(&r);
+        uint32_t sum = serial_get_u32(&r);
+
+        if (r.bad || len > r.left || checksum(r.p, len) != sum)
+        {
+            chilog(WARNING, "Ignoring a torn record at the end of snapshot %s", ctx->persist_file);
+            break;
+        }
+
+        serial_reader_t record = {.p = r.p, .left = len, .bad = false};
+        load_record(ctx, &record);
+        r.p += len;
+        r.left -= len;
+    }
+    munmap(map, st.st_size);
+    counter_set(&ctx->counters, COUNTER_OPERATORS, HASH_COUNT(ctx->irc_operators_hashtable));
+
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    chilog(INFO, "Snapshot: restored the lists of %u channels and %u operators in %.1f ms",
+           HASH_COUNT(ctx->persist_pending), HASH_COUNT(ctx->irc_operators_hashtable),
+           (t1.tv_sec - t0.tv_sec) * 1e3 + (t1.tv_nsec - t0.tv_nsec) / 1e6);
+
+    return CHIRC_OK;
+}
+
+
+int persist_init(server_ctx *ctx)
+{
+    /*
+     * persist_init - Start the thread writing the snapshot file
+     *
+     * ctx: server context
+     *
+     * Return: CHIRC_OK/CHIRC_ERROR
+     */
+    pthread_t tid;
+
+    if (pthread_create(&tid, NULL, persist_thread, ctx) != 0)
+    {
+        chilog(CRITICAL, "Could not create the snapshot thread");
+        return CHIRC_ERROR;
+    }
+    pthread_detach(tid);
+
+    return CHIRC_OK;
+}
+
+
+void persist_mark(server_ctx *ctx, channel_t *channel, bool removed)
+{
+    /*
+     * persist_mark - Mark the mask lists of a channel as changed, or the
+     * channel as removed (called with the channel's table taken)
+     *
+     * ctx: server context
+     *
+     * channel: the channel
+     *
+     * removed: whether the channel is about to be removed
+     *
+     * Return: nothing
+     */
+    persist_dirty_t *d;
+
+    if (ctx->persist_file == NULL || (removed && !has_lists(channel)))
+    {
+        return;
+    }
+
+    pthread_mutex_lock(&ctx->persist_lock);
+    save(ctx, channel, removed);
+    HASH_FIND_STR(ctx->persist_dirty, channel->channel_name, d);
+    if (d == NULL)
+    {
+        d = malloc(sizeof(persist_dirty_t));
+        d->channel_name = sdsdup(channel->channel_name);
+        HASH_ADD_KEYPTR(hh, ctx->persist_dirty, d->channel_name, sdslen(d->channel_name), d);
+    }
+    pthread_mutex_unlock(&ctx->persist_lock);
+}
+
+
+void persist_claim(server_ctx *ctx, channel_t *channel)
+{
+    /*
+     * persist_claim - Give a channel just created the lists restored for it
+     * (called with the channel's table taken)
+     *
+     * ctx: server context
+     *
+     * channel: the new channel
+     *
+     * Return: nothing
+     */
+    persist_channel_t *p;
+
+    if (ctx->persist_file == NULL)
+    {
+        return;
+    }
+
+    pthread_mutex_lock(&ctx->persist_lock);
+    HASH_FIND_STR(ctx->persist_pending, channel->channel_name, p);
+    if (p != NULL)
+    {
+        HASH_DELETE(hh, ctx->persist_pending, p);
+        banlist_free(&channel->bans);
+        banlist_free(&channel->excepts);
+        banlist_free(&channel->invites);
+        channel->bans = p->bans;
+        channel->excepts = p->excepts;
+        channel->invites = p->invites;
+        sdsfree(p->channel_name);
+        free(p);
+    }
+    /* Lists handed over by a live upgrade are kept as they are */
+    save(ctx, channel, false);
+    pthread_mutex_unlock(&ctx->persist_lock);
+}
+
+
+bool persist_find_BANNED(server_ctx *ctx, sds channel_name, sds hostmask)
+{
+    /*
+     * persist_find_BANNED - (Thread-safe)Check a user creating a channel
+     * against the lists restored for it
+     *
+     * ctx: server context
+     *
+     * channel_name: the channel, which does not exist
+     *
+     * hostmask: nick!user@host of the user
+     *
+     * Return: true if a restored ban matches and no exception does
+     */
+    persist_channel_t *p;
+    bool banned = false;
+
+    pthread_mutex_lock(&ctx->persist_lock);
+    HASH_FIND_STR(ctx->persist_pending, channel_name, p);
+    if (p != NULL)
+    {
+        banned = banlist_match(&p->bans, hostmask) && !banlist_match(&p->excepts, hostmask);
+    }
+    pthread_mutex_unlock(&ctx->persist_lock);
+
+    return banned;
+}
+
+
+void persist_free(server_ctx *ctx)
+{
+    /*
+     * persist_free - Free the restored lists and the dirty marks when the
+     * server shuts down
+     *
+     * ctx: server context
+     *
+     * Return: nothing
+     */
+    persist_channel_t *p, *p_tmp;
+    persist_record_t *saved, *saved_tmp;
+    persist_dirty_t *d, *d_tmp;
+
+    HASH_ITER(hh, ctx->persist_pending, p, p_tmp)
+    {
+        HASH_DELETE(hh, ctx->persist_pending, p);
+        pending_free(p);
+    }
+    HASH_ITER(hh, ctx->persist_saved, saved, saved_tmp)
+    {
+        HASH_DELETE(hh, ctx->persist_saved, saved);
+        sdsfree(saved->record);
+        sdsfree(saved->channel_name);
+        free(saved);
+    }
+    HASH_ITER(hh, ctx->persist_dirty, d, d_tmp)
+    {
+        HASH_DELETE(hh, ctx->persist_dirty, d);
+        sdsfree(d->channel_name);
+        free(d);
+    }
+}
@@ -0,0 +1,134 @@
+#ifndef PERSIST_H_
+#define PERSIST_H_
+
+#include <stdbool.h>
+#include "server.h"
+#include "channels.h"
+#include "banlist.h"
+#include "../lib/uthash.h"
+#include "../lib/sds/sds.h"
+
+#define PERSIST_MAGIC 0x43485053        /* "CHPS", first word of a snapshot file */
+#define PERSIST_VERSION 1               /* Bumped when the record layout changes */
+#define PERSIST_INTERVAL 1              /* Seconds between two writes of the changes */
+#define PERSIST_COMPACT_BYTES (64 * 1024) /* Slack before a log twice its compacted size is rewritten */
+
+/*
+ * Snapshot of the state that outlives a connection: the +b, +e and +I
+ * lists of the channels, and the IRC operators. With -P, it is kept in a
+ * file that survives a crash and is loaded when the server starts again.
+ *
+ * The file is a log of records, each with its length and checksum: the
+ * mask lists of one channel, the removal of a channel, or the list of
+ * operators. The last record of a channel wins. A channel's record is
+ * serialized into ctx->persist_saved by whoever changes its lists, as the
+ * channels may belong to shards no other thread reads. A background
+ * thread writes the channels marked in ctx->persist_dirty every
+ * PERSIST_INTERVAL seconds, copying just their records under persist_lock
+ * and writing outside it, and rewrites the whole file into a new one once
+ * the log is twice its compacted size. At startup the file is mapped and read in one
+ * pass; a torn record at the end is ignored.
+ *
+ * Channels only exist while they have members, so restored lists wait in
+ * ctx->persist_pending until the channel is joined again.
+ */
+
+/* Mask lists of a channel restored from the snapshot, not joined yet */
+typedef struct persist_channel
+{
+    sds channel_name;   /* Key for hashtable */
+    banlist_t bans;
+    banlist_t excepts;
+    banlist_t invites;
+    UT_hash_handle hh;
+} persist_channel_t;
+
+/* The record of a channel that has mask lists */
+typedef struct persist_record
+{
+    sds channel_name;   /* Key for hashtable */
+    sds record;         /* Serialized, as written to the file */
+    UT_hash_handle hh;
+} persist_record_t;
+
+/* A channel whose lists changed or that was removed since the last write */
+typedef struct persist_dirty
+{
+    sds channel_name;   /* Key for hashtable */
+    UT_hash_handle hh;
+} persist_dirty_t;
+
+/*
+ * persist_load - Restore the mask lists and operators of a snapshot file
+ *
+ * ctx: server context, before any client is served
+ *
+ * Return: CHIRC_OK, also if there is no file yet, or CHIRC_ERROR if the
+ * file is not a snapshot
+ */
+int persist_load(server_ctx *ctx);
+
+/*
+ * persist_init - Start the thread writing the snapshot file. Its first
+ * write rewrites the file with the whole state.
+ *
+ * ctx: server context
+ *
+ * Return: CHIRC_OK/CHIRC_ERROR
+ */
+int persist_init(server_ctx *ctx);
+
+/*
+ * persist_mark - Mark the mask lists of a channel as changed, or the
+ * channel as removed (called with the channel's table taken by
+ * server_lock_CHANNELS)
+ *
+ * ctx: server context
+ *
+ * channel: the channel
+ *
+ * removed: whether the channel is about to be removed. Only a channel
+ * with lists is marked then, as the others are not in the file.
+ *
+ * Return: nothing
+ */
+void persist_mark(server_ctx *ctx, channel_t *channel, bool removed);
+
+/*
+ * persist_claim - Give a channel just created the lists restored for it,
+ * or keep the record of the lists a live upgrade handed over (called with
+ * the channel's table taken by server_lock_CHANNELS)
+ *
+ * ctx: server context
+ *
+ * channel: the new channel
+ *
+ * Return: nothing
+ */
+void persist_claim(server_ctx *ctx, channel_t *channel);
+
+/*
+ * persist_find_BANNED - (Thread-safe)Check a user creating a channel
+ * against the lists restored for it
+ *
+ * ctx: server context
+ *
+ * channel_name: the channel, which does not exist
+ *
+ * hostmask: nick!user@host of the user
+ *
+ * Return: true if a restored ban matches and no exception does
+ */
+bool persist_find_BANNED(server_ctx *ctx, sds channel_name, sds hostmask);
+
+/*
+ * persist_free - Free the restored lists and the dirty marks when the
+ * server shuts down
+ *
+ * ctx: server context
+ *
+ * Return: nothing
+ */
+void persist_free(server_ctx *ctx);
+
+#endif
@@ -0,0 +1,1188 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netdb.h>
+#include "pool.h"
+#include "uring.h"
+#include "shard.h"
+#include "tls.h"
+#include "capture.h"
+#include "link.h"
+#include "trace.h"
+#include "server.h"
+#include "handlers.h"
+#include "stats.h"
+#include "reply.h"
+#include "log.h"
+#include "../lib/sds/sds.h"
+
+/* Connections ready to run, a ring. The worker owning it takes from the
+ * front, the others steal from the back. */
+typedef struct pool_deque
+{
+    pthread_mutex_t lock;
+    conn_info_t **items;
+    int head;
+    int count;
+    int size;
+} pool_deque_t;
+
+/* user_data of the cancellations; that of the receives is their connection */
+#define TAG_CANCEL 1
+#define TAG_ACCEPT 2
+
+typedef struct pool
+{
+    server_ctx *ctx;
+    int nio;
+    int *epfds;                 /* One epoll instance per I/O thread */
+    bool uring;                 /* The I/O threads use rings instead */
+    uring_t *rings;             /* One io_uring per I/O thread */
+    atomic_int *armed;          /* Outstanding receives of each ring */
+    uring_t accept_ring;
+    int server_socket;          /* Accepted by accept_ring, or -1 */
+    bool quiescing;             /* A live upgrade stopped the rings (changed with upgrade_lock held for writing) */
+    atomic_int next_io;         /* Round robin over the I/O threads */
+    int nworkers;
+    pool_deque_t *deques;       /* One per worker */
+    atomic_int ready;           /* Connections in the deques */
+    atomic_int idle;            /* Workers asleep or going to sleep */
+    pthread_mutex_t idle_lock;
+    pthread_cond_t idle_cond;
+} pool_t;
+
+/* Arguments of an I/O thread or a worker */
+typedef struct pool_thread_args
+{
+    pool_t *pool;
+    int index;
+} pool_thread_args;
+
+static pool_t *pool;
+
+
+static void deque_push(pool_deque_t *dq, conn_info_t *conn)
+{
+    pthread_mutex_lock(&dq->lock);
+    if (dq->count == dq->size)
+    {
+        int size = dq->size ? dq->size * 2 : 64;
+        conn_info_t **items = malloc(size * sizeof(conn_info_t *));
+
+        for (int i = 0; i < dq->count; i++)
+        {
+            items[i] = dq->items[(dq->head + i) % dq->size];
+        }
+        free(dq->items);
+        dq->items = items;
+        dq->head = 0;
+        dq->size = size;
+    }
+    dq->items[(dq->head + dq->count) % dq->size] = conn;
+    dq->count++;
+    pthread_mutex_unlock(&dq->lock);
+}
+
+
+/* Take from the front (owner) or the back (thief) */
+static conn_info_t *deque_take(pool_deque_t *dq, bool steal)
+{
+    conn_info_t *conn = NULL;
+
+    pthread_mutex_lock(&dq->lock);
+    if (dq->count > 0)
+    {
+        if (steal)
+        {
+            conn = dq->items[(dq->head + dq->count - 1) % dq->size];
+        }
+        else
+        {
+            conn = dq->items[dq->head];
+            dq->head = (dq->head + 1) % dq->size;
+        }
+        dq->count--;
+    }
+    pthread_mutex_unlock(&dq->lock);
+
+    return conn;
+}
+
+
+/* Put a connection in line, and wake a worker if one sleeps */
+static void submit(int worker, conn_info_t *conn)
+{
+    deque_push(&pool->deques[worker], conn);
+    atomic_fetch_add(&pool->ready, 1);
+    if (atomic_load(&pool->idle) > 0)
+    {
+        pthread_mutex_lock(&pool->idle_lock);
+        pthread_cond_signal(&pool->idle_cond);
+        pthread_mutex_unlock(&pool->idle_lock);
+    }
+}
+
+
+/* Take a submission queue entry, submitting the queue first if it is full */
+static struct io_uring_sqe *ring_prep(uring_t *ring)
+{
+    struct io_uring_sqe *sqe = uring_prep(ring);
+
+    if (sqe == NULL)
+    {
+        uring_submit(ring);
+        sqe = uring_prep(ring);
+    }
+    return sqe;
+}
+
+
+/*
+ * arm - Wait for input on a connection again: one readiness event at a
+ * time with epoll, a multishot receive with io_uring (conn->pool->armed is
+ * set by the caller)
+ */
+static int arm(conn_info_t *conn, int op)
+{
+    int rc = 0;
+
+    if (pool->uring)
+    {
+        uring_t *ring = &pool->rings[conn->pool->io];
+
+        atomic_fetch_add(&pool->armed[conn->pool->io], 1);
+        pthread_mutex_lock(&ring->lock);
+        struct io_uring_sqe *sqe = ring_prep(ring);
+        sqe->opcode = IORING_OP_RECV;
+        sqe->fd = conn->client_socket;
+        sqe->ioprio = IORING_RECV_MULTISHOT;
+        sqe->flags = IOSQE_BUFFER_SELECT;
+        sqe->buf_group = 0;
+        sqe->user_data = (uint64_t)(uintptr_t)conn;
+        rc = uring_submit(ring) < 0 ? -1 : 0;
+        pthread_mutex_unlock(&ring->lock);
+        if (rc == -1)
+        {
+            atomic_fetch_sub(&pool->armed[conn->pool->io], 1);
+        }
+    }
+    else
+    {
+        struct epoll_event ev = {.events = EPOLLIN | EPOLLRDHUP | EPOLLONESHOT, .data.ptr = conn};
+
+        stats_syscalls(1);
+        rc = epoll_ctl(pool->epfds[conn->pool->io], op, conn->client_socket, &ev);
+    }
+    if (rc == -1)
+    {
+        chilog(ERROR, "Could not wait on connection %d: %s", conn->client_socket, strerror(errno));
+    }
+    return rc == -1 ? CHIRC_ERROR : CHIRC_OK;
+}
+
+
+/* Cancel the multishot receive of a connection whose queue is full */
+static void disarm(conn_info_t *conn)
+{
+    uring_t *ring = &pool->rings[conn->pool->io];
+
+    pthread_mutex_lock(&ring->lock);
+    struct io_uring_sqe *sqe = ring_prep(ring);
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = -1;
+    sqe->addr = (uint64_t)(uintptr_t)conn;
+    sqe->user_data = TAG_CANCEL;
+    uring_submit(ring);
+    pthread_mutex_unlock(&ring->lock);
+}
+
+
+/* Frame the whole commands of the cmd stack and tokenize them */
+static int parse(conn_info_t *conn, uint64_t recv_ns, pool_cmd_t **head, pool_cmd_t **tail)
+{
+    int count;
+    sds *cmdseg = frame_commands(conn->cmdstack, &count);
+
+    capture_lines(conn->capture_id, cmdseg, count);
+    for (int i = 0; i < count; i++)
+    {
+        pool_cmd_t *cmd = malloc(sizeof(pool_cmd_t));
+
+        cmd->tokens = tokenize_command(cmdseg[i], &cmd->argc);
+        cmd->step = NULL;
+        cmd->recv_ns = recv_ns;
+        cmd->trace_id = trace_sample();
+        cmd->trace_ns = trace_recv(cmd->trace_id, recv_ns);
+        cmd->next = NULL;
+        if (*tail != NULL)
+        {
+            (*tail)->next = cmd;
+        }
+        else
+        {
+            *head = cmd;
+        }
+        *tail = cmd;
+    }
+    sdsfreesplitres(cmdseg, count);
+
+    return count;
+}
+
+
+/*
+ * enqueue - Append commands to the queue of a connection, put it in line
+ * if it was not, and wait for more input unless there is none or enough
+ * is queued. With io_uring, ended tells that the multishot receive of the
+ * connection completed for the last time.
+ */
+static void enqueue(conn_info_t *conn, pool_cmd_t *head, pool_cmd_t *tail, int count, bool eof, bool ended)
+{
+    pool_conn_t *pc = conn->pool;
+    bool schedule, rearm, pause = false;
+
+    pthread_mutex_lock(&pc->lock);
+    if (head != NULL)
+    {
+        if (pc->tail != NULL)
+        {
+            pc->tail->next = head;
+        }
+        else
+        {
+            pc->head = head;
+        }
+        pc->tail = tail;
+        pc->queued += count;
+    }
+    pc->eof = pc->eof || eof;
+    schedule = !pc->scheduled && (pc->head != NULL || pc->eof);
+    if (schedule)
+    {
+        pc->scheduled = true;
+    }
+    rearm = !eof;
+    if (rearm && pc->queued >= POOL_BACKLOG)
+    {
+        pause = !pc->paused;
+        pc->paused = true;
+        rearm = false;
+    }
+    if (pool->uring)
+    {
+        /* A multishot receive goes on by itself, until it is cancelled or
+         * the kernel runs out of buffers */
+        if (ended)
+        {
+            pc->armed = false;
+            atomic_fetch_sub(&pool->armed[pc->io], 1);
+        }
+        pause = pause && pc->armed;
+        rearm = rearm && !pc->armed && !pool->quiescing;
+        pc->armed = pc->armed || rearm;
+    }
+    pthread_mutex_unlock(&pc->lock);
+
+    if (pause && pool->uring)
+    {
+        disarm(conn);
+    }
+    if (rearm)
+    {
+        arm(conn, EPOLL_CTL_MOD);
+    }
+    if (schedule)
+    {
+        submit(pc->home, conn);
+    }
+}
+
+
+/* Read what a connection sent, up to POOL_READ_BYTES (I/O thread) */
+static void pool_read(server_ctx *ctx, conn_info_t *conn)
+{
+    char buffer[BUFFER_SIZE];
+    pool_cmd_t *head = NULL, *tail = NULL;
+    int count = 0;
+    size_t total = 0;
+    bool eof = false;
+
+    pthread_rwlock_rdlock(&ctx->upgrade_lock);
+    while (total < POOL_READ_BYTES)
+    {
+        int nbytes = recv(conn->client_socket, buffer, sizeof(buffer) - 1, MSG_DONTWAIT);
+        stats_syscalls(1);
+
+        if (nbytes == -1 && errno == EINTR)
+        {
+            continue;
+        }
+        if (nbytes == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        {
+            break;
+        }
+        if (nbytes <= 0)
+        {
+            eof = true;
+            break;
+        }
+        stats_bytes_in(nbytes);
+        total += nbytes;
+
+        if (conn->tls != NULL)
+        {
+            if (tls_input(conn, buffer, nbytes) == CHIRC_ERROR)
+            {
+                eof = true;
+                break;
+            }
+        }
+        else if (conn->link != NULL)
+        {
+            if (link_input(conn, buffer, nbytes) == CHIRC_ERROR)
+            {
+                eof = true;
+                break;
+            }
+        }
+        else
+        {
+            buffer[nbytes] = '\0';
+            conn->cmdstack = sdscat(conn->cmdstack, buffer);
+        }
+        count += parse(conn, stats_now(), &head, &tail);
+    }
+    enqueue(conn, head, tail, count, eof, false);
+    pthread_rwlock_unlock(&ctx->upgrade_lock);
+}
+
+
+/*
+ * complete - Take in a completion of an I/O thread's ring: data received
+ * by a multishot receive, its end, or a cancellation (called with
+ * ctx->upgrade_lock held)
+ */
+static void complete(uring_t *ring, struct io_uring_cqe *cqe)
+{
+    pool_cmd_t *head = NULL, *tail = NULL;
+    int count = 0;
+    bool eof = false;
+
+    if (cqe->user_data == TAG_CANCEL)
+    {
+        return;
+    }
+
+    conn_info_t *conn = (conn_info_t *)(uintptr_t)cqe->user_data;
+    bool ended = !(cqe->flags & IORING_CQE_F_MORE);
+
+    if (cqe->res > 0)
+    {
+        stats_bytes_in(cqe->res);
+        if (conn->tls != NULL && tls_input(conn, uring_buffer(ring, cqe), cqe->res) == CHIRC_ERROR)
+        {
+            /* The receive then ends as for a QUIT, and the socket is
+             * closed after it */
+            shutdown(conn->client_socket, SHUT_RDWR);
+        }
+        else if (conn->tls == NULL && conn->link != NULL &&
+                 link_input(conn, uring_buffer(ring, cqe), cqe->res) == CHIRC_ERROR)
+        {
+            /* A corrupt compressed stream, likewise */
+            shutdown(conn->client_socket, SHUT_RDWR);
+        }
+        else if (conn->tls == NULL && conn->link == NULL)
+        {
+            conn->cmdstack = sdscatlen(conn->cmdstack, uring_buffer(ring, cqe), cqe->res);
+        }
+        uring_recycle(ring, cqe);
+        count = parse(conn, stats_now(), &head, &tail);
+    }
+    else if (cqe->res != -ENOBUFS && cqe->res != -ECANCELED)
+    {
+        /* The peer is gone, or the receive failed */
+        eof = true;
+    }
+    enqueue(conn, head, tail, count, eof, ended);
+}
+
+
+static void *uring_io_thread(void *args)
+{
+    pool_thread_args *ta = (pool_thread_args *)args;
+    uring_t *ring = &ta->pool->rings[ta->index];
+    server_ctx *ctx = ta->pool->ctx;
+    struct io_uring_cqe *cqe;
+
+    free(ta);
+    pthread_detach(pthread_self());
+
+    for (;;)
+    {
+        uring_wait(ring);
+
+        /* A live upgrade may have taken the completions in the meantime */
+        pthread_rwlock_rdlock(&ctx->upgrade_lock);
+        while ((cqe = uring_peek(ring)) != NULL)
+        {
+            complete(ring, cqe);
+            uring_seen(ring);
+        }
+        pthread_rwlock_unlock(&ctx->upgrade_lock);
+    }
+
+    return NULL;
+}
+
+
+static void *io_thread(void *args)
+{
+    pool_thread_args *ta = (pool_thread_args *)args;
+    int epfd = ta->pool->epfds[ta->index];
+    server_ctx *ctx = ta->pool->ctx;
+    struct epoll_event events[POOL_EVENTS];
+
+    free(ta);
+    pthread_detach(pthread_self());
+
+    for (;;)
+    {
+        int n = epoll_wait(epfd, events, POOL_EVENTS, -1);
+        stats_syscalls(1);
+
+        for (int i = 0; i < n; i++)
+        {
+            pool_read(ctx, (conn_info_t *)events[i].data.ptr);
+        }
+    }
+
+    return NULL;
+}
+
+
+/*
+ * split - Replace a command with several targets by one command per
+ * target, at the front of the queue, for the channel shards
+ *
+ * Return: false if the command is to be run as it is
+ */
+static bool split(server_ctx *ctx, conn_info_t *conn, pool_cmd_t *cmd)
+{
+    pool_cmd_t *head = NULL, *tail = NULL;
+    int count;
+    sds *targets = handle_split_targets(ctx, cmd->tokens, cmd->argc, conn, &count);
+
+    if (targets == NULL)
+    {
+        return false;
+    }
+    for (int i = 0; i < count; i++)
+    {
+        pool_cmd_t *one = malloc(sizeof(pool_cmd_t));
+
+        one->argc = cmd->argc;
+        one->tokens = malloc(cmd->argc * sizeof(sds));
+        for (int k = 0; k < cmd->argc; k++)
+        {
+            one->tokens[k] = k == 1 ? targets[i] : sdsdup(cmd->tokens[k]);
+        }
+        one->step = NULL;
+        one->recv_ns = cmd->recv_ns;
+        one->trace_id = cmd->trace_id;
+        one->trace_ns = one->trace_id != 0 ? stats_now() : 0;
+        one->next = NULL;
+        if (tail != NULL)
+        {
+            tail->next = one;
+        }
+        else
+        {
+            head = one;
+        }
+        tail = one;
+    }
+    free(targets);
+
+    if (head != NULL)
+    {
+        pool_requeue(conn, head, tail, count);
+    }
+    sdsfreesplitres(cmd->tokens, cmd->argc);
+    free(cmd);
+
+    return true;
+}
+
+
+/*
+ * dispatch - Run a command, or hand it to a channel shard
+ *
+ * Return: false if the worker is done with the command, true if the
+ * command was taken over
+ */
+static bool dispatch(server_ctx *ctx, conn_info_t *conn, pool_cmd_t *cmd)
+{
+    /* Left to the workers, as the I/O threads must not wait on DNS */
+    conn_resolve(conn);
+
+    if (cmd->step != NULL)
+    {
+        if (cmd->shard >= 0)
+        {
+            shard_post(ctx, cmd->shard, conn, cmd);
+            return true;
+        }
+        cmd->step(ctx, conn, cmd->arg);
+        return false;
+    }
+
+    int shard = ctx->shards != NULL ? shard_route(ctx, cmd->tokens, cmd->argc) : SHARD_LOCAL;
+
+    if (shard == SHARD_SPLIT && split(ctx, conn, cmd))
+    {
+        return true;
+    }
+    if (shard >= 0)
+    {
+        shard_post(ctx, shard, conn, cmd);
+        return true;
+    }
+
+    handle_request(ctx, cmd->tokens, cmd->argc, conn);
+    if (conn->quit)
+    {
+        /* The I/O thread then sees the end of input, and the
+         * socket is closed after it */
+        shutdown(conn->client_socket, SHUT_RDWR);
+    }
+    return false;
+}
+
+
+/* Run up to POOL_BATCH commands of a connection, in order (worker) */
+static void run(server_ctx *ctx, int self, conn_info_t *conn)
+{
+    pool_conn_t *pc = conn->pool;
+    bool more, finished, rearm = false;
+
+    pthread_rwlock_rdlock(&ctx->upgrade_lock);
+    atomic_store(&pc->holds, 1);
+    for (int i = 0; i < POOL_BATCH && atomic_load(&pc->holds) == 1; i++)
+    {
+        pthread_mutex_lock(&pc->lock);
+        pool_cmd_t *cmd = pc->head;
+        if (cmd != NULL)
+        {
+            pc->head = cmd->next;
+            if (pc->head == NULL)
+            {
+                pc->tail = NULL;
+            }
+            pc->queued--;
+        }
+        pthread_mutex_unlock(&pc->lock);
+
+        if (cmd == NULL)
+        {
+            break;
+        }
+
+        /* Commands after a QUIT are dropped, not the steps of the QUIT */
+        conn->recv_ns = cmd->recv_ns;
+        conn->trace_id = cmd->trace_id;
+        trace_span(cmd->trace_id, "queue", NULL, cmd->trace_ns, stats_now());
+        if ((conn->quit && cmd->step == NULL) || !dispatch(ctx, conn, cmd))
+        {
+            sdsfreesplitres(cmd->tokens, cmd->argc);
+            free(cmd);
+        }
+    }
+    link_flush(ctx);
+
+    if (atomic_fetch_sub(&pc->holds, 1) > 1)
+    {
+        /* Waiting for the channel shards: the last one done puts the
+         * connection back in line */
+        pthread_rwlock_unlock(&ctx->upgrade_lock);
+        return;
+    }
+
+    pthread_mutex_lock(&pc->lock);
+    more = pc->head != NULL;
+    finished = !more && pc->eof;
+    if (!more && !finished)
+    {
+        pc->scheduled = false;
+    }
+    if (pc->paused && pc->queued <= POOL_BACKLOG / 2)
+    {
+        pc->paused = false;
+        /* With io_uring, the receive may not be cancelled yet */
+        rearm = !pool->uring || (!pc->armed && !pc->eof);
+        pc->armed = pool->uring && (pc->armed || rearm);
+    }
+    pthread_mutex_unlock(&pc->lock);
+
+    sds squit = finished ? link_eof(conn) : NULL;
+    if (squit != NULL)
+    {
+        /* A server link takes down what is behind it first, now that the
+         * commands it sent before are done */
+        pool_cmd_t *cmd = calloc(1, sizeof(pool_cmd_t));
+        cmd->tokens = tokenize_command(squit, &cmd->argc);
+        cmd->recv_ns = stats_now();
+        pool_requeue(conn, cmd, cmd, 1);
+        sdsfree(squit);
+        finished = false;
+        more = true;
+    }
+
+    if (rearm)
+    {
+        arm(conn, EPOLL_CTL_MOD);
+    }
+    if (finished)
+    {
+        /* Nothing else refers to the connection: the I/O thread stopped
+         * waiting on it at the end of input */
+        close_socket(ctx, conn->client_socket);
+        conn_free(conn);
+    }
+    pthread_rwlock_unlock(&ctx->upgrade_lock);
+
+    if (more)
+    {
+        submit(self, conn);
+    }
+}
+
+
+static void *worker_thread(void *args)
+{
+    pool_thread_args *ta = (pool_thread_args *)args;
+    int self = ta->index;
+    server_ctx *ctx = ta->pool->ctx;
+
+    free(ta);
+    pthread_detach(pthread_self());
+
+    for (;;)
+    {
+        conn_info_t *conn = deque_take(&pool->deques[self], false);
+
+        for (int i = 1; conn == NULL && i < pool->nworkers; i++)
+        {
+            conn = deque_take(&pool->deques[(self + i) % pool->nworkers], true);
+        }
+
+        if (conn == NULL)
+        {
+            /* Sleep unless a connection was put in line meanwhile; a
+             * submitter that sees idle > 0 signals under the same lock */
+            pthread_mutex_lock(&pool->idle_lock);
+            atomic_fetch_add(&pool->idle, 1);
+            if (atomic_load(&pool->ready) == 0)
+            {
+                pthread_cond_wait(&pool->idle_cond, &pool->idle_lock);
+            }
+            atomic_fetch_sub(&pool->idle, 1);
+            pthread_mutex_unlock(&pool->idle_lock);
+            continue;
+        }
+
+        atomic_fetch_sub(&pool->ready, 1);
+        run(ctx, self, conn);
+    }
+
+    return NULL;
+}
+
+
+static int start_thread(void *(*fn)(void *), int index)
+{
+    pthread_t tid;
+    pool_thread_args *ta = malloc(sizeof(pool_thread_args));
+
+    ta->pool = pool;
+    ta->index = index;
+    if (pthread_create(&tid, NULL, fn, ta) != 0)
+    {
+        free(ta);
+        return CHIRC_ERROR;
+    }
+    return CHIRC_OK;
+}
+
+
+/* Set up the rings of the io_uring backend */
+static int uring_setup(void)
+{
+    int rc;
+
+    if (!uring_supported())
+    {
+        chilog(WARNING, "io_uring lacks multishot receives here, using epoll");
+        return CHIRC_ERROR;
+    }
+    pool->rings = calloc(pool->nio, sizeof(uring_t));
+    pool->armed = calloc(pool->nio, sizeof(atomic_int));
+    for (int i = 0; i < pool->nio; i++)
+    {
+        rc = uring_init(&pool->rings[i], POOL_URING_ENTRIES, POOL_URING_BUFS, POOL_URING_BUF_SIZE);
+        if (rc < 0)
+        {
+            chilog(WARNING, "Could not set up an io_uring (%s), using epoll", strerror(-rc));
+            return CHIRC_ERROR;
+        }
+    }
+    rc = uring_init(&pool->accept_ring, 8, 0, 0);
+    if (rc < 0)
+    {
+        chilog(WARNING, "Could not set up an io_uring (%s), using epoll", strerror(-rc));
+        return CHIRC_ERROR;
+    }
+    pool->uring = true;
+
+    return CHIRC_OK;
+}
+
+
+int pool_init(server_ctx *ctx, int io_threads, int workers, bool uring)
+{
+    /*
+     * pool_init - Start the I/O threads and the workers of split mode
+     *
+     * ctx: server context
+     *
+     * io_threads: number of I/O threads
+     *
+     * workers: number of workers
+     *
+     * uring: wait with io_uring rather than epoll, if the kernel allows it
+     *
+     * Return: CHIRC_OK/CHIRC_ERROR
+     */
+    pool = calloc(1, sizeof(pool_t));
+    pool->ctx = ctx;
+    pool->nio = io_threads;
+    pool->nworkers = workers;
+    pool->epfds = malloc(io_threads * sizeof(int));
+    pool->deques = calloc(workers, sizeof(pool_deque_t));
+    pool->server_socket = -1;
+    pthread_mutex_init(&pool->idle_lock, NULL);
+    pthread_cond_init(&pool->idle_cond, NULL);
+
+    for (int i = 0; i < workers; i++)
+    {
+        pthread_mutex_init(&pool->deques[i].lock, NULL);
+    }
+    if (uring && uring_setup() == CHIRC_OK)
+    {
+        io_threads = 0;     /* No epoll instance needed */
+    }
+    for (int i = 0; i < io_threads; i++)
+    {
+        pool->epfds[i] = epoll_create1(EPOLL_CLOEXEC);
+        if (pool->epfds[i] == -1)
+        {
+            chilog(CRITICAL, "Could not create an epoll instance: %s", strerror(errno));
+            return CHIRC_ERROR;
+        }
+    }
+
+    for (int i = 0; i < workers; i++)
+    {
+        if (start_thread(worker_thread, i) == CHIRC_ERROR)
+        {
+            chilog(CRITICAL, "Could not create a worker thread");
+            return CHIRC_ERROR;
+        }
+    }
+    for (int i = 0; i < pool->nio; i++)
+    {
+        if (start_thread(pool->uring ? uring_io_thread : io_thread, i) == CHIRC_ERROR)
+        {
+            chilog(CRITICAL, "Could not create an I/O thread");
+            return CHIRC_ERROR;
+        }
+    }
+    ctx->pool = pool;
+    chilog(INFO, "Split mode: %d workers, %d I/O threads waiting with %s", workers, pool->nio,
+           pool->uring ? "io_uring" : "epoll");
+
+    return CHIRC_OK;
+}
+
+
+int pool_add(conn_info_t *conn)
+{
+    /*
+     * pool_add - Serve a registered connection in split mode
+     *
+     * conn: the connection
+     *
+     * Return: CHIRC_OK/CHIRC_ERROR
+     */
+    pool_conn_t *pc = calloc(1, sizeof(pool_conn_t));
+    pool_cmd_t *head = NULL, *tail = NULL;
+
+    pthread_mutex_init(&pc->lock, NULL);
+    pc->io = atomic_fetch_add(&pool->next_io, 1) % pool->nio;
+    pc->home = conn->client_socket % pool->nworkers;
+    conn->pool = pc;
+
+    /* Whole commands handed over by a live upgrade run first. The
+     * connection is marked scheduled before the I/O thread can see it. */
+    int count = parse(conn, stats_now(), &head, &tail);
+    pc->head = head;
+    pc->tail = tail;
+    pc->queued = count;
+    pc->scheduled = count > 0;
+
+    pc->armed = pool->uring;
+    if (arm(conn, EPOLL_CTL_ADD) == CHIRC_ERROR)
+    {
+        return CHIRC_ERROR;
+    }
+    if (count > 0)
+    {
+        submit(pc->home, conn);
+    }
+
+    return CHIRC_OK;
+}
+
+
+void pool_continue(conn_info_t *conn)
+{
+    /*
+     * pool_continue - Let a connection that waited for a channel shard run
+     * its next commands, once no other shard message is pending for it
+     *
+     * conn: the connection
+     *
+     * Return: nothing
+     */
+    if (atomic_fetch_sub(&conn->pool->holds, 1) == 1)
+    {
+        submit(conn->pool->home, conn);
+    }
+}
+
+
+void pool_requeue(conn_info_t *conn, pool_cmd_t *head, pool_cmd_t *tail, int count)
+{
+    /*
+     * pool_requeue - Put commands or steps at the front of the queue of a
+     * connection, to be run next in their order
+     *
+     * conn: the connection
+     *
+     * head: the first of them, linked by next
+     *
+     * tail: the last of them
+     *
+     * count: how many there are
+     *
+     * Return: nothing
+     */
+    pool_conn_t *pc = conn->pool;
+
+    pthread_mutex_lock(&pc->lock);
+    tail->next = pc->head;
+    pc->head = head;
+    if (pc->tail == NULL)
+    {
+        pc->tail = tail;
+    }
+    pc->queued += count;
+    pthread_mutex_unlock(&pc->lock);
+}
+
+
+void pool_settle(server_ctx *ctx, conn_info_t *conn)
+{
+    /*
+     * pool_settle - Run the steps at the front of the queue of a connection
+     *
+     * ctx: server context
+     *
+     * conn: the connection
+     *
+     * Return: nothing
+     *
+     * The workers and the shards wait on the lock held here, so the steps
+     * are run by this thread, each as the shard it is for.
+     */
+    pool_conn_t *pc = conn->pool;
+
+    while (pc->head != NULL && pc->head->step != NULL)
+    {
+        pool_cmd_t *cmd = pc->head;
+
+        pc->head = cmd->next;
+        if (pc->head == NULL)
+        {
+            pc->tail = NULL;
+        }
+        pc->queued--;
+        shard_run(ctx, cmd->shard, conn, cmd);
+        free(cmd);
+    }
+}
+
+
+sds pool_unread(conn_info_t *conn)
+{
+    /*
+     * pool_unread - The input of a connection that was not run yet
+     *
+     * conn: the connection
+     *
+     * Return: its queued commands and then its incomplete command
+     */
+    sds unread = sdsempty();
+
+    if (conn->pool != NULL)
+    {
+        for (pool_cmd_t *cmd = conn->pool->head; cmd != NULL; cmd = cmd->next)
+        {
+            sds line = sdsjoinsds(cmd->tokens, cmd->argc, " ", 1);
+            unread = sdscatsds(unread, line);
+            unread = sdscatlen(unread, "\r\n", 2);
+            sdsfree(line);
+        }
+    }
+    return sdscatsds(unread, conn->cmdstack);
+}
+
+
+/* Submit the multishot accept of the listening socket */
+static void arm_accept(void)
+{
+    uring_t *ring = &pool->accept_ring;
+
+    pthread_mutex_lock(&ring->lock);
+    struct io_uring_sqe *sqe = ring_prep(ring);
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = pool->server_socket;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_CLOEXEC;
+    sqe->user_data = TAG_ACCEPT;
+    uring_submit(ring);
+    pthread_mutex_unlock(&ring->lock);
+}
+
+
+int pool_listen(int server_socket)
+{
+    /*
+     * pool_listen - Start accepting the connections of the listening socket
+     * with a multishot accept, when the I/O threads use io_uring
+     *
+     * server_socket: the listening socket
+     *
+     * Return: CHIRC_OK, or CHIRC_ERROR if connections are to be accepted
+     * with accept4() instead
+     */
+    if (pool == NULL || !pool->uring)
+    {
+        return CHIRC_ERROR;
+    }
+    pool->server_socket = server_socket;
+    arm_accept();
+
+    return CHIRC_OK;
+}
+
+
+/*
+ * accepted - Take in a completion of the multishot accept (called with
+ * ctx->upgrade_lock held)
+ *
+ * Return: the new socket, or -1
+ */
+static int accepted(struct io_uring_cqe *cqe)
+{
+    int res = cqe->res;
+
+    if (cqe->user_data == TAG_CANCEL)
+    {
+        return -1;
+    }
+    if (res == -EMFILE || res == -ENFILE)
+    {
+        /* The multishot accept stopped; it would fail again at once */
+        accept_shed(pool->ctx, pool->server_socket, false);
+    }
+    if (!(cqe->flags & IORING_CQE_F_MORE) && !pool->quiescing)
+    {
+        arm_accept();
+    }
+    if (res < 0 && res != -ECANCELED && res != -EMFILE && res != -ENFILE)
+    {
+        chilog(ERROR, "Could not accept() connection: %s", strerror(-res));
+    }
+    return res;
+}
+
+
+int pool_accept(server_ctx *ctx)
+{
+    /*
+     * pool_accept - Wait for a connection accepted by pool_listen
+     *
+     * ctx: server context
+     *
+     * Return: the new socket, with ctx->upgrade_lock held for reading
+     */
+    uring_t *ring = &pool->accept_ring;
+    struct io_uring_cqe *cqe;
+
+    for (;;)
+    {
+        uring_wait(ring);
+
+        pthread_rwlock_rdlock(&ctx->upgrade_lock);
+        while ((cqe = uring_peek(ring)) != NULL)
+        {
+            int client_socket = accepted(cqe);
+
+            uring_seen(ring);
+            if (client_socket >= 0)
+            {
+                return client_socket;
+            }
+        }
+        pthread_rwlock_unlock(&ctx->upgrade_lock);
+    }
+}
+
+
+/* Cancel every request of a ring */
+static void cancel_all(uring_t *ring)
+{
+    pthread_mutex_lock(&ring->lock);
+    struct io_uring_sqe *sqe = ring_prep(ring);
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = -1;
+    sqe->cancel_flags = IORING_ASYNC_CANCEL_ANY | IORING_ASYNC_CANCEL_ALL;
+    sqe->user_data = TAG_CANCEL;
+    uring_submit(ring);
+    pthread_mutex_unlock(&ring->lock);
+}
+
+
+void pool_quiesce(server_ctx *ctx)
+{
+    /*
+     * pool_quiesce - Stop the receives and the accept of the io_uring
+     * backend and take in what they completed
+     *
+     * ctx: server context
+     *
+     * Return: nothing
+     *
+     * The threads consuming the rings wait on the lock held here, so their
+     * completions are taken in by this thread. Connections accepted before
+     * the cancellation are registered, and their receives cancelled next.
+     */
+    struct io_uring_cqe *cqe;
+    bool done;
+
+    if (pool == NULL || !pool->uring)
+    {
+        return;
+    }
+    pool->quiescing = true;
+
+    if (pool->server_socket != -1)
+    {
+        cancel_all(&pool->accept_ring);
+        for (done = false; !done;)
+        {
+            uring_wait(&pool->accept_ring);
+            while ((cqe = uring_peek(&pool->accept_ring)) != NULL)
+            {
+                int client_socket = accepted(cqe);
+
+                done = done || (cqe->user_data == TAG_ACCEPT && !(cqe->flags & IORING_CQE_F_MORE));
+                uring_seen(&pool->accept_ring);
+                if (client_socket >= 0)
+                {
+                    accept_client(ctx, client_socket, false);
+                }
+            }
+        }
+    }
+
+    for (int i = 0; i < pool->nio; i++)
+    {
+        uring_t *ring = &pool->rings[i];
+
+        cancel_all(ring);
+        while (atomic_load(&pool->armed[i]) > 0 || uring_peek(ring) != NULL)
+        {
+            uring_wait(ring);
+            while ((cqe = uring_peek(ring)) != NULL)
+            {
+                complete(ring, cqe);
+                uring_seen(ring);
+            }
+        }
+    }
+}
+
+
+void pool_resume(server_ctx *ctx)
+{
+    /*
+     * pool_resume - Submit the receives and the accept again after a live
+     * upgrade failed
+     *
+     * ctx: server context
+     *
+     * Return: nothing
+     */
+    conn_info_t *conn, *tmp;
+
+    if (pool == NULL || !pool->uring)
+    {
+        return;
+    }
+    pool->quiescing = false;
+
+    pthread_mutex_lock(&ctx->conns_lock);
+    HASH_ITER(hh, ctx->conns, conn, tmp)
+    {
+        pool_conn_t *pc = conn->pool;
+        bool rearm;
+
+        if (pc == NULL)
+        {
+            continue;
+        }
+        pthread_mutex_lock(&pc->lock);
+        rearm = !pc->armed && !pc->paused && !pc->eof;
+        pc->armed = pc->armed || rearm;
+        pthread_mutex_unlock(&pc->lock);
+        if (rearm)
+        {
+            arm(conn, EPOLL_CTL_MOD);
+        }
+    }
+    pthread_mutex_unlock(&ctx->conns_lock);
+
+    if (pool->server_socket != -1)
+    {
+        arm_accept();
+    }
+}
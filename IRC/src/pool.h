@@ -0,0 +1,204 @@
+#ifndef POOL_H_
+#define POOL_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include "server.h"
+#include "../lib/sds/sds.h"
+
+#define POOL_MAX_THREADS 256    /* Most I/O threads or workers */
+#define POOL_BATCH 16           /* Commands of a connection run before it goes back in line */
+#define POOL_BACKLOG 64         /* Queued commands of a connection before its input is left unread */
+#define POOL_READ_BYTES 16384   /* Most bytes read from a connection for one readiness event */
+#define POOL_EVENTS 64          /* Readiness events taken at once by an I/O thread */
+#define POOL_URING_ENTRIES 256  /* Submission queue of each io_uring */
+#define POOL_URING_BUFS 256     /* Provided receive buffers of each I/O thread */
+#define POOL_URING_BUF_SIZE 4096
+
+/*
+ * Split mode (-w): instead of a thread per connection, a few I/O threads
+ * wait on the connections with epoll, read their input, frame it into
+ * commands and tokenize them, and a pool of workers runs handle_request.
+ *
+ * Each connection has a queue of tokenized commands. It is in a worker's
+ * deque while the queue is not empty, and only one worker at a time runs
+ * its commands, in order, at most POOL_BATCH before it goes back in line.
+ * A heavy command thus only delays the connection that sent it. A worker
+ * runs the connections of its own deque first and steals from the other
+ * deques when it is empty. When a connection has POOL_BACKLOG commands
+ * waiting, its input is left in the kernel until the queue drains.
+ *
+ * I/O threads and workers hold ctx->upgrade_lock for reading while they
+ * read or run commands, like the threads of the default mode. Only the
+ * worker running a connection closes it, after the end of its input, so
+ * the socket number is not reused while a command for it is queued.
+ *
+ * The I/O threads wait with epoll, or with -B uring on an io_uring each:
+ * every connection then has one multishot receive that keeps filling
+ * buffers of the thread's provided buffer ring, so input costs no system
+ * call besides the one waiting for completions, and the accept loop uses
+ * a multishot accept. A connection with POOL_BACKLOG commands waiting has
+ * its receive cancelled, and one is submitted again once it drains. When
+ * the kernel lacks io_uring or these features, epoll is used.
+ *
+ * With channel shards (shard.h), a worker hands the channel commands to
+ * the shards instead of running them, and the connection is not run again
+ * until they are done with it. A command that needs several shards puts
+ * steps at the front of the queue, which are run in turn like commands,
+ * each by its shard or by the worker.
+ */
+
+/* A step of a command, run with its argument */
+typedef void (*pool_step_fn)(server_ctx *ctx, conn_info_t *conn, void *arg);
+
+/* A command framed and tokenized by an I/O thread, or a step */
+typedef struct pool_cmd
+{
+    sds *tokens;            /* NULL for a step */
+    int argc;
+    pool_step_fn step;      /* Run instead of the tokens, NULL for a command */
+    void *arg;
+    int shard;              /* Shard running the step, SHARD_LOCAL for the worker */
+    uint64_t recv_ns;       /* When it was received, for stats */
+    uint32_t trace_id;      /* Traced message, 0 if none */
+    uint64_t trace_ns;      /* When a traced message was queued */
+    struct pool_cmd *next;
+} pool_cmd_t;
+
+/* Split mode state of a connection */
+typedef struct pool_conn
+{
+    pthread_mutex_t lock;   /* Protects the queue and the flags */
+    pool_cmd_t *head;       /* Commands not run yet, oldest first */
+    pool_cmd_t *tail;
+    int queued;
+    int io;                 /* I/O thread waiting on the connection */
+    int home;               /* Worker whose deque it is put in */
+    bool scheduled;         /* In a deque or being run */
+    bool paused;            /* Input left unread until the queue drains */
+    bool eof;               /* End of input: close once the queue is run */
+    bool armed;             /* io_uring: a multishot receive is outstanding */
+    atomic_int holds;       /* The worker running it, plus the channel shard messages it waits for */
+} pool_conn_t;
+
+/*
+ * pool_init - Start the I/O threads and the workers of split mode
+ *
+ * ctx: server context
+ *
+ * io_threads: number of I/O threads
+ *
+ * workers: number of workers
+ *
+ * uring: wait with io_uring rather than epoll, if the kernel allows it
+ *
+ * Return: CHIRC_OK/CHIRC_ERROR
+ */
+int pool_init(server_ctx *ctx, int io_threads, int workers, bool uring);
+
+/*
+ * pool_add - Serve a registered connection in split mode
+ *
+ * conn: the connection. Whole commands already in its cmd stack, handed
+ * over by a live upgrade, are queued first.
+ *
+ * Return: CHIRC_OK/CHIRC_ERROR
+ */
+int pool_add(conn_info_t *conn);
+
+/*
+ * pool_continue - Let a connection that waited for a channel shard run its
+ * next commands, once no other shard message is pending for it
+ *
+ * conn: the connection
+ *
+ * Return: nothing
+ */
+void pool_continue(conn_info_t *conn);
+
+/*
+ * pool_requeue - Put commands or steps at the front of the queue of a
+ * connection, to be run next in their order (called by the thread running
+ * the connection)
+ *
+ * conn: the connection
+ *
+ * head: the first of them, linked by next
+ *
+ * tail: the last of them
+ *
+ * count: how many there are
+ *
+ * Return: nothing
+ */
+void pool_requeue(conn_info_t *conn, pool_cmd_t *head, pool_cmd_t *tail, int count);
+
+/*
+ * pool_settle - Run the steps at the front of the queue of a connection,
+ * as only commands can be handed over by a live upgrade (called with
+ * ctx->upgrade_lock held for writing, once the shards are quiesced)
+ *
+ * ctx: server context
+ *
+ * conn: the connection
+ *
+ * Return: nothing
+ */
+void pool_settle(server_ctx *ctx, conn_info_t *conn);
+
+/*
+ * pool_unread - The input of a connection that was not run yet (called
+ * with ctx->upgrade_lock held for writing, after pool_settle)
+ *
+ * conn: the connection
+ *
+ * Return: its queued commands, each followed by "\r\n", and then its
+ * incomplete command, to be freed by the caller
+ */
+sds pool_unread(conn_info_t *conn);
+
+/*
+ * pool_listen - Start accepting the connections of the listening socket
+ * with a multishot accept, when the I/O threads use io_uring
+ *
+ * server_socket: the listening socket
+ *
+ * Return: CHIRC_OK, or CHIRC_ERROR if connections are to be accepted with
+ * accept4() instead
+ */
+int pool_listen(int server_socket);
+
+/*
+ * pool_accept - Wait for a connection accepted by pool_listen
+ *
+ * ctx: server context
+ *
+ * Return: the new socket, with ctx->upgrade_lock held for reading
+ */
+int pool_accept(server_ctx *ctx);
+
+/*
+ * pool_quiesce - Stop the receives and the accept of the io_uring backend
+ * and take in what they completed, so that all input and connections are
+ * in ctx->conns for a live upgrade (called with ctx->upgrade_lock held for
+ * writing)
+ *
+ * ctx: server context
+ *
+ * Return: nothing
+ */
+void pool_quiesce(server_ctx *ctx);
+
+/*
+ * pool_resume - Submit the receives and the accept again after a live
+ * upgrade failed (called with ctx->upgrade_lock held for writing)
+ *
+ * ctx: server context
+ *
+ * Return: nothing
+ */
+void pool_resume(server_ctx *ctx);
+
+#endif
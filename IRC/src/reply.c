@@ -109,6 +109,15 @@ int reply_error(sds *cmd, char *reply_code, conn_info_t *conn, server_ctx *ctx)
 
         sdsfree(error);
     }
+    else if (!strncmp(reply_code, ERR_TOOMANYTARGETS, ERROR_CODE_LEN))
+    {
+        chirc_message_add_parameter(msg, cmd[1], false);
+        sds error = sdscatprintf(sdsempty(), "Too many recipients. Only the first %d were processed\r\n",
+                                 ctx->max_targets);
+        chirc_message_add_parameter(msg, error, true);
+
+        sdsfree(error);
+    }
     else if (!strncmp(reply_code, ERR_NORECIPIENT, ERROR_CODE_LEN))
     {
         sds error = sdscatprintf(sdsempty(), "No recipient given (%s)\r\n", cmd[0]);
@@ -169,6 +178,21 @@ int reply_error(sds *cmd, char *reply_code, conn_info_t *conn, server_ctx *ctx)
 
         sdsfree(error);
     }
+    else if (!strncmp(reply_code, ERR_BANNEDFROMCHAN, ERROR_CODE_LEN))
+    {
+        chirc_message_add_parameter(msg, cmd[1], false);
+        sds error = sdscatprintf(sdsempty(), "Cannot join channel (+b)\r\n");
+        chirc_message_add_parameter(msg, error, true);
+
+        sdsfree(error);
+    }
+    else if (!strncmp(reply_code, ERR_NOPRIVILEGES, ERROR_CODE_LEN))
+    {
+        sds error = sdscatprintf(sdsempty(), "Permission Denied- You're not an IRC operator\r\n");
+        chirc_message_add_parameter(msg, error, true);
+
+        sdsfree(error);
+    }
     else if (!strncmp(reply_code, ERR_PASSWDMISMATCH, ERROR_CODE_LEN))
     {
         sds error = sdscatprintf(sdsempty(), "Password incorrect\r\n");
@@ -59,6 +59,11 @@
 #define RPL_LUSERCHANNELS "254"
 #define RPL_LUSERME "255"
 
+#define RPL_STATSCOMMANDS "212"
+#define RPL_ENDOFSTATS "219"
+#define RPL_STATSUPTIME "242"
+#define RPL_STATSDEBUG "249"
+
 #define RPL_AWAY "301"
 #define RPL_UNAWAY "305"
 #define RPL_NOWAWAY "306"
@@ -78,6 +83,13 @@
 
 #define RPL_CHANNELMODEIS "324"
 
+#define RPL_INVITELIST "346"
+#define RPL_ENDOFINVITELIST "347"
+#define RPL_EXCEPTLIST "348"
+#define RPL_ENDOFEXCEPTLIST "349"
+#define RPL_BANLIST "367"
+#define RPL_ENDOFBANLIST "368"
+
 #define RPL_NOTOPIC "331"
 #define RPL_TOPIC "332"
 
@@ -94,6 +106,7 @@
 #define ERR_NOSUCHSERVER "402"
 #define ERR_NOSUCHCHANNEL "403"
 #define ERR_CANNOTSENDTOCHAN "404"
+#define ERR_TOOMANYTARGETS "407"
 #define ERR_NORECIPIENT "411"
 #define ERR_NOTEXTTOSEND "412"
 #define ERR_UNKNOWNCOMMAND "421"
@@ -107,6 +120,7 @@
 #define ERR_ALREADYREGISTRED "462"
 #define ERR_PASSWDMISMATCH "464"
 #define ERR_UNKNOWNMODE "472"
+#define ERR_BANNEDFROMCHAN "474"
 #define ERR_NOPRIVILEGES "481"
 #define ERR_CHANOPRIVSNEEDED "482"
 #define ERR_UMODEUNKNOWNFLAG "501"
@@ -3,6 +3,11 @@
 #include "reply.h"
 #include "msg.h"
 #include "../lib/sds/sds.h"
+#include "stats.h"
+#include "server_cmd.h"
+#include "tls.h"
+#include "trace.h"
+#include "../lib/uthash.h"
 
 
 int sendall(int s, char *buf, int *len)
@@ -28,6 +33,7 @@ int sendall(int s, char *buf, int *len)
     while (total < *len)
     {
         n = send(s, buf + total, bytesleft, 0);
+        stats_syscalls(1);
         /* Check the return value of send(). */
         if (n == -1)
         {
@@ -51,7 +57,7 @@ int send_msg(int client_socket, server_ctx *ctx, sds msg)
      *
      * client_socket: client_socket
      *
-     * ctx: server_context, we use the socket_lock to protect send_all()
+     * ctx: server_context, we use the socket's lock in socket_locks to protect send_all()
      *
      * msg: The buffer message to be sent
      *
@@ -62,14 +68,94 @@ int send_msg(int client_socket, server_ctx *ctx, sds msg)
     int r = MSG_OK;
     int len = sdslen(msg);
 
-    pthread_mutex_lock(&ctx->socket_lock);
-    if (sendall(client_socket, msg, &len) == -1)
+    if (client_socket < 0)
+    {
+        /* A user of another server: what it gets goes on a server link */
+        return MSG_OK;
+    }
+
+    pthread_mutex_t *lock = &ctx->socket_locks[client_socket % SOCKET_LOCKS];
+    uint64_t start = trace_msg != 0 ? stats_now() : 0;
+
+    stats_send_enter();
+    trace_mutex_lock(lock, "socket_lock");
+    /* TLS connections go through OpenSSL, unless the kernel encrypts */
+    tls_conn_t *tls = tls_sender(ctx, client_socket);
+    if ((tls != NULL ? tls_send(tls, msg, &len) : sendall(client_socket, msg, &len)) == -1)
     {
         chilog(ERROR, "We only sent %d bytes because of the error!\n", len);
         /* Check the return value of sendall(). */
         r = MSG_ERROR;
     }
-    pthread_mutex_unlock(&ctx->socket_lock);
+    pthread_mutex_unlock(lock);
+    stats_send_leave();
+    stats_bytes_out(len);
+    if (trace_msg != 0)
+    {
+        trace_span(trace_msg, "send", NULL, start, stats_now());
+    }
+
+    return r;
+}
+
+
+/*
+ * nick_message - Serialize a NICK message
+ *
+ * prefix: ":nick!user@host" of the user changing nickname
+ *
+ * cmdtokens: tokenized command stacks
+ *
+ * argc: count of the argument numbers
+ *
+ * Return: a new sds string
+ */
+static sds nick_message(sds prefix, sds *cmdtokens, int argc)
+{
+    chirc_message_t *msg = (chirc_message_t *)malloc(sizeof(chirc_message_t));
+
+    chirc_message_construct(msg, prefix, cmdtokens[0]);
+
+    sds param = sdsjoinsds(cmdtokens + 1, argc - 1, " ", 1);
+    param = sdscat(param, "\r\n");
+    chirc_message_add_parameter(msg, param, true);
+
+    sds host_msg;
+    chirc_message_to_string(msg, &host_msg);
+
+    sdsfree(param);
+    chirc_message_destroy(msg);
+
+    return host_msg;
+}
+
+
+/*
+ * relay_to_neighbors - Send one serialized message to every user sharing
+ * a channel with a user, once each
+ *
+ * ctx: server_context
+ *
+ * sockets: the sockets of the neighbors, each once
+ *
+ * count: the number of sockets
+ *
+ * host_msg: the message
+ *
+ * Return: MSG_OK/MSG_ERROR if sending to any of them failed
+ */
+static int relay_to_neighbors(server_ctx *ctx, const int *sockets, int count, sds host_msg)
+{
+    int r = MSG_OK;
+
+    /* A peer that went away must not keep the others from being told */
+    for (int i = 0; i < count; i++)
+    {
+        if (send_msg(sockets[i], ctx, host_msg) == MSG_ERROR)
+        {
+            r = MSG_ERROR;
+        }
+    }
 
     return r;
 }
@@ -94,36 +180,53 @@ int server_reply_nick(server_ctx *ctx, sds prefix, sds *cmdtokens,
      * Return: MSG_OK/MSG_ERROR
      *
      */
+    sds host_msg = nick_message(prefix, cmdtokens, argc);
+    int r = send_msg(client_socket, ctx, host_msg);
 
-    chirc_message_t *msg = (chirc_message_t *)malloc(sizeof(chirc_message_t));
+    sdsfree(host_msg);
 
-    chirc_message_construct(msg, prefix, cmdtokens[0]);
+    return r;
+}
 
-    sds param = sdsjoinsds(cmdtokens + 1, argc - 1, " ", 1);
-    param = sdscat(param, "\r\n");
-    chirc_message_add_parameter(msg, param, true);
 
-    sds host_msg;
-    chirc_message_to_string(msg, &host_msg);
-    if (send_msg(client_socket, ctx, host_msg) == MSG_ERROR)
-    {
-        return MSG_ERROR;
-    }
+int server_reply_nick_relay(server_ctx *ctx, sds prefix, sds *cmdtokens,
+                            int argc, const int *sockets, int count)
+{
+    /*
+     * server_reply_nick_relay - A thread-safe function to relay NICK reply
+     * to every user sharing a channel with the user, once each.
+     *
+     * ctx: server_context
+     *
+     * prefix: buffer message to be sent
+     *
+     * cmdtokens: tokenized command stacks
+     *
+     * argc: count of the argument numbers
+     *
+     * sockets: the sockets of the users sharing a channel with the user,
+     * each once
+     *
+     * count: the number of sockets
+     *
+     * Return: MSG_OK/MSG_ERROR
+     *
+     */
+    sds host_msg = nick_message(prefix, cmdtokens, argc);
+    int r = relay_to_neighbors(ctx, sockets, count, host_msg);
 
     sdsfree(host_msg);
-    sdsfree(param);
-
-    chirc_message_destroy(msg);
 
-    return MSG_OK;
+    return r;
 }
 
 
 int server_reply_quit_relay(server_ctx *ctx, sds prefix, sds *cmdtokens,
-                            int argc, int client_socket)
+                            int argc, const int *sockets, int count)
 {
     /*
-     * server_reply_quit_relay - A thread-safe function to relay QUIT reply.
+     * server_reply_quit_relay - A thread-safe function to relay QUIT reply
+     * to every user sharing a channel with the user, once each.
      *
      * ctx: server_context
      *
@@ -133,7 +236,10 @@ int server_reply_quit_relay(server_ctx *ctx, sds prefix, sds *cmdtokens,
      *
      * argc: count of the argument numbers
      *
-     * client_socket: client socket for the reply
+     * sockets: the sockets of the users sharing a channel with the user,
+     * each once
+     *
+     * count: the number of sockets
      *
      * Return: MSG_OK/MSG_ERROR
      *
@@ -161,16 +267,13 @@ int server_reply_quit_relay(server_ctx *ctx, sds prefix, sds *cmdtokens,
 
     sds host_msg;
     chirc_message_to_string(quit_msg, &host_msg);
-    if (send_msg(client_socket, ctx, host_msg) == MSG_ERROR)
-    {
-        return MSG_ERROR;
-    }
+    int r = relay_to_neighbors(ctx, sockets, count, host_msg);
 
     sdsfree(host_msg);
     sdsfree(param);
     chirc_message_destroy(quit_msg);
 
-    return MSG_OK;
+    return r;
 }
 
 
@@ -227,7 +330,7 @@ int server_reply_quit(server_ctx *ctx, sds *cmdtokens,
 
 int server_reply_join(server_ctx *ctx,
                       sds prefix, char *cmd, sds nickname, sds channel_name,
-                      int client_socket, channel_t *c)
+                      int client_socket)
 {
 
     /*
@@ -237,7 +340,7 @@ int server_reply_join(server_ctx *ctx,
      *
      * prefix: buffer message to be sent
      *
-     * cmd: reply_code
+     * cmd: reply_code, RPL_ENDOFNAMES
      *
      * nickname: nickname of the joined user
      *
@@ -245,8 +348,6 @@ int server_reply_join(server_ctx *ctx,
      *
      * client_socket: client socket for the reply
      *
-     * c: the channel the user joined
-     *
      * Return: MSG_OK/MSG_ERROR
      *
      */
@@ -259,33 +360,10 @@ int server_reply_join(server_ctx *ctx,
 
     sds param = sdsempty();
 
-    if (!strncmp(cmd, RPL_NAMREPLY, MAX_STR_LEN))
-    {
-        /* RPL_NAMREPLY */
-        chirc_message_add_parameter(msg, "=", false);
-        sdscatsds(param, channel_name);
-        chirc_message_add_parameter(msg, param, false);
-
-        /* Add name list as param */
-        param = sdscpy(param, "@");
-
-        pthread_mutex_lock(&ctx->channels_lock);
-        for (channel_client *cc = c->channel_clients; cc != NULL; cc = cc->hh.next)
-        {
-            param = sdscatsds(param, cc->nick);
-            if (cc->hh.next)
-            {
-                param = sdscat(param, " ");
-            }
-        }
-        pthread_mutex_unlock(&ctx->channels_lock);
-
-        param = sdscat(param, "\r\n");
-    }
-    else if (!strncmp(cmd, RPL_ENDOFNAMES, MAX_STR_LEN))
+    if (!strncmp(cmd, RPL_ENDOFNAMES, MAX_STR_LEN))
     {
         /* RPL_ENDOFNAMES */
-        sdscatsds(param, channel_name);
+        param = sdscatsds(param, channel_name);
         chirc_message_add_parameter(msg, param, false);
         param = sdscpy(param, "End of NAMES list\r\n");
     }
@@ -351,10 +429,11 @@ int server_reply_join_relay(server_ctx *ctx,
 
 
 int server_reply_privmsg(server_ctx *ctx,
-                         sds prefix, sds *cmdtokens, int argc, int client_socket)
+                         sds prefix, sds *cmdtokens, int argc, msg_target_t *target)
 {
     /*
-     * server_reply_privmsg - A thread-safe function to relay PRIVMSG reply.
+     * server_reply_privmsg - A thread-safe function to relay PRIVMSG reply
+     * to the recipients of one target.
      *
      * ctx: server_context
      *
@@ -364,22 +443,24 @@ int server_reply_privmsg(server_ctx *ctx,
      *
      * argc: count of the argument numbers
      *
-     * client_socket: client socket for the reply
+     * target: the target, resolved by server_resolve_TARGETS
      *
      * Return: MSG_OK/MSG_ERROR
      *
+     * The message is serialized once, sent to every recipient and, for a
+     * channel, kept in its history.
      */
     chirc_message_t *msg = (chirc_message_t *)malloc(sizeof(chirc_message_t));
 
     sds cmd = cmdtokens[0];
     if (!strncmp(cmdtokens[0], "NOTICE", MAX_STR_LEN) &&
-        cmdtokens[1][0] == '#')
+        target->name[0] == '#')
     {
         cmd = "PRIVMSG";
     }
     chirc_message_construct(msg, prefix, cmd);
 
-    chirc_message_add_parameter(msg, cmdtokens[1], false);
+    chirc_message_add_parameter(msg, target->name, false);
     sds param = sdsjoinsds(cmdtokens + 2, argc - 2, " ", 1);
     if (param[0] == ':')
     {
@@ -391,16 +472,29 @@ int server_reply_privmsg(server_ctx *ctx,
 
     sds host_msg;
     chirc_message_to_string(msg, &host_msg);
-    if (send_msg(client_socket, ctx, host_msg) == MSG_ERROR)
+
+    int r = MSG_OK;
+    for (int i = 0; i < target->nsockets; i++)
     {
-        return MSG_ERROR;
+        if (send_msg(target->sockets[i], ctx, host_msg) == MSG_ERROR)
+        {
+            r = MSG_ERROR;
+        }
     }
 
-    sdsfree(host_msg);
+    /* The same buffer goes into the channel history */
+    if (target->name[0] == '#')
+    {
+        history_record(ctx, target->name, host_msg);
+    }
+    else
+    {
+        sdsfree(host_msg);
+    }
     sdsfree(param);
     chirc_message_destroy(msg);
 
-    return MSG_OK;
+    return r;
 }
 
 
@@ -425,7 +519,7 @@ int server_reply_ping(server_ctx *ctx, sds prefix, sds server_hostname, int clie
 
     chirc_message_construct(msg, prefix, "PONG");
 
-    sds host = sdscatsds(server_hostname, sdsnew("\r\n"));
+    sds host = sdscat(sdsdup(server_hostname), "\r\n");
     chirc_message_add_parameter(msg, host, true);
 
     sds host_msg;
@@ -487,7 +581,9 @@ int server_reply_whois(server_ctx *ctx,
     }
     else if (!strncmp(cmd, RPL_WHOISSERVER, MAX_STR_LEN))
     {
-        chirc_message_add_parameter(msg, conn->server_hostname, false);
+        /* A user of another server of the network is connected to it */
+        chirc_message_add_parameter(msg, starget->server != NULL ? starget->server->servername
+                                                                 : conn->server_hostname, false);
 
         chirc_message_add_parameter(msg, "*\r\n", true);
     }
@@ -534,6 +630,7 @@ sds server_reply_list(server_ctx *ctx,
      */
     chirc_message_t *msg = (chirc_message_t *)malloc(sizeof(chirc_message_t));
 
+    (void)ctx;
     chirc_message_construct(msg, prefix, cmd);
 
     chirc_message_add_parameter(msg, nickname, false);
@@ -593,6 +690,94 @@ int server_reply_listend(server_ctx *ctx,
 }
 
 
+sds server_reply_who(server_ctx *ctx,
+                     sds prefix, sds nickname, sds channel,
+                     sds server_hostname, who_row_t *row)
+{
+    /*
+     * server_reply_who - A thread-safe function to form WHO reply.
+     *
+     * ctx: server_context
+     *
+     * prefix: buffer message to be sent
+     *
+     * nickname: the nickname of the user asking
+     *
+     * channel: the channel of the listed user, or "*"
+     *
+     * server_hostname: the server the listed user is on
+     *
+     * row: the listed user
+     *
+     * Return: sds string
+     *
+     */
+    chirc_message_t *msg = (chirc_message_t *)malloc(sizeof(chirc_message_t));
+
+    (void)ctx;
+    chirc_message_construct(msg, prefix, RPL_WHOREPLY);
+
+    chirc_message_add_parameter(msg, nickname, false);
+    chirc_message_add_parameter(msg, channel, false);
+    chirc_message_add_parameter(msg, row->username, false);
+    chirc_message_add_parameter(msg, row->hostname, false);
+    chirc_message_add_parameter(msg, server_hostname, false);
+    chirc_message_add_parameter(msg, row->nick, false);
+    chirc_message_add_parameter(msg, row->status, false);
+
+    sds trailing = sdscatprintf(sdsempty(), "0 %s\r\n", row->realname);
+    chirc_message_add_parameter(msg, trailing, true);
+
+    sds host_msg;
+    chirc_message_to_string(msg, &host_msg);
+
+    sdsfree(trailing);
+    chirc_message_destroy(msg);
+
+    return host_msg;
+}
+
+
+int server_reply_endofwho(server_ctx *ctx,
+                          sds prefix, sds nickname, sds mask,
+                          int client_socket)
+{
+    /*
+     * server_reply_endofwho - A thread-safe function to send WHO end reply.
+     *
+     * ctx: server_context
+     *
+     * prefix: buffer message to be sent
+     *
+     * nickname: the nickname of the user asking
+     *
+     * mask: the channel or mask asked for, or "*"
+     *
+     * client_socket: client socket for the reply
+     *
+     * Return: MSG_OK/MSG_ERROR
+     *
+     */
+    chirc_message_t *msg = (chirc_message_t *)malloc(sizeof(chirc_message_t));
+
+    chirc_message_construct(msg, prefix, RPL_ENDOFWHO);
+
+    chirc_message_add_parameter(msg, nickname, false);
+    chirc_message_add_parameter(msg, mask, false);
+    chirc_message_add_parameter(msg, "End of WHO list\r\n", true);
+
+    sds host_msg;
+    chirc_message_to_string(msg, &host_msg);
+
+    int rc = send_msg(client_socket, ctx, host_msg);
+
+    sdsfree(host_msg);
+    chirc_message_destroy(msg);
+
+    return rc;
+}
+
+
 int server_reply_oper(server_ctx *ctx,
                       sds prefix, char *cmd, sds *cmdtokens, int client_socket)
 {
@@ -734,6 +919,109 @@ int server_reply_mode(server_ctx *ctx, sds prefix, sds *cmdtokens,
 }
 
 
+int server_reply_history(server_ctx *ctx, sds *lines, int count, int client_socket)
+{
+    /*
+     * server_reply_history - A thread-safe function to replay channel history.
+     *
+     * ctx: server_context
+     *
+     * lines: the messages, copied by history_copy
+     *
+     * count: the number of messages
+     *
+     * client_socket: client socket for the reply
+     *
+     * Return: MSG_OK/MSG_ERROR
+     *
+     * The messages are sent in batches of HISTORY_BATCH_BYTES, so the
+     * socket lock is never held for the whole history.
+     */
+    sds batch = sdsempty();
+    int rc = MSG_OK;
+
+    for (int i = 0; i < count && rc == MSG_OK; i++)
+    {
+        batch = sdscatsds(batch, lines[i]);
+        if (sdslen(batch) >= HISTORY_BATCH_BYTES || i == count - 1)
+        {
+            rc = send_msg(client_socket, ctx, batch);
+            sdsclear(batch);
+        }
+    }
+    sdsfree(batch);
+
+    return rc;
+}
+
+
+sds server_reply_banlist(server_ctx *ctx,
+                         sds prefix, char *cmd, sds nickname,
+                         sds channel_name, banlist_entry_t *entry)
+{
+    /*
+     * server_reply_banlist - A thread-safe function to form a ban, exception
+     * or invite list reply.
+     *
+     * ctx: server_context
+     *
+     * prefix: buffer message to be sent
+     *
+     * cmd: reply_code, RPL_BANLIST, RPL_EXCEPTLIST or RPL_INVITELIST
+     *
+     * nickname: the nickname of the user asking
+     *
+     * channel_name: the channel_name
+     *
+     * entry: the listed mask
+     *
+     * Return: sds string
+     *
+     */
+    (void)ctx;
+
+    return sdscatprintf(sdsempty(), "%s %s %s %s %s %s %lld\r\n",
+                        prefix, cmd, nickname, channel_name,
+                        entry->mask, entry->setter, (long long)entry->set_at);
+}
+
+
+int server_reply_endofbanlist(server_ctx *ctx,
+                              sds prefix, char *cmd, sds nickname,
+                              sds channel_name, int client_socket)
+{
+    /*
+     * server_reply_endofbanlist - A thread-safe function to send the end of
+     * a ban, exception or invite list.
+     *
+     * ctx: server_context
+     *
+     * prefix: buffer message to be sent
+     *
+     * cmd: reply_code, RPL_ENDOFBANLIST, RPL_ENDOFEXCEPTLIST or
+     * RPL_ENDOFINVITELIST
+     *
+     * nickname: the nickname of the user asking
+     *
+     * channel_name: the channel_name
+     *
+     * client_socket: client socket for the reply
+     *
+     * Return: MSG_OK/MSG_ERROR
+     *
+     */
+    char *what = !strcmp(cmd, RPL_ENDOFBANLIST) ? "ban" :
+                 !strcmp(cmd, RPL_ENDOFEXCEPTLIST) ? "exception" : "invite";
+    sds host_msg = sdscatprintf(sdsempty(), "%s %s %s %s :End of channel %s list\r\n",
+                                prefix, cmd, nickname, channel_name, what);
+
+    int rc = send_msg(client_socket, ctx, host_msg);
+    sdsfree(host_msg);
+
+    return rc;
+}
+
+
 int server_reply_welcome(server_ctx *ctx, client_t *client, conn_info_t *conn)
 {
     /*
@@ -848,18 +1136,20 @@ int server_reply_lusers(server_ctx *ctx, sds nick, conn_info_t *conn)
     sds server_hostname = conn->server_hostname;
     sds client_hostname = conn->client_hostname;
 
-    /* Count number of users */
-    pthread_mutex_lock(&ctx->clients_lock);
-    int num_connections = HASH_COUNT(ctx->client_hashtable);
-    pthread_mutex_unlock(&ctx->clients_lock);
-
-    /* Count num_connected_users, num_of_total_connections */
-    pthread_mutex_lock(&ctx->lock);
-    int num_of_users = ctx->num_connected_users;
-    int num_of_total_connections = ctx->total_connections;
-    pthread_mutex_unlock(&ctx->lock);
+    /* Read without any lock: the counters are summed over their shards,
+     * so a registration happening meanwhile may show in one and not yet
+     * in another */
+    int num_connections = counter_read(&ctx->counters, COUNTER_CLIENTS);
+    int num_of_users = counter_read(&ctx->counters, COUNTER_USERS);
+    int num_of_total_connections = counter_read(&ctx->counters, COUNTER_CONNECTIONS);
+    int num_of_irc_operator = counter_read(&ctx->counters, COUNTER_OPERATORS);
+    int num_of_channels = counter_read(&ctx->counters, COUNTER_CHANNELS);
 
     int num_of_unknown_connections = num_of_total_connections - num_connections;
+    if (num_of_unknown_connections < 0)
+    {
+        num_of_unknown_connections = 0;
+    }
 
     /* RPL_LUSERCLIENT */
     sds serclient_msg = sdscatprintf(sdsempty(),
@@ -875,12 +1165,6 @@ int server_reply_lusers(server_ctx *ctx, sds nick, conn_info_t *conn)
     }
 
     /* RPL_LUSEROP */
-    irc_oper_t **irc_operators_hashtable = &ctx->irc_operators_hashtable;
-    /* Count num_of_irc_operator */
-    pthread_mutex_lock(&ctx->operators_lock);
-    int num_of_irc_operator = HASH_COUNT(ctx->irc_operators_hashtable);
-    pthread_mutex_unlock(&ctx->operators_lock);
-
     sds serop_msg = sdscatprintf(sdsempty(),
                                  ":%s %s %s %d :operator(s) online\r\n",
                                  server_hostname,
@@ -905,13 +1189,6 @@ int server_reply_lusers(server_ctx *ctx, sds nick, conn_info_t *conn)
     }
 
     /* RPL_LUSERCHANNELS */
-    channel_t **channel_hashtable = &ctx->channels_hashtable;
-
-    /* Count num_of_channels */
-    pthread_mutex_lock(&ctx->channels_lock);
-    int num_of_channels = HASH_COUNT(ctx->channels_hashtable);
-    pthread_mutex_unlock(&ctx->channels_lock);
-
     sds serchannel_msg = sdscatprintf(sdsempty(), ":%s %s %s %d :channels formed\r\n",
                                       server_hostname,
                                       RPL_LUSERCHANNELS,
@@ -941,4 +1218,327 @@ int server_reply_lusers(server_ctx *ctx, sds nick, conn_info_t *conn)
     sdsfree(serme_msg);
 
     return MSG_OK;
-}
\ No newline at end of file
+}
+
+
+int server_reply_stats(server_ctx *ctx, sds nick, sds query, conn_info_t *conn)
+{
+    /*
+     * server_reply_stats - A thread-safe function to send STATS reply.
+     *
+     * ctx: server_context
+     *
+     * nick: nickname of the operator asking
+     *
+     * query: the STATS letter: "m" for command counts, "l" for command
+     * latencies, "t" for connections and traffic, "u" for uptime
+     *
+     * conn: connection information with serverhostname, clienthostname and client_socket
+     *
+     * Return: MSG_OK/MSG_ERROR
+     *
+     */
+    sds server_hostname = conn->server_hostname;
+    sds reply = sdsempty();
+
+    if (!strncmp(query, "m", MAX_STR_LEN))
+    {
+        /* RPL_STATSCOMMANDS: one line per command that was used */
+        for (int slot = 0; slot < STATS_MAX_COMMANDS; slot++)
+        {
+            uint64_t count = stats_command_count(slot);
+            if (stats_command_name(slot) == NULL || count == 0)
+            {
+                continue;
+            }
+            reply = sdscatprintf(reply, ":%s %s %s %s %llu\r\n",
+                                 server_hostname, RPL_STATSCOMMANDS, nick,
+                                 stats_command_name(slot), (unsigned long long)count);
+        }
+    }
+    else if (!strncmp(query, "l", MAX_STR_LEN))
+    {
+        /* RPL_STATSDEBUG: latency percentiles of each phase, in microseconds */
+        for (int slot = 0; slot < STATS_MAX_COMMANDS; slot++)
+        {
+            stats_latency_t queue, exec;
+            if (stats_command_name(slot) == NULL || stats_command_count(slot) == 0)
+            {
+                continue;
+            }
+            stats_command_latency(slot, STATS_QUEUE, &queue);
+            stats_command_latency(slot, STATS_EXEC, &exec);
+            reply = sdscatprintf(reply,
+                                 ":%s %s %s :%s recv-dispatch p50=%llu p90=%llu p99=%llu max=%llu"
+                                 " dispatch-flush p50=%llu p90=%llu p99=%llu max=%llu\r\n",
+                                 server_hostname, RPL_STATSDEBUG, nick, stats_command_name(slot),
+                                 (unsigned long long)queue.p50, (unsigned long long)queue.p90,
+                                 (unsigned long long)queue.p99, (unsigned long long)queue.max,
+                                 (unsigned long long)exec.p50, (unsigned long long)exec.p90,
+                                 (unsigned long long)exec.p99, (unsigned long long)exec.max);
+        }
+    }
+    else if (!strncmp(query, "t", MAX_STR_LEN))
+    {
+        /* RPL_STATSDEBUG: connections, traffic and send path depth */
+        sds summary = stats_summary();
+        reply = sdscatprintf(reply, ":%s %s %s :%s\r\n",
+                             server_hostname, RPL_STATSDEBUG, nick, summary);
+        sdsfree(summary);
+    }
+    else if (!strncmp(query, "u", MAX_STR_LEN))
+    {
+        /* RPL_STATSUPTIME */
+        uint64_t up = stats_uptime();
+        reply = sdscatprintf(reply, ":%s %s %s :Server Up %llu days %llu:%02llu:%02llu\r\n",
+                             server_hostname, RPL_STATSUPTIME, nick,
+                             (unsigned long long)(up / 86400),
+                             (unsigned long long)(up % 86400 / 3600),
+                             (unsigned long long)(up % 3600 / 60),
+                             (unsigned long long)(up % 60));
+    }
+
+    /* RPL_ENDOFSTATS */
+    reply = sdscatprintf(reply, ":%s %s %s %s :End of STATS report\r\n",
+                         server_hostname, RPL_ENDOFSTATS, nick, query);
+
+    int rc = send_msg(conn->client_socket, ctx, reply);
+    sdsfree(reply);
+
+    return rc;
+}
+
+
+/*
+ * names_pack - Pack member list pieces into RPL_NAMREPLY lines of at most
+ * NAMES_LINE_MAX bytes
+ *
+ * out: the lines are appended to it
+ *
+ * header: the start of every line, up to and including the ':'
+ *
+ * pieces: space separated "[@]nick" entries
+ *
+ * count: number of pieces
+ *
+ * Return: out
+ */
+static sds names_pack(sds out, sds header, sds *pieces, int count)
+{
+    size_t budget = sdslen(header) < NAMES_LINE_MAX ? NAMES_LINE_MAX - sdslen(header) : 0;
+    size_t used = 0;
+
+    for (int i = 0; i < count; i++)
+    {
+        char *p = pieces[i];
+        size_t len = sdslen(pieces[i]);
+
+        while (len > 0)
+        {
+            /* Copy the whole piece if it fits, else as many entries as fit */
+            size_t take = len;
+            size_t room = used == 0 ? budget : (budget > used + 1 ? budget - used - 1 : 0);
+
+            if (take > room)
+            {
+                take = 0;
+                for (char *space = memchr(p, ' ', len); space != NULL && (size_t)(space - p) <= room;
+                     space = memchr(space + 1, ' ', len - (space + 1 - p)))
+                {
+                    take = space - p;
+                }
+                if (take == 0 && used == 0)
+                {
+                    /* A single entry longer than a line; send it anyway */
+                    char *space = memchr(p, ' ', len);
+                    take = space ? (size_t)(space - p) : len;
+                }
+            }
+
+            if (take == 0)
+            {
+                out = sdscatlen(out, "\r\n", 2);
+                used = 0;
+                continue;
+            }
+
+            if (used == 0)
+            {
+                out = sdscatsds(out, header);
+            }
+            else
+            {
+                out = sdscatlen(out, " ", 1);
+                used++;
+            }
+            out = sdscatlen(out, p, take);
+            used += take;
+
+            /* Skip the space separating the entry from the rest */
+            p += take;
+            len -= take;
+            if (len > 0 && *p == ' ')
+            {
+                p++;
+                len--;
+            }
+        }
+    }
+
+    if (used > 0)
+    {
+        out = sdscatlen(out, "\r\n", 2);
+    }
+
+    return out;
+}
+
+
+sds server_reply_names_lines(server_ctx *ctx, sds prefix, sds nickname, channel_t *c)
+{
+    /*
+     * server_reply_names_lines - Serialize the RPL_NAMREPLY lines of a
+     * channel, split to fit in NAMES_LINE_MAX bytes each (Not thread-safe,
+     * called with the channel's table taken by server_lock_CHANNELS)
+     *
+     * ctx: server_context
+     *
+     * prefix: ":" followed by the server hostname
+     *
+     * nickname: nickname of the user asking
+     *
+     * c: the channel
+     *
+     * Return: a new sds string, empty if there is nothing to send
+     *
+     * The member list is rebuilt from the members' nicks if it is stale,
+     * which change under clients_lock.
+     */
+    int count;
+    sds header = sdscatprintf(sdsempty(), "%s %s %s = %s :",
+                              prefix, RPL_NAMREPLY, nickname, c->channel_name);
+
+    trace_mutex_lock(&ctx->clients_lock, "clients_lock");
+    sds *pieces = channel_names_get(c, &count);
+    pthread_mutex_unlock(&ctx->clients_lock);
+    sds out = names_pack(sdsempty(), header, pieces, count);
+
+    sdsfree(header);
+
+    return out;
+}
+
+
+int server_reply_names(server_ctx *ctx, sds prefix, sds nickname, channel_t *c, int client_socket)
+{
+    /*
+     * server_reply_names - A thread-safe function to send the RPL_NAMREPLY
+     * lines of a channel, split to fit in NAMES_LINE_MAX bytes each.
+     *
+     * ctx: server_context
+     *
+     * prefix: ":" followed by the server hostname
+     *
+     * nickname: nickname of the user asking
+     *
+     * c: the channel
+     *
+     * client_socket: client socket for the reply
+     *
+     * Return: MSG_OK/MSG_ERROR
+     *
+     */
+    int rc = MSG_OK;
+
+    server_lock_CHANNELS(ctx);
+    sds out = server_reply_names_lines(ctx, prefix, nickname, c);
+    server_unlock_CHANNELS(ctx);
+
+    if (sdslen(out) > 0)
+    {
+        rc = send_msg(client_socket, ctx, out);
+    }
+
+    sdsfree(out);
+
+    return rc;
+}
+
+
+static int compare_sockets(const void *a, const void *b)
+{
+    int x = *(const int *)a, y = *(const int *)b;
+
+    return (x > y) - (x < y);
+}
+
+
+int server_reply_names_nochannel(server_ctx *ctx, sds prefix, sds nickname,
+                                 const int *members, int nmembers, int client_socket)
+{
+    /*
+     * server_reply_names_nochannel - A thread-safe function to send the
+     * RPL_NAMREPLY lines listing the users that are in no channel.
+     *
+     * ctx: server_context
+     *
+     * prefix: ":" followed by the server hostname
+     *
+     * nickname: nickname of the user asking
+     *
+     * members: with channel shards, the sorted sockets of the users in some
+     * channel, gathered from the shards; NULL to look at the users'
+     * memberships instead
+     *
+     * nmembers: the number of member sockets
+     *
+     * client_socket: client socket for the reply
+     *
+     * Return: MSG_OK/MSG_ERROR
+     *
+     */
+    sds *pieces = NULL;
+    int count = 0;
+    int rc = MSG_OK;
+    sds out = sdsempty();
+    sds header = sdscatprintf(sdsempty(), "%s %s %s * * :", prefix, RPL_NAMREPLY, nickname);
+
+    /* The memberships of a user are its list of channels, which the
+     * shards change without channels_lock */
+    if (members == NULL)
+    {
+        trace_mutex_lock(&ctx->channels_lock, "channels_lock");
+    }
+    trace_mutex_lock(&ctx->clients_lock, "clients_lock");
+    for (client_t *client = ctx->client_hashtable; client != NULL; client = client->hh.next)
+    {
+        if (client->info.state != REGISTERED)
+        {
+            continue;
+        }
+        if (members == NULL ? client->channels != NULL :
+            bsearch(&client->socket, members, nmembers, sizeof(int), compare_sockets) != NULL)
+        {
+            continue;
+        }
+        pieces = realloc(pieces, (count + 1) * sizeof(sds));
+        pieces[count++] = sdsdup(client->info.nick);
+    }
+    pthread_mutex_unlock(&ctx->clients_lock);
+    if (members == NULL)
+    {
+        pthread_mutex_unlock(&ctx->channels_lock);
+    }
+
+    out = names_pack(out, header, pieces, count);
+    if (sdslen(out) > 0)
+    {
+        rc = send_msg(client_socket, ctx, out);
+    }
+
+    sdsfreesplitres(pieces, count);
+    sdsfree(header);
+    sdsfree(out);
+
+    return rc;
+}
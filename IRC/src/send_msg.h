@@ -7,6 +7,10 @@
 #include "log.h"
 #include "reply.h"
 #include "msg.h"
+#include "server_cmd.h"
+#include "history.h"
+
+#define NAMES_LINE_MAX 510 /* Longest RPL_NAMREPLY line, without the "\r\n" */
 
 /* This sendall fucntion is cited from this link: https://beej.us/guide/bgnet/html/#sendall
  *
@@ -61,7 +65,8 @@ int server_reply_nick(server_ctx *ctx,
                       int argc, int client_socket);
 
 /*
- * server_reply_quit_relay - A thread-safe function to relay QUIT reply.
+ * server_reply_nick_relay - A thread-safe function to relay NICK reply
+ * to every user sharing a channel with the user, once each.
  *
  * ctx: server_context
  *
@@ -71,14 +76,41 @@ int server_reply_nick(server_ctx *ctx,
  *
  * argc: count of the argument numbers
  *
- * client_socket: client socket for the reply
+ * sockets: the sockets of the users sharing a channel with the user,
+ * each once, from server_find_NEIGHBORS or shard_neighbors
+ *
+ * count: the number of sockets
+ *
+ * Return: MSG_OK/MSG_ERROR
+ *
+ */
+int server_reply_nick_relay(server_ctx *ctx,
+                            sds prefix, sds *cmdtokens,
+                            int argc, const int *sockets, int count);
+
+/*
+ * server_reply_quit_relay - A thread-safe function to relay QUIT reply
+ * to every user sharing a channel with the user, once each.
+ *
+ * ctx: server_context
+ *
+ * prefix: buffer message to be sent
+ *
+ * cmdtokens: tokenized command stacks
+ *
+ * argc: count of the argument numbers
+ *
+ * sockets: the sockets of the users sharing a channel with the user,
+ * each once, from server_find_NEIGHBORS or shard_neighbors
+ *
+ * count: the number of sockets
  *
  * Return: MSG_OK/MSG_ERROR
  *
  */
 int server_reply_quit_relay(server_ctx *ctx,
                             sds prefix, sds *cmdtokens,
-                            int argc, int client_socket);
+                            int argc, const int *sockets, int count);
 
 /*
  * server_reply_quit - A thread-safe function to send QUIT reply.
@@ -107,7 +139,7 @@ int server_reply_quit(server_ctx *ctx, sds *cmdtokens,
  *
  * prefix: buffer message to be sent
  *
- * cmd: reply_code
+ * cmd: reply_code, RPL_ENDOFNAMES
  *
  * nickname: nickname of the joined user
  *
@@ -115,15 +147,12 @@ int server_reply_quit(server_ctx *ctx, sds *cmdtokens,
  *
  * client_socket: client socket for the reply
  *
- * c: the channel the user joined
- *
  * Return: MSG_OK/MSG_ERROR
  *
  */
 int server_reply_join(server_ctx *ctx,
                       sds prefix, char *cmd, sds nickname,
-                      sds channel_name, int client_socket,
-                      channel_t *c);
+                      sds channel_name, int client_socket);
 
 /*
  * server_reply_join_relay - A thread-safe function to relay JOIN reply.
@@ -146,7 +175,8 @@ int server_reply_join_relay(server_ctx *ctx,
                             sds channel_name, int client_socket);
 
 /*
- * server_reply_privmsg - A thread-safe function to relay PRIVMSG reply.
+ * server_reply_privmsg - A thread-safe function to relay PRIVMSG reply
+ * to the recipients of one target.
  *
  * ctx: server_context
  *
@@ -156,14 +186,14 @@ int server_reply_join_relay(server_ctx *ctx,
  *
  * argc: count of the argument numbers
  *
- * client_socket: client socket for the reply
+ * target: the target, resolved by server_resolve_TARGETS
  *
  * Return: MSG_OK/MSG_ERROR
  *
  */
 int server_reply_privmsg(server_ctx *ctx,
                          sds prefix, sds *cmdtokens, int argc,
-                         int client_socket);
+                         msg_target_t *target);
 
 /*
  * server_reply_whois - A thread-safe function to relay WHOIS reply.
@@ -247,6 +277,48 @@ int server_reply_listend(server_ctx *ctx,
                          sds prefix, char *cmd, sds nickname,
                          int client_socket);
 
+/*
+ * server_reply_who - A thread-safe function to form WHO reply.
+ *
+ * ctx: server_context
+ *
+ * prefix: buffer message to be sent
+ *
+ * nickname: the nickname of the user asking
+ *
+ * channel: the channel of the listed user, or "*"
+ *
+ * server_hostname: the server the listed user is on
+ *
+ * row: the listed user
+ *
+ * Return: sds string
+ *
+ */
+sds server_reply_who(server_ctx *ctx,
+                     sds prefix, sds nickname, sds channel,
+                     sds server_hostname, who_row_t *row);
+
+/*
+ * server_reply_endofwho - A thread-safe function to send WHO end reply.
+ *
+ * ctx: server_context
+ *
+ * prefix: buffer message to be sent
+ *
+ * nickname: the nickname of the user asking
+ *
+ * mask: the channel or mask asked for, or "*"
+ *
+ * client_socket: client socket for the reply
+ *
+ * Return: MSG_OK/MSG_ERROR
+ *
+ */
+int server_reply_endofwho(server_ctx *ctx,
+                          sds prefix, sds nickname, sds mask,
+                          int client_socket);
+
 /*
  * server_reply_oper - A thread-safe function to send OPER reply.
  *
@@ -306,6 +378,69 @@ int server_reply_part(server_ctx *ctx,
 int server_reply_mode(server_ctx *ctx, sds prefix,
                       sds *cmdtokens, int client_socket);
 
+/*
+ * server_reply_history - A thread-safe function to replay channel history.
+ *
+ * ctx: server_context
+ *
+ * lines: the messages, copied by history_copy
+ *
+ * count: the number of messages
+ *
+ * client_socket: client socket for the reply
+ *
+ * Return: MSG_OK/MSG_ERROR
+ *
+ */
+int server_reply_history(server_ctx *ctx, sds *lines, int count, int client_socket);
+
+/*
+ * server_reply_banlist - A thread-safe function to form a ban, exception
+ * or invite list reply.
+ *
+ * ctx: server_context
+ *
+ * prefix: buffer message to be sent
+ *
+ * cmd: reply_code, RPL_BANLIST, RPL_EXCEPTLIST or RPL_INVITELIST
+ *
+ * nickname: the nickname of the user asking
+ *
+ * channel_name: the channel_name
+ *
+ * entry: the listed mask
+ *
+ * Return: sds string
+ *
+ */
+sds server_reply_banlist(server_ctx *ctx,
+                         sds prefix, char *cmd, sds nickname,
+                         sds channel_name, banlist_entry_t *entry);
+
+/*
+ * server_reply_endofbanlist - A thread-safe function to send the end of
+ * a ban, exception or invite list.
+ *
+ * ctx: server_context
+ *
+ * prefix: buffer message to be sent
+ *
+ * cmd: reply_code, RPL_ENDOFBANLIST, RPL_ENDOFEXCEPTLIST or
+ * RPL_ENDOFINVITELIST
+ *
+ * nickname: the nickname of the user asking
+ *
+ * channel_name: the channel_name
+ *
+ * client_socket: client socket for the reply
+ *
+ * Return: MSG_OK/MSG_ERROR
+ *
+ */
+int server_reply_endofbanlist(server_ctx *ctx,
+                              sds prefix, char *cmd, sds nickname,
+                              sds channel_name, int client_socket);
+
 /*
  * server_reply_welcome - A thread-safe function to send
  welcome reply for NICK and USER.
@@ -354,4 +489,83 @@ int reply_welcome(server_ctx *ctx, client_t *client, conn_info_t *conn);
  */
 int server_reply_lusers(server_ctx *ctx, sds nick, conn_info_t *conn);
 
+/*
+ * server_reply_stats - A thread-safe function to send STATS reply.
+ *
+ * ctx: server_context
+ *
+ * nick: nickname of the operator asking
+ *
+ * query: the STATS letter: "m" for command counts, "l" for command
+ * latencies, "t" for connections and traffic, "u" for uptime
+ *
+ * conn: connection information with serverhostname,
+ * clienthostname and client_socket
+ *
+ * Return: MSG_OK/MSG_ERROR
+ *
+ */
+int server_reply_stats(server_ctx *ctx, sds nick, sds query, conn_info_t *conn);
+
+/*
+ * server_reply_names_lines - Serialize the RPL_NAMREPLY lines of a
+ * channel, split to fit in NAMES_LINE_MAX bytes each (Not thread-safe,
+ * called with the channel's table taken by server_lock_CHANNELS)
+ *
+ * ctx: server_context
+ *
+ * prefix: ":" followed by the server hostname
+ *
+ * nickname: nickname of the user asking
+ *
+ * c: the channel
+ *
+ * Return: a new sds string, empty if there is nothing to send
+ *
+ */
+sds server_reply_names_lines(server_ctx *ctx, sds prefix, sds nickname, channel_t *c);
+
+/*
+ * server_reply_names - A thread-safe function to send the RPL_NAMREPLY
+ * lines of a channel, split to fit in NAMES_LINE_MAX bytes each.
+ *
+ * ctx: server_context
+ *
+ * prefix: ":" followed by the server hostname
+ *
+ * nickname: nickname of the user asking
+ *
+ * c: the channel
+ *
+ * client_socket: client socket for the reply
+ *
+ * Return: MSG_OK/MSG_ERROR
+ *
+ */
+int server_reply_names(server_ctx *ctx, sds prefix, sds nickname, channel_t *c, int client_socket);
+
+/*
+ * server_reply_names_nochannel - A thread-safe function to send the
+ * RPL_NAMREPLY lines listing the users that are in no channel.
+ *
+ * ctx: server_context
+ *
+ * prefix: ":" followed by the server hostname
+ *
+ * nickname: nickname of the user asking
+ *
+ * members: with channel shards, the sorted sockets of the users in some
+ * channel, gathered from the shards; NULL to look at the users'
+ * memberships instead
+ *
+ * nmembers: the number of member sockets
+ *
+ * client_socket: client socket for the reply
+ *
+ * Return: MSG_OK/MSG_ERROR
+ *
+ */
+int server_reply_names_nochannel(server_ctx *ctx, sds prefix, sds nickname,
+                                 const int *members, int nmembers, int client_socket);
+
 #endif
@@ -0,0 +1,126 @@
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include "serial.h"
+#include "banlist.h"
+#include "../lib/sds/sds.h"
+
+
+sds serial_put_u32(sds b, uint32_t v)
+{
+    return sdscatlen(b, &v, sizeof(v));
+}
+
+
+sds serial_put_u64(sds b, uint64_t v)
+{
+    return sdscatlen(b, &v, sizeof(v));
+}
+
+
+sds serial_put_str(sds b, const char *str)
+{
+    if (str == NULL)
+    {
+        return serial_put_u32(b, SERIAL_NULL_STR);
+    }
+    b = serial_put_u32(b, strlen(str));
+    return sdscat(b, str);
+}
+
+
+sds serial_put_banlist(sds b, const banlist_t *list)
+{
+    b = serial_put_u32(b, list->count);
+    for (int i = 0; i < list->count; i++)
+    {
+        b = serial_put_str(b, list->entries[i].mask);
+        b = serial_put_str(b, list->entries[i].setter);
+        b = serial_put_u64(b, (uint64_t)list->entries[i].set_at);
+    }
+    return b;
+}
+
+
+static void get_bytes(serial_reader_t *r, void *out, size_t n)
+{
+    if (r->bad || r->left < n)
+    {
+        r->bad = true;
+        memset(out, 0, n);
+        return;
+    }
+    memcpy(out, r->p, n);
+    r->p += n;
+    r->left -= n;
+}
+
+
+uint32_t serial_get_u32(serial_reader_t *r)
+{
+    uint32_t v;
+    get_bytes(r, &v, sizeof(v));
+    return v;
+}
+
+
+uint64_t serial_get_u64(serial_reader_t *r)
+{
+    uint64_t v;
+    get_bytes(r, &v, sizeof(v));
+    return v;
+}
+
+
+sds serial_get_str(serial_reader_t *r)
+{
+    uint32_t len = serial_get_u32(r);
+
+    if (r->bad || len == SERIAL_NULL_STR)
+    {
+        return NULL;
+    }
+    if (r->left < len)
+    {
+        r->bad = true;
+        return NULL;
+    }
+    sds str = sdsnewlen(r->p, len);
+    r->p += len;
+    r->left -= len;
+    return str;
+}
+
+
+void serial_get_banlist(serial_reader_t *r, banlist_t *list)
+{
+    uint32_t count = serial_get_u32(r);
+    banlist_entry_t *entries;
+    int n = 0;
+
+    if (r->bad || count == 0 || count > r->left)
+    {
+        return;
+    }
+    entries = malloc(count * sizeof(banlist_entry_t));
+    for (uint32_t i = 0; i < count && !r->bad; i++)
+    {
+        sds mask = serial_get_str(r);
+        sds setter = serial_get_str(r);
+        time_t set_at = (time_t)serial_get_u64(r);
+
+        if (mask == NULL || setter == NULL)
+        {
+            sdsfree(mask);
+            sdsfree(setter);
+            continue;
+        }
+        entries[n].mask = mask;
+        entries[n].setter = setter;
+        entries[n].set_at = set_at;
+        n++;
+    }
+    banlist_add_entries(list, entries, n);
+    free(entries);
+}
@@ -0,0 +1,110 @@
+#ifndef SERIAL_H_
+#define SERIAL_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "banlist.h"
+#include "../lib/sds/sds.h"
+
+#define SERIAL_NULL_STR UINT32_MAX /* Length marking a NULL string */
+
+/*
+ * Binary encoding of server state, shared by the live upgrade and the
+ * snapshot file: native-endian integers and strings, each string a 32-bit
+ * length followed by its bytes. Both ends run on the same host, so there
+ * is no need for a portable encoding.
+ */
+
+/* Cursor over encoded bytes */
+typedef struct serial_reader
+{
+    const char *p;
+    size_t left;
+    bool bad;           /* Read past the end */
+} serial_reader_t;
+
+/*
+ * serial_put_u32 - Append a 32-bit integer
+ *
+ * b: the buffer
+ *
+ * v: the integer
+ *
+ * Return: the buffer, which may have moved
+ */
+sds serial_put_u32(sds b, uint32_t v);
+
+/*
+ * serial_put_u64 - Append a 64-bit integer
+ *
+ * b: the buffer
+ *
+ * v: the integer
+ *
+ * Return: the buffer, which may have moved
+ */
+sds serial_put_u64(sds b, uint64_t v);
+
+/*
+ * serial_put_str - Append a string
+ *
+ * b: the buffer
+ *
+ * str: the string, or NULL
+ *
+ * Return: the buffer, which may have moved
+ */
+sds serial_put_str(sds b, const char *str);
+
+/*
+ * serial_put_banlist - Append the masks of a +b, +e or +I list, with who
+ * set them and when
+ *
+ * b: the buffer
+ *
+ * list: the list
+ *
+ * Return: the buffer, which may have moved
+ */
+sds serial_put_banlist(sds b, const banlist_t *list);
+
+/*
+ * serial_get_u32 - Read a 32-bit integer
+ *
+ * r: the cursor, marked bad if there are not enough bytes left
+ *
+ * Return: the integer, or 0 past the end
+ */
+uint32_t serial_get_u32(serial_reader_t *r);
+
+/*
+ * serial_get_u64 - Read a 64-bit integer
+ *
+ * r: the cursor, marked bad if there are not enough bytes left
+ *
+ * Return: the integer, or 0 past the end
+ */
+uint64_t serial_get_u64(serial_reader_t *r);
+
+/*
+ * serial_get_str - Read a string
+ *
+ * r: the cursor, marked bad if there are not enough bytes left
+ *
+ * Return: the string, or NULL for a NULL string or past the end
+ */
+sds serial_get_str(serial_reader_t *r);
+
+/*
+ * serial_get_banlist - Read masks written by serial_put_banlist into a list
+ *
+ * r: the cursor, marked bad if there are not enough bytes left
+ *
+ * list: an initialized list the masks are added to
+ *
+ * Return: nothing
+ */
+void serial_get_banlist(serial_reader_t *r, banlist_t *list);
+
+#endif
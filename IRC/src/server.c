@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdbool.h>
@@ -11,6 +12,8 @@
 #include <signal.h>
 #include <errno.h>
 #include <time.h>
+#include <poll.h>
+#include <fcntl.h>
 #include "handlers.h"
 #include <pthread.h>
 #include "../lib/sds/sds.h"
@@ -19,6 +22,18 @@
 #include "server_cmd.h"
 #include "log.h"
 #include "reply.h"
+#include "network.h"
+#include "stats.h"
+#include "chanlist.h"
+#include "history.h"
+#include "upgrade.h"
+#include "persist.h"
+#include "link.h"
+#include "pool.h"
+#include "shard.h"
+#include "tls.h"
+#include "capture.h"
+#include "trace.h"
 
 /*
  * service_single_client - single worker thread function
@@ -30,6 +45,16 @@
 void *service_single_client(void *args);
 
 
+/*
+ * worker_exit - Cleanup handler of a worker thread
+ *
+ * args: worker arguments
+ *
+ * Return: nothing
+ */
+static void worker_exit(void *args);
+
+
 /*
  * free_ctx - free context and all its allocated memory
  *
@@ -40,37 +65,82 @@ void *service_single_client(void *args);
 void free_ctx(server_ctx *ctx);
 
 
-int server(char *port, char *passwd, char *servername, char *network_file)
+int server(server_config *config)
 {
     /*
      * server - Initialize server context and handle multi-clients
      *
-     * port: port number
-     *
-     * passwd: operator password specified in main.c
-     *
-     * host: server_hostname
-     *
-     * network_file: network file specified in main.c
+     * config: settings of the server
      *
      * Return: EXIT_SUCCESS/EXIT_FAILURE
      *
      */
+    char *port = config->port;
+
     /* Initialize context */
     server_ctx *ctx = calloc(1, sizeof(server_ctx));
-    ctx->num_connected_users = 0;                   /* Number of connected clients, used in LUSERS */
-    ctx->total_connections = 0;                     /* Number of total connections, used in LUSERS */
-    ctx->password = passwd;                         /* User password, read from input */
+    ctx->password = config->passwd;                 /* User password, read from input */
     ctx->client_hashtable = NULL;                   /* Client_hashtable to store all connections */
     ctx->nicks_hashtable = NULL;                    /* Nicks_hashtable to store all user nicknames */
     ctx->channels_hashtable = NULL;                 /* Channels_hashtable to store all channels */
     ctx->irc_operators_hashtable = NULL;            /* IRC_operator_hashtable to store all operators */
-    pthread_mutex_init(&ctx->lock, NULL);           /* Initiate lock to protect num_connection and total_connections */
+    ctx->max_targets = config->max_targets;         /* MAXTARGETS for PRIVMSG, NOTICE, JOIN and PART */
+    ctx->history_lines = config->history_lines;     /* Messages kept per channel, 0 to keep none */
+    ctx->history_max_bytes = config->history_max_bytes; /* Memory cap of all channel histories */
+    ctx->history_bytes = 0;
+    ctx->histories = NULL;
+    ctx->history_newest = NULL;
+    ctx->history_oldest = NULL;
+    ctx->conns = NULL;
+    ctx->persist_file = config->persist_file;       /* Snapshot file, NULL to keep none */
+    ctx->persist_pending = NULL;
+    ctx->persist_saved = NULL;
+    ctx->persist_dirty = NULL;
+    ctx->persist_opers_dirty = false;
+    ctx->pool = NULL;                               /* Split mode threads, started below if asked for */
+    ctx->shards = NULL;                             /* Channel shards, started below if asked for */
+    ctx->nshards = 0;
+    ctx->tls = NULL;                                /* TLS listener, started below if asked for */
+    ctx->backlog = config->backlog;                 /* Pending connections of the listening ports */
+    ctx->link_compress = config->link_compress;     /* Compression of the server links, -1 for none */
+    ctx->link_flush = config->link_flush;
+    ctx->spare_fd = open("/dev/null", O_RDONLY | O_CLOEXEC); /* Released when out of descriptors */
+    pthread_mutex_init(&ctx->lock, NULL);           /* Initiate lock to protect the ID counters */
     pthread_mutex_init(&ctx->channels_lock, NULL);  /* Initiate lock to protect channels hashtable */
     pthread_mutex_init(&ctx->clients_lock, NULL);   /* Initiate lock to protect clients hashtable */
     pthread_mutex_init(&ctx->nicks_lock, NULL);     /* Initiate lock to protect nicks hashtable */
     pthread_mutex_init(&ctx->operators_lock, NULL); /* Initiate lock to protect operators hashtable */
-    pthread_mutex_init(&ctx->socket_lock, NULL);    /* Initiate lock to protect sendall */
+    for (int i = 0; i < SOCKET_LOCKS; i++)
+    {
+        pthread_mutex_init(&ctx->socket_locks[i], NULL); /* Initiate locks to protect sendall */
+    }
+    pthread_mutex_init(&ctx->chanlist_lock, NULL);  /* Initiate lock to protect the LIST snapshot */
+    pthread_mutex_init(&ctx->history_lock, NULL);   /* Initiate lock to protect the channel histories */
+    pthread_mutex_init(&ctx->persist_lock, NULL);   /* Initiate lock to protect the snapshot's mask lists */
+    pthread_mutex_init(&ctx->conns_lock, NULL);     /* Initiate lock to protect the connections */
+    pthread_mutex_init(&ctx->links_lock, NULL);     /* Initiate lock to protect the server links */
+
+    /* A waiting upgrade must not starve behind a steady stream of commands */
+    pthread_rwlockattr_t upgrade_attr;
+    pthread_rwlockattr_init(&upgrade_attr);
+    pthread_rwlockattr_setkind_np(&upgrade_attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+    pthread_rwlock_init(&ctx->upgrade_lock, &upgrade_attr);
+    pthread_rwlockattr_destroy(&upgrade_attr);
+
+    /* In a network, the port to listen on comes from our entry in the network file */
+    ctx->network = NULL;
+    if (config->network_file != NULL)
+    {
+        ctx->network = network_load(config->network_file, config->servername);
+        if (ctx->network == NULL)
+        {
+            chilog(CRITICAL, "Could not load network file %s", config->network_file);
+            free_ctx(ctx);
+            return EXIT_FAILURE;
+        }
+        port = ctx->network->self->port;
+        ctx->links = calloc(ctx->network->num_servers, sizeof(struct link *));
+    }
 
     sigset_t new;
     sigemptyset(&new);
@@ -80,14 +150,80 @@ int server(char *port, char *passwd, char *servername, char *network_file)
         perror("Unable to mask SIGPIPE");
         exit(-1);
     }
-    int server_socket;
+
+    /* Start the stats module after masking SIGPIPE so its thread inherits the mask */
+    if (stats_init(config->stats_socket) == CHIRC_ERROR)
+    {
+        free_ctx(ctx);
+        return EXIT_FAILURE;
+    }
+    register_handler_stats();
+
+    /* Like the stats thread, after masking SIGPIPE */
+    if (config->trace_socket != NULL && trace_init(config->trace_socket, config->trace_rate) == CHIRC_ERROR)
+    {
+        free_ctx(ctx);
+        return EXIT_FAILURE;
+    }
+
+    /* Before a live upgrade hands connections over, so they are captured too */
+    if (config->capture_file != NULL && capture_init(config->capture_file) == CHIRC_ERROR)
+    {
+        free_ctx(ctx);
+        return EXIT_FAILURE;
+    }
+
+    /* Before a live upgrade hands connections over, as they go to the pool */
+    if (config->workers > 0 &&
+        pool_init(ctx, config->io_threads, config->workers, config->uring) == CHIRC_ERROR)
+    {
+        free_ctx(ctx);
+        return EXIT_FAILURE;
+    }
+    if (config->shards > 0 && shard_init(ctx, config->shards) == CHIRC_ERROR)
+    {
+        free_ctx(ctx);
+        return EXIT_FAILURE;
+    }
+
+    /* The same for every connection, so looked up once */
+    if (gethostname(ctx->server_host, sizeof ctx->server_host) == -1)
+    {
+        chilog(ERROR, "gethostname() failed");
+        free_ctx(ctx);
+        return EXIT_FAILURE;
+    }
+    if (ctx->network != NULL)
+    {
+        /* The prefix of the replies names this server in its network */
+        snprintf(ctx->server_host, sizeof ctx->server_host, "%s", ctx->network->self->servername);
+    }
+
+    int server_socket = -1;
     int client_socket;
     struct addrinfo hints, *res, *p;
-    struct sockaddr_storage *client_addr = NULL;
     int yes = 1;
-    socklen_t sin_size = sizeof(struct sockaddr_in);
-    pthread_t worker_thread;
-    worker_args(*wa);
+
+    /* Take over the sockets and state of a running server, if there is one */
+    if (config->upgrade_socket != NULL &&
+        upgrade_resume(ctx, config->upgrade_socket, &server_socket) == CHIRC_ERROR)
+    {
+        free_ctx(ctx);
+        return EXIT_FAILURE;
+    }
+
+    if (capture_start() == CHIRC_ERROR)
+    {
+        free_ctx(ctx);
+        return EXIT_FAILURE;
+    }
+
+    /* Otherwise restore the mask lists and operators saved before a crash or restart */
+    if (config->persist_file != NULL && server_socket == -1 && persist_load(ctx) == CHIRC_ERROR)
+    {
+        free_ctx(ctx);
+        return EXIT_FAILURE;
+    }
 
     memset(&hints, 0, sizeof hints);
     hints.ai_family = AF_UNSPEC;
@@ -95,15 +231,22 @@ int server(char *port, char *passwd, char *servername, char *network_file)
     hints.ai_flags = AI_PASSIVE; // Return my address, so I can bind() to it
 
     /* Call getaddrinfo with the host parameter set to NULL */
-    if (getaddrinfo(NULL, port, &hints, &res) != 0)
+    if (server_socket != -1)
+    {
+        res = NULL;
+    }
+    else if (getaddrinfo(NULL, port, &hints, &res) != 0)
     {
         perror("getaddrinfo() failed");
-        pthread_exit(NULL);
+        free_ctx(ctx);
+        return EXIT_FAILURE;
     }
 
     for (p = res; p != NULL; p = p->ai_next)
     {
-        if ((server_socket = socket(p->ai_family, p->ai_socktype, p->ai_protocol)) == -1)
+        /* Close-on-exec, so a process started for an upgrade only gets the sockets handed to it */
+        if ((server_socket = socket(p->ai_family, p->ai_socktype | SOCK_CLOEXEC | SOCK_NONBLOCK,
+                                    p->ai_protocol)) == -1)
         {
             perror("Could not open socket");
             continue;
@@ -123,7 +266,7 @@ int server(char *port, char *passwd, char *servername, char *network_file)
             continue;
         }
 
-        if (listen(server_socket, 5) == -1)
+        if (listen(server_socket, ctx->backlog) == -1)
         {
             perror("Socket listen() failed");
             close(server_socket);
@@ -133,43 +276,78 @@ int server(char *port, char *passwd, char *servername, char *network_file)
         break;
     }
 
-    freeaddrinfo(res);
+    if (res != NULL)
+    {
+        freeaddrinfo(res);
+
+        if (p == NULL)
+        {
+            chilog(ERROR, "Could not find a socket to bind to.\n");
+            free_ctx(ctx);
+            return EXIT_FAILURE;
+        }
+    }
+    else if (listen(server_socket, ctx->backlog) == -1)
+    {
+        /* A socket handed over by an upgrade keeps the backlog it was given,
+         * unless it is listened on again */
+        perror("Socket listen() failed");
+    }
+
+    if (config->upgrade_socket != NULL &&
+        upgrade_init(ctx, config->upgrade_socket, server_socket) == CHIRC_ERROR)
+    {
+        close(server_socket);
+        free_ctx(ctx);
+        return EXIT_FAILURE;
+    }
+
+    if (config->persist_file != NULL && persist_init(ctx) == CHIRC_ERROR)
+    {
+        close(server_socket);
+        free_ctx(ctx);
+        return EXIT_FAILURE;
+    }
 
-    if (p == NULL)
+    /* TLS connections are not handed over by an upgrade: the TLS port is
+     * bound again by every process */
+    if (config->tls_port != NULL &&
+        tls_init(ctx, config->tls_port, config->tls_cert, config->tls_key, config->ktls) == CHIRC_ERROR)
     {
-        chilog(ERROR, "Could not find a socket to bind to.\n");
-        pthread_exit(NULL);
+        close(server_socket);
+        free_ctx(ctx);
+        return EXIT_FAILURE;
     }
 
+    /* With io_uring, one multishot accept takes the connections */
+    bool ring_accept = pool_listen(server_socket) == CHIRC_OK;
+
     while (1)
     {
-        client_addr = calloc(1, sin_size);
-        if ((client_socket = accept(server_socket, (struct sockaddr *)client_addr, &sin_size)) == -1)
+        if (ring_accept)
         {
-            free(client_addr);
-            chilog(ERROR, "Could not accept() connection");
+            client_socket = pool_accept(ctx);
+            if (accept_client(ctx, client_socket, false) == CHIRC_ERROR)
+            {
+                pthread_rwlock_unlock(&ctx->upgrade_lock);
+                close(server_socket);
+                return EXIT_FAILURE;
+            }
+            pthread_rwlock_unlock(&ctx->upgrade_lock);
             continue;
         }
 
-        char client_hostname[MAX_STR_LEN];
-        char port[100];
-        int result = getnameinfo((struct sockaddr *)client_addr,
-                                 sin_size,
-                                 client_hostname,
-                                 sizeof client_hostname,
-                                 port,
-                                 sizeof port, 0);
-        wa = calloc(1, sizeof(worker_args));
-        wa->socket = client_socket;
-        wa->client_hostname = sdsnew(client_hostname);
-        wa->ctx = ctx;
-
-        if (pthread_create(&worker_thread, NULL, service_single_client, wa) != 0)
+        /* The listening socket is non-blocking: after an upgrade, the new
+         * process may accept the connection first */
+        struct pollfd pfd = {.fd = server_socket, .events = POLLIN};
+        stats_syscalls(1);  /* poll() */
+        if (poll(&pfd, 1, -1) == -1)
+        {
+            continue;
+        }
+
+        if (accept_batch(ctx, server_socket, false) == CHIRC_ERROR)
         {
-            perror("Could not create a worker thread");
-            free(client_addr);
-            free(wa);
-            close(client_socket);
             close(server_socket);
             return EXIT_FAILURE;
         }
@@ -179,8 +357,14 @@ int server(char *port, char *passwd, char *servername, char *network_file)
     pthread_mutex_destroy(&ctx->channels_lock);
     pthread_mutex_destroy(&ctx->clients_lock);
     pthread_mutex_destroy(&ctx->operators_lock);
-    pthread_mutex_destroy(&ctx->socket_lock);
+    for (int i = 0; i < SOCKET_LOCKS; i++)
+    {
+        pthread_mutex_destroy(&ctx->socket_locks[i]);
+    }
     pthread_mutex_destroy(&ctx->lock);
+    pthread_mutex_destroy(&ctx->chanlist_lock);
+    pthread_mutex_destroy(&ctx->conns_lock);
+    pthread_rwlock_destroy(&ctx->upgrade_lock);
 
     free_ctx(ctx);
 
@@ -188,6 +372,286 @@ int server(char *port, char *passwd, char *servername, char *network_file)
 }
 
 
+int accept_client(server_ctx *ctx, int client_socket, bool tls)
+{
+    /*
+     * accept_client - Serve a connection just accepted (called with
+     * ctx->upgrade_lock held). Its hostname is looked up later, by the
+     * thread serving it.
+     *
+     * ctx: server context
+     *
+     * client_socket: the new connection
+     *
+     * tls: the connection was accepted on the TLS port
+     *
+     * Return: CHIRC_OK, or CHIRC_ERROR if it could not be served (it is
+     * then closed)
+     */
+    stats_connection_opened();
+
+    if (start_worker(ctx, client_socket, NULL, NULL, tls, NULL) == CHIRC_ERROR)
+    {
+        close_socket(ctx, client_socket);
+        return CHIRC_ERROR;
+    }
+
+    return CHIRC_OK;
+}
+
+
+int accept_batch(server_ctx *ctx, int listener, bool tls)
+{
+    /*
+     * accept_batch - Accept and serve the connections waiting on a
+     * listening socket, up to ACCEPT_BATCH of them, until the queue is empty
+     *
+     * ctx: server context
+     *
+     * listener: the non-blocking listening socket
+     *
+     * tls: listener is the TLS port
+     *
+     * Return: CHIRC_OK, or CHIRC_ERROR if a connection could not be served
+     */
+    int client_socket;
+    bool out_of_fds = false;
+
+    /* Accepted connections are registered before an upgrade can start. The
+     * lock is given back after a batch, so a storm of connections does not
+     * hold an upgrade off. */
+    pthread_rwlock_rdlock(&ctx->upgrade_lock);
+    for (int i = 0; i < ACCEPT_BATCH; i++)
+    {
+        /* The peer's address is not asked for: conn_resolve() gets it */
+        stats_syscalls(1);  /* accept4() */
+        if ((client_socket = accept4(listener, NULL, NULL, SOCK_CLOEXEC)) == -1)
+        {
+            out_of_fds = errno == EMFILE || errno == ENFILE;
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR && !out_of_fds)
+            {
+                chilog(ERROR, "Could not accept() %sconnection", tls ? "TLS " : "");
+            }
+            break;
+        }
+
+        if (accept_client(ctx, client_socket, tls) == CHIRC_ERROR)
+        {
+            pthread_rwlock_unlock(&ctx->upgrade_lock);
+            return CHIRC_ERROR;
+        }
+    }
+    pthread_rwlock_unlock(&ctx->upgrade_lock);
+
+    /* The connection stays queued and the listener readable */
+    if (out_of_fds)
+    {
+        accept_shed(ctx, listener, tls);
+    }
+
+    return CHIRC_OK;
+}
+
+
+void accept_shed(server_ctx *ctx, int listener, bool tls)
+{
+    /*
+     * accept_shed - Close a connection waiting on a listening socket that
+     * could not be accepted for lack of file descriptors, so the listener
+     * does not stay readable and the accept loop does not spin.
+     * ctx->spare_fd is closed to accept it and opened again. If there is no
+     * spare descriptor or no connection, waits for ACCEPT_BACKOFF_MS instead.
+     *
+     * ctx: server context
+     *
+     * listener: the listening socket
+     *
+     * tls: listener is the TLS port
+     *
+     * Return: nothing
+     */
+    int spare = atomic_exchange(&ctx->spare_fd, -1);
+    int client_socket = -1;
+    int expected = -1;
+
+    /* Without a spare, another listener holds it or it could not be opened again */
+    if (spare != -1)
+    {
+        close(spare);
+        stats_syscalls(1);  /* accept4() */
+        client_socket = accept4(listener, NULL, NULL, SOCK_CLOEXEC);
+        if (client_socket != -1)
+        {
+            close(client_socket);
+            chilog(WARNING, "Out of file descriptors: closed a new %sconnection", tls ? "TLS " : "");
+        }
+    }
+
+    /* An io_uring accept fails for lack of descriptors even when no
+     * connection is waiting: then only time can help */
+    if (client_socket == -1)
+    {
+        struct timespec wait = {.tv_sec = 0, .tv_nsec = ACCEPT_BACKOFF_MS * 1000000L};
+        nanosleep(&wait, NULL);
+    }
+
+    /* Fails while descriptors are short, and is retried on the next shed */
+    spare = open("/dev/null", O_RDONLY | O_CLOEXEC);
+    if (spare != -1 && !atomic_compare_exchange_strong(&ctx->spare_fd, &expected, spare))
+    {
+        close(spare);
+    }
+}
+
+
+void conn_resolve(conn_info_t *conn)
+{
+    /*
+     * conn_resolve - Look up the hostname of a connection, if it is not
+     * known yet. Called by the thread serving it before its first command,
+     * so a slow lookup does not hold up the accept loop.
+     *
+     * conn: the connection
+     *
+     * Return: nothing
+     */
+    struct sockaddr_storage addr;
+    socklen_t addr_len = sizeof addr;
+    char client_hostname[MAX_STR_LEN] = "";
+    char port[100];
+
+    if (conn->client_hostname != NULL)
+    {
+        return;
+    }
+
+    stats_syscalls(1);  /* getpeername() */
+    if (getpeername(conn->client_socket, (struct sockaddr *)&addr, &addr_len) == 0)
+    {
+        getnameinfo((struct sockaddr *)&addr, addr_len, client_hostname, sizeof client_hostname,
+                    port, sizeof port, 0);
+    }
+    conn->client_hostname = sdsnew(client_hostname);
+}
+
+
+int start_worker(server_ctx *ctx, int client_socket, sds client_hostname, sds cmdstack, bool tls,
+                 struct link *link)
+{
+    /*
+     * start_worker - Register a connection and start the thread serving it,
+     * or hand it to the I/O threads in split mode
+     *
+     * ctx: server context
+     *
+     * client_socket: the connection
+     *
+     * client_hostname: the client's hostname, taken over by the connection,
+     * or NULL to look it up with conn_resolve() before its first command
+     *
+     * cmdstack: input received by a previous process before a live upgrade
+     * and not processed yet, taken over by the connection, or NULL for a
+     * new connection
+     *
+     * tls: the connection was accepted on the TLS port
+     *
+     * link: the server link opened by CONNECT on it, taken over by the
+     * connection, or NULL
+     *
+     * Return: CHIRC_OK/CHIRC_ERROR
+     */
+    pthread_t worker_thread;
+    worker_args *wa;
+    conn_info_t *conn = calloc(1, sizeof(conn_info_t));
+
+    conn->client_socket = client_socket;
+    conn->server_hostname = sdsnew(ctx->server_host);
+    conn->client_hostname = client_hostname;
+    conn->cmdstack = cmdstack != NULL ? cmdstack : sdsempty();
+    conn->link = link;
+
+    /* Before it is served: the first bytes read are the client's hello */
+    if (tls && (conn->tls = tls_conn_new(ctx, client_socket)) == NULL)
+    {
+        conn_free(conn);
+        return CHIRC_ERROR;
+    }
+
+    if (cmdstack == NULL)
+    {
+        add_total_connected_number(ctx);
+    }
+    conn->capture_id = capture_open((tls ? CAPTURE_TLS : 0) | (cmdstack != NULL ? CAPTURE_HANDED_OVER : 0));
+
+    pthread_mutex_lock(&ctx->conns_lock);
+    HASH_ADD_INT(ctx->conns, client_socket, conn);
+    pthread_mutex_unlock(&ctx->conns_lock);
+
+    if (ctx->pool != NULL)
+    {
+        if (pool_add(conn) == CHIRC_ERROR)
+        {
+            goto fail;
+        }
+        return CHIRC_OK;
+    }
+
+    wa = calloc(1, sizeof(worker_args));
+    wa->socket = client_socket;
+    wa->ctx = ctx;
+    wa->conn = conn;
+
+    if (pthread_create(&worker_thread, NULL, service_single_client, wa) != 0)
+    {
+        perror("Could not create a worker thread");
+        free(wa);
+        goto fail;
+    }
+
+    return CHIRC_OK;
+
+fail:
+    pthread_mutex_lock(&ctx->conns_lock);
+    HASH_DEL(ctx->conns, conn);
+    pthread_mutex_unlock(&ctx->conns_lock);
+    capture_close(conn->capture_id);
+    conn_free(conn);
+    return CHIRC_ERROR;
+}
+
+
+/*
+ * run_commands - Process the whole commands of the cmd stack, up to a QUIT
+ *
+ * ctx: server context
+ *
+ * conn: the connection
+ *
+ * Return: nothing
+ */
+static void run_commands(server_ctx *ctx, conn_info_t *conn)
+{
+    int i, argc, count = 0;
+    sds *cmdtokens;
+
+    /* Design: a cmd stack for assembling the next message that will be processed.
+     * Split the untreated command information into whole command segments if possible. */
+    sds *cmdseg = frame_commands(conn->cmdstack, &count); // Command segments
+    capture_lines(conn->capture_id, cmdseg, count);
+
+    for (i = 0; i < count && !conn->quit; i++)
+    {
+        cmdtokens = tokenize_command(cmdseg[i], &argc);
+        conn->trace_id = trace_sample();
+        trace_recv(conn->trace_id, conn->recv_ns);
+        handle_request(ctx, cmdtokens, argc, conn);
+        sdsfreesplitres(cmdtokens, argc);
+    }
+    sdsfreesplitres(cmdseg, count);
+    link_flush(ctx);
+}
+
+
 void *service_single_client(void *args)
 {
     /*
@@ -196,89 +660,208 @@ void *service_single_client(void *args)
      * args: worker arguments
      *
      * Return: nothing
+     *
+     * The worker waits for input without any lock, then takes the upgrade
+     * lock for reading before it reads and processes it. A live upgrade
+     * taking the lock for writing thus never finds a command half done,
+     * and input it leaves unread is read by the new process.
      */
     worker_args *wa;
     server_ctx *ctx;
+    conn_info_t *conn;
     int client_socket = 0;                  // Client_socket
-    sds server_hostname = sdsempty();       // Server_hostname, prefix of msg
-    sds client_hostname;                    // Client_hostname, prefix of msg
     int nbytes = 0;                         // Length of command from the client
-    int count = 0;                          // Length of tokens
     char buffer[BUFFER_SIZE];               // Command received from the client
-    sds cmdstack = sdsempty();              // Received but untreated command
 
     wa = (struct worker_args *)args;
     client_socket = wa->socket;
     ctx = wa->ctx;
-    client_hostname = wa->client_hostname;
+    conn = wa->conn;
 
-    add_total_connected_number(ctx);
+    pthread_detach(pthread_self());
 
-    /* Get server host name */
-    char server_host[MAX_STR_LEN];
-    int host_check = gethostname(server_host, sizeof server_host);
-    if (host_check == -1) 
-    {
-        chilog(ERROR, "gethostname() failed");
-        exit(CHIRC_ERROR);
-    }
-    server_hostname = sdsnew(server_host);
+    pthread_cleanup_push(worker_exit, wa);
 
-    /* Initialize connection struc with client socket,
-     * server hostname and client hostname */
-    conn_info_t *conn = calloc(1, sizeof(conn_info_t));
-    conn->client_socket = client_socket;
-    conn->server_hostname = server_hostname;
-    conn->client_hostname = client_hostname;
+    /* Before the upgrade lock is taken: the lookup may wait on DNS */
+    conn_resolve(conn);
 
-    pthread_detach(pthread_self());
+    /* Whole commands handed over by a live upgrade */
+    pthread_rwlock_rdlock(&ctx->upgrade_lock);
+    wa->upgrade_locked = true;
+    conn->recv_ns = stats_now();
+    run_commands(ctx, conn);
 
-    while (1)
+    while (!conn->quit)
     {
+        wa->upgrade_locked = false;
+        pthread_rwlock_unlock(&ctx->upgrade_lock);
+
+        struct pollfd pfd = {.fd = client_socket, .events = POLLIN};
+        stats_syscalls(2);  /* poll() and recv() */
+        if (poll(&pfd, 1, -1) == -1)
+        {
+            pthread_rwlock_rdlock(&ctx->upgrade_lock);
+            wa->upgrade_locked = true;
+            continue;
+        }
+
+        pthread_rwlock_rdlock(&ctx->upgrade_lock);
+        wa->upgrade_locked = true;
+
         memset(buffer, 0, sizeof(buffer));
-        nbytes = recv(client_socket, buffer, sizeof(buffer), 0);
+        nbytes = recv(client_socket, buffer, sizeof(buffer) - 1, MSG_DONTWAIT);
+
+        if (nbytes == -1 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+        {
+            continue;
+        }
 
         /* a return code of 0 from recv means that the client has disconnected; */
         /* a return code of -1 is errors */
         if (nbytes <= 0)
         {
-            sdsfree(conn->server_hostname);
-            sdsfree(conn->client_hostname);
-            free(conn);
-            
-            close_socket(ctx, client_socket);
-            pthread_exit(NULL);
+            break;
         }
-        // Add NULL terminator to manipulate the bytes returned by recv() as a C-string
-        buffer[nbytes] = '\0';
-        cmdstack = sdscat(cmdstack, buffer);
-
-        /* Design: a cmd stack for assembling the next message that will be processed.
-         * Split the untreated command information into whole command segments if possible. */
-        sds *cmdseg; // Command segments
+        conn->recv_ns = stats_now();
+        stats_bytes_in(nbytes);
 
-        cmdseg = sdssplitlen(cmdstack, sdslen(cmdstack), "\r\n", 2, &count);
-        if (count <= 1) // Not meet the end of a command
+        if (conn->tls != NULL)
         {
-            sdsfreesplitres(cmdseg, count);
-            continue;
+            if (tls_input(conn, buffer, nbytes) == CHIRC_ERROR)
+            {
+                break;
+            }
         }
-        else
+        else if (conn->link != NULL)
         {
-            /* Have (count - 1) whole commands */
-            int i, argc;
-            sds *cmdtokens;
-            for (i = 0; i < count - 1; i++)
+            if (link_input(conn, buffer, nbytes) == CHIRC_ERROR)
             {
-                sdstrim(cmdseg[i], " ");
-                cmdtokens = sdssplitlen(cmdseg[i], sdslen(cmdseg[i]), " ", 1, &argc);
-                handle_request(ctx, cmdtokens, argc, conn);
-                sdsfreesplitres(cmdtokens, argc);
+                break;
             }
-            sdsrange(cmdstack, (int)sdslen(cmdstack) - (int)sdslen(cmdseg[count - 1]), (int)sdslen(cmdstack));
-            sdsfreesplitres(cmdseg, count);
         }
+        else
+        {
+            // Add NULL terminator to manipulate the bytes returned by recv() as a C-string
+            buffer[nbytes] = '\0';
+            conn->cmdstack = sdscat(conn->cmdstack, buffer);
+        }
+
+        run_commands(ctx, conn);
+    }
+
+    /* End of input, or QUIT. A server link takes down what is behind it
+     * first, once the commands it sent before are done. */
+    sds squit = link_eof(conn);
+    if (squit != NULL)
+    {
+        int argc;
+        sds *cmdtokens = tokenize_command(squit, &argc);
+        handle_request(ctx, cmdtokens, argc, conn);
+        sdsfreesplitres(cmdtokens, argc);
+        sdsfree(squit);
+        link_flush(ctx);
+    }
+    close_socket(ctx, client_socket);
+
+    pthread_cleanup_pop(1);
+    return NULL;
+}
+
+
+static void worker_exit(void *args)
+{
+    /*
+     * worker_exit - Cleanup handler of a worker thread
+     *
+     * args: worker arguments
+     *
+     * Return: nothing
+     */
+    worker_args *wa = (worker_args *)args;
+
+    if (wa->upgrade_locked)
+    {
+        pthread_rwlock_unlock(&wa->ctx->upgrade_lock);
     }
+
+    conn_free(wa->conn);
+    free(wa);
+}
+
+
+void conn_free(conn_info_t *conn)
+{
+    /*
+     * conn_free - Free a connection once it is closed
+     *
+     * conn: the connection
+     *
+     * Return: nothing
+     */
+    if (conn->pool != NULL)
+    {
+        pool_cmd_t *cmd, *next;
+
+        for (cmd = conn->pool->head; cmd != NULL; cmd = next)
+        {
+            next = cmd->next;
+            sdsfreesplitres(cmd->tokens, cmd->argc);
+            free(cmd);
+        }
+        pthread_mutex_destroy(&conn->pool->lock);
+        free(conn->pool);
+    }
+    sdsfree(conn->server_hostname);
+    sdsfree(conn->client_hostname);
+    sdsfree(conn->cmdstack);
+    link_free(conn->link);
+    free(conn);
+}
+
+
+sds *frame_commands(sds cmdstack, int *count)
+{
+    /*
+     * frame_commands - Split the whole commands off the front of a cmd stack
+     *
+     * cmdstack: received but untreated bytes. The incomplete command at the
+     * end, if any, is left in it.
+     *
+     * count: number of whole commands returned
+     *
+     * Return: the whole commands without "\r\n", to be freed with sdsfreesplitres
+     */
+    int n;
+    sds *cmdseg = sdssplitlen(cmdstack, sdslen(cmdstack), "\r\n", 2, &n);
+
+    if (n == 0)
+    {
+        *count = 0;
+        return cmdseg;
+    }
+
+    /* The last segment is what follows the last "\r\n" */
+    sdsrange(cmdstack, (int)sdslen(cmdstack) - (int)sdslen(cmdseg[n - 1]), (int)sdslen(cmdstack));
+    sdsfree(cmdseg[n - 1]);
+    *count = n - 1;
+
+    return cmdseg;
+}
+
+
+sds *tokenize_command(sds cmd, int *argc)
+{
+    /*
+     * tokenize_command - Split a whole command into space separated tokens
+     *
+     * cmd: the command, trimmed in place
+     *
+     * argc: number of tokens returned
+     *
+     * Return: the tokens, to be freed with sdsfreesplitres
+     */
+    sdstrim(cmd, " ");
+    return sdssplitlen(cmd, sdslen(cmd), " ", 1, argc);
 }
 
 
@@ -298,23 +881,37 @@ void free_ctx(server_ctx *ctx)
     HASH_ITER(hh, ctx->client_hashtable, client_ht, client_tmp)
     {
         HASH_DEL(ctx->client_hashtable, client_ht);
-        free(client_ht); /* free it */
+        free_USER(client_ht); /* free it */
     }
     HASH_ITER(hh, ctx->nicks_hashtable, nicks_ht, nick_tmp)
     {
         HASH_DEL(ctx->nicks_hashtable, nicks_ht);
         free(nicks_ht); /* free it */
     }
-    HASH_ITER(hh, ctx->channels_hashtable, channels_ht, channel_tmp)
+    channel_t **tables[SHARD_MAX];
+    int ntables = shard_tables(ctx, tables);
+    for (int i = 0; i < ntables; i++)
     {
-        HASH_DEL(ctx->channels_hashtable, channels_ht);
-        free(channels_ht); /* free it */
+        HASH_ITER(hh, *tables[i], channels_ht, channel_tmp)
+        {
+            HASH_DEL(*tables[i], channels_ht);
+            free(channels_ht); /* free it */
+        }
     }
     HASH_ITER(hh, ctx->irc_operators_hashtable, irc_operators_ht, irc_temp)
     {
         HASH_DEL(ctx->irc_operators_hashtable, irc_operators_ht);
         free(irc_operators_ht); /* free it */
     }
+    link_cleanup(ctx);
+    network_free(ctx->network);
+    chanlist_free(ctx);
+    history_free(ctx);
+    persist_free(ctx);
+    if (ctx->spare_fd != -1)
+    {
+        close(ctx->spare_fd);
+    }
     free(ctx);
 }
 
@@ -322,7 +919,8 @@ void free_ctx(server_ctx *ctx)
 void close_socket(server_ctx *ctx, int client_socket)
 {
     /*
-     * close_socket - Close socket when exit
+     * close_socket - Close socket when exit, and remove the connection from
+     * ctx->conns so a live upgrade does not hand it over
      *
      * ctx: server context
      *
@@ -330,7 +928,23 @@ void close_socket(server_ctx *ctx, int client_socket)
      *
      * Return: nothing
      */
-    pthread_mutex_lock(&ctx->socket_lock);
+    conn_info_t *conn;
+    uint32_t capture_id = 0;
+
+    pthread_mutex_lock(&ctx->conns_lock);
+    HASH_FIND_INT(ctx->conns, &client_socket, conn);
+    if (conn != NULL)
+    {
+        HASH_DEL(ctx->conns, conn);
+        capture_id = conn->capture_id;
+    }
+    pthread_mutex_unlock(&ctx->conns_lock);
+    capture_close(capture_id);
+
+    pthread_mutex_lock(&ctx->socket_locks[client_socket % SOCKET_LOCKS]);
+    tls_close(ctx, client_socket);
     close(client_socket);
-    pthread_mutex_unlock(&ctx->socket_lock);
+    pthread_mutex_unlock(&ctx->socket_locks[client_socket % SOCKET_LOCKS]);
+
+    stats_connection_closed();
 }
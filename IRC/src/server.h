@@ -1,12 +1,25 @@
 #ifndef SERVERS_H
 #define SERVERS_H
 
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <sys/socket.h>
 #include "../lib/../lib/uthash.h"
 #include "client.h"
 #include "channels.h"
+#include "network.h"
+#include "counter.h"
+#include "compress.h"
 #include "../lib/sds/sds.h"
 #define BUFFER_SIZE 512
 #define MAX_STR_LEN 100
+#define DEFAULT_MAXTARGETS 20 /* Targets of one PRIVMSG, NOTICE, JOIN or PART unless -t says otherwise */
+#define DEFAULT_HISTORY_BYTES (8 * 1024 * 1024) /* Memory cap of all channel histories unless -M says otherwise */
+#define SOCKET_LOCKS 64 /* Locks serializing the sends to a socket, picked by socket number */
+#define DEFAULT_BACKLOG 4096 /* Pending connections of a listening port unless -b says otherwise (capped by somaxconn) */
+#define ACCEPT_BATCH 64 /* Connections accepted in a row before a waiting upgrade may take over */
+#define ACCEPT_BACKOFF_MS 10 /* Wait before accepting again when out of descriptors and none was shed */
 
 typedef struct irc_oper
 {
@@ -19,55 +32,217 @@ typedef struct irc_oper
  * amongst all the worker threads */
 typedef struct context
 {
-    int num_connected_users;             /* Number of user connections */
-    int total_connections;               /* Total number of user & server connections */
+    counters_t counters;                 /* Users, connections, channels and operators, for LUSERS */
     char *password;                      /* User Password */
     client_t *client_hashtable;          /* User connection hashtable */
     nick_t *nicks_hashtable;             /* Nicks hashtable */
-    channel_t *channels_hashtable;       /* Channels hashtable */
+    channel_t *channels_hashtable;       /* Channels hashtable, unused with channel shards, which own theirs */
     irc_oper_t *irc_operators_hashtable; /* Irc_operators hashtable */
-    pthread_mutex_t lock;                /* Locks to protect number_connections and total_connections */
+    network_t *network;                  /* Servers from the network file, NULL if standalone */
+    struct link **links;                 /* Registered server links by server ID, protected by links_lock */
+    struct uid_entry *uids;              /* Users of the network by UID, protected by clients_lock */
+    int remote_key;                      /* Key of the last user of another server in client_hashtable, protected by lock */
+    int link_compress;                   /* zlib level of compressed server links, -1 to compress none */
+    link_flush_t link_flush;             /* When compressed server links send what they compressed */
+    int max_targets;                     /* Most targets processed in one PRIVMSG, NOTICE, JOIN or PART */
+    uint32_t uid_counter;                /* Local part of the next user ID */
+    uint32_t cid_counter;                /* Local part of the next channel ID */
+    _Atomic uint64_t channels_generation; /* Bumped on every channel membership change */
+    uint64_t relay_epoch;                /* Stamp of the last neighbor search without shards, protected by channels_lock */
+    struct chanlist_snapshot *chanlist;  /* Cached snapshot for LIST, protected by chanlist_lock */
+    int history_lines;                   /* Messages kept per channel for replay, 0 to keep none */
+    size_t history_max_bytes;            /* Cap on the bytes of all channel histories */
+    size_t history_bytes;                /* Bytes of all channel histories, protected by history_lock */
+    struct history *histories;           /* Channel histories hashtable, protected by history_lock */
+    struct history *history_newest;      /* Most recently used history, protected by history_lock */
+    struct history *history_oldest;      /* Least recently used history, evicted first */
+    struct conn_info *conns;             /* Open connections by socket, protected by conns_lock */
+    char *persist_file;                  /* Snapshot of the mask lists and operators, NULL to keep none */
+    struct persist_channel *persist_pending; /* Restored mask lists of channels not joined yet, protected by persist_lock */
+    struct persist_record *persist_saved; /* Records of the channels that have mask lists, protected by persist_lock */
+    struct persist_dirty *persist_dirty; /* Channels to write to the snapshot, protected by persist_lock */
+    bool persist_opers_dirty;            /* Operators to write to the snapshot, protected by operators_lock */
+    struct pool *pool;                   /* I/O threads and workers of split mode, NULL for a thread per connection */
+    struct shard *shards;                /* Owners of the channels in split mode, NULL if the workers run channel commands */
+    int nshards;                         /* Number of channel shards */
+    struct tls *tls;                     /* TLS listener and sessions, NULL without -T */
+    int backlog;                         /* Pending connections of the listening ports */
+    atomic_int spare_fd;                 /* Kept open to shed connections when out of descriptors, -1 while in use */
+    char server_host[MAX_STR_LEN];       /* gethostname(), looked up once for all the connections */
+    pthread_mutex_t lock;                /* Locks to protect the ID counters */
     pthread_mutex_t channels_lock;       /* Locks to protect channels hashtable and channel_clients hashtable */
     pthread_mutex_t clients_lock;        /* Locks to protect clients hashtable */
     pthread_mutex_t nicks_lock;          /* Locks to protect nicks hashtable */
     pthread_mutex_t operators_lock;      /* Locks to protect irc_operators hashtable */
-    pthread_mutex_t socket_lock;         /* Locks to protect sendall() function */
+    pthread_mutex_t socket_locks[SOCKET_LOCKS]; /* Locks to protect sendall() function, one per socket number modulo SOCKET_LOCKS */
+    pthread_mutex_t chanlist_lock;       /* Locks to protect the LIST snapshot pointer and refcounts */
+    pthread_mutex_t history_lock;        /* Locks to protect the channel histories, taken after channels_lock */
+    pthread_mutex_t persist_lock;        /* Locks to protect the mask lists kept for the snapshot, taken after channels_lock */
+    pthread_mutex_t conns_lock;          /* Locks to protect the connections hashtable */
+    pthread_mutex_t links_lock;          /* Locks to protect the links table, taken before channels_lock */
+    pthread_rwlock_t upgrade_lock;       /* Read-held while input is accepted or processed, write-held by a live upgrade */
 
 } server_ctx;
 
 /* Worker_args struct is local to worker thread to hold server context info */
 typedef struct worker_args
 {
-    int socket;          /* Server socket */
-    sds client_hostname; /* Client hostname, e.g. "foo.example.com" */
-    server_ctx *ctx;     /* Server context pointer */
+    int socket;              /* Server socket */
+    server_ctx *ctx;         /* Server context pointer */
+    struct conn_info *conn;  /* The connection, registered in ctx->conns */
+    bool upgrade_locked;     /* The worker holds ctx->upgrade_lock for reading */
 } worker_args;
 
 typedef struct conn_info
 {
-    int client_socket;   /* Client socket */
+    int client_socket;   /* Client socket, key for ctx->conns */
     sds server_hostname; /* Server hostname, e.g. "bar.example.com" */
-    sds client_hostname; /* Client hostname, e.g. "foo.example.com" */
+    sds client_hostname; /* Client hostname, e.g. "foo.example.com", NULL until conn_resolve() */
+    sds cmdstack;        /* Received but untreated bytes, an incomplete command */
+    uint64_t recv_ns;    /* When the data being processed was received, for stats */
+    uint32_t trace_id;   /* Traced message being processed, 0 if none */
+    bool quit;           /* Set by QUIT: the connection is closed after the command */
+    struct pool_conn *pool; /* Command queue in split mode, NULL otherwise */
+    struct tls_conn *tls;   /* TLS session, NULL for a plain connection */
+    uint32_t capture_id;    /* Number of the connection in the traffic capture, 0 if none */
+    struct link *link;      /* Server link state once it sent PASS or SERVER or was opened by CONNECT, NULL otherwise */
+    UT_hash_handle hh;
 } conn_info_t;
 
+/* Settings of a server, filled in by main.c from the command line */
+typedef struct server_config
+{
+    char *port;               /* Port to listen on, unless the network file gives one */
+    char *passwd;             /* Operator password */
+    char *servername;         /* Our entry in the network file */
+    char *network_file;       /* Servers of the network, NULL if standalone */
+    char *stats_socket;       /* Unix socket serving JSON stats, NULL for none */
+    char *upgrade_socket;     /* Unix socket for live upgrades, NULL for none */
+    char *persist_file;       /* Snapshot file of the mask lists and operators, NULL for none */
+    int workers;              /* Workers running commands in split mode, 0 for a thread per connection */
+    int io_threads;           /* Threads reading the connections in split mode */
+    bool uring;               /* In split mode, use io_uring instead of epoll when the kernel can */
+    int shards;               /* In split mode, threads owning the channels, 0 for none */
+    int max_targets;          /* Most targets processed in one PRIVMSG, NOTICE, JOIN or PART */
+    int history_lines;        /* Messages kept per channel and replayed on JOIN, 0 to keep none */
+    size_t history_max_bytes; /* Cap on the memory of all channel histories */
+    char *tls_port;           /* Port of the TLS listener, NULL for none */
+    char *tls_cert;           /* PEM certificate chain of the TLS listener */
+    char *tls_key;            /* PEM private key of the TLS listener */
+    bool ktls;                /* Let the kernel encrypt the replies of TLS connections when it can */
+    char *capture_file;       /* Binary log the lines received are appended to, NULL for none */
+    char *trace_socket;       /* Unix socket serving the message trace, NULL to trace nothing */
+    int trace_rate;           /* One line in trace_rate is traced */
+    int backlog;              /* Pending connections of the listening ports */
+    int link_compress;        /* zlib level of server links both ends want compressed, -1 to compress none */
+    link_flush_t link_flush;  /* After every message, or in batches, on compressed server links */
+} server_config;
+
 /*
  * server - Initialize server context and handle multi-clients
  *
- * port: port number
+ * config: settings of the server
+ *
+ * Return: EXIT_SUCCESS/EXIT_FAILURE
+ *
+ */
+int server(server_config *config);
+
+/*
+ * start_worker - Register a connection and start the thread serving it,
+ * or hand it to the I/O threads in split mode
+ *
+ * ctx: server context
  *
- * passwd: operator password specified in main.c
+ * client_socket: the connection
  *
- * host: server_hostname
+ * client_hostname: the client's hostname, taken over by the connection,
+ * or NULL to look it up with conn_resolve() before its first command
  *
- * network_file: network file specified in main.c
+ * cmdstack: input received by a previous process before a live upgrade
+ * and not processed yet, taken over by the connection, or NULL for a new
+ * connection
  *
- * Return: EXIT_SUCCESS/EXIT_FAILURE
+ * tls: the connection was accepted on the TLS port
+ *
+ * link: the server link opened by CONNECT on it, taken over by the
+ * connection, or NULL
+ *
+ * Return: CHIRC_OK/CHIRC_ERROR
+ */
+int start_worker(server_ctx *ctx, int client_socket, sds client_hostname, sds cmdstack, bool tls,
+                 struct link *link);
+
+/*
+ * accept_client - Serve a connection just accepted (called with
+ * ctx->upgrade_lock held). Its hostname is looked up later, by the thread
+ * serving it.
+ *
+ * ctx: server context
+ *
+ * client_socket: the new connection
+ *
+ * tls: the connection was accepted on the TLS port
+ *
+ * Return: CHIRC_OK, or CHIRC_ERROR if it could not be served (it is then
+ * closed)
+ */
+int accept_client(server_ctx *ctx, int client_socket, bool tls);
+
+/*
+ * accept_batch - Accept and serve the connections waiting on a listening
+ * socket, up to ACCEPT_BATCH of them, until the queue is empty
+ *
+ * ctx: server context
+ *
+ * listener: the non-blocking listening socket
+ *
+ * tls: listener is the TLS port
+ *
+ * Return: CHIRC_OK, or CHIRC_ERROR if a connection could not be served
+ */
+int accept_batch(server_ctx *ctx, int listener, bool tls);
+
+/*
+ * accept_shed - Close a connection waiting on a listening socket that could
+ * not be accepted for lack of file descriptors, so the listener does not
+ * stay readable and the accept loop does not spin. ctx->spare_fd is closed
+ * to accept it and opened again. If there is no spare descriptor or no
+ * connection, waits for ACCEPT_BACKOFF_MS instead.
+ *
+ * ctx: server context
+ *
+ * listener: the listening socket
+ *
+ * tls: listener is the TLS port
+ *
+ * Return: nothing
+ */
+void accept_shed(server_ctx *ctx, int listener, bool tls);
+
+/*
+ * conn_resolve - Look up the hostname of a connection, if it is not known
+ * yet. Called by the thread serving it before its first command, so a
+ * slow lookup does not hold up the accept loop.
+ *
+ * conn: the connection
  *
+ * Return: nothing
  */
-int server(char *port, char *passwd, char *host, char *network_file);
+void conn_resolve(conn_info_t *conn);
 
 /*
- * close_socket - Close socket when exit
+ * conn_free - Free a connection once it is closed
+ *
+ * conn: the connection
+ *
+ * Return: nothing
+ */
+void conn_free(conn_info_t *conn);
+
+/*
+ * close_socket - Close socket when exit, and remove the connection from
+ * ctx->conns so a live upgrade does not hand it over
  *
  * ctx: server context
  *
@@ -77,4 +252,27 @@ int server(char *port, char *passwd, char *host, char *network_file);
  */
 void close_socket(server_ctx *ctx, int client_socket);
 
+/*
+ * frame_commands - Split the whole commands off the front of a cmd stack
+ *
+ * cmdstack: received but untreated bytes. The incomplete command at the
+ * end, if any, is left in it.
+ *
+ * count: number of whole commands returned
+ *
+ * Return: the whole commands without "\r\n", to be freed with sdsfreesplitres
+ */
+sds *frame_commands(sds cmdstack, int *count);
+
+/*
+ * tokenize_command - Split a whole command into space separated tokens
+ *
+ * cmd: the command, trimmed in place
+ *
+ * argc: number of tokens returned
+ *
+ * Return: the tokens, to be freed with sdsfreesplitres
+ */
+sds *tokenize_command(sds cmd, int *argc);
+
 #endif
\ No newline at end of file
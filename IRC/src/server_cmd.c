@@ -1,4 +1,49 @@
+#include <stdlib.h>
+#include <string.h>
 #include "server_cmd.h"
+#include "reply.h"
+#include "persist.h"
+#include "history.h"
+#include "shard.h"
+#include "trace.h"
+
+
+channel_t **server_lock_CHANNELS(server_ctx *ctx)
+{
+    /*
+     * server_lock_CHANNELS - Take the channel table: the one of the calling
+     * shard with channel shards, or ctx->channels_hashtable under
+     * channels_lock
+     *
+     * ctx: server_context
+     *
+     * Return: The table, to be given back with server_unlock_CHANNELS.
+     *
+     */
+    if (ctx->shards != NULL)
+    {
+        /* Only the shard owning the table uses it */
+        return shard_table(ctx);
+    }
+    trace_mutex_lock(&ctx->channels_lock, "channels_lock");
+    return &ctx->channels_hashtable;
+}
+
+
+void server_unlock_CHANNELS(server_ctx *ctx)
+{
+    /*
+     * server_unlock_CHANNELS - Give back the table taken by server_lock_CHANNELS
+     *
+     * ctx: server_context
+     *
+     * Return: nothing
+     */
+    if (ctx->shards == NULL)
+    {
+        pthread_mutex_unlock(&ctx->channels_lock);
+    }
+}
 
 
 client_t *server_find_USER(server_ctx *ctx, int client_socket)
@@ -16,7 +61,7 @@ client_t *server_find_USER(server_ctx *ctx, int client_socket)
 
     client_t **client_hashtable = &ctx->client_hashtable;
 
-    pthread_mutex_lock(&ctx->clients_lock);
+    trace_mutex_lock(&ctx->clients_lock, "clients_lock");
     client_t *user = find_USER(client_socket, client_hashtable);
     pthread_mutex_unlock(&ctx->clients_lock);
 
@@ -38,7 +83,7 @@ nick_t *server_find_NICK(server_ctx *ctx, sds nickname)
      */
     nick_t **nicks_hashtable = &ctx->nicks_hashtable;
 
-    pthread_mutex_lock(&ctx->nicks_lock);
+    trace_mutex_lock(&ctx->nicks_lock, "nicks_lock");
     nick_t *nick = find_NICK(nickname, nicks_hashtable);
     pthread_mutex_unlock(&ctx->nicks_lock);
 
@@ -60,7 +105,7 @@ irc_oper_t *server_find_OPER(server_ctx *ctx, sds nickname)
      */
     irc_oper_t *irc_operator_value;
 
-    pthread_mutex_lock(&ctx->operators_lock);
+    trace_mutex_lock(&ctx->operators_lock, "operators_lock");
     HASH_FIND_STR(ctx->irc_operators_hashtable, nickname, irc_operator_value);
     pthread_mutex_unlock(&ctx->operators_lock);
 
@@ -68,24 +113,24 @@ irc_oper_t *server_find_OPER(server_ctx *ctx, sds nickname)
 }
 
 
-channel_client *server_find_CHANNEL_CLIENT(server_ctx *ctx, channel_t *channel, sds nickname)
+channel_client *server_find_CHANNEL_CLIENT(server_ctx *ctx, channel_t *channel, client_t *user)
 {
     /*
-     * server_find_CHANNEL_CLIENT - (Thread-safe)Find the client in channel with the given nick name
+     * server_find_CHANNEL_CLIENT - (Thread-safe)Find the membership of a user in a channel
      *
      * ctx: server_context
      *
      * channel: the channel which may include the client
      *
-     * nickname: the nickname to be searched as key
+     * user: the user to be searched as key
      *
-     * Return: The channel_client with given nickname or NULL if not exists.
+     * Return: The channel_client of the user or NULL if not exists.
      *
      */
 
-    pthread_mutex_lock(&ctx->channels_lock);
-    channel_client *cha_cli = find_CHANNEL_CLIENT(nickname, &channel->channel_clients);
-    pthread_mutex_unlock(&ctx->channels_lock);
+    server_lock_CHANNELS(ctx);
+    channel_client *cha_cli = find_CHANNEL_CLIENT(user, &channel->channel_clients);
+    server_unlock_CHANNELS(ctx);
 
     return cha_cli;
 }
@@ -103,11 +148,9 @@ channel_t *server_find_CHANNEL(server_ctx *ctx, sds channel_name)
      * Return: The channel with given name or NULL if not exists.
      *
      */
-    channel_t **channel_hashtable = &ctx->channels_hashtable;
-
-    pthread_mutex_lock(&ctx->channels_lock);
+    channel_t **channel_hashtable = server_lock_CHANNELS(ctx);
     channel_t *channel = find_CHANNEL(channel_name, channel_hashtable);
-    pthread_mutex_unlock(&ctx->channels_lock);
+    server_unlock_CHANNELS(ctx);
 
     return channel;
 }
@@ -130,7 +173,7 @@ nick_t *server_add_NICK(server_ctx *ctx, int client_socket, sds nickname)
      */
     nick_t **nicks_hashtable = &ctx->nicks_hashtable;
 
-    pthread_mutex_lock(&ctx->nicks_lock);
+    trace_mutex_lock(&ctx->nicks_lock, "nicks_lock");
     nick_t *added = add_NICK(nickname, client_socket, nicks_hashtable);
     pthread_mutex_unlock(&ctx->nicks_lock);
 
@@ -154,9 +197,13 @@ client_t *server_add_USER(server_ctx *ctx, client_t *client, int client_socket)
      */
     client_t **client_hashtable = &ctx->client_hashtable;
 
-    pthread_mutex_lock(&ctx->clients_lock);
+    trace_mutex_lock(&ctx->clients_lock, "clients_lock");
     client_t *added = add_USER(client, client_socket, client_hashtable);
     pthread_mutex_unlock(&ctx->clients_lock);
+    if (added == client)
+    {
+        counter_add(&ctx->counters, COUNTER_CLIENTS, 1);
+    }
 
     return added;
 }
@@ -175,16 +222,119 @@ void server_remove_NICK(server_ctx *ctx, sds nickname)
      */
     nick_t **nicks_hashtable = &ctx->nicks_hashtable;
 
-    pthread_mutex_lock(&ctx->nicks_lock);
+    trace_mutex_lock(&ctx->nicks_lock, "nicks_lock");
     remove_NICK(nickname, nicks_hashtable);
     pthread_mutex_unlock(&ctx->nicks_lock);
 }
 
 
+void server_remove_USER(server_ctx *ctx, int client_socket)
+{
+    /*
+     * server_remove_USER - (Thread-safe)Remove client from client_hashtable table
+     *
+     * ctx: server_context
+     *
+     * client_socket: client socket of the user to be removed
+     *
+     * Return: nothing
+     */
+    client_t **client_hashtable = &ctx->client_hashtable;
+
+    trace_mutex_lock(&ctx->clients_lock, "clients_lock");
+    unsigned int before = HASH_COUNT(*client_hashtable);
+    remove_USER(client_socket, client_hashtable);
+    counter_add(&ctx->counters, COUNTER_CLIENTS, (int64_t)HASH_COUNT(*client_hashtable) - before);
+    pthread_mutex_unlock(&ctx->clients_lock);
+}
+
+
+client_t *server_take_USER(server_ctx *ctx, int client_socket)
+{
+    /*
+     * server_take_USER - (Thread-safe)Remove client from client_hashtable
+     * table without freeing it
+     *
+     * ctx: server_context
+     *
+     * client_socket: client socket of the user to be removed
+     *
+     * Return: The client, to be freed with free_USER, or NULL
+     */
+    client_t *client;
+
+    trace_mutex_lock(&ctx->clients_lock, "clients_lock");
+    client = find_USER(client_socket, &ctx->client_hashtable);
+    if (client != NULL)
+    {
+        HASH_DELETE(hh, ctx->client_hashtable, client);
+        counter_add(&ctx->counters, COUNTER_CLIENTS, -1);
+    }
+    pthread_mutex_unlock(&ctx->clients_lock);
+
+    return client;
+}
+
+
+int server_find_NEIGHBORS(server_ctx *ctx, client_t *user, int **sockets)
+{
+    /*
+     * server_find_NEIGHBORS - (Thread-safe)Find the sockets of every user sharing
+     * at least one channel with the given user, each listed once
+     *
+     * ctx: server_context
+     *
+     * user: the user whose neighbors are searched, not listed itself
+     *
+     * sockets: set to a malloc'd array of client sockets, to be freed by the caller
+     *
+     * Return: The number of sockets.
+     *
+     * Without channel shards only, which find them with shard_neighbors.
+     * Only the channels of the user are visited, through its list of
+     * memberships. Every search takes a new epoch and stamps the client_t of
+     * each user it lists, so a user met again in another shared channel is
+     * skipped with one comparison instead of a search through the sockets
+     * found so far.
+     */
+    int count = 0, size = 0;
+    int *found = NULL;
+
+    trace_mutex_lock(&ctx->channels_lock, "channels_lock");
+    uint64_t epoch = ++ctx->relay_epoch;
+    user->relay_epoch = epoch;
+
+    for (channel_client *joined = user->channels; joined != NULL; joined = joined->next_joined)
+    {
+        for (channel_client *cc = joined->channel->channel_clients; cc != NULL; cc = cc->hh.next)
+        {
+            client_t *peer = cc->user;
+            if (peer->relay_epoch == epoch) // Already listed
+            {
+                continue;
+            }
+            peer->relay_epoch = epoch;
+
+            if (count == size)
+            {
+                size = size ? size * 2 : 16;
+                found = realloc(found, size * sizeof(int));
+            }
+            found[count++] = peer->socket;
+        }
+    }
+    pthread_mutex_unlock(&ctx->channels_lock);
+
+    *sockets = found;
+    return count;
+}
+
+
 channel_t *server_add_CHANNEL(server_ctx *ctx, sds channel_name)
 {
     /*
-     * server_add_CHANNEL - (Thread-safe)Add channel with the given channel name
+     * server_add_CHANNEL - (Thread-safe)Add channel with the given channel name,
+     * with the mask lists restored for it from the snapshot if there are any
      *
      * ctx: server_context
      *
@@ -193,50 +343,84 @@ channel_t *server_add_CHANNEL(server_ctx *ctx, sds channel_name)
      * Return: The channel added.
      *
      */
-    channel_t **channel_hashtable = &ctx->channels_hashtable;
-
-    pthread_mutex_lock(&ctx->channels_lock);
+    channel_t **channel_hashtable = server_lock_CHANNELS(ctx);
     channel_t *channel = add_CHANNEL(channel_name, channel_hashtable);
-    pthread_mutex_unlock(&ctx->channels_lock);
+    if (channel->cid == 0)
+    {
+        channel->cid = server_new_CID(ctx);
+        persist_claim(ctx, channel);
+        counter_add(&ctx->counters, COUNTER_CHANNELS, 1);
+    }
+    server_unlock_CHANNELS(ctx);
 
     return channel;
 }
 
 
-channel_client *server_add_CHANNEL_CLIENT(server_ctx *ctx, sds nickname, sds channel_name, bool flag)
+channel_client *server_add_CHANNEL_CLIENT(server_ctx *ctx, client_t *user,
+                                          sds channel_name, bool flag)
 {
     /*
      * server_add_CHANNEL_CLIENT - (Thread-safe) Add client with the given channel name to the channel
      *
      * ctx: server_context
      *
-     * nickname: The nickname you want to insert the client into the channel as key
+     * user: The user you want to insert into the channel as key
      *
      * channel_name: channel_name to be added
      *
      * flag: If flag == 1, channel exists, else channel is newly created.
      *
-     * Return: The channel_client with given nickname after adding it to the hashtable.
+     * Return: The channel_client of the user after adding it to the hashtable.
      *
      */
     channel_t *c = server_find_CHANNEL(ctx, channel_name);
 
-    pthread_mutex_lock(&ctx->channels_lock);
-    channel_client *cha_cli = add_CHANNEL_CLIENT(nickname, &c->channel_clients);
+    server_lock_CHANNELS(ctx);
+    channel_client *cha_cli = add_CHANNEL_CLIENT(user, c);
     if (flag == 0)
     {
-        cha_cli->mode = "o";
-    }
-    else
-    {
-        cha_cli->mode = "-o";
+        cha_cli->modes |= MEMBER_OP;
     }
-    pthread_mutex_unlock(&ctx->channels_lock);
+    channel_names_add(c, cha_cli);
+    ctx->channels_generation++;
+    server_unlock_CHANNELS(ctx);
 
     return cha_cli;
 }
 
 
+void server_leave_CHANNEL(server_ctx *ctx, channel_t **channels, channel_t *channel, client_t *user)
+{
+    /*
+     * server_leave_CHANNEL - Remove a member from a channel, and the
+     * channel once it is empty (Not thread-safe, called with the table
+     * taken by server_lock_CHANNELS)
+     *
+     * ctx: server_context
+     *
+     * channels: the table of the channel
+     *
+     * channel: the channel, freed if it is removed
+     *
+     * user: the member
+     *
+     * Return: nothing
+     *
+     */
+    remove_CHANNEL_CLIENT(user, channel);
+    channel_names_invalidate(channel);
+    ctx->channels_generation++;
+    if (HASH_COUNT(channel->channel_clients) <= 0)
+    {
+        history_drop(ctx, channel->channel_name);
+        persist_mark(ctx, channel, true);
+        remove_CHANNEL(channel->channel_name, channels);
+        counter_add(&ctx->counters, COUNTER_CHANNELS, -1);
+    }
+}
+
+
 irc_oper_t *server_add_OPER(server_ctx *ctx, irc_oper_t *irc_operator_value)
 {
     /*
@@ -249,9 +433,11 @@ irc_oper_t *server_add_OPER(server_ctx *ctx, irc_oper_t *irc_operator_value)
      * Return: The added operator.
      *
      */
-    pthread_mutex_lock(&ctx->operators_lock);
+    trace_mutex_lock(&ctx->operators_lock, "operators_lock");
     HASH_ADD_STR(ctx->irc_operators_hashtable, nick, irc_operator_value);
+    ctx->persist_opers_dirty = true;
     pthread_mutex_unlock(&ctx->operators_lock);
+    counter_add(&ctx->counters, COUNTER_OPERATORS, 1);
 
     return irc_operator_value;
 }
@@ -260,58 +446,407 @@ irc_oper_t *server_add_OPER(server_ctx *ctx, irc_oper_t *irc_operator_value)
 void add_connected_user_number(server_ctx *ctx)
 {
     /*
-     * add_connected_user_number - (Thread-safe)add connected user number
+     * add_connected_user_number - (Lock-free)add connected user number
      *
      * ctx: server_context
      *
      * Return: nothing
      */
-    pthread_mutex_lock(&ctx->lock);
-    ctx->num_connected_users++;
-    pthread_mutex_unlock(&ctx->lock);
+    counter_add(&ctx->counters, COUNTER_USERS, 1);
 }
 
 
 void dec_connected_user_number(server_ctx *ctx)
 {
     /*
-     * dec_connected_user_number - (Thread-safe)decrease connected user number
+     * dec_connected_user_number - (Lock-free)decrease connected user number
      *
      * ctx: server_context
      *
      * Return: nothing
      */
-    pthread_mutex_lock(&ctx->lock);
-    ctx->num_connected_users--;
-    pthread_mutex_unlock(&ctx->lock);
+    counter_add(&ctx->counters, COUNTER_USERS, -1);
 }
 
 
 void add_total_connected_number(server_ctx *ctx)
 {
     /*
-     * add_total_connected_number - (Thread-safe)add total connections number
+     * add_total_connected_number - (Lock-free)add total connections number
      *
      * ctx: server_context
      *
      * Return: nothing
      */
-    pthread_mutex_lock(&ctx->lock);
-    ctx->total_connections++;
-    pthread_mutex_unlock(&ctx->lock);
+    counter_add(&ctx->counters, COUNTER_CONNECTIONS, 1);
 }
 
 
 void dec_total_connected_number(server_ctx *ctx)
 {
     /*
-     * dec_total_connected_number - (Thread-safe)decrease total connections number
+     * dec_total_connected_number - (Lock-free)decrease total connections number
      *
      * ctx: server_context
      *
      * Return: nothing
      */
-    pthread_mutex_lock(&ctx->lock);
-    ctx->total_connections--;
+    counter_add(&ctx->counters, COUNTER_CONNECTIONS, -1);
+}
+
+
+/*
+ * server_id - Numeric ID of this server, 0 when running standalone
+ */
+static unsigned int server_id(server_ctx *ctx)
+{
+    return ctx->network ? ctx->network->self->id : 0;
+}
+
+
+uint64_t server_new_UID(server_ctx *ctx)
+{
+    /*
+     * server_new_UID - (Thread-safe)Allocate a network-wide ID for a new user
+     *
+     * ctx: server_context
+     *
+     * Return: the new user ID
+     */
+    trace_mutex_lock(&ctx->lock, "ctx_lock");
+    uint32_t counter = ++ctx->uid_counter;
+    pthread_mutex_unlock(&ctx->lock);
+
+    return uid_make(server_id(ctx), counter);
+}
+
+
+uint64_t server_new_CID(server_ctx *ctx)
+{
+    /*
+     * server_new_CID - (Thread-safe)Allocate a network-wide ID for a new channel
+     *
+     * ctx: server_context
+     *
+     * Return: the new channel ID
+     */
+    trace_mutex_lock(&ctx->lock, "ctx_lock");
+    uint32_t counter = ++ctx->cid_counter;
     pthread_mutex_unlock(&ctx->lock);
+
+    return uid_make(server_id(ctx), counter);
+}
+
+
+void server_resolve_TARGETS(server_ctx *ctx, client_t *user, msg_target_t *targets, int count)
+{
+    /*
+     * server_resolve_TARGETS - (Thread-safe)Resolve the targets of a PRIVMSG or NOTICE
+     * to the sockets of their recipients, all under one hold of the locks
+     *
+     * ctx: server_context
+     *
+     * user: the sender, who must be in the channels it sends to
+     *
+     * targets: the targets, with name set
+     *
+     * count: the number of targets
+     *
+     * Return: nothing
+     */
+    nick_t **nicks_hashtable = &ctx->nicks_hashtable;
+    channel_t **channels = NULL;
+    bool nicks = false;
+
+    /* Only the tables the targets need: a shard holds just its own
+     * channels, and messages to a user run on the worker */
+    for (int i = 0; i < count; i++)
+    {
+        if (targets[i].name[0] == '#')
+        {
+            channels = channels != NULL ? channels : server_lock_CHANNELS(ctx);
+        }
+        else
+        {
+            nicks = true;
+        }
+    }
+    if (nicks)
+    {
+        trace_mutex_lock(&ctx->nicks_lock, "nicks_lock");
+    }
+    for (int i = 0; i < count; i++)
+    {
+        msg_target_t *t = &targets[i];
+
+        t->error = NULL;
+        t->sockets = NULL;
+        t->nsockets = 0;
+
+        if (t->name[0] != '#')
+        {
+            nick_t *n = find_NICK(t->name, nicks_hashtable);
+            if (n == NULL) // Nickname not exist
+            {
+                t->error = ERR_NOSUCHNICK;
+                continue;
+            }
+            t->sockets = malloc(sizeof(int));
+            t->sockets[t->nsockets++] = n->client_socket;
+            continue;
+        }
+
+        channel_t *c = find_CHANNEL(t->name, channels);
+        if (c == NULL) // Channel not exist
+        {
+            t->error = ERR_NOSUCHNICK;
+            continue;
+        }
+        if (find_CHANNEL_CLIENT(user, &c->channel_clients) == NULL) // Sender not in the channel
+        {
+            t->error = ERR_CANNOTSENDTOCHAN;
+            continue;
+        }
+
+        t->sockets = malloc(HASH_COUNT(c->channel_clients) * sizeof(int));
+        for (channel_client *cc = c->channel_clients; cc != NULL; cc = cc->hh.next)
+        {
+            /* Do not send msg to self */
+            if (cc->user != user)
+            {
+                t->sockets[t->nsockets++] = cc->user->socket;
+            }
+        }
+    }
+    if (nicks)
+    {
+        pthread_mutex_unlock(&ctx->nicks_lock);
+    }
+    if (channels != NULL)
+    {
+        server_unlock_CHANNELS(ctx);
+    }
+}
+
+
+bool server_find_BANNED(server_ctx *ctx, channel_t *channel, sds hostmask)
+{
+    /*
+     * server_find_BANNED - (Thread-safe)Check a joining user against the ban
+     * and exception lists of a channel
+     *
+     * ctx: server_context
+     *
+     * channel: the channel
+     *
+     * hostmask: nick!user@host of the user
+     *
+     * Return: true if a ban matches and no exception does.
+     */
+    server_lock_CHANNELS(ctx);
+    bool banned = banlist_match(&channel->bans, hostmask) &&
+                  !banlist_match(&channel->excepts, hostmask);
+    server_unlock_CHANNELS(ctx);
+
+    return banned;
+}
+
+
+/*
+ * who_row_add - Append the WHO row of a user (Not thread-safe, called
+ * with clients_lock held)
+ */
+static void who_row_add(who_row_t **rows, int *count, int *size,
+                        client_t *client, bool chanop)
+{
+    if (*count == *size)
+    {
+        *size = *size ? *size * 2 : 16;
+        *rows = realloc(*rows, *size * sizeof(who_row_t));
+    }
+
+    who_row_t *row = &(*rows)[(*count)++];
+    char *status = row->status;
+
+    row->nick = sdsdup(client->info.nick);
+    row->username = sdsdup(client->info.username);
+    row->hostname = sdsdup(client->client_hostname);
+    row->realname = sdsdup(client->info.realname);
+    *status++ = 'H';
+    if (client->info.is_irc_operator)
+    {
+        *status++ = '*';
+    }
+    if (chanop)
+    {
+        *status++ = '@';
+    }
+    *status = '\0';
+}
+
+
+int server_find_WHO_CHANNEL(server_ctx *ctx, sds channel_name, bool opers_only,
+                            who_row_t **rows)
+{
+    /*
+     * server_find_WHO_CHANNEL - (Thread-safe)Copy the WHO rows of the members
+     * of a channel, found through the channel's member table
+     *
+     * ctx: server_context
+     *
+     * channel_name: the channel
+     *
+     * opers_only: only list IRC operators
+     *
+     * rows: set to a malloc'd array, to be freed with who_rows_free
+     *
+     * Return: The number of rows, or -1 if the channel does not exist.
+     *
+     * Only the members are visited, never the whole user table, and the
+     * rows are copied so the replies are sent with no lock held.
+     */
+    int count = 0, size = 0;
+
+    *rows = NULL;
+    channel_t *c = find_CHANNEL(channel_name, server_lock_CHANNELS(ctx));
+    if (c == NULL)
+    {
+        server_unlock_CHANNELS(ctx);
+        return -1;
+    }
+
+    trace_mutex_lock(&ctx->clients_lock, "clients_lock");
+    for (channel_client *cc = c->channel_clients; cc != NULL; cc = cc->hh.next)
+    {
+        if (opers_only && !cc->user->info.is_irc_operator)
+        {
+            continue;
+        }
+        who_row_add(rows, &count, &size, cc->user, cc->modes & MEMBER_OP);
+    }
+    pthread_mutex_unlock(&ctx->clients_lock);
+    server_unlock_CHANNELS(ctx);
+
+    return count;
+}
+
+
+static int compare_sockets(const void *a, const void *b)
+{
+    int x = *(const int *)a, y = *(const int *)b;
+
+    return (x > y) - (x < y);
+}
+
+
+int server_find_WHO_MASK(server_ctx *ctx, client_t *user, const mask_t *mask,
+                         bool opers_only, const int *shared, int nshared, who_row_t **rows)
+{
+    /*
+     * server_find_WHO_MASK - (Thread-safe)Copy the WHO rows of the registered
+     * users whose nickname, username, hostname or realname match a mask
+     *
+     * ctx: server_context
+     *
+     * user: the user asking
+     *
+     * mask: the compiled mask, or NULL to list the users who share no channel
+     * with the user asking, the user asking included
+     *
+     * opers_only: only list IRC operators
+     *
+     * shared: with channel shards and no mask, the sorted sockets of the
+     * users sharing a channel with the user asking, found by
+     * shard_neighbors; NULL otherwise
+     *
+     * nshared: the number of shared sockets
+     *
+     * rows: set to a malloc'd array, to be freed with who_rows_free
+     *
+     * Return: The number of rows.
+     *
+     * Without a mask or channel shards, the members of the channels of the
+     * user asking are stamped with a new epoch as in server_find_NEIGHBORS,
+     * and every other user is listed. With a mask, no channel is used.
+     */
+    int count = 0, size = 0;
+    uint64_t epoch = 0;
+    bool stamp = mask == NULL && ctx->shards == NULL;
+
+    *rows = NULL;
+    if (stamp)
+    {
+        trace_mutex_lock(&ctx->channels_lock, "channels_lock");
+        epoch = ++ctx->relay_epoch;
+        for (channel_client *joined = user->channels; joined != NULL; joined = joined->next_joined)
+        {
+            for (channel_client *cc = joined->channel->channel_clients; cc != NULL; cc = cc->hh.next)
+            {
+                cc->user->relay_epoch = epoch;
+            }
+        }
+    }
+
+    trace_mutex_lock(&ctx->clients_lock, "clients_lock");
+    for (client_t *client = ctx->client_hashtable; client != NULL; client = client->hh.next)
+    {
+        if (client->info.state != REGISTERED || (opers_only && !client->info.is_irc_operator))
+        {
+            continue;
+        }
+        if (stamp)
+        {
+            if (client->relay_epoch == epoch) // Shares a channel
+            {
+                continue;
+            }
+        }
+        else if (mask == NULL)
+        {
+            /* The user asking is only its own neighbor while in a channel */
+            if (client == user ? user->channels != NULL :
+                bsearch(&client->socket, shared, nshared, sizeof(int), compare_sockets) != NULL)
+            {
+                continue;
+            }
+        }
+        else if (!mask_match(mask, client->info.nick) &&
+                 !mask_match(mask, client->info.username) &&
+                 !mask_match(mask, client->client_hostname) &&
+                 !mask_match(mask, client->info.realname))
+        {
+            continue;
+        }
+        who_row_add(rows, &count, &size, client, false);
+    }
+    pthread_mutex_unlock(&ctx->clients_lock);
+    if (stamp)
+    {
+        pthread_mutex_unlock(&ctx->channels_lock);
+    }
+
+    return count;
+}
+
+
+void who_rows_free(who_row_t *rows, int count)
+{
+    /*
+     * who_rows_free - Free the rows copied by server_find_WHO_CHANNEL or
+     * server_find_WHO_MASK
+     *
+     * rows: the rows
+     *
+     * count: the number of rows
+     *
+     * Return: nothing
+     */
+    for (int i = 0; i < count; i++)
+    {
+        sdsfree(rows[i].nick);
+        sdsfree(rows[i].username);
+        sdsfree(rows[i].hostname);
+        sdsfree(rows[i].realname);
+    }
+    free(rows);
 }
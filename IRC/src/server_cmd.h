@@ -1,7 +1,54 @@
+#ifndef SERVER_CMD_H_
+#define SERVER_CMD_H_
+
 #include "server.h"
 #include "client.h"
 #include "../lib/sds/sds.h"
 #include "channels.h"
+#include "mask.h"
+
+/* One target of a PRIVMSG or NOTICE, filled in by server_resolve_TARGETS */
+typedef struct msg_target
+{
+    sds name;     /* Nickname or channel name, as given by the sender */
+    char *error;  /* Error reply code if the message cannot be delivered, else NULL */
+    int *sockets; /* Client sockets to deliver to (malloc'd) */
+    int nsockets; /* Number of sockets */
+} msg_target_t;
+
+#define WHO_BATCH_BYTES 4096 /* WHO replies are sent in batches of about this size */
+
+/* One RPL_WHOREPLY line, copied out of the tables so it can be sent
+ * after the locks are released */
+typedef struct who_row
+{
+    sds nick;
+    sds username;
+    sds hostname;
+    sds realname;
+    char status[4]; /* "H", then "*" for an IRC operator, then "@" for a channel operator */
+} who_row_t;
+
+/*
+ * server_lock_CHANNELS - Take the channel table: the one of the calling
+ * shard with channel shards, which no other thread uses, or
+ * ctx->channels_hashtable under channels_lock
+ *
+ * ctx: server_context
+ *
+ * Returns: The table, to be given back with server_unlock_CHANNELS.
+ */
+channel_t **server_lock_CHANNELS(server_ctx *ctx);
+
+/*
+ * server_unlock_CHANNELS - Give back the table taken by
+ * server_lock_CHANNELS
+ *
+ * ctx: server_context
+ *
+ * Returns: nothing
+ */
+void server_unlock_CHANNELS(server_ctx *ctx);
 
 /*
  * server_find_USER - (Thread-safe) Find connected client
@@ -43,20 +90,20 @@ channel_t *server_find_CHANNEL(server_ctx *ctx, sds channel_name);
 nick_t *server_find_NICK(server_ctx *ctx, sds nickname);
 
 /*
- * server_find_CHANNEL_CLIENT - (Thread-safe)Find the client in
- * channel with the given nick name
+ * server_find_CHANNEL_CLIENT - (Thread-safe)Find the membership of a
+ * user in a channel
  *
  * ctx: server_context
  *
  * channel: the channel which may include the client
  *
- * nickname: the nickname to be searched as key
+ * user: the user to be searched as key
  *
- * Return: The channel_client with given nickname or NULL if not exists.
+ * Return: The channel_client of the user or NULL if not exists.
  *
  */
 channel_client *server_find_CHANNEL_CLIENT(server_ctx *ctx,
-                                           channel_t *channel, sds nickname);
+                                           channel_t *channel, client_t *user);
 
 /*
  * server_find_OPER - (Thread-safe)Find operator with the given nickname
@@ -103,7 +150,8 @@ client_t *server_add_USER(server_ctx *ctx, client_t *client,
 
 /*
  * server_add_CHANNEL - (Thread-safe)Add channel with the given
- * channel name
+ * channel name, with the mask lists restored for it from the snapshot if
+ * there are any
  *
  * ctx: server_context
  *
@@ -120,20 +168,37 @@ channel_t *server_add_CHANNEL(server_ctx *ctx, sds channel_name);
  *
  * ctx: server_context
  *
- * nickname: The nickname you want to insert the client into the
- * channel as key
+ * user: The user you want to insert into the channel as key
  *
  * channel_name: channel_name to be added
  *
- * flag: If flag == 1, channel exists, else channel is newly created.
+ * flag: If flag == 1, channel exists, else channel is newly created
+ * and the user is its operator.
+ *
+ * Return: The channel_client of the user after adding it to the
+ * hashtable.
+ *
+ */
+channel_client *server_add_CHANNEL_CLIENT(server_ctx *ctx, client_t *user,
+                                          sds channel_name, bool flag);
+
+/*
+ * server_leave_CHANNEL - Remove a member from a channel, and the channel
+ * once it is empty (Not thread-safe, called with the table taken by
+ * server_lock_CHANNELS)
+ *
+ * ctx: server_context
+ *
+ * channels: the table of the channel
+ *
+ * channel: the channel, freed if it is removed
+ *
+ * user: the member
  *
- * Return: The channel_client with given nickname after adding it to
- * the hashtable.
+ * Return: nothing
  *
  */
-channel_client *server_add_CHANNEL_CLIENT(server_ctx *ctx,
-                                          sds nickname, sds channel_name, 
-                                          bool flag);
+void server_leave_CHANNEL(server_ctx *ctx, channel_t **channels, channel_t *channel, client_t *user);
 
 /*
  * server_add_OPER - (Thread-safe)Add operator to the hashtable
@@ -160,7 +225,50 @@ irc_oper_t *server_add_OPER(server_ctx *ctx, irc_oper_t *irc_operator_value);
 void server_remove_NICK(server_ctx *ctx, sds nickname);
 
 /*
- * add_connected_user_number - (Thread-safe)add connected user number
+ * server_remove_USER - (Thread-safe)Remove client from client_hashtable
+ * table
+ *
+ * ctx: server_context
+ *
+ * client_socket: client socket of the user to be removed
+ *
+ * Returns: nothing
+ */
+void server_remove_USER(server_ctx *ctx, int client_socket);
+
+/*
+ * server_take_USER - (Thread-safe)Remove client from client_hashtable
+ * table without freeing it, for the channel shards to drop its
+ * memberships first
+ *
+ * ctx: server_context
+ *
+ * client_socket: client socket of the user to be removed
+ *
+ * Returns: The client, to be freed with free_USER, or NULL
+ */
+client_t *server_take_USER(server_ctx *ctx, int client_socket);
+
+/*
+ * server_find_NEIGHBORS - (Thread-safe)Find the sockets of every user
+ * sharing at least one channel with the given user, each listed once
+ * however many channels they share
+ *
+ * ctx: server_context
+ *
+ * user: the user whose neighbors are searched, not listed itself
+ *
+ * sockets: set to a malloc'd array of client sockets, to be freed by
+ * the caller
+ *
+ * Returns: The number of sockets.
+ *
+ * Without channel shards only, which find them with shard_neighbors.
+ */
+int server_find_NEIGHBORS(server_ctx *ctx, client_t *user, int **sockets);
+
+/*
+ * add_connected_user_number - (Lock-free)add connected user number
  *
  * ctx: server_context
  *
@@ -169,7 +277,7 @@ void server_remove_NICK(server_ctx *ctx, sds nickname);
 void add_connected_user_number(server_ctx *ctx);
 
 /*
- * dec_connected_user_number - (Thread-safe)decrease connected user number
+ * dec_connected_user_number - (Lock-free)decrease connected user number
  *
  * ctx: server_context
  *
@@ -178,7 +286,7 @@ void add_connected_user_number(server_ctx *ctx);
 void dec_connected_user_number(server_ctx *ctx);
 
 /*
- * add_total_connected_number - (Thread-safe)add total connections number
+ * add_total_connected_number - (Lock-free)add total connections number
  *
  * ctx: server_context
  *
@@ -187,11 +295,119 @@ void dec_connected_user_number(server_ctx *ctx);
 void add_total_connected_number(server_ctx *ctx);
 
 /*
- * dec_total_connected_number - (Thread-safe)decrease total
+ * dec_total_connected_number - (Lock-free)decrease total
  * connections number
  *
  * ctx: server_context
  *
  * Returns: nothing
  */
-void dec_total_connected_number(server_ctx *ctx);
\ No newline at end of file
+void dec_total_connected_number(server_ctx *ctx);
+
+/*
+ * server_new_UID - (Thread-safe)Allocate a network-wide ID for a new user
+ *
+ * ctx: server_context
+ *
+ * Returns: the new user ID
+ */
+uint64_t server_new_UID(server_ctx *ctx);
+
+/*
+ * server_new_CID - (Thread-safe)Allocate a network-wide ID for a new channel
+ *
+ * ctx: server_context
+ *
+ * Returns: the new channel ID
+ */
+uint64_t server_new_CID(server_ctx *ctx);
+
+/*
+ * server_resolve_TARGETS - (Thread-safe)Resolve the targets of a PRIVMSG
+ * or NOTICE to the sockets of their recipients, all under one hold of
+ * the locks. With channel shards, the channels are those of the calling
+ * shard.
+ *
+ * ctx: server_context
+ *
+ * user: the sender, who must be in the channels it sends to and does
+ * not receive its own channel messages
+ *
+ * targets: the targets, with name set
+ *
+ * count: the number of targets
+ *
+ * Returns: nothing
+ */
+void server_resolve_TARGETS(server_ctx *ctx, client_t *user, msg_target_t *targets, int count);
+
+/*
+ * server_find_BANNED - (Thread-safe)Check a joining user against the ban
+ * and exception lists of a channel
+ *
+ * ctx: server_context
+ *
+ * channel: the channel
+ *
+ * hostmask: nick!user@host of the user
+ *
+ * Returns: true if a ban matches and no exception does.
+ */
+bool server_find_BANNED(server_ctx *ctx, channel_t *channel, sds hostmask);
+
+/*
+ * server_find_WHO_CHANNEL - (Thread-safe)Copy the WHO rows of the members
+ * of a channel, found through the channel's member table
+ *
+ * ctx: server_context
+ *
+ * channel_name: the channel
+ *
+ * opers_only: only list IRC operators
+ *
+ * rows: set to a malloc'd array, to be freed with who_rows_free
+ *
+ * Returns: The number of rows, or -1 if the channel does not exist.
+ */
+int server_find_WHO_CHANNEL(server_ctx *ctx, sds channel_name, bool opers_only,
+                            who_row_t **rows);
+
+/*
+ * server_find_WHO_MASK - (Thread-safe)Copy the WHO rows of the registered
+ * users whose nickname, username, hostname or realname match a mask
+ *
+ * ctx: server_context
+ *
+ * user: the user asking
+ *
+ * mask: the compiled mask, or NULL to list the users who share no channel
+ * with the user asking, the user asking included
+ *
+ * opers_only: only list IRC operators
+ *
+ * shared: with channel shards and no mask, the sorted sockets of the
+ * users sharing a channel with the user asking, found by shard_neighbors;
+ * NULL otherwise
+ *
+ * nshared: the number of shared sockets
+ *
+ * rows: set to a malloc'd array, to be freed with who_rows_free
+ *
+ * Returns: The number of rows.
+ */
+int server_find_WHO_MASK(server_ctx *ctx, client_t *user, const mask_t *mask,
+                         bool opers_only, const int *shared, int nshared, who_row_t **rows);
+
+/*
+ * who_rows_free - Free the rows copied by server_find_WHO_CHANNEL or
+ * server_find_WHO_MASK
+ *
+ * rows: the rows
+ *
+ * count: the number of rows
+ *
+ * Returns: nothing
+ */
+void who_rows_free(who_row_t *rows, int count);
+
+#endif
@@ -0,0 +1,698 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <sched.h>
+#include <pthread.h>
+#include "shard.h"
+#include "pool.h"
+#include "stats.h"
+#include "server.h"
+#include "server_cmd.h"
+#include "handlers.h"
+#include "channels.h"
+#include "reply.h"
+#include "log.h"
+#include "trace.h"
+#include "../lib/uthash.h"
+#include "../lib/sds/sds.h"
+
+/* Arguments of a shard thread */
+typedef struct shard_thread_args
+{
+    server_ctx *ctx;
+    int index;
+} shard_thread_args;
+
+static __thread int this_shard = -1;     /* Shard run by the calling thread, -1 for other threads */
+
+
+/* FNV-1a of the channel name */
+static int shard_of(server_ctx *ctx, sds channel_name)
+{
+    uint32_t h = 2166136261u;
+
+    for (size_t i = 0; i < sdslen(channel_name); i++)
+    {
+        h ^= (unsigned char)channel_name[i];
+        h *= 16777619u;
+    }
+    return h % ctx->nshards;
+}
+
+
+/* Append a message to a queue (any thread) */
+static void push(shard_t *sh, shard_msg_t *msg)
+{
+    atomic_store_explicit(&msg->next, NULL, memory_order_relaxed);
+    shard_msg_t *prev = atomic_exchange_explicit(&sh->head, msg, memory_order_acq_rel);
+    atomic_store_explicit(&prev->next, msg, memory_order_release);
+}
+
+
+/*
+ * pop - Take the oldest message of a queue (one consumer at a time)
+ *
+ * Return: the message, or NULL if the queue is empty or a producer is
+ * between its exchange and its link
+ */
+static shard_msg_t *pop(shard_t *sh)
+{
+    shard_msg_t *tail = sh->tail;
+    shard_msg_t *next = atomic_load_explicit(&tail->next, memory_order_acquire);
+
+    if (tail == &sh->stub)
+    {
+        if (next == NULL)
+        {
+            return NULL;
+        }
+        sh->tail = next;
+        tail = next;
+        next = atomic_load_explicit(&tail->next, memory_order_acquire);
+    }
+    if (next != NULL)
+    {
+        sh->tail = next;
+        return tail;
+    }
+    if (tail != atomic_load_explicit(&sh->head, memory_order_acquire))
+    {
+        return NULL;
+    }
+
+    /* tail is the last message: put the stub behind it to take it */
+    push(sh, &sh->stub);
+    next = atomic_load_explicit(&tail->next, memory_order_acquire);
+    if (next != NULL)
+    {
+        sh->tail = next;
+        return tail;
+    }
+    return NULL;
+}
+
+
+/* Take a message known to be posted, waiting out a producer mid-push */
+static shard_msg_t *take(shard_t *sh)
+{
+    shard_msg_t *msg;
+
+    while ((msg = pop(sh)) == NULL)
+    {
+        sched_yield();
+    }
+    atomic_fetch_sub(&sh->pending, 1);
+
+    return msg;
+}
+
+
+/* Post a message, and wake the shard if it sleeps */
+static void post(server_ctx *ctx, int index, shard_msg_t *msg)
+{
+    shard_t *sh = &ctx->shards[index];
+
+    atomic_fetch_add(&msg->conn->pool->holds, 1);
+    push(sh, msg);
+    atomic_fetch_add(&sh->pending, 1);
+    if (atomic_load(&sh->sleeping))
+    {
+        pthread_mutex_lock(&sh->lock);
+        pthread_cond_signal(&sh->cond);
+        pthread_mutex_unlock(&sh->lock);
+    }
+}
+
+
+/* Run a command or a step as the calling thread, without freeing it */
+static void run_cmd(server_ctx *ctx, conn_info_t *conn, struct pool_cmd *cmd)
+{
+    conn->recv_ns = cmd->recv_ns;
+    conn->trace_id = cmd->trace_id;
+    trace_span(conn->trace_id, "shard", NULL, cmd->trace_ns, stats_now());
+    if (cmd->step != NULL)
+    {
+        cmd->step(ctx, conn, cmd->arg);
+    }
+    else
+    {
+        handle_request(ctx, cmd->tokens, cmd->argc, conn);
+        sdsfreesplitres(cmd->tokens, cmd->argc);
+    }
+}
+
+
+/* Run a message and let its connection go on once it has none left */
+static void process(server_ctx *ctx, shard_msg_t *msg)
+{
+    conn_info_t *conn = msg->conn;
+
+    run_cmd(ctx, conn, msg->cmd);
+    free(msg->cmd);
+    free(msg);
+    pool_continue(conn);
+}
+
+
+static void *shard_thread(void *args)
+{
+    shard_thread_args *ta = (shard_thread_args *)args;
+    server_ctx *ctx = ta->ctx;
+    shard_t *sh = &ctx->shards[ta->index];
+
+    this_shard = ta->index;
+    free(ta);
+    pthread_detach(pthread_self());
+
+    for (;;)
+    {
+        /* A poster that sees sleeping set signals under the same lock */
+        pthread_mutex_lock(&sh->lock);
+        atomic_store(&sh->sleeping, 1);
+        while (atomic_load(&sh->pending) == 0)
+        {
+            pthread_cond_wait(&sh->cond, &sh->lock);
+        }
+        atomic_store(&sh->sleeping, 0);
+        pthread_mutex_unlock(&sh->lock);
+
+        /* Messages are taken with the lock held, so a live upgrade finds
+         * every one either done or still queued */
+        pthread_rwlock_rdlock(&ctx->upgrade_lock);
+        for (int i = 0; i < SHARD_BATCH && atomic_load(&sh->pending) > 0; i++)
+        {
+            process(ctx, take(sh));
+        }
+        pthread_rwlock_unlock(&ctx->upgrade_lock);
+    }
+
+    return NULL;
+}
+
+
+int shard_init(server_ctx *ctx, int shards)
+{
+    /*
+     * shard_init - Start the channel shards
+     *
+     * ctx: server context, in split mode
+     *
+     * shards: number of shards
+     *
+     * Return: CHIRC_OK/CHIRC_ERROR
+     */
+    ctx->shards = aligned_alloc(64, shards * sizeof(shard_t));
+    memset(ctx->shards, 0, shards * sizeof(shard_t));
+    ctx->nshards = shards;
+
+    for (int i = 0; i < shards; i++)
+    {
+        shard_t *sh = &ctx->shards[i];
+
+        atomic_store(&sh->stub.next, NULL);
+        atomic_store(&sh->head, &sh->stub);
+        sh->tail = &sh->stub;
+        pthread_mutex_init(&sh->lock, NULL);
+        pthread_cond_init(&sh->cond, NULL);
+    }
+
+    for (int i = 0; i < shards; i++)
+    {
+        pthread_t tid;
+        shard_thread_args *ta = malloc(sizeof(shard_thread_args));
+
+        ta->ctx = ctx;
+        ta->index = i;
+        if (pthread_create(&tid, NULL, shard_thread, ta) != 0)
+        {
+            free(ta);
+            chilog(CRITICAL, "Could not create a shard thread");
+            return CHIRC_ERROR;
+        }
+    }
+    chilog(INFO, "Channels owned by %d shards", shards);
+
+    return CHIRC_OK;
+}
+
+
+int shard_route(server_ctx *ctx, sds *cmdtokens, int argc)
+{
+    /*
+     * shard_route - Where a command of a connection runs with channel shards
+     *
+     * ctx: server context
+     *
+     * cmdtokens: the command
+     *
+     * argc: number of tokens
+     *
+     * Return: the shard owning its channel, SHARD_SPLIT or SHARD_LOCAL
+     *
+     * Commands missing parameters change nothing and run on the worker,
+     * which replies the error. The commands without a channel, and those
+     * needing every shard, run on the worker too.
+     */
+    if (argc < 2)
+    {
+        return SHARD_LOCAL;
+    }
+
+    bool membership = !strcmp(cmdtokens[0], "JOIN") || !strcmp(cmdtokens[0], "PART") ||
+                      !strcmp(cmdtokens[0], "NAMES");
+    bool message = !strcmp(cmdtokens[0], "PRIVMSG") || !strcmp(cmdtokens[0], "NOTICE");
+    bool channel = !strcmp(cmdtokens[0], "MODE") || !strcmp(cmdtokens[0], "HISTORY") ||
+                   (!strcmp(cmdtokens[0], "WHO") && cmdtokens[1][0] == '#');
+
+    if (channel)
+    {
+        return shard_of(ctx, cmdtokens[1]);
+    }
+    if (!membership && (!message || argc < 3))
+    {
+        return SHARD_LOCAL;
+    }
+    if (strchr(cmdtokens[1], ',') != NULL)
+    {
+        return SHARD_SPLIT;
+    }
+    if (message && cmdtokens[1][0] != '#')
+    {
+        /* To a user */
+        return SHARD_LOCAL;
+    }
+    return shard_of(ctx, cmdtokens[1]);
+}
+
+
+void shard_post(server_ctx *ctx, int shard, conn_info_t *conn, struct pool_cmd *cmd)
+{
+    /*
+     * shard_post - Hand a command or a step to a shard
+     *
+     * ctx: server context
+     *
+     * shard: the shard, as returned by shard_route or set in the step
+     *
+     * conn: the connection, which waits until the command is run
+     *
+     * cmd: the command, taken over by the shard
+     *
+     * Return: nothing
+     */
+    shard_msg_t *msg = calloc(1, sizeof(shard_msg_t));
+
+    msg->conn = conn;
+    msg->cmd = cmd;
+    if (cmd->trace_id != 0)
+    {
+        cmd->trace_ns = stats_now();
+    }
+    post(ctx, shard, msg);
+}
+
+
+void shard_run(server_ctx *ctx, int shard, conn_info_t *conn, struct pool_cmd *cmd)
+{
+    /*
+     * shard_run - Run a step as the shard it is for, while the shards are
+     * stopped for a live upgrade
+     *
+     * ctx: server context
+     *
+     * shard: the shard, or SHARD_LOCAL for a step of the worker
+     *
+     * conn: the connection
+     *
+     * cmd: the step, not freed
+     *
+     * Return: nothing
+     */
+    int self = this_shard;
+
+    this_shard = shard;
+    run_cmd(ctx, conn, cmd);
+    this_shard = self;
+}
+
+
+channel_t **shard_table(server_ctx *ctx)
+{
+    /*
+     * shard_table - The channel table of the shard running the caller
+     *
+     * ctx: server context
+     *
+     * Return: the table, which only that shard uses
+     *
+     * The commands using a channel are routed to its owner, so any other
+     * thread getting here is a routing bug, which must not go on to use a
+     * table it does not own.
+     */
+    if (this_shard < 0)
+    {
+        chilog(CRITICAL, "A channel table was used outside of the channel shards");
+        exit(-1);
+    }
+    return &ctx->shards[this_shard].channels;
+}
+
+
+channel_t **shard_table_of(server_ctx *ctx, sds channel_name)
+{
+    /*
+     * shard_table_of - The table a channel belongs in
+     *
+     * ctx: server context
+     *
+     * channel_name: the channel
+     *
+     * Return: the table
+     */
+    if (ctx->shards == NULL)
+    {
+        return &ctx->channels_hashtable;
+    }
+    return &ctx->shards[shard_of(ctx, channel_name)].channels;
+}
+
+
+int shard_tables(server_ctx *ctx, channel_t **tables[SHARD_MAX])
+{
+    /*
+     * shard_tables - Every channel table, when no shard runs
+     *
+     * ctx: server context
+     *
+     * tables: filled in with up to SHARD_MAX tables
+     *
+     * Return: the number of tables
+     */
+    if (ctx->shards == NULL)
+    {
+        tables[0] = &ctx->channels_hashtable;
+        return 1;
+    }
+    for (int i = 0; i < ctx->nshards; i++)
+    {
+        tables[i] = &ctx->shards[i].channels;
+    }
+    return ctx->nshards;
+}
+
+
+/*
+ * steps - Put the steps of a command at the front of the queue of its
+ * connection: visit run by each of the shards in turn, then finish run by
+ * the worker
+ *
+ * conn: the connection running the command
+ *
+ * shards: the shards to visit, in order
+ *
+ * count: how many there are
+ *
+ * visit, finish, arg: the steps and the argument they share
+ */
+static void steps(conn_info_t *conn, const int *shards, int count,
+                  pool_step_fn visit, pool_step_fn finish, void *arg)
+{
+    struct pool_cmd *head = NULL, *tail = NULL;
+
+    for (int i = 0; i <= count; i++)
+    {
+        struct pool_cmd *cmd = calloc(1, sizeof(struct pool_cmd));
+
+        cmd->step = i < count ? visit : finish;
+        cmd->arg = arg;
+        cmd->shard = i < count ? shards[i] : SHARD_LOCAL;
+        cmd->recv_ns = conn->recv_ns;
+        cmd->trace_id = conn->trace_id;
+        cmd->trace_ns = cmd->trace_id != 0 ? stats_now() : 0;
+        if (tail == NULL)
+        {
+            head = cmd;
+        }
+        else
+        {
+            tail->next = cmd;
+        }
+        tail = cmd;
+    }
+    pool_requeue(conn, head, tail, count + 1);
+}
+
+
+/* A search for the neighbors of a user */
+typedef struct neighbors
+{
+    client_t *user;
+    shard_visit_t visit;
+    shard_neighbors_fn fn;
+    void *arg;
+    int *sockets;       /* Found so far, with duplicates */
+    int count;
+    int size;
+} neighbors_t;
+
+
+static int compare_sockets(const void *a, const void *b)
+{
+    int x = *(const int *)a, y = *(const int *)b;
+
+    return (x > y) - (x < y);
+}
+
+
+/* Visit the channels of the user owned by the calling shard */
+static void neighbors_visit(server_ctx *ctx, conn_info_t *conn, void *arg)
+{
+    neighbors_t *n = (neighbors_t *)arg;
+    channel_t **channels = shard_table(ctx);
+    channel_client *joined, *next;
+
+    (void)conn;
+    for (joined = n->user->channels; joined != NULL; joined = next)
+    {
+        /* Leaving frees the membership */
+        next = joined->next_joined;
+        channel_t *c = joined->channel;
+        if (!shard_owned(ctx, c->channel_name))
+        {
+            continue;
+        }
+
+        for (channel_client *cc = c->channel_clients; cc != NULL; cc = cc->hh.next)
+        {
+            if (cc->user == n->user)
+            {
+                continue;
+            }
+            if (n->count == n->size)
+            {
+                n->size = n->size ? n->size * 2 : 16;
+                n->sockets = realloc(n->sockets, n->size * sizeof(int));
+            }
+            n->sockets[n->count++] = cc->user->socket;
+        }
+
+        if (n->visit == SHARD_RENAME)
+        {
+            channel_names_invalidate(c);
+        }
+        else if (n->visit == SHARD_LEAVE)
+        {
+            server_leave_CHANNEL(ctx, channels, c, n->user);
+        }
+    }
+}
+
+
+/* Hand the neighbors, each once, to the command that searched them */
+static void neighbors_finish(server_ctx *ctx, conn_info_t *conn, void *arg)
+{
+    neighbors_t *n = (neighbors_t *)arg;
+    int count = 0;
+
+    qsort(n->sockets, n->count, sizeof(int), compare_sockets);
+    for (int i = 0; i < n->count; i++)
+    {
+        if (count == 0 || n->sockets[count - 1] != n->sockets[i])
+        {
+            n->sockets[count++] = n->sockets[i];
+        }
+    }
+    n->fn(ctx, conn, n->sockets, count, n->arg);
+    free(n->sockets);
+    free(n);
+}
+
+
+void shard_neighbors(server_ctx *ctx, conn_info_t *conn, client_t *user,
+                     shard_visit_t visit, shard_neighbors_fn fn, void *arg)
+{
+    /*
+     * shard_neighbors - Find the users sharing a channel with a user, by
+     * visiting the shards of its channels in turn, then run fn on the worker
+     *
+     * ctx: server context
+     *
+     * conn: the connection running the command
+     *
+     * user: the user
+     *
+     * visit: what the shards also do to the user's channels
+     *
+     * fn: run with the sockets of the neighbors
+     *
+     * arg: passed to fn
+     *
+     * Return: nothing
+     *
+     * The list of the user's memberships only changes through its own
+     * commands, so the worker running one reads it without a lock, and
+     * each shard only touches the channels it owns.
+     */
+    bool member[SHARD_MAX] = {false};
+    int shards[SHARD_MAX];
+    int count = 0;
+
+    for (channel_client *joined = user->channels; joined != NULL; joined = joined->next_joined)
+    {
+        int i = shard_of(ctx, joined->channel->channel_name);
+
+        if (!member[i])
+        {
+            member[i] = true;
+            shards[count++] = i;
+        }
+    }
+
+    if (count == 0)
+    {
+        fn(ctx, conn, NULL, 0, arg);
+        return;
+    }
+
+    neighbors_t *n = calloc(1, sizeof(neighbors_t));
+
+    n->user = user;
+    n->visit = visit;
+    n->fn = fn;
+    n->arg = arg;
+    steps(conn, shards, count, neighbors_visit, neighbors_finish, n);
+}
+
+
+/* A visit of every channel */
+typedef struct channels_walk
+{
+    shard_channel_fn each;
+    pool_step_fn finish;
+    void *arg;
+} channels_walk_t;
+
+
+/* Visit the channels owned by the calling shard */
+static void channels_visit(server_ctx *ctx, conn_info_t *conn, void *arg)
+{
+    channels_walk_t *w = (channels_walk_t *)arg;
+
+    (void)conn;
+    for (channel_t *c = *shard_table(ctx); c != NULL; c = c->hh.next)
+    {
+        w->each(ctx, c, w->arg);
+    }
+}
+
+
+static void channels_finish(server_ctx *ctx, conn_info_t *conn, void *arg)
+{
+    channels_walk_t *w = (channels_walk_t *)arg;
+
+    w->finish(ctx, conn, w->arg);
+    free(w);
+}
+
+
+void shard_channels(server_ctx *ctx, conn_info_t *conn, shard_channel_fn each,
+                    pool_step_fn finish, void *arg)
+{
+    /*
+     * shard_channels - Visit every channel, shard by shard, then run finish
+     * on the worker
+     *
+     * ctx: server context
+     *
+     * conn: the connection running the command
+     *
+     * each: run by the owner of each channel
+     *
+     * finish: run by the worker once every shard was visited
+     *
+     * arg: passed to each and finish
+     *
+     * Return: nothing
+     */
+    channels_walk_t *w = malloc(sizeof(channels_walk_t));
+    int shards[SHARD_MAX];
+
+    for (int i = 0; i < ctx->nshards; i++)
+    {
+        shards[i] = i;
+    }
+    w->each = each;
+    w->finish = finish;
+    w->arg = arg;
+    steps(conn, shards, ctx->nshards, channels_visit, channels_finish, w);
+}
+
+
+bool shard_owned(server_ctx *ctx, sds channel_name)
+{
+    /*
+     * shard_owned - Whether the calling thread is the shard owning a channel
+     *
+     * ctx: server context
+     *
+     * channel_name: the channel
+     *
+     * Return: true if it is
+     */
+    return ctx->shards != NULL && this_shard >= 0 && shard_of(ctx, channel_name) == this_shard;
+}
+
+
+void shard_quiesce(server_ctx *ctx)
+{
+    /*
+     * shard_quiesce - Run the messages left in the queues
+     *
+     * ctx: server context
+     *
+     * Return: nothing
+     *
+     * The shards wait on the lock held here, so this thread is the only
+     * consumer of their queues, and runs the messages of each as that
+     * shard. The connections it lets go on are run by the workers after
+     * the upgrade, or handed over with their input.
+     */
+    if (ctx->shards == NULL)
+    {
+        return;
+    }
+    for (int i = 0; i < ctx->nshards; i++)
+    {
+        shard_t *sh = &ctx->shards[i];
+
+        this_shard = i;
+        while (atomic_load(&sh->pending) > 0)
+        {
+            process(ctx, take(sh));
+        }
+    }
+    this_shard = -1;
+}
@@ -0,0 +1,232 @@
+#ifndef SHARD_H_
+#define SHARD_H_
+
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include "server.h"
+#include "server_cmd.h"
+#include "pool.h"
+#include "../lib/sds/sds.h"
+
+#define SHARD_MAX 64        /* Most channel shards */
+#define SHARD_BATCH 64      /* Messages taken by a shard for one hold of ctx->upgrade_lock */
+
+#define SHARD_LOCAL -1      /* shard_route: the worker runs the command */
+#define SHARD_SPLIT -2      /* shard_route: the command is run once per target */
+
+/*
+ * Channel shards (-c, with split mode): each channel is owned by one
+ * shard, a thread chosen by hashing the channel name, and is kept in the
+ * shard's own table, which no other thread reads or writes. The commands
+ * on one channel (JOIN, PART, MODE, NAMES, WHO, HISTORY, and PRIVMSG or
+ * NOTICE to a channel) are posted to the owner's queue instead of being
+ * run by the worker, and use the table without any lock; those naming
+ * several channels are run once per channel first.
+ *
+ * The commands that need the channels of several shards (NICK, QUIT,
+ * LIST, and NAMES or WHO of everyone) visit the shards in turn through
+ * their queues, each adding what its own channels hold, and are finished
+ * by the worker. QUIT thus takes the user out of its channels shard by
+ * shard, and the client is freed once the last one is done. The
+ * connection waits until a shard is done with it, so its commands and
+ * their steps run in order, and the list of a user's memberships only
+ * changes through the user's own commands.
+ *
+ * The queues are intrusive multi-producer single-consumer lists (Vyukov):
+ * posting is one atomic exchange, and a shard only sleeps on its condition
+ * variable when its queue is empty.
+ */
+
+/* A message to a shard */
+typedef struct shard_msg
+{
+    _Atomic(struct shard_msg *) next;
+    conn_info_t *conn;      /* Connection waiting for the message to be done */
+    struct pool_cmd *cmd;   /* Command or step to run */
+} shard_msg_t;
+
+typedef struct shard
+{
+    _Alignas(64) _Atomic(shard_msg_t *) head;   /* Producers push here */
+    atomic_int pending;                         /* Messages posted and not taken */
+    atomic_int sleeping;                        /* The shard waits on cond */
+    _Alignas(64) shard_msg_t *tail;             /* The shard takes from here */
+    shard_msg_t stub;
+    channel_t *channels;                        /* Channels owned, only used by the shard */
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+} shard_t;
+
+/* What the shards of a user's channels do besides finding its neighbors */
+typedef enum
+{
+    SHARD_FIND,     /* Nothing */
+    SHARD_RENAME,   /* Rebuild the member lists, the nick changed */
+    SHARD_LEAVE     /* Take the user out of the channels */
+} shard_visit_t;
+
+/* Run by the worker with the sockets found by shard_neighbors */
+typedef void (*shard_neighbors_fn)(server_ctx *ctx, conn_info_t *conn,
+                                   int *sockets, int count, void *arg);
+
+/* Run by a shard for each of its channels, for shard_channels */
+typedef void (*shard_channel_fn)(server_ctx *ctx, channel_t *c, void *arg);
+
+/*
+ * shard_init - Start the channel shards
+ *
+ * ctx: server context, in split mode
+ *
+ * shards: number of shards
+ *
+ * Return: CHIRC_OK/CHIRC_ERROR
+ */
+int shard_init(server_ctx *ctx, int shards);
+
+/*
+ * shard_route - Where a command of a connection runs with channel shards
+ *
+ * ctx: server context
+ *
+ * cmdtokens: the command
+ *
+ * argc: number of tokens
+ *
+ * Return: the shard owning its channel, SHARD_SPLIT if it has several
+ * targets and is to be run once for each first, or SHARD_LOCAL
+ */
+int shard_route(server_ctx *ctx, sds *cmdtokens, int argc);
+
+/*
+ * shard_post - Hand a command or a step to a shard
+ *
+ * ctx: server context
+ *
+ * shard: the shard, as returned by shard_route or set in the step
+ *
+ * conn: the connection, which waits until the command is run
+ *
+ * cmd: the command, taken over by the shard
+ *
+ * Return: nothing
+ */
+void shard_post(server_ctx *ctx, int shard, conn_info_t *conn, struct pool_cmd *cmd);
+
+/*
+ * shard_run - Run a step as the shard it is for, while the shards are
+ * stopped for a live upgrade (called with ctx->upgrade_lock held for
+ * writing)
+ *
+ * ctx: server context
+ *
+ * shard: the shard, or SHARD_LOCAL for a step of the worker
+ *
+ * conn: the connection
+ *
+ * cmd: the step, not freed
+ *
+ * Return: nothing
+ */
+void shard_run(server_ctx *ctx, int shard, conn_info_t *conn, struct pool_cmd *cmd);
+
+/*
+ * shard_table - The channel table of the shard running the caller, with
+ * channel shards
+ *
+ * ctx: server context
+ *
+ * Return: the table, which only that shard uses
+ */
+channel_t **shard_table(server_ctx *ctx);
+
+/*
+ * shard_table_of - The table a channel belongs in: the one of the shard
+ * owning it with channel shards, ctx->channels_hashtable otherwise
+ *
+ * ctx: server context
+ *
+ * channel_name: the channel
+ *
+ * Return: the table
+ */
+channel_t **shard_table_of(server_ctx *ctx, sds channel_name);
+
+/*
+ * shard_tables - Every channel table, for a live upgrade or a shutdown,
+ * when no shard runs
+ *
+ * ctx: server context
+ *
+ * tables: filled in with up to SHARD_MAX tables
+ *
+ * Return: the number of tables, 1 without shards
+ */
+int shard_tables(server_ctx *ctx, channel_t **tables[SHARD_MAX]);
+
+/*
+ * shard_neighbors - Find the users sharing a channel with a user, by
+ * visiting the shards of its channels in turn, then run fn on the worker
+ * (called by the worker running the user's command)
+ *
+ * ctx: server context
+ *
+ * conn: the connection running the command
+ *
+ * user: the user, whose memberships only its own commands change
+ *
+ * visit: what the shards also do to the user's channels
+ *
+ * fn: run with the sockets of the neighbors, each once and sorted; the
+ * array is freed after it returns. Run at once if the user is in no
+ * channel.
+ *
+ * arg: passed to fn
+ *
+ * Return: nothing
+ */
+void shard_neighbors(server_ctx *ctx, conn_info_t *conn, client_t *user,
+                     shard_visit_t visit, shard_neighbors_fn fn, void *arg);
+
+/*
+ * shard_channels - Visit every channel, shard by shard, then run finish on
+ * the worker (called by the worker running a command)
+ *
+ * ctx: server context
+ *
+ * conn: the connection running the command
+ *
+ * each: run by the owner of each channel
+ *
+ * finish: run by the worker once every shard was visited
+ *
+ * arg: passed to each and finish
+ *
+ * Return: nothing
+ */
+void shard_channels(server_ctx *ctx, conn_info_t *conn, shard_channel_fn each,
+                    pool_step_fn finish, void *arg);
+
+/*
+ * shard_owned - Whether the calling thread is the shard owning a channel
+ *
+ * ctx: server context
+ *
+ * channel_name: the channel
+ *
+ * Return: true if it is, and may use the channel
+ */
+bool shard_owned(server_ctx *ctx, sds channel_name);
+
+/*
+ * shard_quiesce - Run the messages left in the queues, so that no command
+ * is half done for a live upgrade (called with ctx->upgrade_lock held for
+ * writing)
+ *
+ * ctx: server context
+ *
+ * Return: nothing
+ */
+void shard_quiesce(server_ctx *ctx);
+
+#endif
@@ -0,0 +1,585 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <stdatomic.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "stats.h"
+#include "send_msg.h"
+#include "reply.h"
+#include "log.h"
+#include "../lib/sds/sds.h"
+
+#define STATS_SUB_BITS 3 /* log2(STATS_SUB_BUCKETS) */
+#define STATS_ACCEPT_BACKOFF_MIN_MS 10   /* First wait after running out of descriptors */
+#define STATS_ACCEPT_BACKOFF_MAX_MS 1000
+
+/*
+ * Counters and histograms updated by a subset of the threads. chirc runs
+ * one thread per connection, so rather than giving every thread its own
+ * buckets (which would cost the full histogram set per connection), each
+ * thread is pinned to one of STATS_SHARDS shards on first use and updates
+ * it with relaxed atomics. Readers merge the shards.
+ */
+typedef struct stats_shard
+{
+    _Atomic uint64_t commands[STATS_MAX_COMMANDS];
+    _Atomic uint64_t max[STATS_MAX_COMMANDS][STATS_PHASES];
+    _Atomic uint64_t buckets[STATS_MAX_COMMANDS][STATS_PHASES][STATS_BUCKETS];
+} stats_shard_t;
+
+static stats_shard_t shards[STATS_SHARDS];
+static const char *command_names[STATS_MAX_COMMANDS];
+static _Atomic unsigned int next_shard;
+static __thread int thread_shard = -1;
+
+static _Atomic int64_t connections;
+static _Atomic uint64_t total_connections;
+static _Atomic uint64_t total_bytes_in;
+static _Atomic uint64_t total_bytes_out;
+static _Atomic uint64_t total_syscalls;
+static _Atomic uint64_t tls_handshakes;
+static _Atomic uint64_t tls_resumed;
+static _Atomic uint64_t tls_ktls;
+static _Atomic int64_t senders;
+static _Atomic int64_t senders_peak;
+static uint64_t start_ns;
+
+
+/*
+ * my_shard - Return the shard of the calling thread
+ */
+static stats_shard_t *my_shard(void)
+{
+    if (thread_shard < 0)
+    {
+        thread_shard = atomic_fetch_add_explicit(&next_shard, 1, memory_order_relaxed) % STATS_SHARDS;
+    }
+    return &shards[thread_shard];
+}
+
+
+/*
+ * atomic_max - Raise an atomic to at least value
+ */
+static void atomic_max(_Atomic uint64_t *a, uint64_t value)
+{
+    uint64_t cur = atomic_load_explicit(a, memory_order_relaxed);
+
+    while (cur < value &&
+           !atomic_compare_exchange_weak_explicit(a, &cur, value,
+                                                  memory_order_relaxed,
+                                                  memory_order_relaxed))
+        ;
+}
+
+
+/*
+ * bucket_of - Histogram bucket of a value: exact below STATS_SUB_BUCKETS,
+ * then STATS_SUB_BUCKETS linear buckets per power of two
+ */
+static int bucket_of(uint64_t us)
+{
+    if (us < STATS_SUB_BUCKETS)
+    {
+        return (int)us;
+    }
+
+    int msb = 63 - __builtin_clzll(us);
+    int shift = msb - STATS_SUB_BITS;
+    int bucket = (shift + 1) * STATS_SUB_BUCKETS + (int)(us >> shift) - STATS_SUB_BUCKETS;
+
+    return bucket < STATS_BUCKETS ? bucket : STATS_BUCKETS - 1;
+}
+
+
+/*
+ * bucket_upper - Largest value that falls in a bucket
+ */
+static uint64_t bucket_upper(int bucket)
+{
+    if (bucket < STATS_SUB_BUCKETS)
+    {
+        return bucket;
+    }
+
+    int shift = bucket / STATS_SUB_BUCKETS - 1;
+    uint64_t low = (uint64_t)(bucket % STATS_SUB_BUCKETS + STATS_SUB_BUCKETS) << shift;
+
+    return low + (1ULL << shift) - 1;
+}
+
+
+uint64_t stats_now(void)
+{
+    /*
+     * stats_now - Monotonic clock used for all latency measurements
+     *
+     * Return: nanoseconds since an arbitrary point
+     */
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+
+void stats_register_command(int slot, const char *name)
+{
+    /*
+     * stats_register_command - Name a command slot for reports
+     *
+     * slot: index of the command, usually its dispatch table index
+     *
+     * name: command name, must outlive the stats module
+     *
+     * Return: nothing
+     */
+    if (slot >= 0 && slot < STATS_MAX_COMMANDS)
+    {
+        command_names[slot] = name;
+    }
+}
+
+
+void stats_record_command(int slot, uint64_t recv_ns, uint64_t dispatch_ns, uint64_t done_ns)
+{
+    /*
+     * stats_record_command - Record one executed command (lock-free)
+     *
+     * slot: index of the command
+     *
+     * recv_ns: stats_now() when the line was received
+     *
+     * dispatch_ns: stats_now() when the handler was called
+     *
+     * done_ns: stats_now() when the handler and its replies were done
+     *
+     * Return: nothing
+     */
+    if (slot < 0 || slot >= STATS_MAX_COMMANDS)
+    {
+        return;
+    }
+
+    stats_shard_t *shard = my_shard();
+    uint64_t us[STATS_PHASES];
+
+    us[STATS_QUEUE] = dispatch_ns > recv_ns ? (dispatch_ns - recv_ns) / 1000 : 0;
+    us[STATS_EXEC] = done_ns > dispatch_ns ? (done_ns - dispatch_ns) / 1000 : 0;
+
+    atomic_fetch_add_explicit(&shard->commands[slot], 1, memory_order_relaxed);
+    for (int phase = 0; phase < STATS_PHASES; phase++)
+    {
+        atomic_fetch_add_explicit(&shard->buckets[slot][phase][bucket_of(us[phase])], 1,
+                                  memory_order_relaxed);
+        atomic_max(&shard->max[slot][phase], us[phase]);
+    }
+}
+
+
+void stats_connection_opened(void)
+{
+    /*
+     * stats_connection_opened/stats_connection_closed - Track connections
+     * (lock-free)
+     *
+     * Return: nothing
+     */
+    atomic_fetch_add_explicit(&connections, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&total_connections, 1, memory_order_relaxed);
+}
+
+
+void stats_connection_closed(void)
+{
+    atomic_fetch_sub_explicit(&connections, 1, memory_order_relaxed);
+}
+
+
+void stats_tls_handshake(bool resumed, bool ktls)
+{
+    /*
+     * stats_tls_handshake - Count a TLS handshake done (lock-free)
+     *
+     * resumed: the client resumed a session
+     *
+     * ktls: the kernel encrypts the replies of the connection
+     *
+     * Return: nothing
+     */
+    atomic_fetch_add_explicit(&tls_handshakes, 1, memory_order_relaxed);
+    if (resumed)
+    {
+        atomic_fetch_add_explicit(&tls_resumed, 1, memory_order_relaxed);
+    }
+    if (ktls)
+    {
+        atomic_fetch_add_explicit(&tls_ktls, 1, memory_order_relaxed);
+    }
+}
+
+
+void stats_bytes_in(uint64_t n)
+{
+    /*
+     * stats_bytes_in/stats_bytes_out - Count bytes received from and sent
+     * to sockets (lock-free)
+     *
+     * n: number of bytes
+     *
+     * Return: nothing
+     */
+    atomic_fetch_add_explicit(&total_bytes_in, n, memory_order_relaxed);
+}
+
+
+void stats_bytes_out(uint64_t n)
+{
+    atomic_fetch_add_explicit(&total_bytes_out, n, memory_order_relaxed);
+}
+
+
+void stats_syscalls(uint64_t n)
+{
+    /*
+     * stats_syscalls - Count system calls made on the message path
+     * (lock-free)
+     *
+     * n: number of system calls
+     *
+     * Return: nothing
+     */
+    atomic_fetch_add_explicit(&total_syscalls, n, memory_order_relaxed);
+}
+
+
+void stats_send_enter(void)
+{
+    /*
+     * stats_send_enter/stats_send_leave - Track how many threads are waiting
+     * to send or sending, i.e. the depth of the queue on the send path
+     * (lock-free)
+     *
+     * Return: nothing
+     */
+    int64_t depth = atomic_fetch_add_explicit(&senders, 1, memory_order_relaxed) + 1;
+    int64_t peak = atomic_load_explicit(&senders_peak, memory_order_relaxed);
+
+    while (peak < depth &&
+           !atomic_compare_exchange_weak_explicit(&senders_peak, &peak, depth,
+                                                  memory_order_relaxed,
+                                                  memory_order_relaxed))
+        ;
+}
+
+
+void stats_send_leave(void)
+{
+    atomic_fetch_sub_explicit(&senders, 1, memory_order_relaxed);
+}
+
+
+uint64_t stats_command_count(int slot)
+{
+    /*
+     * stats_command_count - Number of times a command was executed
+     *
+     * slot: index of the command
+     *
+     * Return: the merged counter
+     */
+    uint64_t count = 0;
+
+    for (int i = 0; i < STATS_SHARDS; i++)
+    {
+        count += atomic_load_explicit(&shards[i].commands[slot], memory_order_relaxed);
+    }
+    return count;
+}
+
+
+const char *stats_command_name(int slot)
+{
+    /*
+     * stats_command_name - Name registered for a command slot
+     *
+     * slot: index of the command
+     *
+     * Return: the name, or NULL if the slot is unused
+     */
+    return slot >= 0 && slot < STATS_MAX_COMMANDS ? command_names[slot] : NULL;
+}
+
+
+void stats_command_latency(int slot, stats_phase_t phase, stats_latency_t *lat)
+{
+    /*
+     * stats_command_latency - Merge the shards of one latency histogram
+     *
+     * slot: index of the command
+     *
+     * phase: which latency to report
+     *
+     * lat: output
+     *
+     * Return: nothing
+     */
+    uint64_t merged[STATS_BUCKETS] = {0};
+    double percentiles[] = {0.50, 0.90, 0.99};
+    uint64_t *results[] = {&lat->p50, &lat->p90, &lat->p99};
+
+    memset(lat, 0, sizeof(stats_latency_t));
+
+    for (int i = 0; i < STATS_SHARDS; i++)
+    {
+        for (int b = 0; b < STATS_BUCKETS; b++)
+        {
+            uint64_t n = atomic_load_explicit(&shards[i].buckets[slot][phase][b], memory_order_relaxed);
+            merged[b] += n;
+            lat->count += n;
+        }
+        uint64_t max = atomic_load_explicit(&shards[i].max[slot][phase], memory_order_relaxed);
+        lat->max = max > lat->max ? max : lat->max;
+    }
+
+    for (int p = 0; p < 3 && lat->count > 0; p++)
+    {
+        uint64_t target = (uint64_t)(percentiles[p] * lat->count + 0.5);
+        uint64_t seen = 0;
+        int b;
+
+        target = target ? target : 1;
+        for (b = 0; b < STATS_BUCKETS - 1; b++)
+        {
+            seen += merged[b];
+            if (seen >= target)
+            {
+                break;
+            }
+        }
+        uint64_t upper = bucket_upper(b);
+        *results[p] = upper < lat->max ? upper : lat->max;
+    }
+}
+
+
+sds stats_summary(void)
+{
+    /*
+     * stats_summary - Single-line summary of connections, traffic and the
+     * send path, for STATS
+     *
+     * Return: a new sds string
+     */
+    return sdscatprintf(sdsempty(),
+                        "connections=%lld total=%llu bytes_in=%llu bytes_out=%llu syscalls=%llu senders=%lld senders_peak=%lld",
+                        (long long)atomic_load(&connections),
+                        (unsigned long long)atomic_load(&total_connections),
+                        (unsigned long long)atomic_load(&total_bytes_in),
+                        (unsigned long long)atomic_load(&total_bytes_out),
+                        (unsigned long long)atomic_load(&total_syscalls),
+                        (long long)atomic_load(&senders),
+                        (long long)atomic_load(&senders_peak));
+}
+
+
+uint64_t stats_uptime(void)
+{
+    /*
+     * stats_uptime - Seconds since the stats module was initialized
+     *
+     * Return: uptime in seconds
+     */
+    return (stats_now() - start_ns) / 1000000000ULL;
+}
+
+
+/*
+ * json_latency - Append a latency histogram as a JSON object
+ */
+static sds json_latency(sds json, int slot, stats_phase_t phase)
+{
+    stats_latency_t lat;
+
+    stats_command_latency(slot, phase, &lat);
+    return sdscatprintf(json, "{\"count\":%llu,\"p50\":%llu,\"p90\":%llu,\"p99\":%llu,\"max\":%llu}",
+                        (unsigned long long)lat.count, (unsigned long long)lat.p50,
+                        (unsigned long long)lat.p90, (unsigned long long)lat.p99,
+                        (unsigned long long)lat.max);
+}
+
+
+sds stats_dump_json(void)
+{
+    /*
+     * stats_dump_json - Dump all metrics as a JSON object
+     *
+     * Return: a new sds string
+     */
+    sds json = sdscatprintf(sdsempty(),
+                            "{\"uptime\":%llu,"
+                            "\"connections\":{\"current\":%lld,\"total\":%llu},"
+                            "\"bytes\":{\"in\":%llu,\"out\":%llu},"
+                            "\"syscalls\":%llu,"
+                            "\"tls\":{\"handshakes\":%llu,\"resumed\":%llu,\"ktls\":%llu},"
+                            "\"senders\":{\"current\":%lld,\"peak\":%lld},"
+                            "\"commands\":{",
+                            (unsigned long long)stats_uptime(),
+                            (long long)atomic_load(&connections),
+                            (unsigned long long)atomic_load(&total_connections),
+                            (unsigned long long)atomic_load(&total_bytes_in),
+                            (unsigned long long)atomic_load(&total_bytes_out),
+                            (unsigned long long)atomic_load(&total_syscalls),
+                            (unsigned long long)atomic_load(&tls_handshakes),
+                            (unsigned long long)atomic_load(&tls_resumed),
+                            (unsigned long long)atomic_load(&tls_ktls),
+                            (long long)atomic_load(&senders),
+                            (long long)atomic_load(&senders_peak));
+    bool first = true;
+
+    for (int slot = 0; slot < STATS_MAX_COMMANDS; slot++)
+    {
+        if (command_names[slot] == NULL)
+        {
+            continue;
+        }
+        json = sdscatprintf(json, "%s\"%s\":{\"count\":%llu,\"recv_to_dispatch_us\":",
+                            first ? "" : ",", command_names[slot],
+                            (unsigned long long)stats_command_count(slot));
+        json = json_latency(json, slot, STATS_QUEUE);
+        json = sdscat(json, ",\"dispatch_to_flush_us\":");
+        json = json_latency(json, slot, STATS_EXEC);
+        json = sdscat(json, "}");
+        first = false;
+    }
+
+    return sdscat(json, "}}\n");
+}
+
+
+/*
+ * serve_stats - Thread function answering every connection on the stats
+ * Unix socket with one JSON dump
+ */
+static void *serve_stats(void *args)
+{
+    int listener = *(int *)args;
+    long backoff_ms = 0;
+
+    free(args);
+    pthread_detach(pthread_self());
+
+    while (1)
+    {
+        int client = accept(listener, NULL, NULL);
+        if (client == -1)
+        {
+            if (errno == EINTR || errno == ECONNABORTED)
+            {
+                continue;
+            }
+            if (errno != EMFILE && errno != ENFILE && errno != ENOBUFS && errno != ENOMEM)
+            {
+                chilog(ERROR, "Could not accept() on stats socket, giving up: %s", strerror(errno));
+                break;
+            }
+
+            /* Out of descriptors or memory: the pending connection stays
+             * queued, so wait for some to be released instead of spinning */
+            if (backoff_ms == 0)
+            {
+                chilog(ERROR, "Could not accept() on stats socket: %s", strerror(errno));
+                backoff_ms = STATS_ACCEPT_BACKOFF_MIN_MS;
+            }
+            else if ((backoff_ms *= 2) > STATS_ACCEPT_BACKOFF_MAX_MS)
+            {
+                backoff_ms = STATS_ACCEPT_BACKOFF_MAX_MS;
+            }
+            struct timespec wait = {.tv_sec = backoff_ms / 1000,
+                                    .tv_nsec = (backoff_ms % 1000) * 1000000L};
+            nanosleep(&wait, NULL);
+            continue;
+        }
+        backoff_ms = 0;
+
+        sds json = stats_dump_json();
+        int len = sdslen(json);
+        if (sendall(client, json, &len) == -1)
+        {
+            chilog(WARNING, "Stats dump truncated after %d bytes", len);
+        }
+        sdsfree(json);
+        close(client);
+    }
+
+    close(listener);
+    return NULL;
+}
+
+
+int stats_init(char *socket_path)
+{
+    /*
+     * stats_init - Initialize the stats module and, optionally, start a
+     * thread serving stats_dump_json() on a Unix socket. Every connection
+     * to the socket receives one dump and is closed.
+     *
+     * socket_path: path of the Unix socket, or NULL to not expose one
+     *
+     * Return: CHIRC_OK/CHIRC_ERROR
+     */
+    struct sockaddr_un addr;
+    pthread_t thread;
+
+    start_ns = stats_now();
+
+    if (socket_path == NULL)
+    {
+        return CHIRC_OK;
+    }
+
+    if (strlen(socket_path) >= sizeof(addr.sun_path))
+    {
+        chilog(ERROR, "Stats socket path is too long: %s", socket_path);
+        return CHIRC_ERROR;
+    }
+
+    int *listener = malloc(sizeof(int));
+    *listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (*listener == -1)
+    {
+        perror("Could not open stats socket");
+        free(listener);
+        return CHIRC_ERROR;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, socket_path);
+    unlink(socket_path);
+
+    if (bind(*listener, (struct sockaddr *)&addr, sizeof(addr)) == -1 ||
+        listen(*listener, 5) == -1)
+    {
+        perror("Could not bind stats socket");
+        close(*listener);
+        free(listener);
+        return CHIRC_ERROR;
+    }
+
+    if (pthread_create(&thread, NULL, serve_stats, listener) != 0)
+    {
+        perror("Could not create stats thread");
+        close(*listener);
+        free(listener);
+        return CHIRC_ERROR;
+    }
+
+    return CHIRC_OK;
+}
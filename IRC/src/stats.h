@@ -0,0 +1,181 @@
+#ifndef STATS_H_
+#define STATS_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "../lib/sds/sds.h"
+
+#define STATS_MAX_COMMANDS 32   /* Slots for dispatch table entries plus "unknown" */
+#define STATS_SHARDS 16         /* Threads are spread over this many sets of counters */
+#define STATS_SUB_BUCKETS 8     /* Linear buckets per power of two (~12% precision) */
+#define STATS_MAGNITUDES 30     /* Powers of two tracked, in microseconds (~18 minutes) */
+#define STATS_BUCKETS (STATS_SUB_BUCKETS * (STATS_MAGNITUDES + 1))
+
+/* Latency phases recorded for every command */
+typedef enum
+{
+    STATS_QUEUE = 0,    /* From recv() of the line to the start of dispatch */
+    STATS_EXEC = 1,     /* From dispatch until all replies were written */
+    STATS_PHASES = 2
+} stats_phase_t;
+
+/* A merged, point-in-time view of one latency histogram */
+typedef struct stats_latency
+{
+    uint64_t count;
+    uint64_t p50;   /* Percentiles and max, in microseconds */
+    uint64_t p90;
+    uint64_t p99;
+    uint64_t max;
+} stats_latency_t;
+
+/*
+ * stats_now - Monotonic clock used for all latency measurements
+ *
+ * Return: nanoseconds since an arbitrary point
+ */
+uint64_t stats_now(void);
+
+/*
+ * stats_register_command - Name a command slot for reports
+ *
+ * slot: index of the command, usually its dispatch table index
+ *
+ * name: command name, must outlive the stats module
+ *
+ * Return: nothing
+ */
+void stats_register_command(int slot, const char *name);
+
+/*
+ * stats_record_command - Record one executed command (lock-free)
+ *
+ * slot: index of the command
+ *
+ * recv_ns: stats_now() when the line was received
+ *
+ * dispatch_ns: stats_now() when the handler was called
+ *
+ * done_ns: stats_now() when the handler and its replies were done
+ *
+ * Return: nothing
+ */
+void stats_record_command(int slot, uint64_t recv_ns, uint64_t dispatch_ns, uint64_t done_ns);
+
+/*
+ * stats_connection_opened/stats_connection_closed - Track connections
+ * (lock-free)
+ *
+ * Return: nothing
+ */
+void stats_connection_opened(void);
+void stats_connection_closed(void);
+
+/*
+ * stats_bytes_in/stats_bytes_out - Count bytes received from and sent
+ * to sockets (lock-free)
+ *
+ * n: number of bytes
+ *
+ * Return: nothing
+ */
+void stats_bytes_in(uint64_t n);
+void stats_bytes_out(uint64_t n);
+
+/*
+ * stats_syscalls - Count system calls made on the message path: waiting
+ * for and accepting connections, receiving, sending, and submitting to or
+ * waiting on an io_uring (lock-free)
+ *
+ * n: number of system calls
+ *
+ * Return: nothing
+ */
+void stats_syscalls(uint64_t n);
+
+/*
+ * stats_tls_handshake - Count a TLS handshake done (lock-free)
+ *
+ * resumed: the client resumed a session
+ *
+ * ktls: the kernel encrypts the replies of the connection
+ *
+ * Return: nothing
+ */
+void stats_tls_handshake(bool resumed, bool ktls);
+
+/*
+ * stats_send_enter/stats_send_leave - Track how many threads are waiting
+ * to send or sending, i.e. the depth of the queue on the send path
+ * (lock-free)
+ *
+ * Return: nothing
+ */
+void stats_send_enter(void);
+void stats_send_leave(void);
+
+/*
+ * stats_command_count - Number of times a command was executed
+ *
+ * slot: index of the command
+ *
+ * Return: the merged counter
+ */
+uint64_t stats_command_count(int slot);
+
+/*
+ * stats_command_name - Name registered for a command slot
+ *
+ * slot: index of the command
+ *
+ * Return: the name, or NULL if the slot is unused
+ */
+const char *stats_command_name(int slot);
+
+/*
+ * stats_command_latency - Merge the shards of one latency histogram
+ *
+ * slot: index of the command
+ *
+ * phase: which latency to report
+ *
+ * lat: output
+ *
+ * Return: nothing
+ */
+void stats_command_latency(int slot, stats_phase_t phase, stats_latency_t *lat);
+
+/*
+ * stats_summary - Single-line summary of connections, traffic and the
+ * send path, for STATS
+ *
+ * Return: a new sds string
+ */
+sds stats_summary(void);
+
+/*
+ * stats_uptime - Seconds since the stats module was initialized
+ *
+ * Return: uptime in seconds
+ */
+uint64_t stats_uptime(void);
+
+/*
+ * stats_dump_json - Dump all metrics as a JSON object
+ *
+ * Return: a new sds string
+ */
+sds stats_dump_json(void);
+
+/*
+ * stats_init - Initialize the stats module and, optionally, start a
+ * thread serving stats_dump_json() on a Unix socket. Every connection
+ * to the socket receives one dump and is closed.
+ *
+ * socket_path: path of the Unix socket, or NULL to not expose one
+ *
+ * Return: CHIRC_OK/CHIRC_ERROR
+ */
+int stats_init(char *socket_path);
+
+#endif
@@ -0,0 +1,410 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#include "tls.h"
+#include "server.h"
+#include "stats.h"
+#include "reply.h"
+#include "log.h"
+#include "../lib/sds/sds.h"
+
+
+/* Log the errors OpenSSL queued, after a message of ours */
+static void log_ssl_errors(char *what)
+{
+    unsigned long e;
+    char buf[256];
+
+    chilog(ERROR, "%s", what);
+    while ((e = ERR_get_error()) != 0)
+    {
+        ERR_error_string_n(e, buf, sizeof buf);
+        chilog(ERROR, "  %s", buf);
+    }
+}
+
+
+/* Bind the TLS port. SO_REUSEPORT lets the process started by a live
+ * upgrade bind it while the old one still listens. */
+static int tls_listen(char *port, int backlog)
+{
+    struct addrinfo hints, *res, *p;
+    int s = -1;
+    int yes = 1;
+
+    memset(&hints, 0, sizeof hints);
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE;
+    if (getaddrinfo(NULL, port, &hints, &res) != 0)
+    {
+        perror("getaddrinfo() failed");
+        return -1;
+    }
+
+    for (p = res; p != NULL; p = p->ai_next)
+    {
+        if ((s = socket(p->ai_family, p->ai_socktype | SOCK_CLOEXEC | SOCK_NONBLOCK,
+                        p->ai_protocol)) == -1)
+        {
+            continue;
+        }
+        if (setsockopt(s, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(int)) == -1 ||
+            setsockopt(s, SOL_SOCKET, SO_REUSEPORT, &yes, sizeof(int)) == -1 ||
+            bind(s, p->ai_addr, p->ai_addrlen) == -1 ||
+            listen(s, backlog) == -1)
+        {
+            close(s);
+            s = -1;
+            continue;
+        }
+        break;
+    }
+    freeaddrinfo(res);
+
+    if (s == -1)
+    {
+        chilog(ERROR, "Could not bind the TLS port %s.\n", port);
+    }
+    return s;
+}
+
+
+/* Accept the connections of the TLS port, as the main loop does for the
+ * plain one */
+static void *tls_accept_thread(void *args)
+{
+    server_ctx *ctx = (server_ctx *)args;
+    int listener = ctx->tls->listener;
+
+    while (1)
+    {
+        struct pollfd pfd = {.fd = listener, .events = POLLIN};
+
+        stats_syscalls(1);  /* poll() */
+        if (poll(&pfd, 1, -1) == -1)
+        {
+            continue;
+        }
+
+        if (accept_batch(ctx, listener, true) == CHIRC_ERROR)
+        {
+            chilog(ERROR, "Could not serve a TLS connection");
+        }
+    }
+
+    return NULL;
+}
+
+
+int tls_init(server_ctx *ctx, char *port, char *cert_file, char *key_file, bool ktls)
+{
+    /*
+     * tls_init - Load the certificate and listen on the TLS port
+     *
+     * ctx: server context
+     *
+     * port: TLS port
+     *
+     * cert_file: PEM certificate chain
+     *
+     * key_file: PEM private key
+     *
+     * ktls: let the kernel encrypt the replies when it can
+     *
+     * Return: CHIRC_OK/CHIRC_ERROR
+     */
+    struct rlimit rl;
+    pthread_t thread;
+    tls_t *tls = calloc(1, sizeof(tls_t));
+
+    tls->ssl_ctx = SSL_CTX_new(TLS_server_method());
+    if (tls->ssl_ctx == NULL)
+    {
+        log_ssl_errors("Could not create the TLS context");
+        free(tls);
+        return CHIRC_ERROR;
+    }
+    SSL_CTX_set_min_proto_version(tls->ssl_ctx, TLS1_2_VERSION);
+
+    if (SSL_CTX_use_certificate_chain_file(tls->ssl_ctx, cert_file) != 1 ||
+        SSL_CTX_use_PrivateKey_file(tls->ssl_ctx, key_file, SSL_FILETYPE_PEM) != 1 ||
+        SSL_CTX_check_private_key(tls->ssl_ctx) != 1)
+    {
+        log_ssl_errors("Could not load the TLS certificate and key");
+        SSL_CTX_free(tls->ssl_ctx);
+        free(tls);
+        return CHIRC_ERROR;
+    }
+
+    /* Resumption: tickets are on by default, and clients that do not take
+     * them are found by session ID in the cache */
+    SSL_CTX_set_session_cache_mode(tls->ssl_ctx, SSL_SESS_CACHE_SERVER);
+    SSL_CTX_sess_set_cache_size(tls->ssl_ctx, TLS_SESSION_CACHE);
+    SSL_CTX_set_session_id_context(tls->ssl_ctx, (const unsigned char *)"chirc", 5);
+    SSL_CTX_set_timeout(tls->ssl_ctx, TLS_SESSION_TIMEOUT);
+
+    /* Idle connections give their buffers back */
+    SSL_CTX_set_mode(tls->ssl_ctx, SSL_MODE_RELEASE_BUFFERS);
+    if (ktls)
+    {
+#ifdef SSL_OP_ENABLE_KTLS
+        SSL_CTX_set_options(tls->ssl_ctx, SSL_OP_ENABLE_KTLS);
+#else
+        chilog(WARNING, "This OpenSSL has no kernel TLS, replies are encrypted by OpenSSL");
+#endif
+    }
+
+    /* The TLS state of a socket is found by its number */
+    tls->max_conns = 1024;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur != RLIM_INFINITY)
+    {
+        tls->max_conns = rl.rlim_cur;
+    }
+    tls->conns = calloc(tls->max_conns, sizeof(tls_conn_t *));
+
+    tls->listener = tls_listen(port, ctx->backlog);
+    if (tls->listener == -1)
+    {
+        free(tls->conns);
+        SSL_CTX_free(tls->ssl_ctx);
+        free(tls);
+        return CHIRC_ERROR;
+    }
+    ctx->tls = tls;
+
+    if (pthread_create(&thread, NULL, tls_accept_thread, ctx) != 0)
+    {
+        perror("Could not create the TLS accept thread");
+        return CHIRC_ERROR;
+    }
+    pthread_detach(thread);
+
+    chilog(INFO, "Listening for TLS on port %s%s", port, ktls ? " (kernel TLS when available)" : "");
+    return CHIRC_OK;
+}
+
+
+tls_conn_t *tls_conn_new(server_ctx *ctx, int client_socket)
+{
+    /*
+     * tls_conn_new - Start the TLS session of a connection accepted on the
+     * TLS port (Not thread-safe, called before the connection is served)
+     *
+     * ctx: server context
+     *
+     * client_socket: the connection
+     *
+     * Return: the TLS state, or NULL if it could not be created
+     */
+    tls_t *tls = ctx->tls;
+
+    if (client_socket >= tls->max_conns)
+    {
+        return NULL;
+    }
+
+    tls_conn_t *t = calloc(1, sizeof(tls_conn_t));
+    t->ssl = SSL_new(tls->ssl_ctx);
+    if (t->ssl == NULL)
+    {
+        free(t);
+        return NULL;
+    }
+
+    /* The handshake and the session tickets are written as several records:
+     * Nagle would hold each one back until the client acknowledges the last */
+    int yes = 1;
+    setsockopt(client_socket, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof yes);
+
+    /* Reads come from whoever reads the connection, writes go straight to
+     * the socket so the kernel can take them over */
+    t->rbio = BIO_new(BIO_s_mem());
+    BIO *wbio = BIO_new_socket(client_socket, BIO_NOCLOSE);
+    BIO_set_mem_eof_return(t->rbio, -1);
+    SSL_set_bio(t->ssl, t->rbio, wbio);
+    SSL_set_accept_state(t->ssl);
+    pthread_mutex_init(&t->lock, NULL);
+
+    tls->conns[client_socket] = t;
+    return t;
+}
+
+
+int tls_input(conn_info_t *conn, const char *data, int len)
+{
+    /*
+     * tls_input - Take in bytes received on a TLS connection: move the
+     * handshake on, and append what they decrypt to the cmd stack
+     * (called by the thread reading the connection)
+     *
+     * conn: the connection
+     *
+     * data: the bytes received
+     *
+     * len: number of bytes
+     *
+     * Return: CHIRC_OK, or CHIRC_ERROR if the handshake failed, the data is
+     * not valid or the client closed the session: the connection is to be
+     * closed
+     */
+    tls_conn_t *t = conn->tls;
+    char buffer[BUFFER_SIZE * 4];
+    int r = CHIRC_OK;
+    int n;
+
+    pthread_mutex_lock(&t->lock);
+    BIO_write(t->rbio, data, len);
+
+    if (!t->established)
+    {
+        n = SSL_do_handshake(t->ssl);
+        if (n != 1)
+        {
+            if (SSL_get_error(t->ssl, n) != SSL_ERROR_WANT_READ)
+            {
+                ERR_clear_error();
+                r = CHIRC_ERROR;
+            }
+            pthread_mutex_unlock(&t->lock);
+            return r;
+        }
+
+        t->established = true;
+#ifdef SSL_OP_ENABLE_KTLS
+        t->ktls_send = BIO_get_ktls_send(SSL_get_wbio(t->ssl));
+#endif
+        stats_tls_handshake(SSL_session_reused(t->ssl), t->ktls_send);
+    }
+
+    /* The rest of the records, and the commands they carry */
+    while ((n = SSL_read(t->ssl, buffer, sizeof buffer)) > 0)
+    {
+        conn->cmdstack = sdscatlen(conn->cmdstack, buffer, n);
+    }
+    if (SSL_get_error(t->ssl, n) != SSL_ERROR_WANT_READ)
+    {
+        /* close_notify, or an error */
+        ERR_clear_error();
+        r = CHIRC_ERROR;
+    }
+    pthread_mutex_unlock(&t->lock);
+
+    return r;
+}
+
+
+tls_conn_t *tls_sender(server_ctx *ctx, int client_socket)
+{
+    /*
+     * tls_sender - The TLS session a send to a socket goes through (called
+     * with the socket's lock held)
+     *
+     * ctx: server context
+     *
+     * client_socket: the socket
+     *
+     * Return: the TLS state, or NULL if the socket takes plain text: not a
+     * TLS connection, or one whose replies the kernel encrypts
+     */
+    if (ctx->tls == NULL || client_socket < 0 || client_socket >= ctx->tls->max_conns)
+    {
+        return NULL;
+    }
+
+    tls_conn_t *t = ctx->tls->conns[client_socket];
+    return t != NULL && !t->ktls_send ? t : NULL;
+}
+
+
+int tls_send(tls_conn_t *t, char *buf, int *len)
+{
+    /*
+     * tls_send - Encrypt and send a whole buffer (called with the socket's
+     * lock held)
+     *
+     * t: the TLS state
+     *
+     * buf: buffer message to be sent
+     *
+     * len: its length, set to the number of bytes sent
+     *
+     * Return: -1 on failure, 0 on success
+     */
+    int n;
+
+    pthread_mutex_lock(&t->lock);
+    if (!t->established)
+    {
+        /* Nothing is sent to a client before it registers */
+        pthread_mutex_unlock(&t->lock);
+        *len = 0;
+        return -1;
+    }
+
+    /* The socket blocks, so the whole buffer is written or the socket failed */
+    n = SSL_write(t->ssl, buf, *len);
+    stats_syscalls(1);
+    if (n <= 0)
+    {
+        ERR_clear_error();
+        *len = 0;
+        pthread_mutex_unlock(&t->lock);
+        return -1;
+    }
+    pthread_mutex_unlock(&t->lock);
+
+    *len = n;
+    return 0;
+}
+
+
+void tls_close(server_ctx *ctx, int client_socket)
+{
+    /*
+     * tls_close - End the TLS session of a socket about to be closed, if it
+     * has one (called with the socket's lock held)
+     *
+     * ctx: server context
+     *
+     * client_socket: the socket
+     *
+     * Return: nothing
+     */
+    if (ctx->tls == NULL || client_socket < 0 || client_socket >= ctx->tls->max_conns)
+    {
+        return;
+    }
+
+    tls_conn_t *t = ctx->tls->conns[client_socket];
+    if (t == NULL)
+    {
+        return;
+    }
+    ctx->tls->conns[client_socket] = NULL;
+
+    pthread_mutex_lock(&t->lock);
+    if (t->established)
+    {
+        SSL_shutdown(t->ssl);
+    }
+    pthread_mutex_unlock(&t->lock);
+
+    ERR_clear_error();
+    pthread_mutex_destroy(&t->lock);
+    SSL_free(t->ssl);
+    free(t);
+}
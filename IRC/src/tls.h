@@ -0,0 +1,136 @@
+#ifndef TLS_H_
+#define TLS_H_
+
+#include <stdbool.h>
+#include <pthread.h>
+#include <openssl/ssl.h>
+#include "server.h"
+
+#define TLS_SESSION_CACHE 20000     /* Sessions kept for resumption by session ID */
+#define TLS_SESSION_TIMEOUT 7200    /* Seconds a session or ticket can be resumed */
+
+/*
+ * TLS listener (-T): connections accepted on the TLS port are served like
+ * the others, by their own thread or by the I/O threads and workers of
+ * split mode. Whoever reads a connection feeds the bytes received to a
+ * memory BIO, which drives the handshake and is decrypted into the cmd
+ * stack, so the handshake never blocks an I/O thread and io_uring receives
+ * work unchanged. Replies are written by SSL_write on the socket, under
+ * the socket's lock.
+ *
+ * A reconnecting client resumes its session instead of doing a full
+ * handshake: with a session ticket (TLS 1.3, or 1.2 clients that support
+ * them), or by session ID from the server's cache.
+ *
+ * With -k, OpenSSL hands the keys to kernel TLS once the handshake is
+ * done, when the kernel supports it: the kernel then encrypts what is
+ * sent, and replies go out with the plain send() of the other connections.
+ *
+ * A live upgrade cannot hand a TLS session over: TLS clients are
+ * disconnected by it, and reconnect with a full handshake.
+ */
+
+/* TLS state of a connection */
+typedef struct tls_conn
+{
+    SSL *ssl;
+    BIO *rbio;              /* Bytes received and not decrypted yet */
+    bool established;       /* The handshake is done */
+    bool ktls_send;         /* The kernel encrypts the replies: they are sent as plain text */
+    pthread_mutex_t lock;   /* Serializes the reader and the senders on ssl */
+} tls_conn_t;
+
+typedef struct tls
+{
+    SSL_CTX *ssl_ctx;
+    int listener;           /* The TLS listening socket */
+    tls_conn_t **conns;     /* TLS connections by socket number, protected by the socket's lock */
+    int max_conns;          /* Size of conns: the limit on open files */
+} tls_t;
+
+/*
+ * tls_init - Load the certificate and listen on the TLS port
+ *
+ * ctx: server context
+ *
+ * port: TLS port
+ *
+ * cert_file: PEM certificate chain
+ *
+ * key_file: PEM private key
+ *
+ * ktls: let the kernel encrypt the replies when it can
+ *
+ * Return: CHIRC_OK/CHIRC_ERROR
+ */
+int tls_init(server_ctx *ctx, char *port, char *cert_file, char *key_file, bool ktls);
+
+/*
+ * tls_conn_new - Start the TLS session of a connection accepted on the
+ * TLS port (Not thread-safe, called before the connection is served)
+ *
+ * ctx: server context
+ *
+ * client_socket: the connection
+ *
+ * Return: the TLS state, or NULL if it could not be created
+ */
+tls_conn_t *tls_conn_new(server_ctx *ctx, int client_socket);
+
+/*
+ * tls_input - Take in bytes received on a TLS connection: move the
+ * handshake on, and append what they decrypt to the cmd stack
+ * (called by the thread reading the connection)
+ *
+ * conn: the connection
+ *
+ * data: the bytes received
+ *
+ * len: number of bytes
+ *
+ * Return: CHIRC_OK, or CHIRC_ERROR if the handshake failed, the data is
+ * not valid or the client closed the session: the connection is to be
+ * closed
+ */
+int tls_input(conn_info_t *conn, const char *data, int len);
+
+/*
+ * tls_sender - The TLS session a send to a socket goes through (called
+ * with the socket's lock held)
+ *
+ * ctx: server context
+ *
+ * client_socket: the socket
+ *
+ * Return: the TLS state, or NULL if the socket takes plain text: not a
+ * TLS connection, or one whose replies the kernel encrypts
+ */
+tls_conn_t *tls_sender(server_ctx *ctx, int client_socket);
+
+/*
+ * tls_send - Encrypt and send a whole buffer (called with the socket's
+ * lock held)
+ *
+ * t: the TLS state
+ *
+ * buf: buffer message to be sent
+ *
+ * len: its length, set to the number of bytes sent
+ *
+ * Return: -1 on failure, 0 on success
+ */
+int tls_send(tls_conn_t *t, char *buf, int *len);
+
+/*
+ * tls_close - End the TLS session of a socket about to be closed, if it
+ * has one (called with the socket's lock held)
+ *
+ * ctx: server context
+ *
+ * client_socket: the socket
+ *
+ * Return: nothing
+ */
+void tls_close(server_ctx *ctx, int client_socket);
+
+#endif
@@ -0,0 +1,393 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "trace.h"
+#include "stats.h"
+#include "send_msg.h"
+#include "reply.h"
+#include "log.h"
+#include "../lib/sds/sds.h"
+
+/*
+ * A span in a ring. The owner thread writes it as a seqlock: seq is 0
+ * while the fields change, then the index of the span plus one, so a dump
+ * running at the same time skips the spans it saw half written.
+ */
+typedef struct trace_event
+{
+    _Atomic uint64_t seq;
+    uint64_t start_ns;
+    uint64_t end_ns;
+    const char *name;
+    const char *detail;
+    uint32_t msg;
+    uint32_t tid;
+} trace_event_t;
+
+/*
+ * The spans of one thread. With a thread per connection, threads come and
+ * go: a thread that ends gives its ring back, to be written on by the
+ * next thread that traces, and the spans it holds can still be dumped.
+ */
+typedef struct trace_ring
+{
+    _Atomic uint64_t head;          /* Spans written so far */
+    bool in_use;                    /* A thread writes on it, protected by rings_lock */
+    struct trace_ring *next;        /* All the rings, protected by rings_lock */
+    trace_event_t events[TRACE_RING_EVENTS];
+} trace_ring_t;
+
+/* A span copied out of a ring by a dump */
+typedef struct trace_copy
+{
+    uint64_t start_ns;
+    uint64_t end_ns;
+    const char *name;
+    const char *detail;
+    uint32_t msg;
+    uint32_t tid;
+} trace_copy_t;
+
+__thread uint32_t trace_msg;
+
+static int sample_rate;             /* One line in sample_rate is traced, 0 when not tracing */
+static _Atomic uint32_t next_msg = 1;
+static pthread_mutex_t rings_lock = PTHREAD_MUTEX_INITIALIZER;
+static trace_ring_t *rings;
+static pthread_key_t ring_key;
+static __thread trace_ring_t *my_ring;
+static __thread uint32_t my_tid;
+static __thread int32_t countdown = -1; /* Lines until the next traced one */
+
+
+/* pthread key destructor: give the ring of an ending thread back */
+static void release_ring(void *ring)
+{
+    pthread_mutex_lock(&rings_lock);
+    ((trace_ring_t *)ring)->in_use = false;
+    pthread_mutex_unlock(&rings_lock);
+}
+
+
+/* The ring of the calling thread, taken on its first span */
+static trace_ring_t *thread_ring(void)
+{
+    trace_ring_t *r;
+
+    if (my_ring != NULL)
+    {
+        return my_ring;
+    }
+
+    pthread_mutex_lock(&rings_lock);
+    for (r = rings; r != NULL && r->in_use; r = r->next)
+        ;
+    if (r == NULL)
+    {
+        r = calloc(1, sizeof(trace_ring_t));
+        if (r == NULL)
+        {
+            pthread_mutex_unlock(&rings_lock);
+            return NULL;
+        }
+        r->next = rings;
+        rings = r;
+    }
+    r->in_use = true;
+    pthread_mutex_unlock(&rings_lock);
+
+    pthread_setspecific(ring_key, r);
+    my_ring = r;
+    my_tid = (uint32_t)gettid();
+
+    return r;
+}
+
+
+uint32_t trace_sample(void)
+{
+    /*
+     * trace_sample - Decide whether to trace a line that was just received
+     *
+     * Return: the number of a new message to trace, or 0
+     */
+    uint32_t msg;
+
+    if (sample_rate == 0)
+    {
+        return 0;
+    }
+    if (countdown < 0)
+    {
+        /* Threads do not all trace their first line */
+        countdown = (int32_t)(stats_now() % sample_rate);
+    }
+    if (countdown-- > 0)
+    {
+        return 0;
+    }
+    countdown = sample_rate - 1;
+
+    while ((msg = atomic_fetch_add_explicit(&next_msg, 1, memory_order_relaxed)) == 0)
+        ;
+    return msg;
+}
+
+
+uint64_t trace_recv(uint32_t msg, uint64_t recv_ns)
+{
+    /*
+     * trace_recv - Record that a traced line was received, and framed and
+     * tokenized since
+     *
+     * msg: message number, 0 to record nothing
+     *
+     * recv_ns: stats_now() when the line was received
+     *
+     * Return: stats_now() once it was parsed, 0 if msg is 0
+     */
+    if (msg == 0)
+    {
+        return 0;
+    }
+
+    uint64_t now = stats_now();
+    trace_span(msg, "recv", NULL, recv_ns, recv_ns);
+    trace_span(msg, "parse", NULL, recv_ns, now);
+    return now;
+}
+
+
+void trace_span(uint32_t msg, const char *name, const char *detail, uint64_t start_ns, uint64_t end_ns)
+{
+    /*
+     * trace_span - Record a span of a message in the calling thread's ring
+     * (lock-free)
+     *
+     * msg: message number, 0 to record nothing
+     *
+     * name: what was done, a string that outlives the server
+     *
+     * detail: command or lock, a string that outlives the server, or NULL
+     *
+     * start_ns, end_ns: stats_now() at the start and at the end
+     *
+     * Return: nothing
+     */
+    trace_ring_t *r;
+
+    if (msg == 0 || (r = thread_ring()) == NULL)
+    {
+        return;
+    }
+
+    uint64_t h = atomic_load_explicit(&r->head, memory_order_relaxed);
+    trace_event_t *e = &r->events[h % TRACE_RING_EVENTS];
+
+    atomic_store_explicit(&e->seq, 0, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    e->start_ns = start_ns;
+    e->end_ns = end_ns;
+    e->name = name;
+    e->detail = detail;
+    e->msg = msg;
+    e->tid = my_tid;
+    atomic_store_explicit(&e->seq, h + 1, memory_order_release);
+    atomic_store_explicit(&r->head, h + 1, memory_order_release);
+}
+
+
+/* Copy the spans of a ring that are not being overwritten */
+static size_t copy_ring(trace_ring_t *r, trace_copy_t *out)
+{
+    uint64_t h = atomic_load_explicit(&r->head, memory_order_acquire);
+    size_t n = 0;
+
+    for (uint64_t i = h > TRACE_RING_EVENTS ? h - TRACE_RING_EVENTS : 0; i < h; i++)
+    {
+        trace_event_t *e = &r->events[i % TRACE_RING_EVENTS];
+
+        if (atomic_load_explicit(&e->seq, memory_order_acquire) != i + 1)
+        {
+            continue;
+        }
+        out[n] = (trace_copy_t){e->start_ns, e->end_ns, e->name, e->detail, e->msg, e->tid};
+        atomic_thread_fence(memory_order_acquire);
+        if (atomic_load_explicit(&e->seq, memory_order_relaxed) == i + 1)
+        {
+            n++;
+        }
+    }
+
+    return n;
+}
+
+
+/* Spans of a message together, in the order they started */
+static int compare_spans(const void *a, const void *b)
+{
+    const trace_copy_t *x = a, *y = b;
+
+    if (x->msg != y->msg)
+    {
+        return x->msg < y->msg ? -1 : 1;
+    }
+    return (x->start_ns > y->start_ns) - (x->start_ns < y->start_ns);
+}
+
+
+sds trace_dump_json(void)
+{
+    /*
+     * trace_dump_json - Dump the spans of all the rings, in the Chrome trace
+     * event format
+     *
+     * Return: a new sds string
+     */
+    trace_ring_t *r;
+    size_t nrings = 0, n = 0;
+    int pid = getpid();
+
+    /* Rings are never freed, so the list can be walked past the lock */
+    pthread_mutex_lock(&rings_lock);
+    trace_ring_t *first = rings;
+    for (r = first; r != NULL; r = r->next)
+    {
+        nrings++;
+    }
+    pthread_mutex_unlock(&rings_lock);
+
+    trace_copy_t *spans = malloc((nrings * TRACE_RING_EVENTS + 1) * sizeof(trace_copy_t));
+    for (r = first; r != NULL; r = r->next)
+    {
+        n += copy_ring(r, spans + n);
+    }
+    qsort(spans, n, sizeof(trace_copy_t), compare_spans);
+
+    sds json = sdsnew("{\"displayTimeUnit\":\"ns\",\"traceEvents\":[");
+    for (size_t i = 0; i < n; i++)
+    {
+        trace_copy_t *s = &spans[i];
+
+        json = sdscatprintf(json, "%s{\"name\":\"%s%s%s\",\"cat\":\"chirc\",\"ph\":\"X\","
+                                  "\"ts\":%.3f,\"dur\":%.3f,\"pid\":%d,\"tid\":%u,\"args\":{\"msg\":%u}}",
+                            i > 0 ? ",\n" : "\n", s->name, s->detail ? " " : "", s->detail ? s->detail : "",
+                            s->start_ns / 1e3, (s->end_ns - s->start_ns) / 1e3, pid, s->tid, s->msg);
+
+        /* An arrow from the thread that handed the message over */
+        if (i > 0 && spans[i - 1].msg == s->msg && spans[i - 1].tid != s->tid)
+        {
+            trace_copy_t *p = &spans[i - 1];
+            json = sdscatprintf(json, ",\n{\"name\":\"message\",\"cat\":\"chirc\",\"ph\":\"s\",\"id\":%u,"
+                                      "\"ts\":%.3f,\"pid\":%d,\"tid\":%u}",
+                                s->msg, p->start_ns / 1e3, pid, p->tid);
+            json = sdscatprintf(json, ",\n{\"name\":\"message\",\"cat\":\"chirc\",\"ph\":\"f\",\"bp\":\"e\","
+                                      "\"id\":%u,\"ts\":%.3f,\"pid\":%d,\"tid\":%u}",
+                                s->msg, s->start_ns / 1e3, pid, s->tid);
+        }
+    }
+    free(spans);
+
+    return sdscat(json, "\n]}\n");
+}
+
+
+/*
+ * serve_trace - Thread function answering every connection on the trace
+ * Unix socket with one dump
+ */
+static void *serve_trace(void *args)
+{
+    int listener = *(int *)args;
+
+    free(args);
+    pthread_detach(pthread_self());
+
+    while (1)
+    {
+        int client = accept(listener, NULL, NULL);
+        if (client == -1)
+        {
+            chilog(ERROR, "Could not accept() on trace socket");
+            continue;
+        }
+
+        sds json = trace_dump_json();
+        int len = sdslen(json);
+        if (sendall(client, json, &len) == -1)
+        {
+            chilog(WARNING, "Trace dump truncated after %d bytes", len);
+        }
+        sdsfree(json);
+        close(client);
+    }
+
+    return NULL;
+}
+
+
+int trace_init(char *socket_path, int rate)
+{
+    /*
+     * trace_init - Start tracing and a thread serving trace_dump_json() on a
+     * Unix socket. Every connection to the socket receives one dump and is
+     * closed.
+     *
+     * socket_path: path of the Unix socket
+     *
+     * rate: one line in rate is traced
+     *
+     * Return: CHIRC_OK/CHIRC_ERROR
+     */
+    struct sockaddr_un addr;
+    pthread_t thread;
+
+    if (strlen(socket_path) >= sizeof(addr.sun_path))
+    {
+        chilog(ERROR, "Trace socket path is too long: %s", socket_path);
+        return CHIRC_ERROR;
+    }
+
+    int *listener = malloc(sizeof(int));
+    *listener = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (*listener == -1)
+    {
+        perror("Could not open trace socket");
+        free(listener);
+        return CHIRC_ERROR;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, socket_path);
+    unlink(socket_path);
+
+    if (bind(*listener, (struct sockaddr *)&addr, sizeof(addr)) == -1 ||
+        listen(*listener, 5) == -1)
+    {
+        perror("Could not bind trace socket");
+        close(*listener);
+        free(listener);
+        return CHIRC_ERROR;
+    }
+
+    pthread_key_create(&ring_key, release_ring);
+    if (pthread_create(&thread, NULL, serve_trace, listener) != 0)
+    {
+        perror("Could not create trace thread");
+        close(*listener);
+        free(listener);
+        return CHIRC_ERROR;
+    }
+    sample_rate = rate;
+    chilog(INFO, "Tracing one line in %d", rate);
+
+    return CHIRC_OK;
+}
@@ -0,0 +1,116 @@
+#ifndef TRACE_H_
+#define TRACE_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include "stats.h"
+#include "../lib/sds/sds.h"
+
+#define TRACE_RING_EVENTS 1024   /* Events kept per thread, the oldest are overwritten */
+#define TRACE_DEFAULT_RATE 100   /* One line in this many is traced */
+
+/*
+ * Sampled message tracing (-X): one received line in every -x is given a
+ * message number, and the threads that work on it record timed spans of
+ * its way through the server:
+ *
+ *   recv       when the bytes holding it were received
+ *   parse      from then until it was framed and tokenized
+ *   queue      split mode: waiting for a worker
+ *   shard      channel shards: waiting for the channel's shard
+ *   dispatch   the handler and the replies it sent, named after the command
+ *   lock       waiting for and taking a lock, named after the lock
+ *   send       one write to a socket, socket lock included; the last one
+ *              is the final write
+ *
+ * Spans go to a ring of TRACE_RING_EVENTS per thread, written without
+ * locks. Every connection to the trace Unix socket receives one dump of
+ * all the rings, in the Chrome trace event format (chrome://tracing or
+ * https://ui.perfetto.dev), with the spans of a message that moved between
+ * threads linked by flow arrows.
+ */
+
+/* The message the calling thread works on, 0 if none */
+extern __thread uint32_t trace_msg;
+
+/*
+ * trace_init - Start tracing and a thread serving trace_dump_json() on a
+ * Unix socket. Every connection to the socket receives one dump and is
+ * closed.
+ *
+ * socket_path: path of the Unix socket
+ *
+ * rate: one line in rate is traced
+ *
+ * Return: CHIRC_OK/CHIRC_ERROR
+ */
+int trace_init(char *socket_path, int rate);
+
+/*
+ * trace_sample - Decide whether to trace a line that was just received
+ *
+ * Return: the number of a new message to trace, or 0
+ */
+uint32_t trace_sample(void);
+
+/*
+ * trace_recv - Record that a traced line was received, and framed and
+ * tokenized since
+ *
+ * msg: message number, 0 to record nothing
+ *
+ * recv_ns: stats_now() when the line was received
+ *
+ * Return: stats_now() once it was parsed, 0 if msg is 0
+ */
+uint64_t trace_recv(uint32_t msg, uint64_t recv_ns);
+
+/*
+ * trace_span - Record a span of a message in the calling thread's ring
+ * (lock-free)
+ *
+ * msg: message number, 0 to record nothing
+ *
+ * name: what was done, a string that outlives the server
+ *
+ * detail: command or lock, a string that outlives the server, or NULL
+ *
+ * start_ns, end_ns: stats_now() at the start and at the end
+ *
+ * Return: nothing
+ */
+void trace_span(uint32_t msg, const char *name, const char *detail, uint64_t start_ns, uint64_t end_ns);
+
+/*
+ * trace_dump_json - Dump the spans of all the rings, in the Chrome trace
+ * event format
+ *
+ * Return: a new sds string
+ */
+sds trace_dump_json(void);
+
+/*
+ * trace_mutex_lock - Take a lock, recording the time it took as a lock
+ * span if the thread works on a traced message
+ *
+ * lock: the lock
+ *
+ * name: name of the lock in the trace
+ *
+ * Return: nothing
+ */
+static inline void trace_mutex_lock(pthread_mutex_t *lock, const char *name)
+{
+    if (trace_msg == 0)
+    {
+        pthread_mutex_lock(lock);
+        return;
+    }
+
+    uint64_t start = stats_now();
+    pthread_mutex_lock(lock);
+    trace_span(trace_msg, "lock", name, start, stats_now());
+}
+
+#endif
@@ -0,0 +1,824 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include "upgrade.h"
+#include "server.h"
+#include "client.h"
+#include "channels.h"
+#include "banlist.h"
+#include "history.h"
+#include "serial.h"
+#include "pool.h"
+#include "shard.h"
+#include "persist.h"
+#include "send_msg.h"
+#include "stats.h"
+#include "capture.h"
+#include "reply.h"
+#include "log.h"
+#include "../lib/uthash.h"
+#include "../lib/sds/sds.h"
+
+
+static char exe_path[PATH_MAX];     /* Binary started on SIGUSR2 */
+static char **saved_argv;           /* Its arguments */
+
+/* Arguments of the thread serving the upgrade socket */
+typedef struct upgrade_args
+{
+    server_ctx *ctx;
+    int listener;       /* The upgrade socket */
+    int server_socket;  /* The listening socket to hand over */
+} upgrade_args;
+
+
+/*
+ * snapshot - Serialize the server state (upgrade_lock held for writing,
+ * so no handler is running and the tables can be read without their locks)
+ *
+ * ctx: server context
+ *
+ * server_socket: the listening socket
+ *
+ * fds: set to a malloc'd array of the sockets to hand over, the listening
+ * socket first and then the connections in the order of the state
+ *
+ * nfds: set to the number of sockets
+ *
+ * Return: the state, to be freed by the caller
+ */
+static sds snapshot(server_ctx *ctx, int server_socket, int **fds, int *nfds)
+{
+    sds b = sdsempty();
+    int n = 0;
+    conn_info_t *conn, *conn_tmp;
+    client_t *client, *client_tmp;
+
+    /* A command visiting the channel shards in turn cannot be handed over
+     * half done: its steps are run first */
+    HASH_ITER(hh, ctx->conns, conn, conn_tmp)
+    {
+        if (conn->pool != NULL)
+        {
+            pool_settle(ctx, conn);
+        }
+    }
+
+    /* TLS sessions cannot be handed over: their clients are dropped, and
+     * counted out */
+    uint32_t nconns = 0;
+    uint32_t users = counter_read(&ctx->counters, COUNTER_USERS);
+    uint32_t connections = counter_read(&ctx->counters, COUNTER_CONNECTIONS);
+    HASH_ITER(hh, ctx->conns, conn, conn_tmp)
+    {
+        if (conn->tls == NULL)
+        {
+            nconns++;
+            continue;
+        }
+        connections--;
+        HASH_FIND_INT(ctx->client_hashtable, &conn->client_socket, client);
+        if (client != NULL && client->info.state == REGISTERED)
+        {
+            users--;
+        }
+    }
+
+    b = serial_put_u32(b, users);
+    b = serial_put_u32(b, connections);
+    b = serial_put_u32(b, ctx->uid_counter);
+    b = serial_put_u32(b, ctx->cid_counter);
+
+    /* Connections, with their old socket numbers to rebuild the tables */
+    *fds = malloc((nconns + 1) * sizeof(int));
+    (*fds)[n++] = server_socket;
+    b = serial_put_u32(b, nconns);
+    HASH_ITER(hh, ctx->conns, conn, conn_tmp)
+    {
+        if (conn->tls != NULL)
+        {
+            continue;
+        }
+        (*fds)[n++] = conn->client_socket;
+        b = serial_put_u32(b, conn->client_socket);
+        b = serial_put_str(b, conn->client_hostname);
+        if (conn->pool != NULL)
+        {
+            sds unread = pool_unread(conn);
+            b = serial_put_str(b, unread);
+            sdsfree(unread);
+        }
+        else
+        {
+            b = serial_put_str(b, conn->cmdstack);
+        }
+    }
+    *nfds = n;
+
+    b = serial_put_u32(b, HASH_COUNT(ctx->client_hashtable));
+    HASH_ITER(hh, ctx->client_hashtable, client, client_tmp)
+    {
+        b = serial_put_u32(b, client->socket);
+        b = serial_put_u64(b, client->uid);
+        b = serial_put_str(b, client->client_hostname);
+        b = serial_put_str(b, client->info.nick);
+        b = serial_put_str(b, client->info.username);
+        b = serial_put_str(b, client->info.realname);
+        b = serial_put_u32(b, client->info.state);
+        b = serial_put_u32(b, client->info.is_irc_operator);
+    }
+
+    b = serial_put_u32(b, HASH_COUNT(ctx->nicks_hashtable));
+    nick_t *nick, *nick_tmp;
+    HASH_ITER(hh, ctx->nicks_hashtable, nick, nick_tmp)
+    {
+        b = serial_put_str(b, nick->nick);
+        b = serial_put_u32(b, nick->client_socket);
+    }
+
+    channel_t **tables[SHARD_MAX];
+    int ntables = shard_tables(ctx, tables);
+    uint32_t nchannels = 0;
+
+    for (int i = 0; i < ntables; i++)
+    {
+        nchannels += HASH_COUNT(*tables[i]);
+    }
+    b = serial_put_u32(b, nchannels);
+    for (int i = 0; i < ntables; i++)
+    {
+        channel_t *c, *c_tmp;
+        HASH_ITER(hh, *tables[i], c, c_tmp)
+        {
+            b = serial_put_str(b, c->channel_name);
+            b = serial_put_u64(b, c->cid);
+            b = serial_put_u32(b, HASH_COUNT(c->channel_clients));
+            channel_client *cc, *cc_tmp;
+            HASH_ITER(hh, c->channel_clients, cc, cc_tmp)
+            {
+                b = serial_put_str(b, cc->user->info.nick);
+                b = serial_put_str(b, (cc->modes & MEMBER_OP) ? "o" : "");
+            }
+            b = serial_put_banlist(b, &c->bans);
+            b = serial_put_banlist(b, &c->excepts);
+            b = serial_put_banlist(b, &c->invites);
+        }
+    }
+
+    /* Mask lists restored from the snapshot file, waiting for a JOIN */
+    b = serial_put_u32(b, HASH_COUNT(ctx->persist_pending));
+    persist_channel_t *p, *p_tmp;
+    HASH_ITER(hh, ctx->persist_pending, p, p_tmp)
+    {
+        b = serial_put_str(b, p->channel_name);
+        b = serial_put_banlist(b, &p->bans);
+        b = serial_put_banlist(b, &p->excepts);
+        b = serial_put_banlist(b, &p->invites);
+    }
+
+    b = serial_put_u32(b, HASH_COUNT(ctx->irc_operators_hashtable));
+    irc_oper_t *oper, *oper_tmp;
+    HASH_ITER(hh, ctx->irc_operators_hashtable, oper, oper_tmp)
+    {
+        b = serial_put_str(b, oper->nick);
+        b = serial_put_str(b, oper->mode);
+    }
+
+    /* Histories, least recently used first so the use order carries over */
+    pthread_mutex_lock(&ctx->history_lock);
+    b = serial_put_u32(b, HASH_COUNT(ctx->histories));
+    for (history_t *h = ctx->history_oldest; h != NULL; h = h->newer)
+    {
+        b = serial_put_str(b, h->channel_name);
+        b = serial_put_u32(b, h->count);
+        for (int i = 0; i < h->count; i++)
+        {
+            b = serial_put_str(b, h->lines[(h->start + i) % ctx->history_lines]);
+        }
+    }
+    pthread_mutex_unlock(&ctx->history_lock);
+
+    return b;
+}
+
+
+/*
+ * restore - Rebuild the server state sent by the previous process and
+ * start a worker for every connection
+ *
+ * ctx: server context, with empty tables
+ *
+ * r: the state
+ *
+ * fds: the sockets received, the listening socket first
+ *
+ * nfds: the number of sockets
+ *
+ * Return: CHIRC_OK/CHIRC_ERROR
+ */
+static int restore(server_ctx *ctx, serial_reader_t *r, int *fds, int nfds)
+{
+    counter_set(&ctx->counters, COUNTER_USERS, serial_get_u32(r));
+    counter_set(&ctx->counters, COUNTER_CONNECTIONS, serial_get_u32(r));
+    ctx->uid_counter = serial_get_u32(r);
+    ctx->cid_counter = serial_get_u32(r);
+
+    /* Old socket number -> new one */
+    uint32_t nconns = serial_get_u32(r);
+    if (r->bad || nconns != (uint32_t)nfds - 1)
+    {
+        return CHIRC_ERROR;
+    }
+    int *old_fds = malloc((nconns + 1) * sizeof(int));
+    sds *hostnames = calloc(nconns + 1, sizeof(sds));
+    sds *cmdstacks = calloc(nconns + 1, sizeof(sds));
+    int max_fd = 0;
+    for (uint32_t i = 0; i < nconns; i++)
+    {
+        old_fds[i] = serial_get_u32(r);
+        hostnames[i] = serial_get_str(r);
+        cmdstacks[i] = serial_get_str(r);
+        if (old_fds[i] > max_fd)
+        {
+            max_fd = old_fds[i];
+        }
+    }
+    int *remap = malloc((max_fd + 1) * sizeof(int));
+    for (int i = 0; i <= max_fd; i++)
+    {
+        remap[i] = -1;
+    }
+    for (uint32_t i = 0; i < nconns && !r->bad; i++)
+    {
+        remap[old_fds[i]] = fds[i + 1];
+    }
+
+    uint32_t count = serial_get_u32(r);
+    for (uint32_t i = 0; i < count && !r->bad; i++)
+    {
+        uint32_t old_fd = serial_get_u32(r);
+        int socket = old_fd <= (uint32_t)max_fd ? remap[old_fd] : -1;
+        uint64_t uid = serial_get_u64(r);
+        sds hostname = serial_get_str(r);
+        sds nick = serial_get_str(r);
+        sds username = serial_get_str(r);
+        sds realname = serial_get_str(r);
+        uint32_t state = serial_get_u32(r);
+        uint32_t is_irc_operator = serial_get_u32(r);
+
+        if (!r->bad && socket != -1)
+        {
+            client_t *client = new_USER(socket, hostname, uid);
+
+            user_set_nick(&client->info, nick != NULL ? nick : "");
+            user_set_username(&client->info, username != NULL ? username : "");
+            client->info.realname = sdscpy(client->info.realname, realname != NULL ? realname : "");
+            client->info.state = state;
+            client->info.is_irc_operator = is_irc_operator;
+            add_USER(client, socket, &ctx->client_hashtable);
+        }
+        sdsfree(hostname);
+        sdsfree(nick);
+        sdsfree(username);
+        sdsfree(realname);
+    }
+
+    count = serial_get_u32(r);
+    for (uint32_t i = 0; i < count && !r->bad; i++)
+    {
+        sds nick = serial_get_str(r);
+        uint32_t old_fd = serial_get_u32(r);
+        int socket = old_fd <= (uint32_t)max_fd ? remap[old_fd] : -1;
+
+        if (nick != NULL && socket != -1)
+        {
+            add_NICK(nick, socket, &ctx->nicks_hashtable);
+        }
+        sdsfree(nick);
+    }
+
+    count = serial_get_u32(r);
+    for (uint32_t i = 0; i < count && !r->bad; i++)
+    {
+        sds name = serial_get_str(r);
+        if (name == NULL)
+        {
+            break;
+        }
+        channel_t *c = add_CHANNEL(name, shard_table_of(ctx, name));
+        sdsfree(name);
+
+        c->cid = serial_get_u64(r);
+        uint32_t nmembers = serial_get_u32(r);
+        for (uint32_t j = 0; j < nmembers && !r->bad; j++)
+        {
+            sds nick = serial_get_str(r);
+            sds mode = serial_get_str(r);
+            if (nick == NULL)
+            {
+                sdsfree(mode);
+                continue;
+            }
+            nick_t *n = find_NICK(nick, &ctx->nicks_hashtable);
+            client_t *user = n != NULL ? find_USER(n->client_socket, &ctx->client_hashtable) : NULL;
+            if (user != NULL)
+            {
+                channel_client *cc = add_CHANNEL_CLIENT(user, c);
+                cc->modes = mode != NULL && !strcmp(mode, "o") ? MEMBER_OP : 0;
+            }
+            sdsfree(nick);
+            sdsfree(mode);
+        }
+        channel_names_invalidate(c);
+        serial_get_banlist(r, &c->bans);
+        serial_get_banlist(r, &c->excepts);
+        serial_get_banlist(r, &c->invites);
+        persist_claim(ctx, c);
+    }
+    ctx->channels_generation++;
+
+    count = serial_get_u32(r);
+    for (uint32_t i = 0; i < count && !r->bad; i++)
+    {
+        sds name = serial_get_str(r);
+        if (name == NULL)
+        {
+            break;
+        }
+        persist_channel_t *p = calloc(1, sizeof(persist_channel_t));
+        p->channel_name = name;
+        banlist_init(&p->bans);
+        banlist_init(&p->excepts);
+        banlist_init(&p->invites);
+        serial_get_banlist(r, &p->bans);
+        serial_get_banlist(r, &p->excepts);
+        serial_get_banlist(r, &p->invites);
+        HASH_ADD_KEYPTR(hh, ctx->persist_pending, p->channel_name, sdslen(p->channel_name), p);
+    }
+
+    count = serial_get_u32(r);
+    for (uint32_t i = 0; i < count && !r->bad; i++)
+    {
+        irc_oper_t *oper = malloc(sizeof(irc_oper_t));
+
+        oper->nick = serial_get_str(r);
+        oper->mode = serial_get_str(r);
+        if (oper->nick == NULL)
+        {
+            sdsfree(oper->mode);
+            free(oper);
+            continue;
+        }
+        HASH_ADD_STR(ctx->irc_operators_hashtable, nick, oper);
+    }
+
+    count = serial_get_u32(r);
+    for (uint32_t i = 0; i < count && !r->bad; i++)
+    {
+        sds name = serial_get_str(r);
+        uint32_t nlines = serial_get_u32(r);
+
+        for (uint32_t j = 0; j < nlines && !r->bad && name != NULL; j++)
+        {
+            sds line = serial_get_str(r);
+            if (line != NULL)
+            {
+                history_record(ctx, name, line);
+            }
+        }
+        sdsfree(name);
+    }
+
+    counter_set(&ctx->counters, COUNTER_CLIENTS, HASH_COUNT(ctx->client_hashtable));
+    channel_t **tables[SHARD_MAX];
+    int ntables = shard_tables(ctx, tables);
+    int64_t nchannels = 0;
+
+    for (int i = 0; i < ntables; i++)
+    {
+        nchannels += HASH_COUNT(*tables[i]);
+    }
+    counter_set(&ctx->counters, COUNTER_CHANNELS, nchannels);
+    counter_set(&ctx->counters, COUNTER_OPERATORS, HASH_COUNT(ctx->irc_operators_hashtable));
+
+    /* Only now that the state is complete may the connections be served.
+     * The workers wait on the lock until all of them are started. */
+    int rc = r->bad ? CHIRC_ERROR : CHIRC_OK;
+    pthread_rwlock_wrlock(&ctx->upgrade_lock);
+    for (uint32_t i = 0; i < nconns; i++)
+    {
+        if (rc == CHIRC_OK &&
+            start_worker(ctx, fds[i + 1], hostnames[i],
+                         cmdstacks[i] ? cmdstacks[i] : sdsempty(), false, NULL) == CHIRC_OK)
+        {
+            stats_connection_opened();
+            continue;
+        }
+        sdsfree(hostnames[i]);
+        sdsfree(cmdstacks[i]);
+        rc = CHIRC_ERROR;
+    }
+    pthread_rwlock_unlock(&ctx->upgrade_lock);
+
+    free(old_fds);
+    free(hostnames);
+    free(cmdstacks);
+    free(remap);
+
+    return rc;
+}
+
+
+/* Send sockets over a Unix socket, UPGRADE_FDS_PER_MSG at a time, each
+ * batch attached to one byte */
+static int send_fds(int peer, int *fds, int nfds)
+{
+    char control[CMSG_SPACE(UPGRADE_FDS_PER_MSG * sizeof(int))];
+
+    for (int i = 0; i < nfds; i += UPGRADE_FDS_PER_MSG)
+    {
+        int n = nfds - i < UPGRADE_FDS_PER_MSG ? nfds - i : UPGRADE_FDS_PER_MSG;
+        char byte = 0;
+        struct iovec iov = {.iov_base = &byte, .iov_len = 1};
+        struct msghdr msg = {0};
+
+        memset(control, 0, sizeof(control));
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control;
+        msg.msg_controllen = CMSG_SPACE(n * sizeof(int));
+
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(n * sizeof(int));
+        memcpy(CMSG_DATA(cmsg), fds + i, n * sizeof(int));
+
+        if (sendmsg(peer, &msg, 0) != 1)
+        {
+            return CHIRC_ERROR;
+        }
+    }
+    return CHIRC_OK;
+}
+
+
+/* Receive nfds sockets sent by send_fds(), close-on-exec */
+static int recv_fds(int peer, int *fds, int nfds)
+{
+    char control[CMSG_SPACE(UPGRADE_FDS_PER_MSG * sizeof(int))];
+    int got = 0;
+
+    while (got < nfds)
+    {
+        char byte;
+        struct iovec iov = {.iov_base = &byte, .iov_len = 1};
+        struct msghdr msg = {0};
+
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+
+        if (recvmsg(peer, &msg, MSG_CMSG_CLOEXEC) != 1 || (msg.msg_flags & MSG_CTRUNC))
+        {
+            break;
+        }
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+        if (cmsg == NULL || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+        {
+            break;
+        }
+        int n = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        if (n > nfds - got)
+        {
+            break;
+        }
+        memcpy(fds + got, CMSG_DATA(cmsg), n * sizeof(int));
+        got += n;
+    }
+
+    if (got < nfds)
+    {
+        for (int i = 0; i < got; i++)
+        {
+            close(fds[i]);
+        }
+        return CHIRC_ERROR;
+    }
+    return CHIRC_OK;
+}
+
+
+/* Read exactly len bytes */
+static int recvall(int s, void *buf, size_t len)
+{
+    size_t total = 0;
+
+    while (total < len)
+    {
+        ssize_t n = recv(s, (char *)buf + total, len - total, 0);
+        if (n <= 0)
+        {
+            return CHIRC_ERROR;
+        }
+        total += n;
+    }
+    return CHIRC_OK;
+}
+
+
+/*
+ * handoff - Hand the server over to the new process connected on peer.
+ * Does not return if the new process takes over.
+ */
+static void handoff(server_ctx *ctx, int server_socket, int peer)
+{
+    uint64_t start_ns = stats_now();
+
+    pthread_rwlock_wrlock(&ctx->upgrade_lock);
+    pool_quiesce(ctx);
+    shard_quiesce(ctx);
+    uint64_t paused_ns = stats_now();
+
+    int *fds, nfds;
+    sds state = snapshot(ctx, server_socket, &fds, &nfds);
+    sds header = serial_put_u32(sdsempty(), UPGRADE_MAGIC);
+    header = serial_put_u32(header, UPGRADE_VERSION);
+    header = serial_put_u32(header, nfds);
+    header = serial_put_u64(header, sdslen(state));
+    int header_len = sdslen(header);
+    int state_len = sdslen(state);
+
+    struct timeval timeout = {.tv_sec = UPGRADE_ACK_TIMEOUT};
+    setsockopt(peer, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+    /* Before the new process appends its own records */
+    capture_suspend(true);
+
+    char ack = 0;
+    if (sendall(peer, header, &header_len) == 0 &&
+        sendall(peer, state, &state_len) == 0 &&
+        send_fds(peer, fds, nfds) == CHIRC_OK &&
+        recv(peer, &ack, 1, 0) == 1 && ack == 'K')
+    {
+        /* The sockets stay open in the new process; this one just goes away */
+        chilog(INFO, "Upgrade: handed over %d connections and %d bytes of state; "
+                     "commands waited %.1f ms to drain and were paused for %.1f ms",
+               nfds - 1, state_len, (paused_ns - start_ns) / 1e6, (stats_now() - paused_ns) / 1e6);
+        exit(EXIT_SUCCESS);
+    }
+
+    chilog(ERROR, "Upgrade: the new process did not take over, resuming");
+    capture_suspend(false);
+    sdsfree(header);
+    sdsfree(state);
+    free(fds);
+    pool_resume(ctx);
+    pthread_rwlock_unlock(&ctx->upgrade_lock);
+}
+
+
+/*
+ * serve_upgrade - Thread function handing the server over to each process
+ * connecting to the upgrade socket
+ */
+static void *serve_upgrade(void *args)
+{
+    upgrade_args *ua = (upgrade_args *)args;
+
+    pthread_detach(pthread_self());
+
+    while (1)
+    {
+        int peer = accept4(ua->listener, NULL, NULL, SOCK_CLOEXEC);
+        if (peer == -1)
+        {
+            chilog(ERROR, "Could not accept() on upgrade socket");
+            continue;
+        }
+
+        handoff(ua->ctx, ua->server_socket, peer);
+        close(peer);
+    }
+
+    return NULL;
+}
+
+
+/*
+ * start_successor - SIGUSR2 handler starting the new process, which then
+ * connects to the upgrade socket. Only async-signal-safe calls.
+ */
+static void start_successor(int sig)
+{
+    if (fork() == 0)
+    {
+        sigset_t none;
+
+        /* The handler runs with SIGUSR2 blocked, which exec would keep */
+        sigemptyset(&none);
+        sigprocmask(SIG_SETMASK, &none, NULL);
+        execv(exe_path, saved_argv);
+        _exit(127);
+    }
+}
+
+
+void upgrade_save_argv(int argc, char *argv[])
+{
+    /*
+     * upgrade_save_argv - Remember how chirc was started, for SIGUSR2
+     *
+     * argc: argument count from main()
+     *
+     * argv: arguments from main(), before getopt() reorders them
+     *
+     * Return: nothing
+     */
+    saved_argv = calloc(argc + 1, sizeof(char *));
+    memcpy(saved_argv, argv, argc * sizeof(char *));
+
+    /* The path, not the running image, so a rebuilt binary is picked up */
+    ssize_t n = readlink("/proc/self/exe", exe_path, sizeof(exe_path) - 1);
+    if (n <= 0 || strstr(exe_path, " (deleted)") != NULL)
+    {
+        snprintf(exe_path, sizeof(exe_path), "%s", argv[0]);
+    }
+    else
+    {
+        exe_path[n] = '\0';
+    }
+}
+
+
+int upgrade_resume(server_ctx *ctx, char *socket_path, int *server_socket)
+{
+    /*
+     * upgrade_resume - Take over from a running server, if one answers on
+     * the upgrade socket
+     *
+     * ctx: server context, freshly initialized
+     *
+     * socket_path: path of the upgrade socket
+     *
+     * server_socket: set to the listening socket taken over, or -1 if no
+     * server answered and the port must be bound as usual
+     *
+     * Return: CHIRC_OK, or CHIRC_ERROR if a handoff started but failed
+     */
+    struct sockaddr_un addr;
+
+    *server_socket = -1;
+    if (strlen(socket_path) >= sizeof(addr.sun_path))
+    {
+        chilog(ERROR, "Upgrade socket path is too long: %s", socket_path);
+        return CHIRC_ERROR;
+    }
+
+    int peer = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, socket_path);
+    if (peer == -1 || connect(peer, (struct sockaddr *)&addr, sizeof(addr)) == -1)
+    {
+        /* No server running: start from scratch */
+        if (peer != -1)
+        {
+            close(peer);
+        }
+        return CHIRC_OK;
+    }
+
+    uint64_t start_ns = stats_now();
+    uint32_t magic, version, nfds;
+    uint64_t state_len;
+    if (recvall(peer, &magic, sizeof(magic)) == CHIRC_ERROR ||
+        recvall(peer, &version, sizeof(version)) == CHIRC_ERROR ||
+        recvall(peer, &nfds, sizeof(nfds)) == CHIRC_ERROR ||
+        recvall(peer, &state_len, sizeof(state_len)) == CHIRC_ERROR ||
+        magic != UPGRADE_MAGIC || version != UPGRADE_VERSION || nfds < 1)
+    {
+        chilog(ERROR, "Upgrade: the running server sent no valid state");
+        close(peer);
+        return CHIRC_ERROR;
+    }
+
+    char *state = malloc(state_len);
+    int *fds = malloc(nfds * sizeof(int));
+    if (recvall(peer, state, state_len) == CHIRC_ERROR ||
+        recv_fds(peer, fds, nfds) == CHIRC_ERROR)
+    {
+        chilog(ERROR, "Upgrade: the running server hung up during the handoff");
+        free(state);
+        free(fds);
+        close(peer);
+        return CHIRC_ERROR;
+    }
+
+    serial_reader_t r = {.p = state, .left = state_len, .bad = false};
+    if (restore(ctx, &r, fds, nfds) == CHIRC_ERROR || send(peer, "K", 1, 0) != 1)
+    {
+        chilog(ERROR, "Upgrade: could not restore the state of the running server");
+        free(state);
+        free(fds);
+        close(peer);
+        exit(EXIT_FAILURE); // Workers may already be serving some of the connections
+    }
+
+    chilog(INFO, "Upgrade: took over %u connections and %llu bytes of state in %.1f ms",
+           nfds - 1, (unsigned long long)state_len, (stats_now() - start_ns) / 1e6);
+    *server_socket = fds[0];
+    free(state);
+    free(fds);
+    close(peer);
+
+    return CHIRC_OK;
+}
+
+
+int upgrade_init(server_ctx *ctx, char *socket_path, int server_socket)
+{
+    /*
+     * upgrade_init - Listen on the upgrade socket for a new process, and
+     * start it on SIGUSR2
+     *
+     * ctx: server context
+     *
+     * socket_path: path of the upgrade socket
+     *
+     * server_socket: the listening socket to hand over
+     *
+     * Return: CHIRC_OK/CHIRC_ERROR
+     */
+    struct sockaddr_un addr;
+    pthread_t thread;
+
+    if (strlen(socket_path) >= sizeof(addr.sun_path))
+    {
+        chilog(ERROR, "Upgrade socket path is too long: %s", socket_path);
+        return CHIRC_ERROR;
+    }
+
+    upgrade_args *ua = malloc(sizeof(upgrade_args));
+    ua->ctx = ctx;
+    ua->server_socket = server_socket;
+    ua->listener = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (ua->listener == -1)
+    {
+        perror("Could not open upgrade socket");
+        free(ua);
+        return CHIRC_ERROR;
+    }
+
+    /* After a handoff, the previous process still holds the old socket
+     * file open, but no longer answers on it */
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, socket_path);
+    unlink(socket_path);
+
+    if (bind(ua->listener, (struct sockaddr *)&addr, sizeof(addr)) == -1 ||
+        listen(ua->listener, 1) == -1)
+    {
+        perror("Could not bind upgrade socket");
+        close(ua->listener);
+        free(ua);
+        return CHIRC_ERROR;
+    }
+
+    if (pthread_create(&thread, NULL, serve_upgrade, ua) != 0)
+    {
+        perror("Could not create upgrade thread");
+        close(ua->listener);
+        free(ua);
+        return CHIRC_ERROR;
+    }
+
+    if (saved_argv != NULL)
+    {
+        struct sigaction sa;
+
+        memset(&sa, 0, sizeof(sa));
+        sa.sa_handler = start_successor;
+        sa.sa_flags = SA_RESTART;
+        sigemptyset(&sa.sa_mask);
+        sigaction(SIGUSR2, &sa, NULL);
+
+        /* Nobody waits for a successor that fails to start */
+        signal(SIGCHLD, SIG_IGN);
+    }
+
+    return CHIRC_OK;
+}
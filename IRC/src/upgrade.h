@@ -0,0 +1,70 @@
+#ifndef UPGRADE_H_
+#define UPGRADE_H_
+
+#include "server.h"
+
+#define UPGRADE_MAGIC 0x43485550   /* "CHUP", first word of a handoff */
+#define UPGRADE_VERSION 2          /* Bumped when the state layout changes */
+#define UPGRADE_FDS_PER_MSG 250    /* Descriptors per SCM_RIGHTS message, below SCM_MAX_FD */
+#define UPGRADE_ACK_TIMEOUT 10     /* Seconds to wait for the new process before resuming */
+
+/*
+ * Live upgrade: a new chirc process takes over the listening socket, every
+ * client socket and the whole server state from the running one, so no
+ * client is disconnected.
+ *
+ * The running server listens on a Unix socket (-u). A new process started
+ * with the same -u path connects to it instead of binding the port. The
+ * running server then takes ctx->upgrade_lock for writing, which waits
+ * for the commands being processed to finish and keeps any other from
+ * starting, serializes the clients, nicks, channels, operators and
+ * histories, and sends them followed by the sockets (SCM_RIGHTS). Once the
+ * new process acknowledges, the old one exits; if it does not, the old
+ * one releases the lock and carries on. Input that arrives during the
+ * handoff stays in the kernel until the new process reads it.
+ *
+ * SIGUSR2 makes the running server start the new process itself, by
+ * executing its binary again with the same arguments.
+ */
+
+/*
+ * upgrade_save_argv - Remember how chirc was started, for SIGUSR2
+ *
+ * argc: argument count from main()
+ *
+ * argv: arguments from main(), before getopt() reorders them
+ *
+ * Return: nothing
+ */
+void upgrade_save_argv(int argc, char *argv[]);
+
+/*
+ * upgrade_resume - Take over from a running server, if one answers on the
+ * upgrade socket
+ *
+ * ctx: server context, freshly initialized
+ *
+ * socket_path: path of the upgrade socket
+ *
+ * server_socket: set to the listening socket taken over, or -1 if no
+ * server answered and the port must be bound as usual
+ *
+ * Return: CHIRC_OK, or CHIRC_ERROR if a handoff started but failed
+ */
+int upgrade_resume(server_ctx *ctx, char *socket_path, int *server_socket);
+
+/*
+ * upgrade_init - Listen on the upgrade socket for a new process, and
+ * start it on SIGUSR2
+ *
+ * ctx: server context
+ *
+ * socket_path: path of the upgrade socket
+ *
+ * server_socket: the listening socket to hand over
+ *
+ * Return: CHIRC_OK/CHIRC_ERROR
+ */
+int upgrade_init(server_ctx *ctx, char *socket_path, int server_socket);
+
+#endif
@@ -0,0 +1,251 @@
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include "uring.h"
+#include "stats.h"
+
+
+static int sys_setup(unsigned entries, struct io_uring_params *p)
+{
+    return syscall(__NR_io_uring_setup, entries, p);
+}
+
+
+static int sys_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags)
+{
+    stats_syscalls(1);
+    return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+
+static int sys_register(int fd, unsigned opcode, void *arg, unsigned nargs)
+{
+    return syscall(__NR_io_uring_register, fd, opcode, arg, nargs);
+}
+
+
+bool uring_supported(void)
+{
+    /*
+     * uring_supported - Whether the kernel has what the server relies on
+     *
+     * Return: true if it does
+     *
+     * Multishot receives came with the same release (6.0) as
+     * IORING_OP_SEND_ZC, which the probe can see.
+     */
+    struct io_uring_params p;
+    size_t len = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+    struct io_uring_probe *probe = calloc(1, len);
+    bool ok = false;
+
+    memset(&p, 0, sizeof(p));
+    int fd = sys_setup(2, &p);
+    if (fd < 0)
+    {
+        free(probe);
+        return false;
+    }
+    if ((p.features & IORING_FEAT_SINGLE_MMAP) &&
+        sys_register(fd, IORING_REGISTER_PROBE, probe, 256) == 0 &&
+        probe->last_op >= IORING_OP_SEND_ZC)
+    {
+        ok = (probe->ops[IORING_OP_RECV].flags & IO_URING_OP_SUPPORTED) &&
+             (probe->ops[IORING_OP_ACCEPT].flags & IO_URING_OP_SUPPORTED) &&
+             (probe->ops[IORING_OP_ASYNC_CANCEL].flags & IO_URING_OP_SUPPORTED);
+    }
+    close(fd);
+    free(probe);
+
+    return ok;
+}
+
+
+int uring_init(uring_t *ring, unsigned entries, unsigned nbufs, unsigned buf_size)
+{
+    /*
+     * uring_init - Set up a ring
+     *
+     * ring: the ring
+     *
+     * entries: submission queue entries, a power of two
+     *
+     * nbufs: provided buffers, a power of two, or 0 for none
+     *
+     * buf_size: size of each provided buffer
+     *
+     * Return: 0, or -errno
+     */
+    struct io_uring_params p;
+
+    memset(ring, 0, sizeof(uring_t));
+    memset(&p, 0, sizeof(p));
+    ring->fd = sys_setup(entries, &p);
+    if (ring->fd < 0)
+    {
+        return -errno;
+    }
+    pthread_mutex_init(&ring->lock, NULL);
+
+    /* The submission and completion rings share one mapping (SINGLE_MMAP) */
+    size_t sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    size_t cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    ring->ring_len = sq_len > cq_len ? sq_len : cq_len;
+    ring->ring_mem = mmap(NULL, ring->ring_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                          ring->fd, IORING_OFF_SQ_RING);
+    if (ring->ring_mem == MAP_FAILED)
+    {
+        int err = -errno;
+        close(ring->fd);
+        return err;
+    }
+    ring->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      ring->fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED)
+    {
+        int err = -errno;
+        munmap(ring->ring_mem, ring->ring_len);
+        close(ring->fd);
+        return err;
+    }
+
+    char *base = ring->ring_mem;
+    ring->sq_head = (unsigned *)(base + p.sq_off.head);
+    ring->sq_tail = (unsigned *)(base + p.sq_off.tail);
+    ring->sq_mask = (unsigned *)(base + p.sq_off.ring_mask);
+    ring->sq_array = (unsigned *)(base + p.sq_off.array);
+    ring->sq_entries = p.sq_entries;
+    ring->sq_pending = *ring->sq_tail;
+    ring->cq_head = (unsigned *)(base + p.cq_off.head);
+    ring->cq_tail = (unsigned *)(base + p.cq_off.tail);
+    ring->cq_mask = (unsigned *)(base + p.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(base + p.cq_off.cqes);
+
+    if (nbufs == 0)
+    {
+        return 0;
+    }
+
+    /* Provided buffer ring: the kernel takes buffers from its head, and
+     * they are put back at its tail once their data is copied */
+    size_t br_len = nbufs * sizeof(struct io_uring_buf);
+    ring->br = mmap(NULL, br_len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    ring->bufs = malloc((size_t)nbufs * buf_size);
+    if (ring->br == MAP_FAILED || ring->bufs == NULL)
+    {
+        return -ENOMEM;
+    }
+    ring->nbufs = nbufs;
+    ring->buf_size = buf_size;
+
+    struct io_uring_buf_reg reg = {.ring_addr = (uint64_t)(uintptr_t)ring->br, .ring_entries = nbufs, .bgid = 0};
+    if (sys_register(ring->fd, IORING_REGISTER_PBUF_RING, &reg, 1) != 0)
+    {
+        return -errno;
+    }
+    for (unsigned i = 0; i < nbufs; i++)
+    {
+        struct io_uring_buf *buf = &ring->br->bufs[i];
+        buf->addr = (uint64_t)(uintptr_t)(ring->bufs + (size_t)i * buf_size);
+        buf->len = buf_size;
+        buf->bid = i;
+    }
+    ring->br_tail = nbufs;
+    atomic_store_explicit((_Atomic unsigned short *)&ring->br->tail, ring->br_tail, memory_order_release);
+
+    return 0;
+}
+
+
+struct io_uring_sqe *uring_prep(uring_t *ring)
+{
+    unsigned head = atomic_load_explicit((_Atomic unsigned *)ring->sq_head, memory_order_acquire);
+
+    if (ring->sq_pending - head >= ring->sq_entries)
+    {
+        return NULL;
+    }
+    unsigned index = ring->sq_pending & *ring->sq_mask;
+    struct io_uring_sqe *sqe = &ring->sqes[index];
+
+    memset(sqe, 0, sizeof(*sqe));
+    ring->sq_array[index] = index;
+    ring->sq_pending++;
+
+    return sqe;
+}
+
+
+int uring_submit(uring_t *ring)
+{
+    unsigned pending = ring->sq_pending - *ring->sq_tail;
+    int rc;
+
+    atomic_store_explicit((_Atomic unsigned *)ring->sq_tail, ring->sq_pending, memory_order_release);
+    if (pending == 0)
+    {
+        return 0;
+    }
+    do
+    {
+        rc = sys_enter(ring->fd, pending, 0, 0);
+    } while (rc < 0 && errno == EINTR);
+
+    return rc < 0 ? -errno : rc;
+}
+
+
+int uring_wait(uring_t *ring)
+{
+    if (uring_peek(ring) != NULL)
+    {
+        return 0;
+    }
+    return sys_enter(ring->fd, 0, 1, IORING_ENTER_GETEVENTS) < 0 ? -errno : 0;
+}
+
+
+struct io_uring_cqe *uring_peek(uring_t *ring)
+{
+    unsigned head = *ring->cq_head;
+    unsigned tail = atomic_load_explicit((_Atomic unsigned *)ring->cq_tail, memory_order_acquire);
+
+    if (head == tail)
+    {
+        return NULL;
+    }
+    return &ring->cqes[head & *ring->cq_mask];
+}
+
+
+void uring_seen(uring_t *ring)
+{
+    atomic_store_explicit((_Atomic unsigned *)ring->cq_head, *ring->cq_head + 1, memory_order_release);
+}
+
+
+char *uring_buffer(uring_t *ring, struct io_uring_cqe *cqe)
+{
+    unsigned bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+
+    return ring->bufs + (size_t)bid * ring->buf_size;
+}
+
+
+void uring_recycle(uring_t *ring, struct io_uring_cqe *cqe)
+{
+    unsigned bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+    struct io_uring_buf *buf = &ring->br->bufs[ring->br_tail & (ring->nbufs - 1)];
+
+    buf->addr = (uint64_t)(uintptr_t)(ring->bufs + (size_t)bid * ring->buf_size);
+    buf->len = ring->buf_size;
+    buf->bid = bid;
+    ring->br_tail++;
+    atomic_store_explicit((_Atomic unsigned short *)&ring->br->tail, ring->br_tail, memory_order_release);
+}
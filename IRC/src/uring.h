@@ -0,0 +1,141 @@
+#ifndef URING_H_
+#define URING_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <linux/io_uring.h>
+
+/*
+ * A minimal io_uring, driven with the raw system calls (the server does not
+ * depend on liburing). One thread waits for and consumes completions;
+ * submissions may come from any thread and are serialized by ring->lock.
+ * A ring may also own a ring of provided buffers, which multishot receives
+ * fill without a buffer being submitted for each read.
+ */
+
+typedef struct uring
+{
+    int fd;
+    pthread_mutex_t lock;           /* Serializes submissions */
+
+    /* Submission queue */
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    struct io_uring_sqe *sqes;
+    unsigned sq_entries;
+    unsigned sq_pending;            /* Tail of the entries taken, published on submit */
+
+    /* Completion queue */
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_cqe *cqes;
+
+    void *ring_mem;
+    size_t ring_len;
+    size_t sqes_len;
+
+    /* Provided buffers, group 0 */
+    struct io_uring_buf_ring *br;
+    char *bufs;
+    unsigned nbufs;
+    unsigned buf_size;
+    unsigned short br_tail;
+} uring_t;
+
+/*
+ * uring_supported - Whether the kernel has what the server relies on:
+ * provided buffer rings and multishot receives and accepts
+ *
+ * Return: true if it does
+ */
+bool uring_supported(void);
+
+/*
+ * uring_init - Set up a ring
+ *
+ * ring: the ring
+ *
+ * entries: submission queue entries, a power of two
+ *
+ * nbufs: provided buffers, a power of two, or 0 for none
+ *
+ * buf_size: size of each provided buffer
+ *
+ * Return: 0, or -errno
+ */
+int uring_init(uring_t *ring, unsigned entries, unsigned nbufs, unsigned buf_size);
+
+/*
+ * uring_prep - Take a submission queue entry (called with ring->lock held)
+ *
+ * ring: the ring
+ *
+ * Return: a zeroed entry, or NULL if the queue is full
+ */
+struct io_uring_sqe *uring_prep(uring_t *ring);
+
+/*
+ * uring_submit - Submit the entries taken since the last submission
+ * (called with ring->lock held)
+ *
+ * ring: the ring
+ *
+ * Return: the number submitted, or -errno
+ */
+int uring_submit(uring_t *ring);
+
+/*
+ * uring_wait - Wait until there is a completion
+ *
+ * ring: the ring
+ *
+ * Return: 0, or -errno (-EINTR included)
+ */
+int uring_wait(uring_t *ring);
+
+/*
+ * uring_peek - The oldest completion not consumed yet
+ *
+ * ring: the ring
+ *
+ * Return: the completion, or NULL
+ */
+struct io_uring_cqe *uring_peek(uring_t *ring);
+
+/*
+ * uring_seen - Consume the completion returned by uring_peek
+ *
+ * ring: the ring
+ *
+ * Return: nothing
+ */
+void uring_seen(uring_t *ring);
+
+/*
+ * uring_buffer - The provided buffer a completion was given
+ *
+ * ring: the ring
+ *
+ * cqe: the completion, which has IORING_CQE_F_BUFFER set
+ *
+ * Return: the buffer
+ */
+char *uring_buffer(uring_t *ring, struct io_uring_cqe *cqe);
+
+/*
+ * uring_recycle - Give the buffer of a completion back to the kernel once
+ * its data is copied
+ *
+ * ring: the ring
+ *
+ * cqe: the completion
+ *
+ * Return: nothing
+ */
+void uring_recycle(uring_t *ring, struct io_uring_cqe *cqe);
+
+#endif
@@ -3,10 +3,40 @@ import time
 from chirc.types import CouldNotConnectException, ReplyTimeoutException,\
     IRCMessage
 import socket
-            
+import ssl
+
+
+class TLSSocket(object):
+    '''
+    TLS socket handed to telnetlib, which waits for data with select()
+    and then reads 50 bytes: a read returns all the data already
+    decrypted, so none is left behind where select() does not see it.
+    '''
+
+    def __init__(self, sock):
+        self.sock = sock
+
+    def recv(self, n):
+        data = self.sock.recv(max(n, 16384))
+        while self.sock.pending():
+            data += self.sock.recv(self.sock.pending())
+        return data
+
+    def __getattr__(self, name):
+        return getattr(self.sock, name)
+
+
+# One context for all the TLS clients, as a session can only be resumed
+# with the context it was made with. The server's certificate is self-signed.
+tls_context = ssl.SSLContext(ssl.PROTOCOL_TLS_CLIENT)
+tls_context.check_hostname = False
+tls_context.verify_mode = ssl.CERT_NONE
+
+
 class ChircClient(object):
     
-    def __init__(self, host = "localhost", port = 7776, msg_timeout = 0.1, nodelay=False):
+    def __init__(self, host = "localhost", port = 7776, msg_timeout = 0.1, nodelay=False,
+                 tls = False, tls_session = None):
         self.host = host
         self.port = port
         self.msg_timeout = msg_timeout
@@ -19,6 +49,9 @@ class ChircClient(object):
                 #self.client.set_debuglevel(100)
                 if nodelay:
                     self.client.sock.setsockopt(socket.IPPROTO_TCP, socket.TCP_NODELAY, 1)
+                if tls:
+                    self.client.sock = TLSSocket(tls_context.wrap_socket(self.client.sock,
+                                                                         session = tls_session))
                 break
             except Exception:
                 tries -= 1
@@ -29,6 +62,12 @@ class ChircClient(object):
     
     def disconnect(self):
         self.client.close()
+
+    def tls_session(self):
+        return self.client.sock.session
+
+    def tls_session_reused(self):
+        return self.client.sock.session_reused
         
     def get_message(self):
         msg = self.client.read_until(str.encode("\r\n"), timeout=self.msg_timeout)
@@ -2,6 +2,10 @@ RPL_WELCOME = "001"
 RPL_YOURHOST = "002"
 RPL_CREATED = "003"
 RPL_MYINFO = "004"
+RPL_STATSCOMMANDS = "212"
+RPL_ENDOFSTATS = "219"
+RPL_STATSUPTIME = "242"
+RPL_STATSDEBUG = "249"
 RPL_LUSERCLIENT = "251"
 RPL_LUSEROP = "252"
 RPL_LUSERUNKNOWN = "253"
@@ -21,6 +25,10 @@ RPL_ENDOFWHO = "315"
 RPL_LIST = "322"
 RPL_LISTEND = "323"
 RPL_CHANNELMODEIS = "324"
+RPL_EXCEPTLIST = "348"
+RPL_ENDOFEXCEPTLIST = "349"
+RPL_BANLIST = "367"
+RPL_ENDOFBANLIST = "368"
 RPL_NOTOPIC = "331"
 RPL_TOPIC = "332"
 RPL_NAMREPLY = "353"
@@ -32,6 +40,7 @@ RPL_YOUREOPER = "381"
 ERR_NOSUCHNICK = "401"
 ERR_NOSUCHCHANNEL = "403"
 ERR_CANNOTSENDTOCHAN = "404"
+ERR_TOOMANYTARGETS = "407"
 ERR_NORECIPIENT = "411"
 ERR_NOTEXTTOSEND = "412"
 ERR_UNKNOWNCOMMAND = "421"
@@ -45,6 +54,8 @@ ERR_NEEDMOREPARAMS = "461"
 ERR_ALREADYREGISTRED = "462"
 ERR_PASSWDMISMATCH = "464"
 ERR_UNKNOWNMODE = "472"
+ERR_BANNEDFROMCHAN = "474"
+ERR_NOPRIVILEGES = "481"
 ERR_CHANOPRIVSNEEDED = "482"
 ERR_UMODEUNKNOWNFLAG = "501"
 ERR_USERSDONTMATCH = "502"
\ No newline at end of file
@@ -5,6 +5,8 @@ import os
 import shutil
 import re
 import string
+import socket
+import json
 
 import chirc.replies as replies
 from chirc.client import ChircClient
@@ -26,7 +28,8 @@ class SingleIRCSession:
 
     def __init__(self, chirc_exe = None, msg_timeout = 0.1,
                  chirc_port = None, loglevel = -1, debug = False,
-                 irc_network = None, irc_network_server = None, external_chirc_port=None):
+                 irc_network = None, irc_network_server = None, external_chirc_port=None,
+                 chirc_args = None, tls = False):
         if chirc_exe is None:
             self.chirc_exe = "../build/chirc"
         else:            
@@ -58,6 +61,8 @@ class SingleIRCSession:
         self.msg_timeout = msg_timeout
         self.loglevel = loglevel
         self.debug = debug
+        self.chirc_args = chirc_args if chirc_args is not None else []
+        self.tls = tls
         self.external_chirc_port = external_chirc_port
 
         random_str = "".join([random.choice(string.ascii_letters + string.digits) for _ in range(8)])
@@ -100,6 +105,14 @@ class SingleIRCSession:
             return
 
         self.tmpdir = tempfile.mkdtemp()
+
+        if self.tls:
+            # Self-signed certificate of the TLS listener
+            subprocess.run(["openssl", "req", "-x509", "-newkey", "rsa:2048", "-nodes",
+                            "-keyout", "key.pem", "-out", "cert.pem", "-days", "1",
+                            "-subj", "/CN=localhost"],
+                           cwd = self.tmpdir, check = True,
+                           stdout = subprocess.DEVNULL, stderr = subprocess.DEVNULL)
         
         if self.randomize_ports:
             self.port = random.randint(10000,60000)
@@ -130,6 +143,10 @@ class SingleIRCSession:
                 chirc_cmd = [os.path.abspath(self.chirc_exe), "-p", str(self.port)]
 
             chirc_cmd += ["-o", self.oper_password]
+            chirc_cmd += self.chirc_args
+            if self.tls:
+                # The TLS port follows the plain one
+                chirc_cmd += ["-T", str(self.port + 1), "-C", "cert.pem", "-K", "key.pem"]
 
 
             if self.loglevel == -1:
@@ -139,6 +156,7 @@ class SingleIRCSession:
             elif self.loglevel == 2:
                 chirc_cmd.append("-vv")
 
+            self.chirc_cmd = chirc_cmd
             self.chirc_proc = subprocess.Popen(chirc_cmd, cwd = self.tmpdir)
             time.sleep(0.01)
             rc = self.chirc_proc.poll()        
@@ -154,6 +172,115 @@ class SingleIRCSession:
 
         self.started = True
         
+    def upgrade_server(self, timeout = 5):
+        """
+        Start a new chirc process with the same arguments, and wait for
+        the running one to hand its connections over and exit. The server
+        must have been started with -u.
+        """
+        old_proc = self.chirc_proc
+        self.chirc_proc = subprocess.Popen(self.chirc_cmd, cwd = self.tmpdir)
+        try:
+            rc = old_proc.wait(timeout = timeout)
+        except subprocess.TimeoutExpired:
+            old_proc.kill()
+            old_proc.wait()
+            pytest.fail("chirc process did not hand over to the new one")
+        if rc != 0:
+            pytest.fail("chirc process failed during upgrade. rc = %i" % rc)
+
+    def restart_server(self):
+        """
+        Kill the chirc process, as a crash would, and start it again with
+        the same arguments. The clients of the killed process are dropped.
+        """
+        self.chirc_proc.kill()
+        self.chirc_proc.wait()
+        for c in list(self.clients):
+            self.disconnect_client(c)
+        # The port may be held for a moment after the kill, while the
+        # kernel tears down the io_uring of the killed process
+        for attempt in range(20):
+            self.chirc_proc = subprocess.Popen(self.chirc_cmd, cwd = self.tmpdir)
+            time.sleep(0.1)
+            rc = self.chirc_proc.poll()
+            if rc is None:
+                return
+        pytest.fail("chirc process failed to restart. rc = %i" % rc)
+
+    def read_capture(self, filename, wait = 0.3):
+        """
+        Parse a capture written by chirc -R in the session's directory,
+        after waiting for the server to write it out. Returns a list of
+        (type, connection, value) tuples: the wall clock for "S", the flags
+        for "O", the line for "L" and None for "C".
+        """
+        time.sleep(wait)
+        with open(os.path.join(self.tmpdir, filename), "rb") as f:
+            data = f.read()
+        assert data[:8] == b"CHIRCCAP", "Not a capture file"
+        pos = 12
+
+        def varint():
+            nonlocal pos
+            value, shift = 0, 0
+            while True:
+                byte = data[pos]
+                pos += 1
+                value |= (byte & 0x7f) << shift
+                shift += 7
+                if not byte & 0x80:
+                    return value
+
+        records = []
+        while pos < len(data):
+            rtype = chr(data[pos])
+            pos += 1
+            if rtype == "S":
+                records.append(("S", None, varint()))
+                continue
+            varint()
+            conn = varint()
+            if rtype == "O":
+                records.append(("O", conn, varint()))
+            elif rtype == "L":
+                length = varint()
+                records.append(("L", conn, data[pos:pos + length].decode()))
+                pos += length
+            else:
+                assert rtype == "C", "Bad record type %s" % rtype
+                records.append(("C", conn, None))
+        return records
+
+    def _read_json_socket(self, socket_name, wait):
+        time.sleep(wait)
+        s = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+        s.connect(os.path.join(self.tmpdir, socket_name))
+        data = b""
+        while True:
+            chunk = s.recv(65536)
+            if not chunk:
+                break
+            data += chunk
+        s.close()
+        return json.loads(data)
+
+    def read_trace(self, socket_name, wait = 0.1):
+        """
+        Fetch the trace served by chirc -X on a Unix socket in the session's
+        directory, after waiting for the server to be done with the last
+        command. Returns the list of trace events.
+        """
+        return self._read_json_socket(socket_name, wait)["traceEvents"]
+
+    def read_stats(self, socket_name, wait = 0.1):
+        """
+        Fetch the stats served by chirc -S on a Unix socket in the session's
+        directory, after waiting for the server to be done with the last
+        command. Returns the decoded JSON object.
+        """
+        return self._read_json_socket(socket_name, wait)
+
     def end_session(self):
         if not self.started:
             return
@@ -184,13 +311,26 @@ class SingleIRCSession:
         c = ChircClient(msg_timeout = self.msg_timeout, port=port, nodelay = nodelay)
         self.clients.append(c)
         return c
+
+    def get_tls_client(self, tls_session = None):
+        """
+        Connect to the TLS port, resuming tls_session if given. The session
+        must have been started with tls = True.
+        """
+        c = ChircClient(msg_timeout = self.msg_timeout, port = self.port + 1,
+                        tls = True, tls_session = tls_session)
+        self.clients.append(c)
+        return c
         
     def disconnect_client(self, c):
         c.disconnect()
         self.clients.remove(c)
     
-    def connect_user(self, nick, username):
-        client = self.get_client()
+    def connect_user(self, nick, username, tls = False, tls_session = None):
+        if tls:
+            client = self.get_tls_client(tls_session)
+        else:
+            client = self.get_client()
         
         client.send_cmd("NICK %s" % nick)
         client.send_cmd("USER %s * * :%s" % (nick, username))
@@ -725,14 +865,19 @@ class SingleIRCSession:
         self.get_reply(client, expect_code = replies.RPL_ENDOFNAMES, expect_nick = nick,
                        expect_short_params = expect_short_params, expect_nparams = 2)
 
-    def verify_list(self, channels, client, nick, expect_topics = None):
+    def verify_list(self, channels, client, nick, expect_topics = None, param = None):
         """
         User `nick` sends a LIST command and we verify the replies.
         `channels` is a dictionary mapping channel names to users in each channel.
         `expect_topics` is a dictionary mapping channel names to their topics
+        `param` is the parameter of the LIST command, if any. `channels` must
+        then only contain the channels expected in the reply.
         """
 
-        client.send_cmd("LIST")
+        if param is None:
+            client.send_cmd("LIST")
+        else:
+            client.send_cmd("LIST %s" % param)
 
         channelsl = set([k for k in channels.keys() if k is not None])
         numchannels = len(channelsl)
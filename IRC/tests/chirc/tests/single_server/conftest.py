@@ -2,23 +2,109 @@ import pytest
 from chirc.tests.common.sessions import SingleIRCSession
 
 
-@pytest.fixture
-def irc_session(request):   
-    chirc_exe = request.config.getoption("--chirc-exe")
-    chirc_loglevel = request.config.getoption("--chirc-loglevel")
-    chirc_port = request.config.getoption("--chirc-port")
-    external_chirc_port = request.config.getoption("--chirc-external-port")
-    
-    session = SingleIRCSession(chirc_exe=chirc_exe,
-                               loglevel=chirc_loglevel,
-                               chirc_port=chirc_port,
-                               external_chirc_port=external_chirc_port)
-    
+def make_session(request, extra_args = None, tls = False):
+    """
+    Start a single-server session with the command-line options of the
+    test run plus extra_args, and end it when the test is done
+    """
+    session = SingleIRCSession(chirc_exe=request.config.getoption("--chirc-exe"),
+                               loglevel=request.config.getoption("--chirc-loglevel"),
+                               chirc_port=request.config.getoption("--chirc-port"),
+                               external_chirc_port=request.config.getoption("--chirc-external-port"),
+                               chirc_args=extra_args,
+                               tls=tls)
+
     session.start_session()
-    
-    def fin():
-        session.end_session()
-        
-    request.addfinalizer(fin)    
-    
+    request.addfinalizer(session.end_session)
+
     return session
+
+
+@pytest.fixture
+def irc_session(request):
+    return make_session(request)
+
+
+@pytest.fixture
+def history_session(request):
+    """
+    A session whose server keeps the last three messages of each channel
+    """
+    return make_session(request, ["-H", "3"])
+
+
+@pytest.fixture
+def stats_session(request):
+    """
+    A session whose server serves its stats as JSON on stats.sock
+    (read_stats)
+    """
+    return make_session(request, ["-S", "stats.sock"])
+
+
+@pytest.fixture
+def upgrade_session(request):
+    """
+    A session whose server can be upgraded in place (upgrade_server)
+    """
+    return make_session(request, ["-u", "upgrade.sock"])
+
+
+@pytest.fixture
+def persist_session(request):
+    """
+    A session whose server keeps a snapshot file and can be restarted
+    from it (restart_server)
+    """
+    return make_session(request, ["-P", "snapshot.bin"])
+
+
+@pytest.fixture(params=[["-B", "epoll"], ["-B", "uring"], ["-B", "epoll", "-c", "4"]],
+                ids=["epoll", "uring", "shards"])
+def pool_session(request):
+    """
+    A session whose server runs commands on a pool of workers (split mode),
+    with each I/O backend and with channel shards, and can be upgraded in
+    place (upgrade_server)
+    """
+    return make_session(request, ["-w", "4", "-i", "2"] + request.param + ["-u", "upgrade.sock"])
+
+
+@pytest.fixture(params=[[], ["-w", "2", "-B", "uring"]], ids=["threads", "uring"])
+def tls_session(request):
+    """
+    A session whose server also listens for TLS, on the port after the
+    plain one (get_tls_client), with a thread per connection and in split
+    mode, and can be upgraded in place (upgrade_server)
+    """
+    return make_session(request, request.param + ["-u", "upgrade.sock"], tls=True)
+
+
+@pytest.fixture(params=[[], ["-w", "2", "-c", "2"]], ids=["threads", "shards"])
+def trace_session(request):
+    """
+    A session whose server traces every line and serves the trace on
+    trace.sock (read_trace), with a thread per connection and with
+    channel shards
+    """
+    return make_session(request, request.param + ["-X", "trace.sock", "-x", "1"])
+
+
+@pytest.fixture(params=[[], ["-w", "2", "-B", "uring"]], ids=["threads", "uring"])
+def capture_session(request):
+    """
+    A session whose server records the lines it receives to capture.bin
+    (read_capture), with a thread per connection and in split mode, and
+    can be upgraded in place (upgrade_server)
+    """
+    return make_session(request, request.param + ["-R", "capture.bin", "-u", "upgrade.sock"])
+
+
+@pytest.fixture(params=[[], ["-w", "2"], ["-w", "2", "-B", "uring"]], ids=["threads", "epoll", "uring"])
+def storm_session(request):
+    """
+    A session whose server has a short listen backlog, with a thread per
+    connection and in split mode, and can be upgraded in place
+    (upgrade_server)
+    """
+    return make_session(request, request.param + ["-b", "16", "-u", "upgrade.sock"])
@@ -99,6 +99,24 @@ class TestJOIN(object):
         irc_session.get_ERR_NEEDMOREPARAMS_reply(client1, 
                                                  expect_nick="user1", expect_cmd="JOIN")
 
+    def test_join_multiple(self, irc_session):
+        """
+        Two clients connect to the server and join three channels
+        with a single JOIN command.
+        """
+
+        client1 = irc_session.connect_user("user1", "User One")
+        client2 = irc_session.connect_user("user2", "User Two")
+
+        client1.send_cmd("JOIN #test1,#test2,#test3")
+        for channel in ("#test1", "#test2", "#test3"):
+            irc_session.verify_join(client1, "user1", channel, expect_names = ["@user1"])
+
+        client2.send_cmd("JOIN #test1,#test3")
+        for channel in ("#test1", "#test3"):
+            irc_session.verify_join(client2, "user2", channel, expect_names = ["@user1", "user2"])
+            irc_session.verify_relayed_join(client1, from_nick="user2", channel=channel)
+
 
 @pytest.mark.category("CHANNEL_PRIVMSG_NOTICE")
 class TestChannelPRIVMSG(object):
@@ -273,6 +291,27 @@ class TestPART(object):
         irc_session.get_reply(client2, expect_timeout = True)
                         
 
+    def test_channel_part_multiple(self, irc_session):
+        """
+        Two clients connect to the server and join #test1 and #test2.
+        The first user leaves both, plus a channel it is not in, with
+        a single PART command.
+        """
+        clients = irc_session.connect_clients(2, join_channel = "#test1")
+        irc_session.join_channel(clients, "#test2")
+
+        nick1, client1 = clients[0]
+        nick2, client2 = clients[1]
+
+        client1.send_cmd("PART #test1,#test3,#test2 :Bye")
+        irc_session.verify_relayed_part(client1, from_nick=nick1, channel="#test1", msg="Bye")
+        irc_session.get_reply(client1, expect_code = replies.ERR_NOSUCHCHANNEL, expect_nick = nick1,
+                              expect_nparams = 2, expect_short_params = ["#test3"])
+        irc_session.verify_relayed_part(client1, from_nick=nick1, channel="#test2", msg="Bye")
+        irc_session.verify_relayed_part(client2, from_nick=nick1, channel="#test1", msg="Bye")
+        irc_session.verify_relayed_part(client2, from_nick=nick1, channel="#test2", msg="Bye")
+
+
     def test_channel_part4(self, irc_session):
         """
         Two clients connect to the server, join a channel, and then leave it.
@@ -862,7 +901,40 @@ class TestNAMES(object):
         
         users["user1"].send_cmd("NAMES #noexist")
         irc_session.get_reply(users["user1"], expect_code = replies.RPL_ENDOFNAMES, expect_nick = "user1",
-                   expect_nparams = 2)                
+                   expect_nparams = 2)
+
+    def test_names_chunked(self, irc_session):
+        """
+        Forty users with long nicks join #big, more than fit in a single
+        line. user1, who is not in the channel, then sends NAMES #big and
+        we verify that the RPL_NAMREPLY lines fit in 512 bytes and list
+        every member exactly once.
+        """
+        observer = irc_session.connect_user("user1", "User One")
+
+        nicks = ["chunkmember%02d" % i for i in range(40)]
+        for nick in nicks:
+            client = irc_session.connect_user(nick, "User %s" % nick)
+            client.send_cmd("JOIN #big")
+            irc_session.verify_relayed_join(client, nick, "#big")
+
+        observer.send_cmd("NAMES #big")
+
+        names = []
+        nlines = 0
+        reply = irc_session.get_reply(observer, expect_nick = "user1")
+        while reply.cmd == replies.RPL_NAMREPLY:
+            assert len(reply.raw()) + 2 <= 512, "RPL_NAMREPLY longer than 512 bytes: {}".format(reply.raw())
+            irc_session.verify_names_single(reply, "user1", expect_channel = "#big")
+            names += reply.params[3][1:].split(" ")
+            nlines += 1
+            reply = irc_session.get_reply(observer, expect_nick = "user1")
+
+        irc_session._assert_equals(reply.cmd, replies.RPL_ENDOFNAMES,
+                                   explanation = "Expected RPL_ENDOFNAMES after the RPL_NAMREPLY lines",
+                                   irc_msg = reply)
+        assert nlines > 1, "Expected the names of #big to be split over several lines"
+        assert sorted(names) == sorted(["@" + nicks[0]] + nicks[1:]), "Unexpected names: {}".format(names)
 
 
 @pytest.mark.category("LIST")                
@@ -971,6 +1043,57 @@ class TestLIST(object):
                                          "#test3": "Topic Three"})      
 
 
+    def test_list_names(self, irc_session):
+        """
+        Nine users join the channels of test_list1. user1 then sends
+        a LIST command for two of the channels and one that does
+        not exist.
+        """
+        users = irc_session.connect_and_join_channels(channels1)
+
+        expect = {k: channels1[k] for k in ("#test1", "#test3")}
+        irc_session.verify_list(expect, users["user1"], "user1", param = "#test1,#test3,#noexist")
+
+
+    def test_list_users(self, irc_session):
+        """
+        Six users join three channels of different sizes:
+
+        #test1: @user1, user2, user3
+        #test2: @user4
+        #test3: @user5, user6
+
+        user1 then sends LIST commands filtered on the number of users.
+        """
+        channels = { "#test1": ("@user1", "user2", "user3"),
+                     "#test2": ("@user4",),
+                     "#test3": ("@user5", "user6")
+                   }
+        users = irc_session.connect_and_join_channels(channels)
+
+        expect = {k: channels[k] for k in ("#test1", "#test3")}
+        irc_session.verify_list(expect, users["user1"], "user1", param = ">1")
+
+        expect = {k: channels[k] for k in ("#test2", "#test3")}
+        irc_session.verify_list(expect, users["user1"], "user1", param = "<3")
+
+        expect = {k: channels[k] for k in ("#test3",)}
+        irc_session.verify_list(expect, users["user1"], "user1", param = ">1,<3")
+
+
+    def test_list_mask(self, irc_session):
+        """
+        Nine users join the channels of test_list1. user1 then sends
+        LIST commands with name masks.
+        """
+        users = irc_session.connect_and_join_channels(channels1)
+
+        expect = {k: channels1[k] for k in ("#test2",)}
+        irc_session.verify_list(expect, users["user1"], "user1", param = "*2")
+
+        expect = {k: channels1[k] for k in ("#test1", "#test3")}
+        irc_session.verify_list(expect, users["user1"], "user1", param = "#TEST?,!*2")
+
 @pytest.mark.category("WHO")
 class TestWHO(object):
             
@@ -1215,9 +1338,94 @@ class TestWHO(object):
         self._test_who(irc_session, channels3, users["user1"], "user1", channel = "#test3", aways = aways, ircops = ircops)                     
         self._test_who(irc_session, channels3, users["user1"], "user1", channel = "#test4", aways = aways, ircops = ircops)        
         self._test_who(irc_session, channels3, users["user1"], "user1", channel = "#test5", aways = aways, ircops = ircops)                            
+
+    def test_who_mask(self, irc_session):
+        """
+        Connects eleven users as in test_who3. user1 then sends "WHO user1?",
+        which matches user10 and user11 whatever channels they are in.
+        """
+        users = irc_session.connect_and_join_channels(channels2)
+
+        users["user1"].send_cmd("WHO user1?")
+
+        expected = set(["user10", "user11"])
+        for i in range(len(expected)):
+            reply = irc_session.get_reply(users["user1"], expect_code = replies.RPL_WHOREPLY, expect_nick = "user1",
+                                          expect_nparams = 7, expect_short_params = ["*"])
+            irc_session._assert_in(reply.params[5], expected,
+                                   explanation = "Received unexpected RPL_WHOREPLY for {}".format(reply.params[5]),
+                                   irc_msg = reply)
+            expected.remove(reply.params[5])
+
+        irc_session.get_reply(users["user1"], expect_code = replies.RPL_ENDOFWHO, expect_nick = "user1",
+                              expect_nparams = 2, expect_short_params = ["user1?"],
+                              long_param_re = "End of WHO list")
                  
                  
 
+@pytest.mark.category("CHANNEL_HISTORY")
+class TestHISTORY(object):
+
+    def test_history_join(self, history_session):
+        """
+        user1 joins #test and sends five messages to it. When user2 joins,
+        the last three are replayed after the names.
+        """
+        client1 = history_session.connect_user("user1", "User One")
+        client2 = history_session.connect_user("user2", "User Two")
+
+        client1.send_cmd("JOIN #test")
+        history_session.verify_join(client1, "user1", "#test")
+
+        for i in range(1, 6):
+            client1.send_cmd("PRIVMSG #test :message %i" % i)
+        # The reply to HISTORY comes after the messages are recorded
+        client1.send_cmd("HISTORY #test 1")
+        history_session.verify_relayed_privmsg(client1, from_nick = "user1", recip = "#test",
+                                               msg = "message 5")
+        history_session.get_message(client1, expect_cmd = "NOTICE", expect_nparams = 2,
+                                    long_param_re = "End of #test history")
+
+        client2.send_cmd("JOIN #test")
+        history_session.verify_relayed_join(client1, from_nick = "user2", channel = "#test")
+        history_session.verify_join(client2, "user2", "#test")
+
+        for i in range(3, 6):
+            history_session.verify_relayed_privmsg(client2, from_nick = "user1", recip = "#test",
+                                                   msg = "message %i" % i)
+
+    def test_history_command(self, history_session):
+        """
+        Two users in #test exchange four messages. user2 asks for the last
+        two with HISTORY, and user3, who is not in #test, cannot ask.
+        """
+        client1 = history_session.connect_user("user1", "User One")
+        client2 = history_session.connect_user("user2", "User Two")
+        client3 = history_session.connect_user("user3", "User Three")
+
+        client1.send_cmd("JOIN #test")
+        history_session.verify_join(client1, "user1", "#test")
+        client2.send_cmd("JOIN #test")
+        history_session.verify_relayed_join(client1, from_nick = "user2", channel = "#test")
+        history_session.verify_join(client2, "user2", "#test")
+
+        for i in range(1, 5):
+            client1.send_cmd("PRIVMSG #test :message %i" % i)
+            history_session.verify_relayed_privmsg(client2, from_nick = "user1", recip = "#test",
+                                                   msg = "message %i" % i)
+
+        client2.send_cmd("HISTORY #test 2")
+        for i in range(3, 5):
+            history_session.verify_relayed_privmsg(client2, from_nick = "user1", recip = "#test",
+                                                   msg = "message %i" % i)
+        history_session.get_message(client2, expect_cmd = "NOTICE", expect_nparams = 2,
+                                    long_param_re = "End of #test history")
+
+        client3.send_cmd("HISTORY #test")
+        history_session.get_reply(client3, expect_code = replies.ERR_NOTONCHANNEL, expect_nick = "user3",
+                                  expect_nparams = 2, expect_short_params = ["#test"])
+
+
 class TestChannelUPDATEAssignment2(object):
 
     @pytest.mark.category("NICK_CHANNEL")
@@ -1272,4 +1480,75 @@ class TestChannelUPDATEAssignment2(object):
                                 long_param_re = r"Closing Link: .* \(I'm outta here\)")
                     
         irc_session.verify_disconnect(client1)
-                                                                                                      
\ No newline at end of file
+                                                                                                      
+    @pytest.mark.category("NICK_CHANNEL")
+    def test_update1b_nick_shared(self, irc_session):
+        """
+        Ensure that a nick change is relayed once to a user sharing
+        several channels with the user changing nick, and that the
+        channels know the user by the new nick afterwards.
+        """
+        clients = irc_session.connect_clients(3)
+        for channel in ("#test1", "#test2", "#test3"):
+            irc_session.join_channel(clients, channel)
+
+        nick1, client1 = clients[0]
+
+        client1.send_cmd("NICK userfoo")
+
+        irc_session.verify_relayed_nick(client1, from_nick=nick1, newnick="userfoo")
+        for nick, client in clients[1:]:
+            irc_session.verify_relayed_nick(client, from_nick=nick1, newnick="userfoo")
+            irc_session.get_reply(client, expect_timeout = True)
+
+        nick2, client2 = clients[1]
+        client2.send_cmd("NAMES #test2")
+        irc_session.verify_names(client2, nick2, expect_channel = "#test2",
+                                 expect_names = ["@userfoo", "user2", "user3"])
+
+    @pytest.mark.category("NICK_CHANNEL")
+    def test_update1b_nick_long(self, irc_session):
+        """
+        Ensure that a channel operator keeps its privileges and is known by
+        its new nick when changing to a long nick and back to a short one.
+        """
+        clients = irc_session.connect_clients(2, join_channel = "#test")
+
+        nick1, client1 = clients[0]
+        nick2, client2 = clients[1]
+
+        for newnick, oldnick in (("averyveryverylongnickname", nick1), ("userfoo", "averyveryverylongnickname")):
+            client1.send_cmd("NICK " + newnick)
+            irc_session.verify_relayed_nick(client2, from_nick=oldnick, newnick=newnick)
+
+            client2.send_cmd("NAMES #test")
+            irc_session.verify_names(client2, nick2, expect_channel = "#test",
+                                     expect_names = ["@" + newnick, nick2])
+
+            client1.send_cmd("PRIVMSG #test :hello")
+            irc_session.verify_relayed_privmsg(client2, from_nick = newnick, recip = "#test", msg = "hello")
+
+    @pytest.mark.category("QUIT_CHANNEL")
+    def test_update1b_quit_shared(self, irc_session):
+        """
+        Ensure that a QUIT is relayed once to a user sharing several
+        channels with the user quitting, and that the nick can be
+        used again afterwards.
+        """
+        clients = irc_session.connect_clients(3)
+        for channel in ("#test1", "#test2", "#test3"):
+            irc_session.join_channel(clients, channel)
+
+        nick1, client1 = clients[0]
+
+        client1.send_cmd("QUIT")
+
+        for nick, client in clients[1:]:
+            irc_session.verify_relayed_quit(client, from_nick=nick1, msg = "Client Quit")
+            irc_session.get_reply(client, expect_timeout = True)
+
+        irc_session.get_message(client1, expect_cmd = "ERROR", expect_nparams = 1,
+                                long_param_re = r"Closing Link: .* \(Client Quit\)")
+        irc_session.verify_disconnect(client1)
+
+        irc_session.connect_user(nick1, "User Again")
@@ -691,3 +691,451 @@ class TestQUIT(object):
         
         irc_session.verify_disconnect(client1)
         irc_session.verify_disconnect(client2)
+
+
+@pytest.mark.category("UPGRADE")
+class TestUpgrade(object):
+
+    def test_upgrade_keeps_channels(self, upgrade_session):
+        """
+        Two users in #test; user1 has sent half a message when the server
+        is upgraded. The new process completes it, relays it, and accepts
+        a third user who sees both members.
+        """
+        client1 = upgrade_session.connect_user("user1", "User One")
+        client2 = upgrade_session.connect_user("user2", "User Two")
+
+        client1.send_cmd("JOIN #test")
+        upgrade_session.verify_join(client1, "user1", "#test")
+        client2.send_cmd("JOIN #test")
+        upgrade_session.verify_relayed_join(client1, from_nick = "user2", channel = "#test")
+        upgrade_session.verify_join(client2, "user2", "#test")
+
+        client1.send_raw(["PRIVMSG #test :hal"])
+        upgrade_session.upgrade_server()
+        client1.send_raw(["f\r\n"])
+        upgrade_session.verify_relayed_privmsg(client2, from_nick = "user1", recip = "#test", msg = "half")
+
+        client3 = upgrade_session.connect_user("user3", "User Three")
+        client3.send_cmd("JOIN #test")
+        upgrade_session.verify_relayed_join(client1, from_nick = "user3", channel = "#test")
+        upgrade_session.verify_relayed_join(client2, from_nick = "user3", channel = "#test")
+        upgrade_session.verify_join(client3, "user3", "#test", expect_names = ["@user1", "user2", "user3"])
+
+    def test_upgrade_keeps_lusers(self, upgrade_session):
+        """
+        The counts LUSERS reports are carried over by a live upgrade: two
+        users in two channels and a connection that has sent nothing yet,
+        then a third user registering with the new process.
+        """
+        (nick1, client1), (nick2, client2) = upgrade_session.connect_clients(2, join_channel = "#test1")
+        client1.send_cmd("JOIN #test2")
+        upgrade_session.verify_join(client1, "user1", "#test2")
+        upgrade_session.get_client()
+
+        upgrade_session.upgrade_server()
+
+        client3 = upgrade_session.connect_user("user3", "User Three")
+        client3.send_cmd("LUSERS")
+        upgrade_session.verify_lusers(client3, "user3",
+                                      expect_users = 3,
+                                      expect_ops = 0,
+                                      expect_unknown = 1,
+                                      expect_channels = 2,
+                                      expect_clients = 3)
+
+    def test_upgrade_during_registration(self, upgrade_session):
+        """
+        A client sends NICK before the upgrade and USER after it, and is
+        welcomed by the new process. Its nick is still taken.
+        """
+        client1 = upgrade_session.get_client()
+        client1.send_cmd("NICK user1")
+
+        upgrade_session.upgrade_server()
+
+        client1.send_cmd("USER user1 * * :User One")
+        upgrade_session.verify_welcome_messages(client1, "user1")
+
+        client2 = upgrade_session.get_client()
+        client2.send_cmd("NICK user1")
+        upgrade_session.get_reply(client2, expect_code = replies.ERR_NICKNAMEINUSE, expect_nick = "*",
+                                  expect_nparams = 2, expect_short_params = ["user1"])
+
+
+@pytest.mark.category("SPLIT_MODE")
+class TestSplitMode(object):
+
+    def test_split_mode_pipelined_order(self, pool_session):
+        """
+        A client sends more PRIVMSGs in one write than a connection may
+        have queued. Workers run them one batch at a time, input is read
+        again as the queue drains, and they are relayed in the order they
+        were sent.
+        """
+        client1 = pool_session.connect_user("user1", "User One")
+        client2 = pool_session.connect_user("user2", "User Two")
+
+        client1.send_raw(["".join("PRIVMSG user2 :msg%d\r\n" % i for i in range(200))])
+        client1.send_cmd("PRIVMSG user2 :last")
+        for i in range(200):
+            pool_session.verify_relayed_privmsg(client2, from_nick = "user1", recip = "user2", msg = "msg%d" % i)
+        pool_session.verify_relayed_privmsg(client2, from_nick = "user1", recip = "user2", msg = "last")
+
+    def test_split_mode_quit_drops_rest(self, pool_session):
+        """
+        Commands after a QUIT in the same write are not run, and the
+        connection is closed. Its nick is free again.
+        """
+        client1 = pool_session.connect_user("user1", "User One")
+        client2 = pool_session.connect_user("user2", "User Two")
+
+        client1.send_raw(["QUIT :Bye\r\nPRIVMSG user2 :too late\r\n"])
+        pool_session.get_message(client1, expect_cmd = "ERROR", expect_nparams = 1,
+                                 long_param_re = r"Closing Link: .* \(Bye\)")
+        pool_session.verify_disconnect(client1)
+
+        client3 = pool_session.connect_user("user1", "User One")
+        client3.send_cmd("PRIVMSG user2 :hello")
+        pool_session.verify_relayed_privmsg(client2, from_nick = "user1", recip = "user2", msg = "hello")
+
+    def test_split_mode_upgrade(self, pool_session):
+        """
+        A command split across a live upgrade of a server in split mode is
+        completed and relayed by the new process.
+        """
+        client1 = pool_session.connect_user("user1", "User One")
+        client2 = pool_session.connect_user("user2", "User Two")
+
+        client1.send_raw(["PRIVMSG user2 :hal"])
+        pool_session.upgrade_server()
+        client1.send_raw(["f\r\n"])
+        pool_session.verify_relayed_privmsg(client2, from_nick = "user1", recip = "user2", msg = "half")
+
+    def test_split_mode_channels(self, pool_session):
+        """
+        JOIN and PRIVMSG to several channels at once, then NICK and QUIT
+        of a member of all of them. Each channel is relayed in the order
+        it was given, and NICK and QUIT are relayed once to a member
+        sharing several channels.
+        """
+        client1 = pool_session.connect_user("user1", "User One")
+        client2 = pool_session.connect_user("user2", "User Two")
+
+        client1.send_cmd("JOIN #alpha,#beta,#gamma")
+        for channel in ["#alpha", "#beta", "#gamma"]:
+            pool_session.verify_join(client1, "user1", channel, expect_names = ["@user1"])
+
+        client2.send_cmd("JOIN #alpha,#beta,#gamma")
+        for channel in ["#alpha", "#beta", "#gamma"]:
+            pool_session.verify_join(client2, "user2", channel, expect_names = ["@user1", "user2"])
+            pool_session.verify_relayed_join(client1, "user2", channel)
+
+        client2.send_cmd("PRIVMSG #gamma,#alpha,#beta :hello")
+        for channel in ["#gamma", "#alpha", "#beta"]:
+            pool_session.verify_relayed_privmsg(client1, from_nick = "user2", recip = channel, msg = "hello")
+
+        client2.send_cmd("NICK user3")
+        pool_session.verify_relayed_nick(client2, "user2", "user3")
+        pool_session.verify_relayed_nick(client1, "user2", "user3")
+        client2.send_cmd("PRIVMSG #beta :renamed")
+        pool_session.verify_relayed_privmsg(client1, from_nick = "user3", recip = "#beta", msg = "renamed")
+
+        client2.send_cmd("QUIT :Bye")
+        pool_session.verify_relayed_quit(client1, "user3", "Bye")
+        client1.send_cmd("PRIVMSG #alpha :alone")
+        pool_session.get_reply(client1, expect_timeout = True)
+
+
+@pytest.mark.category("TLS")
+class TestTLS(object):
+
+    def test_tls_register_and_relay(self, tls_session):
+        """
+        A user registers on the TLS port and exchanges messages with a
+        user on the plain one.
+        """
+        client1 = tls_session.connect_user("user1", "User One", tls = True)
+        client2 = tls_session.connect_user("user2", "User Two")
+
+        client1.send_cmd("PRIVMSG user2 :over tls")
+        tls_session.verify_relayed_privmsg(client2, from_nick = "user1", recip = "user2", msg = "over tls")
+        client2.send_cmd("PRIVMSG user1 :in clear")
+        tls_session.verify_relayed_privmsg(client1, from_nick = "user2", recip = "user1", msg = "in clear")
+
+    def test_tls_resume_session(self, tls_session):
+        """
+        A user quits and reconnects with the session of its first
+        connection, which is resumed instead of a full handshake.
+        """
+        client1 = tls_session.connect_user("user1", "User One", tls = True)
+        session = client1.tls_session()
+        assert not client1.tls_session_reused()
+
+        client1.send_cmd("QUIT :Bye")
+        tls_session.get_message(client1, expect_cmd = "ERROR", expect_nparams = 1,
+                                long_param_re = r"Closing Link: .* \(Bye\)")
+        tls_session.verify_disconnect(client1)
+
+        client2 = tls_session.connect_user("user1", "User One", tls = True, tls_session = session)
+        assert client2.tls_session_reused()
+
+    def test_tls_upgrade_drops_tls(self, tls_session):
+        """
+        A live upgrade hands the plain connections over but not the TLS
+        ones: the TLS user is gone, and its nick and its place in LUSERS
+        are free for a new TLS connection.
+        """
+        client1 = tls_session.connect_user("user1", "User One")
+        client2 = tls_session.connect_user("user2", "User Two", tls = True)
+
+        tls_session.upgrade_server()
+        tls_session.verify_disconnect(client2)
+
+        client3 = tls_session.get_tls_client()
+        client3.send_cmd("NICK user2")
+        client3.send_cmd("USER user2 * * :User Two")
+        tls_session.verify_welcome_messages(client3, "user2")
+        tls_session.verify_lusers(client3, "user2", expect_users = 2, expect_clients = 2)
+
+        client3.send_cmd("PRIVMSG user1 :back")
+        tls_session.verify_relayed_privmsg(client1, from_nick = "user2", recip = "user1", msg = "back")
+
+
+@pytest.mark.category("CAPTURE")
+class TestCapture(object):
+
+    def test_capture_lines(self, capture_session):
+        """
+        Each connection is recorded when it opens, with the lines it sends
+        in order, without "\r\n", and when it closes. A line sent in two
+        writes is recorded once.
+        """
+        client1 = capture_session.connect_user("user1", "User One")
+        client2 = capture_session.connect_user("user2", "User Two")
+
+        client1.send_raw(["PRIVMSG user2 :hel", "lo\r\nPRIVMSG user2 :again\r\n"], wait = 0.1)
+        capture_session.verify_relayed_privmsg(client2, from_nick = "user1", recip = "user2", msg = "hello")
+        capture_session.verify_relayed_privmsg(client2, from_nick = "user1", recip = "user2", msg = "again")
+        client2.send_cmd("QUIT :Bye")
+        capture_session.get_message(client2, expect_cmd = "ERROR", expect_nparams = 1,
+                                    long_param_re = r"Closing Link: .* \(Bye\)")
+        capture_session.verify_disconnect(client2)
+
+        records = capture_session.read_capture("capture.bin")
+        assert records[0][0] == "S"
+        opened = [conn for rtype, conn, flags in records if rtype == "O"]
+        assert len(opened) == 2 and all(flags == 0 for rtype, conn, flags in records if rtype == "O")
+        lines1 = [line for rtype, conn, line in records if rtype == "L" and conn == opened[0]]
+        lines2 = [line for rtype, conn, line in records if rtype == "L" and conn == opened[1]]
+        assert lines1 == ["NICK user1", "USER user1 * * :User One", "PRIVMSG user2 :hello", "PRIVMSG user2 :again"]
+        assert lines2 == ["NICK user2", "USER user2 * * :User Two", "QUIT :Bye"]
+        assert ("C", opened[1], None) in records and ("C", opened[0], None) not in records
+
+    def test_capture_upgrade(self, capture_session):
+        """
+        A live upgrade starts a new segment in the same file, where the
+        connection handed over is opened again. The line it had half sent
+        is recorded once, whole, by the new process.
+        """
+        client1 = capture_session.connect_user("user1", "User One")
+        client2 = capture_session.connect_user("user2", "User Two")
+
+        client1.send_raw(["PRIVMSG user2 :hal"])
+        capture_session.upgrade_server()
+        client1.send_raw(["f\r\n"])
+        capture_session.verify_relayed_privmsg(client2, from_nick = "user1", recip = "user2", msg = "half")
+
+        records = capture_session.read_capture("capture.bin")
+        starts = [i for i, record in enumerate(records) if record[0] == "S"]
+        assert len(starts) == 2
+        before, after = records[:starts[1]], records[starts[1]:]
+        assert [rtype for rtype, conn, value in before if rtype == "O"] == ["O", "O"]
+        handed_over = {conn for rtype, conn, flags in after if rtype == "O" and flags & 0x02}
+        assert len(handed_over) == 2
+        assert [line for rtype, conn, line in records if rtype == "L" and line.startswith("PRIVMSG")] == \
+            ["PRIVMSG user2 :half"]
+        assert [conn for rtype, conn, line in after if rtype == "L"][0] in handed_over
+
+
+@pytest.mark.category("TRACE")
+class TestTrace(object):
+
+    def test_trace_channel_privmsg(self, trace_session):
+        """
+        The spans of a traced channel PRIVMSG go from its receipt to the
+        write relaying it, with the lock waits and the writes inside the
+        dispatch. Spans on other threads are linked by flow arrows.
+        """
+        (nick1, client1), (nick2, client2) = trace_session.connect_clients(2, join_channel = "#test")
+
+        client1.send_cmd("PRIVMSG #test :traced")
+        trace_session.verify_relayed_privmsg(client2, from_nick = "user1", recip = "#test", msg = "traced")
+
+        events = trace_session.read_trace("trace.sock")
+        dispatch = [e for e in events if e["name"] == "dispatch PRIVMSG"]
+        assert len(dispatch) == 1
+        msg = dispatch[0]["args"]["msg"]
+        spans = [e for e in events if e["ph"] == "X" and e["args"]["msg"] == msg]
+        names = [e["name"] for e in spans]
+        assert names[:2] == ["recv", "parse"]
+        assert "send" in names and any(name.startswith("lock ") for name in names)
+
+        start, end = dispatch[0]["ts"], dispatch[0]["ts"] + dispatch[0]["dur"]
+        for e in spans:
+            assert e["ts"] >= spans[0]["ts"]
+            if e["name"] == "send" or e["name"].startswith("lock "):
+                assert start <= e["ts"] and e["ts"] + e["dur"] <= end + 0.001
+                assert e["tid"] == dispatch[0]["tid"]
+
+        threads = {e["tid"] for e in spans}
+        flows = [e for e in events if e["ph"] in "sf" and e["id"] == msg]
+        assert len(flows) == 2 * (len(threads) - 1)
+        if len(threads) > 1:
+            assert "queue" in names and "shard" in names
+
+
+@pytest.mark.category("STATS")
+class TestSTATS(object):
+
+    def _oper(self, session, client, nick):
+        client.send_cmd("OPER %s %s" % (nick, session.oper_password))
+        session.get_reply(client, expect_code = replies.RPL_YOUREOPER, expect_nick = nick,
+                          expect_nparams = 1, long_param_re = "You are now an IRC operator")
+
+    def _get_stats(self, session, client, nick, query, expect_code):
+        """
+        Send STATS <query> and return the replies with expect_code,
+        checking that they are followed by RPL_ENDOFSTATS
+        """
+        client.send_cmd("STATS %s" % query)
+        replies_ = []
+        while True:
+            reply = session.get_reply(client, expect_nick = nick)
+            if reply.cmd == replies.RPL_ENDOFSTATS:
+                session.verify_reply(reply, expect_code = replies.RPL_ENDOFSTATS, expect_nick = nick,
+                                     expect_nparams = 2, expect_short_params = [query],
+                                     long_param_re = "End of STATS report")
+                return replies_
+            session.verify_reply(reply, expect_code = expect_code, expect_nick = nick)
+            replies_.append(reply)
+
+    def test_stats_not_oper(self, irc_session):
+        """
+        STATS is only available to IRC operators.
+        """
+        client1 = irc_session.connect_user("user1", "User One")
+
+        client1.send_cmd("STATS m")
+        irc_session.get_reply(client1, expect_code = replies.ERR_NOPRIVILEGES, expect_nick = "user1",
+                              expect_nparams = 1, long_param_re = "Permission Denied.*")
+
+    def test_stats_no_query(self, irc_session):
+        client1 = irc_session.connect_user("user1", "User One")
+
+        client1.send_cmd("STATS")
+        irc_session.get_ERR_NEEDMOREPARAMS_reply(client1, expect_nick = "user1", expect_cmd = "STATS")
+
+    def test_stats_commands(self, irc_session):
+        """
+        STATS m counts the commands run so far, one RPL_STATSCOMMANDS
+        per command.
+        """
+        (nick1, client1), (nick2, client2) = irc_session.connect_clients(2)
+        self._oper(irc_session, client1, nick1)
+
+        for i in range(3):
+            client1.send_cmd("PRIVMSG user2 :hello %i" % i)
+            irc_session.verify_relayed_privmsg(client2, from_nick = "user1", recip = "user2",
+                                               msg = "hello %i" % i)
+
+        counts = {}
+        for reply in self._get_stats(irc_session, client1, nick1, "m", replies.RPL_STATSCOMMANDS):
+            assert len(reply.params) == 3, reply.raw()
+            counts[reply.params[1]] = int(reply.params[2])
+
+        assert counts["PRIVMSG"] == 3
+        assert counts["NICK"] == 2 and counts["USER"] == 2
+        assert counts["OPER"] == 1
+
+    def test_stats_latency_traffic_uptime(self, irc_session):
+        """
+        STATS l gives a line of percentiles per command, STATS t the
+        connections and traffic, and STATS u the uptime.
+        """
+        client1 = irc_session.connect_user("user1", "User One")
+        self._oper(irc_session, client1, "user1")
+
+        latencies = self._get_stats(irc_session, client1, "user1", "l", replies.RPL_STATSDEBUG)
+        lines = [reply.params[1].lstrip(":") for reply in latencies]
+        assert {line.split()[0] for line in lines} >= {"NICK", "USER", "OPER"}
+        for line in lines:
+            assert "recv-dispatch p50=" in line and "dispatch-flush p50=" in line
+
+        traffic = self._get_stats(irc_session, client1, "user1", "t", replies.RPL_STATSDEBUG)
+        assert len(traffic) == 1
+
+        uptime = self._get_stats(irc_session, client1, "user1", "u", replies.RPL_STATSUPTIME)
+        assert len(uptime) == 1
+        irc_session.verify_reply(uptime[0], expect_code = replies.RPL_STATSUPTIME, expect_nick = "user1",
+                                 expect_nparams = 1, long_param_re = r"Server Up 0 days 0:00:\d\d")
+
+    def test_stats_json(self, stats_session):
+        """
+        The -S socket serves the same counters as JSON.
+        """
+        (nick1, client1), (nick2, client2) = stats_session.connect_clients(2)
+
+        for i in range(3):
+            client1.send_cmd("PRIVMSG user2 :hello %i" % i)
+            stats_session.verify_relayed_privmsg(client2, from_nick = "user1", recip = "user2",
+                                                 msg = "hello %i" % i)
+
+        stats = stats_session.read_stats("stats.sock")
+        assert stats["connections"]["current"] == 2
+        assert stats["connections"]["total"] == 2
+        assert stats["bytes"]["in"] > 0 and stats["bytes"]["out"] > 0
+        assert isinstance(stats["uptime"], int)
+
+        privmsg = stats["commands"]["PRIVMSG"]
+        assert privmsg["count"] == 3
+        for phase in ("recv_to_dispatch_us", "dispatch_to_flush_us"):
+            assert set(privmsg[phase]) >= {"p50", "p90", "p99", "max"}
+            assert privmsg[phase]["p50"] <= privmsg[phase]["max"]
+
+        # Every connection gets a dump of its own
+        assert stats_session.read_stats("stats.sock", wait = 0)["commands"]["PRIVMSG"]["count"] == 3
+
+
+@pytest.mark.category("CONNECTION_STORM")
+class TestConnectionStorm(object):
+
+    def _register_all(self, session, clients):
+        for i, client in enumerate(clients):
+            client.send_cmd("NICK user%d" % i)
+            client.send_cmd("USER user%d * * :User %d" % (i, i))
+        for i, client in enumerate(clients):
+            session.get_reply(client, expect_code = replies.RPL_WELCOME, expect_nick = "user%d" % i,
+                              expect_nparams = 1,
+                              long_param_re = r"Welcome to the Internet Relay Network user%d!user%d@\S+" % (i, i))
+
+    def test_storm_burst(self, storm_session):
+        """
+        Many more clients than the listen backlog connect at once, then
+        all of them register. Every one is welcomed with a hostname, looked
+        up by the thread serving it.
+        """
+        clients = [storm_session.get_client() for i in range(100)]
+
+        self._register_all(storm_session, clients)
+
+    def test_storm_upgrade_before_first_command(self, storm_session):
+        """
+        Clients connected but silent when the server is upgraded may not
+        have their hostname looked up yet. The new process looks it up
+        before their first command.
+        """
+        clients = [storm_session.get_client() for i in range(10)]
+
+        storm_session.upgrade_server()
+        self._register_all(storm_session, clients)
@@ -1,4 +1,5 @@
 import pytest
+import time
 from chirc.tests.common.fixtures import channels1, channels2, channels3
 from chirc import replies
 
@@ -865,6 +866,150 @@ class TestChannelMembershipMODE(object):
         irc_session.connect_and_join_channels(channels3)
 
 
+@pytest.mark.category("MODES")
+class TestChannelBanMODE(object):
+
+    def test_channel_ban01(self, irc_session):
+        """
+        Three users connect to the server and user1 joins #test. user1 bans
+        user2 (+b), which is relayed with the mask completed to user2!*@*.
+        user2 cannot join #test, and user3 can.
+        """
+
+        client1 = irc_session.connect_user("user1", "User One")
+        client2 = irc_session.connect_user("user2", "User Two")
+        client3 = irc_session.connect_user("user3", "User Three")
+
+        client1.send_cmd("JOIN #test")
+        irc_session.verify_join(client1, "user1", "#test")
+
+        client1.send_cmd("MODE #test +b user2")
+        irc_session.verify_relayed_mode(client1, "user1", "#test", "+b", "user2!*@*")
+
+        client2.send_cmd("JOIN #test")
+        irc_session.get_reply(client2, expect_code = replies.ERR_BANNEDFROMCHAN, expect_nick = "user2",
+                              expect_nparams = 2, expect_short_params = ["#test"],
+                              long_param_re = "Cannot join channel \\(\\+b\\)")
+
+        client3.send_cmd("JOIN #test")
+        irc_session.verify_join(client3, "user3", "#test")
+
+    def test_channel_ban02(self, irc_session):
+        """
+        user1 bans everyone from #test and excepts user2 (+e). user2
+        can join #test, and user3 cannot.
+        """
+
+        client1 = irc_session.connect_user("user1", "User One")
+        client2 = irc_session.connect_user("user2", "User Two")
+        client3 = irc_session.connect_user("user3", "User Three")
+
+        client1.send_cmd("JOIN #test")
+        irc_session.verify_join(client1, "user1", "#test")
+
+        client1.send_cmd("MODE #test +b *!*@*")
+        irc_session.verify_relayed_mode(client1, "user1", "#test", "+b", "*!*@*")
+        client1.send_cmd("MODE #test +e user2")
+        irc_session.verify_relayed_mode(client1, "user1", "#test", "+e", "user2!*@*")
+
+        client2.send_cmd("JOIN #test")
+        irc_session.verify_join(client2, "user2", "#test")
+
+        client3.send_cmd("JOIN #test")
+        irc_session.get_reply(client3, expect_code = replies.ERR_BANNEDFROMCHAN, expect_nick = "user3",
+                              expect_nparams = 2, expect_short_params = ["#test"])
+
+    def test_channel_ban03(self, irc_session):
+        """
+        user1 sets two bans on #test, lists them, removes one (-b) and
+        lists them again.
+        """
+
+        client1 = irc_session.connect_user("user1", "User One")
+
+        client1.send_cmd("JOIN #test")
+        irc_session.verify_join(client1, "user1", "#test")
+
+        client1.send_cmd("MODE #test +b user2")
+        irc_session.verify_relayed_mode(client1, "user1", "#test", "+b", "user2!*@*")
+        client1.send_cmd("MODE #test +b *!guest*@*")
+        irc_session.verify_relayed_mode(client1, "user1", "#test", "+b", "*!guest*@*")
+
+        client1.send_cmd("MODE #test +b")
+        for mask in ("user2!*@*", "*!guest*@*"):
+            reply = irc_session.get_reply(client1, expect_code = replies.RPL_BANLIST, expect_nick = "user1")
+            irc_session._assert_equals(reply.params[1:3], ["#test", mask],
+                                       explanation = "Expected ban {}".format(mask),
+                                       irc_msg = reply)
+        irc_session.get_reply(client1, expect_code = replies.RPL_ENDOFBANLIST, expect_nick = "user1",
+                              expect_nparams = 2, expect_short_params = ["#test"])
+
+        client1.send_cmd("MODE #test -b user2")
+        irc_session.verify_relayed_mode(client1, "user1", "#test", "-b", "user2!*@*")
+
+        client1.send_cmd("MODE #test b")
+        reply = irc_session.get_reply(client1, expect_code = replies.RPL_BANLIST, expect_nick = "user1")
+        irc_session._assert_equals(reply.params[1:3], ["#test", "*!guest*@*"],
+                                   explanation = "Expected ban *!guest*@*",
+                                   irc_msg = reply)
+        irc_session.get_reply(client1, expect_code = replies.RPL_ENDOFBANLIST, expect_nick = "user1",
+                              expect_nparams = 2, expect_short_params = ["#test"])
+
+    def test_channel_ban04(self, irc_session):
+        """
+        Two users join #test. The second user, who is not a channel
+        operator, cannot set a ban.
+        """
+
+        clients = irc_session.connect_clients(2, join_channel = "#test")
+
+        nick2, client2 = clients[1]
+
+        irc_session.set_channel_mode(client2, nick2, "#test", "+b", "user1", expect_ops_needed = True)
+
+    def test_channel_ban_restart(self, persist_session):
+        """
+        user1 bans user2 from #test and excepts user3 from a ban on
+        everyone, then the server crashes and restarts from its snapshot.
+        #test is gone with its members, but its lists come back when it is
+        joined again: user2 cannot create it, user3 can, and the lists
+        are intact.
+        """
+
+        client1 = persist_session.connect_user("user1", "User One")
+
+        client1.send_cmd("JOIN #test")
+        persist_session.verify_join(client1, "user1", "#test")
+        client1.send_cmd("MODE #test +b user2")
+        persist_session.verify_relayed_mode(client1, "user1", "#test", "+b", "user2!*@*")
+        client1.send_cmd("MODE #test +b *!*@*")
+        persist_session.verify_relayed_mode(client1, "user1", "#test", "+b", "*!*@*")
+        client1.send_cmd("MODE #test +e user3")
+        persist_session.verify_relayed_mode(client1, "user1", "#test", "+e", "user3!*@*")
+
+        # Let the snapshot thread write the changes
+        time.sleep(1.5)
+        persist_session.restart_server()
+
+        client2 = persist_session.connect_user("user2", "User Two")
+        client2.send_cmd("JOIN #test")
+        persist_session.get_reply(client2, expect_code = replies.ERR_BANNEDFROMCHAN, expect_nick = "user2",
+                                  expect_nparams = 2, expect_short_params = ["#test"])
+
+        client3 = persist_session.connect_user("user3", "User Three")
+        client3.send_cmd("JOIN #test")
+        persist_session.verify_join(client3, "user3", "#test")
+
+        client3.send_cmd("MODE #test b")
+        for mask in ("user2!*@*", "*!*@*"):
+            reply = persist_session.get_reply(client3, expect_code = replies.RPL_BANLIST, expect_nick = "user3")
+            persist_session._assert_equals(reply.params[1:3], ["#test", mask],
+                                           explanation = "Expected ban {}".format(mask),
+                                           irc_msg = reply)
+        persist_session.get_reply(client3, expect_code = replies.RPL_ENDOFBANLIST, expect_nick = "user3",
+                                  expect_nparams = 2, expect_short_params = ["#test"])
+
+
 @pytest.mark.category("MODES")
 class TestPermissionsPRIVMSG(BaseTestPermissions):
 
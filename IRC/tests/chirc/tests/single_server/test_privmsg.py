@@ -155,6 +155,46 @@ class TestPRIVMSG(object):
 
         irc_session.get_reply(client1, expect_code = replies.ERR_NORECIPIENT, expect_nick = "user1", 
                               expect_nparams = 1, long_param_re = r"No recipient given \(PRIVMSG\)")
+
+    def test_privmsg_targets(self, irc_session):
+        """
+        Test sending one PRIVMSG to a list of users, one of which does
+        not exist and one of which is repeated
+        """
+
+        client1 = irc_session.connect_user("user1", "User One")
+        client2 = irc_session.connect_user("user2", "User Two")
+        client3 = irc_session.connect_user("user3", "User Three")
+
+        client1.send_cmd("PRIVMSG user2,user4,user3,user2 :Hello")
+
+        irc_session.get_reply(client1, expect_code = replies.ERR_NOSUCHNICK, expect_nick = "user1",
+                              expect_nparams = 2, expect_short_params = ["user4"],
+                              long_param_re = "No such nick/channel")
+        irc_session.verify_relayed_privmsg(client2, from_nick="user1", recip="user2", msg="Hello")
+        irc_session.verify_relayed_privmsg(client3, from_nick="user1", recip="user3", msg="Hello")
+        irc_session.get_reply(client2, expect_timeout = True)
+
+    def test_privmsg_toomanytargets(self, irc_session):
+        """
+        Test sending a PRIVMSG to more targets than MAXTARGETS (20):
+        the first twenty are processed and the others get ERR_TOOMANYTARGETS
+        """
+
+        client1 = irc_session.connect_user("user1", "User One")
+        client2 = irc_session.connect_user("user2", "User Two")
+        client3 = irc_session.connect_user("user3", "User Three")
+
+        targets = ["user2"] + ["ghost%i" % i for i in range(19)] + ["user3"]
+        client1.send_cmd("PRIVMSG %s :Hello" % ",".join(targets))
+
+        irc_session.get_reply(client1, expect_code = replies.ERR_TOOMANYTARGETS, expect_nick = "user1",
+                              expect_nparams = 2, expect_short_params = ["user3"])
+        for i in range(19):
+            irc_session.get_reply(client1, expect_code = replies.ERR_NOSUCHNICK, expect_nick = "user1",
+                                  expect_nparams = 2, expect_short_params = ["ghost%i" % i])
+        irc_session.verify_relayed_privmsg(client2, from_nick="user1", recip="user2", msg="Hello")
+        irc_session.get_reply(client3, expect_timeout = True)
         
 
 @pytest.mark.category("PRIVMSG_NOTICE")
@@ -0,0 +1,214 @@
+/*
+ *
+ *  chirc-unit-compress: unit tests of the zlib streams of compressed
+ *  server links
+ *
+ *  Each test compresses with the deflater of one link_zstream_t and
+ *  decompresses with the inflater of another, as the two ends of a link.
+ *
+ *  Exits with a non-zero status on the first failed check.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "compress.h"
+#include "reply.h"
+#include "log.h"
+#include "../lib/sds/sds.h"
+
+#define CHECK(cond)                                                     \
+    do                                                                  \
+    {                                                                   \
+        if (!(cond))                                                    \
+        {                                                               \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__,      \
+                    __LINE__, #cond);                                   \
+            exit(EXIT_FAILURE);                                         \
+        }                                                               \
+    } while (0)
+
+#define LINE1 ":001AAAAAA PRIVMSG #chirc :hello\r\n"
+#define LINE2 ":001AAAAAB PRIVMSG #chirc :hello again\r\n"
+#define LINE3 ":001AAAAAA QUIT :bye\r\n"
+
+
+/* Decompress all of in on the receiving end, checking it gives expected */
+static void check_received(link_zstream_t *rx, sds in, const char *expected)
+{
+    sds out = sdsempty();
+
+    CHECK(link_zstream_decompress(rx, in, sdslen(in), &out) == CHIRC_OK);
+    CHECK(sdslen(out) == strlen(expected));
+    CHECK(!memcmp(out, expected, sdslen(out)));
+    sdsfree(out);
+}
+
+
+static void test_sync(void)
+{
+    link_zstream_t tx, rx;
+    sds wire = sdsempty();
+
+    CHECK(link_zstream_init(&tx, LINK_COMPRESS_DEFAULT_LEVEL, LINK_FLUSH_SYNC) == CHIRC_OK);
+    CHECK(link_zstream_init(&rx, LINK_COMPRESS_DEFAULT_LEVEL, LINK_FLUSH_SYNC) == CHIRC_OK);
+
+    /* Every line can be read as soon as it is sent */
+    CHECK(link_zstream_compress(&tx, LINE1, strlen(LINE1), &wire) == CHIRC_OK);
+    CHECK(sdslen(wire) > 0);
+    check_received(&rx, wire, LINE1);
+    sdsclear(wire);
+
+    CHECK(link_zstream_compress(&tx, LINE2, strlen(LINE2), &wire) == CHIRC_OK);
+    check_received(&rx, wire, LINE2);
+    sdsclear(wire);
+
+    /* Nothing is held back, so a flush sends nothing */
+    CHECK(link_zstream_flush(&tx, &wire) == CHIRC_OK);
+    CHECK(sdslen(wire) == 0);
+
+    CHECK(tx.raw_out == strlen(LINE1) + strlen(LINE2));
+    CHECK(rx.raw_in == tx.raw_out);
+    CHECK(rx.compressed_in == tx.compressed_out);
+
+    sdsfree(wire);
+    link_zstream_free(&tx);
+    link_zstream_free(&rx);
+}
+
+
+static void test_batch_partial_flush(void)
+{
+    link_zstream_t tx, rx;
+    sds wire = sdsempty();
+
+    CHECK(link_zstream_init(&tx, LINK_COMPRESS_DEFAULT_LEVEL, LINK_FLUSH_BATCH) == CHIRC_OK);
+    CHECK(link_zstream_init(&rx, LINK_COMPRESS_DEFAULT_LEVEL, LINK_FLUSH_BATCH) == CHIRC_OK);
+
+    /* Short lines are held back: what was sent so far gives no line */
+    CHECK(link_zstream_compress(&tx, LINE1, strlen(LINE1), &wire) == CHIRC_OK);
+    CHECK(link_zstream_compress(&tx, LINE2, strlen(LINE2), &wire) == CHIRC_OK);
+    CHECK(tx.pending == strlen(LINE1) + strlen(LINE2));
+    check_received(&rx, wire, "");
+    sdsclear(wire);
+
+    /* A flush in the middle of the stream sends both */
+    CHECK(link_zstream_flush(&tx, &wire) == CHIRC_OK);
+    CHECK(tx.pending == 0);
+    check_received(&rx, wire, LINE1 LINE2);
+    sdsclear(wire);
+
+    /* And the same streams go on after it */
+    CHECK(link_zstream_compress(&tx, LINE3, strlen(LINE3), &wire) == CHIRC_OK);
+    CHECK(link_zstream_flush(&tx, &wire) == CHIRC_OK);
+    check_received(&rx, wire, LINE3);
+
+    sdsfree(wire);
+    link_zstream_free(&tx);
+    link_zstream_free(&rx);
+}
+
+
+static void test_batch_threshold(void)
+{
+    link_zstream_t tx, rx;
+    sds wire = sdsempty();
+    sds sent = sdsempty();
+    sds got = sdsempty();
+    int n = 0;
+
+    CHECK(link_zstream_init(&tx, LINK_COMPRESS_DEFAULT_LEVEL, LINK_FLUSH_BATCH) == CHIRC_OK);
+    CHECK(link_zstream_init(&rx, LINK_COMPRESS_DEFAULT_LEVEL, LINK_FLUSH_BATCH) == CHIRC_OK);
+
+    /* Once LINK_COMPRESS_FLUSH_BYTES are held back, they are sent without a flush */
+    while (sdslen(sent) < LINK_COMPRESS_FLUSH_BYTES)
+    {
+        sds line = sdscatprintf(sdsempty(), ":001AAAAAA PRIVMSG #chirc :line %d\r\n", n++);
+
+        CHECK(link_zstream_compress(&tx, line, sdslen(line), &wire) == CHIRC_OK);
+        sent = sdscatsds(sent, line);
+        sdsfree(line);
+    }
+    CHECK(tx.pending == 0);
+    CHECK(link_zstream_decompress(&rx, wire, sdslen(wire), &got) == CHIRC_OK);
+    CHECK(sdslen(got) == sdslen(sent));
+    CHECK(!memcmp(got, sent, sdslen(sent)));
+    CHECK(tx.compressed_out < tx.raw_out);
+
+    sdsfree(wire);
+    sdsfree(sent);
+    sdsfree(got);
+    link_zstream_free(&tx);
+    link_zstream_free(&rx);
+}
+
+
+static void test_split_reads(void)
+{
+    link_zstream_t tx, rx;
+    sds wire = sdsempty();
+    sds got = sdsempty();
+
+    CHECK(link_zstream_init(&tx, 9, LINK_FLUSH_SYNC) == CHIRC_OK);
+    CHECK(link_zstream_init(&rx, 9, LINK_FLUSH_SYNC) == CHIRC_OK);
+
+    CHECK(link_zstream_compress(&tx, LINE1, strlen(LINE1), &wire) == CHIRC_OK);
+    CHECK(link_zstream_compress(&tx, LINE2, strlen(LINE2), &wire) == CHIRC_OK);
+    CHECK(link_zstream_compress(&tx, LINE3, strlen(LINE3), &wire) == CHIRC_OK);
+
+    /* The bytes can come in a few at a time, across the flush points */
+    for (size_t i = 0; i < sdslen(wire); i += 3)
+    {
+        size_t len = sdslen(wire) - i < 3 ? sdslen(wire) - i : 3;
+
+        CHECK(link_zstream_decompress(&rx, wire + i, len, &got) == CHIRC_OK);
+    }
+    CHECK(sdslen(got) == strlen(LINE1 LINE2 LINE3));
+    CHECK(!memcmp(got, LINE1 LINE2 LINE3, sdslen(got)));
+
+    sdsfree(wire);
+    sdsfree(got);
+    link_zstream_free(&tx);
+    link_zstream_free(&rx);
+}
+
+
+static void test_corrupt(void)
+{
+    link_zstream_t rx;
+    sds got = sdsempty();
+
+    /* Plain text where a zlib header is expected */
+    CHECK(link_zstream_init(&rx, LINK_COMPRESS_DEFAULT_LEVEL, LINK_FLUSH_SYNC) == CHIRC_OK);
+    CHECK(link_zstream_decompress(&rx, LINE1, strlen(LINE1), &got) == CHIRC_ERROR);
+
+    sdsfree(got);
+    link_zstream_free(&rx);
+}
+
+
+static void test_requested(void)
+{
+    CHECK(link_compress_requested("chirc|Z"));
+    CHECK(link_compress_requested("chirc|UZ"));
+    CHECK(!link_compress_requested("chirc|U"));
+    CHECK(!link_compress_requested(""));
+}
+
+
+int main(void)
+{
+    chirc_setloglevel(QUIET);
+
+    test_sync();
+    test_batch_partial_flush();
+    test_batch_threshold();
+    test_split_reads();
+    test_corrupt();
+    test_requested();
+
+    printf("compress: all checks passed\n");
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,205 @@
+/*
+ *
+ *  chirc-unit-network: unit tests of the spanning tree routing and the
+ *  UID encoding used by server links
+ *
+ *  The network is seven servers, so the tree laid out by network_load is
+ *
+ *              0
+ *          1       2
+ *        3   4   5   6
+ *
+ *  Exits with a non-zero status on the first failed check.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "network.h"
+#include "reply.h"
+#include "log.h"
+#include "../lib/sds/sds.h"
+
+#define NT_SERVERS 7
+
+#define CHECK(cond)                                                     \
+    do                                                                  \
+    {                                                                   \
+        if (!(cond))                                                    \
+        {                                                               \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__,      \
+                    __LINE__, #cond);                                   \
+            exit(EXIT_FAILURE);                                         \
+        }                                                               \
+    } while (0)
+
+
+/* Write the network file of NT_SERVERS servers, returning its path */
+static char *write_network(void)
+{
+    static char path[] = "/tmp/chirc-network-XXXXXX";
+    int fd = mkstemp(path);
+    FILE *f = fd != -1 ? fdopen(fd, "w") : NULL;
+
+    CHECK(f != NULL);
+    for (int i = 0; i < NT_SERVERS; i++)
+    {
+        fprintf(f, "irc-%d.example.net,127.0.0.1,%d,passwd%d\n", i, 7776 + i, i);
+    }
+    fclose(f);
+
+    return path;
+}
+
+
+static network_t *load_as(char *path, int id)
+{
+    char servername[32];
+    network_t *net;
+
+    snprintf(servername, sizeof servername, "irc-%d.example.net", id);
+    net = network_load(path, servername);
+    CHECK(net != NULL);
+    CHECK(net->self->id == (unsigned int)id);
+
+    return net;
+}
+
+
+static void test_next_hop(char *path)
+{
+    /* Expected next hop from each server (row) to each server (column) */
+    static const int expected[NT_SERVERS][NT_SERVERS] = {
+        {-1, 1, 2, 1, 1, 2, 2},
+        {0, -1, 0, 3, 4, 0, 0},
+        {0, 0, -1, 0, 0, 5, 6},
+        {1, 1, 1, -1, 1, 1, 1},
+        {1, 1, 1, 1, -1, 1, 1},
+        {2, 2, 2, 2, 2, -1, 2},
+        {2, 2, 2, 2, 2, 2, -1},
+    };
+
+    for (int self = 0; self < NT_SERVERS; self++)
+    {
+        network_t *net = load_as(path, self);
+
+        for (int dest = 0; dest < NT_SERVERS; dest++)
+        {
+            CHECK(network_next_hop(net, dest) == expected[self][dest]);
+        }
+        /* Not a server of the network */
+        CHECK(network_next_hop(net, NT_SERVERS) == -1);
+        network_free(net);
+    }
+}
+
+
+static void test_downstream(char *path)
+{
+    unsigned int all[NT_SERVERS] = {0, 1, 2, 3, 4, 5, 6};
+    unsigned int hops[NT_SERVERS];
+    network_t *net = load_as(path, 1);
+
+    /* A broadcast goes on every link once */
+    CHECK(network_downstream(net, all, NT_SERVERS, -1, hops) == 3);
+    CHECK(hops[0] == 0 && hops[1] == 3 && hops[2] == 4);
+
+    /* But not back on the link it came from */
+    CHECK(network_downstream(net, all, NT_SERVERS, 0, hops) == 2);
+    CHECK(hops[0] == 3 && hops[1] == 4);
+    CHECK(network_downstream(net, all, NT_SERVERS, 3, hops) == 2);
+    CHECK(hops[0] == 0 && hops[1] == 4);
+
+    /* Servers behind the same link share it, repeated or not */
+    unsigned int other_side[] = {5, 6, 6, 2};
+    CHECK(network_downstream(net, other_side, 4, -1, hops) == 1);
+    CHECK(hops[0] == 0);
+    CHECK(network_downstream(net, other_side, 4, 0, hops) == 0);
+
+    /* This server and unknown servers need no link */
+    unsigned int nowhere[] = {1, NT_SERVERS, 1000};
+    CHECK(network_downstream(net, nowhere, 3, -1, hops) == 0);
+    network_free(net);
+
+    /* A leaf has its parent only */
+    net = load_as(path, 6);
+    CHECK(network_downstream(net, all, NT_SERVERS, -1, hops) == 1);
+    CHECK(hops[0] == 2);
+    CHECK(network_downstream(net, all, NT_SERVERS, 2, hops) == 0);
+    network_free(net);
+}
+
+
+static void test_uid_round_trip(void)
+{
+    const uint64_t uids[] = {
+        uid_make(0, 0),
+        uid_make(0, 1),
+        uid_make(1, 123456),
+        uid_make(35, 36),
+        uid_make(36, 0xFFFFFFFF),
+        uid_make(NETWORK_MAX_SERVERS - 1, 0x80000000),
+    };
+    char buf[UID_STR_LEN + 1];
+    uint64_t uid;
+
+    for (size_t i = 0; i < sizeof(uids) / sizeof(uids[0]); i++)
+    {
+        uid_encode(uids[i], buf);
+        CHECK(strlen(buf) == UID_STR_LEN);
+        CHECK(uid_decode(buf, &uid) == CHIRC_OK);
+        CHECK(uid == uids[i]);
+    }
+
+    uid_encode(uid_make(0, 0), buf);
+    CHECK(!strcmp(buf, "000000000"));
+    uid_encode(uid_make(NETWORK_MAX_SERVERS - 1, 35), buf);
+    CHECK(!strcmp(buf, "ZZ000000Z"));
+    CHECK(uid_server(uid_make(NETWORK_MAX_SERVERS - 1, 35)) == NETWORK_MAX_SERVERS - 1);
+}
+
+
+static void test_uid_invalid(void)
+{
+    const char *invalid[] = {
+        "",
+        "00000000",     /* Too short */
+        "0000000000",   /* Too long */
+        "00000000a",    /* Lower case */
+        "0000-0000",
+        "0000 0000",
+        "00ZZZZZZZ",    /* Counter past 32 bits */
+        "001Z141Z4",    /* 2^32, the smallest counter past 32 bits */
+    };
+    uint64_t uid = 42;
+
+    for (size_t i = 0; i < sizeof(invalid) / sizeof(invalid[0]); i++)
+    {
+        CHECK(uid_decode(invalid[i], &uid) == CHIRC_ERROR);
+        CHECK(uid == 42);
+    }
+
+    /* The largest counter is still valid */
+    CHECK(uid_decode("001Z141Z3", &uid) == CHIRC_OK);
+    CHECK(uid == uid_make(0, 0xFFFFFFFF));
+}
+
+
+int main(void)
+{
+    chirc_setloglevel(QUIET);
+
+    char *path = write_network();
+    test_next_hop(path);
+    test_downstream(path);
+    test_uid_round_trip();
+    test_uid_invalid();
+    unlink(path);
+
+    printf("network: all checks passed\n");
+    return EXIT_SUCCESS;
+}
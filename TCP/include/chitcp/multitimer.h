@@ -56,7 +56,6 @@
 
 /* Forward declarations */
 typedef struct single_timer single_timer_t;
-typedef struct active_timer active_timer_t;
 typedef struct multi_timer multi_timer_t;
 
 /* Function pointer typedef for timer callback function
@@ -99,52 +98,34 @@ typedef struct single_timer
     /* Timeout spec */
     struct timespec *timeout_spec;
 
-} single_timer_t;
-
-
-/*  linked list of active timers */
-typedef struct active_timer
-{
-    /* currrnt timer */
-    single_timer_t* timer;
-
-    /* Timeout spec */
-    struct timespec timeout_spec;
+    /* Multitimer the timer belongs to */
+    multi_timer_t *mt;
 
-    /* next active timer */
-    active_timer_t* next;
-    
-    /* previous active timer */
-    active_timer_t* prev;
-} active_timer_t;
+    /* Deadline on CLOCK_MONOTONIC, in nanoseconds, while active */
+    uint64_t expires;
 
+    /* Timing wheel list the timer is in (see timerwheel.h),
+     * protected by the wheel lock */
+    single_timer_t **slot;
+    single_timer_t *next;
+    single_timer_t *prev;
 
-/* Arguments struct for multitimer thread */
-typedef struct worker_args
-{
-    multi_timer_t *mt;
-} worker_args_t;
+} single_timer_t;
 
 
-/* A multitimer */
+/* A multitimer. Its timers are driven by the timing wheel shared
+ * by all the multitimers (see timerwheel.h) */
 typedef struct multi_timer
 {
-    /* Thread identifier */
-    pthread_t mt_thread;
-    pthread_mutex_t mt_lock;
-    pthread_cond_t mt_cond;
-
     /* number of timers */
     uint16_t num_timers;
 
     /* all timers */
     single_timer_t **timers;
 
-    /* the active timer */
-    active_timer_t* active_timers;
-
-    /* Is the multitimer active? */
-    bool active;
+    /* Set by mt_free; the timers can no longer be set once it is,
+     * protected by the wheel lock */
+    bool dying;
 
 } multi_timer_t;
 
@@ -163,7 +144,7 @@ typedef struct multi_timer
  *  - CHITCP_OK: multitimer created successfully
  *  - CHITCP_ENOMEM: Could not allocate memory for multitimer
  *  - CHITCP_EINIT: Could not initialize some part of the multitimer
- *  - CHITCP_ETHREAD: Could not create multitimer thread
+ *  - CHITCP_ETHREAD: Could not start the timing wheel thread
  */
 int mt_init(multi_timer_t *mt, uint16_t num_timers);
 
@@ -171,7 +152,7 @@ int mt_init(multi_timer_t *mt, uint16_t num_timers);
 /*
  * mt_free - Frees the multitimer
  *
- * Stops the multitimer thread and frees all resources
+ * Cancels the active timers and frees all resources
  * used by the multitimer
  *
  * mt: Multitimer
@@ -223,7 +204,8 @@ int mt_get_timer_by_id(multi_timer_t *mt, uint16_t id, single_timer_t **timer);
   * Returns:
  *  - CHITCP_OK: timer set correctly
  *  - CHITCP_EINVAL: Invalid timer identifier, or specified a timer
- *                   that is already active
+ *                   that is already active, or the multitimer is
+ *                   being freed
  */
 int mt_set_timer(multi_timer_t *mt, uint16_t id, uint64_t timeout, mt_callback_func callback, void* callback_args);
 
@@ -0,0 +1,136 @@
+/*
+ *  chiTCP - A simple, testable TCP stack
+ *
+ *  A timing wheel shared by all the multitimers
+ *
+ */
+
+/*
+ *  Copyright (c) 2013-2019, The University of Chicago
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are met:
+ *
+ *  - Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ *  - Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ *  - Neither the name of The University of Chicago nor the names of its
+ *    contributors may be used to endorse or promote products derived from this
+ *    software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ *  AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ *  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ *  ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ *  LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ *  CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ *  SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ *  INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ *  CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ *  ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ *  POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#ifndef TIMERWHEEL_H_
+#define TIMERWHEEL_H_
+
+#include <stdint.h>
+#include "chitcp/multitimer.h"
+
+/*
+ * The timers of every multitimer in the process are kept in a single
+ * hierarchical timing wheel, driven by one thread, instead of a sorted
+ * list and a thread per multitimer. Deadlines are on CLOCK_MONOTONIC.
+ *
+ * The wheel has TW_LEVELS levels of TW_SLOTS slots. A slot of level 0
+ * holds the timers expiring in one tick of TW_TICK ns, a slot of level n
+ * the timers expiring in TW_SLOTS^n ticks, which are moved to the level
+ * below when the wheel reaches them. Setting and cancelling a timer is
+ * O(1): it is linked into, or out of, the list of a slot. The thread
+ * sleeps until the next tick that has timers to fire or to move down.
+ *
+ * A timer fires on the first tick that starts at or after its deadline,
+ * so at most one tick late. Timers further away than the wheel spans
+ * are kept in its last slot, and placed again when they are moved down.
+ */
+
+#define TW_TICK_SHIFT (17)                   /* A tick is 2^17 ns, about 131 us */
+#define TW_TICK (1L << TW_TICK_SHIFT)
+#define TW_SLOT_BITS (6)
+#define TW_SLOTS (1 << TW_SLOT_BITS)
+#define TW_LEVELS (4)                        /* 2^24 ticks, about 36 minutes */
+
+
+/*
+ * tw_init - Starts the timing wheel thread, if it is not running yet
+ *
+ * Returns:
+ *  - CHITCP_OK: the wheel is running
+ *  - CHITCP_ETHREAD: Could not create the wheel thread
+ */
+int tw_init(void);
+
+
+/*
+ * tw_set - Sets a timer on the wheel
+ *
+ * timer: Timer (must not be active)
+ *
+ * timeout: Timeout in nanoseconds
+ *
+ * callback_fn, callback_args: Callback function and its parameters,
+ *          called from the wheel thread (without holding any lock of
+ *          the wheel) when the timer expires.
+ *
+ * Returns:
+ *  - CHITCP_OK: timer set correctly
+ *  - CHITCP_EINVAL: the timer is already active, or its multitimer
+ *          is being freed
+ */
+int tw_set(single_timer_t *timer, uint64_t timeout, mt_callback_func callback_fn, void *callback_args);
+
+
+/*
+ * tw_cancel - Takes a timer off the wheel
+ *
+ * timer: Timer
+ *
+ * Returns:
+ *  - CHITCP_OK: timer cancelled
+ *  - CHITCP_EINVAL: the timer is not active
+ */
+int tw_cancel(single_timer_t *timer);
+
+
+/*
+ * tw_cancel_all - Takes all the timers of a multitimer off the wheel for good
+ *
+ * Waits for a callback of one of them that is running to return (unless
+ * called from that callback) before cancelling them, and makes tw_set
+ * refuse to set them again, so no timer of the multitimer is left on the
+ * wheel when it returns.
+ *
+ * mt: Multitimer
+ *
+ * Returns: nothing
+ */
+void tw_cancel_all(multi_timer_t *mt);
+
+
+/*
+ * tw_remaining - Time left until a timer expires
+ *
+ * timer: Timer
+ *
+ * Returns: nanoseconds until the timer expires, 0 if it is not active
+ *          or has passed its deadline
+ */
+uint64_t tw_remaining(single_timer_t *timer);
+
+#endif /* TIMERWHEEL_H_ */
@@ -0,0 +1,163 @@
+/*
+ *  chiTCP - A simple, testable TCP stack
+ *
+ *  Sets the RETRANSMISSION and PERSIST timers of many multitimers, as
+ *  chitcpd does for every socket, and reports the threads that takes
+ *  and what setting, cancelling and firing the timers costs.
+ *
+ *  Usage: multitimer-scale [NUM_SOCKETS]   (10000 by default)
+ *
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdatomic.h>
+
+#include "chitcp/multitimer.h"
+
+#define RETRANSMISSION (0)
+#define PERSIST (1)
+
+/* Timeouts are spread over 200ms-1s, like RTOs */
+#define MIN_TIMEOUT (200 * MILLISECOND)
+#define TIMEOUT_SPREAD (800 * MILLISECOND)
+
+struct fired
+{
+    struct timespec deadline;
+    uint64_t late;
+};
+
+static atomic_uint_fast64_t num_fired;
+static atomic_uint_fast64_t max_late;
+
+uint64_t now_ns(struct timespec *ts)
+{
+    clock_gettime(CLOCK_REALTIME, ts);
+    return ts->tv_sec * SECOND + ts->tv_nsec;
+}
+
+void callback_func(multi_timer_t *mt, single_timer_t *timer, void *args)
+{
+    struct fired *f = args;
+    struct timespec ts, diff;
+
+    now_ns(&ts);
+    if (timespec_subtract(&diff, &ts, &f->deadline) == 0)
+    {
+        f->late = diff.tv_sec * SECOND + diff.tv_nsec;
+    }
+    uint64_t late = f->late;
+    uint64_t max = atomic_load(&max_late);
+    while (late > max && !atomic_compare_exchange_weak(&max_late, &max, late))
+        ;
+    atomic_fetch_add(&num_fired, 1);
+}
+
+/* Threads of this process, from /proc/self/status */
+int num_threads()
+{
+    char line[256];
+    int threads = -1;
+    FILE *f = fopen("/proc/self/status", "r");
+
+    if (f == NULL)
+    {
+        return -1;
+    }
+    while (fgets(line, sizeof(line), f) != NULL)
+    {
+        if (sscanf(line, "Threads: %d", &threads) == 1)
+        {
+            break;
+        }
+    }
+    fclose(f);
+
+    return threads;
+}
+
+int main(int argc, char *argv[])
+{
+    int num_sockets = argc > 1 ? atoi(argv[1]) : 10000;
+    multi_timer_t *mts = calloc(num_sockets, sizeof(multi_timer_t));
+    struct fired *fired = calloc(num_sockets, sizeof(struct fired));
+    struct timespec ts;
+    uint64_t start, elapsed, late_sum = 0;
+    int threads, cancelled = 0;
+
+    chitcp_setloglevel(ERROR);
+    srand(1);
+
+    start = now_ns(&ts);
+    for (int i = 0; i < num_sockets; i++)
+    {
+        if (mt_init(&mts[i], 2) != CHITCP_OK)
+        {
+            fprintf(stderr, "mt_init failed after %d multitimers\n", i);
+            return 1;
+        }
+        mt_set_timer_name(&mts[i], RETRANSMISSION, "RETRANSMISSION");
+        mt_set_timer_name(&mts[i], PERSIST, "PERSIST");
+    }
+    elapsed = now_ns(&ts) - start;
+    threads = num_threads();
+    printf("%d multitimers: %d threads, mt_init %.0f ns each\n",
+           num_sockets, threads, (double) elapsed / num_sockets);
+
+    /* Set the RETRANSMISSION timers, and a PERSIST timer on every other socket */
+    start = now_ns(&ts);
+    for (int i = 0; i < num_sockets; i++)
+    {
+        uint64_t timeout = MIN_TIMEOUT + (uint64_t) rand() % TIMEOUT_SPREAD;
+
+        now_ns(&fired[i].deadline);
+        fired[i].deadline.tv_nsec += timeout;
+        fired[i].deadline.tv_sec += fired[i].deadline.tv_nsec / SECOND;
+        fired[i].deadline.tv_nsec %= SECOND;
+        mt_set_timer(&mts[i], RETRANSMISSION, timeout, callback_func, &fired[i]);
+        mt_set_timer(&mts[i], PERSIST, 10 * SECOND, NULL, NULL);
+    }
+    elapsed = now_ns(&ts) - start;
+    printf("mt_set_timer: %.0f ns each\n", (double) elapsed / (2 * num_sockets));
+
+    /* Cancel the PERSIST timers and one RETRANSMISSION timer in four,
+     * as an ACK does */
+    start = now_ns(&ts);
+    for (int i = 0; i < num_sockets; i++)
+    {
+        mt_cancel_timer(&mts[i], PERSIST);
+        if (i % 4 == 0)
+        {
+            mt_cancel_timer(&mts[i], RETRANSMISSION);
+            cancelled++;
+        }
+    }
+    elapsed = now_ns(&ts) - start;
+    printf("mt_cancel_timer: %.0f ns each\n", (double) elapsed / (num_sockets + cancelled));
+
+    sleep(2);
+
+    for (int i = 0; i < num_sockets; i++)
+    {
+        late_sum += fired[i].late;
+    }
+    printf("%lu/%d timers fired, %.0f us late on average, %.0f us at most\n",
+           (unsigned long) atomic_load(&num_fired), num_sockets - cancelled,
+           atomic_load(&num_fired) ? (double) late_sum / atomic_load(&num_fired) / MICROSECOND : 0.0,
+           (double) atomic_load(&max_late) / MICROSECOND);
+
+    start = now_ns(&ts);
+    for (int i = 0; i < num_sockets; i++)
+    {
+        mt_free(&mts[i]);
+    }
+    elapsed = now_ns(&ts) - start;
+    printf("mt_free: %.0f ns each\n", (double) elapsed / num_sockets);
+
+    free(mts);
+    free(fired);
+
+    return 0;
+}
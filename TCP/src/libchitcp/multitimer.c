@@ -43,109 +43,9 @@
 #include <errno.h>
 #include "chitcp/utils.h"
 #include "chitcp/multitimer.h"
+#include "chitcp/timerwheel.h"
 #include "chitcp/log.h"
 
-/*
- * delete_timer - Delete an timer from the list of active timer
- *
- * id: id of timer to be deleted
- *
- * mt: head of list to remove timer from
- *
- * Returns: nothing
- */
-void delete_timer(multi_timer_t *mt, uint16_t id)
-{
-    /* no active timer */
-    if (mt->active_timers == NULL)
-    {
-        return;
-    }
-    active_timer_t *elt;
-    DL_FOREACH(mt->active_timers, elt)
-    {
-        if (elt->timer->id == id)
-        {
-            break;
-        }
-    }
-    DL_DELETE(mt->active_timers, elt);
-    free(elt);
-    return;
-}
-
-/* Normalize Timespec to let the tv_nsec of timespec less than SECOND
- *
- * ts: timespec
- *
- * Returns: nothing
- */
-void timespec_normalize(struct timespec *ts)
-{
-    ts->tv_sec += ((ts->tv_nsec) / SECOND);
-    ts->tv_nsec = ((ts->tv_nsec) % SECOND);
-}
-
-/* helper function to create multitimer thread
- *
- * args: multitimer arguments
- *
- * Returns: nothing
- */
-void *mt_handler_func(void *args)
-{
-    multi_timer_t *mt = (multi_timer_t *)args;
-    int rc;
-    struct timespec ts, temp;
-
-    pthread_mutex_lock(&mt->mt_lock);
-    mt->active = true;
-
-    clock_gettime(CLOCK_REALTIME, &ts);
-    timespec_normalize(&ts);
-
-    while (mt->active)
-    {
-        rc = pthread_cond_timedwait(&mt->mt_cond, &mt->mt_lock, &ts);
-
-        clock_gettime(CLOCK_REALTIME, &ts);
-
-        if (rc == ETIMEDOUT)
-        {
-            clock_gettime(CLOCK_REALTIME, &ts);
-            while (mt->active_timers &&
-                   timespec_subtract(&temp, &mt->active_timers->timeout_spec, &ts))
-            {
-                mt->active_timers->timer->num_timeouts += 1;
-                mt->active_timers->timer->active = false;
-                mt->active_timers->timer->callback_fn(mt, mt->active_timers->timer,
-                                                      mt->active_timers->timer->callback_args);
-
-                delete_timer(mt, mt->active_timers->timer->id);
-            }
-        }
-        if (mt->active_timers != NULL)
-        {
-            ts.tv_sec = mt->active_timers->timeout_spec.tv_sec;
-            ts.tv_nsec = mt->active_timers->timeout_spec.tv_nsec;
-
-            /* Normalize Timespec */
-            if (ts.tv_nsec > SECOND)
-            {
-                clock_gettime(CLOCK_REALTIME, &ts);
-                timespec_normalize(&ts);
-            }
-        }
-        else
-        {
-            clock_gettime(CLOCK_REALTIME, &ts);
-            timespec_normalize(&ts);
-        }
-    }
-    pthread_mutex_unlock(&mt->mt_lock);
-    pthread_exit(NULL);
-}
-
 /* See multitimer.h */
 int timespec_subtract(struct timespec *result, struct timespec *x, struct timespec *y)
 {
@@ -179,6 +79,13 @@ int timespec_subtract(struct timespec *result, struct timespec *x, struct timesp
 /* See multitimer.h */
 int mt_init(multi_timer_t *mt, uint16_t num_timers)
 {
+    /* The timers are driven by the shared timing wheel,
+     * so there is no thread to create here */
+    if (tw_init() != CHITCP_OK)
+    {
+        return CHITCP_ETHREAD;
+    }
+
     mt->timers = (single_timer_t **)calloc(1, sizeof(single_timer_t *) * num_timers);
     if (mt->timers == NULL)
     {
@@ -186,6 +93,7 @@ int mt_init(multi_timer_t *mt, uint16_t num_timers)
     }
 
     mt->num_timers = num_timers;
+    mt->dying = false;
 
     for (int id = 0; id < num_timers; id++)
     {
@@ -200,16 +108,7 @@ int mt_init(multi_timer_t *mt, uint16_t num_timers)
         mt->timers[id]->num_timeouts = 0;
         mt->timers[id]->callback_fn = NULL;
         mt->timers[id]->callback_args = NULL;
-    }
-
-    pthread_mutex_init(&mt->mt_lock, NULL);
-    pthread_cond_init(&mt->mt_cond, NULL);
-    mt->active_timers = NULL;
-
-    if (pthread_create(&mt->mt_thread, NULL, mt_handler_func, mt) != 0)
-    {
-        mt_free(mt);
-        return CHITCP_ETHREAD;
+        mt->timers[id]->mt = mt;
     }
 
     return CHITCP_OK;
@@ -218,35 +117,16 @@ int mt_init(multi_timer_t *mt, uint16_t num_timers)
 /* See multitimer.h */
 int mt_free(multi_timer_t *mt)
 {
-    while (1)
-    {
-        if (mt->active)
-        {
-            mt->active = false;
-            pthread_mutex_lock(&mt->mt_lock);
-            pthread_cond_signal(&mt->mt_cond);
-            pthread_mutex_unlock(&mt->mt_lock);
-
-            /* Free single timers, active timers, and lastly multitimer */
-            active_timer_t *at;
-            DL_FOREACH(mt->active_timers, at)
-            {
-                DL_DELETE(mt->active_timers, at);
-                free(at);
-            }
-            for (int i = 0; i < mt->num_timers; i++)
-            {
-                free(mt->timers[i]);
-            }
-            free(mt->timers);
-
-            pthread_join(mt->mt_thread, NULL);
-            pthread_mutex_destroy(&mt->mt_lock);
-            pthread_cond_destroy(&mt->mt_cond);
+    /* Take the timers off the wheel before freeing them */
+    tw_cancel_all(mt);
 
-            return CHITCP_OK;
-        }
+    for (int i = 0; i < mt->num_timers; i++)
+    {
+        free(mt->timers[i]);
     }
+    free(mt->timers);
+
+    return CHITCP_OK;
 }
 
 /* See multitimer.h */
@@ -262,71 +142,18 @@ int mt_get_timer_by_id(multi_timer_t *mt, uint16_t id, single_timer_t **timer)
 
     return CHITCP_OK;
 }
-int timeoutcmp(active_timer_t *a, active_timer_t *b)
-{
-    struct timespec first = a->timeout_spec;
-    struct timespec second = b->timeout_spec;
-    if (first.tv_sec > second.tv_sec)
-    {
-        return 1;
-    }
-    else if (first.tv_sec < second.tv_sec)
-    {
-        return -1;
-    }
-    else
-    {
-        if (first.tv_nsec > second.tv_nsec)
-        {
-            return 1;
-        }
-        else if (first.tv_nsec < second.tv_nsec)
-        {
-            return -1;
-        }
-        else
-        {
-            return 0;
-        }
-    }
-}
 
 /* See multitimer.h */
 int mt_set_timer(multi_timer_t *mt, uint16_t id, uint64_t timeout, mt_callback_func callback_fn, void *callback_args)
 {
-    struct timespec temp;
     if (id >= mt->num_timers || id < 0)
     {
         // invalid id
         return CHITCP_EINVAL;
     }
-    active_timer_t *elt;
-    DL_FOREACH(mt->active_timers, elt)
-    {
-        if (elt->timer->id == id)
-        {
-            return CHITCP_EINVAL;
-        }
-    }
-    mt->timers[id]->active = true;
-    mt->timers[id]->callback_fn = callback_fn;
-    mt->timers[id]->callback_args = callback_args;
-
-    active_timer_t *temp_timer = (active_timer_t *)calloc(1, sizeof(active_timer_t));
-    temp_timer->timer = mt->timers[id];
 
-    /* update the timeout spec of the timer */
-    clock_gettime(CLOCK_REALTIME, &temp_timer->timeout_spec);
-    temp_timer->timeout_spec.tv_nsec += timeout;
-    timespec_normalize(&temp_timer->timeout_spec);
-
-    DL_APPEND(mt->active_timers, temp_timer);
-    DL_SORT(mt->active_timers, timeoutcmp);
-    pthread_mutex_lock(&mt->mt_lock);
-    pthread_cond_signal(&mt->mt_cond);
-    pthread_mutex_unlock(&mt->mt_lock);
-
-    return CHITCP_OK;
+    /* CHITCP_EINVAL if the timer is already active */
+    return tw_set(mt->timers[id], timeout, callback_fn, callback_args);
 }
 
 /* See multitimer.h */
@@ -337,26 +164,9 @@ int mt_cancel_timer(multi_timer_t *mt, uint16_t id)
         // invalid id
         return CHITCP_EINVAL;
     }
-    while (1)
-    {
-        if (mt->active)
-        {
-            if (!mt->timers[id]->active)
-            {
-                return CHITCP_EINVAL;
-            }
-            else
-            {
-                mt->timers[id]->active = false;
-                delete_timer(mt, id);
-                pthread_mutex_lock(&mt->mt_lock);
-                pthread_cond_signal(&mt->mt_cond);
-                pthread_mutex_unlock(&mt->mt_lock);
 
-                return CHITCP_OK;
-            }
-        }
-    }
+    /* CHITCP_EINVAL if the timer is not active */
+    return tw_cancel(mt->timers[id]);
 }
 
 /* See multitimer.h */
@@ -381,16 +191,14 @@ int mt_set_timer_name(multi_timer_t *mt, uint16_t id, const char *name)
  */
 int mt_chilog_single_timer(loglevel_t level, single_timer_t *timer)
 {
-    struct timespec now, diff;
-    clock_gettime(CLOCK_REALTIME, &now);
+    struct timespec diff;
 
     if (timer->active)
     {
-        /* Compute the appropriate value for "diff" here; it should contain
-         * the time remaining until the timer times out.
-         * Note: The timespec_subtract function can come in handy here*/
-        diff.tv_sec = 0;
-        diff.tv_nsec = 0;
+        /* Time remaining until the timer times out */
+        uint64_t remaining = tw_remaining(timer);
+        diff.tv_sec = remaining / SECOND;
+        diff.tv_nsec = remaining % SECOND;
         chilog(level, "%i %s %lis %lins", timer->id, timer->name, diff.tv_sec, diff.tv_nsec);
     }
     else
@@ -402,7 +210,13 @@ int mt_chilog_single_timer(loglevel_t level, single_timer_t *timer)
 /* See multitimer.h */
 int mt_chilog(loglevel_t level, multi_timer_t *mt, bool active_only)
 {
-    /* Your code here */
+    for (int i = 0; i < mt->num_timers; i++)
+    {
+        if (!active_only || mt->timers[i]->active)
+        {
+            mt_chilog_single_timer(level, mt->timers[i]);
+        }
+    }
 
     return CHITCP_OK;
 }
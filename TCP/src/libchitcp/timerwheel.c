@@ -0,0 +1,447 @@
+/*
+ *  chiTCP - A simple, testable TCP stack
+ *
+ *  A timing wheel shared by all the multitimers
+ */
+
+/*
+ *  Copyright (c) 2013-2019, The University of Chicago
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are met:
+ *
+ *  - Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ *  - Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ *  - Neither the name of The University of Chicago nor the names of its
+ *    contributors may be used to endorse or promote products derived from this
+ *    software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ *  AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ *  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ *  ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ *  LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ *  CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ *  SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ *  INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ *  CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ *  ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ *  POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <time.h>
+#include <pthread.h>
+#include "chitcp/types.h"
+#include "chitcp/utlist.h"
+#include "chitcp/log.h"
+#include "chitcp/multitimer.h"
+#include "chitcp/timerwheel.h"
+
+#define TW_NEVER (UINT64_MAX)
+
+/* The timing wheel. All its fields, and the active, num_timeouts,
+ * callback and wheel fields of the timers, are protected by lock. */
+static struct timer_wheel
+{
+    pthread_t thread;
+    pthread_mutex_t lock;
+
+    /* Signalled when a timer is set to expire before the wheel wakes up */
+    pthread_cond_t wakeup;
+
+    /* Signalled when a callback returns */
+    pthread_cond_t returned;
+
+    /* Next tick to go through; all the earlier ones have been */
+    uint64_t now;
+
+    /* Tick the thread sleeps until, TW_NEVER if it sleeps until woken */
+    uint64_t wake;
+
+    /* Number of active timers */
+    uint64_t count;
+
+    /* Timers of each slot, and a bit per non-empty slot */
+    single_timer_t *slots[TW_LEVELS][TW_SLOTS];
+    uint64_t occupied[TW_LEVELS];
+
+    /* Timers past their deadline, waiting for their callback to be called */
+    single_timer_t *expired;
+
+    /* Timer whose callback is running, if any */
+    single_timer_t *running;
+} wheel;
+
+static pthread_once_t wheel_once = PTHREAD_ONCE_INIT;
+static int wheel_rc = CHITCP_ETHREAD;
+
+
+/* Current CLOCK_MONOTONIC time, in nanoseconds */
+static uint64_t monotonic_ns()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * SECOND + ts.tv_nsec;
+}
+
+
+/* Links a timer into its list, and marks the list non-empty */
+static void slot_add(single_timer_t *timer, int level, int idx)
+{
+    timer->slot = &wheel.slots[level][idx];
+    DL_APPEND(wheel.slots[level][idx], timer);
+    wheel.occupied[level] |= 1ULL << idx;
+}
+
+
+/* Unlinks a timer from the list it is in */
+static void slot_remove(single_timer_t *timer)
+{
+    single_timer_t **slot = timer->slot;
+
+    DL_DELETE(*slot, timer);
+    timer->slot = NULL;
+
+    if (*slot == NULL && slot != &wheel.expired)
+    {
+        int i = slot - &wheel.slots[0][0];
+        wheel.occupied[i / TW_SLOTS] &= ~(1ULL << (i % TW_SLOTS));
+    }
+}
+
+
+/*
+ * wheel_insert - Places a timer in the slot of its deadline
+ *
+ * Same placement as the classic Linux timer wheel: the level is given by
+ * how far the deadline is from the wheel, and the slot by the bits of the
+ * deadline tick for that level, so that the slot is reached, and moved to
+ * the level below, before the deadline.
+ */
+static void wheel_insert(single_timer_t *timer)
+{
+    uint64_t tick = (timer->expires + TW_TICK - 1) >> TW_TICK_SHIFT;
+    uint64_t delta;
+    int level;
+
+    if (tick < wheel.now)
+    {
+        tick = wheel.now;
+    }
+    delta = tick - wheel.now;
+
+    for (level = 0; level < TW_LEVELS - 1; level++)
+    {
+        if (delta < 1ULL << (TW_SLOT_BITS * (level + 1)))
+        {
+            break;
+        }
+    }
+    if (delta >= 1ULL << (TW_SLOT_BITS * TW_LEVELS))
+    {
+        /* Beyond the wheel, kept in its last slot until it gets closer */
+        tick = wheel.now + (1ULL << (TW_SLOT_BITS * TW_LEVELS)) - 1;
+    }
+
+    slot_add(timer, level, (tick >> (TW_SLOT_BITS * level)) & (TW_SLOTS - 1));
+}
+
+
+/* Next tick, from wheel.now on, that has timers to fire or to move down */
+static uint64_t wheel_next_tick()
+{
+    uint64_t next = TW_NEVER;
+
+    for (int level = 0; level < TW_LEVELS; level++)
+    {
+        if (wheel.occupied[level] == 0)
+        {
+            continue;
+        }
+
+        int shift = TW_SLOT_BITS * level;
+        uint64_t base = wheel.now >> shift;
+        int idx = base & (TW_SLOTS - 1);
+
+        /* The slot of wheel.now on level 0, and on the other levels when
+         * wheel.now starts it, has not been gone through yet */
+        bool pending = (wheel.now & ((1ULL << shift) - 1)) == 0;
+        int from = pending ? idx : idx + 1;
+        uint64_t later = from < TW_SLOTS ? wheel.occupied[level] >> from << from : 0;
+        int slot = __builtin_ctzll(later ? later : wheel.occupied[level]);
+        uint64_t ahead = (uint64_t) ((slot - idx) & (TW_SLOTS - 1));
+
+        if (ahead == 0 && !pending)
+        {
+            ahead = TW_SLOTS;
+        }
+
+        uint64_t tick = (base + ahead) << shift;
+        if (tick < next)
+        {
+            next = tick;
+        }
+    }
+
+    return next;
+}
+
+
+/* Goes through one tick: moves down the slots it reaches, and moves the
+ * timers of its level 0 slot to the expired list */
+static void wheel_tick()
+{
+    single_timer_t *timer, *tmp;
+
+    for (int level = 1; level < TW_LEVELS; level++)
+    {
+        int shift = TW_SLOT_BITS * level;
+
+        if (wheel.now & ((1ULL << shift) - 1))
+        {
+            break;
+        }
+
+        int idx = (wheel.now >> shift) & (TW_SLOTS - 1);
+        single_timer_t *cascade = wheel.slots[level][idx];
+
+        wheel.slots[level][idx] = NULL;
+        wheel.occupied[level] &= ~(1ULL << idx);
+        DL_FOREACH_SAFE(cascade, timer, tmp)
+        {
+            DL_DELETE(cascade, timer);
+            wheel_insert(timer);
+        }
+    }
+
+    int idx = wheel.now & (TW_SLOTS - 1);
+    DL_FOREACH_SAFE(wheel.slots[0][idx], timer, tmp)
+    {
+        slot_remove(timer);
+        timer->slot = &wheel.expired;
+        DL_APPEND(wheel.expired, timer);
+    }
+}
+
+
+/* Goes through all the ticks up to the current one, skipping the ones
+ * with nothing to do */
+static void wheel_advance(uint64_t now_tick)
+{
+    while (wheel.now <= now_tick)
+    {
+        uint64_t next = wheel_next_tick();
+
+        if (next > now_tick)
+        {
+            wheel.now = now_tick + 1;
+            break;
+        }
+        wheel.now = next;
+        wheel_tick();
+        wheel.now++;
+    }
+}
+
+
+/* Thread function of the wheel */
+static void *wheel_thread_func(void *args)
+{
+    struct timespec ts;
+
+    pthread_mutex_lock(&wheel.lock);
+    while (true)
+    {
+        uint64_t now_tick = monotonic_ns() >> TW_TICK_SHIFT;
+
+        wheel_advance(now_tick);
+
+        /* Callbacks are called without the lock, so they can set timers */
+        while (wheel.expired != NULL)
+        {
+            single_timer_t *timer = wheel.expired;
+            multi_timer_t *mt = timer->mt;
+            mt_callback_func callback_fn = timer->callback_fn;
+            void *callback_args = timer->callback_args;
+
+            slot_remove(timer);
+            timer->active = false;
+            timer->num_timeouts += 1;
+            wheel.count--;
+
+            if (callback_fn != NULL)
+            {
+                wheel.running = timer;
+                pthread_mutex_unlock(&wheel.lock);
+                callback_fn(mt, timer, callback_args);
+                pthread_mutex_lock(&wheel.lock);
+                wheel.running = NULL;
+                pthread_cond_broadcast(&wheel.returned);
+            }
+        }
+
+        wheel.wake = wheel_next_tick();
+        if (wheel.wake == TW_NEVER)
+        {
+            pthread_cond_wait(&wheel.wakeup, &wheel.lock);
+        }
+        else if (wheel.wake > now_tick)
+        {
+            uint64_t wake_ns = wheel.wake << TW_TICK_SHIFT;
+
+            ts.tv_sec = wake_ns / SECOND;
+            ts.tv_nsec = wake_ns % SECOND;
+            pthread_cond_timedwait(&wheel.wakeup, &wheel.lock, &ts);
+        }
+    }
+
+    return NULL;
+}
+
+
+/* pthread_once function starting the wheel */
+static void wheel_start()
+{
+    pthread_condattr_t attr;
+
+    pthread_mutex_init(&wheel.lock, NULL);
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&wheel.wakeup, &attr);
+    pthread_condattr_destroy(&attr);
+    pthread_cond_init(&wheel.returned, NULL);
+
+    wheel.now = monotonic_ns() >> TW_TICK_SHIFT;
+    wheel.wake = TW_NEVER;
+
+    if (pthread_create(&wheel.thread, NULL, wheel_thread_func, NULL) != 0)
+    {
+        chilog(CRITICAL, "Could not create timing wheel thread");
+        return;
+    }
+    pthread_detach(wheel.thread);
+    wheel_rc = CHITCP_OK;
+}
+
+
+/* See timerwheel.h */
+int tw_init(void)
+{
+    pthread_once(&wheel_once, wheel_start);
+
+    return wheel_rc;
+}
+
+
+/* See timerwheel.h */
+int tw_set(single_timer_t *timer, uint64_t timeout, mt_callback_func callback_fn, void *callback_args)
+{
+    uint64_t now = monotonic_ns();
+
+    pthread_mutex_lock(&wheel.lock);
+    if (timer->active || timer->mt->dying)
+    {
+        pthread_mutex_unlock(&wheel.lock);
+        return CHITCP_EINVAL;
+    }
+
+    if (wheel.count++ == 0)
+    {
+        /* The wheel may have slept for long; start it from now */
+        wheel.now = now >> TW_TICK_SHIFT;
+    }
+
+    timer->active = true;
+    timer->callback_fn = callback_fn;
+    timer->callback_args = callback_args;
+    timer->expires = now + timeout;
+    wheel_insert(timer);
+
+    /* Wake the thread up if it sleeps past the new deadline */
+    if ((timer->expires + TW_TICK - 1) >> TW_TICK_SHIFT < wheel.wake)
+    {
+        wheel.wake = 0;
+        pthread_cond_signal(&wheel.wakeup);
+    }
+    pthread_mutex_unlock(&wheel.lock);
+
+    return CHITCP_OK;
+}
+
+
+/* Takes an active timer off the wheel, with the lock held */
+static void wheel_cancel(single_timer_t *timer)
+{
+    slot_remove(timer);
+    timer->active = false;
+    wheel.count--;
+}
+
+
+/* See timerwheel.h */
+int tw_cancel(single_timer_t *timer)
+{
+    pthread_mutex_lock(&wheel.lock);
+    if (!timer->active)
+    {
+        pthread_mutex_unlock(&wheel.lock);
+        return CHITCP_EINVAL;
+    }
+    wheel_cancel(timer);
+    pthread_mutex_unlock(&wheel.lock);
+
+    /* The thread is not woken up; if it was to wake up for this timer,
+     * it finds nothing to do and goes back to sleep */
+    return CHITCP_OK;
+}
+
+
+/* See timerwheel.h */
+void tw_cancel_all(multi_timer_t *mt)
+{
+    pthread_mutex_lock(&wheel.lock);
+
+    /* A running callback may set a timer again until it returns,
+     * so wait for it first, and keep anything else from doing so */
+    mt->dying = true;
+    while (wheel.running != NULL && wheel.running->mt == mt &&
+           !pthread_equal(pthread_self(), wheel.thread))
+    {
+        pthread_cond_wait(&wheel.returned, &wheel.lock);
+    }
+    for (int i = 0; i < mt->num_timers; i++)
+    {
+        if (mt->timers[i]->active)
+        {
+            wheel_cancel(mt->timers[i]);
+        }
+    }
+    pthread_mutex_unlock(&wheel.lock);
+}
+
+
+/* See timerwheel.h */
+uint64_t tw_remaining(single_timer_t *timer)
+{
+    uint64_t now = monotonic_ns();
+    uint64_t remaining = 0;
+
+    pthread_mutex_lock(&wheel.lock);
+    if (timer->active && timer->expires > now)
+    {
+        remaining = timer->expires - now;
+    }
+    pthread_mutex_unlock(&wheel.lock);
+
+    return remaining;
+}
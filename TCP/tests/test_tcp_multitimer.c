@@ -724,3 +724,127 @@ Test(multitimer, set_multiple_timer_all_reverse_cancel_test_timing, .init = log_
     cr_assert_eq(rc, CHITCP_OK);
 }
 
+
+
+/* Sets one timer in each of many multitimers, which share the timing wheel,
+ * and a timer from the callback of another one, and tests that they all
+ * fired at the correct time */
+#define NUM_MULTITIMERS (100)
+
+struct callback_args *reset_args;
+
+void reset_callback(multi_timer_t *mt, single_timer_t *timer, void *args)
+{
+    timing_callback(mt, timer, args);
+    mt_set_timer(mt, timer->id + 1, 50*MILLISECOND, timing_callback, reset_args);
+}
+
+Test(multitimer, set_timers_many_multitimers_test_timing, .init = log_setup, .timeout = 2.0)
+{
+    multi_timer_t *mts = calloc(NUM_MULTITIMERS, sizeof(multi_timer_t));
+    single_timer_t *timer;
+    struct timespec start_time;
+    int rc;
+
+    struct timespec *timeouts = calloc(NUM_MULTITIMERS + 1, sizeof(struct timespec));
+    struct callback_args *args = calloc(NUM_MULTITIMERS + 1, sizeof(struct callback_args));
+
+    for(int i=0; i < NUM_MULTITIMERS + 1; i++)
+    {
+        args[i].timeouts = timeouts;
+        args[i].idx = i;
+    }
+    reset_args = &args[NUM_MULTITIMERS];
+
+    clock_gettime(CLOCK_REALTIME, &start_time);
+
+    for(int i=0; i < NUM_MULTITIMERS; i++)
+    {
+        rc = mt_init(&mts[i], 2);
+        cr_assert_eq(rc, CHITCP_OK);
+
+        rc = mt_set_timer(&mts[i], 0, 50*MILLISECOND, i == 0 ? reset_callback : timing_callback, &args[i]);
+        cr_assert_eq(rc, CHITCP_OK);
+    }
+
+    usleep(150*USLEEP_MILLISECOND);
+
+    for(int i=0; i < NUM_MULTITIMERS; i++)
+    {
+        rc = mt_get_timer_by_id(&mts[i], 0, &timer);
+        cr_assert_eq(rc, CHITCP_OK);
+        cr_assert_eq(timer->active, false);
+        cr_assert_eq(timer->num_timeouts, 1);
+
+        check_timer_timeout(&start_time, &timeouts[i], 50*MILLISECOND);
+    }
+
+    /* The timer set from the callback */
+    rc = mt_get_timer_by_id(&mts[0], 1, &timer);
+    cr_assert_eq(rc, CHITCP_OK);
+    cr_assert_eq(timer->active, false);
+    cr_assert_eq(timer->num_timeouts, 1);
+
+    check_timer_timeout(&start_time, &timeouts[NUM_MULTITIMERS], 100*MILLISECOND);
+
+    for(int i=0; i < NUM_MULTITIMERS; i++)
+    {
+        rc = mt_free(&mts[i]);
+        cr_assert_eq(rc, CHITCP_OK);
+    }
+}
+
+
+/* Frees a multitimer while the callback of one of its timers is running
+ * and sets that same timer again, and tests that no callback runs after
+ * mt_free has returned */
+#define NUM_FREE_ROUNDS (20)
+
+struct rearm_args
+{
+    volatile bool entered;
+    volatile int calls;
+};
+
+void rearm_callback(multi_timer_t *mt, single_timer_t *timer, void *args)
+{
+    struct rearm_args *rearm = (struct rearm_args *) args;
+
+    rearm->calls++;
+    rearm->entered = true;
+    usleep(5*USLEEP_MILLISECOND);
+    mt_set_timer(mt, timer->id, 1*MILLISECOND, rearm_callback, args);
+}
+
+Test(multitimer, free_while_callback_sets_timer, .init = log_setup, .timeout = 5.0)
+{
+    struct rearm_args args;
+    int rc;
+
+    for(int i=0; i < NUM_FREE_ROUNDS; i++)
+    {
+        multi_timer_t *mt = calloc(1, sizeof(multi_timer_t));
+
+        args.entered = false;
+        args.calls = 0;
+
+        rc = mt_init(mt, NUM_TIMERS);
+        cr_assert_eq(rc, CHITCP_OK);
+
+        rc = mt_set_timer(mt, TIMER_IDX, 1*MILLISECOND, rearm_callback, &args);
+        cr_assert_eq(rc, CHITCP_OK);
+
+        while (!args.entered)
+        {
+            usleep(100);
+        }
+
+        rc = mt_free(mt);
+        cr_assert_eq(rc, CHITCP_OK);
+        free(mt);
+
+        int calls = args.calls;
+        usleep(20*USLEEP_MILLISECOND);
+        cr_assert_eq(args.calls, calls, "A callback ran after mt_free returned");
+    }
+}